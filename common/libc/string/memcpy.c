@@ -47,39 +47,55 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For speedy copying, if both pointers have the same alignment
+	 * within a word, copy bytes until they're word-aligned, then
+	 * copy words, four at a time while there's room, then finish
+	 * the tail by bytes. If they're aligned differently, there's no
+	 * portable way to use word accesses, so copy by bytes.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if ((uintptr_t)d % sizeof(long) == (uintptr_t)s % sizeof(long)) {
+		long *ld;
+		const long *ls;
 
-		long *d = dst;
-		const long *s = src;
+		while (len > 0 && (uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		ld = (long *)d;
+		ls = (const long *)s;
+		while (len >= 4*sizeof(long)) {
+			ld[0] = ls[0];
+			ld[1] = ls[1];
+			ld[2] = ls[2];
+			ld[3] = ls[3];
+			ld += 4;
+			ls += 4;
+			len -= 4*sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*ld++ = *ls++;
+			len -= sizeof(long);
 		}
+		d = (char *)ld;
+		s = (const char *)ls;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
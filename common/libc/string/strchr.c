@@ -36,8 +36,10 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
+#include <kern/strword.h>
 
 /*
  * C standard string function: find leftmost instance of a character
@@ -48,6 +50,28 @@ strchr(const char *s, int ch_arg)
 {
 	/* avoid sign-extension problems */
 	const char ch = ch_arg;
+	const unsigned long *w;
+	unsigned long chs;
+
+	/*
+	 * Scan bytes up to a word boundary, then skip whole words
+	 * that have neither the 0 nor CH in them.
+	 */
+	while (!STRWORD_ALIGNED(s)) {
+		if (*s == ch) {
+			return (char *)s;
+		}
+		if (*s == 0) {
+			return NULL;
+		}
+		s++;
+	}
+	chs = STRWORD_REPEAT(ch);
+	for (w = (const unsigned long *)s;
+	     !STRWORD_HASZERO(*w) && !STRWORD_HASZERO(*w ^ chs); w++) {
+		/* nothing */
+	}
+	s = (const char *)w;
 
 	/* scan from left to right */
 	while (*s) {
@@ -36,8 +36,10 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
+#include <kern/strword.h>
 
 /*
  * Standard C string function: compare two strings and return their
@@ -49,6 +51,33 @@ strcmp(const char *a, const char *b)
 {
 	size_t i;
 
+	/*
+	 * If the strings are aligned alike, skip ahead a word at a
+	 * time over the part where they match and A hasn't ended;
+	 * then the byte loop below finds exactly where they part.
+	 */
+	if ((uintptr_t)a % sizeof(long) == (uintptr_t)b % sizeof(long)) {
+		const unsigned long *wa, *wb;
+
+		while (!STRWORD_ALIGNED(a)) {
+			if (*a == 0 || *a != *b) {
+				break;
+			}
+			a++;
+			b++;
+		}
+		if (STRWORD_ALIGNED(a)) {
+			wa = (const unsigned long *)a;
+			wb = (const unsigned long *)b;
+			while (*wa == *wb && !STRWORD_HASZERO(*wa)) {
+				wa++;
+				wb++;
+			}
+			a = (const char *)wa;
+			b = (const char *)wb;
+		}
+	}
+
 	/*
 	 * Walk down both strings until either they're different
 	 * or we hit the end of A.
@@ -36,8 +36,10 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
+#include <kern/strword.h>
 
 /*
  * Standard C string function: copy one string to another.
@@ -45,12 +47,35 @@
 char *
 strcpy(char *dest, const char *src)
 {
-	size_t i;
+	size_t i = 0;
+
+	/*
+	 * If both are aligned alike, copy bytes up to a word boundary,
+	 * then whole words until the one with the null terminator in
+	 * it, which is finished off by bytes.
+	 */
+	if ((uintptr_t)dest % sizeof(long) == (uintptr_t)src % sizeof(long)) {
+		unsigned long *wd;
+		const unsigned long *ws;
+
+		while (!STRWORD_ALIGNED(src + i) && src[i]) {
+			dest[i] = src[i];
+			i++;
+		}
+		if (STRWORD_ALIGNED(src + i)) {
+			wd = (unsigned long *)(dest + i);
+			ws = (const unsigned long *)(src + i);
+			while (!STRWORD_HASZERO(*ws)) {
+				*wd++ = *ws++;
+			}
+			i = (const char *)ws - src;
+		}
+	}
 
 	/*
 	 * Copy characters until we hit the null terminator.
 	 */
-	for (i=0; src[i]; i++) {
+	for (; src[i]; i++) {
 		dest[i] = src[i];
 	}
 
@@ -36,8 +36,10 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
+#include <kern/strword.h>
 
 /*
  * C standard string function: get length of a string
@@ -46,10 +48,21 @@
 size_t
 strlen(const char *str)
 {
-	size_t ret = 0;
+	const char *s = str;
+	const unsigned long *w;
 
-	while (str[ret]) {
-		ret++;
+	/* Bytes up to a word boundary, then words until one has the 0 */
+	while (!STRWORD_ALIGNED(s)) {
+		if (*s == 0) {
+			return s - str;
+		}
+		s++;
 	}
-	return ret;
+	for (w = (const unsigned long *)s; !STRWORD_HASZERO(*w); w++) {
+		/* nothing */
+	}
+	for (s = (const char *)w; *s; s++) {
+		/* nothing */
+	}
+	return s - str;
 }
@@ -0,0 +1,48 @@
+#ifndef _MIPS_KCLOCK_H_
+#define _MIPS_KCLOCK_H_
+
+/*
+ * Raw access to the on-chip cycle counter for <kclock.h>.
+ *
+ * On System/161 c0_count goes back to zero whenever it reaches
+ * c0_compare (and when the timer is restarted); the timer interrupt
+ * it raises shows in c0_cause until c0_compare is written again.
+ */
+
+#ifndef KCLOCK_INLINE
+#define KCLOCK_INLINE INLINE
+#endif
+
+#define MIPS_CAUSE_TIMER  0x00008000	/* on-chip timer interrupt pending */
+
+uint32_t kclock_readcount(void);
+bool kclock_timerpending(void);
+
+KCLOCK_INLINE
+uint32_t
+kclock_readcount(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+KCLOCK_INLINE
+bool
+kclock_timerpending(void)
+{
+	uint32_t cause;
+
+	/* $13 == c0_cause */
+	__asm volatile("mfc0 %0, $13" : "=r" (cause));
+	return (cause & MIPS_CAUSE_TIMER) != 0;
+}
+
+#endif /* _MIPS_KCLOCK_H_ */
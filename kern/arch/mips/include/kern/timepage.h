@@ -0,0 +1,13 @@
+#ifndef _KERN_MIPS_TIMEPAGE_H_
+#define _KERN_MIPS_TIMEPAGE_H_
+
+/*
+ * Where the time page is mapped: the last page of user space, just
+ * above the stack.
+ *
+ * This file should only be included via <kern/timepage.h>.
+ */
+#define TIMEPAGE_VADDR  0x7ffff000
+
+
+#endif /* _KERN_MIPS_TIMEPAGE_H_ */
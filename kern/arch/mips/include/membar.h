@@ -0,0 +1,37 @@
+#ifndef _MIPS_MEMBAR_H_
+#define _MIPS_MEMBAR_H_
+
+/*
+ * On MIPS every kind of barrier is the same instruction. (System/161
+ * keeps memory sequentially consistent anyway; the sync there, and the
+ * "memory" clobber, are what stop the compiler moving accesses past.)
+ */
+
+#ifndef MEMBAR_INLINE
+#define MEMBAR_INLINE INLINE
+#endif
+
+void membar_any_any(void);
+void membar_load_load(void);
+void membar_store_store(void);
+void membar_load_any(void);
+void membar_any_store(void);
+
+MEMBAR_INLINE
+void
+membar_any_any(void)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		"sync;"
+		".set pop"		/* restore assembler mode */
+		::: "memory");
+}
+
+MEMBAR_INLINE void membar_load_load(void) { membar_any_any(); }
+MEMBAR_INLINE void membar_store_store(void) { membar_any_any(); }
+MEMBAR_INLINE void membar_load_any(void) { membar_any_any(); }
+MEMBAR_INLINE void membar_any_store(void) { membar_any_any(); }
+
+#endif /* _MIPS_MEMBAR_H_ */
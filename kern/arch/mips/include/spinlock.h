@@ -43,6 +43,12 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_fetchadd(volatile spinlock_data_t *sd,
+				       unsigned val);
+spinlock_data_t spinlock_data_swap(volatile spinlock_data_t *sd,
+				   spinlock_data_t val);
+bool spinlock_data_cas(volatile spinlock_data_t *sd,
+		       spinlock_data_t old, spinlock_data_t new);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +99,79 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * The rest retry the LL/SC until the SC goes through, since unlike
+ * test-and-set they can't pretend a failure was an answer. Each
+ * returns (or compares against) the value the SC replaced.
+ */
+
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchadd(volatile spinlock_data_t *sd, unsigned val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set reorder;"		/* let the assembler fill delay slots */
+		"1: ll %0, 0(%3);"	/*   x = *sd */
+		"addu %1, %0, %2;"	/*   y = x + val */
+		"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   again if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (val), "r" (sd) : "memory");
+	return x;
+}
+
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_swap(volatile spinlock_data_t *sd, spinlock_data_t val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set reorder;"		/* let the assembler fill delay slots */
+		"1: ll %0, 0(%3);"	/*   x = *sd */
+		"move %1, %2;"		/*   y = val */
+		"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   again if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (val), "r" (sd) : "memory");
+	return x;
+}
+
+SPINLOCK_INLINE
+bool
+spinlock_data_cas(volatile spinlock_data_t *sd,
+		  spinlock_data_t old, spinlock_data_t new)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set reorder;"		/* let the assembler fill delay slots */
+		"1: ll %0, 0(%4);"	/*   x = *sd */
+		"move %1, $0;"		/*   y = 0 (no store) */
+		"bne %0, %2, 2f;"	/*   done if x != old */
+		"move %1, %3;"		/*   y = new */
+		"sc %1, 0(%4);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   again if it failed */
+		"2:;"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (old), "r" (new), "r" (sd)
+		: "memory");
+	return y != 0;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
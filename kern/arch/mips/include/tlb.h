@@ -41,6 +41,11 @@
  *
  *   tlb_write: same as tlb_random, but you choose the slot.
  *
+ *   tlb_setasid: load ASID into the PID field of ENTRYHI, which is
+ *        what the processor matches user translations against. All
+ *        of the other operations here clobber ENTRYHI, so this must be
+ *        called again after them before touching user memory.
+ *
  *   tlb_read: read a TLB entry out of the TLB into ENTRYHI and ENTRYLO.
  *        INDEX specifies which one to get.
  *
@@ -56,6 +61,7 @@
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
+void tlb_setasid(uint32_t asid);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
@@ -63,10 +69,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID. dumbvm
+ * doesn't use it and leaves TLBHI_PID zero; smartvm tags user entries
+ * with one (see NUM_ASID). TLBLO_GLOBAL matches whatever the current
+ * ASID is; smartvm uses it for kernel mappings in kseg2. The bits that
+ * aren't assigned a meaning can be left always zero.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,14 +85,15 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
 #define TLBLO_NOCACHE 0x00000800
 #define TLBLO_DIRTY   0x00000400
 #define TLBLO_VALID   0x00000200
-/*      TLBLO_GLOBAL  0x00000100 */
+#define TLBLO_GLOBAL  0x00000100
 
 /*
  * Values for completely invalid TLB entries. The TLB entry index should
@@ -101,5 +109,10 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of distinct address space IDs the TLB can tag entries with.
+ */
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_TLB_H_ */
@@ -30,6 +30,7 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <kern/machine/timepage.h>	/* for TIMEPAGE_VADDR */
 
 /*
  * Machine-dependent VM system definitions.
@@ -81,9 +82,10 @@
  * address after the stack area.
  *
  * We put the stack at the very top of user virtual memory because it
- * grows downwards.
+ * grows downwards; the only thing above it is the time page (see
+ * <kern/timepage.h>).
  */
-#define USERSTACK     USERSPACETOP
+#define USERSTACK     TIMEPAGE_VADDR
 
 /*
  * Interface to the low-level module that looks after the amount of
@@ -121,5 +123,11 @@ struct tlbshootdown {
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-cpu page directory read by the fast-path TLB refill
+ * (exception-mips1.S); indexed by cpu number. 0 disables it.
+ */
+extern vaddr_t cpu_utlbdir[];
+
 
 #endif /* _MIPS_VM_H_ */
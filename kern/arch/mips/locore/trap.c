@@ -36,8 +36,10 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
+#include <softint.h>
 #include <syscall.h>
 
 
@@ -105,13 +107,9 @@ static void kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr) {
 		break;
 	}
 
-	/*
-	 * You will probably want to change this.
-	 */
-
 	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
 		code, sig, trapcodenames[code], epc, vaddr);
-	panic("I don't know how to handle this\n");
+	sys__exit_sig(sig);
 }
 
 /*
@@ -122,6 +120,7 @@ static void kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr) {
 void mips_trap(struct trapframe *tf) {
 	uint32_t code;
 	bool isutlb, iskern;
+	unsigned timestate;
 	int spl;
 
 	/* The trap frame is supposed to be 37 registers long. */
@@ -177,7 +176,18 @@ void mips_trap(struct trapframe *tf) {
 			doadjust = false;
 		}
 
+		timestate = cpu_timeswitch(CPUTIME_INTR);
 		mainbus_interrupt(tf);
+		if (doadjust) {
+			/*
+			 * We interrupted something that had interrupts
+			 * on, so the bottom halves can have them on too.
+			 */
+			softint_run(IPL_NONE);
+			/* Something woken may outrank what we interrupted */
+			thread_preempt();
+		}
+		cpu_timeswitch(timestate);
 
 		if (doadjust) {
 			KASSERT(curthread->t_curspl == IPL_HIGH);
@@ -190,6 +200,13 @@ void mips_trap(struct trapframe *tf) {
 		goto done2;
 	}
 
+	/*
+	 * Time from here on is the kernel's, until we return. (Do this
+	 * first, while we're still on the cpu the trap came in on.)
+	 */
+	timestate = cpu_timeswitch(iskern ? curcpu->c_timestate :
+				   CPUTIME_KERNEL);
+
 	/*
 	 * The processor turned interrupts off when it took the trap.
 	 *
@@ -309,6 +326,12 @@ void mips_trap(struct trapframe *tf) {
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/* Before going back to user mode, give way to anything we woke */
+	if (!iskern) {
+		thread_preempt();
+	}
+	cpu_timeswitch(timestate);
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -326,6 +349,20 @@ void mips_trap(struct trapframe *tf) {
 		return;
 	}
 
+	/*
+	 * If another thread in our process is exiting, or the OOM
+	 * killer picked the process, don't go back to user mode. Get
+	 * interrupts back on first (as above), since leaving the
+	 * process can sleep.
+	 */
+	if (!iskern && curproc != NULL &&
+	    (curproc->p_exiting || curproc->p_oomkilled)) {
+		splhigh();
+		spl0();
+		uthread_checkexit();
+		cpu_irqoff();
+	}
+
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
 	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
 
@@ -366,6 +403,7 @@ void mips_usermode(struct trapframe *tf) {
 	 * be on. To interact properly with the spl-handling logic
 	 * above, we explicitly call spl0() and then call cpu_irqoff().
 	 */
+	cpu_timeswitch(CPUTIME_USER);
 	spl0();
 	cpu_irqoff();
 
@@ -38,8 +38,588 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <trace.h>
+#include "opt-net.h"
 
 
+/*
+ * System call handlers.
+ *
+ * Each one unpacks its arguments from the trapframe, calls the
+ * sys_* function that does the work, and returns 0 or an error
+ * code; a return value, if any, goes in *retval. They are found
+ * through syscall_table below, indexed by call number.
+ */
+
+typedef int (*syscall_handler_t)(struct trapframe *tf, int32_t *retval);
+
+static int sc_reboot(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_reboot(tf->tf_a0);
+}
+
+static int sc_time(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static int sc_nanosleep(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_nanosleep((const_userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static int sc_cputimes(struct trapframe *tf, int32_t *retval) {
+	return sys_cputimes((int)tf->tf_a0, (userptr_t)tf->tf_a1, retval);
+}
+
+static int sc_vmstats(struct trapframe *tf, int32_t *retval) {
+	return sys_vmstats((userptr_t)tf->tf_a0, retval);
+}
+
+static int sc_utrace(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_utrace((unsigned)tf->tf_a0, (unsigned)tf->tf_a1);
+}
+
+#ifdef UW
+static int sc_open(struct trapframe *tf, int32_t *retval) {
+	return sys_open((const_userptr_t)tf->tf_a0, (int)tf->tf_a1,
+		(mode_t)tf->tf_a2, retval);
+}
+
+static int sc_close(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_close((int)tf->tf_a0);
+}
+
+static int sc_read(struct trapframe *tf, int32_t *retval) {
+	return sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, retval);
+}
+
+static int sc_write(struct trapframe *tf, int32_t *retval) {
+	return sys_write((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, retval);
+}
+
+static int sc_pread(struct trapframe *tf, int32_t *retval) {
+	// The 64-bit offset can't go in a3, so it's on the user stack
+	off_t offset;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &offset, sizeof(offset));
+	if (err) {
+		return err;
+	}
+	return sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, offset, retval);
+}
+
+static int sc_pwrite(struct trapframe *tf, int32_t *retval) {
+	off_t offset;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &offset, sizeof(offset));
+	if (err) {
+		return err;
+	}
+	return sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, offset, retval);
+}
+
+static int sc_getdirentry(struct trapframe *tf, int32_t *retval) {
+	return sys_getdirentry((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, retval);
+}
+
+static int sc_getdirentries(struct trapframe *tf, int32_t *retval) {
+	return sys_getdirentries((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, retval);
+}
+
+static int sc_readv(struct trapframe *tf, int32_t *retval) {
+	return sys_readv((int)tf->tf_a0, (const_userptr_t)tf->tf_a1,
+		(int)tf->tf_a2, retval);
+}
+
+static int sc_writev(struct trapframe *tf, int32_t *retval) {
+	return sys_writev((int)tf->tf_a0, (const_userptr_t)tf->tf_a1,
+		(int)tf->tf_a2, retval);
+}
+
+static int sc_lseek(struct trapframe *tf, int32_t *retval) {
+	// The 64-bit offset is in the aligned pair a2/a3, whence is on the
+	// user stack, and the 64-bit result goes back in v0/v1
+	off_t pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+	off_t newpos;
+	int whence;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &whence, sizeof(whence));
+	if (err) {
+		return err;
+	}
+	err = sys_lseek((int)tf->tf_a0, pos, whence, &newpos);
+	if (err) {
+		return err;
+	}
+	*retval = (int32_t)(newpos >> 32);
+	tf->tf_v1 = (uint32_t)newpos;
+	return 0;
+}
+
+static int sc_dup2(struct trapframe *tf, int32_t *retval) {
+	return sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, retval);
+}
+
+static int sc_fstat(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_fstat((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static int sc_fallocate(struct trapframe *tf, int32_t *retval) {
+	// The 64-bit offset is in the aligned pair a2/a3, the length is on
+	// the user stack
+	off_t pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+	off_t len;
+	int err;
+
+	(void)retval;
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &len, sizeof(len));
+	if (err) {
+		return err;
+	}
+	return sys_fallocate((int)tf->tf_a0, pos, len);
+}
+
+static int sc_posix_fadvise(struct trapframe *tf, int32_t *retval) {
+	// As with fallocate, but the hint comes after the length
+	off_t pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+	off_t len;
+	int advice;
+	int err;
+
+	(void)retval;
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &len, sizeof(len));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 24), &advice, sizeof(advice));
+	if (err) {
+		return err;
+	}
+	return sys_posix_fadvise((int)tf->tf_a0, pos, len, advice);
+}
+
+static int sc_sync_file_range(struct trapframe *tf, int32_t *retval) {
+	// Laid out as for posix_fadvise
+	off_t pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+	off_t len;
+	unsigned flags;
+	int err;
+
+	(void)retval;
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &len, sizeof(len));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 24), &flags, sizeof(flags));
+	if (err) {
+		return err;
+	}
+	return sys_sync_file_range((int)tf->tf_a0, pos, len, flags);
+}
+
+static int sc_copy_file_range(struct trapframe *tf, int32_t *retval) {
+	// The length and flags are on the user stack
+	size_t len;
+	unsigned flags;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &len, sizeof(len));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 20), &flags, sizeof(flags));
+	if (err) {
+		return err;
+	}
+	return sys_copy_file_range((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(int)tf->tf_a2, (userptr_t)tf->tf_a3, len, flags, retval);
+}
+
+static int sc_ioctl(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_ioctl((int)tf->tf_a0, (int)tf->tf_a1, (userptr_t)tf->tf_a2);
+}
+
+static int sc_pipe(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_pipe((userptr_t)tf->tf_a0);
+}
+
+static int sc_ioring_setup(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_ioring_setup((userptr_t)tf->tf_a0);
+}
+
+static int sc_ioring_enter(struct trapframe *tf, int32_t *retval) {
+	return sys_ioring_enter((unsigned)tf->tf_a0, (unsigned)tf->tf_a1,
+		retval);
+}
+
+#if OPT_NET
+static int sc_socket(struct trapframe *tf, int32_t *retval) {
+	return sys_socket((int)tf->tf_a0, (int)tf->tf_a1, (int)tf->tf_a2,
+		retval);
+}
+
+static int sc_bind(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_bind((int)tf->tf_a0, (const_userptr_t)tf->tf_a1,
+		(socklen_t)tf->tf_a2);
+}
+
+static int sc_sendto(struct trapframe *tf, int32_t *retval) {
+	// the address and its length are the fifth and sixth arguments,
+	// on the user stack
+	userptr_t addr;
+	socklen_t addrlen;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &addr, sizeof(addr));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 20), &addrlen,
+		sizeof(addrlen));
+	if (err) {
+		return err;
+	}
+	return sys_sendto((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, (int)tf->tf_a3, (const_userptr_t)addr,
+		addrlen, retval);
+}
+
+static int sc_recvfrom(struct trapframe *tf, int32_t *retval) {
+	// as for sendto
+	userptr_t addr, addrlen;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &addr, sizeof(addr));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 20), &addrlen,
+		sizeof(addrlen));
+	if (err) {
+		return err;
+	}
+	return sys_recvfrom((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(size_t)tf->tf_a2, (int)tf->tf_a3, addr, addrlen, retval);
+}
+#endif
+
+static int sc_remove(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_remove((const_userptr_t)tf->tf_a0);
+}
+
+static int sc_exit(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	sys__exit((int)tf->tf_a0);
+	/* sys__exit does not return, execution should not get here */
+	panic("unexpected return from sys__exit");
+	return 0;
+}
+
+static int sc_fork(struct trapframe *tf, int32_t *retval) {
+	// Returns the child's PID in retval
+	DEBUG(DB_SYSCALL, "sys_fork called by process with ID %d\n", curproc->p_id);
+	return sys_fork(tf, (pid_t *)retval);
+}
+
+static int sc_vfork(struct trapframe *tf, int32_t *retval) {
+	return sys_vfork(tf, (pid_t *)retval);
+}
+
+static int sc_getpid(struct trapframe *tf, int32_t *retval) {
+	(void)tf;
+	return sys_getpid((pid_t *)retval);
+}
+
+static int sc_waitpid(struct trapframe *tf, int32_t *retval) {
+	return sys_waitpid((pid_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+		(int)tf->tf_a2, (pid_t *)retval);
+}
+
+static int sc_execv(struct trapframe *tf, int32_t *retval) {
+	return sys_execv((const_userptr_t)tf->tf_a0,
+		(const_userptr_t *)tf->tf_a1, retval);
+}
+
+static int sc_sbrk(struct trapframe *tf, int32_t *retval) {
+	return sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)retval);
+}
+
+static int sc_threadfork(struct trapframe *tf, int32_t *retval) {
+	return sys_threadfork((vaddr_t)tf->tf_a0, (vaddr_t)tf->tf_a1,
+		(vaddr_t)tf->tf_a2, (int *)retval);
+}
+
+static int sc_threadexit(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	sys_threadexit((int)tf->tf_a0);
+	/* sys_threadexit does not return either */
+	panic("unexpected return from sys_threadexit");
+	return 0;
+}
+
+static int sc_threadjoin(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_threadjoin((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static int sc_setaffinity(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_setaffinity((unsigned)tf->tf_a0);
+}
+
+static int sc_getaffinity(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_getaffinity((userptr_t)tf->tf_a0);
+}
+
+static int sc_setnice(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_setnice((pid_t)tf->tf_a0, (int)tf->tf_a1);
+}
+
+static int sc_getnice(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_getnice((pid_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static int sc_sched_setscheduler(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_sched_setscheduler((int)tf->tf_a0, (int)tf->tf_a1);
+}
+
+static int sc_sched_getscheduler(struct trapframe *tf, int32_t *retval) {
+	return sys_sched_getscheduler((userptr_t)tf->tf_a0, retval);
+}
+
+static int sc_ioprio_set(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_ioprio_set((int)tf->tf_a0);
+}
+
+static int sc_ioprio_get(struct trapframe *tf, int32_t *retval) {
+	(void)tf;
+	return sys_ioprio_get(retval);
+}
+
+static int sc_getrusage(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static int sc_futex_wait(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_futex_wait((userptr_t)tf->tf_a0, (int)tf->tf_a1);
+}
+
+static int sc_futex_wake(struct trapframe *tf, int32_t *retval) {
+	return sys_futex_wake((userptr_t)tf->tf_a0, (int)tf->tf_a1, retval);
+}
+
+static int sc_mmap(struct trapframe *tf, int32_t *retval) {
+	// fd is the fifth argument, on the user stack, and the 64-bit
+	// offset after it is aligned to the next doubleword
+	int fd;
+	off_t offset;
+	int err;
+
+	err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+	if (err) {
+		return err;
+	}
+	err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+	if (err) {
+		return err;
+	}
+	return sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+		(int)tf->tf_a3, fd, offset, (vaddr_t *)retval);
+}
+
+static int sc_munmap(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+}
+
+static int sc_madvise(struct trapframe *tf, int32_t *retval) {
+	(void)retval;
+	return sys_madvise((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+		(int)tf->tf_a2);
+}
+
+static int sc_poll(struct trapframe *tf, int32_t *retval) {
+	return sys_poll((userptr_t)tf->tf_a0, (nfds_t)tf->tf_a1, (int)tf->tf_a2,
+		retval);
+}
+#endif // UW
+
+static const struct {
+	const char *name;
+	syscall_handler_t handler;
+} syscall_table[SYSCALL_NCALLS] = {
+	[SYS_reboot]	= { "reboot",	sc_reboot },
+	[SYS___time]	= { "__time",	sc_time },
+	[SYS_nanosleep]	= { "nanosleep", sc_nanosleep },
+	[SYS_cputimes]	= { "cputimes",	sc_cputimes },
+	[SYS_vmstats]	= { "vmstats",	sc_vmstats },
+	[SYS_utrace]	= { "utrace",	sc_utrace },
+#ifdef UW
+	[SYS_open]	= { "open",	sc_open },
+	[SYS_close]	= { "close",	sc_close },
+	[SYS_read]	= { "read",	sc_read },
+	[SYS_write]	= { "write",	sc_write },
+	[SYS_pread]	= { "pread",	sc_pread },
+	[SYS_pwrite]	= { "pwrite",	sc_pwrite },
+	[SYS_readv]	= { "readv",	sc_readv },
+	[SYS_writev]	= { "writev",	sc_writev },
+	[SYS_lseek]	= { "lseek",	sc_lseek },
+	[SYS_getdirentry] = { "getdirentry", sc_getdirentry },
+	[SYS_getdirentries] = { "getdirentries", sc_getdirentries },
+	[SYS_dup2]	= { "dup2",	sc_dup2 },
+	[SYS_fstat]	= { "fstat",	sc_fstat },
+	[SYS_fallocate]	= { "fallocate", sc_fallocate },
+	[SYS_ioctl]	= { "ioctl",	sc_ioctl },
+	[SYS_pipe]	= { "pipe",	sc_pipe },
+	[SYS_ioring_setup] = { "ioring_setup", sc_ioring_setup },
+	[SYS_ioring_enter] = { "ioring_enter", sc_ioring_enter },
+	[SYS_copy_file_range] = { "copy_file_range", sc_copy_file_range },
+	[SYS_posix_fadvise] = { "posix_fadvise", sc_posix_fadvise },
+	[SYS_sync_file_range] = { "sync_file_range", sc_sync_file_range },
+#if OPT_NET
+	[SYS_socket]	= { "socket",	sc_socket },
+	[SYS_bind]	= { "bind",	sc_bind },
+	[SYS_sendto]	= { "sendto",	sc_sendto },
+	[SYS_recvfrom]	= { "recvfrom",	sc_recvfrom },
+#endif
+	[SYS_remove]	= { "remove",	sc_remove },
+	[SYS__exit]	= { "_exit",	sc_exit },
+	[SYS_fork]	= { "fork",	sc_fork },
+	[SYS_vfork]	= { "vfork",	sc_vfork },
+	[SYS_getpid]	= { "getpid",	sc_getpid },
+	[SYS_waitpid]	= { "waitpid",	sc_waitpid },
+	[SYS_getrusage]	= { "getrusage", sc_getrusage },
+	[SYS_execv]	= { "execv",	sc_execv },
+	[SYS_sbrk]	= { "sbrk",	sc_sbrk },
+	[SYS_threadfork] = { "threadfork", sc_threadfork },
+	[SYS_threadexit] = { "threadexit", sc_threadexit },
+	[SYS_threadjoin] = { "threadjoin", sc_threadjoin },
+	[SYS_futex_wait] = { "futex_wait", sc_futex_wait },
+	[SYS_futex_wake] = { "futex_wake", sc_futex_wake },
+	[SYS_setaffinity] = { "setaffinity", sc_setaffinity },
+	[SYS_getaffinity] = { "getaffinity", sc_getaffinity },
+	[SYS_setnice]	= { "setnice",	sc_setnice },
+	[SYS_getnice]	= { "getnice",	sc_getnice },
+	[SYS_sched_setscheduler] = { "sched_setscheduler",
+				     sc_sched_setscheduler },
+	[SYS_sched_getscheduler] = { "sched_getscheduler",
+				     sc_sched_getscheduler },
+	[SYS_ioprio_set] = { "ioprio_set", sc_ioprio_set },
+	[SYS_ioprio_get] = { "ioprio_get", sc_ioprio_get },
+	[SYS_mmap]	= { "mmap",	sc_mmap },
+	[SYS_munmap]	= { "munmap",	sc_munmap },
+	[SYS_madvise]	= { "madvise",	sc_madvise },
+	[SYS_poll]	= { "poll",	sc_poll },
+#endif // UW
+
+	/* Add stuff here */
+};
+
+/*
+ * Fast system calls.
+ *
+ * A few calls only read a field or two: no locks, no sleeping, and no
+ * user memory. The exception code hands every system call from user
+ * mode to syscall_fast first, with interrupts still off and having
+ * saved only what the C calling convention needs (see fast_syscall in
+ * exception-mips1.S). If CALLNO is one of these, do it, put its result
+ * in *RETVAL and return true, and the exception code goes straight back
+ * to user mode. Otherwise return false and the call takes the full
+ * path through mips_trap and syscall(); so too if anything is waiting
+ * that the way back from mips_trap would deal with.
+ *
+ * These calls can't fail. They are counted in the stats, but not
+ * timed (that would cost more than the call) or traced.
+ */
+
+typedef int32_t (*fastsyscall_handler_t)(void);
+
+#ifdef UW
+static int32_t fsc_getpid(void) {
+	return curproc->p_id;
+}
+#endif // UW
+
+static const fastsyscall_handler_t fastsyscall_table[SYSCALL_NCALLS] = {
+#ifdef UW
+	[SYS_getpid]	= fsc_getpid,
+#endif // UW
+};
+
+bool syscall_fast(int callno, int32_t *retval) {
+	if (callno < 0 || callno >= SYSCALL_NCALLS ||
+	    fastsyscall_table[callno] == NULL) {
+		return false;
+	}
+	if (curproc == NULL || curproc->p_exiting || curproc->p_oomkilled ||
+	    curcpu->c_resched) {
+		return false;
+	}
+
+	*retval = fastsyscall_table[callno]();
+	curthread->t_usage.tu_syscalls++;
+	curcpu->c_syscall_stats[callno].ss_calls++;
+	return true;
+}
+
+/*
+ * Time of day in nanoseconds, for timing system calls.
+ */
+static uint64_t syscall_now(void) {
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Charge a call to CALLNO on whatever cpu we're on now. _exit and
+ * threadexit never get here, since they don't return; they're counted
+ * on the way in.
+ */
+static void syscall_account(int callno, int err, uint64_t nsecs) {
+	struct syscall_stat *ss;
+	int spl;
+
+	spl = splhigh();
+	ss = &curcpu->c_syscall_stats[callno];
+	ss->ss_calls++;
+	if (err) {
+		ss->ss_errors++;
+	}
+	ss->ss_nsecs += nsecs;
+	splx(spl);
+}
+
 /*
  * System call dispatcher.
  *
@@ -82,6 +662,7 @@ void syscall(struct trapframe *tf) {
 	int callno;
 	int32_t retval;
 	int err;
+	uint64_t start;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -100,58 +681,26 @@ void syscall(struct trapframe *tf) {
 
 	retval = 0;
 
-	switch (callno) {
-		case SYS_reboot:
-			err = sys_reboot(tf->tf_a0);
-			break;
+	TRACE(TR_SYSENTER, callno, 0);
+	curthread->t_usage.tu_syscalls++;
 
-		case SYS___time:
-			err = sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
-		break;
+	if (callno < 0 || callno >= SYSCALL_NCALLS ||
+	    syscall_table[callno].handler == NULL) {
+		kprintf("Unknown syscall %d\n", callno);
+		err = ENOSYS;
+	}
 #ifdef UW
-	case SYS_write:
-		err = sys_write(
-			(int)tf->tf_a0,
-			(userptr_t)tf->tf_a1,
-			(int)tf->tf_a2,
-			(int *)(&retval)
-		);
-
-	  break;
-	case SYS__exit:
-		sys__exit((int)tf->tf_a0);
-		/* sys__exit does not return, execution should not get here */
-		panic("unexpected return from sys__exit");
-		break;
-	case SYS_fork:
-		// Process fork will happen here
-		// Set retval to the value of the PID (or whatever was forked)
-		// Returns whether there was an error
-		DEBUG(DB_SYSCALL, "sys_fork called by process with ID %d\n", curproc->p_id);
-		err = sys_fork(tf, (pid_t *)&retval);
-		break;
-	case SYS_getpid:
-		err = sys_getpid((pid_t *)&retval);
-	  break;
-	case SYS_waitpid:
-		err = sys_waitpid((pid_t)tf->tf_a0,
-			(userptr_t)tf->tf_a1,
-			(int)tf->tf_a2,
-			(pid_t *)&retval
-		);
-		break;
-	case SYS_execv:
-		err = sys_execv((const_userptr_t)tf->tf_a0, (const_userptr_t *)tf->tf_a1, &retval);
-		break;
+	else if (callno == SYS__exit || callno == SYS_threadexit) {
+		syscall_account(callno, 0, 0);
+		err = syscall_table[callno].handler(tf, &retval);
+	}
 #endif // UW
-
-	    /* Add stuff here */
-
-	default:
-	  kprintf("Unknown syscall %d\n", callno);
-	  err = ENOSYS;
-	  break;
+	else {
+		start = syscall_now();
+		err = syscall_table[callno].handler(tf, &retval);
+		syscall_account(callno, err, syscall_now() - start);
 	}
+	TRACE(TR_SYSEXIT, callno, err);
 
 
 	if (err) {
@@ -181,6 +730,50 @@ void syscall(struct trapframe *tf) {
 	KASSERT(curthread->t_iplhigh_count == 0);
 }
 
+/*
+ * Print the call count, failures and average time of each system call
+ * that has been made, summed over all cpus.
+ */
+int syscall_getstats(unsigned callno, const char **name,
+		     struct syscall_stat *total) {
+	struct syscall_stat *ss;
+	unsigned j, ncpus;
+
+	if (callno >= SYSCALL_NCALLS || syscall_table[callno].handler == NULL) {
+		return ENOSYS;
+	}
+
+	ncpus = cpu_count();
+	total->ss_calls = 0;
+	total->ss_errors = 0;
+	total->ss_nsecs = 0;
+	for (j = 0; j < ncpus; j++) {
+		ss = &cpu_get(j)->c_syscall_stats[callno];
+		total->ss_calls += ss->ss_calls;
+		total->ss_errors += ss->ss_errors;
+		total->ss_nsecs += ss->ss_nsecs;
+	}
+	*name = syscall_table[callno].name;
+	return 0;
+}
+
+void syscall_printstats(void) {
+	struct syscall_stat total;
+	const char *name;
+	unsigned i;
+
+	kprintf("%-10s %10s %10s %12s %14s\n",
+		"syscall", "calls", "errors", "avg nsecs", "total usecs");
+	for (i = 0; i < SYSCALL_NCALLS; i++) {
+		if (syscall_getstats(i, &name, &total) || total.ss_calls == 0) {
+			continue;
+		}
+		kprintf("%-10s %10u %10u %12llu %14llu\n",
+			name, total.ss_calls, total.ss_errors,
+			total.ss_nsecs / total.ss_calls, total.ss_nsecs / 1000);
+	}
+}
+
 /*
  * Enter user mode for a newly forked process.
  *
@@ -59,6 +59,13 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Page directory for the fast-path TLB refill in exception-mips1.S,
+ * also indexed by CPU number. Set by the VM system in as_activate; 0
+ * means always take the slow path.
+ */
+vaddr_t cpu_utlbdir[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
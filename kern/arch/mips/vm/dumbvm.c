@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define KMTAG KMT_VM
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -37,6 +39,7 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <clock.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -106,6 +109,75 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_textcache_purge(struct vnode *v)
+{
+	/* dumbvm loads executables up front and caches nothing */
+	(void)v;
+}
+
+/*
+ * No page sharing in dumbvm, so pipes always copy.
+ */
+unsigned
+vm_loanpages(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+	     paddr_t *paddrs)
+{
+	(void)as;
+	(void)vaddr;
+	(void)npages;
+	(void)paddrs;
+	return 0;
+}
+
+unsigned
+vm_mappages(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+	    const paddr_t *paddrs)
+{
+	(void)as;
+	(void)vaddr;
+	(void)npages;
+	(void)paddrs;
+	return 0;
+}
+
+void
+vm_unloanpage(paddr_t paddr)
+{
+	/* Nothing is ever lent */
+	(void)paddr;
+	panic("dumbvm: vm_unloanpage\n");
+}
+
+int
+vm_prefault(struct uio *uio)
+{
+	/* No mapped files in dumbvm */
+	(void)uio;
+	return 0;
+}
+
+bool
+vm_kva_force(bool on)
+{
+	/* There's no such fallback here */
+	(void)on;
+	return false;
+}
+
+paddr_t
+vm_getpage(void)
+{
+	return getppages(1);
+}
+
+void
+vm_putpage(paddr_t paddr)
+{
+	/* nothing - leak the memory, as free_kpages does. */
+	(void)paddr;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -114,6 +186,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
+	bool writable;
 	int spl;
 
 	faultaddress &= PAGE_FRAME;
@@ -122,8 +195,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
+		/* Only the time page is read-only, and writing it is an error */
+		return EFAULT;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -169,6 +242,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
+	writable = true;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
@@ -179,6 +253,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (faultaddress == TIMEPAGE_VADDR &&
+		 faulttype == VM_FAULT_READ) {
+		paddr = timepage_paddr();
+		writable = false;
+	}
 	else {
 		return EFAULT;
 	}
@@ -195,7 +274,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			continue;
 		}
 		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		elo = paddr | (writable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
@@ -232,6 +311,13 @@ as_destroy(struct addrspace *as)
 	kfree(as);
 }
 
+void
+as_doom(struct addrspace *as)
+{
+	/* There's nothing here worth putting off */
+	as_destroy(as);
+}
+
 void
 as_activate(void)
 {
@@ -353,6 +439,51 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap region */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t len, off_t offset,
+	bool writable, bool shared, vaddr_t *ret)
+{
+	/* nor any way to map files */
+	(void)as;
+	(void)v;
+	(void)len;
+	(void)offset;
+	(void)writable;
+	(void)shared;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	return ENOSYS;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	/* nothing to tune; hints can always be ignored */
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)advice;
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -27,17 +27,37 @@
  * SUCH DAMAGE.
  */
 
+#define KMTAG KMT_VM
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <pagetable.h>
 #include <syscall.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <filecache.h>
+#include <uw-vmstats.h>
+#include <synch.h>
+#include <thread.h>
+#include <swap.h>
+#include <trace.h>
+#include <clock.h>
+#include <workqueue.h>
+#include <lathist.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -46,8 +66,20 @@
  * assignment, this file is not included in your kernel!
  */
 
-/* under smartvm, always have 48k of user stack */
-#define SMARTVM_STACKPAGES    12
+/*
+ * Under smartvm the user stack may grow to SMARTVM_STACKPAGES pages (1M by
+ * default) below USERSTACK. Pages are only given frames when touched.
+ * The page below the lowest stack page is a guard that is never mapped,
+ * so an overflowing stack faults instead of running into the heap.
+ */
+#ifndef SMARTVM_STACKPAGES
+#define SMARTVM_STACKPAGES    256
+#endif
+#define SMARTVM_STACKBASE     (USERSTACK - SMARTVM_STACKPAGES * PAGE_SIZE)
+#define SMARTVM_STACKGUARD    (SMARTVM_STACKBASE - PAGE_SIZE)
+
+/* mmap offsets and lengths are limited to this many file pages (4G) */
+#define MMAP_MAXPAGES         (1U << 20)
 
 /**
 	A coremap is an array of coremapentry instances
@@ -55,19 +87,355 @@
 	element of coremap will have used == true
 
 	This array is contiguous in memory
+
+	Free pages are managed as a binary buddy system layered on top of the
+	coremap. Every free block of 2^k pages is on the free list for order k,
+	linked through the freenext/freeprev fields of the block's first entry.
+	The buddy of a block at index i of order k is at index i ^ (1 << k).
 */
 static struct coremapentry *coremap = NULL;
 
 static bool coremapsetup = false;
 
-// Is the TLB currently full?
-static bool tlbfull = false;
+// Heads of the per-order free lists (coremap indices, -1 if empty)
+static int freelists[COREMAP_MAXORDER + 1];
+
+// Number of pages currently on the free lists
+static int freepagecount = 0;
+
+// Address spaces by coremap owner index, so a coremap entry can name
+// its owner in a few bits. Slot 0 stays NULL. Protected by stealmem_lock.
+static struct addrspace *coremap_owners[COREMAP_OWNERS];
+static unsigned coremap_ownerhint = 1;
+
+// Clock hand for page replacement (coremap index)
+static int clockhand = 0;
+
+// ASID allocation. ASIDs are handed out in order within a generation;
+// when they run out a new generation starts, and each CPU flushes its
+// TLB the next time it activates an address space. ASID 0 is never
+// given out. asid_lock also covers each address space's as_cpus and
+// each CPU's c_curas; it is taken before any CPU's IPI lock.
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;
+static unsigned asid_next = 1;
+
+// Frames zeroed ahead of time by the vm_zero job on kworkq, so zero-fill
+// faults don't have to clear a page themselves. Protected by
+// stealmem_lock.
+#define ZEROPOOL_MAX    32
+#define ZEROPOOL_LOW    (ZEROPOOL_MAX / 2)
+static paddr_t zeropool[ZEROPOOL_MAX];
+static unsigned zeropool_count = 0;
+static bool zeropool_wanted = false;
+static bool zeropool_ready = false;	// zeropool_work is set up
+static struct work zeropool_work;
+
+// Free memory watermarks. Once taking a user page leaves fewer than
+// shrink_low frames free, the vm_zero job runs the shrinkers (see
+// vm.h) to get back to shrink_high. Protected by stealmem_lock.
+static unsigned shrink_low = 0;
+static unsigned shrink_high = 0;
+static bool shrink_wanted = false;
+
+// One frame of zeros shared read-only (copy-on-write) by every
+// anonymous page that has been read but never written. Holds a
+// reference of its own so it is never freed.
+static paddr_t zeropage = 0;
+
+static paddr_t getkpages(unsigned long npages);
+static void vm_zero_run(void *data);
+static unsigned zeropool_shrink(unsigned npages);
+static unsigned textcache_shrink(unsigned npages);
+
+static struct shrinker zeropool_shrinker = { "vm_zero", zeropool_shrink, NULL };
+static struct shrinker textcache_shrinker = { "textcache", textcache_shrink, NULL };
+
+// Serializes evictions
+static struct lock *evict_lock = NULL;
+
+// Address spaces of exited processes waiting to have their frames freed
+// (see as_doom), newest first through as_reaplink. The as_reap job on
+// kworkq frees REAP_BATCH PTEs' worth at a time and queues itself again
+// while there are any left; the reap shrinker frees them on demand.
+#define REAP_BATCH  64
+#define PT_SLOTS    (PT_DIR_ENTRIES * PT_TABLE_ENTRIES)
+static struct lock *reap_lock = NULL;
+static struct addrspace *reap_list = NULL;
+static struct work reap_work;
+static void as_reap_run(void *data);
+static unsigned reap_shrink(unsigned npages);
+static struct shrinker reap_shrinker = { "as_reap", reap_shrink, NULL };
+static void vm_compact_run(void *data);
+
+// Executable page cache. Frames read in from an executable stay here,
+// keyed by vnode and page address, so the next process running the same
+// program maps the same frame instead of reading the page again: text
+// pages read-only, data pages copy-on-write. Each entry holds a reference
+// to its frame and to its vnode, and is found through a hash on both.
+// Once the cache is full the hand looks for a frame no process maps any
+// more to replace, so a program that is running keeps its text shared
+// with the next exec of it; entries are dropped when the file is opened
+// for writing or its filesystem is unmounted.
+#define TEXTCACHE_SIZE         128
+#define TEXTCACHE_BUCKETS      32
+#define TEXTCACHE_PURGE_BATCH  16
+struct textcache_entry {
+	struct vnode *tc_vnode;		// NULL if the slot is unused
+	vaddr_t tc_vaddr;
+	paddr_t tc_paddr;
+	int tc_next;			// Next in the hash chain, or -1
+};
+static struct textcache_entry textcache[TEXTCACHE_SIZE];
+static int textcache_buckets[TEXTCACHE_BUCKETS];
+static unsigned textcache_hand = 0;
+static struct lock *textcache_lock = NULL;
+
+// Out-of-memory handling (see vm_oom). oom_pages counts the frames each
+// coremap owner has, filled in under oom_lock just before a victim is
+// picked. A fault gives up after OOM_RETRIES tries.
+#define OOM_RETRIES  64
+static struct lock *oom_lock = NULL;
+static unsigned oom_pages[COREMAP_OWNERS];
+
+// Kernel virtual memory in kseg2, for multi-page kernel allocations when
+// there's no physically contiguous run for them. The frames (a chain of
+// runs from getppageid) are mapped page by page, kva_frames[i] backing
+// page i, and loaded into the TLB on demand as global entries by
+// kva_fault. kva_npages is the size of the allocation starting at each
+// page. Freed pages other CPUs may still hold in their TLBs are marked in
+// kva_stale and aren't handed out again until every TLB has been flushed
+// (see kva_flushstale). All protected by kva_lock, which is taken after
+// every other lock.
+#define KVA_PAGES       1024
+#define KVA_WORDS       (KVA_PAGES / 32)
+static struct spinlock kva_lock = SPINLOCK_INITIALIZER;
+static uint32_t kva_used[KVA_WORDS];
+static uint32_t kva_stale[KVA_WORDS];
+static paddr_t kva_frames[KVA_PAGES];
+static uint16_t kva_npages[KVA_PAGES];
+// Set by vm_kva_force, for tests: every multi-page allocation goes to kseg2
+static volatile bool kva_forced = false;
+
+// Compaction. When a multi-page kernel allocation finds no free run
+// big enough, compact_alloc builds one: it picks the naturally aligned
+// block of that size whose pages are all either free or private user
+// pages that could be moved (see compact_movable), takes the free ones
+// off the free lists, and moves each user page to a frame elsewhere.
+// A page being moved is marked busy in its PTE and coremap entry, as
+// for eviction, so its owner waits, and shot out of the TLBs before it
+// is copied. The block is then a run of the caller's. Where that can't
+// be done on the spot (spinlocks held, or in an interrupt), the
+// vm_compact job on kworkq frees up a block of the largest size asked
+// for, compact_order, in the background; it gives the block straight
+// back to the buddy system, where the next such allocation finds it.
+// Only blocks up to COMPACT_MAXORDER are built; compact_lock lets one
+// compaction run at a time.
+#define COMPACT_MAXORDER  6
+static struct lock *compact_lock = NULL;
+static struct work compact_work;
+static unsigned compact_order = 0;	// 0 if not wanted; stealmem_lock
+static bool compact_ready = false;	// compact_work is set up
+
+// Mapped files. Each file that some process has mmapped has a mapobj,
+// found by vnode, holding the frames of the pages touched so far (with a
+// reference to each). Every mapping of the file, in any address space,
+// maps these same frames: MAP_SHARED ones directly, so all of them see
+// each other's writes, MAP_PRIVATE ones copy-on-write. The frames have no
+// owner, so the clock never evicts them.
+// If the file system keeps the file in the file page cache (VOP_GETPAGE),
+// the frames are the cache's own pages, pinned for as long as the mapobj
+// lasts and marked MO_CACHED: read and write see the mappings' changes
+// and the mappings see theirs, and the file system writes them back with
+// the rest of the file's data. Otherwise each page is read into a frame
+// of the mapobj's own with VOP_READ; shared pages that have been written
+// are marked MO_DIRTY and written back with VOP_WRITE when a writable
+// shared mapping goes away, and until then read and write on the file
+// don't see them, nor do the mappings see later writes.
+// The file system is never called with mmap_lock (or as_faultlock) held:
+// its locks come first, as a thread in VOP_READ or VOP_WRITE may fault on
+// a mapping. A fault that needs it lets go and has mapobj_readin get the
+// page, then tries again.
+// Anonymous mappings (MAP_ANONYMOUS) have a mapobj of their own, with no
+// vnode, that only the mapping and its copies in forked children use.
+#define MO_DIRTY        0x1	// in mo_pages, below the frame bits
+#define MO_CACHED       0x2	// a file cache page, in mo_cached
+#define MO_BUSY         0x4	// in mapobj_readin; wait on mmap_cv
+struct mapobj {
+	struct vnode *mo_vnode;		// open, and referenced; NULL if anonymous
+	unsigned mo_refcount;		// mmapregions using it
+	paddr_t *mo_pages;		// by file page; 0 until read in
+	struct fcpage **mo_cached;	// the pinned cache pages, if MO_CACHED
+	unsigned mo_npages;
+	struct mapobj *mo_next;
+};
+
+// One mapping in an address space
+struct mmapregion {
+	vaddr_t mr_start;
+	size_t mr_npages;
+	unsigned mr_firstpage;		// file page mapped at mr_start
+	bool mr_writable;
+	bool mr_shared;
+	int mr_advice;			// MADV_NORMAL, _RANDOM or _SEQUENTIAL
+	struct mapobj *mr_obj;
+};
+
+// A fault on a file page not yet read in, in a MADV_SEQUENTIAL mapping,
+// reads this many pages from there on into the file page cache at once
+#define MMAP_RA_PAGES  8
+
+// Room for this many mappings when an address space first maps a file;
+// the table doubles from there
+#define MMAP_INITSLOTS  4
+
+// Protects the mapobjs, their pages, and every address space's mappings
+static struct mapobj *mapobjs = NULL;
+static struct lock *mmap_lock = NULL;
+static struct cv *mmap_cv = NULL;	// a page stopped being MO_BUSY
 
 /*
  * Wrap rma_stealmem in a spinlock.
+ * Also protects the coremap and its free lists.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/**
+	Push the block starting at `index` onto the free list for `order`
+*/
+static void freelist_push(int index, unsigned order) {
+	struct coremapentry *entry = coremap + index;
+
+	entry->used = false;
+	entry->nextentry = -1;
+	entry->isfreehead = true;
+	entry->order = order;
+	entry->freeprev = -1;
+	entry->freenext = freelists[order];
+	if (freelists[order] >= 0) {
+		coremap[freelists[order]].freeprev = index;
+	}
+	freelists[order] = index;
+}
+
+/**
+	Unlink the block starting at `index` from its free list
+*/
+static void freelist_remove(int index) {
+	struct coremapentry *entry = coremap + index;
+
+	KASSERT(entry->isfreehead);
+	if (entry->freeprev >= 0) {
+		coremap[entry->freeprev].freenext = entry->freenext;
+	} else {
+		freelists[entry->order] = entry->freenext;
+	}
+	if (entry->freenext >= 0) {
+		coremap[entry->freenext].freeprev = entry->freeprev;
+	}
+	entry->isfreehead = false;
+	entry->freenext = entry->freeprev = -1;
+}
+
+/**
+	Smallest order whose block holds at least `npages` pages
+*/
+static unsigned order_for(unsigned long npages) {
+	unsigned order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+/**
+	Give the block of 2^order pages at `index` back to the buddy system,
+	merging it with its buddy for as long as the buddy is also free.
+*/
+static void buddy_free_block(int index, unsigned order) {
+	while (order < COREMAP_MAXORDER) {
+		int buddy = index ^ (1 << order);
+		if (buddy + (1 << order) > totalpagecount) break;
+
+		struct coremapentry *b = coremap + buddy;
+		if (!b->isfreehead || b->order != order) break;
+
+		freelist_remove(buddy);
+		if (buddy < index) index = buddy;
+		order++;
+	}
+	freelist_push(index, order);
+}
+
+/**
+	Free an arbitrary run of pages [index, index + npages) by splitting it
+	into the largest naturally aligned power-of-two blocks that fit.
+*/
+static void buddy_free_run(int index, unsigned long npages) {
+	for (unsigned long i = 0; i < npages; i++) {
+		coremap[index + i].used = false;
+		coremap[index + i].nextentry = -1;
+		coremap[index + i].runlength = 0;
+	}
+	freepagecount += npages;
+	while (npages > 0) {
+		unsigned order = 0;
+		while (order < COREMAP_MAXORDER &&
+		       (index & ((1 << (order + 1)) - 1)) == 0 &&
+		       (1UL << (order + 1)) <= npages) {
+			order++;
+		}
+		buddy_free_block(index, order);
+		index += 1 << order;
+		npages -= 1UL << order;
+	}
+}
+
+/**
+	Allocate `npages` physically contiguous pages from the buddy system.
+	The tail of the power-of-two block that isn't needed is handed straight
+	back, so a 5 page request only holds on to 5 pages.
+	Returns the index of the first page, or -1 if no block is big enough.
+*/
+static int buddy_alloc_run(unsigned long npages) {
+	unsigned want = order_for(npages);
+	unsigned order;
+
+	if (want > COREMAP_MAXORDER) return -1;
+
+	// Find the smallest non-empty free list that fits
+	for (order = want; order <= COREMAP_MAXORDER; order++) {
+		if (freelists[order] >= 0) break;
+	}
+	if (order > COREMAP_MAXORDER) return -1;
+
+	int index = freelists[order];
+	freelist_remove(index);
+
+	// Split off upper halves until the block is the size we want
+	while (order > want) {
+		order--;
+		freelist_push(index + (1 << order), order);
+	}
+
+	freepagecount -= 1 << want;
+
+	// Return the unneeded tail of the block
+	if (npages < (1UL << want)) {
+		buddy_free_run(index + npages, (1UL << want) - npages);
+	}
+
+	for (unsigned long i = 0; i < npages; i++) {
+		struct coremapentry *row = coremap + index + i;
+		row->used = true;
+		row->nextentry = -1;
+		row->runlength = 0;
+	}
+	coremap[index].runlength = npages;
+
+	return index;
+}
+
 /**
 	TODO: Rename to not-so-smartvm.c
 	TODO: Dynamic segments for processes using Segmentation and Paging translation
@@ -88,12 +456,27 @@ void vm_bootstrap(void) {
 	totalpagecount -= pagesforcoremap; // a few pages are now unavailable
 	coremap = (struct coremapentry *)PADDR_TO_KVADDR(coremapploc);
 
+	for (unsigned order = 0; order <= COREMAP_MAXORDER; order++) {
+		freelists[order] = -1;
+	}
+
 	// Zero out all the core map entries
 	for (int i = 0; i < totalpagecount; i++) {
-		(coremap + i)->used = false;
+		(coremap + i)->used = true;
 		(coremap + i)->nextentry = -1;
+		(coremap + i)->isfreehead = false;
+		(coremap + i)->order = 0;
+		(coremap + i)->runlength = 0;
+		(coremap + i)->refcount = 0;
+		(coremap + i)->owner = 0;
+		(coremap + i)->vpage = 0;
+		(coremap + i)->busy = false;
+		(coremap + i)->referenced = false;
 	}
 
+	// Hand every page to the buddy system
+	buddy_free_run(0, totalpagecount);
+
 	// Recalc ramsize again
 	ram_getsize(&lo, &hi);
 
@@ -103,284 +486,3250 @@ void vm_bootstrap(void) {
 	pmemstart = lo;
 	pmemend = hi;
 	coremapsetup = true;
+
+	vmstats_init();
+
+	// The per-CPU TLB slot map is one 64-bit word
+	KASSERT(NUM_TLB <= 64);
+
+	// Every fault and page allocation on every cpu takes this one; queue
+	// the waiters so each spins on its own word
+	spinlock_setkind(&stealmem_lock, SPINLOCK_MCS);
+	spinlock_profile(&stealmem_lock, "stealmem_lock");
+	evict_lock = lock_create("evict_lock");
+	textcache_lock = lock_create("textcache_lock");
+	for (int i = 0; i < TEXTCACHE_BUCKETS; i++) {
+		textcache_buckets[i] = -1;
+	}
+	mmap_lock = lock_create("mmap_lock");
+	mmap_cv = cv_create("mmap_cv");
+	oom_lock = lock_create("oom_lock");
+	reap_lock = lock_create("reap_lock");
+	compact_lock = lock_create("compact_lock");
+	vm_register_shrinker(&zeropool_shrinker);
+	vm_register_shrinker(&textcache_shrinker);
+	vm_register_shrinker(&reap_shrinker);
+
+	// Caches shrink once under 1/32 of memory is free, back to 1/16
+	shrink_low = totalpagecount / 32;
+	shrink_high = 2 * shrink_low;
+	if (evict_lock == NULL || textcache_lock == NULL ||
+	    mmap_lock == NULL || oom_lock == NULL || reap_lock == NULL ||
+	    compact_lock == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	zeropage = getkpages(1);
+	if (zeropage == 0) {
+		panic("vm_bootstrap: no memory for the zero page\n");
+	}
+	memzero_page((void *)PADDR_TO_KVADDR(zeropage));
+	coremap[(zeropage - pmemstart) / PAGE_SIZE].refcount = 1;
+
+	work_init(&zeropool_work, vm_zero_run, NULL);
+	zeropool_ready = true;
+	work_init(&reap_work, as_reap_run, NULL);
+	work_init(&compact_work, vm_compact_run, NULL);
+	compact_ready = true;
+
+	swap_bootstrap(totalpagecount);
 }
 
 /**
 	Get the address of a free physical page, allocating as we go
 	When more than one page is required, the coremap entry will have the index
 	of the next page (the last page will have an index of -1).
+
+	Each link of the chain is a contiguous run; we try to satisfy the whole
+	request with one run and only fall back to a chain of single pages when
+	memory is too fragmented for that.
+	Returns -1 if there is not enough free memory.
+	Must be called with stealmem_lock held.
 */
 int getppageid(unsigned long npages) {
 
-	int result = -1;
-	struct coremapentry* previousrow = NULL;
-	int i;
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
 
-	for (i = 0; i < totalpagecount && npages > 0; i++) {
-		struct coremapentry* row = (coremap + i);
-		if (row->used) continue;
-		row->used = true;
+	if (npages == 0 || npages > (unsigned long)freepagecount) {
+		return -1;
+	}
+
+	int result = buddy_alloc_run(npages);
+	if (result >= 0) {
+		return result;
+	}
+
+	struct coremapentry* previousrow = NULL;
+	while (npages > 0) {
+		int i = buddy_alloc_run(1);
+		KASSERT(i >= 0); // we checked freepagecount above
 
 		if (previousrow == NULL) {
 			result = i;
 		} else {
 			previousrow->nextentry = i;
 		}
-		previousrow = row;
-
-		if (--npages == 0) break;
-	}
-
-	if (i == totalpagecount) {
-		// Did not break before finding a page
-		// TODO: Evict page from memory into swap file
-		panic("Out of memory. No more pages to allocate\n");
+		previousrow = coremap + i;
+		npages--;
 	}
 
 	return result;
 }
 
-static paddr_t getppages(unsigned long npages) {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
+/**
+	Give a chain of runs handed out by getppageid back to the buddy system
+	Must be called with stealmem_lock held.
+*/
+static void freeppageid(int pagenumber) {
 
-	if (coremapsetup) {
-		addr = (paddr_t)(pmemstart + getppageid(npages) * PAGE_SIZE);
-	} else {
-		addr = ram_stealmem(npages);
-	}
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
 
-	spinlock_release(&stealmem_lock);
-	return addr;
+	// Keep grabbing the next run and free it
+	do {
+		struct coremapentry * kpage = (coremap + pagenumber);
+		KASSERT(kpage->used); // Crash if this is an unused page
+		KASSERT(kpage->runlength > 0); // Must be the start of a run
+		int next = kpage->nextentry;
+		buddy_free_run(pagenumber, kpage->runlength);
+		pagenumber = next;
+	} while (pagenumber >= 0);
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t alloc_kpages(int npages) {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+/**
+	Take a single page out of this CPU's page cache, refilling the cache
+	from the coremap in one batch if it is empty.
+	Returns 0 if the coremap has nothing left either.
+*/
+static paddr_t pagecache_alloc(void) {
+	paddr_t addr = 0;
+	struct cpu *c;
+	int spl;
+
+	// Interrupts off so we stay on this CPU and interrupt-time kmalloc
+	// can't see the cache half updated
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if (c->c_pagecache_count == 0) {
+		spinlock_acquire(&stealmem_lock);
+		while (c->c_pagecache_count < CPU_PAGECACHE_BATCH) {
+			int id = buddy_alloc_run(1);
+			if (id < 0) break;
+			c->c_pagecache[c->c_pagecache_count++] =
+				(paddr_t)(pmemstart + id * PAGE_SIZE);
+		}
+		spinlock_release(&stealmem_lock);
 	}
-	return PADDR_TO_KVADDR(pa);
-}
 
-void free_kpages(vaddr_t addr) {
+	if (c->c_pagecache_count > 0) {
+		addr = c->c_pagecache[--c->c_pagecache_count];
+	}
 
-	// (void)addr;
-	// TODO: check if physical address is in the right bounds?
+	splx(spl);
+	return addr;
+}
 
-	paddr_t paddr = KVADDR_TO_PADDR(addr);
-	KASSERT(paddr % PAGE_SIZE == 0); // must be the address of a page
+/**
+	Put a single page that was allocated as a one page run into this CPU's
+	page cache. When the cache is full, a batch goes back to the coremap.
+*/
+static void pagecache_free(paddr_t paddr) {
+	struct cpu *c;
+	int spl;
 
-	// convert physical address to page number
-	int pagenumber = (paddr - pmemstart) / PAGE_SIZE;
+	spl = splhigh();
+	c = curcpu->c_self;
 
-	// Keep grabbing the next page and free it
-	do {
-		// Free the page
-		struct coremapentry * kpage = (coremap + pagenumber);
-		KASSERT(kpage->used); // Crash if this is an unused page
-		kpage->used = false;
-		pagenumber = kpage->nextentry;
-		kpage->nextentry = -1;
-	} while (pagenumber >= 0);
-}
+	if (c->c_pagecache_count == CPU_PAGECACHE_MAX) {
+		spinlock_acquire(&stealmem_lock);
+		while (c->c_pagecache_count > CPU_PAGECACHE_MAX - CPU_PAGECACHE_BATCH) {
+			paddr_t p = c->c_pagecache[--c->c_pagecache_count];
+			buddy_free_run((p - pmemstart) / PAGE_SIZE, 1);
+		}
+		spinlock_release(&stealmem_lock);
+	}
 
-void vm_tlbshootdown_all(void) {
-	panic("smartvm tried to do tlb shootdown?!\n");
-}
+	c->c_pagecache[c->c_pagecache_count++] = paddr;
 
-void vm_tlbshootdown(const struct tlbshootdown *ts) {
-	(void)ts;
-	panic("smartvm tried to do tlb shootdown?!\n");
+	splx(spl);
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress) {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
-	struct addrspace *as;
+/**
+	Return every page in this CPU's page cache to the coremap.
+	Used when the coremap can't satisfy a request on its own.
+*/
+static void pagecache_drain(void) {
+	struct cpu *c;
 	int spl;
 
-	faultaddress &= PAGE_FRAME;
+	spl = splhigh();
+	c = curcpu->c_self;
 
-	DEBUG(DB_VM, "smartvm: fault: 0x%x\n", faultaddress);
+	spinlock_acquire(&stealmem_lock);
+	while (c->c_pagecache_count > 0) {
+		paddr_t p = c->c_pagecache[--c->c_pagecache_count];
+		buddy_free_run((p - pmemstart) / PAGE_SIZE, 1);
+	}
+	spinlock_release(&stealmem_lock);
 
-	switch (faulttype) {
-	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		kprintf("VM error: User process attempted write to read-only memory.\n");
-		sys__exit(faulttype);
+	splx(spl);
+}
 
-	    case VM_FAULT_READ:
-	    case VM_FAULT_WRITE:
-		break;
-	    default:
-		return EINVAL;
-	}
+/**
+	Contiguous physical pages for kernel use. Unlike getppageid these are
+	never chained, since kernel memory is accessed through kseg0.
+*/
+static paddr_t getkpages(unsigned long npages) {
+	paddr_t addr = 0;
 
-	if (curproc == NULL) {
-		/*
-		 * No process. This is probably a kernel fault early
-		 * in boot. Return EFAULT so as to panic instead of
-		 * getting into an infinite faulting loop.
-		 */
-		return EFAULT;
+	if (coremapsetup && npages == 1) {
+		addr = pagecache_alloc();
+		if (addr != 0) {
+			return addr;
+		}
 	}
 
-	as = curproc_getas();
-	if (as == NULL) {
-		/*
-		 * No address space set up. This is probably also a
-		 * kernel fault early in boot.
-		 */
-		return EFAULT;
+	spinlock_acquire(&stealmem_lock);
+
+	if (coremapsetup) {
+		int id = buddy_alloc_run(npages);
+		if (id >= 0) {
+			addr = (paddr_t)(pmemstart + id * PAGE_SIZE);
+		}
+	} else {
+		addr = ram_stealmem(npages);
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+	spinlock_release(&stealmem_lock);
 
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - SMARTVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-	bool dirtiable;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = vaddr_to_paddr(faultaddress,  vbase1, as->as_pbase1);
-		dirtiable = as->as_dirtiable1;
-	} else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = vaddr_to_paddr(faultaddress,  vbase2, as->as_pbase2);
-		dirtiable = as->as_dirtiable2;
-	} else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = vaddr_to_paddr(faultaddress, stackbase, as->as_stackpbase);
-		dirtiable = true;
-	} else {
-		return EFAULT;
+	if (addr == 0 && coremapsetup) {
+		// Pages parked in our cache may be what's missing
+		pagecache_drain();
+		spinlock_acquire(&stealmem_lock);
+		int id = buddy_alloc_run(npages);
+		if (id >= 0) {
+			addr = (paddr_t)(pmemstart + id * PAGE_SIZE);
+		}
+		spinlock_release(&stealmem_lock);
 	}
 
-	// if not yet ready, we're still loading segments
-	// Will always be dirtiable in this case
-	if (!as->as_ready) dirtiable = true;
+	return addr;
+}
+
+/*
+	Per-CPU TLB manager. Each CPU tracks which of its TLB slots are in use
+	so refills go to a free slot while there is one, and otherwise evict
+	round-robin. User entries are tagged with the address space's ASID.
+	All of these must be called with interrupts off, and leave EntryHi
+	holding the current ASID again.
+	The fast-path refill in exception-mips1.S also loads entries, with
+	tlbwr, without telling c_tlb_used; so the bitmap only says which slots
+	we filled, not which are empty.
+*/
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+static void tlbmgr_flush(void) {
+	struct cpu *c = curcpu->c_self;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	for (int i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	c->c_tlb_used = 0;
+	tlb_setasid(c->c_asid);
+}
+
+/**
+	Drop every entry for the page at `vaddr`, whatever address space it
+	is tagged with; the caller doesn't know which ASID the page's owner
+	had when this CPU loaded it.
+*/
+static void tlbmgr_invalidate(vaddr_t vaddr) {
+	struct cpu *c = curcpu->c_self;
 
-	for (i=0; !tlbfull && i < NUM_TLB; i++) {
+	// Every slot: the fast refill path doesn't mark the ones it uses
+	for (int i=0; i<NUM_TLB; i++) {
+		uint32_t ehi, elo;
 		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+		if ((ehi & TLBHI_VPAGE) == vaddr) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			c->c_tlb_used &= ~((uint64_t)1 << i);
 		}
-		ehi = faultaddress;
-		elo = paddr | (dirtiable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
-		DEBUG(DB_VM, "smartvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
 	}
+	tlb_setasid(c->c_asid);
+}
 
-	tlbfull = true;
+/**
+	Drop every entry tagged with `asid`.
+*/
+static void tlbmgr_purge(unsigned asid) {
+	struct cpu *c = curcpu->c_self;
 
-	// If we reached this point the TLB is full
-	// Evict and write to a random page for now
-	ehi = faultaddress;
-	elo = paddr | (dirtiable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
-	tlb_random(ehi, elo);
-	splx(spl);
-	return 0;
+	for (int i=0; i<NUM_TLB; i++) {
+		uint32_t ehi, elo;
+		tlb_read(&ehi, &elo, i);
+		if ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			c->c_tlb_used &= ~((uint64_t)1 << i);
+		}
+	}
+	tlb_setasid(c->c_asid);
 }
 
 /**
-	Follows the coremap to find the correct physical address
+	Pick a slot for a new entry: a free one while there is one, and
+	otherwise the one the hand is on. The hand keeps moving, so the
+	entry replaced is always the one loaded longest ago. `replacing` says
+	which it was.
 */
-paddr_t vaddr_to_paddr(vaddr_t addr, vaddr_t vbase, paddr_t pbase) {
-	int pagenumber = (pbase - pmemstart) / PAGE_SIZE;
-	struct coremapentry * entry = coremap + pagenumber;
-	for (size_t i = 0; i < (addr - vbase) / PAGE_SIZE; i++) {
-		pagenumber = entry->nextentry;
-		entry = coremap + pagenumber;
+static int tlbmgr_slot(struct cpu *c, bool *replacing) {
+	int i;
+
+	if (~c->c_tlb_used != 0) {
+		for (i=0; c->c_tlb_used & ((uint64_t)1 << i); i++);
+		c->c_tlb_used |= (uint64_t)1 << i;
+		*replacing = false;
+		return i;
 	}
-	return (paddr_t)(pmemstart + (pagenumber * PAGE_SIZE) + (addr % PAGE_SIZE));
+	*replacing = true;
+	i = c->c_tlb_hand;
+	c->c_tlb_hand = (c->c_tlb_hand + 1) % NUM_TLB;
+	return i;
 }
 
-struct addrspace * as_create(void) {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
-	if (as==NULL) {
-		return NULL;
+/**
+	Load a translation, counting whether it went into a free slot or
+	pushed another entry out.
+*/
+static void tlbmgr_insert(vaddr_t vaddr, uint32_t elo) {
+	struct cpu *c = curcpu->c_self;
+	uint32_t ehi = vaddr | (c->c_asid << TLBHI_PIDSHIFT);
+	bool replacing;
+	int i;
+
+	// A write to a COW page already has a (read-only) entry; replace it
+	// in place, the TLB must never hold two entries for one page
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+		tlb_setasid(c->c_asid);
+		return;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_dirtiable1 = false;
+	i = tlbmgr_slot(c, &replacing);
+	tlb_write(ehi, elo, i);
+	vmstats_inc(replacing ? VMSTAT_TLB_FAULT_REPLACE : VMSTAT_TLB_FAULT_FREE);
+	tlb_setasid(c->c_asid);
+}
+
+/**
+	Load a translation nobody faulted on yet, unless it is already there.
+	Not counted as a TLB fault.
+*/
+static void tlbmgr_preload(vaddr_t vaddr, uint32_t elo) {
+	struct cpu *c = curcpu->c_self;
+	uint32_t ehi = vaddr | (c->c_asid << TLBHI_PIDSHIFT);
+	bool replacing;
+
+	if (tlb_probe(ehi, 0) < 0) {
+		tlb_write(ehi, elo, tlbmgr_slot(c, &replacing));
+	}
+	tlb_setasid(c->c_asid);
+}
+
+/*
+	TLB shootdown. Invalidations for one address space are collected in a
+	struct shootdown and sent together: each CPU running the address space
+	gets them all in one IPI (a whole-TLB flush past TLBSHOOTDOWN_MAX
+	pages), and shootdown_flush waits until they are done. CPUs not
+	running it aren't interrupted at all; they lose their bit in
+	as_cpus and purge the ASID when they next activate it.
+	Must be called with interrupts on and no spinlocks held.
+*/
+#define SHOOTDOWN_ALL   (TLBSHOOTDOWN_MAX + 1)
+
+struct shootdown {
+	struct addrspace *sd_as;
+	unsigned sd_npages;	// SHOOTDOWN_ALL for the whole address space
+	struct tlbshootdown sd_pages[TLBSHOOTDOWN_MAX];
+};
+
+static void shootdown_init(struct shootdown *sd, struct addrspace *as) {
+	sd->sd_as = as;
+	sd->sd_npages = 0;
+}
+
+static void shootdown_add(struct shootdown *sd, vaddr_t vaddr) {
+	if (sd->sd_npages < TLBSHOOTDOWN_MAX) {
+		sd->sd_pages[sd->sd_npages].ts_addrspace = sd->sd_as;
+		sd->sd_pages[sd->sd_npages].ts_vaddr = vaddr;
+		sd->sd_npages++;
+	} else {
+		sd->sd_npages = SHOOTDOWN_ALL;
+	}
+}
+
+static void shootdown_flush(struct shootdown *sd) {
+	struct addrspace *as = sd->sd_as;
+	bool all = sd->sd_npages == SHOOTDOWN_ALL;
+	unsigned tickets[MAXCPUS];
+	uint32_t sent = 0;
+	unsigned n, i;
+	int spl;
+
+	if (sd->sd_npages == 0) return;
+
+	// Stay on this CPU between flushing our own TLB and telling the others
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	for (n = 0; n < cpu_count(); n++) {
+		struct cpu *c = cpu_get(n);
+		if (c->c_curas != as) {
+			as->as_cpus &= ~CPUMASK_CPU(n);
+		} else if (c == curcpu->c_self) {
+			if (all) {
+				tlbmgr_purge(c->c_asid);
+			} else {
+				for (i = 0; i < sd->sd_npages; i++) {
+					tlbmgr_invalidate(sd->sd_pages[i].ts_vaddr);
+				}
+			}
+		} else {
+			tickets[n] = ipi_tlbshootdown(c, sd->sd_pages, all ? 0 : sd->sd_npages);
+			sent |= CPUMASK_CPU(n);
+		}
+	}
+	spinlock_release(&asid_lock);
+	splx(spl);
+
+	for (n = 0; sent != 0; n++) {
+		if (sent & CPUMASK_CPU(n)) {
+			ipi_tlbshootdown_wait(cpu_get(n), tickets[n]);
+			sent &= ~CPUMASK_CPU(n);
+		}
+	}
+	sd->sd_npages = 0;
+}
+
+/**
+	Invalidate every TLB entry for the address space, on every CPU.
+*/
+static void shootdown_as(struct addrspace *as) {
+	struct shootdown sd;
+
+	shootdown_init(&sd, as);
+	sd.sd_npages = SHOOTDOWN_ALL;
+	shootdown_flush(&sd);
+}
+
+/**
+	Reverse mapping: the address space and virtual address of the one
+	mapping of a private user frame. Must be called with stealmem_lock
+	held.
+*/
+static struct addrspace *coremap_owner(const struct coremapentry *entry) {
+	return coremap_owners[entry->owner];
+}
+
+static vaddr_t coremap_vaddr(const struct coremapentry *entry) {
+	return (vaddr_t)entry->vpage * PAGE_SIZE;
+}
+
+/**
+	Give an address space an owner index. Returns false if they are all
+	taken.
+*/
+static bool coremap_addowner(struct addrspace *as) {
+	bool found = false;
+
+	spinlock_acquire(&stealmem_lock);
+	for (unsigned n = 1; n < COREMAP_OWNERS; n++) {
+		unsigned i = coremap_ownerhint;
+		coremap_ownerhint = coremap_ownerhint % (COREMAP_OWNERS - 1) + 1;
+		if (coremap_owners[i] == NULL) {
+			coremap_owners[i] = as;
+			as->as_ownerid = i;
+			found = true;
+			break;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+	return found;
+}
+
+/**
+	Give the index back once none of the address space's frames name it.
+*/
+static void coremap_removeowner(struct addrspace *as) {
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(coremap_owners[as->as_ownerid] == as);
+	coremap_owners[as->as_ownerid] = NULL;
+	spinlock_release(&stealmem_lock);
+}
+
+/**
+	Second-chance clock over the coremap. Picks a resident user page that
+	only one address space maps and that hasn't been referenced since the
+	hand last passed it. The page's PTE is marked busy so its owner waits
+	for the eviction to finish instead of using the frame.
+	Returns the coremap index, or -1 if nothing can be evicted.
+	Must be called with stealmem_lock held.
+*/
+static int clock_choose_victim(void) {
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	for (int n = 0; n < 2 * totalpagecount; n++) {
+		int i = clockhand;
+		struct coremapentry *entry = coremap + i;
+		clockhand = (clockhand + 1) % totalpagecount;
+
+		if (!entry->used || entry->owner == 0) continue;
+		if (entry->busy || entry->refcount != 1) continue;
+		// About to be freed anyway; no sense writing it out
+		if (coremap_owner(entry)->as_doomed) continue;
+		pte_t *pte = pt_lookup(coremap_owner(entry)->as_pt, coremap_vaddr(entry));
+		if (entry->referenced) {
+			// Second chance. Its next TLB refill has to come through
+			// vm_fault again for us to find out it's still in use.
+			entry->referenced = false;
+			*pte &= ~PTE_REF;
+			continue;
+		}
+
+		KASSERT(pte != NULL && (*pte & PTE_VALID));
+		KASSERT(PTE_FRAME(*pte) == (paddr_t)(pmemstart + i * PAGE_SIZE));
+
+		*pte = (*pte & ~PTE_VALID) | PTE_BUSY;
+		entry->busy = true;
+		return i;
+	}
+
+	return -1;
+}
+
+/**
+	Take a frame from the pre-zeroed pool, or 0 if it is empty. Wakes the
+	zeroing job when the pool runs low, or free memory does.
+*/
+static paddr_t zeropool_take(void) {
+	paddr_t paddr = 0;
+	bool wake = false;
+
+	spinlock_acquire(&stealmem_lock);
+	if (zeropool_count > 0) {
+		paddr = zeropool[--zeropool_count];
+	}
+	if (zeropool_count < ZEROPOOL_LOW && !zeropool_wanted && zeropool_ready) {
+		zeropool_wanted = true;
+		wake = true;
+	}
+	if ((unsigned)freepagecount < shrink_low && !shrink_wanted && zeropool_ready) {
+		shrink_wanted = true;
+		wake = true;
+	}
+	spinlock_release(&stealmem_lock);
+
+	if (wake) {
+		work_enqueue(kworkq, &zeropool_work);
+	}
+	return paddr;
+}
+
+/**
+	Background job that refills the pre-zeroed pool whenever it gets
+	low. It backs off when free memory is scarce, so pooled frames don't
+	push other pages out to swap, and yields between pages so it mostly
+	runs when nothing else wants the CPU. When free memory is below the
+	low watermark it first has the kernel's caches shrink.
+*/
+static void vm_zero_run(void *data) {
+	unsigned want;
+
+	(void)data;
+
+	spinlock_acquire(&stealmem_lock);
+	want = 0;
+	if (shrink_wanted && (unsigned)freepagecount < shrink_high) {
+		want = shrink_high - freepagecount;
+	}
+	spinlock_release(&stealmem_lock);
+	if (want > 0) {
+		vm_shrink(want);
+	}
+	spinlock_acquire(&stealmem_lock);
+	shrink_wanted = false;
+	spinlock_release(&stealmem_lock);
+
+	for (;;) {
+		paddr_t paddr;
+		bool full;
+
+		spinlock_acquire(&stealmem_lock);
+		full = zeropool_count >= ZEROPOOL_MAX ||
+			freepagecount < 2 * ZEROPOOL_MAX;
+		if (full) {
+			zeropool_wanted = false;
+		}
+		spinlock_release(&stealmem_lock);
+		if (full) break;
+
+		paddr = getkpages(1);
+		if (paddr == 0) {
+			spinlock_acquire(&stealmem_lock);
+			zeropool_wanted = false;
+			spinlock_release(&stealmem_lock);
+			break;
+		}
+		memzero_page((void *)PADDR_TO_KVADDR(paddr));
+
+		spinlock_acquire(&stealmem_lock);
+		full = zeropool_count >= ZEROPOOL_MAX;
+		if (!full) {
+			zeropool[zeropool_count++] = paddr;
+		}
+		spinlock_release(&stealmem_lock);
+		if (full) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+		}
+
+		thread_yield();
+	}
+}
+
+/**
+	Shrinker: hand pre-zeroed frames back to the page allocator, where
+	kernel allocations can use them too.
+*/
+static unsigned zeropool_shrink(unsigned npages) {
+	paddr_t paddr;
+	unsigned n;
+
+	for (n = 0; n < npages; n++) {
+		spinlock_acquire(&stealmem_lock);
+		paddr = zeropool_count > 0 ? zeropool[--zeropool_count] : 0;
+		spinlock_release(&stealmem_lock);
+		if (paddr == 0) break;
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+	return n;
+}
+
+/**
+	Take the page at `vaddr` in `as` for eviction along with a victim
+	the clock chose just before it, if the clock would have taken it
+	too: resident, private, not doomed, and not used since the hand
+	last passed. Marks it busy the same way and returns its frame, or
+	returns 0 if it won't do.
+	Must be called with stealmem_lock held.
+*/
+static paddr_t evict_take_neighbour(struct addrspace *as, vaddr_t vaddr) {
+	struct coremapentry *entry;
+	pte_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	if (vaddr >= USERSPACETOP) return 0;
+	pte = pt_lookup(as->as_pt, vaddr);
+	if (pte == NULL || !(*pte & PTE_VALID) || (*pte & PTE_BUSY)) return 0;
+	if (PTE_FRAME(*pte) == zeropage) return 0;
+
+	entry = coremap + (PTE_FRAME(*pte) - pmemstart) / PAGE_SIZE;
+	if (entry->owner == 0 || coremap_owner(entry) != as) return 0;
+	if (entry->busy || entry->refcount != 1 || entry->referenced) return 0;
+	KASSERT(coremap_vaddr(entry) == vaddr);
+
+	*pte = (*pte & ~PTE_VALID) | PTE_BUSY;
+	entry->busy = true;
+	return PTE_FRAME(*pte);
+}
+
+/**
+	Free up a frame by writing user pages out to swap. The clock picks
+	one; the pages right after it in the same address space go with it
+	if they're just as idle, up to SWAP_CLUSTER in consecutive slots and
+	one disk write, so a fault on any of them can read the rest back in
+	with it (see as_fault_in). The frames of the others go back to the
+	page allocator.
+	Returns the clock's victim's frame (now owned by the caller), or 0
+	if there is no swap, nothing to evict, or we're in a context that
+	can't sleep.
+*/
+static paddr_t evict_page(void) {
+	struct coremapentry *entry;
+	struct shootdown sd;
+	struct addrspace *as;
+	paddr_t paddrs[SWAP_CLUSTER];
+	vaddr_t vaddr;
+	paddr_t paddr;
+	unsigned slot, n, got, i;
+	pte_t *pte;
+	int victim;
+	int result;
+
+	if (evict_lock == NULL || !swap_enabled()) {
+		return 0;
+	}
+	if (curthread->t_in_interrupt || curthread->t_iplhigh_count > 0) {
+		// Can't do disk I/O from here
+		return 0;
+	}
+
+	lock_acquire(evict_lock);
+
+	// Somebody may have given memory back while we waited, and frames
+	// sitting in the zero pool are free memory too
+	paddr = getkpages(1);
+	if (paddr == 0) {
+		paddr = zeropool_take();
+	}
+	if (paddr != 0) {
+		lock_release(evict_lock);
+		return paddr;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	victim = clock_choose_victim();
+	if (victim < 0) {
+		spinlock_release(&stealmem_lock);
+		lock_release(evict_lock);
+		return 0;
+	}
+	entry = coremap + victim;
+	as = coremap_owner(entry);
+	vaddr = coremap_vaddr(entry);
+	paddrs[0] = (paddr_t)(pmemstart + victim * PAGE_SIZE);
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		paddrs[n] = evict_take_neighbour(as, vaddr + n * PAGE_SIZE);
+		if (paddrs[n] == 0) break;
+	}
+	spinlock_release(&stealmem_lock);
+
+	// The clock only picks pages one address space maps
+	shootdown_init(&sd, as);
+	for (i = 0; i < n; i++) {
+		shootdown_add(&sd, vaddr + i * PAGE_SIZE);
+	}
+	shootdown_flush(&sd);
+
+	got = n;
+	result = swap_alloc_cluster(&slot, &got);
+	if (!result) {
+		result = swap_write_cluster(slot, paddrs, got);
+		if (result) {
+			for (i = 0; i < got; i++) {
+				swap_free(slot + i);
+			}
+		}
+	}
+	if (result) {
+		got = 0;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	for (i = 0; i < n; i++) {
+		pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE);
+		KASSERT(pte != NULL && (*pte & PTE_BUSY));
+		entry = coremap + (paddrs[i] - pmemstart) / PAGE_SIZE;
+		if (i >= got) {
+			// Couldn't write it out (or no room in the run); put
+			// the page back
+			*pte = (*pte & ~PTE_BUSY) | PTE_VALID;
+			entry->busy = false;
+		} else {
+			*pte = PTE_MAKE_SWAP(slot + i,
+				(*pte & PTE_FLAGMASK & ~PTE_BUSY) | PTE_SWAPPED);
+			entry->owner = 0;
+			entry->busy = false;
+			entry->refcount = 0;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+
+	for (i = 1; i < got; i++) {
+		free_kpages(PADDR_TO_KVADDR(paddrs[i]));
+	}
+
+	lock_release(evict_lock);
+	return got > 0 ? paddrs[0] : 0;
+}
+
+static void upage_init(paddr_t paddr) {
+	struct coremapentry *entry = coremap + (paddr - pmemstart) / PAGE_SIZE;
+
+	// The bits share a word with ones the clock reads
+	spinlock_acquire(&stealmem_lock);
+	entry->refcount = 1;
+	entry->owner = 0;
+	entry->busy = false;
+	entry->referenced = false;
+	spinlock_release(&stealmem_lock);
+}
+
+/**
+	A single zeroed frame for a user page. Comes from the pre-zeroed pool
+	when it can; otherwise it is cleared here, after evicting a page to
+	swap if memory is full.
+*/
+static paddr_t getupage(void) {
+	paddr_t paddr = zeropool_take();
+	if (paddr == 0) {
+		paddr = getkpages(1);
+		if (paddr == 0) {
+			paddr = evict_page();
+		}
+		if (paddr != 0) {
+			memzero_page((void *)PADDR_TO_KVADDR(paddr));
+		}
+	}
+	if (paddr != 0) {
+		upage_init(paddr);
+	}
+	return paddr;
+}
+
+/**
+	A frame for a user page that is about to be filled, but only if one
+	is free: nothing is evicted for it, and it isn't zeroed.
+*/
+static paddr_t getupage_nowait(void) {
+	paddr_t paddr = getkpages(1);
+	if (paddr == 0) {
+		paddr = zeropool_take();
+	}
+	if (paddr != 0) {
+		upage_init(paddr);
+	}
+	return paddr;
+}
+
+/**
+	Record which address space maps a private user frame so the clock can
+	find its PTE. Shared (COW) frames have no owner and are never evicted.
+	Must be called with stealmem_lock held.
+*/
+static void upage_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr) {
+	struct coremapentry *entry = coremap + (paddr - pmemstart) / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(as->as_ownerid != 0);
+	entry->owner = as->as_ownerid;
+	entry->vpage = vaddr / PAGE_SIZE;
+	entry->referenced = true;
+}
+
+/**
+	User frames can be shared copy-on-write between address spaces after a
+	fork. Each mapping holds a reference; the frame goes back to the
+	coremap when the last one is dropped.
+	Must be called with stealmem_lock held.
+*/
+static void upage_incref_locked(paddr_t paddr) {
+	struct coremapentry *entry = coremap + (paddr - pmemstart) / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(entry->refcount < (1U << 24) - 1);
+	entry->refcount++;
+	entry->owner = 0;
+}
+
+/**
+	Drop a reference. Returns true if that was the last one, in which case
+	the caller must free_kpages the frame once it has released the lock.
+*/
+static bool upage_decref_locked(paddr_t paddr) {
+	struct coremapentry *entry = coremap + (paddr - pmemstart) / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+	KASSERT(entry->refcount > 0);
+	KASSERT(!entry->busy);
+	if (--entry->refcount > 0) {
+		return false;
+	}
+	entry->owner = 0;
+	return true;
+}
+
+static void freeupage(paddr_t paddr) {
+	bool last;
+
+	spinlock_acquire(&stealmem_lock);
+	last = upage_decref_locked(paddr);
+	spinlock_release(&stealmem_lock);
+
+	if (last) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+static bool kva_test(const uint32_t *map, unsigned i) {
+	return (map[i / 32] & ((uint32_t)1 << (i % 32))) != 0;
+}
+
+static void kva_set(uint32_t *map, unsigned i, bool on) {
+	if (on) {
+		map[i / 32] |= (uint32_t)1 << (i % 32);
+	} else {
+		map[i / 32] &= ~((uint32_t)1 << (i % 32));
+	}
+}
+
+/**
+	First page of a free stretch of `npages` pages of kseg2, or -1.
+	Must be called with kva_lock held.
+*/
+static int kva_findfree(unsigned npages) {
+	unsigned i, run = 0;
+
+	KASSERT(spinlock_do_i_hold(&kva_lock));
+
+	for (i = 0; i < KVA_PAGES; i++) {
+		if (kva_test(kva_used, i) || kva_test(kva_stale, i)) {
+			run = 0;
+		} else if (++run == npages) {
+			return i + 1 - npages;
+		}
+	}
+	return -1;
+}
+
+/**
+	Flush every CPU's TLB so the pages in kva_stale can be used again.
+	Only the pages that were stale when we started are released; ones
+	freed meanwhile may have been loaded again after the flush. Returns
+	false, doing nothing, if we can't wait for other CPUs from here.
+*/
+static bool kva_flushstale(void) {
+	uint32_t stale[KVA_WORDS];
+	unsigned tickets[MAXCPUS];
+	uint32_t sent = 0;
+	unsigned n, i;
+	int spl;
+
+	if (curthread->t_curspl != 0 || curthread->t_in_interrupt) {
+		return false;
+	}
+
+	spinlock_acquire(&kva_lock);
+	for (i = 0; i < KVA_WORDS; i++) {
+		stale[i] = kva_stale[i];
+	}
+	spinlock_release(&kva_lock);
+
+	spl = splhigh();
+	for (n = 0; n < cpu_count(); n++) {
+		struct cpu *c = cpu_get(n);
+		if (c == curcpu->c_self) {
+			tlbmgr_flush();
+		} else {
+			tickets[n] = ipi_tlbshootdown(c, NULL, 0);
+			sent |= CPUMASK_CPU(n);
+		}
+	}
+	splx(spl);
+
+	for (n = 0; sent != 0; n++) {
+		if (sent & CPUMASK_CPU(n)) {
+			ipi_tlbshootdown_wait(cpu_get(n), tickets[n]);
+			sent &= ~CPUMASK_CPU(n);
+		}
+	}
+
+	spinlock_acquire(&kva_lock);
+	for (i = 0; i < KVA_WORDS; i++) {
+		kva_stale[i] &= ~stale[i];
+	}
+	spinlock_release(&kva_lock);
+	return true;
+}
+
+/**
+	Find room in kseg2 for the `npages` frames of the getppageid chain
+	starting at `id` and map them there. Returns the first page, or -1.
+*/
+static int kva_claim(int id, unsigned npages) {
+	int start, run;
+	unsigned i;
+
+	spinlock_acquire(&kva_lock);
+	start = kva_findfree(npages);
+	if (start >= 0) {
+		// The chain is ours, so its entries don't change under us
+		i = start;
+		for (run = id; run >= 0; run = coremap[run].nextentry) {
+			for (unsigned j = 0; j < coremap[run].runlength; j++) {
+				kva_frames[i] = pmemstart + (run + j) * PAGE_SIZE;
+				kva_set(kva_used, i, true);
+				i++;
+			}
+		}
+		KASSERT(i == start + npages);
+		kva_npages[start] = npages;
+	}
+	spinlock_release(&kva_lock);
+	return start;
+}
+
+/**
+	Map `npages` frames, not necessarily contiguous, at a contiguous kseg2
+	address. Returns 0 if there isn't the memory or the address space.
+*/
+static vaddr_t kva_alloc(unsigned npages) {
+	int id, start;
+
+	if (npages > KVA_PAGES) {
+		return 0;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	id = getppageid(npages);
+	spinlock_release(&stealmem_lock);
+	if (id < 0) {
+		return 0;
+	}
+
+	start = kva_claim(id, npages);
+	if (start < 0 && kva_flushstale()) {
+		start = kva_claim(id, npages);
+	}
+	if (start < 0) {
+		spinlock_acquire(&stealmem_lock);
+		freeppageid(id);
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+	return MIPS_KSEG2 + start * PAGE_SIZE;
+}
+
+/**
+	Unmap and free an allocation made by kva_alloc.
+*/
+static void kva_free(vaddr_t addr) {
+	unsigned start = (addr - MIPS_KSEG2) / PAGE_SIZE;
+	unsigned npages, i;
+	bool others = cpu_count() > 1;
+	paddr_t head;
+	int spl;
+
+	KASSERT(addr % PAGE_SIZE == 0);
+	KASSERT(start < KVA_PAGES);
+
+	spinlock_acquire(&kva_lock);
+	KASSERT(kva_test(kva_used, start) && kva_npages[start] > 0);
+	npages = kva_npages[start];
+	head = kva_frames[start];
+	kva_npages[start] = 0;
+	for (i = start; i < start + npages; i++) {
+		kva_frames[i] = 0;
+		kva_set(kva_used, i, false);
+		kva_set(kva_stale, i, others);
+	}
+	spinlock_release(&kva_lock);
+
+	// Our own TLB we can clean now; with other CPUs the pages stay
+	// stale until kva_flushstale
+	spl = splhigh();
+	for (i = start; i < start + npages; i++) {
+		tlbmgr_invalidate(MIPS_KSEG2 + i * PAGE_SIZE);
+	}
+	splx(spl);
+
+	spinlock_acquire(&stealmem_lock);
+	freeppageid((head - pmemstart) / PAGE_SIZE);
+	spinlock_release(&stealmem_lock);
+}
+
+/**
+	TLB miss on a kseg2 address: load the page's global entry. Can happen
+	anywhere in the kernel, even with spinlocks held.
+*/
+static int kva_fault(vaddr_t faultaddress) {
+	unsigned i = (faultaddress - MIPS_KSEG2) / PAGE_SIZE;
+	paddr_t paddr = 0;
+	int spl;
+
+	if (i >= KVA_PAGES) {
+		return EFAULT;
+	}
+
+	spl = splhigh();
+	spinlock_acquire(&kva_lock);
+	if (kva_test(kva_used, i)) {
+		paddr = kva_frames[i];
+	}
+	spinlock_release(&kva_lock);
+	if (paddr != 0) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		tlbmgr_insert(faultaddress, paddr | TLBLO_GLOBAL | TLBLO_DIRTY | TLBLO_VALID);
+	}
+	splx(spl);
+
+	return paddr != 0 ? 0 : EFAULT;
+}
+
+/**
+	Can coremap entry `i` be moved elsewhere? It has to be a resident
+	private user page the clock could evict: one owner, who isn't
+	exiting, and not already busy.
+	Must be called with stealmem_lock held.
+*/
+static bool compact_movable(int i) {
+	struct coremapentry *entry = coremap + i;
+	pte_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	if (!entry->used || entry->owner == 0) return false;
+	if (entry->busy || entry->refcount != 1) return false;
+	if (coremap_owner(entry)->as_doomed) return false;
+	pte = pt_lookup(coremap_owner(entry)->as_pt, coremap_vaddr(entry));
+	if (pte == NULL || !(*pte & PTE_VALID) || (*pte & PTE_BUSY)) return false;
+	KASSERT(PTE_FRAME(*pte) == (paddr_t)(pmemstart + i * PAGE_SIZE));
+	return true;
+}
+
+/**
+	The block of 2^order pages that is cheapest to free up: every page
+	free or movable, as few to move as possible, and enough free frames
+	outside it to move them to. Returns its first page, or -1.
+	Must be called with stealmem_lock held.
+*/
+static int compact_pick(unsigned order) {
+	int size = 1 << order;
+	int best = -1, bestmoves = size + 1;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	for (int start = 0; start + size <= totalpagecount; start += size) {
+		int nfree = 0, nmoves = 0, i = start;
+
+		while (i < start + size) {
+			struct coremapentry *entry = coremap + i;
+			if (entry->isfreehead) {
+				// Aligned, and none is as big as the
+				// block, so it lies inside it
+				KASSERT(entry->order < order);
+				nfree += 1 << entry->order;
+				i += 1 << entry->order;
+			} else if (compact_movable(i)) {
+				nmoves++;
+				i++;
+			} else {
+				break;
+			}
+		}
+		if (i < start + size || nmoves >= bestmoves) continue;
+		if (nmoves > freepagecount - nfree) continue;
+		best = start;
+		bestmoves = nmoves;
+		if (bestmoves <= 1) break;
+	}
+	return best;
+}
+
+/**
+	Move the user page in coremap entry `i`, already marked busy and
+	out of the TLBs, to a frame outside the block being compacted.
+	Returns false, leaving it where it is and no longer busy, if there
+	is no frame for it.
+*/
+static bool compact_move(int i) {
+	struct coremapentry *entry = coremap + i;
+	struct addrspace *as;
+	paddr_t oldpa = (paddr_t)(pmemstart + i * PAGE_SIZE);
+	paddr_t newpa;
+	vaddr_t vaddr;
+	pte_t *pte;
+
+	// Busy, so ours; but the bits share words with others'
+	spinlock_acquire(&stealmem_lock);
+	as = coremap_owner(entry);
+	vaddr = coremap_vaddr(entry);
+	spinlock_release(&stealmem_lock);
+
+	// The block's free pages are off the free lists, so this is elsewhere
+	newpa = getkpages(1);
+	if (newpa != 0) {
+		memcpy((void *)PADDR_TO_KVADDR(newpa),
+		       (void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+		upage_init(newpa);
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	pte = pt_lookup(as->as_pt, vaddr);
+	KASSERT(pte != NULL && (*pte & PTE_BUSY));
+	KASSERT(PTE_FRAME(*pte) == oldpa);
+	if (newpa == 0) {
+		*pte = (*pte & ~PTE_BUSY) | PTE_VALID;
+		entry->busy = false;
+		spinlock_release(&stealmem_lock);
+		return false;
+	}
+	upage_setowner(newpa, as, vaddr);
+	coremap[(newpa - pmemstart) / PAGE_SIZE].referenced = entry->referenced;
+	*pte = PTE_MAKE(newpa, (*pte & PTE_FLAGMASK & ~PTE_BUSY) | PTE_VALID);
+	entry->owner = 0;
+	entry->busy = false;
+	entry->refcount = 0;
+	entry->referenced = false;
+	spinlock_release(&stealmem_lock);
+	vmstats_inc(VMSTAT_COMPACT_MOVE);
+	return true;
+}
+
+/**
+	Build a free run of `npages` pages by moving user pages out of the
+	way, and allocate it as getkpages would. Returns 0 if no block can
+	be freed up, or if we can't sleep here.
+*/
+static paddr_t compact_alloc(unsigned long npages) {
+	unsigned order = order_for(npages);
+	struct shootdown sd;
+	int start, size, i;
+	bool ok = true;
+
+	if (order > COMPACT_MAXORDER || compact_lock == NULL) return 0;
+	if (curthread->t_curspl != 0 || curthread->t_in_interrupt) return 0;
+
+	lock_acquire(compact_lock);
+	// What's parked in our page cache can't be moved
+	pagecache_drain();
+
+	// Claim the block: its free pages become ours, and its user pages
+	// busy, all at once so none of them is freed or changes meanwhile
+	spinlock_acquire(&stealmem_lock);
+	start = buddy_alloc_run(npages);
+	if (start >= 0) {
+		// Freed meanwhile
+		spinlock_release(&stealmem_lock);
+		lock_release(compact_lock);
+		return (paddr_t)(pmemstart + start * PAGE_SIZE);
+	}
+	start = compact_pick(order);
+	if (start < 0) {
+		spinlock_release(&stealmem_lock);
+		lock_release(compact_lock);
+		return 0;
+	}
+	size = 1 << order;
+	for (i = start; i < start + size; ) {
+		struct coremapentry *entry = coremap + i;
+		if (entry->isfreehead) {
+			int n = 1 << entry->order;
+			freelist_remove(i);
+			freepagecount -= n;
+			for (int j = i; j < i + n; j++) {
+				coremap[j].used = true;
+				coremap[j].nextentry = -1;
+				coremap[j].runlength = 0;
+			}
+			i += n;
+		} else {
+			pte_t *pte = pt_lookup(coremap_owner(entry)->as_pt,
+				coremap_vaddr(entry));
+			*pte = (*pte & ~PTE_VALID) | PTE_BUSY;
+			entry->busy = true;
+			i++;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+
+	// Shoot the user pages out of the TLBs, one address space at a time
+	shootdown_init(&sd, NULL);
+	for (i = start; i < start + size; i++) {
+		struct coremapentry *entry = coremap + i;
+		struct addrspace *as;
+		vaddr_t vaddr;
+
+		spinlock_acquire(&stealmem_lock);
+		as = entry->busy ? coremap_owner(entry) : NULL;
+		vaddr = coremap_vaddr(entry);
+		spinlock_release(&stealmem_lock);
+		if (as == NULL) continue;
+		if (as != sd.sd_as) {
+			shootdown_flush(&sd);
+			shootdown_init(&sd, as);
+		}
+		shootdown_add(&sd, vaddr);
+	}
+	shootdown_flush(&sd);
+
+	for (i = start; i < start + size; i++) {
+		bool busy;
+
+		spinlock_acquire(&stealmem_lock);
+		busy = coremap[i].busy;
+		spinlock_release(&stealmem_lock);
+		if (!busy) continue;
+		if (!ok) {
+			// Out of frames; put the rest back
+			spinlock_acquire(&stealmem_lock);
+			pte_t *pte = pt_lookup(coremap_owner(coremap + i)->as_pt,
+				coremap_vaddr(coremap + i));
+			*pte = (*pte & ~PTE_BUSY) | PTE_VALID;
+			coremap[i].busy = false;
+			spinlock_release(&stealmem_lock);
+			continue;
+		}
+		ok = compact_move(i);
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	if (!ok) {
+		// Give back what we got; the pages that stayed are their owners'
+		for (i = start; i < start + size; i++) {
+			if (coremap[i].owner == 0) {
+				buddy_free_run(i, 1);
+			}
+		}
+		spinlock_release(&stealmem_lock);
+		lock_release(compact_lock);
+		return 0;
+	}
+	// Now as buddy_alloc_run leaves it; the pages moved from had their
+	// owners' single page runs
+	for (i = start; i < start + size; i++) {
+		coremap[i].nextentry = -1;
+		coremap[i].runlength = 0;
+	}
+	coremap[start].runlength = npages;
+	if (npages < (unsigned long)size) {
+		buddy_free_run(start + npages, size - npages);
+	}
+	spinlock_release(&stealmem_lock);
+	lock_release(compact_lock);
+
+	vmstats_inc(VMSTAT_COMPACT);
+	return (paddr_t)(pmemstart + start * PAGE_SIZE);
+}
+
+/**
+	Ask the vm_compact job for a free block big enough for `npages`.
+*/
+static void compact_request(unsigned long npages) {
+	unsigned order = order_for(npages);
+
+	if (order > COMPACT_MAXORDER || !compact_ready) return;
+	spinlock_acquire(&stealmem_lock);
+	if (order > compact_order) {
+		compact_order = order;
+	}
+	spinlock_release(&stealmem_lock);
+	work_enqueue(kworkq, &compact_work);
+}
+
+/**
+	Background job: free up a block of 2^compact_order pages if no free
+	block is that big, and hand it back to the buddy system whole.
+*/
+static void vm_compact_run(void *data) {
+	unsigned order, o;
+	paddr_t pa;
+	bool have;
+
+	(void)data;
+
+	spinlock_acquire(&stealmem_lock);
+	order = compact_order;
+	compact_order = 0;
+	have = false;
+	for (o = order; o <= COREMAP_MAXORDER; o++) {
+		if (freelists[o] >= 0) {
+			have = true;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+	if (order == 0 || have) return;
+
+	pa = compact_alloc(1UL << order);
+	if (pa != 0) {
+		spinlock_acquire(&stealmem_lock);
+		freeppageid((pa - pmemstart) / PAGE_SIZE);
+		spinlock_release(&stealmem_lock);
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t alloc_kpages(int npages) {
+	paddr_t pa;
+	if (kva_forced && npages > 1 && coremapsetup) {
+		return kva_alloc(npages);
+	}
+	pa = getkpages(npages);
+	if (pa==0 && npages == 1) {
+		// Push a user page out to make room
+		pa = evict_page();
+	}
+	if (pa==0 && npages > 1 && coremapsetup) {
+		// Move user pages out of the way of a run, or have it done
+		// for next time if we can't wait for that here
+		pa = compact_alloc(npages);
+		if (pa == 0 && (curthread->t_curspl != 0 ||
+				curthread->t_in_interrupt)) {
+			compact_request(npages);
+		}
+	}
+	if (pa==0 && npages > 1 && coremapsetup) {
+		// The memory may be there, just not in one piece
+		return kva_alloc(npages);
+	}
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+bool vm_kva_force(bool on) {
+	bool old = kva_forced;
+	kva_forced = on;
+	return old;
+}
+
+void free_kpages(vaddr_t addr) {
+
+	if (addr >= MIPS_KSEG2) {
+		kva_free(addr);
+		return;
+	}
+
+
+	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	KASSERT(paddr % PAGE_SIZE == 0); // must be the address of a page
+
+	if (paddr < pmemstart) {
+		// Stolen before the coremap existed; can't be given back
+		return;
+	}
+	KASSERT(paddr < pmemend);
+
+	// convert physical address to page number
+	int pagenumber = (paddr - pmemstart) / PAGE_SIZE;
+
+	// We own this page, so nobody else changes its entry under us
+	struct coremapentry *kpage = coremap + pagenumber;
+	KASSERT(kpage->used);
+	if (kpage->runlength == 1 && kpage->nextentry < 0) {
+		pagecache_free(paddr);
+		return;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	freeppageid(pagenumber);
+	spinlock_release(&stealmem_lock);
+}
+
+void vm_tlbshootdown_all(void) {
+	int spl;
+
+	spl = splhigh();
+	tlbmgr_flush();
+	splx(spl);
+}
+
+void vm_tlbshootdown(const struct tlbshootdown *ts) {
+	int spl;
+
+	spl = splhigh();
+	tlbmgr_invalidate(ts->ts_vaddr & PAGE_FRAME);
+	splx(spl);
+}
+
+/**
+	Does the page at `pagevaddr` overlap a segment's file data
+	[filevaddr, filevaddr + filesz)? If not, it starts out all zeros.
+*/
+static bool as_page_has_filedata(struct vnode *v, vaddr_t pagevaddr,
+	vaddr_t filevaddr, size_t filesz) {
+
+	vaddr_t lo = pagevaddr > filevaddr ? pagevaddr : filevaddr;
+	vaddr_t hi = pagevaddr + PAGE_SIZE;
+	if (filevaddr + filesz < hi) hi = filevaddr + filesz;
+
+	return v != NULL && lo < hi;
+}
+
+/**
+	Read the part of the page at `pagevaddr` that overlaps a segment's file
+	data from the executable into the frame at `paddr`.
+*/
+static int as_read_filepage(struct vnode *v, vaddr_t pagevaddr, paddr_t paddr,
+	vaddr_t filevaddr, off_t fileoffset, size_t filesz) {
+
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	vaddr_t lo = pagevaddr > filevaddr ? pagevaddr : filevaddr;
+	vaddr_t hi = pagevaddr + PAGE_SIZE;
+	if (filevaddr + filesz < hi) hi = filevaddr + filesz;
+
+	KASSERT(v != NULL && lo < hi);
+
+	uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(paddr) + (lo - pagevaddr)),
+		hi - lo, fileoffset + (lo - filevaddr), UIO_READ);
+
+	result = VOP_READ(v, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
+static unsigned textcache_hash(struct vnode *v, vaddr_t vaddr) {
+	return (((uintptr_t)v >> 4) ^ (vaddr / PAGE_SIZE)) % TEXTCACHE_BUCKETS;
+}
+
+/**
+	Take cache slot `slot` off its hash chain. The slot keeps its contents.
+	Must be called with textcache_lock held.
+*/
+static void textcache_unlink(int slot) {
+	struct textcache_entry *tc = &textcache[slot];
+	int *link = &textcache_buckets[textcache_hash(tc->tc_vnode, tc->tc_vaddr)];
+
+	while (*link != slot) {
+		KASSERT(*link >= 0);
+		link = &textcache[*link].tc_next;
+	}
+	*link = tc->tc_next;
+	tc->tc_next = -1;
+}
+
+/**
+	Pick the cache slot to fill next: an empty one, or failing that one
+	whose frame only the cache still holds, so frames that are mapped stay
+	shared. Takes the slot under the hand if every frame is in use.
+	Must be called with textcache_lock held.
+*/
+static int textcache_victim(void) {
+	unsigned i;
+	int slot;
+
+	spinlock_acquire(&stealmem_lock);
+	for (i = 0; i < TEXTCACHE_SIZE; i++) {
+		slot = (textcache_hand + i) % TEXTCACHE_SIZE;
+		if (textcache[slot].tc_vnode == NULL ||
+		    coremap[(textcache[slot].tc_paddr - pmemstart) / PAGE_SIZE].refcount == 1) {
+			break;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+
+	if (i == TEXTCACHE_SIZE) {
+		slot = textcache_hand;
+	}
+	textcache_hand = (slot + 1) % TEXTCACHE_SIZE;
+	return slot;
+}
+
+/**
+	Fault in a page that comes from the executable through the page cache:
+	map the cached frame if there is one, otherwise read the page into a
+	new frame and cache that. Text pages are mapped read-only and data
+	pages copy-on-write, so a cached frame is never written.
+*/
+static int as_fault_in_cached(struct addrspace *as, vaddr_t faultaddress,
+	pte_t *pte, uint32_t flags, vaddr_t filevaddr, off_t fileoffset,
+	size_t filesz) {
+
+	struct vnode *v = as->as_vnode;
+	struct textcache_entry *tc;
+	struct vnode *oldvnode = NULL;
+	paddr_t oldpaddr = 0;
+	paddr_t paddr = 0;
+	pte_t old = *pte;
+	unsigned bucket = textcache_hash(v, faultaddress);
+	int slot;
+	int result;
+
+	lock_acquire(textcache_lock);
+	for (slot = textcache_buckets[bucket]; slot >= 0; slot = tc->tc_next) {
+		tc = &textcache[slot];
+		if (tc->tc_vnode == v && tc->tc_vaddr == faultaddress) {
+			paddr = tc->tc_paddr;
+			break;
+		}
+	}
+
+	if (paddr == 0) {
+		paddr = getupage();
+		if (paddr == 0) {
+			lock_release(textcache_lock);
+			return ENOMEM;
+		}
+		result = as_read_filepage(v, faultaddress, paddr,
+			filevaddr, fileoffset, filesz);
+		if (result) {
+			lock_release(textcache_lock);
+			freeupage(paddr);
+			return result;
+		}
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		curthread->t_usage.tu_majflt++;
+
+		// The frame's first reference (from getupage) is the cache's
+		slot = textcache_victim();
+		tc = &textcache[slot];
+		oldvnode = tc->tc_vnode;
+		oldpaddr = tc->tc_paddr;
+		if (oldvnode != NULL) {
+			textcache_unlink(slot);
+		}
+		VOP_INCREF(v);
+		tc->tc_vnode = v;
+		tc->tc_vaddr = faultaddress;
+		tc->tc_paddr = paddr;
+		tc->tc_next = textcache_buckets[bucket];
+		textcache_buckets[bucket] = slot;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte == old);
+	upage_incref_locked(paddr);
+	*pte = PTE_MAKE(paddr, PTE_VALID | ((flags & PTE_WRITABLE) ? PTE_COW : 0));
+	spinlock_release(&stealmem_lock);
+
+	lock_release(textcache_lock);
+
+	if (oldvnode != NULL) {
+		freeupage(oldpaddr);
+		VOP_DECREF(oldvnode);
+	}
+	return 0;
+}
+
+/**
+	Drop up to `max` cached pages: those of `v`, or of every file if `v`
+	is NULL, and with `idleonly` just the ones no process maps, whose
+	frames that frees. Frames still mapped by a process stay with it
+	until it lets go. Returns how many pages were dropped.
+*/
+static unsigned textcache_drop(struct vnode *v, bool idleonly, unsigned max) {
+	struct textcache_entry dropped[TEXTCACHE_PURGE_BATCH];
+	unsigned i, start = 0, ndropped, total = 0;
+	bool idle;
+
+	if (textcache_lock == NULL) {
+		return 0;
+	}
+
+	// A batch at a time, to keep the stack small
+	while (start < TEXTCACHE_SIZE && total < max) {
+		ndropped = 0;
+		lock_acquire(textcache_lock);
+		for (i = start; i < TEXTCACHE_SIZE && ndropped < TEXTCACHE_PURGE_BATCH &&
+		     total + ndropped < max; i++) {
+			struct textcache_entry *tc = &textcache[i];
+			if (tc->tc_vnode == NULL) continue;
+			if (v != NULL && tc->tc_vnode != v) continue;
+			if (idleonly) {
+				spinlock_acquire(&stealmem_lock);
+				idle = coremap[(tc->tc_paddr - pmemstart) / PAGE_SIZE].refcount == 1;
+				spinlock_release(&stealmem_lock);
+				if (!idle) continue;
+			}
+			textcache_unlink(i);
+			dropped[ndropped++] = *tc;
+			tc->tc_vnode = NULL;
+			tc->tc_paddr = 0;
+		}
+		lock_release(textcache_lock);
+		start = i;
+		total += ndropped;
+
+		// Last references may reclaim the vnode, so not under the lock
+		for (i = 0; i < ndropped; i++) {
+			freeupage(dropped[i].tc_paddr);
+			VOP_DECREF(dropped[i].tc_vnode);
+		}
+	}
+	return total;
+}
+
+/**
+	Drop every cached page of `v`, or the whole cache if `v` is NULL.
+*/
+void vm_textcache_purge(struct vnode *v) {
+	textcache_drop(v, false, TEXTCACHE_SIZE);
+}
+
+/**
+	Shrinker: drop cached pages no process is using. Not when this thread
+	is the one faulting a page into the cache.
+*/
+static unsigned textcache_shrink(unsigned npages) {
+	if (textcache_lock == NULL || lock_do_i_hold(textcache_lock)) {
+		return 0;
+	}
+	return textcache_drop(NULL, true, npages);
+}
+
+static unsigned as_oomsize(struct addrspace *as) {
+	return oom_pages[as->as_ownerid];
+}
+
+/**
+	A user fault couldn't get a frame, even after trying to evict a page
+	to swap. Have the kernel's caches give memory back; failing that,
+	have the process with the most pages
+	killed and let it run so it can exit. Returns true if the fault is
+	worth retrying, false if it should fail: this process is the one
+	being killed, there's nothing to kill, or we've waited long enough.
+*/
+static bool vm_oom(unsigned attempt) {
+	pid_t victim;
+
+	if (attempt >= OOM_RETRIES || curproc->p_oomkilled) {
+		return false;
+	}
+	if (curthread->t_in_interrupt || curthread->t_iplhigh_count > 0) {
+		return false;
+	}
+	if (vm_shrink(shrink_high) > 0) {
+		return true;
+	}
+
+	lock_acquire(oom_lock);
+	bzero(oom_pages, sizeof(oom_pages));
+	spinlock_acquire(&stealmem_lock);
+	for (int i = 0; i < totalpagecount; i++) {
+		if (coremap[i].used && coremap[i].owner != 0) {
+			oom_pages[coremap[i].owner]++;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+	victim = proc_oomkill(as_oomsize);
+	lock_release(oom_lock);
+
+	if (victim == 0 || victim == curproc->p_id) {
+		return false;
+	}
+	thread_yield();
+	return true;
+}
+
+/**
+	Find the mapobj for `v`, making one if there is none yet, and take a
+	reference to it. A NULL `v` always gets a new anonymous one.
+	Returns NULL if out of memory.
+	Must be called with mmap_lock held.
+*/
+static struct mapobj *mapobj_get(struct vnode *v) {
+	struct mapobj *mo;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+
+	for (mo = mapobjs; v != NULL && mo != NULL; mo = mo->mo_next) {
+		if (mo->mo_vnode == v) {
+			mo->mo_refcount++;
+			return mo;
+		}
+	}
+
+	mo = kmalloc(sizeof(struct mapobj));
+	if (mo == NULL) {
+		return NULL;
+	}
+	mo->mo_vnode = v;
+	mo->mo_refcount = 1;
+	mo->mo_pages = NULL;
+	mo->mo_cached = NULL;
+	mo->mo_npages = 0;
+	mo->mo_next = NULL;
+	if (v != NULL) {
+		VOP_INCOPEN(v);
+		VOP_INCREF(v);
+		mo->mo_next = mapobjs;
+		mapobjs = mo;
+	}
+	return mo;
+}
+
+/**
+	Make room in mo_pages for (at least) the first `npages` file pages.
+	Must be called with mmap_lock held.
+*/
+static int mapobj_grow(struct mapobj *mo, unsigned npages) {
+	unsigned n = mo->mo_npages > 0 ? mo->mo_npages : 8;
+	paddr_t *pages;
+	struct fcpage **cached = NULL;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+
+	if (npages <= mo->mo_npages) {
+		return 0;
+	}
+	while (n < npages) {
+		n *= 2;
+	}
+	pages = kmalloc(n * sizeof(paddr_t));
+	if (pages == NULL) {
+		return ENOMEM;
+	}
+	if (mo->mo_vnode != NULL) {
+		cached = kmalloc(n * sizeof(struct fcpage *));
+		if (cached == NULL) {
+			kfree(pages);
+			return ENOMEM;
+		}
+	}
+	for (unsigned i = 0; i < n; i++) {
+		pages[i] = i < mo->mo_npages ? mo->mo_pages[i] : 0;
+		if (cached != NULL) {
+			cached[i] = i < mo->mo_npages ? mo->mo_cached[i] : NULL;
+		}
+	}
+	kfree(mo->mo_pages);
+	kfree(mo->mo_cached);
+	mo->mo_pages = pages;
+	mo->mo_cached = cached;
+	mo->mo_npages = n;
+	return 0;
+}
+
+/**
+	Can mapobj_getpage, and mapobj_dirty too if `forwrite`, do file page
+	`index` without going to the file system?
+	Must be called with mmap_lock held.
+*/
+static bool mapobj_ready(struct mapobj *mo, unsigned index, bool forwrite) {
+	paddr_t slot = mo->mo_pages[index];
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+
+	if (mo->mo_vnode == NULL) {
+		return true;
+	}
+	if (slot == 0 || (slot & MO_BUSY)) {
+		return false;
+	}
+	// A cache page has to be got for writing again (see mapobj_readin)
+	return !forwrite || (slot & (MO_CACHED | MO_DIRTY)) != MO_CACHED;
+}
+
+/**
+	Read file page `index` of `mo` in from the file system, and get it
+	for writing too if `forwrite`, so that it is mapobj_ready; a fault
+	that's about to map it MADV_SEQUENTIAL passes the read-ahead it wants
+	in `ra` pages. Whatever lies past the end of the file reads as zeros.
+	A cache page got for writing has had the blocks under it allocated,
+	and is kept dirty for as long as it's mapped.
+	Called without mmap_lock, holding a reference to `mo`. The slot is
+	MO_BUSY meanwhile, so anyone else after the page waits for us.
+*/
+static int mapobj_readin(struct mapobj *mo, unsigned index, bool forwrite,
+	unsigned ra) {
+
+	struct iovec iov;
+	struct uio u;
+	struct fcpage *pp;
+	paddr_t slot, paddr;
+	int result = 0;
+
+	KASSERT(mo->mo_vnode != NULL);
+
+	lock_acquire(mmap_lock);
+	KASSERT(mo->mo_refcount > 0);
+	KASSERT(index < mo->mo_npages);
+	while (mo->mo_pages[index] & MO_BUSY) {
+		cv_wait(mmap_cv, mmap_lock);
+	}
+	if (mapobj_ready(mo, index, forwrite)) {
+		lock_release(mmap_lock);
+		return 0;
+	}
+	slot = mo->mo_pages[index];
+	pp = slot != 0 ? mo->mo_cached[index] : NULL;
+	mo->mo_pages[index] = slot | MO_BUSY;
+	lock_release(mmap_lock);
+
+	if (slot == 0) {
+		if (ra > 1) {
+			// Have the file system read on ahead in one go; the
+			// faults that follow find the pages in its cache
+			(void)VOP_ADVISE(mo->mo_vnode, (off_t)index * PAGE_SIZE,
+				(off_t)ra * PAGE_SIZE, POSIX_FADV_WILLNEED);
+		}
+		result = VOP_GETPAGE(mo->mo_vnode, index, false, &pp);
+		if (result == 0) {
+			// The cache's own reference covers the mapobj's
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			slot = filecache_paddr(pp) | MO_CACHED;
+		} else if (result == ENOSYS) {
+			paddr = getupage();
+			if (paddr == 0) {
+				result = ENOMEM;
+			} else {
+				// A short read leaves the rest of the (zeroed)
+				// frame alone
+				uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr),
+					PAGE_SIZE, (off_t)index * PAGE_SIZE, UIO_READ);
+				result = VOP_READ(mo->mo_vnode, &u);
+				if (result) {
+					freeupage(paddr);
+				} else {
+					vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+					curthread->t_usage.tu_majflt++;
+					// The frame's first reference (from
+					// getupage) is the mapobj's
+					slot = paddr;
+				}
+			}
+		}
+	}
+
+	if (result == 0 && forwrite && (slot & (MO_CACHED | MO_DIRTY)) == MO_CACHED) {
+		struct fcpage *wpp;
+
+		result = VOP_GETPAGE(mo->mo_vnode, index, true, &wpp);
+		if (result == 0) {
+			KASSERT(wpp == pp);
+			filecache_mapwrite(wpp);
+			filecache_release(wpp);
+			slot |= MO_DIRTY;
+		}
+	}
+
+	lock_acquire(mmap_lock);
+	KASSERT(mo->mo_pages[index] & MO_BUSY);
+	if (slot & MO_CACHED) {
+		mo->mo_cached[index] = pp;
+	}
+	mo->mo_pages[index] = slot;
+	cv_broadcast(mmap_cv, mmap_lock);
+	lock_release(mmap_lock);
+	return result;
+}
+
+/**
+	The frame holding file page `index`. Pages of files are read in by
+	mapobj_readin, and until then this returns EAGAIN; anonymous ones are
+	zero filled here on first use.
+	Must be called with mmap_lock held.
+*/
+static int mapobj_getpage(struct mapobj *mo, unsigned index, paddr_t *ret) {
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+	KASSERT(index < mo->mo_npages);
+
+	if (!mapobj_ready(mo, index, false)) {
+		return EAGAIN;
+	}
+	if (mo->mo_pages[index] != 0) {
+		*ret = mo->mo_pages[index] & PAGE_FRAME;
+		return 0;
+	}
+
+	paddr = getupage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	mo->mo_pages[index] = paddr;
+	*ret = paddr;
+	return 0;
+}
+
+/**
+	File page `index`, already got, is about to be written through a
+	shared mapping. A cache page has to have been got for writing by
+	mapobj_readin first, so the file system could allocate its blocks;
+	until then this returns EAGAIN.
+	Must be called with mmap_lock held.
+*/
+static int mapobj_dirty(struct mapobj *mo, unsigned index) {
+	KASSERT(lock_do_i_hold(mmap_lock));
+	KASSERT(mo->mo_pages[index] != 0);
+
+	if (!mapobj_ready(mo, index, true)) {
+		return EAGAIN;
+	}
+	mo->mo_pages[index] |= MO_DIRTY;
+	return 0;
+}
+
+/**
+	Write the dirty pages among file pages [first, first + npages) back
+	with VOP_WRITE, stopping at the current end of the file: a mapping
+	never makes a file longer. Pages stay marked dirty, as other mappings
+	may still have them writable and go on changing them without faulting.
+	Returns the first error, after trying every page.
+	Called without mmap_lock, as mapobj_readin, holding a reference to
+	`mo` so the frames stay put.
+*/
+static int mapobj_writeback(struct mapobj *mo, unsigned first, unsigned npages) {
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	paddr_t slot;
+	int result, err = 0;
+
+	if (mo->mo_vnode == NULL) {
+		return 0;
+	}
+	result = VOP_STAT(mo->mo_vnode, &st);
+	if (result) {
+		return result;
+	}
+
+	for (unsigned i = first; i < first + npages; i++) {
+		off_t pos = (off_t)i * PAGE_SIZE;
+		if (pos >= st.st_size) break;
+		// (mapobj_grow may move the array meanwhile)
+		lock_acquire(mmap_lock);
+		slot = i < mo->mo_npages ? mo->mo_pages[i] : 0;
+		lock_release(mmap_lock);
+		if (!(slot & MO_DIRTY)) continue;
+		// (the file system writes back its own)
+		if (slot & MO_CACHED) continue;
+
+		size_t len = st.st_size - pos < PAGE_SIZE ? st.st_size - pos : PAGE_SIZE;
+		uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(slot & PAGE_FRAME),
+			len, pos, UIO_WRITE);
+		result = VOP_WRITE(mo->mo_vnode, &u);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
+
+/**
+	Drop a reference to `mo`. The last one frees its frames and closes
+	the file; any dirty pages were written back as each writable shared
+	mapping went away.
+*/
+static void mapobj_put(struct mapobj *mo) {
+	struct mapobj **pp;
+
+	lock_acquire(mmap_lock);
+	KASSERT(mo->mo_refcount > 0);
+	if (--mo->mo_refcount > 0) {
+		lock_release(mmap_lock);
+		return;
+	}
+	if (mo->mo_vnode != NULL) {
+		for (pp = &mapobjs; *pp != mo; pp = &(*pp)->mo_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = mo->mo_next;
+	}
+	lock_release(mmap_lock);
+
+	// Nobody can find it now. Closing may reclaim the vnode, so this
+	// isn't done under the lock.
+	for (unsigned i = 0; i < mo->mo_npages; i++) {
+		if (mo->mo_pages[i] & MO_CACHED) {
+			filecache_release(mo->mo_cached[i]);
+		} else if (mo->mo_pages[i] != 0) {
+			freeupage(mo->mo_pages[i] & PAGE_FRAME);
+		}
+	}
+	if (mo->mo_vnode != NULL) {
+		vfs_close(mo->mo_vnode);
+	}
+	kfree(mo->mo_pages);
+	kfree(mo->mo_cached);
+	kfree(mo);
+}
+
+static bool mmapregion_contains(const struct mmapregion *mr, vaddr_t vaddr) {
+	return vaddr >= mr->mr_start && vaddr < mr->mr_start + mr->mr_npages * PAGE_SIZE;
+}
+
+/**
+	Index in `as`'s mapping table of the first mapping that starts above
+	`vaddr`; the one before it (if any) is the only one that can contain
+	`vaddr`. Must be called with mmap_lock held.
+*/
+static unsigned as_mapindex(struct addrspace *as, vaddr_t vaddr) {
+	unsigned lo = 0, hi = as->as_nmmaps;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (as->as_mmaps[mid]->mr_start <= vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+	The mapping in `as` containing `vaddr`, or NULL. Tries the one found
+	last time first, since faults tend to come in runs on one mapping.
+	Must be called with mmap_lock held.
+*/
+static struct mmapregion *as_findmap(struct addrspace *as, vaddr_t vaddr) {
+	struct mmapregion *mr;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+
+	mr = as->as_lastmap;
+	if (mr != NULL && mmapregion_contains(mr, vaddr)) {
+		return mr;
+	}
+
+	i = as_mapindex(as, vaddr);
+	if (i == 0 || !mmapregion_contains(as->as_mmaps[i - 1], vaddr)) {
+		return NULL;
+	}
+	as->as_lastmap = as->as_mmaps[i - 1];
+	return as->as_lastmap;
+}
+
+/**
+	Enter `mr` in `as`'s mapping table, in address order, growing the table
+	if it's full. Must be called with mmap_lock held.
+*/
+static int as_insertmap(struct addrspace *as, struct mmapregion *mr) {
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+
+	if (as->as_nmmaps == as->as_mmapslots) {
+		unsigned slots = as->as_mmapslots ? 2 * as->as_mmapslots : MMAP_INITSLOTS;
+		struct mmapregion **table = kmalloc(slots * sizeof(*table));
+		if (table == NULL) {
+			return ENOMEM;
+		}
+		for (i = 0; i < as->as_nmmaps; i++) {
+			table[i] = as->as_mmaps[i];
+		}
+		kfree(as->as_mmaps);
+		as->as_mmaps = table;
+		as->as_mmapslots = slots;
+	}
+
+	for (i = as->as_nmmaps; i > 0 && as->as_mmaps[i - 1]->mr_start > mr->mr_start; i--) {
+		as->as_mmaps[i] = as->as_mmaps[i - 1];
+	}
+	as->as_mmaps[i] = mr;
+	as->as_nmmaps++;
+	return 0;
+}
+
+/**
+	Take the mapping at index `i` out of `as`'s mapping table.
+	Must be called with mmap_lock held.
+*/
+static void as_removemap(struct addrspace *as, unsigned i) {
+	KASSERT(lock_do_i_hold(mmap_lock));
+	KASSERT(i < as->as_nmmaps);
+
+	if (as->as_lastmap == as->as_mmaps[i]) {
+		as->as_lastmap = NULL;
+	}
+	for (; i + 1 < as->as_nmmaps; i++) {
+		as->as_mmaps[i] = as->as_mmaps[i + 1];
+	}
+	as->as_nmmaps--;
+}
+
+/**
+	First touch of a page of a mapped file: map the file's frame. A shared
+	mapping maps it directly, but only writable once it is written, so we
+	know which pages to write back; a private one maps it copy-on-write.
+	Private anonymous memory doesn't need the mapobj at all and is filled
+	in just like the heap. Returns EAGAIN if the file page isn't
+	mapobj_ready yet.
+	Must be called with mmap_lock held.
+*/
+static int as_fault_in_mmap(struct addrspace *as, struct mmapregion *mr,
+	vaddr_t faultaddress, pte_t *pte, bool write) {
+
+	struct mapobj *mo = mr->mr_obj;
+	unsigned index = mr->mr_firstpage + (faultaddress - mr->mr_start) / PAGE_SIZE;
+	pte_t old = *pte;
+	uint32_t flags;
+	paddr_t paddr;
+	int result;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+	KASSERT(!(old & (PTE_VALID | PTE_BUSY | PTE_SWAPPED)));
+
+	if (!mr->mr_shared && mo->mo_vnode == NULL && write && mr->mr_writable) {
+		// A private frame of our own, which can be evicted like any other
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		paddr = getupage();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		spinlock_acquire(&stealmem_lock);
+		KASSERT(*pte == old);
+		upage_setowner(paddr, as, faultaddress);
+		*pte = PTE_MAKE(paddr, PTE_VALID | PTE_WRITABLE);
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+
+	if (!mr->mr_shared && mo->mo_vnode == NULL) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		paddr = zeropage;
+	} else {
+		result = mapobj_getpage(mo, index, &paddr);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (!mr->mr_shared) {
+		flags = mr->mr_writable ? PTE_COW : 0;
+	} else if ((write || mo->mo_vnode == NULL) && mr->mr_writable) {
+		// (anonymous pages have nowhere to be written back to, so
+		// there's no need to wait for the first write)
+		result = mapobj_dirty(mo, index);
+		if (result) {
+			return result;
+		}
+		flags = PTE_SHARED | PTE_WRITABLE;
+	} else {
+		flags = PTE_SHARED;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte == old);
+	upage_incref_locked(paddr);
+	*pte = PTE_MAKE(paddr, PTE_VALID | flags);
+	spinlock_release(&stealmem_lock);
+	return 0;
+}
+
+/**
+	First write to a resident page of a writable shared mapping: mark the
+	file page dirty and make the PTE writable. Returns EAGAIN if the file
+	system has to be asked first, as in as_fault_in_mmap.
+	Must be called with mmap_lock held.
+*/
+static int as_dirty_mmap(struct mmapregion *mr, vaddr_t faultaddress, pte_t *pte) {
+	unsigned index = mr->mr_firstpage + (faultaddress - mr->mr_start) / PAGE_SIZE;
+	int result;
+
+	KASSERT(lock_do_i_hold(mmap_lock));
+	KASSERT(mr->mr_shared && mr->mr_writable);
+
+	result = mapobj_dirty(mr->mr_obj, index);
+	if (result) {
+		return result;
+	}
+
+	// Shared pages are never evicted, so nobody else changes this PTE
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte & PTE_VALID);
+	*pte |= PTE_WRITABLE;
+	spinlock_release(&stealmem_lock);
+	return 0;
+}
+
+/**
+	The segment, heap or stack `vaddr` is in, as [*lo, *hi). False if
+	it's in none of them (so in a file mapping).
+*/
+static bool as_region_bounds(struct addrspace *as, vaddr_t vaddr, vaddr_t *lo, vaddr_t *hi) {
+	vaddr_t vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vaddr_t vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	vaddr_t heaptop = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+
+	if (vaddr >= as->as_vbase1 && vaddr < vtop1) {
+		*lo = as->as_vbase1;
+		*hi = vtop1;
+	} else if (vaddr >= as->as_vbase2 && vaddr < vtop2) {
+		*lo = as->as_vbase2;
+		*hi = vtop2;
+	} else if (vaddr >= as->as_heapbase && vaddr < heaptop) {
+		*lo = as->as_heapbase;
+		*hi = heaptop;
+	} else if (vaddr >= SMARTVM_STACKBASE && vaddr < USERSTACK) {
+		*lo = SMARTVM_STACKBASE;
+		*hi = USERSTACK;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+	Whether the page at `vaddr` can be read in along with a fault on a
+	neighbour: in [lo, hi), out on the disk, and in slot `slot`.
+*/
+static bool as_swap_neighbour(struct addrspace *as, vaddr_t vaddr, unsigned slot,
+	vaddr_t lo, vaddr_t hi) {
+
+	pte_t *pte;
+
+	if (vaddr < lo || vaddr >= hi) return false;
+	pte = pt_lookup(as->as_pt, vaddr);
+	if (pte == NULL) return false;
+	if ((*pte & (PTE_VALID | PTE_BUSY | PTE_SWAPPED)) != PTE_SWAPPED) return false;
+	if (PTE_SWAPSLOT(*pte) != slot) return false;
+	return swap_ondisk(slot);
+}
+
+/**
+	Read the evicted page at `faultaddress` (whose PTE was `old`) back
+	into `paddr`. If it went out to the disk in a cluster (see
+	evict_page), the pages of the same region that went with it and are
+	still out come back in the same read, into frames that happen to be
+	free, and are mapped here too. They aren't marked referenced, so if
+	they turn out not to be wanted the clock takes them first.
+*/
+static int as_swapin(struct addrspace *as, vaddr_t faultaddress, pte_t old, paddr_t paddr) {
+	unsigned slot = PTE_SWAPSLOT(old);
+	paddr_t paddrs[SWAP_CLUSTER];
+	vaddr_t lo, hi, base, v;
+	unsigned nback, n, i;
+	pte_t *pte;
+	int result;
+
+	n = 1;
+	nback = 0;
+	if (as_region_bounds(as, faultaddress, &lo, &hi) && swap_ondisk(slot)) {
+		// Ahead first, since that's where sequential access goes
+		while (n < SWAP_CLUSTER && as_swap_neighbour(as,
+			faultaddress + n * PAGE_SIZE, slot + n, lo, hi)) {
+			n++;
+		}
+		while (n < SWAP_CLUSTER && nback < slot && as_swap_neighbour(as,
+			faultaddress - (nback + 1) * PAGE_SIZE, slot - (nback + 1), lo, hi)) {
+			nback++;
+			n++;
+		}
+	}
+
+	paddrs[nback] = paddr;
+	for (i = 0; i < n; i++) {
+		if (i != nback && (paddrs[i] = getupage_nowait()) == 0) break;
+	}
+	if (i < n) {
+		// No room to spare; just the one page, then
+		while (i-- > 0) {
+			if (i != nback) freeupage(paddrs[i]);
+		}
+		n = 1;
+		nback = 0;
+	}
+
+	if (n == 1) {
+		result = swap_read(slot, paddr);
+	} else {
+		result = swap_read_cluster(slot - nback, paddrs, n);
+	}
+	if (result) {
+		for (i = 0; i < n; i++) {
+			if (i != nback) freeupage(paddrs[i]);
+		}
+		return result;
+	}
+
+	base = faultaddress - nback * PAGE_SIZE;
+	slot -= nback;
+	for (i = 0; i < n; i++) {
+		swap_free(slot + i);
+	}
+
+	// Only we change a non-resident PTE, as in as_fault_in
+	KASSERT(lock_do_i_hold(as->as_faultlock));
+	spinlock_acquire(&stealmem_lock);
+	for (i = 0; i < n; i++) {
+		if (i == nback) continue;
+		v = base + i * PAGE_SIZE;
+		pte = pt_lookup(as->as_pt, v);
+		KASSERT(pte != NULL && (*pte & PTE_SWAPPED) && PTE_SWAPSLOT(*pte) == slot + i);
+		upage_setowner(paddrs[i], as, v);
+		coremap[(paddrs[i] - pmemstart) / PAGE_SIZE].referenced = false;
+		*pte = PTE_MAKE(paddrs[i], PTE_VALID | (*pte & (PTE_WRITABLE | PTE_COW)));
+	}
+	spinlock_release(&stealmem_lock);
+
+	return 0;
+}
+
+/**
+	First touch of a page, or touch of a page that was evicted: give it a
+	frame, fill it from swap or from the executable (leaving it zeroed for
+	bss, heap and stack), and enter it in the page table.
+	A read of a page that starts out zeroed maps the shared zero page
+	instead; the first write takes a private copy.
+	The caller has already checked the address is valid.
+*/
+static int as_fault_in(struct addrspace *as, vaddr_t faultaddress, pte_t *pte, bool write) {
+	vaddr_t vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vaddr_t vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	pte_t old = *pte;
+	uint32_t flags;
+	vaddr_t filevaddr = 0;
+	off_t fileoffset = 0;
+	size_t filesz = 0;
+	bool zerofill;
+	paddr_t paddr;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(as->as_faultlock));
+	KASSERT(!(old & (PTE_VALID | PTE_BUSY)));
+
+	if (old & PTE_SWAPPED) {
+		// Keeps the permissions it had when it was evicted
+		flags = old & (PTE_WRITABLE | PTE_COW);
+	} else if (faultaddress >= as->as_vbase1 && faultaddress < vtop1) {
+		flags = as->as_dirtiable1 ? PTE_WRITABLE : 0;
+		filevaddr = as->as_filevaddr1;
+		fileoffset = as->as_fileoffset1;
+		filesz = as->as_filesz1;
+	} else if (faultaddress >= as->as_vbase2 && faultaddress < vtop2) {
+		flags = as->as_dirtiable2 ? PTE_WRITABLE : 0;
+		filevaddr = as->as_filevaddr2;
+		fileoffset = as->as_fileoffset2;
+		filesz = as->as_filesz2;
+	} else {
+		// Stack or heap
+		flags = PTE_WRITABLE;
+	}
+
+	zerofill = !(old & PTE_SWAPPED) &&
+		!as_page_has_filedata(as->as_vnode, faultaddress, filevaddr, filesz);
+
+	// Not while loading: a read-only mapping then is still written to
+	if (zerofill && !write && as->as_ready) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		spinlock_acquire(&stealmem_lock);
+		KASSERT(*pte == old);
+		upage_incref_locked(zeropage);
+		*pte = PTE_MAKE(zeropage, PTE_VALID | ((flags & PTE_WRITABLE) ? PTE_COW : 0));
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+
+	// Pages straight from the executable are shared through the page
+	// cache, except while loading (when read-only pages get written)
+	if (!zerofill && !(old & PTE_SWAPPED) && as->as_ready) {
+		return as_fault_in_cached(as, faultaddress, pte, flags,
+			filevaddr, fileoffset, filesz);
+	}
+
+	paddr = getupage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	if (old & PTE_SWAPPED) {
+		result = as_swapin(as, faultaddress, old, paddr);
+	} else if (!zerofill) {
+		result = as_read_filepage(as->as_vnode, faultaddress, paddr,
+			filevaddr, fileoffset, filesz);
+		if (!result) vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}
+
+	if (result) {
+		freeupage(paddr);
+		return result;
+	}
+
+	if (zerofill) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	} else {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		curthread->t_usage.tu_majflt++;
+	}
+
+	// Only we change a non-resident PTE (as_faultlock), but the clock
+	// must see the owner and the PTE change together
+	spinlock_acquire(&stealmem_lock);
+	KASSERT(*pte == old);
+	upage_setowner(paddr, as, faultaddress);
+	*pte = PTE_MAKE(paddr, PTE_VALID | flags);
+	spinlock_release(&stealmem_lock);
+
+	return 0;
+}
+
+/**
+	Write to a copy-on-write page. If we hold the only reference the frame
+	is simply made writable again; otherwise we take a private copy and
+	drop our reference to the shared one.
+	Returns EAGAIN if the PTE changed under us and the fault should retry.
+*/
+static int as_break_cow(struct addrspace *as, vaddr_t vaddr, pte_t *pte) {
+	pte_t old = *pte;
+	paddr_t oldpaddr = PTE_FRAME(old);
+	struct coremapentry *entry = coremap + (oldpaddr - pmemstart) / PAGE_SIZE;
+	paddr_t newpaddr;
+	bool last;
+
+	spinlock_acquire(&stealmem_lock);
+	if (*pte != old) {
+		spinlock_release(&stealmem_lock);
+		return EAGAIN;
+	}
+	if (entry->refcount == 1) {
+		// Everyone else already took their copy
+		upage_setowner(oldpaddr, as, vaddr);
+		*pte = (old & ~PTE_COW) | PTE_WRITABLE;
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+	spinlock_release(&stealmem_lock);
+
+	newpaddr = getupage();
+	if (newpaddr == 0) {
+		return ENOMEM;
+	}
+	if (oldpaddr != zeropage) {
+		// (a frame from getupage is already zeroed)
+		memcpy_page((void *)PADDR_TO_KVADDR(newpaddr),
+			    (const void *)PADDR_TO_KVADDR(oldpaddr));
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	if (*pte != old) {
+		spinlock_release(&stealmem_lock);
+		freeupage(newpaddr);
+		return EAGAIN;
+	}
+	upage_setowner(newpaddr, as, vaddr);
+	*pte = PTE_MAKE(newpaddr, ((old & PTE_FLAGMASK) & ~PTE_COW) | PTE_WRITABLE);
+	last = upage_decref_locked(oldpaddr);
+	spinlock_release(&stealmem_lock);
+
+	if (last) {
+		free_kpages(PADDR_TO_KVADDR(oldpaddr));
+	}
+	return 0;
+}
+
+/**
+	Put the translation for a resident page in the TLB.
+	Must be called with stealmem_lock held (so the page can't be evicted
+	between checking its PTE and loading it), which also has interrupts off.
+*/
+static void tlb_insert(vaddr_t faultaddress, paddr_t paddr, bool dirtiable) {
+	uint32_t elo;
+
+	KASSERT(spinlock_do_i_hold(&stealmem_lock));
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	curthread->t_usage.tu_faults++;
+
+	elo = paddr | (dirtiable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
+
+	DEBUG(DB_VM, "smartvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlbmgr_insert(faultaddress, elo);
+}
+
+/**
+	Fault-around. While faults on this CPU walk forwards a page at a time,
+	also load the next FAULTAROUND_PAGES pages into the TLB if they are
+	already resident, so a sequential scan traps once for every few pages
+	instead of once per page. Other access patterns don't trigger it, so
+	it doesn't push useful entries out of the 64-entry TLB. Pages are
+	loaded writable only if their PTE is, so COW and clean shared pages
+	still fault on the first write. 0 turns it off.
+	In a mapping `mr` that madvise has called MADV_SEQUENTIAL, every fault
+	loads FAULTAROUND_SEQPAGES, streaming or not; in a MADV_RANDOM one
+	there is no fault-around at all.
+	Called with stealmem_lock held, after loading `faultaddress`.
+*/
+#define FAULTAROUND_PAGES     4
+#define FAULTAROUND_SEQPAGES  16
+
+static void vm_faultaround(struct addrspace *as, struct mmapregion *mr,
+	vaddr_t faultaddress) {
+
+	struct cpu *c = curcpu->c_self;
+	bool streaming = faultaddress == c->c_tlb_lastfault + PAGE_SIZE;
+	int advice = mr != NULL ? mr->mr_advice : MADV_NORMAL;
+	unsigned npages = FAULTAROUND_PAGES;
+
+	c->c_tlb_lastfault = faultaddress;
+	if (advice == MADV_SEQUENTIAL) {
+		streaming = true;
+		npages = FAULTAROUND_SEQPAGES;
+	}
+	if (!streaming || advice == MADV_RANDOM || !as->as_ready) return;
+
+	for (unsigned i = 1; i <= npages; i++) {
+		vaddr_t v = faultaddress + i * PAGE_SIZE;
+		if (v >= USERSPACETOP) break;
+		pte_t *pte = pt_lookup(as->as_pt, v);
+		if (pte == NULL) break;
+		pte_t entry = *pte;
+		if (!(entry & PTE_VALID) || (entry & PTE_BUSY)) break;
+
+		coremap[(PTE_FRAME(entry) - pmemstart) / PAGE_SIZE].referenced = true;
+		tlbmgr_preload(v, PTE_FRAME(entry) | TLBLO_VALID |
+			((entry & PTE_WRITABLE) ? TLBLO_DIRTY : 0));
+		// The next fault past these still counts as sequential
+		c->c_tlb_lastfault = v;
+	}
+}
+
+/**
+	Handle a fault on a page we know belongs to the address space: fill it
+	in, break copy-on-write, and load it into the TLB. `mr` is the file
+	mapping the page is in, if any, in which case we hold mmap_lock.
+	Called with as_faultlock held. EAGAIN means the file page has to be
+	read in by mapobj_readin first.
+*/
+static int vm_fault_page(struct addrspace *as, struct mmapregion *mr,
+	int faulttype, vaddr_t faultaddress, pte_t *pte) {
+
+	bool filled = false;
+	int result;
+
+	for (;;) {
+		pte_t entry = *pte;
+
+		if (entry & PTE_BUSY) {
+			// Being written out to swap; wait for it to land there
+			thread_yield();
+			continue;
+		}
+
+		if (!(entry & PTE_VALID)) {
+			if (mr != NULL && !(entry & PTE_SWAPPED)) {
+				result = as_fault_in_mmap(as, mr, faultaddress, pte,
+					faulttype != VM_FAULT_READ);
+			} else {
+				result = as_fault_in(as, faultaddress, pte,
+					faulttype != VM_FAULT_READ);
+			}
+			if (result) {
+				return result;
+			}
+			filled = true;
+			continue;
+		}
+
+		if (faulttype != VM_FAULT_READ && (entry & PTE_SHARED) &&
+		    !(entry & PTE_WRITABLE) && mr != NULL && mr->mr_writable) {
+			result = as_dirty_mmap(mr, faultaddress, pte);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		if (faulttype == VM_FAULT_READONLY && !(entry & PTE_WRITABLE)) {
+			if (!(entry & PTE_COW)) {
+				kprintf("VM error: User process attempted write to read-only memory.\n");
+				if (mr != NULL) {
+					lock_release(mmap_lock);
+				}
+				lock_release(as->as_faultlock);
+				sys__exit(faulttype);
+			}
+			result = as_break_cow(as, faultaddress, pte);
+			if (result && result != EAGAIN) {
+				return result;
+			}
+			continue;
+		}
+
+		// if not yet ready, we're still loading segments
+		// Will always be dirtiable in this case (except shared COW frames)
+		bool dirtiable = (entry & PTE_WRITABLE) ||
+			(!as->as_ready && !(entry & PTE_COW));
+
+		spinlock_acquire(&stealmem_lock);
+		if (*pte != entry) {
+			// Picked for eviction just now
+			spinlock_release(&stealmem_lock);
+			continue;
+		}
+		coremap[(PTE_FRAME(entry) - pmemstart) / PAGE_SIZE].referenced = true;
+		if (dirtiable == ((entry & PTE_WRITABLE) != 0)) {
+			// The fast refill path can handle this page from now on
+			*pte = entry | PTE_REF;
+		}
+		if (!filled) {
+			// Still resident, the TLB just lost track of it
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+		tlb_insert(faultaddress, PTE_FRAME(entry), dirtiable);
+		vm_faultaround(as, mr, faultaddress);
+		spinlock_release(&stealmem_lock);
+		return 0;
+	}
+}
+
+/**
+	The part of vm_fault that can be retried once memory has been freed:
+	find what `faultaddress` in `as` is, and fault the page in. Returns
+	EAGAIN, to look again from the start, once it has had to let go of
+	its locks to read a mapped file's page in.
+*/
+static int vm_fault_as(struct addrspace *as, int faulttype, vaddr_t faultaddress) {
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	vaddr_t heapbase, heaptop;
+	struct mmapregion *mr = NULL;
+	struct mapobj *mo = NULL;
+	unsigned index = 0, ra = 0, n;
+	bool forwrite = false;
+	pte_t *pte;
+	int result;
+
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = SMARTVM_STACKBASE;
+	stacktop = USERSTACK;
+	heapbase = as->as_heapbase;
+	heaptop = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+
+	// Our other threads may be faulting on the same page, or on
+	// another one needing the same second-level table
+	lock_acquire(as->as_faultlock);
+
+	if (!(faultaddress >= vbase1 && faultaddress < vtop1) &&
+	    !(faultaddress >= vbase2 && faultaddress < vtop2) &&
+	    !(faultaddress >= heapbase && faultaddress < heaptop) &&
+	    !(faultaddress >= stackbase && faultaddress < stacktop)) {
+		if (faultaddress >= SMARTVM_STACKGUARD && faultaddress < stackbase) {
+			DEBUG(DB_VM, "smartvm: stack overflow at 0x%x\n", faultaddress);
+			lock_release(as->as_faultlock);
+			return EFAULT;
+		}
+
+		// Maybe a mapped file. The lock keeps the mapping from going
+		// away (or its pages from changing) until we're done.
+		lock_acquire(mmap_lock);
+		mr = as_findmap(as, faultaddress);
+		if (mr == NULL) {
+			lock_release(mmap_lock);
+			lock_release(as->as_faultlock);
+			return EFAULT;
+		}
+	}
+
+	// One page table walk instead of following the coremap chain
+	pte = pt_lookup_create(as->as_pt, faultaddress);
+	if (pte == NULL) {
+		result = ENOMEM;
+	} else {
+		result = vm_fault_page(as, mr, faulttype, faultaddress, pte);
+	}
+
+	if (result == EAGAIN) {
+		// Read it in without our locks (see struct mapobj); the
+		// mapping may be gone by the time we look again, but the
+		// reference keeps its pages
+		KASSERT(mr != NULL);
+		mo = mr->mr_obj;
+		mo->mo_refcount++;
+		index = mr->mr_firstpage + (faultaddress - mr->mr_start) / PAGE_SIZE;
+		forwrite = faulttype != VM_FAULT_READ && mr->mr_shared && mr->mr_writable;
+		if (mr->mr_advice == MADV_SEQUENTIAL) {
+			n = mr->mr_firstpage + mr->mr_npages - index;
+			ra = n < MMAP_RA_PAGES ? n : MMAP_RA_PAGES;
+		}
+	}
+
+	if (mr != NULL) {
+		lock_release(mmap_lock);
+	}
+	lock_release(as->as_faultlock);
+
+	if (mo != NULL) {
+		result = mapobj_readin(mo, index, forwrite, ra);
+		mapobj_put(mo);
+		if (result == 0) {
+			result = EAGAIN;
+		}
+	}
+	return result;
+}
+
+/**
+	TLB miss on the time page, which every address space has mapped
+	read-only at the same place. Anything but a read is an error.
+*/
+static int timepage_fault(int faulttype, vaddr_t faultaddress) {
+	int spl;
+
+	if (faulttype != VM_FAULT_READ) {
+		return EFAULT;
+	}
+
+	spl = splhigh();
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	curthread->t_usage.tu_faults++;
+	tlbmgr_insert(faultaddress, timepage_paddr() | TLBLO_VALID);
+	splx(spl);
+	return 0;
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress) {
+	struct addrspace *as;
+	unsigned attempt;
+	uint64_t start;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	if (faultaddress >= MIPS_KSEG2) {
+		return kva_fault(faultaddress);
+	}
+
+	DEBUG(DB_VM, "smartvm: fault: 0x%x\n", faultaddress);
+	TRACE(TR_VMFAULT, faulttype, faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/* Either a copy-on-write page or a real protection error */
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress == TIMEPAGE_VADDR) {
+		return timepage_fault(faulttype, faultaddress);
+	}
+
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_vbase1 != 0);
+	KASSERT(as->as_npages1 != 0);
+	KASSERT(as->as_vbase2 != 0);
+	KASSERT(as->as_npages2 != 0);
+	KASSERT(as->as_pt != NULL);
+	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
+	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+
+	start = lat_now();
+	for (attempt = 0; ; attempt++) {
+		do {
+			result = vm_fault_as(as, faulttype, faultaddress);
+		} while (result == EAGAIN);
+		if (result != ENOMEM || !vm_oom(attempt)) {
+			lat_record(LAT_FAULT, start);
+			return result;
+		}
+	}
+}
+
+struct addrspace * as_create(void) {
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
+	}
+
+	as->as_faultlock = lock_create("as_fault");
+	if (as->as_faultlock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		lock_destroy(as->as_faultlock);
+		kfree(as);
+		return NULL;
+	}
+	if (!coremap_addowner(as)) {
+		pt_destroy(as->as_pt);
+		lock_destroy(as->as_faultlock);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_vbase1 = 0;
+	as->as_npages1 = 0;
+	as->as_dirtiable1 = false;
+
+	as->as_vbase2 = 0;
+	as->as_npages2 = 0;
+	as->as_dirtiable2 = false;
+
+	as->as_filevaddr1 = as->as_filevaddr2 = 0;
+	as->as_fileoffset1 = as->as_fileoffset2 = 0;
+	as->as_filesz1 = as->as_filesz2 = 0;
+	as->as_vnode = NULL;
+
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	as->as_mmaps = NULL;
+	as->as_nmmaps = 0;
+	as->as_mmapslots = 0;
+	as->as_lastmap = NULL;
+	as->as_mmapbase = SMARTVM_STACKGUARD;
+	as->as_ready = false;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+	as->as_ntlbsnap = 0;
+	as->as_doomed = false;
+	as->as_reapnext = 0;
+	as->as_reaplink = NULL;
+
+	return as;
+}
+
+/**
+	Drop whatever a PTE holds (frame reference or swap slot) and clear it.
+	Waits out an eviction in progress. Returns true if that freed a frame.
+*/
+static bool as_release_pte(pte_t *pte) {
+	pte_t entry;
+	bool last = false;
+
+	for (;;) {
+		spinlock_acquire(&stealmem_lock);
+		entry = *pte;
+		if (!(entry & PTE_BUSY)) break;
+		spinlock_release(&stealmem_lock);
+		thread_yield();
+	}
+	if (entry & PTE_VALID) {
+		last = upage_decref_locked(PTE_FRAME(entry));
+	}
+	*pte = 0;
+	spinlock_release(&stealmem_lock);
+
+	if (last) {
+		free_kpages(PADDR_TO_KVADDR(PTE_FRAME(entry)));
+	} else if (entry & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(entry));
+	}
+	return last;
+}
+
+/**
+	Tear down a file mapping already taken out of its address space:
+	drop its pages, write back what it may have changed, and let go of
+	the file. Returns the write-back error, if any.
+*/
+static int as_unmap_region(struct addrspace *as, struct mmapregion *mr) {
+	int result = 0;
+
+	// A fault that found the mapping before it was taken out may still
+	// be filling in a page
+	lock_acquire(as->as_faultlock);
+	for (size_t i = 0; i < mr->mr_npages; i++) {
+		pte_t *pte = pt_lookup(as->as_pt, mr->mr_start + i * PAGE_SIZE);
+		if (pte != NULL && *pte != 0) {
+			as_release_pte(pte);
+		}
+	}
+	lock_release(as->as_faultlock);
+
+	if (mr->mr_shared && mr->mr_writable) {
+		result = mapobj_writeback(mr->mr_obj, mr->mr_firstpage, mr->mr_npages);
+	}
+
+	mapobj_put(mr->mr_obj);
+	kfree(mr);
+	return result;
+}
+
+/**
+	The first part of tearing down an address space: unmap the files
+	mapped into it, writing back what they changed, and close the
+	executable.
+*/
+static void as_unmapall(struct addrspace *as) {
+	// Nobody else can see the address space any more, so no mmap_lock
+	for (unsigned i = 0; i < as->as_nmmaps; i++) {
+		(void)as_unmap_region(as, as->as_mmaps[i]);
+	}
+	kfree(as->as_mmaps);
+	as->as_mmaps = NULL;
+	as->as_nmmaps = 0;
+
+	if (as->as_vnode != NULL) {
+		vfs_close(as->as_vnode);
+		as->as_vnode = NULL;
+	}
+}
+
+/**
+	Free the frames and swap slots the page table maps, going on from
+	slot as_reapnext, until `max` PTEs have been let go of or there are
+	no more (as_reapnext reaches PT_SLOTS). Returns how many frames that
+	freed. The caller has the address space to itself, or for a doomed
+	one holds reap_lock.
+*/
+static unsigned as_release_ptes(struct addrspace *as, unsigned max) {
+	struct pagetable *pt = as->as_pt;
+	unsigned n = 0, freed = 0;
+
+	while (n < max && as->as_reapnext < PT_SLOTS) {
+		unsigned i = as->as_reapnext / PT_TABLE_ENTRIES;
+		unsigned j = as->as_reapnext % PT_TABLE_ENTRIES;
+		pte_t *table = pt->pt_dir[i];
+
+		if (table == NULL) {
+			as->as_reapnext = (i + 1) * PT_TABLE_ENTRIES;
+			continue;
+		}
+		if (table[j] != 0) {
+			if (as_release_pte(&table[j])) {
+				freed++;
+			}
+			n++;
+		}
+		as->as_reapnext++;
+	}
+	return freed;
+}
+
+/**
+	The last part: free the page table, the coremap owner index and the
+	address space itself, once no PTEs are left.
+*/
+static void as_free(struct addrspace *as) {
+	KASSERT(as->as_reapnext == PT_SLOTS);
+	pt_destroy(as->as_pt);
+	coremap_removeowner(as);
+	lock_destroy(as->as_faultlock);
+	kfree(as);
+}
 
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_dirtiable2 = false;
+void as_destroy(struct addrspace *as) {
+	as_unmapall(as);
+	(void)as_release_ptes(as, PT_SLOTS);
+	as_free(as);
+}
 
-	as->as_stackpbase = 0;
+void as_doom(struct addrspace *as) {
+	// What the mappings wrote is in the files by the time anyone hears
+	// the process exited; only the frames wait
+	as_unmapall(as);
 
-	as->as_ready = false;
+	// The clock leaves the frames alone from here on
+	spinlock_acquire(&stealmem_lock);
+	as->as_doomed = true;
+	spinlock_release(&stealmem_lock);
 
-	return as;
+	lock_acquire(reap_lock);
+	as->as_reaplink = reap_list;
+	reap_list = as;
+	lock_release(reap_lock);
+	work_enqueue(kworkq, &reap_work);
 }
 
-void as_destroy(struct addrspace *as) {
-	// Delete all allocated segments
-	// quick way of cleaning by passing in physical page
-	// Should probably have a separate function for this.
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
-
-	// Finally, free up the actual address space structure
-	kfree(as);
+/**
+	Let go of up to `max` PTEs of the doomed address space at the head of
+	the list, and free it if that was the last of them. Returns how many
+	frames came back. Must be called with reap_lock held.
+*/
+static unsigned reap_batch(unsigned max) {
+	struct addrspace *as = reap_list;
+	unsigned freed;
+
+	KASSERT(lock_do_i_hold(reap_lock));
+
+	if (as == NULL) {
+		return 0;
+	}
+	freed = as_release_ptes(as, max);
+	if (as->as_reapnext == PT_SLOTS) {
+		reap_list = as->as_reaplink;
+		as_free(as);
+	}
+	return freed;
+}
+
+/**
+	Background job that frees the frames of exited processes, a batch
+	at a time so it doesn't hold up the rest of kworkq for long.
+*/
+static void as_reap_run(void *data) {
+	bool more;
+
+	(void)data;
+
+	lock_acquire(reap_lock);
+	(void)reap_batch(REAP_BATCH);
+	more = reap_list != NULL;
+	lock_release(reap_lock);
+
+	if (more) {
+		work_enqueue(kworkq, &reap_work);
+	}
+}
+
+/**
+	Shrinker: free doomed address spaces' frames now rather than waiting
+	for the job. Not when this thread is the one reaping.
+*/
+static unsigned reap_shrink(unsigned npages) {
+	unsigned freed = 0;
+
+	if (reap_lock == NULL || lock_do_i_hold(reap_lock)) {
+		return 0;
+	}
+	lock_acquire(reap_lock);
+	while (freed < npages && reap_list != NULL) {
+		freed += reap_batch(npages - freed);
+	}
+	lock_release(reap_lock);
+	return freed;
+}
+
+/**
+	The pages the address space this CPU is running has in its TLB, at
+	most AS_TLBSNAP of them, into `snap`. Going back from the hand
+	gives the ones tlbmgr loaded newest first. Returns how many.
+	Called with interrupts off.
+*/
+static unsigned tlbsnap_take(struct cpu *c, vaddr_t *snap) {
+	uint32_t ehi, elo;
+	unsigned n = 0;
+	int i, k;
+
+	for (k = 1; k <= NUM_TLB && n < AS_TLBSNAP; k++) {
+		i = (c->c_tlb_hand + NUM_TLB - k) % NUM_TLB;
+		tlb_read(&ehi, &elo, i);
+		if ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT != c->c_asid) continue;
+		if (!(elo & TLBLO_VALID)) continue;
+		snap[n++] = ehi & TLBHI_VPAGE;
+	}
+	tlb_setasid(c->c_asid);
+	return n;
+}
+
+/**
+	Load the `n` pages in `snap` for `as`, which this CPU just
+	activated, if they are still mapped; as vm_faultaround does, and
+	with the same permissions.
+	Called with interrupts off.
+*/
+static void tlbsnap_load(struct addrspace *as, const vaddr_t *snap, unsigned n) {
+	pte_t *pte;
+	pte_t entry;
+
+	if (n == 0) return;
+
+	spinlock_acquire(&stealmem_lock);
+	for (unsigned i = 0; i < n; i++) {
+		pte = pt_lookup(as->as_pt, snap[i]);
+		if (pte == NULL) continue;
+		entry = *pte;
+		if (!(entry & PTE_VALID) || (entry & PTE_BUSY)) continue;
+
+		coremap[(PTE_FRAME(entry) - pmemstart) / PAGE_SIZE].referenced = true;
+		tlbmgr_preload(snap[i], PTE_FRAME(entry) | TLBLO_VALID |
+			((entry & PTE_WRITABLE) ? TLBLO_DIRTY : 0));
+	}
+	spinlock_release(&stealmem_lock);
 }
 
 void as_activate(void) {
-	int i, spl;
-	struct addrspace *as;
+	int spl;
+	unsigned gen;
+	bool stale;
+	struct cpu *c;
+	struct addrspace *as, *prev;
+	vaddr_t saved[AS_TLBSNAP], load[AS_TLBSNAP];
+	unsigned nsaved = 0, nload = 0;
 
 	as = curproc_getas();
 #ifdef UW
         /* Kernel threads don't have an address spaces to activate */
 #endif
 	if (as == NULL) {
+		as_deactivate();
 		return;
 	}
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	// Entries tagged with our ASID are still good if it hasn't been
+	// reused since; only a new generation needs a flush, and only a
+	// shootdown we missed (see shootdown_flush) needs a purge
+	c = curcpu->c_self;
+	prev = c->c_curas;
+	if (prev != NULL && prev != as) {
+		nsaved = tlbsnap_take(c, saved);
+	}
+	spinlock_acquire(&asid_lock);
+	if (prev != NULL && prev != as) {
+		memcpy(prev->as_tlbsnap, saved, nsaved * sizeof(vaddr_t));
+		prev->as_ntlbsnap = nsaved;
+	}
+	if (prev != as) {
+		nload = as->as_ntlbsnap;
+		memcpy(load, as->as_tlbsnap, nload * sizeof(vaddr_t));
+	}
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_ASID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+		as->as_cpus = 0;
 	}
-	tlbfull = false;
+	gen = asid_generation;
+	stale = (as->as_cpus & CPUMASK_CPU(c->c_number)) == 0;
+	as->as_cpus |= CPUMASK_CPU(c->c_number);
+	c->c_curas = as;
+	spinlock_release(&asid_lock);
+
+	c->c_asid = as->as_asid;
+	if (c->c_asid_generation != gen) {
+		tlbmgr_flush();
+		c->c_asid_generation = gen;
+	} else if (stale) {
+		tlbmgr_purge(c->c_asid);
+	}
+	tlb_setasid(c->c_asid);
+	cpu_utlbdir[c->c_number] = (vaddr_t)as->as_pt->pt_dir;
+
+	// Back to where it was when it left
+	tlbsnap_load(as, load, nload);
 
 	splx(spl);
 }
 
 void as_deactivate(void) {
-	/* nothing */
+	struct cpu *c;
+	vaddr_t saved[AS_TLBSNAP];
+	unsigned nsaved = 0;
+	int spl;
+
+	// Don't let the fast refill path walk a table that's going away
+	spl = splhigh();
+	c = curcpu->c_self;
+	cpu_utlbdir[c->c_number] = 0;
+	if (c->c_curas != NULL) {
+		nsaved = tlbsnap_take(c, saved);
+	}
+	spinlock_acquire(&asid_lock);
+	if (c->c_curas != NULL) {
+		memcpy(c->c_curas->as_tlbsnap, saved, nsaved * sizeof(vaddr_t));
+		c->c_curas->as_ntlbsnap = nsaved;
+	}
+	c->c_curas = NULL;
+	spinlock_release(&asid_lock);
+	splx(spl);
 }
 
 int as_define_region(
@@ -398,6 +3747,11 @@ int as_define_region(
 
 	npages = sz / PAGE_SIZE;
 
+	// Keep clear of the stack reservation and its guard page
+	if (vaddr + sz > SMARTVM_STACKGUARD || vaddr + sz < vaddr) {
+		return ENOMEM;
+	}
+
 	/* We don't use these - all pages are read-write */
 	bool dirtiable = (bool)(writeable >> 1);
 	(void)readable;
@@ -425,49 +3779,576 @@ int as_define_region(
 	return EUNIMP;
 }
 
-static void as_zero_region(paddr_t paddr, unsigned npages) {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+int as_prepare_load(struct addrspace *as) {
+	vaddr_t vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vaddr_t vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+
+	// Nothing to allocate up front; every page is filled on first fault
+	KASSERT(as->as_vbase1 != 0);
+
+	// The heap starts out empty just past the highest segment
+	as->as_heapbase = vtop1 > vtop2 ? vtop1 : vtop2;
+	as->as_heaptop = as->as_heapbase;
+	return 0;
+}
+
+/**
+	Remember where the initialized data of the region containing `vaddr`
+	lives in the executable. The address space keeps `v` open until it is
+	destroyed so vm_fault can read from it later.
+*/
+int as_define_backing(struct addrspace *as, struct vnode *v,
+	vaddr_t vaddr, off_t offset, size_t filesize) {
+
+	if (as->as_vnode == NULL) {
+		VOP_INCOPEN(v);
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	if (vaddr >= as->as_vbase1 &&
+	    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		as->as_filevaddr1 = vaddr;
+		as->as_fileoffset1 = offset;
+		as->as_filesz1 = filesize;
+		return 0;
+	}
+
+	if (vaddr >= as->as_vbase2 &&
+	    vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		as->as_filevaddr2 = vaddr;
+		as->as_fileoffset2 = offset;
+		as->as_filesz2 = filesize;
+		return 0;
+	}
+
+	return EFAULT;
 }
 
-int as_prepare_load(struct addrspace *as) {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
+int as_complete_load(struct addrspace *as) {
+	as->as_ready = true;
+	return 0;
+}
+
+int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
+	(void)as;
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+/**
+	Give the child of a fork its own view of one parent PTE
+*/
+static int as_copy_pte(pte_t *pte, pte_t *newpte, struct addrspace *new, vaddr_t vaddr) {
+	pte_t entry;
+
+	for (;;) {
+		spinlock_acquire(&stealmem_lock);
+		entry = *pte;
+		if (entry & PTE_VALID) {
+			// (MAP_SHARED pages stay shared, and writable)
+			if ((entry & PTE_WRITABLE) && !(entry & PTE_SHARED)) {
+				entry = (entry & ~PTE_WRITABLE) | PTE_COW;
+				*pte = entry;
+			}
+			upage_incref_locked(PTE_FRAME(entry));
+			*newpte = entry;
+			spinlock_release(&stealmem_lock);
+			return 0;
+		}
+		spinlock_release(&stealmem_lock);
+
+		if (!(entry & PTE_BUSY)) break;
+		thread_yield();
+	}
+
+	if (entry & PTE_SWAPPED) {
+		paddr_t paddr = getupage();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		int result = swap_read(PTE_SWAPSLOT(entry), paddr);
+		if (result) {
+			freeupage(paddr);
+			return result;
+		}
+		spinlock_acquire(&stealmem_lock);
+		upage_setowner(paddr, new, vaddr);
+		*newpte = PTE_MAKE(paddr, PTE_VALID | (entry & (PTE_WRITABLE | PTE_COW)));
+		spinlock_release(&stealmem_lock);
+	}
+
+	return 0;
+}
+
+/**
+	Move the end of the heap by `amount` bytes and hand back where it was.
+	New heap pages are zero filled when first touched; pages dropped by a
+	negative `amount` are freed right away.
+*/
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak) {
+	vaddr_t top, newtop;
+
+	// The heap may grow up to the lowest mapped file
+	lock_acquire(mmap_lock);
+	top = as->as_heaptop;
+	newtop = top + amount;
+	if (amount < 0 && (newtop > top || newtop < as->as_heapbase)) {
+		lock_release(mmap_lock);
+		return EINVAL;
+	}
+	if (amount > 0 && (newtop < top || ROUNDUP(newtop, PAGE_SIZE) > as->as_mmapbase)) {
+		lock_release(mmap_lock);
+		return ENOMEM;
+	}
+	as->as_heaptop = newtop;
+	lock_release(mmap_lock);
+
+	if (amount < 0) {
+		struct shootdown sd;
 
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
+		// Stale entries for the freed pages may be in the TLBs of CPUs
+		// running our other threads, which may also be faulting them in
+		shootdown_init(&sd, as);
+		lock_acquire(as->as_faultlock);
+		for (vaddr_t v = ROUNDUP(newtop, PAGE_SIZE); v < ROUNDUP(top, PAGE_SIZE); v += PAGE_SIZE) {
+			pte_t *pte = pt_lookup(as->as_pt, v);
+			if (pte != NULL && *pte != 0) {
+				as_release_pte(pte);
+				shootdown_add(&sd, v);
+			}
+		}
+		lock_release(as->as_faultlock);
+		shootdown_flush(&sd);
+	}
+
+	*oldbreak = top;
+	return 0;
+}
+
+/**
+	Map `len` bytes of the file `v`, starting at page aligned `offset`,
+	just below the lowest existing mapping (the first one goes right below
+	the stack guard page). Nothing is read until the pages are touched.
+	With a NULL `v` the memory is anonymous and starts out zeroed.
+*/
+int as_mmap(struct addrspace *as, struct vnode *v, size_t len, off_t offset,
+	bool writable, bool shared, vaddr_t *ret) {
+
+	struct mmapregion *mr;
+	size_t npages;
+	vaddr_t start;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > SMARTVM_STACKGUARD) {
+		return ENOMEM;
+	}
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+	// Keep file page numbers (and the mapobj's page array) reasonable
+	if (offset / PAGE_SIZE + npages > MMAP_MAXPAGES) {
+		return EFBIG;
+	}
+
+	mr = kmalloc(sizeof(struct mmapregion));
+	if (mr == NULL) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
+	lock_acquire(mmap_lock);
+	start = as->as_mmapbase - npages * PAGE_SIZE;
+	if (npages * PAGE_SIZE > as->as_mmapbase ||
+	    start < ROUNDUP(as->as_heaptop, PAGE_SIZE)) {
+		lock_release(mmap_lock);
+		kfree(mr);
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(SMARTVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
+	mr->mr_obj = mapobj_get(v);
+	if (mr->mr_obj == NULL) {
+		lock_release(mmap_lock);
+		kfree(mr);
 		return ENOMEM;
 	}
+	mr->mr_start = start;
+	mr->mr_npages = npages;
+	mr->mr_firstpage = offset / PAGE_SIZE;
+	mr->mr_writable = writable;
+	mr->mr_shared = shared;
+	mr->mr_advice = MADV_NORMAL;
+
+	result = mapobj_grow(mr->mr_obj, mr->mr_firstpage + npages);
+	if (result) {
+		lock_release(mmap_lock);
+		mapobj_put(mr->mr_obj);
+		kfree(mr);
+		return result;
+	}
 
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, SMARTVM_STACKPAGES);
+	result = as_insertmap(as, mr);
+	if (result) {
+		lock_release(mmap_lock);
+		mapobj_put(mr->mr_obj);
+		kfree(mr);
+		return result;
+	}
+	as->as_mmapbase = start;
+	lock_release(mmap_lock);
 
+	*ret = start;
 	return 0;
 }
 
-int as_complete_load(struct addrspace *as) {
-	as->as_ready = true;
+/**
+	Remove the mapping that starts at `vaddr`. Only whole mappings can be
+	removed, so `len` must cover exactly the pages it was mapped with.
+*/
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len) {
+	struct mmapregion *mr = NULL;
+	struct shootdown sd;
+	unsigned i;
+	int result;
+
+	lock_acquire(mmap_lock);
+	i = as_mapindex(as, vaddr);
+	if (i > 0 && as->as_mmaps[i - 1]->mr_start == vaddr) {
+		mr = as->as_mmaps[i - 1];
+	}
+	if (mr == NULL || len == 0 ||
+	    ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE != mr->mr_npages) {
+		lock_release(mmap_lock);
+		return EINVAL;
+	}
+	as_removemap(as, i - 1);
+	lock_release(mmap_lock);
+
+	// As in as_sbrk: drop stale TLB entries for the freed pages
+	shootdown_init(&sd, as);
+	for (size_t i = 0; i < mr->mr_npages; i++) {
+		shootdown_add(&sd, mr->mr_start + i * PAGE_SIZE);
+	}
+
+	// Out of the table, so no fault can find it any more
+	result = as_unmap_region(as, mr);
+	shootdown_flush(&sd);
+
+	// Only now that its pages are gone may the space be handed out
+	// again, to the heap if this was the lowest mapping
+	lock_acquire(mmap_lock);
+	as->as_mmapbase = as->as_nmmaps > 0 ? as->as_mmaps[0]->mr_start : SMARTVM_STACKGUARD;
+	lock_release(mmap_lock);
+
+	return result;
+}
+
+/**
+	MADV_WILLNEED on the pages [first, first + npages) of a mapped file:
+	read them into the mapobj now, asking the file system to read the
+	lot in one go first. Stops at the first error; it's only a hint.
+	Called without mmap_lock, holding a reference to `mo`, like
+	mapobj_readin.
+*/
+static void mapobj_willneed(struct mapobj *mo, unsigned first, unsigned npages) {
+	if (mo->mo_vnode == NULL) {
+		// Anonymous memory is zero filled when touched, and costs
+		// nothing to fault in
+		return;
+	}
+	(void)VOP_ADVISE(mo->mo_vnode, (off_t)first * PAGE_SIZE,
+		(off_t)npages * PAGE_SIZE, POSIX_FADV_WILLNEED);
+	for (unsigned i = first; i < first + npages; i++) {
+		if (mapobj_readin(mo, i, false, 0)) {
+			break;
+		}
+	}
+}
+
+/**
+	MADV_DONTNEED: the resident pages from `start` to `end` that only
+	`as` maps are marked unreferenced, and dropped from the TLBs so a
+	touch has to come through vm_fault to mark them again, and the clock
+	takes them ahead of everything it hasn't passed over yet. Nothing is
+	thrown away; a page touched again is just as it was.
+*/
+static void as_dontneed(struct addrspace *as, vaddr_t start, vaddr_t end) {
+	struct shootdown sd;
+
+	shootdown_init(&sd, as);
+	for (vaddr_t v = start; v < end; v += PAGE_SIZE) {
+		bool dropped = false;
+
+		spinlock_acquire(&stealmem_lock);
+		pte_t *pte = pt_lookup(as->as_pt, v);
+		if (pte != NULL && (*pte & PTE_VALID) && !(*pte & PTE_BUSY)) {
+			struct coremapentry *entry =
+				&coremap[(PTE_FRAME(*pte) - pmemstart) / PAGE_SIZE];
+			if (entry->owner != 0 && coremap_owner(entry) == as) {
+				entry->referenced = false;
+				*pte &= ~PTE_REF;
+				dropped = true;
+			}
+		}
+		spinlock_release(&stealmem_lock);
+		if (dropped) {
+			shootdown_add(&sd, v);
+		}
+	}
+	shootdown_flush(&sd);
+}
+
+/**
+	Take the madvise hint `advice` for the pages from `vaddr` (page
+	aligned) through `vaddr + len`. A mapping keeps MADV_NORMAL, RANDOM
+	and SEQUENTIAL for its fault-around and read-ahead; it is the whole
+	mapping that takes the hint, even if only part of it is named. The
+	rest of the address space has nowhere to keep them, so there they do
+	nothing. MADV_WILLNEED reads mapped files' pages in now, and
+	MADV_DONTNEED makes any resident private pages the next to be
+	evicted (see as_dontneed).
+*/
+int as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice) {
+	vaddr_t end;
+	unsigned i;
+
+	if (vaddr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+		return ENOMEM;
+	}
+	end = ROUNDUP(vaddr + len, PAGE_SIZE);
+
+	lock_acquire(mmap_lock);
+	i = as_mapindex(as, vaddr);
+	if (i > 0 && mmapregion_contains(as->as_mmaps[i - 1], vaddr)) {
+		i--;
+	}
+	while (i < as->as_nmmaps && as->as_mmaps[i]->mr_start < end) {
+		struct mmapregion *mr = as->as_mmaps[i];
+		struct mapobj *mo = mr->mr_obj;
+		vaddr_t mrend = mr->mr_start + mr->mr_npages * PAGE_SIZE;
+		vaddr_t lo = vaddr > mr->mr_start ? vaddr : mr->mr_start;
+		vaddr_t hi = end < mrend ? end : mrend;
+
+		switch (advice) {
+		    case MADV_NORMAL:
+		    case MADV_RANDOM:
+		    case MADV_SEQUENTIAL:
+			mr->mr_advice = advice;
+			break;
+		    case MADV_WILLNEED:
+			// The reading is done without mmap_lock, and the
+			// table may change meanwhile
+			mo->mo_refcount++;
+			lock_release(mmap_lock);
+			mapobj_willneed(mo,
+				mr->mr_firstpage + (lo - mr->mr_start) / PAGE_SIZE,
+				(hi - lo) / PAGE_SIZE);
+			mapobj_put(mo);
+			lock_acquire(mmap_lock);
+			i = as_mapindex(as, hi - 1);
+			continue;
+		}
+		i++;
+	}
+	lock_release(mmap_lock);
+
+	if (advice == MADV_DONTNEED) {
+		as_dontneed(as, vaddr, end);
+	}
 	return 0;
 }
 
-int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
-	KASSERT(as->as_stackpbase != 0);
+/**
+	Read in the pages of mapped files that `uio`'s user buffers cover,
+	and get the shared writable ones for writing if it's a read. The file
+	system holds its locks while it copies, and a fault that then needed
+	it would want them again (for a buffer mapping the same file) or take
+	another file's behind them. A page, once in, stays in its mapobj, so
+	those faults now stay in the VM system.
+*/
+int vm_prefault(struct uio *uio) {
+	struct addrspace *as = uio->uio_space;
+	int result;
 
-	*stackptr = USERSTACK;
+	if (uio->uio_segflg != UIO_USERSPACE || as == NULL) {
+		return 0;
+	}
+
+	lock_acquire(mmap_lock);
+	for (unsigned k = 0; k < uio->uio_iovcnt; k++) {
+		vaddr_t base = (vaddr_t)uio->uio_iov[k].iov_ubase;
+		size_t len = uio->uio_iov[k].iov_len;
+		vaddr_t v, end;
+
+		if (len == 0 || base >= USERSPACETOP || len > USERSPACETOP - base) {
+			// (the copy fails on a bad buffer anyway)
+			continue;
+		}
+		v = base & PAGE_FRAME;
+		end = ROUNDUP(base + len, PAGE_SIZE);
+		while (v < end) {
+			unsigned i = as_mapindex(as, v);
+
+			if (i == 0 || !mmapregion_contains(as->as_mmaps[i - 1], v)) {
+				// On to the next mapping, if it's in the buffer
+				if (i == as->as_nmmaps) break;
+				v = as->as_mmaps[i]->mr_start;
+				continue;
+			}
+			struct mmapregion *mr = as->as_mmaps[i - 1];
+			struct mapobj *mo = mr->mr_obj;
+			unsigned index = mr->mr_firstpage + (v - mr->mr_start) / PAGE_SIZE;
+			bool forwrite = uio->uio_rw == UIO_READ && mr->mr_shared && mr->mr_writable;
+
+			if (!mapobj_ready(mo, index, forwrite)) {
+				mo->mo_refcount++;
+				lock_release(mmap_lock);
+				result = mapobj_readin(mo, index, forwrite, 0);
+				mapobj_put(mo);
+				if (result) {
+					return result;
+				}
+				lock_acquire(mmap_lock);
+			}
+			v += PAGE_SIZE;
+		}
+	}
+	lock_release(mmap_lock);
 	return 0;
 }
 
+/**
+	Is `vaddr` ordinary private memory that `as` may write: a writable
+	segment, the heap or the stack? Call with mmap_lock held (for the top
+	of the heap).
+*/
+static bool as_is_private(struct addrspace *as, vaddr_t vaddr) {
+	vaddr_t vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vaddr_t vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+
+	if (vaddr >= as->as_vbase1 && vaddr < vtop1) {
+		return as->as_dirtiable1;
+	}
+	if (vaddr >= as->as_vbase2 && vaddr < vtop2) {
+		return as->as_dirtiable2;
+	}
+	if (vaddr >= as->as_heapbase && vaddr < ROUNDUP(as->as_heaptop, PAGE_SIZE)) {
+		return true;
+	}
+	return vaddr >= SMARTVM_STACKBASE && vaddr < USERSTACK;
+}
+
+/**
+	Lend the kernel the frames behind `npages` pages of `as` from `vaddr`,
+	so a pipe can pass them on without copying them. A new reference to
+	each frame goes in `paddrs`. Writable pages become copy-on-write, so
+	changing the buffer afterwards doesn't change what was lent.
+	Stops at the first page that isn't resident, or is MAP_SHARED, and
+	returns how many were lent. Give each one back with vm_unloanpage.
+*/
+unsigned vm_loanpages(struct addrspace *as, vaddr_t vaddr, unsigned npages, paddr_t *paddrs) {
+	struct shootdown sd;
+	unsigned i;
+
+	KASSERT(as == curproc_getas());
+	KASSERT(vaddr % PAGE_SIZE == 0);
+
+	shootdown_init(&sd, as);
+	for (i = 0; i < npages; i++, vaddr += PAGE_SIZE) {
+		pte_t *pte = pt_lookup(as->as_pt, vaddr);
+		if (pte == NULL) break;
+
+		spinlock_acquire(&stealmem_lock);
+		pte_t entry = *pte;
+		if (!(entry & PTE_VALID) || (entry & (PTE_BUSY | PTE_SHARED))) {
+			spinlock_release(&stealmem_lock);
+			break;
+		}
+		if (entry & PTE_WRITABLE) {
+			*pte = (entry & ~PTE_WRITABLE) | PTE_COW;
+			shootdown_add(&sd, vaddr);
+		}
+		upage_incref_locked(PTE_FRAME(entry));
+		paddrs[i] = PTE_FRAME(entry);
+		spinlock_release(&stealmem_lock);
+	}
+
+	// As in as_copy: no writable TLB entries for them may survive
+	shootdown_flush(&sd);
+	return i;
+}
+
+/**
+	Put lent frames in place of `npages` pages of `as` from `vaddr`,
+	copy-on-write, instead of copying their contents over. Each page takes
+	its own reference; the loans are still the caller's to give back.
+	Stops at the first page that isn't ordinary private memory, and
+	returns how many were replaced.
+*/
+unsigned vm_mappages(struct addrspace *as, vaddr_t vaddr, unsigned npages, const paddr_t *paddrs) {
+	struct shootdown sd;
+	unsigned i;
+
+	KASSERT(as == curproc_getas());
+	KASSERT(vaddr % PAGE_SIZE == 0);
+
+	shootdown_init(&sd, as);
+	lock_acquire(as->as_faultlock);
+	lock_acquire(mmap_lock);
+	for (i = 0; i < npages; i++, vaddr += PAGE_SIZE) {
+		if (!as_is_private(as, vaddr)) break;
+		pte_t *pte = pt_lookup_create(as->as_pt, vaddr);
+		if (pte == NULL) break;
+
+		// as_faultlock keeps our other threads from faulting the old
+		// page back in
+		as_release_pte(pte);
+		spinlock_acquire(&stealmem_lock);
+		KASSERT(*pte == 0);
+		upage_incref_locked(paddrs[i]);
+		*pte = PTE_MAKE(paddrs[i], PTE_VALID | PTE_COW);
+		spinlock_release(&stealmem_lock);
+		shootdown_add(&sd, vaddr);
+	}
+	lock_release(mmap_lock);
+	lock_release(as->as_faultlock);
+
+	// The replaced frames may be gone; as in as_sbrk
+	shootdown_flush(&sd);
+	return i;
+}
+
+void vm_unloanpage(paddr_t paddr) {
+	freeupage(paddr);
+}
+
+/**
+	A frame for the file page cache (see vm.h). Like getupage, but not
+	zeroed, since the cache is about to fill it from the file.
+*/
+paddr_t vm_getpage(void) {
+	paddr_t paddr = getkpages(1);
+	if (paddr == 0) {
+		paddr = zeropool_take();
+	}
+	if (paddr == 0) {
+		paddr = evict_page();
+	}
+	if (paddr != 0) {
+		upage_init(paddr);
+	}
+	return paddr;
+}
+
+void vm_putpage(paddr_t paddr) {
+	freeupage(paddr);
+}
+
 int as_copy(struct addrspace *old, struct addrspace **ret) {
 	struct addrspace *new;
 
@@ -478,30 +4359,83 @@ int as_copy(struct addrspace *old, struct addrspace **ret) {
 
 	new->as_vbase1 = old->as_vbase1;
 	new->as_npages1 = old->as_npages1;
+	new->as_dirtiable1 = old->as_dirtiable1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
+	new->as_dirtiable2 = old->as_dirtiable2;
+	new->as_heapbase = old->as_heapbase;
+	new->as_heaptop = old->as_heaptop;
+	new->as_ready = old->as_ready;
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	// Pages the parent never touched can still be read from the file
+	new->as_filevaddr1 = old->as_filevaddr1;
+	new->as_fileoffset1 = old->as_fileoffset1;
+	new->as_filesz1 = old->as_filesz1;
+	new->as_filevaddr2 = old->as_filevaddr2;
+	new->as_fileoffset2 = old->as_fileoffset2;
+	new->as_filesz2 = old->as_filesz2;
+	if (old->as_vnode != NULL) {
+		VOP_INCOPEN(old->as_vnode);
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	// So do mapped files; the child's shared mappings use the same
+	// frames as ours, the private ones start out the same
+	lock_acquire(mmap_lock);
+	new->as_mmapbase = old->as_mmapbase;
+	for (unsigned i = 0; i < old->as_nmmaps; i++) {
+		struct mmapregion *newmr = kmalloc(sizeof(struct mmapregion));
+		if (newmr != NULL) {
+			*newmr = *old->as_mmaps[i];
+			if (as_insertmap(new, newmr)) {
+				kfree(newmr);
+				newmr = NULL;
+			}
+		}
+		if (newmr == NULL) {
+			lock_release(mmap_lock);
+			as_destroy(new);
+			return ENOMEM;
+		}
+		newmr->mr_obj->mo_refcount++;
 	}
+	lock_release(mmap_lock);
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
+	// Share every resident page of the parent read-only. Writable pages
+	// are marked copy-on-write in both address spaces and are only copied
+	// when one side writes to them (see as_break_cow). Pages the parent
+	// has out in swap are read back into a frame of the child's own.
+	// The parent's other threads mustn't fault pages in (and free their
+	// swap slots) meanwhile.
+	lock_acquire(old->as_faultlock);
+	for (unsigned i = 0; i < PT_DIR_ENTRIES; i++) {
+		pte_t *table = old->as_pt->pt_dir[i];
+		if (table == NULL) continue;
+		for (unsigned j = 0; j < PT_TABLE_ENTRIES; j++) {
+			if (table[j] == 0) continue;
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
+			vaddr_t vaddr = PT_VADDR(i, j);
+			pte_t *newpte = pt_lookup_create(new->as_pt, vaddr);
+			if (newpte == NULL) {
+				lock_release(old->as_faultlock);
+				as_destroy(new);
+				return ENOMEM;
+			}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+			int result = as_copy_pte(&table[j], newpte, new, vaddr);
+			if (result) {
+				lock_release(old->as_faultlock);
+				as_destroy(new);
+				return result;
+			}
+		}
+	}
+	lock_release(old->as_faultlock);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		SMARTVM_STACKPAGES*PAGE_SIZE);
+	// The parent may still have writable TLB entries for pages that
+	// are now copy-on-write, here or on CPUs running its other threads
+	shootdown_as(old);
 
 	*ret = new;
 	return 0;
@@ -28,12 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <kern/unistd.h>
 #include <lib.h>
 #include <mips/trapframe.h>
+#include <mips/specialreg.h>
 #include <cpu.h>
 #include <spl.h>
 #include <clock.h>
+#include <kclock.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -41,6 +44,10 @@
 #include <sys161/bus.h>
 #include <lamebus/lamebus.h>
 #include "autoconf.h"
+#include "opt-kprof.h"
+#if OPT_KPROF
+#include <kprof.h>
+#endif
 
 /*
  * CPU frequency used by the on-chip timer.
@@ -73,6 +80,34 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Restart the on-chip timer from zero so that the next interrupt comes
+ * COUNT cycles from now, rather than wherever the old compare value
+ * would have put it. ($9 == c0_count.) The cycles counted so far go
+ * into the cycle clock's base first.
+ */
+static
+void
+mips_timer_restart(uint32_t count)
+{
+	curcpu->c_cyclebase = kclock_cycles();
+	curcpu->c_cyclecompare = count;
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		"mtc0 $0, $9;"
+		"mtc0 %0, $11;"
+		".set pop"
+		:: "r" (count));
+}
+
+/*
+ * Timer interval used while a cpu is idle (see mainbus_timer_idle).
+ * It doesn't need to be short; it only acts as a backstop so an idle
+ * cpu still looks around for work to steal now and then.
+ */
+#define IDLE_HZ 1
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -113,7 +148,19 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mainbus_timer_start();
+}
+
+void
+mainbus_timer_start(void)
+{
+	int spl;
+
+	spl = splhigh();
+	curcpu->c_tickless = false;
+	mips_timer_restart(CPU_FREQUENCY / HZ);
+	kclock_start();
+	splx(spl);
 }
 
 /*
@@ -233,6 +280,15 @@ mainbus_ramsize(void)
 	return lamebus_ramsize();
 }
 
+/*
+ * The cpu clock rate. See the note on CPU_FREQUENCY above.
+ */
+uint32_t
+mainbus_cpufreq(void)
+{
+	return CPU_FREQUENCY;
+}
+
 /*
  * Send IPI.
  */
@@ -242,6 +298,105 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Cpus device interrupts go to, by cpu number, only for reporting;
+ * the routing itself is in the lamebus softc, under its lock. Set
+ * from the menu, so never by two threads at once.
+ */
+static uint32_t iocpus = 1;
+
+int
+mainbus_set_iocpus(uint32_t cpus)
+{
+	unsigned hwcpu[32];
+	uint32_t slots[32];
+	unsigned i, n, slot;
+
+	n = 0;
+	for (i=0; i<cpu_count() && i<32; i++) {
+		if (cpus & ((uint32_t)1 << i)) {
+			hwcpu[n] = cpu_get(i)->c_hardware_number;
+			slots[n] = 0;
+			n++;
+		}
+	}
+	if (n == 0) {
+		return EINVAL;
+	}
+
+	/*
+	 * Deal the slots with drivers out in turn, so each device's
+	 * interrupts (and its bottom halves) stay on one cpu. Empty
+	 * slots and the controller go to the first.
+	 */
+	i = 0;
+	for (slot=0; slot<LB_NSLOTS; slot++) {
+		if (slot != LB_CONTROLLER_SLOT &&
+		    lamebus->ls_irqfuncs[slot] != NULL) {
+			slots[i++ % n] |= (uint32_t)1 << slot;
+		}
+		else {
+			slots[0] |= (uint32_t)1 << slot;
+		}
+	}
+	for (i=0; i<n; i++) {
+		lamebus_route_interrupts(lamebus, slots[i], hwcpu[i]);
+	}
+	iocpus = cpus & (((uint32_t)1 << (cpu_count() - 1) << 1) - 1);
+	return 0;
+}
+
+uint32_t
+mainbus_iocpus(void)
+{
+	return iocpus;
+}
+
+void
+mainbus_irqreport(void)
+{
+	unsigned slot, hwcpu, count, i;
+
+	kprintf("slot  cpu  interrupts\n");
+	for (slot=0; slot<LB_NSLOTS; slot++) {
+		if (slot == LB_CONTROLLER_SLOT ||
+		    lamebus->ls_irqfuncs[slot] == NULL) {
+			continue;
+		}
+		hwcpu = lamebus_interrupt_cpu(lamebus, slot, &count);
+		for (i=0; i<cpu_count(); i++) {
+			if (cpu_get(i)->c_hardware_number == hwcpu) {
+				break;
+			}
+		}
+		kprintf("%4u  %3u  %10u\n", slot, i, count);
+	}
+}
+
+/*
+ * Stop ticking at HZ while this cpu has nothing to run, and start again
+ * when it does. Called from the idle loop with interrupts off.
+ */
+void
+mainbus_timer_idle(void)
+{
+	KASSERT(curthread->t_curspl > 0);
+	if (!curcpu->c_tickless) {
+		curcpu->c_tickless = true;
+		mips_timer_restart(CPU_FREQUENCY / IDLE_HZ);
+	}
+}
+
+void
+mainbus_timer_resume(void)
+{
+	KASSERT(curthread->t_curspl > 0);
+	if (curcpu->c_tickless) {
+		curcpu->c_tickless = false;
+		mips_timer_restart(CPU_FREQUENCY / HZ);
+	}
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -268,8 +423,18 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_clear_ipi(lamebus, curcpu);
 	}
 	else if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		/*
+		 * The count went back to zero at the compare value; put
+		 * that into the cycle clock. Then reset the timer (this
+		 * clears the interrupt).
+		 */
+		curcpu->c_cyclebase += curcpu->c_cyclecompare;
+		curcpu->c_cyclecompare = CPU_FREQUENCY /
+			(curcpu->c_tickless ? IDLE_HZ : HZ);
+		mips_timer_set(curcpu->c_cyclecompare);
+#if OPT_KPROF
+		kprof_sample(tf->tf_epc, (tf->tf_status & CST_KUp) != 0);
+#endif
 		/* and call hardclock */
 		hardclock();
 	}
@@ -30,15 +30,21 @@
 #ifndef _SYS161_MAXCPUS_H_
 #define _SYS161_MAXCPUS_H_
 
+#include "opt-uniprocessor.h"
+
 /*
  * For various reasons (see mips/cpu.c) it's desirable to have a
  * fixed-size per-cpu array in the data segment. This is
  * platform-dependent rather than processor-dependent because there's
  * nothing about the processor that determines how many CPUs can
  * exist; however, any real platform has *some* limit. For System/161,
- * the limit is 32.
+ * the limit is 32. A uniprocessor kernel uses only the boot cpu.
  */
 
+#if OPT_UNIPROCESSOR
+#define MAXCPUS 1
+#else
 #define MAXCPUS 32
+#endif
 
 #endif /* _SYS161_MAXCPUS_H_ */
@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_KPROF_H_
+#define _OPT_KPROF_H_
+#define OPT_KPROF 0
+#endif /* _OPT_KPROF_H_ */
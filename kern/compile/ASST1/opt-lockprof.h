@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_LOCKPROF_H_
+#define _OPT_LOCKPROF_H_
+#define OPT_LOCKPROF 0
+#endif /* _OPT_LOCKPROF_H_ */
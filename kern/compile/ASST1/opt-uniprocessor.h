@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_UNIPROCESSOR_H_
+#define _OPT_UNIPROCESSOR_H_
+#define OPT_UNIPROCESSOR 0
+#endif /* _OPT_UNIPROCESSOR_H_ */
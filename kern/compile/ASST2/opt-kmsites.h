@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_KMSITES_H_
+#define _OPT_KMSITES_H_
+#define OPT_KMSITES 0
+#endif /* _OPT_KMSITES_H_ */
@@ -24,6 +24,8 @@ SRCS+=$(KTOP)/dev/lamebus/emu_att.c
 SRCS+=$(KTOP)/dev/lamebus/lamebus.c
 SRCS+=$(KTOP)/dev/lamebus/lhd.c
 SRCS+=$(KTOP)/dev/lamebus/lhd_att.c
+SRCS+=$(KTOP)/dev/lamebus/lnet.c
+SRCS+=$(KTOP)/dev/lamebus/lnet_att.c
 SRCS+=$(KTOP)/dev/lamebus/lrandom.c
 SRCS+=$(KTOP)/dev/lamebus/lrandom_att.c
 SRCS+=$(KTOP)/dev/lamebus/lser.c
@@ -37,44 +39,84 @@ SRCS+=$(KTOP)/dev/lamebus/rtclock_ltimer.c
 SRCS+=$(KTOP)/fs/sfs/sfs_fs.c
 SRCS+=$(KTOP)/fs/sfs/sfs_io.c
 SRCS+=$(KTOP)/fs/sfs/sfs_vnode.c
+SRCS+=$(KTOP)/fs/sfs/sfs_journal.c
+SRCS+=$(KTOP)/fs/statsfs/statsfs.c
 SRCS+=$(KTOP)/lib/array.c
 SRCS+=$(KTOP)/lib/bitmap.c
 SRCS+=$(KTOP)/lib/bswap.c
+SRCS+=$(KTOP)/lib/hashtable.c
 SRCS+=$(KTOP)/lib/kgets.c
 SRCS+=$(KTOP)/lib/kprintf.c
 SRCS+=$(KTOP)/lib/misc.c
 SRCS+=$(KTOP)/lib/queue.c
+SRCS+=$(KTOP)/lib/radix.c
+SRCS+=$(KTOP)/lib/ring.c
+SRCS+=$(KTOP)/lib/trace.c
 SRCS+=$(KTOP)/lib/uio.c
+SRCS+=$(KTOP)/net/net.c
+SRCS+=$(KTOP)/net/pbuf.c
+SRCS+=$(KTOP)/net/socket.c
 SRCS+=$(KTOP)/proc/proc.c
 SRCS+=$(KTOP)/startup/main.c
 SRCS+=$(KTOP)/startup/menu.c
 SRCS+=$(KTOP)/syscall/file_syscalls.c
+SRCS+=$(KTOP)/syscall/futex_syscalls.c
+SRCS+=$(KTOP)/syscall/ioring_syscalls.c
 SRCS+=$(KTOP)/syscall/loadelf.c
+SRCS+=$(KTOP)/syscall/mmap_syscalls.c
+SRCS+=$(KTOP)/syscall/net_syscalls.c
+SRCS+=$(KTOP)/syscall/openfile.c
+SRCS+=$(KTOP)/syscall/poll_syscalls.c
 SRCS+=$(KTOP)/syscall/proc_syscalls.c
 SRCS+=$(KTOP)/syscall/runprogram.c
 SRCS+=$(KTOP)/syscall/time_syscalls.c
 SRCS+=$(KTOP)/test/arraytest.c
 SRCS+=$(KTOP)/test/bitmaptest.c
+SRCS+=$(KTOP)/test/fsbench.c
 SRCS+=$(KTOP)/test/fstest.c
+SRCS+=$(KTOP)/test/hashtest.c
 SRCS+=$(KTOP)/test/malloctest.c
+SRCS+=$(KTOP)/test/nettest.c
+SRCS+=$(KTOP)/test/ringtest.c
+SRCS+=$(KTOP)/test/synchbench.c
+SRCS+=$(KTOP)/test/threadbench.c
 SRCS+=$(KTOP)/test/synchtest.c
 SRCS+=$(KTOP)/test/threadtest.c
 SRCS+=$(KTOP)/test/tt3.c
 SRCS+=$(KTOP)/test/uw-tests.c
+SRCS+=$(KTOP)/test/worktest.c
 SRCS+=$(KTOP)/thread/clock.c
+SRCS+=$(KTOP)/thread/cputime.c
+SRCS+=$(KTOP)/thread/kclock.c
+SRCS+=$(KTOP)/thread/lathist.c
+SRCS+=$(KTOP)/thread/rcu.c
+SRCS+=$(KTOP)/thread/softint.c
+SRCS+=$(KTOP)/thread/percpu.c
+SRCS+=$(KTOP)/thread/seqlock.c
 SRCS+=$(KTOP)/thread/spinlock.c
 SRCS+=$(KTOP)/thread/spl.c
 SRCS+=$(KTOP)/thread/synch.c
 SRCS+=$(KTOP)/thread/thread.c
 SRCS+=$(KTOP)/thread/threadlist.c
+SRCS+=$(KTOP)/thread/workqueue.c
+SRCS+=$(KTOP)/vfs/buf.c
+SRCS+=$(KTOP)/vfs/filecache.c
 SRCS+=$(KTOP)/vfs/device.c
 SRCS+=$(KTOP)/vfs/devnull.c
+SRCS+=$(KTOP)/vfs/devwait.c
+SRCS+=$(KTOP)/vfs/devstripe.c
+SRCS+=$(KTOP)/vfs/pipe.c
 SRCS+=$(KTOP)/vfs/vfscwd.c
 SRCS+=$(KTOP)/vfs/vfslist.c
 SRCS+=$(KTOP)/vfs/vfslookup.c
+SRCS+=$(KTOP)/vfs/vfsnamecache.c
 SRCS+=$(KTOP)/vfs/vfspath.c
 SRCS+=$(KTOP)/vfs/vnode.c
 SRCS+=$(KTOP)/vm/kmalloc.c
+SRCS+=$(KTOP)/vm/kmem.c
+SRCS+=$(KTOP)/vm/pagetable.c
+SRCS+=$(KTOP)/vm/shrink.c
+SRCS+=$(KTOP)/vm/swap.c
 SRCS+=$(KTOP)/vm/uw-vmstats.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/adddi3.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/anddi3.c
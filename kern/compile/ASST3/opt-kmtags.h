@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_KMTAGS_H_
+#define _OPT_KMTAGS_H_
+#define OPT_KMTAGS 0
+#endif /* _OPT_KMTAGS_H_ */
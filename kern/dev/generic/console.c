@@ -46,12 +46,28 @@
  * and (2) if the system crashes before we find a console, no output
  * at all may appear.
  *
- * Note that we have no input buffering; characters typed too rapidly
- * will be lost.
+ * Input goes through a small line discipline. While the console is
+ * open as a device, typing is collected a line at a time in the
+ * kernel, with echo, erase (backspace or DEL) and line kill (^U), and
+ * a line is only handed on to readers when it is finished (or fills
+ * CONSOLE_LINE_SIZE), so a reader wakes up once per line rather than
+ * once per key. Otherwise (the kernel menu, which does its own
+ * editing in kgets) each character is handed on as it comes. The
+ * interrupt handler only queues characters; the discipline runs in
+ * its bottom half. Characters that come in faster than that, or lines
+ * that nobody reads, will be lost.
+ *
+ * Output from threads goes into a ring buffer, and the write-done
+ * interrupt sends the next character from it, so a writer only waits
+ * when the buffer is full. Polled output (interrupt handlers, panics)
+ * first sends whatever is in the buffer so things come out in order.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -119,6 +135,17 @@ static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	/* Send anything buffered first (unless we're inside con_start) */
+	if (!spinlock_do_i_hold(&cs->cs_outlock)) {
+		spinlock_acquire(&cs->cs_outlock);
+		while (cs->cs_outbuf_tail != cs->cs_outbuf_head) {
+			cs->cs_sendpolled(cs->cs_devdata,
+					  cs->cs_outbuf[cs->cs_outbuf_tail]);
+			cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+		}
+		spinlock_release(&cs->cs_outlock);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
@@ -142,6 +169,41 @@ putch_complete_polled(struct con_softc *cs)
 
 //////////////////////////////////////////////////
 
+/*
+ * Put LEN characters into the output buffer, waiting for room as
+ * needed, and get the device going if it's idle.
+ */
+static
+void
+putbuf_intr(struct con_softc *cs, const char *buf, size_t len)
+{
+	unsigned nexthead;
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		nexthead = (cs->cs_outbuf_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		while (nexthead == cs->cs_outbuf_tail) {
+			/* full; wait for con_start to make room */
+			cs->cs_outwaiters++;
+			spinlock_release(&cs->cs_outlock);
+			P(cs->cs_wsem);
+			spinlock_acquire(&cs->cs_outlock);
+		}
+		cs->cs_outbuf[cs->cs_outbuf_head] = buf[i];
+		cs->cs_outbuf_head = nexthead;
+
+		if (!cs->cs_outbusy) {
+			cs->cs_outbusy = true;
+			cs->cs_send(cs->cs_devdata,
+				    cs->cs_outbuf[cs->cs_outbuf_tail]);
+			cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+		}
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -149,8 +211,127 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	putbuf_intr(cs, &c, 1);
+}
+
+/*
+ * Echo LEN characters of typed input. This is in interrupt context, so
+ * it can't wait for room in the output buffer; whatever doesn't fit
+ * isn't echoed.
+ */
+static
+void
+con_echo(struct con_softc *cs, const char *buf, size_t len)
+{
+	unsigned nexthead;
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		nexthead = (cs->cs_outbuf_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		if (nexthead == cs->cs_outbuf_tail) {
+			break;
+		}
+		cs->cs_outbuf[cs->cs_outbuf_head] = buf[i];
+		cs->cs_outbuf_head = nexthead;
+	}
+	if (!cs->cs_outbusy && cs->cs_outbuf_tail != cs->cs_outbuf_head) {
+		cs->cs_outbusy = true;
+		cs->cs_send(cs->cs_devdata, cs->cs_outbuf[cs->cs_outbuf_tail]);
+		cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
+/*
+ * Hand LEN characters on to readers, dropping any that don't fit, and
+ * wake them. Call with cs_inlock held.
+ */
+static
+void
+con_deliver(struct con_softc *cs, const unsigned char *buf, size_t len)
+{
+	unsigned nexthead;
+	size_t i;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_inlock));
+
+	for (i=0; i<len; i++) {
+		nexthead = (cs->cs_inbuf_head + 1) % CONSOLE_READ_BUFFER_SIZE;
+		if (nexthead == cs->cs_inbuf_tail) {
+			/* overflow; drop the rest */
+			break;
+		}
+		cs->cs_inbuf[cs->cs_inbuf_head] = buf[i];
+		cs->cs_inbuf_head = nexthead;
+	}
+	while (cs->cs_inwaiters > 0) {
+		cs->cs_inwaiters--;
+		V(cs->cs_rsem);
+	}
+	pollqueue_wakeup(&cs->cs_pollq);
+}
+
+/*
+ * Hand on the line typed so far. Call with cs_inlock held.
+ */
+static
+void
+con_endline(struct con_softc *cs)
+{
+	con_deliver(cs, cs->cs_line, cs->cs_linelen);
+	cs->cs_linelen = 0;
+}
+
+/*
+ * The line discipline: take one typed character. Call with cs_inlock
+ * held.
+ */
+static
+void
+con_ldisc(struct con_softc *cs, unsigned char ch)
+{
+	char c = ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_inlock));
+
+	if (!cs->cs_canon) {
+		con_deliver(cs, &ch, 1);
+		return;
+	}
+
+	switch (ch) {
+	    case '\r':
+	    case '\n':
+		con_echo(cs, "\r\n", 2);
+		cs->cs_line[cs->cs_linelen++] = '\n';
+		con_endline(cs);
+		break;
+	    case '\b':
+	    case 127:
+		if (cs->cs_linelen > 0) {
+			con_echo(cs, "\b \b", 3);
+			cs->cs_linelen--;
+		}
+		break;
+	    case 21: /* ^U */
+		while (cs->cs_linelen > 0) {
+			con_echo(cs, "\b \b", 3);
+			cs->cs_linelen--;
+		}
+		break;
+	    default:
+		con_echo(cs, &c, 1);
+		cs->cs_line[cs->cs_linelen++] = ch;
+		/* Leave room for the newline */
+		if (cs->cs_linelen == CONSOLE_LINE_SIZE - 1) {
+			con_endline(cs);
+		}
+		break;
+	}
 }
 
 /*
@@ -162,21 +343,54 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_acquire(&cs->cs_inlock);
+	while (cs->cs_inbuf_head == cs->cs_inbuf_tail) {
+		/* empty; wait for con_deliver */
+		cs->cs_inwaiters++;
+		spinlock_release(&cs->cs_inlock);
+		P(cs->cs_rsem);
+		spinlock_acquire(&cs->cs_inlock);
+	}
+	ret = cs->cs_inbuf[cs->cs_inbuf_tail];
+	cs->cs_inbuf_tail = (cs->cs_inbuf_tail + 1) % CONSOLE_READ_BUFFER_SIZE;
+	spinlock_release(&cs->cs_inlock);
 	return ret;
 }
 
+/*
+ * Read up to LEN characters of input into BUF, waiting for some if
+ * there are none, and stopping after a newline. Returns how many.
+ */
+static
+size_t
+getbuf_intr(struct con_softc *cs, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	spinlock_acquire(&cs->cs_inlock);
+	while (cs->cs_inbuf_head == cs->cs_inbuf_tail) {
+		cs->cs_inwaiters++;
+		spinlock_release(&cs->cs_inlock);
+		P(cs->cs_rsem);
+		spinlock_acquire(&cs->cs_inlock);
+	}
+	while (n < len && cs->cs_inbuf_head != cs->cs_inbuf_tail) {
+		buf[n] = cs->cs_inbuf[cs->cs_inbuf_tail];
+		cs->cs_inbuf_tail = (cs->cs_inbuf_tail + 1) %
+			CONSOLE_READ_BUFFER_SIZE;
+		if (buf[n++] == '\n') {
+			break;
+		}
+	}
+	spinlock_release(&cs->cs_inlock);
+	return n;
+}
+
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
  * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * if gotchars_head+1 == gotchars_tail, the buffer is full.
  */
 void
 con_input(void *vcs, int ch)
@@ -193,7 +407,29 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
 
-	V(cs->cs_rsem);
+	/* Leave the line discipline to the bottom half */
+	softint_schedule(&cs->cs_inputsi);
+}
+
+/*
+ * Bottom half of con_input: run the characters that have come in since
+ * it last ran through the line discipline.
+ */
+static
+void
+con_inputsoftint(void *vcs)
+{
+	struct con_softc *cs = vcs;
+	unsigned char ch;
+
+	spinlock_acquire(&cs->cs_inlock);
+	while (cs->cs_gotchars_tail != cs->cs_gotchars_head) {
+		ch = cs->cs_gotchars[cs->cs_gotchars_tail];
+		cs->cs_gotchars_tail =
+			(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+		con_ldisc(cs, ch);
+	}
+	spinlock_release(&cs->cs_inlock);
 }
 
 /*
@@ -204,7 +440,20 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	if (cs->cs_outbuf_tail != cs->cs_outbuf_head) {
+		cs->cs_send(cs->cs_devdata, cs->cs_outbuf[cs->cs_outbuf_tail]);
+		cs->cs_outbuf_tail = (cs->cs_outbuf_tail + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
+	else {
+		cs->cs_outbusy = false;
+	}
+	while (cs->cs_outwaiters > 0) {
+		cs->cs_outwaiters--;
+		V(cs->cs_wsem);
+	}
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -281,12 +530,21 @@ getch(void)
  * VFS interface functions
  */
 
+/*
+ * Open and last close switch the line discipline on and off. A line
+ * half typed at the last close is handed on as it is.
+ */
 static
 int
 con_open(struct device *dev, int openflags)
 {
-	(void)dev;
+	struct con_softc *cs = dev->d_data;
+
 	(void)openflags;
+
+	spinlock_acquire(&cs->cs_inlock);
+	cs->cs_canon = true;
+	spinlock_release(&cs->cs_inlock);
 	return 0;
 }
 
@@ -294,7 +552,67 @@ static
 int
 con_close(struct device *dev)
 {
-	(void)dev;
+	struct con_softc *cs = dev->d_data;
+
+	spinlock_acquire(&cs->cs_inlock);
+	cs->cs_canon = false;
+	if (cs->cs_linelen > 0) {
+		con_endline(cs);
+	}
+	spinlock_release(&cs->cs_inlock);
+	return 0;
+}
+
+/*
+ * Readable if there's typed input waiting (a whole line, while the
+ * line discipline is on). Output only ever waits for
+ * the device to catch up, so the console is always writable.
+ */
+static
+int
+con_poll(struct device *dev, int events, struct pollwaiter *pw, int *revents)
+{
+	struct con_softc *cs = dev->d_data;
+
+	/* Get on the queue before looking, in case a key comes in between */
+	pollqueue_add(&cs->cs_pollq, pw);
+
+	*revents = events & POLLOUT;
+	spinlock_acquire(&cs->cs_inlock);
+	if (cs->cs_inbuf_head != cs->cs_inbuf_tail) {
+		*revents |= events & POLLIN;
+	}
+	spinlock_release(&cs->cs_inlock);
+	return 0;
+}
+
+/*
+ * Copy a chunk of a write into BUF, turning \n into \r\n. BUF has room
+ * for twice CHUNK. Returns the length in *RET.
+ */
+#define CON_WCHUNK 64
+
+static
+int
+con_getchunk(struct uio *uio, char *buf, size_t *ret)
+{
+	char in[CON_WCHUNK];
+	size_t n, i, len;
+	int result;
+
+	n = uio->uio_resid < CON_WCHUNK ? uio->uio_resid : CON_WCHUNK;
+	result = uiomove(in, n, uio);
+	if (result) {
+		return result;
+	}
+	len = 0;
+	for (i=0; i<n; i++) {
+		if (in[i]=='\n') {
+			buf[len++] = '\r';
+		}
+		buf[len++] = in[i];
+	}
+	*ret = len;
 	return 0;
 }
 
@@ -303,7 +621,8 @@ int
 con_io(struct device *dev, struct uio *uio)
 {
 	int result;
-	char ch;
+	char buf[2*CON_WCHUNK];
+	size_t len, i;
 	struct lock *lk;
 
 	(void)dev;  // unused
@@ -320,29 +639,31 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
+			/* A line at a time; see con_ldisc */
+			len = getbuf_intr(the_console, buf,
+				uio->uio_resid < sizeof(buf) ?
+				uio->uio_resid : sizeof(buf));
+			for (i=0; i<len; i++) {
+				if (buf[i]=='\r') {
+					buf[i] = '\n';
+				}
 			}
-			result = uiomove(&ch, 1, uio);
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
+			if (buf[len-1]=='\n') {
 				break;
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			result = con_getchunk(uio, buf, &len);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+			putbuf_intr(the_console, buf, len);
 		}
 	}
 	lock_release(lk);
@@ -376,6 +697,7 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_close = con_close;
 	dev->d_io = con_io;
 	dev->d_ioctl = con_ioctl;
+	dev->d_poll = con_poll;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
@@ -418,7 +740,7 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
+	wsem = sem_create("console write", 0);
 	if (wsem == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
@@ -441,6 +763,19 @@ config_con(struct con_softc *cs, int unit)
 	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	softint_init(&cs->cs_inputsi, con_inputsoftint, cs);
+	spinlock_init(&cs->cs_inlock);
+	cs->cs_canon = false;
+	cs->cs_linelen = 0;
+	cs->cs_inbuf_head = 0;
+	cs->cs_inbuf_tail = 0;
+	cs->cs_inwaiters = 0;
+	pollqueue_init(&cs->cs_pollq);
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outbuf_head = 0;
+	cs->cs_outbuf_tail = 0;
+	cs->cs_outbusy = false;
+	cs->cs_outwaiters = 0;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -37,7 +37,14 @@
  * device, and are to be initialized by the attach routine.
  */
 
+#include <spinlock.h>
+#include <poll.h>
+#include <softint.h>
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
+#define CONSOLE_LINE_SIZE 256		/* longest line being typed */
+#define CONSOLE_READ_BUFFER_SIZE 1024	/* input ready to be read */
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -48,11 +55,31 @@ struct con_softc {
 	void (*cs_endpolling)(void *devdata);
 
 	/* initialized by config routine */
-	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
+	struct semaphore *cs_rsem;	/* for waiting on an empty inbuf */
+	struct semaphore *cs_wsem;	/* for waiting on a full outbuf */
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	struct softint cs_inputsi;	/* moves them on to cs_inbuf */
+
+	/* input ready for readers, and the line being typed */
+	struct spinlock cs_inlock;	/* covers the fields below */
+	bool cs_canon;			/* line at a time (while open) */
+	unsigned char cs_line[CONSOLE_LINE_SIZE];
+	unsigned cs_linelen;
+	unsigned char cs_inbuf[CONSOLE_READ_BUFFER_SIZE];
+	unsigned cs_inbuf_head;		/* next slot to put a char in */
+	unsigned cs_inbuf_tail;		/* next slot to take a char out */
+	unsigned cs_inwaiters;		/* threads waiting on cs_rsem */
+	struct pollqueue cs_pollq;	/* threads in poll() waiting for input */
+
+	/* output buffer, drained by the write-done interrupt */
+	struct spinlock cs_outlock;	/* covers the fields below */
+	unsigned char cs_outbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outbuf_head;	/* next slot to put a char in */
+	unsigned cs_outbuf_tail;	/* next slot to take a char out */
+	bool cs_outbusy;		/* device is sending a char */
+	unsigned cs_outwaiters;		/* threads waiting on cs_wsem */
 };
 
 /*
@@ -32,6 +32,8 @@
  * ltimer device for beeping.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <generic/beep.h>
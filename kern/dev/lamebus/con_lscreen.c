@@ -32,6 +32,8 @@
  * screen device.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <generic/console.h>
@@ -32,6 +32,8 @@
  * serial device.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <generic/console.h>
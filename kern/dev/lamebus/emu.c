@@ -40,9 +40,12 @@
  * device as part of testing your filesystem.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/poll.h>
 #include <stat.h>
 #include <lib.h>
 #include <array.h>
@@ -128,6 +131,18 @@ emu_irq(void *dev)
 	sc->e_result = emu_rreg(sc, REG_RESULT);
 	emu_wreg(sc, REG_RESULT, 0);
 
+	softint_schedule(&sc->e_semsi);
+}
+
+/*
+ * The rest of the interrupt: wake up whoever's waiting.
+ */
+static
+void
+emu_softint(void *dev)
+{
+	struct emu_softc *sc = dev;
+
 	V(sc->e_sem);
 }
 
@@ -175,17 +190,19 @@ emu_waitdone(struct emu_softc *sc)
  * for VOP_OPEN. At the hardware level, we need to "open" files in
  * order to look at them, so by the time VOP_OPEN is called the
  * files are already open.
+ *
+ * NAME is NAMELEN characters long and need not be NUL-terminated.
  */
 static
 int
 emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
-	 bool create, bool excl, mode_t mode,
+	 size_t namelen, bool create, bool excl, mode_t mode,
 	 uint32_t *newhandle, int *newisdir)
 {
 	uint32_t op;
 	int result;
 
-	if (strlen(name)+1 > EMU_MAXIO) {
+	if (namelen+1 > EMU_MAXIO) {
 		return ENAMETOOLONG;
 	}
 
@@ -204,8 +221,9 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 
 	lock_acquire(sc->e_lock);
 
-	strcpy(sc->e_iobuf, name);
-	emu_wreg(sc, REG_IOLEN, strlen(name));
+	memcpy(sc->e_iobuf, name, namelen);
+	((char *)sc->e_iobuf)[namelen] = 0;
+	emu_wreg(sc, REG_IOLEN, namelen);
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
@@ -261,45 +279,96 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 
 /*
  * Common code for read and readdir.
+ *
+ * The data is copied out of the device buffer into BUF (LEN bytes,
+ * supplied by the caller) while we have the device, and moved to the
+ * uio after letting it go. The uiomove may fault, and shouldn't hold
+ * up everyone else's emufs operations while it does; and another
+ * thread's operation can then run on the device during it.
  */
 static
 int
-emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	   uint32_t op, struct uio *uio)
+emu_rawread(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	    uint32_t op, off_t offset, void *buf, uint32_t *got,
+	    off_t *newoffset)
 {
+	uint64_t start;
 	int result;
 
-	KASSERT(uio->uio_rw == UIO_READ);
-
+	start = iostat_start(&sc->e_iostat);
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
-		goto out;
+		lock_release(sc->e_lock);
+		iostat_done(&sc->e_iostat, start, false, 0, result);
+		return result;
 	}
 
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
-
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	*got = emu_rreg(sc, REG_IOLEN);
+	KASSERT(*got <= len);
+	memcpy(buf, sc->e_iobuf, *got);
+	*newoffset = emu_rreg(sc, REG_OFFSET);
 
- out:
 	lock_release(sc->e_lock);
+	iostat_done(&sc->e_iostat, start, false, *got, 0);
+	return 0;
+}
+
+static
+int
+emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
+	   uint32_t op, void *buf, struct uio *uio)
+{
+	uint32_t got;
+	off_t newoffset;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	result = emu_rawread(sc, handle, len, op, uio->uio_offset, buf,
+			     &got, &newoffset);
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(buf, got, uio);
+
+	uio->uio_offset = newoffset;
 	return result;
 }
 
 /*
- * Read from a hardware-level file handle.
+ * Read from a hardware-level file handle into BUF, until LEN bytes
+ * or EOF. Hands back how many bytes that was.
  */
 static
 int
 emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	 struct uio *uio)
+	 off_t offset, void *buf, uint32_t *got)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READ, uio);
+	uint32_t n;
+	off_t newoffset;
+	int result;
+
+	*got = 0;
+	while (*got < len) {
+		result = emu_rawread(sc, handle, len - *got, EMU_OP_READ,
+				     offset + *got, (char *)buf + *got,
+				     &n, &newoffset);
+		if (result) {
+			return result;
+		}
+		if (n == 0) {
+			break;
+		}
+		*got += n;
+	}
+	return 0;
 }
 
 /*
@@ -308,42 +377,84 @@ emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
 static
 int
 emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	    struct uio *uio)
+	    void *buf, struct uio *uio)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio);
+	return emu_doread(sc, handle, len, EMU_OP_READDIR, buf, uio);
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Write LEN bytes from BUF to a hardware-level file handle. As with
+ * reads, callers do their uiomove into BUF before coming here, so it
+ * happens without the device.
  */
 static
 int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	  struct uio *uio)
+	  off_t offset, const void *buf)
 {
+	uint64_t start;
 	int result;
 
-	KASSERT(uio->uio_rw == UIO_WRITE);
-
+	start = iostat_start(&sc->e_iostat);
 	lock_acquire(sc->e_lock);
 
+	memcpy(sc->e_iobuf, buf, len);
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
-
-	result = uiomove(sc->e_iobuf, len, uio);
-	if (result) {
-		goto out;
-	}
-
+	emu_wreg(sc, REG_OFFSET, offset);
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
 	result = emu_waitdone(sc);
 
- out:
 	lock_release(sc->e_lock);
+	iostat_done(&sc->e_iostat, start, true, result ? 0 : len, result);
 	return result;
 }
 
+/*
+ * Get a bounce buffer for moving up to RESID bytes, in EMU_MAXIO
+ * chunks, for emu_doread and emu_write; give it back with emu_putbuf.
+ * The uiomove into or out of it happens with no lock held, so it
+ * can't be one buffer under e_lock; instead a few are kept spare, and
+ * only when more I/Os than that are going at once is one allocated.
+ * They are all EMU_MAXIO bytes so any one will do.
+ */
+static
+void *
+emu_getbuf(struct emu_softc *sc, size_t resid, uint32_t *size)
+{
+	void *buf = NULL;
+
+	*size = resid < EMU_MAXIO ? resid : EMU_MAXIO;
+	if (*size == 0) {
+		return NULL;
+	}
+	spinlock_acquire(&sc->e_bufspin);
+	if (sc->e_nspare > 0) {
+		buf = sc->e_spare[--sc->e_nspare];
+	}
+	spinlock_release(&sc->e_bufspin);
+	if (buf == NULL) {
+		buf = kmalloc(EMU_MAXIO);
+	}
+	return buf;
+}
+
+static
+void
+emu_putbuf(struct emu_softc *sc, void *buf)
+{
+	if (buf == NULL) {
+		return;
+	}
+	spinlock_acquire(&sc->e_bufspin);
+	if (sc->e_nspare < EMU_SPAREBUFS) {
+		sc->e_spare[sc->e_nspare++] = buf;
+		buf = NULL;
+	}
+	spinlock_release(&sc->e_bufspin);
+	kfree(buf);
+}
+
 /*
  * Get the file size associated with a hardware-level file handle.
  */
@@ -398,6 +509,7 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 
 static int emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   struct emufs_vnode **ret);
+static int emufs_wflush(struct emufs_vnode *ev);
 
 /*
  * VOP_OPEN on files
@@ -453,8 +565,13 @@ static
 int
 emufs_close(struct vnode *v)
 {
-	(void)v;
-	return 0;
+	struct emufs_vnode *ev = v->vn_data;
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_wflush(ev);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -472,24 +589,34 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
+	 * ef_vnlock keeps the vnode table steady, and keeps anyone from
+	 * loading a vnode for our handle number, which the host may hand
+	 * out again once we close it, until we're out of the table.
+	 * The device itself is only locked by emu_close for the close.
 	 */
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	lock_acquire(ef->ef_vnlock);
 
-	if (ev->ev_v.vn_refcount != 1) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+	/* Someone may have picked it up again since VOP_DECREF looked */
+	if (vnode_decref_notlast(&ev->ev_v)) {
+		/* that consumed the reference VOP_DECREF gave us */
+		lock_release(ef->ef_vnlock);
 		return EBUSY;
 	}
 
+	/* Nothing else can have the vnode, but the flusher can't see it */
+	lock_acquire(ev->ev_lock);
+	result = emufs_wflush(ev);
+	lock_release(ev->ev_lock);
+	if (result) {
+		lock_release(ef->ef_vnlock);
+		return result;
+	}
+
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
 		return result;
 	}
 
@@ -509,50 +636,147 @@ emufs_reclaim(struct vnode *v)
 		      ef->ef_emu->e_unit, ev->ev_handle);
 	}
 
-	vnodearray_remove(ef->ef_vnodes, ix);
+	vnodearray_remove_unordered(ef->ef_vnodes, ix);
 	VOP_CLEANUP(&ev->ev_v);
 
-	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
+	lock_release(ef->ef_vnlock);
 
+	for (i=0; i<EMUFS_NCBLOCKS; i++) {
+		kfree(ev->ev_cache[i].cb_data);
+	}
+	kfree(ev->ev_wbuf);
+	lock_destroy(ev->ev_lock);
 	kfree(ev);
 	return 0;
 }
 
+/*
+ * Throw away everything cached for EV. Call with ev_lock held.
+ */
+static
+void
+emufs_cinval(struct emufs_vnode *ev)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	ev->ev_sizevalid = false;
+	for (i=0; i<EMUFS_NCBLOCKS; i++) {
+		ev->ev_cache[i].cb_offset = -1;
+	}
+}
+
+/*
+ * Find the cache block for the data at OFFSET (a multiple of
+ * EMUFS_CBSIZE) in EV, reading it in if it isn't there. Call with
+ * ev_lock held.
+ */
+static
+int
+emufs_cget(struct emufs_vnode *ev, off_t offset, struct emufs_cblock **ret)
+{
+	struct emufs_cblock *cb, *victim = NULL;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+	KASSERT(offset % EMUFS_CBSIZE == 0);
+
+	for (i=0; i<EMUFS_NCBLOCKS; i++) {
+		cb = &ev->ev_cache[i];
+		if (cb->cb_offset == offset) {
+			cb->cb_stamp = ++ev->ev_clock;
+			*ret = cb;
+			return 0;
+		}
+		if (victim == NULL || cb->cb_offset < 0 ||
+		    (victim->cb_offset >= 0 &&
+		     cb->cb_stamp < victim->cb_stamp)) {
+			victim = cb;
+		}
+	}
+
+	if (victim->cb_data == NULL) {
+		victim->cb_data = kmalloc(EMUFS_CBSIZE);
+		if (victim->cb_data == NULL) {
+			return ENOMEM;
+		}
+	}
+	victim->cb_offset = -1;
+	result = emu_read(ev->ev_emu, ev->ev_handle, EMUFS_CBSIZE, offset,
+			  victim->cb_data, &victim->cb_len);
+	if (result) {
+		return result;
+	}
+	victim->cb_offset = offset;
+	victim->cb_stamp = ++ev->ev_clock;
+	*ret = victim;
+	return 0;
+}
+
 /*
  * VOP_READ
+ *
+ * Goes through the vnode's cache a block at a time. The data is
+ * copied from the cache into a bounce buffer under ev_lock and moved
+ * to the uio after; the uiomove may fault, and the fault may need to
+ * read this same file.
  */
 static
 int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	struct emufs_cblock *cb;
+	off_t blockoff;
+	uint32_t skip, amt;
+	void *buf;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	while (uio->uio_resid > 0) {
-		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
-		}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+	buf = emu_getbuf(ev->ev_emu, EMUFS_CBSIZE, &amt);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
 
-		oldresid = uio->uio_resid;
+	while (uio->uio_resid > 0) {
+		skip = uio->uio_offset % EMUFS_CBSIZE;
+		blockoff = uio->uio_offset - skip;
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
+		lock_acquire(ev->ev_lock);
+		result = emufs_wflush(ev);
+		if (result == 0) {
+			result = emufs_cget(ev, blockoff, &cb);
+		}
 		if (result) {
-			return result;
+			lock_release(ev->ev_lock);
+			break;
+		}
+		amt = cb->cb_len > skip ? cb->cb_len - skip : 0;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
 		}
+		memcpy(buf, (char *)cb->cb_data + skip, amt);
+		lock_release(ev->ev_lock);
 
-		if (uio->uio_resid == oldresid) {
+		if (amt == 0) {
 			/* nothing read - EOF */
 			break;
 		}
+
+		result = uiomove(buf, amt, uio);
+		if (result) {
+			break;
+		}
 	}
 
-	return 0;
+	emu_putbuf(ev->ev_emu, buf);
+	return result;
 }
 
 /*
@@ -564,51 +788,193 @@ emufs_getdirentry(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
 	uint32_t amt;
+	void *buf;
+	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	amt = uio->uio_resid;
-	if (amt > EMU_MAXIO) {
-		amt = EMU_MAXIO;
+	buf = emu_getbuf(ev->ev_emu, uio->uio_resid, &amt);
+	if (buf == NULL && amt > 0) {
+		return ENOMEM;
+	}
+
+	result = emu_readdir(ev->ev_emu, ev->ev_handle, amt, buf, uio);
+	emu_putbuf(ev->ev_emu, buf);
+	return result;
+}
+
+/*
+ * Send EV's write-behind buffer to the device, if anything is in it.
+ * It's empty afterwards either way. Call with ev_lock held.
+ */
+static
+int
+emufs_wflush(struct emufs_vnode *ev)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	if (ev->ev_wblen == 0) {
+		return 0;
+	}
+	result = emu_write(ev->ev_emu, ev->ev_handle, ev->ev_wblen,
+			   ev->ev_wboff, ev->ev_wbuf);
+	ev->ev_wblen = 0;
+	return result;
+}
+
+/*
+ * Flush every vnode's write-behind buffer. Errors are only reported,
+ * since there's nobody to give them to.
+ */
+static
+void
+emufs_wflushall(struct emufs_fs *ef)
+{
+	struct emufs_vnode *ev;
+	unsigned i, num;
+	int result;
+
+	lock_acquire(ef->ef_vnlock);
+	num = vnodearray_num(ef->ef_vnodes);
+	for (i=0; i<num; i++) {
+		ev = vnodearray_get(ef->ef_vnodes, i)->vn_data;
+		lock_acquire(ev->ev_lock);
+		result = emufs_wflush(ev);
+		lock_release(ev->ev_lock);
+		if (result) {
+			kprintf("emu%d: write-behind on handle %u: %s\n",
+				ef->ef_emu->e_unit, ev->ev_handle,
+				strerror(result));
+		}
+	}
+	lock_release(ef->ef_vnlock);
+}
+
+/*
+ * Work function: the timer for write-behind buffers is up.
+ */
+static
+void
+emufs_wbwork_run(void *arg)
+{
+	struct emufs_fs *ef = arg;
+
+	/* Writes from now on need another run */
+	spinlock_acquire(&ef->ef_wbspin);
+	ef->ef_wbarmed = false;
+	spinlock_release(&ef->ef_wbspin);
+
+	emufs_wflushall(ef);
+}
+
+/*
+ * Hold LEN bytes of BUF, for OFFSET in EV, in the write-behind buffer,
+ * flushing what's there first if this doesn't follow on from it or
+ * doesn't fit. A write that fills the buffer anyway, or when there's
+ * no memory for one, goes straight to the device. Call with ev_lock
+ * held.
+ */
+static
+int
+emufs_wbehind(struct emufs_vnode *ev, uint32_t len, off_t offset,
+	      const void *buf)
+{
+	struct emufs_fs *ef = ev->ev_v.vn_fs->fs_data;
+	bool arm;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+	KASSERT(len <= EMU_MAXIO);
+
+	if (ev->ev_wblen > 0 && (offset != ev->ev_wboff + ev->ev_wblen ||
+				 ev->ev_wblen + len > EMU_MAXIO)) {
+		result = emufs_wflush(ev);
+		if (result) {
+			return result;
+		}
+	}
+	if (ev->ev_wblen == 0 && len == EMU_MAXIO) {
+		return emu_write(ev->ev_emu, ev->ev_handle, len, offset, buf);
+	}
+	if (ev->ev_wbuf == NULL) {
+		ev->ev_wbuf = kmalloc(EMU_MAXIO);
+		if (ev->ev_wbuf == NULL) {
+			return emu_write(ev->ev_emu, ev->ev_handle, len,
+					 offset, buf);
+		}
+	}
+
+	if (ev->ev_wblen == 0) {
+		ev->ev_wboff = offset;
+	}
+	memcpy((char *)ev->ev_wbuf + ev->ev_wblen, buf, len);
+	ev->ev_wblen += len;
+	if (ev->ev_wblen == EMU_MAXIO) {
+		return emufs_wflush(ev);
 	}
 
-	return emu_readdir(ev->ev_emu, ev->ev_handle, amt, uio);
+	spinlock_acquire(&ef->ef_wbspin);
+	arm = !ef->ef_wbarmed;
+	ef->ef_wbarmed = true;
+	spinlock_release(&ef->ef_wbspin);
+	if (arm) {
+		work_enqueue_delayed(kworkq, &ef->ef_wbwork,
+				     EMUFS_WB_SECS * HZ);
+	}
+	return 0;
 }
 
 /*
  * VOP_WRITE
+ *
+ * The data goes through a bounce buffer, for the same reason as in
+ * emufs_read, and on to the write-behind buffer (see emufs.h).
  */
 static
 int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
-	size_t oldresid;
-	int result;
+	uint32_t amt, bufsize;
+	off_t offset;
+	void *buf;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+	buf = emu_getbuf(ev->ev_emu, uio->uio_resid, &bufsize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
-		if (amt > EMU_MAXIO) {
-			amt = EMU_MAXIO;
+		if (amt > bufsize) {
+			amt = bufsize;
 		}
 
-		oldresid = uio->uio_resid;
-
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
+		offset = uio->uio_offset;
+		result = uiomove(buf, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
-		if (uio->uio_resid == oldresid) {
-			/* nothing written...? */
+		lock_acquire(ev->ev_lock);
+		emufs_cinval(ev);
+		result = emufs_wbehind(ev, amt, offset, buf);
+		lock_release(ev->ev_lock);
+		if (result) {
 			break;
 		}
 	}
 
-	return 0;
+	emu_putbuf(ev->ev_emu, buf);
+	return result;
 }
 
 /*
@@ -641,10 +1007,21 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
-	if (result) {
-		return result;
+	lock_acquire(ev->ev_lock);
+	if (!ev->ev_sizevalid) {
+		result = emufs_wflush(ev);
+		if (result == 0) {
+			result = emu_getsize(ev->ev_emu, ev->ev_handle,
+					     &ev->ev_size);
+		}
+		if (result) {
+			lock_release(ev->ev_lock);
+			return result;
+		}
+		ev->ev_sizevalid = true;
 	}
+	statbuf->st_size = ev->ev_size;
+	lock_release(ev->ev_lock);
 
 	result = VOP_GETTYPE(v, &statbuf->st_mode);
 	if (result) {
@@ -705,8 +1082,13 @@ static
 int
 emufs_fsync(struct vnode *v)
 {
-	(void)v;
-	return 0;
+	struct emufs_vnode *ev = v->vn_data;
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_wflush(ev);
+	lock_release(ev->ev_lock);
+	return result;
 }
 
 /*
@@ -717,7 +1099,59 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	emufs_cinval(ev);
+	result = emufs_wflush(ev);
+	if (result == 0) {
+		result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	}
+	lock_release(ev->ev_lock);
+	return result;
+}
+
+/*
+ * VOP_FALLOCATE. The host file system does the allocating, so all
+ * there is to do here is grow the file.
+ */
+static
+int
+emufs_fallocate(struct vnode *v, off_t pos, off_t len)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	off_t size;
+	int result;
+
+	lock_acquire(ev->ev_lock);
+	result = emufs_wflush(ev);
+	if (result == 0) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle, &size);
+	}
+	if (result == 0 && pos + len > size) {
+		emufs_cinval(ev);
+		result = emu_trunc(ev->ev_emu, ev->ev_handle, pos + len);
+	}
+	lock_release(ev->ev_lock);
+	return result;
+}
+
+/*
+ * VOP_COPYRANGE. The emulator has no copy operation of its own, so
+ * this goes through a buffer like anything else.
+ */
+static
+int
+emufs_copyrange(struct vnode *v, off_t pos, struct vnode *src,
+		off_t spos, off_t len, off_t *copied)
+{
+	(void)v;
+	(void)pos;
+	(void)src;
+	(void)spos;
+	(void)len;
+	(void)copied;
+	return ENOSYS;
 }
 
 /*
@@ -735,7 +1169,8 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 	int result;
 	int isdir;
 
-	result = emu_open(ev->ev_emu, ev->ev_handle, name, true, excl, mode,
+	result = emu_open(ev->ev_emu, ev->ev_handle, name, strlen(name),
+			  true, excl, mode,
 			  &handle, &isdir);
 	if (result) {
 		return result;
@@ -752,11 +1187,12 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 }
 
 /*
- * VOP_LOOKUP
+ * Look up the first LEN characters of PATHNAME.
  */
 static
 int
-emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
+emufs_dolookup(struct vnode *dir, const char *pathname, size_t len,
+	       struct vnode **ret)
 {
 	struct emufs_vnode *ev = dir->vn_data;
 	struct emufs_fs *ef = dir->vn_fs->fs_data;
@@ -765,8 +1201,8 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
-	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
-			  &handle, &isdir);
+	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, len,
+			  false, false, 0, &handle, &isdir);
 	if (result) {
 		return result;
 	}
@@ -781,15 +1217,25 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	return 0;
 }
 
+/*
+ * VOP_LOOKUP
+ */
+static
+int
+emufs_lookup(struct vnode *dir, const char *pathname, struct vnode **ret)
+{
+	return emufs_dolookup(dir, pathname, strlen(pathname), ret);
+}
+
 /*
  * VOP_LOOKPARENT
  */
 static
 int
-emufs_lookparent(struct vnode *dir, char *pathname, struct vnode **ret,
+emufs_lookparent(struct vnode *dir, const char *pathname, struct vnode **ret,
 		 char *buf, size_t len)
 {
-	char *s;
+	const char *s;
 
 	s = strrchr(pathname, '/');
 	if (s==NULL) {
@@ -803,14 +1249,13 @@ emufs_lookparent(struct vnode *dir, char *pathname, struct vnode **ret,
 		return 0;
 	}
 
-	*s = 0;
-	s++;
-	if (strlen(s)+1 > len) {
+	if (strlen(s+1)+1 > len) {
 		return ENAMETOOLONG;
 	}
-	strcpy(buf, s);
+	strcpy(buf, s+1);
 
-	return emufs_lookup(dir, pathname, ret);
+	/* The host looks up the directory part, without the slash */
+	return emufs_dolookup(dir, pathname, s - pathname, ret);
 }
 
 /*
@@ -846,6 +1291,72 @@ emufs_mmap(struct vnode *v)
 	return EUNIMP;
 }
 
+/*
+ * VOP_GETPAGE - emufs files aren't kept in the file page cache.
+ */
+static
+int
+emufs_getpage(struct vnode *v, uint32_t index, bool forwrite,
+	      struct fcpage **ret)
+{
+	(void)v;
+	(void)index;
+	(void)forwrite;
+	(void)ret;
+	return ENOSYS;
+}
+
+/*
+ * VOP_ADVISE - the host does its own caching, so hints are ignored.
+ */
+static
+int
+emufs_advise(struct vnode *v, off_t pos, off_t len, int advice)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)advice;
+	return 0;
+}
+
+/*
+ * VOP_SYNCRANGE - the only writes held back are the write-behind
+ * buffer's, and handing those to the host doesn't take long enough to
+ * be worth doing in the background, so that's done here and now.
+ */
+static
+int
+emufs_syncrange(struct vnode *v, off_t pos, off_t len, unsigned flags)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	int result = 0;
+
+	(void)pos;
+	(void)len;
+
+	if (flags & SYNC_FILE_RANGE_WRITE) {
+		lock_acquire(ev->ev_lock);
+		result = emufs_wflush(ev);
+		lock_release(ev->ev_lock);
+	}
+	return result;
+}
+
+/*
+ * Called for poll(). Emufs I/O never waits for anything poll could
+ * wait for.
+ */
+static
+int
+emufs_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	(void)v;
+	(void)pw;
+	*revents = events & (POLLIN | POLLOUT);
+	return 0;
+}
+
 //////////////////////////////
 
 /*
@@ -1037,7 +1548,8 @@ emufs_rename_notdir(struct vnode *v1, const char *n1,
 
 static
 int
-emufs_lookup_notdir(struct vnode *v, char *pathname, struct vnode **result)
+emufs_lookup_notdir(struct vnode *v, const char *pathname,
+		    struct vnode **result)
 {
 	(void)v;
 	(void)pathname;
@@ -1047,8 +1559,8 @@ emufs_lookup_notdir(struct vnode *v, char *pathname, struct vnode **result)
 
 static
 int
-emufs_lookparent_notdir(struct vnode *v, char *pathname, struct vnode **result,
-			char *buf, size_t len)
+emufs_lookparent_notdir(struct vnode *v, const char *pathname,
+			struct vnode **result, char *buf, size_t len)
 {
 	(void)v;
 	(void)pathname;
@@ -1068,6 +1580,30 @@ emufs_truncate_isdir(struct vnode *v, off_t len)
 	return ENOTDIR;
 }
 
+static
+int
+emufs_fallocate_isdir(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return EISDIR;
+}
+
+static
+int
+emufs_copyrange_isdir(struct vnode *v, off_t pos, struct vnode *src,
+		      off_t spos, off_t len, off_t *copied)
+{
+	(void)v;
+	(void)pos;
+	(void)src;
+	(void)spos;
+	(void)len;
+	(void)copied;
+	return EISDIR;
+}
+
 //////////////////////////////
 
 /*
@@ -1090,7 +1626,13 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_tryseek,
 	emufs_fsync,
 	emufs_mmap,
+	emufs_getpage,
+	emufs_advise,
+	emufs_syncrange,
+	emufs_poll,
 	emufs_truncate,
+	emufs_fallocate,
+	emufs_copyrange,
 	emufs_uio_op_notdir, /* namefile */
 
 	emufs_creat_notdir,
@@ -1125,7 +1667,13 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_dir_tryseek,
 	emufs_void_op_isdir,  /* fsync */
 	emufs_void_op_isdir,  /* mmap */
+	emufs_getpage,
+	emufs_advise,
+	emufs_syncrange,
+	emufs_poll,
 	emufs_truncate_isdir,
+	emufs_fallocate_isdir,
+	emufs_copyrange_isdir,
 	emufs_namefile,
 
 	emufs_creat,
@@ -1153,8 +1701,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	lock_acquire(ef->ef_vnlock);
 
 	num = vnodearray_num(ef->ef_vnodes);
 	for (i=0; i<num; i++) {
@@ -1165,8 +1712,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 			VOP_INCREF(&ev->ev_v);
 
-			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
+			lock_release(ef->ef_vnlock);
 			*ret = ev;
 			return 0;
 		}
@@ -1176,18 +1722,37 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev = kmalloc(sizeof(struct emufs_vnode));
 	if (ev==NULL) {
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(ef->ef_vnlock);
 		return ENOMEM;
 	}
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
 
+	ev->ev_lock = lock_create("emufs-vnode");
+	if (ev->ev_lock == NULL) {
+		lock_release(ef->ef_vnlock);
+		kfree(ev);
+		return ENOMEM;
+	}
+	ev->ev_sizevalid = false;
+	ev->ev_size = 0;
+	ev->ev_clock = 0;
+	for (i=0; i<EMUFS_NCBLOCKS; i++) {
+		ev->ev_cache[i].cb_offset = -1;
+		ev->ev_cache[i].cb_len = 0;
+		ev->ev_cache[i].cb_stamp = 0;
+		ev->ev_cache[i].cb_data = NULL;
+	}
+	ev->ev_wbuf = NULL;
+	ev->ev_wboff = 0;
+	ev->ev_wblen = 0;
+
 	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			   &ef->ef_fs, ev);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
@@ -1196,14 +1761,13 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	if (result) {
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
-		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_vnlock);
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
 
-	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
+	lock_release(ef->ef_vnlock);
 
 	*ret = ev;
 	return 0;
@@ -1224,7 +1788,7 @@ static
 int
 emufs_sync(struct fs *fs)
 {
-	(void)fs;
+	emufs_wflushall(fs->fs_data);
 	return 0;
 }
 
@@ -1304,9 +1868,20 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 		kfree(ef);
 		return ENOMEM;
 	}
+	ef->ef_vnlock = lock_create("emufs-vnodes");
+	if (ef->ef_vnlock == NULL) {
+		vnodearray_destroy(ef->ef_vnodes);
+		kfree(ef);
+		return ENOMEM;
+	}
+	work_init(&ef->ef_wbwork, emufs_wbwork_run, ef);
+	spinlock_init(&ef->ef_wbspin);
+	ef->ef_wbarmed = false;
 
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
 	if (result) {
+		lock_destroy(ef->ef_vnlock);
+		vnodearray_destroy(ef->ef_vnodes);
 		kfree(ef);
 		return result;
 	}
@@ -1344,9 +1919,13 @@ config_emu(struct emu_softc *sc, int emuno)
 		sc->e_lock = NULL;
 		return ENOMEM;
 	}
+	softint_init(&sc->e_semsi, emu_softint, sc);
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
+	spinlock_init(&sc->e_bufspin);
+	sc->e_nspare = 0;
 
 	snprintf(name, sizeof(name), "emu%d", emuno);
+	iostat_register(&sc->e_iostat, name);
 
 	return emufs_addtovfs(sc, name);
 }
@@ -30,9 +30,13 @@
 #ifndef _LAMEBUS_EMU_H_
 #define _LAMEBUS_EMU_H_
 
+#include <spinlock.h>
+#include <device.h>
+#include <softint.h>
 
 #define EMU_MAXIO       16384
 #define EMU_ROOTHANDLE  0
+#define EMU_SPAREBUFS   2	/* bounce buffers kept between I/Os */
 
 /*
  * The per-device data used by the emufs device driver.
@@ -49,7 +53,14 @@ struct emu_softc {
 	/* Initialized by config_emu() */
 	struct lock *e_lock;
 	struct semaphore *e_sem;
+	struct softint e_semsi;		/* Signals e_sem */
 	void *e_iobuf;
+	struct iostat e_iostat;		/* reads and writes of file data */
+
+	/* Spare EMU_MAXIO bounce buffers (see emu_getbuf) */
+	struct spinlock e_bufspin;	/* protects e_spare and e_nspare */
+	void *e_spare[EMU_SPAREBUFS];
+	unsigned e_nspare;
 
 	/* Written by the interrupt handler */
 	uint32_t e_result;
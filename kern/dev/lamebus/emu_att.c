@@ -31,6 +31,8 @@
  * Code for probe/attach of the emu device to lamebus.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <lamebus/lamebus.h>
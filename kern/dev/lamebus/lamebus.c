@@ -31,11 +31,14 @@
  * Machine-independent LAMEbus code.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
 #include <spinlock.h>
 #include <current.h>
+#include <platform/maxcpus.h>
 #include <lamebus/lamebus.h>
 
 /* Register offsets within each config region */
@@ -147,16 +150,24 @@ lamebus_find_cpus(struct lamebus_softc *lamebus)
 		}
 	}
 
+	/*
+	 * Use the boot cpu and as many others as fit in MAXCPUS; the
+	 * rest are never started.
+	 */
+	lamebus->ls_cpus = self & cpumask;
 	for (i=0; i<numcpus; i++) {
-		if (i != bootcpu) {
+		if (i != bootcpu && cpu_count() < MAXCPUS) {
 			cpu_create(hwnum[i]);
+			lamebus->ls_cpus |= (uint32_t)1 << hwnum[i];
 		}
 	}
+	if (cpu_count() < numcpus) {
+		kprintf("lamebus: using %u of %u cpus\n", cpu_count(), numcpus);
+	}
 
 	/*
-	 * By default, route all interrupts only to the boot cpu. We
-	 * could be arbitrarily more elaborate, up to things like
-	 * dynamic load balancing.
+	 * By default, route all interrupts only to the boot cpu. They
+	 * can be moved afterwards with lamebus_route_interrupts.
 	 */
 
 	for (i=0; i<numcpus; i++) {
@@ -167,6 +178,7 @@ lamebus_find_cpus(struct lamebus_softc *lamebus)
 			val = 0xffffffff;
 		}
 		write_ctlcpu_register(lamebus, hwnum[i], CTLCPU_CIRQE, val);
+		lamebus->ls_cpuirqs[hwnum[i]] = val;
 	}
 }
 
@@ -189,7 +201,7 @@ lamebus_start_cpus(struct lamebus_softc *lamebus)
 	unsigned i;
 	unsigned cpunum;
 
-	cpumask = read_ctl_register(lamebus, CTLREG_CPUS);
+	cpumask = lamebus->ls_cpus;
 	self = read_ctl_register(lamebus, CTLREG_SELF);
 
 	/* Poke in the startup address. */
@@ -400,6 +412,64 @@ lamebus_unmask_interrupt(struct lamebus_softc *lamebus, int slot)
 }
 
 
+/*
+ * Route interrupts using the per-cpu CIRQE registers. The new cpu is
+ * given the slots before the others lose them; the interrupts are
+ * level-triggered, so one that comes in meanwhile isn't lost either
+ * way, and lamebus_interrupt only handles slots routed to its cpu.
+ */
+void
+lamebus_route_interrupts(struct lamebus_softc *lamebus, uint32_t slots,
+			 unsigned hwcpu)
+{
+	uint32_t bits;
+	unsigned i;
+
+	KASSERT(hwcpu < 32);
+	KASSERT((lamebus->ls_cpus & ((uint32_t)1 << hwcpu)) != 0);
+
+	spinlock_acquire(&lamebus->ls_lock);
+	bits = lamebus->ls_cpuirqs[hwcpu] | slots;
+	if (bits != lamebus->ls_cpuirqs[hwcpu]) {
+		write_ctlcpu_register(lamebus, hwcpu, CTLCPU_CIRQE, bits);
+		lamebus->ls_cpuirqs[hwcpu] = bits;
+	}
+	for (i=0; i<32; i++) {
+		if (i == hwcpu ||
+		    (lamebus->ls_cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		bits = lamebus->ls_cpuirqs[i] & ~slots;
+		if (bits != lamebus->ls_cpuirqs[i]) {
+			write_ctlcpu_register(lamebus, i, CTLCPU_CIRQE, bits);
+			lamebus->ls_cpuirqs[i] = bits;
+		}
+	}
+	spinlock_release(&lamebus->ls_lock);
+}
+
+unsigned
+lamebus_interrupt_cpu(struct lamebus_softc *lamebus, int slot,
+		      unsigned *count)
+{
+	uint32_t mask = ((uint32_t)1) << slot;
+	unsigned i, hwcpu;
+
+	KASSERT(slot >= 0 && slot < LB_NSLOTS);
+
+	spinlock_acquire(&lamebus->ls_lock);
+	hwcpu = 0;
+	for (i=0; i<32; i++) {
+		if (lamebus->ls_cpuirqs[i] & mask) {
+			hwcpu = i;
+			break;
+		}
+	}
+	*count = lamebus->ls_irqcount[slot];
+	spinlock_release(&lamebus->ls_lock);
+	return hwcpu;
+}
+
 /*
  * LAMEbus interrupt handling function. (Machine-independent!)
  */
@@ -419,7 +489,7 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 
 	int slot;
 	uint32_t mask;
-	uint32_t irqs;
+	uint32_t irqs, mine;
 	void (*handler)(void *);
 	void *data;
 
@@ -435,10 +505,20 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 
 	/*
 	 * Read the LAMEbus controller register that tells us which
-	 * slots are asserting an interrupt condition.
+	 * slots are asserting an interrupt condition. That covers the
+	 * whole bus; we only take the slots routed to this cpu, and
+	 * leave the others to the cpus they go to.
 	 */
+	mine = lamebus->ls_cpuirqs[curcpu->c_hardware_number];
 	irqs = read_ctl_register(lamebus, CTLREG_IRQS);
 
+	if (irqs != 0 && (irqs & mine) == 0) {
+		/* Rerouted away from us just now; not a dud */
+		spinlock_release(&lamebus->ls_lock);
+		return;
+	}
+	irqs &= mine;
+
 	if (irqs == 0) {
 		/*
 		 * Huh? None of them? Must be a glitch.
@@ -502,6 +582,7 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		 */
 		handler = lamebus->ls_irqfuncs[slot];
 		data = lamebus->ls_devdata[slot];
+		lamebus->ls_irqcount[slot]++;
 		spinlock_release(&lamebus->ls_lock);
 
 		handler(data);
@@ -512,9 +593,11 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		 * Reload the mask of pending IRQs - if we just called
 		 * hardclock, we might not have come back to this
 		 * context for some time, and it might have changed.
+		 * So might the routing.
 		 */
 
-		irqs = read_ctl_register(lamebus, CTLREG_IRQS);
+		mine = lamebus->ls_cpuirqs[curcpu->c_hardware_number];
+		irqs = read_ctl_register(lamebus, CTLREG_IRQS) & mine;
 	}
 
 
@@ -625,6 +708,10 @@ lamebus_init(void)
 	for (i=0; i<LB_NSLOTS; i++) {
 		lamebus->ls_devdata[i] = NULL;
 		lamebus->ls_irqfuncs[i] = NULL;
+		lamebus->ls_irqcount[i] = 0;
+	}
+	for (i=0; i<32; i++) {
+		lamebus->ls_cpuirqs[i] = 0;
 	}
 
 	return lamebus;
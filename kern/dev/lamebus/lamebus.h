@@ -81,10 +81,21 @@ typedef void (*lb_irqfunc)(void *devdata);
 struct lamebus_softc {
 	struct spinlock ls_lock;
 
+	/* Hardware cpus we use (at most MAXCPUS); set at cpu probe */
+	uint32_t     ls_cpus;
+
 	/* Accessed from interrupts; synchronized with ls_lock */
 	uint32_t     ls_slotsinuse;
 	void        *ls_devdata[LB_NSLOTS];
 	lb_irqfunc   ls_irqfuncs[LB_NSLOTS];
+
+	/*
+	 * Slots whose interrupts go to each hardware cpu (what its
+	 * CIRQE register holds, which can't be read back), and how
+	 * many interrupts each slot has had. Also under ls_lock.
+	 */
+	uint32_t     ls_cpuirqs[32];
+	unsigned     ls_irqcount[LB_NSLOTS];
 };
 
 /*
@@ -138,6 +149,20 @@ void lamebus_detach_interrupt(struct lamebus_softc *, int slot);
 void lamebus_mask_interrupt(struct lamebus_softc *, int slot);
 void lamebus_unmask_interrupt(struct lamebus_softc *, int slot);
 
+/*
+ * Send the interrupts of the slots in SLOTS (one bit per slot) to
+ * hardware cpu HWCPU only. Every slot's interrupts go to exactly one
+ * cpu; at boot that is the boot cpu.
+ */
+void lamebus_route_interrupts(struct lamebus_softc *, uint32_t slots,
+			      unsigned hwcpu);
+
+/*
+ * The hardware cpu SLOT's interrupts go to, and how many it has had.
+ */
+unsigned lamebus_interrupt_cpu(struct lamebus_softc *, int slot,
+			       unsigned *count);
+
 /*
  * Function to call to handle a LAMEbus interrupt.
  */
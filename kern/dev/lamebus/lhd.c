@@ -33,11 +33,16 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioprio.h>
 #include <lib.h>
 #include <uio.h>
 #include <synch.h>
+#include <thread.h>
+#include <current.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <trace.h>
+#include <lathist.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -95,14 +100,23 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Record that an I/O has completed: save the result and, once we're
+ * out of the interrupt handler proper, poke the completion semaphore.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
 	lh->lh_result = err;
+	softint_schedule(&lh->lh_donesi);
+}
+
+static
+void
+lhd_donesoftint(void *vlh)
+{
+	struct lhd_softc *lh = vlh;
+
 	V(lh->lh_done);
 }
 
@@ -193,8 +207,145 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Request scheduling.
+ *
+ * One request has the device at a time and does all its sectors back
+ * to back. Requests that arrive meanwhile wait in lh_queue. When the
+ * device comes free, the next request is chosen from the best I/O
+ * class waiting (realtime, then best effort, then idle; the class is
+ * the requesting thread's) and within that C-LOOK style: the nearest
+ * one at or past the head position, going up, or the lowest one when
+ * there is nothing further up. So a reader and a writer on different
+ * parts of the disk get sweeps rather than a seek for every request.
+ * A request that has been passed over LHD_MAXAGE times (LHD_IDLEMAXAGE
+ * for the idle class) goes next anyway, whatever its class, so nothing
+ * waits forever.
+ */
+
+/*
+ * Whether R has waited as long as its class is made to.
+ */
+static
+bool
+lhd_overdue(struct lhd_req *r)
+{
+	return r->lr_age >= (r->lr_class == IOPRIO_IDLE ?
+			     LHD_IDLEMAXAGE : LHD_MAXAGE);
+}
+
+/*
+ * Wait for our turn at the device.
+ */
+static
+void
+lhd_reqwait(struct lhd_softc *lh, struct lhd_req *req)
+{
+	lock_acquire(lh->lh_qlock);
+	if (!lh->lh_busy) {
+		lh->lh_busy = true;
+	}
+	else {
+		req->lr_age = 0;
+		req->lr_go = false;
+		req->lr_next = lh->lh_queue;
+		lh->lh_queue = req;
+		while (!req->lr_go) {
+			cv_wait(lh->lh_qcv, lh->lh_qlock);
+		}
+	}
+	lock_release(lh->lh_qlock);
+}
+
+/*
+ * Give up the device, which was left at sector HEADPOS, and start the
+ * next request, if any.
+ */
+static
+void
+lhd_reqdone(struct lhd_softc *lh, uint32_t headpos)
+{
+	struct lhd_req *r, *next, *lowest, *oldest;
+	struct lhd_req **pp;
+	int class;
+
+	lock_acquire(lh->lh_qlock);
+	KASSERT(lh->lh_busy);
+	lh->lh_headpos = headpos;
+
+	if (lh->lh_queue == NULL) {
+		lh->lh_busy = false;
+		lock_release(lh->lh_qlock);
+		return;
+	}
+
+	class = IOPRIO_NCLASSES;
+	for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+		if (r->lr_class < class) {
+			class = r->lr_class;
+		}
+	}
+
+	next = lowest = oldest = NULL;
+	for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+		if (lhd_overdue(r) &&
+		    (oldest == NULL || r->lr_age > oldest->lr_age)) {
+			oldest = r;
+		}
+		if (r->lr_class != class) {
+			continue;
+		}
+		if (r->lr_sector >= headpos &&
+		    (next == NULL || r->lr_sector < next->lr_sector)) {
+			next = r;
+		}
+		if (lowest == NULL || r->lr_sector < lowest->lr_sector) {
+			lowest = r;
+		}
+	}
+	if (oldest != NULL) {
+		next = oldest;
+	}
+	else if (next == NULL) {
+		next = lowest;
+	}
+
+	for (pp = &lh->lh_queue; *pp != next; pp = &(*pp)->lr_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = next->lr_next;
+	for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+		r->lr_age++;
+	}
+
+	/* The device stays busy; it's handed straight over */
+	next->lr_go = true;
+	cv_broadcast(lh->lh_qcv, lh->lh_qlock);
+	lock_release(lh->lh_qlock);
+}
+
+/*
+ * Finish a request that got NDONE sectors from SECTOR done: hand on
+ * the device and record how it went. START and IOSTART are the
+ * request's lat_now and iostat_start times.
+ */
+static
+int
+lhd_iofinish(struct lhd_softc *lh, struct uio *uio, uint64_t start,
+	     uint64_t iostart, uint32_t sector, uint32_t ndone, int result)
+{
+	lhd_reqdone(lh, sector+ndone);
+	lat_record(LAT_DISK, start);
+	iostat_done(&lh->lh_dev.d_iostat, iostart, uio->uio_rw==UIO_WRITE,
+		    ndone * LHD_SECTSIZE, result);
+	return result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * The hardware does one sector per operation; a multi-sector request
+ * does them all before the device goes to anyone else.
  */
 static
 int
@@ -208,6 +359,8 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
+	struct lhd_req req;
+	uint64_t start, iostart;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -225,12 +378,17 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/* Wait until it's our turn. */
+	start = lat_now();
+	iostart = iostat_start(&lh->lh_dev.d_iostat);
+	req.lr_sector = sector;
+	req.lr_class = curthread->t_ioprio;
+	lhd_reqwait(lh, &req);
+	TRACE(TR_LHDIO, uio->uio_rw==UIO_WRITE, sector);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -238,8 +396,8 @@ lhd_io(struct device *d, struct uio *uio)
 		if (uio->uio_rw == UIO_WRITE) {
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				return lhd_iofinish(lh, uio, start, iostart,
+						    sector, i, result);
 			}
 		}
 
@@ -263,16 +421,15 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
 		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			return lhd_iofinish(lh, uio, start, iostart,
+					    sector, i, result);
 		}
 	}
 
-	return 0;
+	/* Let the next request go ahead. */
+	return lhd_iofinish(lh, uio, start, iostart, sector, len, 0);
 }
 
 /*
@@ -289,27 +446,41 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
+	/* Create the synchronization objects. */
 	lh->lh_done = sem_create("lhd-done", 0);
 	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
 		return ENOMEM;
 	}
+	softint_init(&lh->lh_donesi, lhd_donesoftint, lh);
+	lh->lh_qlock = lock_create("lhd-queue");
+	if (lh->lh_qlock == NULL) {
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+	lh->lh_qcv = cv_create("lhd-queue");
+	if (lh->lh_qcv == NULL) {
+		lock_destroy(lh->lh_qlock);
+		lh->lh_qlock = NULL;
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+	lh->lh_queue = NULL;
+	lh->lh_busy = false;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_poll = NULL;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
 	lh->lh_dev.d_data = lh;
+	iostat_register(&lh->lh_dev.d_iostat, name);
 
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
@@ -31,12 +31,36 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <softint.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * After this many requests have been let ahead of a waiting one, it
+ * goes next regardless of where the head is.
+ */
+#define LHD_MAXAGE  16
+
+/*
+ * The same, for requests in the idle I/O class, which are meant to be
+ * let ahead of a good deal more.
+ */
+#define LHD_IDLEMAXAGE  64
+
+/*
+ * A request waiting for the disk. Lives on the requester's stack.
+ */
+struct lhd_req {
+	uint32_t lr_sector;		/* first sector */
+	int lr_class;			/* I/O class (IOPRIO_*) */
+	unsigned lr_age;		/* requests served while waiting */
+	bool lr_go;			/* set when it's this one's turn */
+	struct lhd_req *lr_next;
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -52,8 +76,15 @@ struct lhd_softc {
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct semaphore *lh_done;	/* Signalled once the I/O is done */
+	struct softint lh_donesi;	/* Signals lh_done */
+
+	/* Request queue; see lhd_io */
+	struct lock *lh_qlock;
+	struct cv *lh_qcv;		/* signalled when a request may go */
+	struct lhd_req *lh_queue;	/* waiting, in no particular order */
+	bool lh_busy;			/* a request has the device */
+	uint32_t lh_headpos;		/* sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
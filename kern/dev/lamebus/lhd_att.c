@@ -30,6 +30,8 @@
 /*
  * Code for probe/attach of lhd to LAMEbus.
  */
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <lamebus/lamebus.h>
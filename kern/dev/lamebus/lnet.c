@@ -27,12 +27,296 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * LAMEbus network card (lnet) driver.
+ *
+ * The card has one buffer each way, so it can hold just one received
+ * frame until we take it and send just one frame at a time. The
+ * interrupt handler takes a received frame off the card straight away,
+ * into a pbuf, and queues it for the rx thread; the card is free for
+ * the next frame as soon as that copy is done. Frames to send wait on
+ * a queue while the card is busy and the interrupt for the last one
+ * starts the next.
+ */
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-/*#include <lamebus/lnet.h>*/ /* not yet */
+#include <synch.h>
+#include <thread.h>
+#include <platform/bus.h>
+#include <lamebus/lnet.h>
 #include "autoconf.h"
+#include "opt-net.h"
+
+/* Registers (offsets within slot) */
+#define LNET_REG_RXINTR   0   /* Receive interrupt; write 0 to clear */
+#define LNET_REG_TXINTR   4   /* Transmit interrupt; write 0 to clear */
+#define LNET_REG_CONTROL  8   /* Control */
+#define LNET_REG_STATUS   12  /* Status */
+
+/* Interrupt register bits */
+#define LNET_INTR_DONE    1   /* A frame came in, or went out */
+
+/* Control register bits */
+#define LNET_CTL_PROMISC  1   /* Take all frames, not just ours */
+#define LNET_CTL_START    2   /* Send the frame in the transmit buffer */
+
+/* Status register */
+#define LNET_STAT_HWADDR  0xffff  /* Our station address */
+
+/* Buffers (offsets within slot) */
+#define LNET_RXBUF        32768
+#define LNET_TXBUF        (32768 + 4096)
+#define LNET_BUFSIZE      4096
+
+/* Real-time priority of the receive thread */
+#define LNET_RXPRIO       (SCHED_RTPRIO_MAX / 2)
+
+/*
+ * Link-level header at the front of every frame. lh_packetlen counts
+ * the header too.
+ */
+struct lnet_linkhdr {
+	uint32_t lh_frame;		/* LNET_FRAMEWORD */
+	uint16_t lh_from;		/* sender's station address */
+	uint16_t lh_packetlen;
+	uint16_t lh_to;			/* station address, or broadcast */
+	uint16_t lh_pad;
+};
+
+#define LNET_FRAMEWORD    0xa4b3c2d1
+
+#if OPT_NET
+
+/*
+ * Shortcut for reading a register.
+ */
+static
+inline
+uint32_t lnet_rdreg(struct lnet_softc *sc, uint32_t reg)
+{
+	return bus_read_register(sc->ln_busdata, sc->ln_buspos, reg);
+}
+
+/*
+ * Shortcut for writing a register.
+ */
+static
+inline
+void lnet_wreg(struct lnet_softc *sc, uint32_t reg, uint32_t val)
+{
+	bus_write_register(sc->ln_busdata, sc->ln_buspos, reg, val);
+}
+
+/*
+ * Give PB to the card to send, and the pbuf back to the pool. Call
+ * with ln_lock held and the card idle.
+ */
+static
+void
+lnet_start(struct lnet_softc *sc, struct pbuf *pb)
+{
+	KASSERT(spinlock_do_i_hold(&sc->ln_lock));
+	KASSERT(!sc->ln_txbusy);
+
+	memcpy(sc->ln_txbuf, PBUF_DATA(pb), pb->pb_len);
+	lnet_wreg(sc, LNET_REG_CONTROL, LNET_CTL_START);
+	sc->ln_txbusy = true;
+	sc->ln_if.if_opackets++;
+	pbuf_put(pb);
+}
+
+/*
+ * Take the frame the card has received, if we can, and queue it for
+ * the rx thread. Call from the interrupt handler, before telling the
+ * card it may overwrite the frame.
+ */
+static
+void
+lnet_receive(struct lnet_softc *sc)
+{
+	struct lnet_linkhdr lh;
+	struct pbuf *pb;
+
+	memcpy(&lh, sc->ln_rxbuf, sizeof(lh));
+	if (lh.lh_frame != LNET_FRAMEWORD ||
+	    lh.lh_packetlen < sizeof(lh) || lh.lh_packetlen > LNET_BUFSIZE) {
+		sc->ln_if.if_idrops++;
+		return;
+	}
+
+	pb = pbuf_get();
+	if (pb == NULL) {
+		sc->ln_if.if_idrops++;
+		return;
+	}
+	/* The whole frame, header and all; the rx thread strips it */
+	pb->pb_off = 0;
+	pb->pb_len = lh.lh_packetlen;
+	memcpy(pb->pb_buf, sc->ln_rxbuf, pb->pb_len);
+
+	if (spscring_put(&sc->ln_rxring, &pb, 1) == 0) {
+		pbuf_put(pb);
+		sc->ln_if.if_idrops++;
+		return;
+	}
+	sc->ln_if.if_ipackets++;
+	softint_schedule(&sc->ln_rxsi);
+}
+
+/*
+ * Interrupt handler for lnet.
+ */
+void
+lnet_irq(void *vsc)
+{
+	struct lnet_softc *sc = vsc;
+	struct pbuf *pb;
+
+	spinlock_acquire(&sc->ln_lock);
+
+	if (lnet_rdreg(sc, LNET_REG_RXINTR) & LNET_INTR_DONE) {
+		lnet_receive(sc);
+		lnet_wreg(sc, LNET_REG_RXINTR, 0);
+	}
+
+	if (lnet_rdreg(sc, LNET_REG_TXINTR) & LNET_INTR_DONE) {
+		lnet_wreg(sc, LNET_REG_TXINTR, 0);
+		sc->ln_txbusy = false;
+		if (spscring_get(&sc->ln_txring, &pb, 1) == 1) {
+			lnet_start(sc, pb);
+		}
+	}
+
+	spinlock_release(&sc->ln_lock);
+}
+
+static
+void
+lnet_rxsoftint(void *vsc)
+{
+	struct lnet_softc *sc = vsc;
+
+	V(sc->ln_rxsem);
+}
 
+/*
+ * Hand received frames up, as many as are there each time we're woken.
+ * This thread is the only one that takes from ln_rxring. It runs
+ * SCHED_FIFO, so the ring is drained promptly even with the cpus busy
+ * and doesn't overflow.
+ */
+static
+void
+lnet_rxthread(void *vsc, unsigned long junk)
+{
+	struct lnet_softc *sc = vsc;
+	struct pbuf *pbs[LNET_RXRING];
+	struct lnet_linkhdr *lh;
+	unsigned i, n;
+
+	(void)junk;
+
+	while (1) {
+		P(sc->ln_rxsem);
+		while ((n = spscring_get(&sc->ln_rxring, pbs, LNET_RXRING)) > 0) {
+			for (i=0; i<n; i++) {
+				lh = PBUF_DATA(pbs[i]);
+				pbuf_pull(pbs[i], sizeof(*lh));
+				net_input(&sc->ln_if, lh->lh_from, pbs[i]);
+			}
+		}
+	}
+}
+
+/*
+ * if_output for lnet: put the link header on PB and send it, or queue
+ * it if the card is busy.
+ */
+static
+int
+lnet_output(struct netif *nif, uint16_t dst, struct pbuf *pb)
+{
+	struct lnet_softc *sc = nif->if_data;
+	struct lnet_linkhdr *lh;
+	int result = 0;
+
+	lh = pbuf_push(pb, sizeof(*lh));
+	lh->lh_frame = LNET_FRAMEWORD;
+	lh->lh_from = nif->if_addr;
+	lh->lh_packetlen = pb->pb_len;
+	lh->lh_to = dst;
+	lh->lh_pad = 0;
+	KASSERT(pb->pb_len <= LNET_BUFSIZE);
+
+	spinlock_acquire(&sc->ln_lock);
+	if (!sc->ln_txbusy) {
+		lnet_start(sc, pb);
+	}
+	else if (spscring_put(&sc->ln_txring, &pb, 1) == 0) {
+		nif->if_odrops++;
+		pbuf_put(pb);
+		result = EAGAIN;
+	}
+	spinlock_release(&sc->ln_lock);
+
+	return result;
+}
+
+int
+config_lnet(struct lnet_softc *sc, int lnetno)
+{
+	int result;
+
+	COMPILE_ASSERT(LNET_BUFSIZE <= PBUF_SIZE);
+
+	/* Get pointers to the on-card buffers. */
+	sc->ln_rxbuf = bus_map_area(sc->ln_busdata, sc->ln_buspos, LNET_RXBUF);
+	sc->ln_txbuf = bus_map_area(sc->ln_busdata, sc->ln_buspos, LNET_TXBUF);
+
+	spinlock_init(&sc->ln_lock);
+	spscring_init(&sc->ln_rxring, sc->ln_rxslots, sizeof(struct pbuf *),
+		      LNET_RXRING);
+	spscring_init(&sc->ln_txring, sc->ln_txslots, sizeof(struct pbuf *),
+		      LNET_TXRING);
+	sc->ln_txbusy = false;
+	sc->ln_rxsem = sem_create("lnet-rx", 0);
+	if (sc->ln_rxsem == NULL) {
+		return ENOMEM;
+	}
+	softint_init(&sc->ln_rxsi, lnet_rxsoftint, sc);
+
+	/* Set up what the network sees. */
+	bzero(&sc->ln_if, sizeof(sc->ln_if));
+	snprintf(sc->ln_if.if_name, sizeof(sc->ln_if.if_name), "lnet%d",
+		 lnetno);
+	sc->ln_if.if_addr = lnet_rdreg(sc, LNET_REG_STATUS) & LNET_STAT_HWADDR;
+	sc->ln_if.if_output = lnet_output;
+	sc->ln_if.if_data = sc;
+
+	result = thread_fork_rt(sc->ln_if.if_name, NULL, SCHED_FIFO,
+				LNET_RXPRIO, lnet_rxthread, sc, 0);
+	if (result) {
+		sem_destroy(sc->ln_rxsem);
+		sc->ln_rxsem = NULL;
+		return result;
+	}
+	net_attach(&sc->ln_if);
+
+	/* Throw away anything left over, and let frames in. */
+	spinlock_acquire(&sc->ln_lock);
+	lnet_wreg(sc, LNET_REG_CONTROL, 0);
+	lnet_wreg(sc, LNET_REG_TXINTR, 0);
+	lnet_wreg(sc, LNET_REG_RXINTR, 0);
+	spinlock_release(&sc->ln_lock);
+
+	return 0;
+}
+
+#else /* !OPT_NET */
+
+/* lnet_att.c doesn't attach any cards, so this doesn't get called. */
 int
 config_lnet(struct lnet_softc *sc, int lnetno)
 {
@@ -43,4 +327,4 @@ config_lnet(struct lnet_softc *sc, int lnetno)
 	return ENODEV;
 }
 
-
+#endif /* OPT_NET */
@@ -0,0 +1,56 @@
+#ifndef _LAMEBUS_LNET_H_
+#define _LAMEBUS_LNET_H_
+
+#include <spinlock.h>
+#include <softint.h>
+#include <ring.h>
+#include <net.h>
+
+/*
+ * Frames queued in software. The card holds one frame each way; these
+ * rings are what stand in for the descriptor rings a real card would
+ * have. Both must be powers of two.
+ */
+#define LNET_RXRING  16		/* received, waiting for the rx thread */
+#define LNET_TXRING  16		/* waiting for the card to be free */
+
+/*
+ * Hardware device data associated with lnet (LAMEbus network card)
+ */
+struct lnet_softc {
+	/* Initialized by lower-level attach code */
+	void *ln_busdata;		/* The bus we're on */
+	uint32_t ln_buspos;		/* Our slot on that bus */
+	int ln_unit;			/* What number lnet we are */
+
+	/*
+	 * Initialized by config_lnet
+	 */
+
+	void *ln_rxbuf;			/* On-card receive buffer */
+	void *ln_txbuf;			/* On-card transmit buffer */
+	struct spinlock ln_lock;	/* registers, tx side, statistics */
+
+	/*
+	 * Receiving: lnet_irq copies each frame into a pbuf and puts it
+	 * on ln_rxring, and the softint wakes the rx thread, which hands
+	 * everything on the ring up to the network. However many frames
+	 * come in before the thread runs, it's woken once.
+	 */
+	struct spscring ln_rxring;
+	struct pbuf *ln_rxslots[LNET_RXRING];
+	struct semaphore *ln_rxsem;	/* V'd when there's work */
+	struct softint ln_rxsi;		/* V's ln_rxsem */
+
+	/* Sending: frames waiting while the card is busy; ln_lock */
+	struct spscring ln_txring;
+	struct pbuf *ln_txslots[LNET_TXRING];
+	bool ln_txbusy;			/* the card has a frame */
+
+	struct netif ln_if;		/* what the network sees */
+};
+
+/* Functions called by lower-level drivers */
+void lnet_irq(/*struct lnet_softc*/ void *);	/* Interrupt handler */
+
+#endif /* _LAMEBUS_LNET_H_ */
@@ -27,10 +27,14 @@
  * SUCH DAMAGE.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <lamebus/lamebus.h>
+#include <lamebus/lnet.h>
 #include "autoconf.h"
+#include "opt-net.h"
 
 /* Lowest revision we support */
 #define LOW_VERSION   1
@@ -40,13 +44,35 @@
 struct lnet_softc *
 attach_lnet_to_lamebus(int lnetno, struct lamebus_softc *sc)
 {
+#if OPT_NET
+	struct lnet_softc *ln;
+#endif
 	int slot = lamebus_probe(sc, LB_VENDOR_CS161, LBCS161_NET,
 				 LOW_VERSION, HIGH_VERSION);
 	if (slot < 0) {
 		return NULL;
 	}
 
+#if OPT_NET
+	ln = kmalloc(sizeof(struct lnet_softc));
+	if (ln == NULL) {
+		/* Out of memory */
+		return NULL;
+	}
+
+	/* Record what the lnet is attached to */
+	ln->ln_busdata = sc;
+	ln->ln_buspos = slot;
+	ln->ln_unit = lnetno;
+
+	/* Mark the slot in use and collect interrupts */
+	lamebus_mark(sc, slot);
+	lamebus_attach_interrupt(sc, slot, ln, lnet_irq);
+
+	return ln;
+#else
 	kprintf("lnet%d: No network support in system\n", lnetno);
 
 	return NULL;
+#endif
 }
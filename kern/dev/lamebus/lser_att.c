@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <lamebus/lamebus.h>
@@ -30,6 +30,8 @@
 /*
  * Routine for probing/attaching ltimer to LAMEbus.
  */
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <lamebus/lamebus.h>
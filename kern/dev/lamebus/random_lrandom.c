@@ -32,6 +32,8 @@
  * random device.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <generic/random.h>
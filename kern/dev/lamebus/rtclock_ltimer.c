@@ -38,6 +38,8 @@
  * ltimer can provide this clock service.
  */
 
+#define KMTAG KMT_DEV
+
 #include <types.h>
 #include <lib.h>
 #include <generic/rtclock.h>
@@ -33,14 +33,18 @@
  * Filesystem-level interface routines.
  */
 
+#define KMTAG KMT_SFS
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -49,8 +53,10 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads do the whole bitmap at once, at mount time. Writes do only the
+ * sectors marked in sfs_mapdirty, since an allocation or free changes
+ * one bit and a big volume's bitmap is many sectors; each mark is
+ * cleared once its sector is written.
  *
  * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
  * bits, one bit for each sector on the filesystem. The number of
@@ -89,8 +95,14 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 		if (rw == UIO_READ) {
 			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
 		}
-		else {
+		else if (bitmap_isset(sfs->sfs_mapdirty, j)) {
 			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_mapdirty, j);
+			}
+		}
+		else {
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -98,6 +110,11 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 			return result;
 		}
 	}
+
+	/* The bitmap's free counts need redoing after loading new bits */
+	if (rw == UIO_READ) {
+		bitmap_resync(sfs->sfs_freemap);
+	}
 	return 0;
 }
 
@@ -111,10 +128,7 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs;
-	unsigned i, num;
-	int result;
-
-	vfs_biglock_acquire();
+	int result, result2;
 
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
@@ -148,18 +162,119 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* A commit writes the data and metadata itself, via the journal */
+	if (sfs->sfs_journal != NULL) {
+		result = sfs_journal_commit(sfs);
+	}
+	else {
+		result = sfs_writedata(sfs);
+		result2 = sfs_writemeta(sfs);
+		if (result == 0) {
+			result = result2;
+		}
+	}
+
+	/* Now put it all in place on disk */
+	result2 = buf_flush(sfs->sfs_device);
+	return result ? result : result2;
+}
+
+/*
+ * Call FUNC for each loaded vnode of SFS, in inode order, and return
+ * the first error, after trying every one.
+ */
+static
+int
+sfs_eachvnode(struct sfs_fs *sfs, int (*func)(struct sfs_vnode *))
+{
+	struct vnodearray *snap;
+	struct sfs_vnode *sv, *other;
+	unsigned i, j, num;
+	int result, firsterr;
+
+	/*
+	 * Take a reference to each loaded vnode and call FUNC after
+	 * letting go of sfs_vnlock: it takes the vnode's own lock,
+	 * which comes before sfs_vnlock in the lock order.
+	 *
+	 * The snapshot is sorted by inode number as it's taken, and an
+	 * inode's number is its block, so inodes synced this way go out
+	 * in one pass across the disk. They only go as far as the buffer
+	 * cache; the device is flushed once, by the caller, rather than
+	 * once per file as VOP_FSYNC would.
+	 */
+	snap = vnodearray_create();
+	if (snap == NULL) {
+		return ENOMEM;
+	}
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs_vnhash_count(&sfs->sfs_vnodes);
+	result = vnodearray_setsize(snap, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(snap);
+		return result;
+	}
+	i = 0;
+	sv = sfs_vnhash_next(&sfs->sfs_vnodes, NULL);
+	while (sv != NULL) {
+		VOP_INCREF(&sv->sv_v);
+		for (j = i; j > 0; j--) {
+			other = vnodearray_get(snap, j-1)->vn_data;
+			if (other->sv_ino < sv->sv_ino) {
+				break;
+			}
+			vnodearray_set(snap, j, &other->sv_v);
+		}
+		vnodearray_set(snap, j, &sv->sv_v);
+		i++;
+		sv = sfs_vnhash_next(&sfs->sfs_vnodes, sv);
+	}
+	KASSERT(i == num);
+	lock_release(sfs->sfs_vnlock);
+
+	/* Keep going past errors, but report the first one */
+	firsterr = 0;
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(snap, i);
+		result = func(v->vn_data);
+		if (result && firsterr == 0) {
+			firsterr = result;
+		}
+		VOP_DECREF(v);
 	}
+	vnodearray_setsize(snap, 0);
+	vnodearray_destroy(snap);
+	return firsterr;
+}
+
+/*
+ * Write the file data out, for sfs_sync and journal commits.
+ */
+int
+sfs_writedata(struct sfs_fs *sfs)
+{
+	return sfs_eachvnode(sfs, sfs_vnode_writeback);
+}
+
+/*
+ * Write the metadata out to the buffer cache, for sfs_sync and journal
+ * commits.
+ */
+int
+sfs_writemeta(struct sfs_fs *sfs)
+{
+	int result, firsterr;
+
+	firsterr = sfs_eachvnode(sfs, sfs_vnode_sync);
+
+	lock_acquire(sfs->sfs_fslock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_fslock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,14 +284,15 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_fslock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_fslock);
+
+	return firsterr;
 }
 
 /*
@@ -189,13 +305,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name never changes while mounted; no lock needed */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,31 +320,42 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
-		return EBUSY;
+	/*
+	 * Do we have any files open? If so, can't unmount. New vnodes
+	 * only come from lookups, which the biglock held by vfs_unmount
+	 * keeps out, so the table stays empty from here.
+	 */
+	result = sfs_detach(sfs);
+	if (result) {
+		return result;
 	}
 
+	/* Erase what orphans are left and put everything in place */
+	sfs_journal_stop(sfs);
+
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	bitmap_destroy(sfs->sfs_mapdirty);
 	bitmap_destroy(sfs->sfs_freemap);
+	sfs_vnhash_cleanup(&sfs->sfs_vnodes);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_fslock);
 
-	/* The vfs layer takes care of the device for us */
-	(void)sfs->sfs_device;
+	/*
+	 * The vfs layer takes care of the device for us, but the
+	 * buffer cache shouldn't keep blocks from it.
+	 */
+	buf_purge(sfs->sfs_device);
 
 	/* Destroy the fs object */
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -282,17 +405,15 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
-	/* Allocate object */
-	sfs = kmalloc(sizeof(struct sfs_fs));
-	if (sfs==NULL) {
+	result = sfs_vnode_cache_init();
+	if (result) {
 		vfs_biglock_release();
-		return ENOMEM;
+		return result;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
+	/* Allocate object */
+	sfs = kmalloc(sizeof(struct sfs_fs));
+	if (sfs==NULL) {
 		vfs_biglock_release();
 		return ENOMEM;
 	}
@@ -300,11 +421,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
 
+	/* Not journaling until sfs_journal_start, at the end */
+	sfs->sfs_journal = NULL;
+
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buf_purge(dev);
 		vfs_biglock_release();
 		return result;
 	}
@@ -316,8 +440,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buf_purge(dev);
 		vfs_biglock_release();
 		return EINVAL;
 	}
@@ -330,23 +454,71 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/* Finish what a crash interrupted, before reading anything else */
+	result = sfs_journal_recover(sfs);
+	if (result) {
+		kfree(sfs);
+		buf_purge(dev);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buf_purge(dev);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_mapdirty = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_mapdirty == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		kfree(sfs);
+		buf_purge(dev);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		bitmap_destroy(sfs->sfs_mapdirty);
+		bitmap_destroy(sfs->sfs_freemap);
+		kfree(sfs);
+		buf_purge(dev);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* No vnodes loaded yet */
+	result = sfs_vnhash_init(&sfs->sfs_vnodes, SFS_VNHASH_MINSIZE);
+	if (result) {
+		bitmap_destroy(sfs->sfs_mapdirty);
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buf_purge(dev);
 		vfs_biglock_release();
 		return result;
 	}
 
+	/* Locks; see sfs.h for what they cover and the order */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	sfs->sfs_fslock = lock_create("sfs_fslock");
+	if (sfs->sfs_vnlock == NULL || sfs->sfs_fslock == NULL) {
+		if (sfs->sfs_vnlock != NULL) {
+			lock_destroy(sfs->sfs_vnlock);
+		}
+		if (sfs->sfs_fslock != NULL) {
+			lock_destroy(sfs->sfs_fslock);
+		}
+		sfs_vnhash_cleanup(&sfs->sfs_vnodes);
+		bitmap_destroy(sfs->sfs_mapdirty);
+		bitmap_destroy(sfs->sfs_freemap);
+		kfree(sfs);
+		buf_purge(dev);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -357,6 +529,23 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* the other fields */
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_ninactive = 0;
+	sfs->sfs_nerasing = 0;
+
+	result = sfs_journal_start(sfs);
+	if (result) {
+		lock_destroy(sfs->sfs_vnlock);
+		lock_destroy(sfs->sfs_fslock);
+		sfs_vnhash_cleanup(&sfs->sfs_vnodes);
+		bitmap_destroy(sfs->sfs_mapdirty);
+		bitmap_destroy(sfs->sfs_freemap);
+		kfree(sfs);
+		buf_purge(dev);
+		vfs_biglock_release();
+		return result;
+	}
+	sfs_attach(sfs);
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
@@ -0,0 +1,746 @@
+/*
+ * SFS metadata journal. See "Journaling" in sfs.h, and kern/sfs.h for
+ * the on-disk format.
+ */
+
+#define KMTAG KMT_SFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <workqueue.h>
+#include <vfs.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+
+/* Blocks copied to the journal per write */
+#define SFS_JSTAGE  8
+
+/*
+ * Blocks one operation can change besides freemap sectors: a rename
+ * has two directory blocks, the directory's inode and indirect block,
+ * and up to three file inodes. Add the freemap's size, since a
+ * truncate can free blocks anywhere, and that's what each open
+ * transaction has to leave room for.
+ */
+#define SFS_JSLACK_BASE  8
+
+struct sfs_journal {
+	struct sfs_fs *j_sfs;
+	struct rwlock *j_txlock;        /* transactions shared, commit excl. */
+	struct lock *j_lock;            /* the rest, except as noted */
+	unsigned j_cap;                 /* most blocks one commit logs */
+	unsigned j_slack;               /* room kept for each transaction */
+
+	uint32_t j_blocks[SFS_JOURNAL_MAX];  /* the blocks held now */
+	unsigned j_n;
+	unsigned j_pending;             /* inodes/freemap sectors to write */
+	unsigned j_active;              /* open transactions */
+	bool j_overflow;                /* held all there was room for */
+	uint32_t j_seq;                 /* the open transaction */
+	uint32_t j_committed;           /* last one committed; j_txlock */
+	struct sfs_vnode *j_orphans;    /* unlinked; linked by sv_lrunext */
+
+	struct sfs_journal *j_next;     /* sfs_journals; vfs_biglock */
+	struct sfs_jheader j_header;    /* only used under j_txlock */
+	char *j_stage;                  /* SFS_JSTAGE blocks, likewise */
+};
+
+/*
+ * Journaled volumes, for the periodic commit. Covered by vfs_biglock,
+ * which mount and unmount hold.
+ */
+static struct sfs_journal *sfs_journals;
+static struct work sfs_journal_work;
+static bool sfs_journal_workstarted;
+
+////////////////////////////////////////////////////////////
+//
+// On-disk format
+
+/* Add N words to the journal checksum SUM (see kern/sfs.h) */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const uint32_t *words, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		sum = sum * 31 + words[i];
+	}
+	return sum;
+}
+
+/* The checksum of a header, before the logged blocks are added */
+static
+uint32_t
+sfs_jsum_header(uint32_t seq, uint32_t nblocks, const uint32_t *blocks)
+{
+	uint32_t sum = seq;
+
+	sum = sfs_jsum(sum, &nblocks, 1);
+	return sfs_jsum(sum, blocks, nblocks);
+}
+
+/* Write the journal header JH, filled in from the other arguments */
+static
+int
+sfs_journal_writeheader(struct sfs_fs *sfs, struct sfs_jheader *jh,
+			uint32_t seq, uint32_t nblocks, const uint32_t *blocks,
+			uint32_t sum)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(nblocks <= SFS_JOURNAL_MAX);
+	COMPILE_ASSERT(sizeof(*jh) == SFS_BLOCKSIZE);
+
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JOURNAL_MAGIC;
+	jh->jh_seq = seq;
+	jh->jh_nblocks = nblocks;
+	jh->jh_sum = sum;
+	if (nblocks > 0) {
+		memcpy(jh->jh_blocks, blocks, nblocks * sizeof(uint32_t));
+	}
+
+	uio_kinit(&iov, &ku, jh, SFS_BLOCKSIZE, 0, UIO_WRITE);
+	return buf_writedirect(sfs->sfs_device, sfs->sfs_super.sp_journal,
+			       1, &ku);
+}
+
+/* Clear the journal, so there's nothing to replay */
+static
+int
+sfs_journal_clear(struct sfs_fs *sfs, struct sfs_jheader *jh, uint32_t seq)
+{
+	return sfs_journal_writeheader(sfs, jh, seq, 0, NULL,
+				       sfs_jsum_header(seq, 0, NULL));
+}
+
+/* Read N logged blocks, from the Ith on, into STAGE */
+static
+int
+sfs_journal_readlog(struct sfs_fs *sfs, char *stage, unsigned i, unsigned n)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, stage, n * SFS_BLOCKSIZE, 0, UIO_READ);
+	return buf_readdirect(sfs->sfs_device,
+			      sfs->sfs_super.sp_journal + 1 + i, n, &ku);
+}
+
+/* Most blocks a journal of SP's size can log in one transaction */
+static
+unsigned
+sfs_journal_cap(const struct sfs_super *sp)
+{
+	if (sp->sp_journalsize - 1 < SFS_JOURNAL_MAX) {
+		return sp->sp_journalsize - 1;
+	}
+	return SFS_JOURNAL_MAX;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Recovery
+
+/*
+ * Replay the transaction left in the journal, if it is complete, and
+ * clear the journal. Called early in mount, before the freemap is
+ * loaded; sfs_super is read again afterwards, since the transaction
+ * may have changed it.
+ */
+int
+sfs_journal_recover(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_jheader *jh;
+	struct buf *b;
+	char *stage;
+	uint32_t sum;
+	unsigned i, k, m, n;
+	int result;
+
+	if (sp->sp_journal == 0) {
+		return 0;
+	}
+	if (sp->sp_journalsize < 2 ||
+	    sp->sp_journal < SFS_MAP_LOCATION +
+	    SFS_BITBLOCKS(sp->sp_nblocks) ||
+	    sp->sp_journal + sp->sp_journalsize > sp->sp_nblocks) {
+		kprintf("sfs: %s: bad journal location %u+%u\n",
+			sp->sp_volname, sp->sp_journal, sp->sp_journalsize);
+		return EINVAL;
+	}
+
+	jh = kmalloc(sizeof(*jh));
+	stage = kmalloc(SFS_JSTAGE * SFS_BLOCKSIZE);
+	if (jh == NULL || stage == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	/* Read the header */
+	{
+		struct iovec iov;
+		struct uio ku;
+
+		uio_kinit(&iov, &ku, jh, SFS_BLOCKSIZE, 0, UIO_READ);
+		result = buf_readdirect(sfs->sfs_device, sp->sp_journal,
+					1, &ku);
+		if (result) {
+			goto out;
+		}
+	}
+	n = jh->jh_nblocks;
+	if (jh->jh_magic != SFS_JOURNAL_MAGIC || n == 0 ||
+	    n > sfs_journal_cap(sp)) {
+		/* Nothing there, or not ours */
+		result = 0;
+		goto out;
+	}
+
+	/* Check the whole transaction made it before using any of it */
+	sum = sfs_jsum_header(jh->jh_seq, n, jh->jh_blocks);
+	for (i=0; i<n; i+=k) {
+		k = n - i < SFS_JSTAGE ? n - i : SFS_JSTAGE;
+		result = sfs_journal_readlog(sfs, stage, i, k);
+		if (result) {
+			goto out;
+		}
+		sum = sfs_jsum(sum, (uint32_t *)stage,
+			       k * SFS_BLOCKSIZE / sizeof(uint32_t));
+	}
+	if (sum != jh->jh_sum) {
+		/* The crash came while it was being written; the old is good */
+		result = 0;
+		goto out;
+	}
+	for (i=0; i<n; i++) {
+		if (jh->jh_blocks[i] >= sp->sp_nblocks) {
+			kprintf("sfs: %s: journal has block %u\n",
+				sp->sp_volname, jh->jh_blocks[i]);
+			result = EINVAL;
+			goto out;
+		}
+	}
+
+	/* Put each block where it goes, through the cache */
+	for (i=0; i<n; i+=k) {
+		k = n - i < SFS_JSTAGE ? n - i : SFS_JSTAGE;
+		result = sfs_journal_readlog(sfs, stage, i, k);
+		if (result) {
+			goto out;
+		}
+		for (m=0; m<k; m++) {
+			result = buf_get(sfs->sfs_device, jh->jh_blocks[i + m],
+					 &b);
+			if (result) {
+				goto out;
+			}
+			memcpy(buf_data(b), stage + m * SFS_BLOCKSIZE,
+			       SFS_BLOCKSIZE);
+			buf_markdirty(b);
+			buf_release(b);
+		}
+	}
+	result = buf_flush(sfs->sfs_device);
+	if (result) {
+		goto out;
+	}
+	kprintf("sfs: %s: replayed %u blocks from the journal\n",
+		sp->sp_volname, n);
+
+	result = sfs_journal_clear(sfs, jh, jh->jh_seq);
+	if (result) {
+		goto out;
+	}
+
+	/* The superblock may have been one of them */
+	result = sfs_rblock(sfs, sp, SFS_SB_LOCATION);
+	sp->sp_volname[sizeof(sp->sp_volname)-1] = 0;
+
+ out:
+	kfree(stage);
+	kfree(jh);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Transactions
+
+/* Whether one more transaction surely fits. Call with j_lock held. */
+static
+bool
+sfs_journal_fits(struct sfs_journal *j)
+{
+	/* The 1 is the superblock */
+	return j->j_n + j->j_pending + 1 +
+		j->j_slack * (j->j_active + 1) <= j->j_cap;
+}
+
+void
+sfs_tx_begin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool force = false;
+
+	if (j == NULL) {
+		return;
+	}
+
+	while (1) {
+		rwlock_acquire_read(j->j_txlock);
+		lock_acquire(j->j_lock);
+		if (force || sfs_journal_fits(j)) {
+			break;
+		}
+		lock_release(j->j_lock);
+		rwlock_release_read(j->j_txlock);
+
+		/* Make room; if that fails, go ahead and take the chance */
+		force = sfs_journal_commit(sfs) != 0;
+	}
+	j->j_active++;
+	lock_release(j->j_lock);
+}
+
+void
+sfs_tx_end(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	j->j_active--;
+	lock_release(j->j_lock);
+	rwlock_release_read(j->j_txlock);
+}
+
+int
+sfs_journal_hold(struct sfs_fs *sfs, struct buf *b, uint32_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL || buf_isheld(b)) {
+		return 0;
+	}
+
+	result = buf_hold(b);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(j->j_lock);
+	if (j->j_n >= j->j_cap) {
+		/*
+		 * Out of room, which the reservations in sfs_tx_begin
+		 * should prevent. Let it go out unjournaled, and have
+		 * the commit do the same with the rest.
+		 */
+		if (!j->j_overflow) {
+			kprintf("sfs: %s: journal full; committing "
+				"unjournaled\n", sfs->sfs_super.sp_volname);
+		}
+		j->j_overflow = true;
+		lock_release(j->j_lock);
+		buf_unhold(b);
+		return 0;
+	}
+	j->j_blocks[j->j_n++] = block;
+	lock_release(j->j_lock);
+	return 0;
+}
+
+void
+sfs_journal_note(struct sfs_fs *sfs, unsigned nblocks)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	lock_acquire(j->j_lock);
+	j->j_pending += nblocks;
+	lock_release(j->j_lock);
+}
+
+void
+sfs_journal_orphan(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	KASSERT(j != NULL);
+	lock_acquire(j->j_lock);
+	sv->sv_lrunext = j->j_orphans;
+	j->j_orphans = sv;
+	lock_release(j->j_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit
+
+/*
+ * Erase orphaned files, as many as leave room for each one's changes.
+ * If BUDGET is false, erase them all.
+ */
+static
+void
+sfs_journal_reap(struct sfs_journal *j, bool budget)
+{
+	struct sfs_vnode *sv;
+
+	while (1) {
+		lock_acquire(j->j_lock);
+		sv = j->j_orphans;
+		if (sv == NULL || (budget && j->j_n + j->j_pending + 1 +
+				   j->j_slack > j->j_cap)) {
+			lock_release(j->j_lock);
+			return;
+		}
+		j->j_orphans = sv->sv_lrunext;
+		sv->sv_lrunext = NULL;
+		lock_release(j->j_lock);
+
+		sfs_vnode_reap(sv);
+	}
+}
+
+/*
+ * Let the first N held blocks go. They're still cached, being held, so
+ * getting them back takes no I/O.
+ */
+static
+void
+sfs_journal_unhold(struct sfs_journal *j, unsigned n)
+{
+	struct sfs_fs *sfs = j->j_sfs;
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	for (i=0; i<n; i++) {
+		result = buf_read(sfs->sfs_device, j->j_blocks[i], &b);
+		KASSERT(result == 0);
+		buf_unhold(b);
+		buf_release(b);
+	}
+
+	/* Ones held since the commit began are in the next transaction */
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_n >= n);
+	j->j_n -= n;
+	memmove(j->j_blocks, j->j_blocks + n, j->j_n * sizeof(uint32_t));
+	lock_release(j->j_lock);
+}
+
+/* Copy the first N held blocks to the journal, then the header */
+static
+int
+sfs_journal_log(struct sfs_journal *j, unsigned n)
+{
+	struct sfs_fs *sfs = j->j_sfs;
+	struct iovec iov;
+	struct uio ku;
+	struct buf *b;
+	uint32_t sum;
+	unsigned i, k, chunk;
+	int result;
+
+	sum = sfs_jsum_header(j->j_seq, n, j->j_blocks);
+	for (i=0; i<n; i+=chunk) {
+		chunk = n - i < SFS_JSTAGE ? n - i : SFS_JSTAGE;
+		for (k=0; k<chunk; k++) {
+			result = buf_read(sfs->sfs_device, j->j_blocks[i + k],
+					  &b);
+			if (result) {
+				return result;
+			}
+			KASSERT(buf_isheld(b));
+			memcpy(j->j_stage + k * SFS_BLOCKSIZE, buf_data(b),
+			       SFS_BLOCKSIZE);
+			buf_release(b);
+		}
+		sum = sfs_jsum(sum, (uint32_t *)j->j_stage,
+			       chunk * SFS_BLOCKSIZE / sizeof(uint32_t));
+
+		uio_kinit(&iov, &ku, j->j_stage, chunk * SFS_BLOCKSIZE, 0,
+			  UIO_WRITE);
+		result = buf_writedirect(sfs->sfs_device,
+					 sfs->sfs_super.sp_journal + 1 + i,
+					 chunk, &ku);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Only now is the transaction there to replay */
+	return sfs_journal_writeheader(sfs, &j->j_header, j->j_seq, n,
+				       j->j_blocks, sum);
+}
+
+/*
+ * Commit the open transaction. Call with j_txlock held exclusively, so
+ * no operation is half done.
+ */
+static
+int
+sfs_journal_docommit(struct sfs_journal *j)
+{
+	struct sfs_fs *sfs = j->j_sfs;
+	unsigned n;
+	bool overflow;
+	int result;
+
+	sfs_journal_reap(j, true);
+
+	/*
+	 * File data goes first, so no committed inode points at blocks
+	 * with stale contents: the dirty pages, and then whatever is in
+	 * the buffer cache. This also puts the last transaction's blocks
+	 * where they belong, so its log can be written over.
+	 */
+	result = sfs_writedata(sfs);
+	if (result) {
+		return result;
+	}
+	result = buf_flush(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	/* Inodes, freemap and superblock into the cache, and held */
+	result = sfs_writemeta(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(j->j_lock);
+	n = j->j_n;
+	overflow = j->j_overflow;
+	j->j_pending = 0;
+	lock_release(j->j_lock);
+
+	if (overflow) {
+		/* Nothing to replay, then, since it's all going in place */
+		result = sfs_journal_clear(sfs, &j->j_header, j->j_seq);
+	}
+	else if (n > 0) {
+		result = sfs_journal_log(j, n);
+	}
+	if (result) {
+		/* Still held; the next commit tries again */
+		return result;
+	}
+
+	sfs_journal_unhold(j, n);
+	if (overflow) {
+		lock_acquire(j->j_lock);
+		j->j_overflow = false;
+		lock_release(j->j_lock);
+		result = buf_flush(sfs->sfs_device);
+	}
+
+	j->j_committed = j->j_seq;
+	lock_acquire(j->j_lock);
+	j->j_seq++;
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * Commit everything done so far. If someone else's commit got there
+ * first, while we waited for them, there's nothing to do: that's how
+ * fsyncs at the same time share one commit.
+ */
+int
+sfs_journal_commit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t seq;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	seq = j->j_seq;
+	lock_release(j->j_lock);
+
+	rwlock_acquire_write(j->j_txlock);
+	if (j->j_committed >= seq) {
+		result = 0;
+	}
+	else {
+		result = sfs_journal_docommit(j);
+	}
+	rwlock_release_write(j->j_txlock);
+	return result;
+}
+
+/* Commit every journaled volume every SFS_JOURNAL_SECS seconds */
+static
+void
+sfs_journal_work_run(void *unused)
+{
+	struct sfs_journal *j;
+	int result;
+
+	(void)unused;
+
+	vfs_biglock_acquire();
+	for (j = sfs_journals; j != NULL; j = j->j_next) {
+		result = sfs_journal_commit(j->j_sfs);
+		if (result) {
+			kprintf("sfs: %s: journal commit: %s\n",
+				j->j_sfs->sfs_super.sp_volname,
+				strerror(result));
+		}
+	}
+	vfs_biglock_release();
+
+	work_enqueue_delayed(kworkq, &sfs_journal_work, SFS_JOURNAL_SECS * HZ);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mount and unmount
+
+/*
+ * Start journaling, if the volume has a journal. Called at the end of
+ * mount, with vfs_biglock held; sfs_journal_recover has run.
+ */
+int
+sfs_journal_start(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_journal *j;
+	unsigned cap, slack;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	sfs->sfs_journal = NULL;
+	if (sp->sp_journal == 0) {
+		return 0;
+	}
+
+	cap = sfs_journal_cap(sp);
+	slack = SFS_JSLACK_BASE + SFS_BITBLOCKS(sp->sp_nblocks);
+	if (slack + 1 > cap) {
+		kprintf("sfs: %s: journal too small for the volume; "
+			"not using it\n", sp->sp_volname);
+		return 0;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_stage = kmalloc(SFS_JSTAGE * SFS_BLOCKSIZE);
+	j->j_txlock = rwlock_create("sfs_txlock");
+	j->j_lock = lock_create("sfs_jlock");
+	if (j->j_stage == NULL || j->j_txlock == NULL || j->j_lock == NULL) {
+		if (j->j_txlock != NULL) {
+			rwlock_destroy(j->j_txlock);
+		}
+		if (j->j_lock != NULL) {
+			lock_destroy(j->j_lock);
+		}
+		kfree(j->j_stage);
+		kfree(j);
+		return ENOMEM;
+	}
+	j->j_sfs = sfs;
+	j->j_cap = cap;
+	j->j_slack = slack;
+	j->j_n = 0;
+	j->j_pending = 0;
+	j->j_active = 0;
+	j->j_overflow = false;
+	j->j_seq = 1;
+	j->j_committed = 0;
+	j->j_orphans = NULL;
+
+	j->j_next = sfs_journals;
+	sfs_journals = j;
+	sfs->sfs_journal = j;
+
+	if (!sfs_journal_workstarted) {
+		work_init(&sfs_journal_work, sfs_journal_work_run, NULL);
+		work_enqueue_delayed(kworkq, &sfs_journal_work,
+				     SFS_JOURNAL_SECS * HZ);
+		sfs_journal_workstarted = true;
+	}
+	return 0;
+}
+
+/*
+ * Stop journaling, at unmount, leaving everything in place on disk and
+ * the journal empty. Called with vfs_biglock held, once the last vnode
+ * is gone.
+ */
+void
+sfs_journal_stop(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_journal **pp;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (j == NULL) {
+		return;
+	}
+
+	/* Each commit erases what orphans it has room for */
+	do {
+		result = sfs_journal_commit(sfs);
+	} while (result == 0 && j->j_orphans != NULL);
+
+	/* Put the last transaction in place; the log's not needed then */
+	if (result == 0) {
+		result = buf_flush(sfs->sfs_device);
+	}
+	if (result == 0) {
+		result = sfs_journal_clear(sfs, &j->j_header, j->j_seq);
+	}
+	if (result) {
+		/* What's left can still go out, if not crash-safely */
+		kprintf("sfs: %s: journal: %s\n", sfs->sfs_super.sp_volname,
+			strerror(result));
+		sfs_journal_reap(j, false);
+		sfs_journal_unhold(j, j->j_n);
+		sfs_writedata(sfs);
+		sfs_writemeta(sfs);
+		sfs_journal_unhold(j, j->j_n);
+		buf_flush(sfs->sfs_device);
+	}
+	KASSERT(j->j_n == 0);
+	KASSERT(j->j_active == 0);
+	KASSERT(j->j_orphans == NULL);
+
+	for (pp = &sfs_journals; *pp != j; pp = &(*pp)->j_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = j->j_next;
+	sfs->sfs_journal = NULL;
+
+	rwlock_destroy(j->j_txlock);
+	lock_destroy(j->j_lock);
+	kfree(j->j_stage);
+	kfree(j);
+}
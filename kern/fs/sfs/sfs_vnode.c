@@ -32,23 +32,69 @@
  *
  * File-level (vnode) interface routines.
  */
+#define KMTAG KMT_SFS
+
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
+#include <kern/poll.h>
 #include <stat.h>
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <synch.h>
+#include <thread.h>
+#include <workqueue.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <vm.h>
+#include <filecache.h>
 #include <sfs.h>
+#include <kmem.h>
+
+/* Object cache for struct sfs_vnode, shared by all mounted volumes */
+static struct kmem_cache *sfs_vnode_cache;
+
+/*
+ * Mounted volumes, for the shrinker. sfs_volumes_lock comes before
+ * every sfs_vnlock.
+ */
+static struct sfs_fs *sfs_volumes;
+static struct lock *sfs_volumes_lock;
+
+/*
+ * Writeback started by sync_file_range: vnodes waiting for it, oldest
+ * first, each with a reference, and the kworkq job that writes them.
+ * sfs_wblistlock covers the list and every vnode's sv_wb* fields.
+ */
+static struct lock *sfs_wblistlock;
+static struct cv *sfs_wbcv;		/* a vnode's writeback finished */
+static struct sfs_vnode *sfs_wbhead, *sfs_wbtail;
+static struct work sfs_wbwork;
+
+static void sfs_wbwork_run(void *unused);
+static unsigned sfs_vnode_shrink(unsigned npages);
+static struct shrinker sfs_vnode_shrinker = {
+	"sfs_vnode", sfs_vnode_shrink, NULL
+};
+
+/* The loaded vnodes table (sfs_vnodes) is hashed by inode number */
+#define SFS_VNHASH_HASH(ino)		hash_uint32(*(ino))
+#define SFS_VNHASH_MATCH(sv, ino)	((sv)->sv_ino == *(ino))
+DEFHASH(sfs_vnhash, struct sfs_vnode, uint32_t, sv_hashlink,
+	SFS_VNHASH_HASH, SFS_VNHASH_MATCH, /*no inline*/);
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Used by sfs_reclaim */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,9 +104,31 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buf_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buf_data(b), SFS_BLOCKSIZE);
+	buf_markdirty(b);
+	buf_release(b);
+	return 0;
+}
+
+/*
+ * Mark SV's inode as needing to be written, and on a journaled volume
+ * count it against the next commit.
+ */
+static
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	if (!sv->sv_dirty) {
+		sv->sv_dirty = true;
+		sfs_journal_note(sv->sv_v.vn_fs->fs_data, 1);
+	}
 }
 
 /* Write an on-disk inode structure back out to disk. */
@@ -68,6 +136,8 @@ static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
@@ -84,28 +154,92 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Note that the freemap sector holding DISKBLOCK's bit needs writing.
+ * Call with sfs_fslock held.
+ */
+static
+void
+sfs_freemap_touch(struct sfs_fs *sfs, uint32_t diskblock)
+{
+	unsigned j = diskblock / SFS_BLOCKBITS;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_fslock));
+
+	if (!bitmap_isset(sfs->sfs_mapdirty, j)) {
+		bitmap_mark(sfs->sfs_mapdirty, j);
+		sfs_journal_note(sfs, 1);
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Allocate a block. These take sfs_fslock themselves, so the caller
+ * must not hold it.
+ *
+ * GOAL is where the caller would like the block to be, normally just
+ * past the file's previous block, so files come out laid down in
+ * order on disk; the first free block at or after it is used. 0 means
+ * no preference.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_fslock);
+	if (goal != 0) {
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
+	}
+	else {
+		result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	}
 	if (result) {
+		lock_release(sfs->sfs_fslock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_touch(sfs, *diskblock);
+	lock_release(sfs->sfs_fslock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
-	/* Clear block before returning it */
+	/* Clear block before returning it (it's ours; no lock needed) */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Allocate N consecutive blocks, the first run of them at or after GOAL,
+ * and hand back the first. They aren't cleared.
+ */
+static
+int
+sfs_balloc_run(struct sfs_fs *sfs, uint32_t n, uint32_t goal,
+	       uint32_t *diskblock)
+{
+	uint32_t b;
+	int result;
+
+	lock_acquire(sfs->sfs_fslock);
+	result = bitmap_alloc_run(sfs->sfs_freemap, n, goal, diskblock);
+	if (result) {
+		lock_release(sfs->sfs_fslock);
+		return result;
+	}
+	/* Once for each freemap block the run touches */
+	for (b = *diskblock; b < *diskblock + n;
+	     b = (b / SFS_BLOCKBITS + 1) * SFS_BLOCKBITS) {
+		sfs_freemap_touch(sfs, b);
+	}
+	lock_release(sfs->sfs_fslock);
+
+	if (*diskblock + n > sfs->sfs_super.sp_nblocks) {
+		panic("sfs: balloc: invalid run %u+%u\n", *diskblock, n);
+	}
+	return 0;
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +247,125 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_fslock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_touch(sfs, diskblock);
+	lock_release(sfs->sfs_fslock);
+}
+
+/*
+ * Free N consecutive blocks, starting at DISKBLOCK.
+ */
+static
+void
+sfs_bfree_run(struct sfs_fs *sfs, uint32_t diskblock, uint32_t n)
+{
+	uint32_t b;
+
+	lock_acquire(sfs->sfs_fslock);
+	bitmap_unmark_run(sfs->sfs_freemap, diskblock, n);
+	/* Once for each freemap block the run touches */
+	for (b = diskblock; b < diskblock + n;
+	     b = (b / SFS_BLOCKBITS + 1) * SFS_BLOCKBITS) {
+		sfs_freemap_touch(sfs, b);
+	}
+	lock_release(sfs->sfs_fslock);
+}
+
+/*
+ * Blocks being freed by truncate, saved up so that a run of them that
+ * are consecutive on disk, as a file's blocks mostly are, goes back to
+ * the freemap at once.
+ */
+struct sfs_freerun {
+	uint32_t fr_start;
+	uint32_t fr_n;
+};
+
+static
+void
+sfs_freerun_flush(struct sfs_fs *sfs, struct sfs_freerun *fr)
+{
+	if (fr->fr_n > 0) {
+		sfs_bfree_run(sfs, fr->fr_start, fr->fr_n);
+		fr->fr_n = 0;
+	}
+}
+
+static
+void
+sfs_freerun_add(struct sfs_fs *sfs, struct sfs_freerun *fr, uint32_t block)
+{
+	if (fr->fr_n > 0 && block == fr->fr_start + fr->fr_n) {
+		fr->fr_n++;
+		return;
+	}
+	sfs_freerun_flush(sfs, fr);
+	fr->fr_start = block;
+	fr->fr_n = 1;
+}
+
+/*
+ * Give back whatever SV has preallocated (see sfs.h).
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	if (sv->sv_pacount > 0) {
+		sfs_bfree_run(sv->sv_v.vn_fs->fs_data, sv->sv_pablock,
+			      sv->sv_pacount);
+		sv->sv_pacount = 0;
+	}
+}
+
+/*
+ * Allocate a data block for block FILEBLOCK of SV, which would like to
+ * be at GOAL. It comes from the blocks preallocated for it, if there
+ * are any; or, if the file is growing, a new window of them is taken
+ * along with it.
+ */
+static
+int
+sfs_balloc_data(struct sfs_vnode *sv, uint32_t fileblock, uint32_t goal,
+		uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t n, start;
+
+	if (sv->sv_pacount > 0 && fileblock == sv->sv_panext) {
+		*diskblock = sv->sv_pablock++;
+		sv->sv_pacount--;
+		sv->sv_panext++;
+		return sfs_clearblock(sfs, *diskblock);
+	}
+
+	n = 0;
+	if (sv->sv_pawant > 0) {
+		n = sv->sv_pawant;
+		sv->sv_pawant = 0;
+	}
+	else if (sv->sv_i.sfi_type == SFS_TYPE_FILE &&
+		 fileblock >= DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE)) {
+		n = sv->sv_pawindow == 0 ? SFS_PA_MIN : sv->sv_pawindow * 2;
+		if (n > SFS_PA_MAX) {
+			n = SFS_PA_MAX;
+		}
+		sv->sv_pawindow = n;
+	}
+
+	/* If there's no run that long free, take a single block */
+	if (n > 1) {
+		sfs_prealloc_release(sv);
+		if (sfs_balloc_run(sfs, n, goal, &start) == 0) {
+			sv->sv_panext = fileblock + 1;
+			sv->sv_pablock = start + 1;
+			sv->sv_pacount = n - 1;
+			*diskblock = start;
+			return sfs_clearblock(sfs, start);
+		}
+	}
+	return sfs_balloc(sfs, goal, diskblock);
 }
 
 /*
@@ -124,44 +375,66 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n",
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_fslock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_fslock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Where to put a new block for direct block FILEBLOCK of a file (or
+ * for a top-level indirect block, with FILEBLOCK SFS_NDIRECT): after the
+ * nearest allocated block before it, or after the inode for the first.
+ */
+static
+uint32_t
+sfs_bgoal_direct(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	while (fileblock > 0) {
+		fileblock--;
+		if (sv->sv_i.sfi_direct[fileblock] != 0) {
+			return sv->sv_i.sfi_direct[fileblock] + 1;
+		}
+	}
+	return sv->sv_ino + 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated. The caller holds sv_maplock.
  */
 static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+sfs_dobmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	   uint32_t *diskblock)
 {
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * The indirect block, used in place in the buffer cache.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idb;
+	uint32_t *idbuf;
 
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idblock, *ientry;
+	uint32_t rest, idoff, span;
+	unsigned levels;
+	uint32_t goal;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,14 +449,16 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_data(sv, fileblock,
+						 sfs_bgoal_direct(sv, fileblock),
+						 &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
@@ -198,27 +473,31 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block; it's under the single, double, or
+	 * triple indirect block. Subtract off the blocks before each
+	 * in turn, so REST is the offset into that one's space, and
+	 * find how many levels of indirect blocks lead to it.
 	 */
-	if (idnum > 0) {
+	rest = fileblock - SFS_NDIRECT;
+	span = SFS_DBPERIDB;
+	for (levels = 1; levels <= 3; levels++) {
+		if (rest < span) {
+			break;
+		}
+		rest -= span;
+		span *= SFS_DBPERIDB;
+	}
+	switch (levels) {
+	    case 1: ientry = &sv->sv_i.sfi_indirect; break;
+	    case 2: ientry = &sv->sv_i.sfi_dindirect; break;
+	    case 3: ientry = &sv->sv_i.sfi_tindirect; break;
+	    default:
+		/* Too large for even the triple indirect block */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	idblock = *ientry;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -229,55 +508,83 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+
+	if (idblock==0) {
 		/*
 		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * allocate a block whose number needs to be stored
+		 * under it. Thus, we need to allocate an indirect
+		 * block. sfs_balloc hands it back zeroed.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc(sfs, sfs_bgoal_direct(sv, SFS_NDIRECT),
+				    &idblock);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*ientry = idblock;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		sfs_dirty_inode(sv);
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Go down through the indirect blocks. Each entry at a level
+	 * covers SPAN file blocks; if one is missing, either allocate
+	 * it (and it comes back zeroed, so the levels below it are
+	 * empty) or stop, since everything under it reads as zeros.
+	 */
+	while (1) {
+		span /= SFS_DBPERIDB;
+		idoff = rest / span;
+		rest %= span;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* Get the indirect block */
+		result = buf_read(sfs->sfs_device, idblock, &idb);
 		if (result) {
 			return result;
 		}
+		idbuf = buf_data(idb);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Get the next block out of the indirect block buffer */
+		block = idbuf[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			result = sfs_journal_hold(sfs, idb, idblock);
+			if (result) {
+				buf_release(idb);
+				return result;
+			}
+			if (idoff > 0 && idbuf[idoff-1] != 0) {
+				goal = idbuf[idoff-1] + 1;
+			}
+			else {
+				goal = idblock + 1;
+			}
+			if (span == 1) {
+				result = sfs_balloc_data(sv, fileblock, goal,
+							 &block);
+			}
+			else {
+				result = sfs_balloc(sfs, goal, &block);
+			}
+			if (result) {
+				buf_release(idb);
+				return result;
+			}
+
+			/* Remember the block we allocated; it's dirty */
+			idbuf[idoff] = block;
+			buf_markdirty(idb);
 		}
+		buf_release(idb);
+
+		if (block == 0 || span == 1) {
+			break;
+		}
+		idblock = block;
 	}
 
 	/* Hand back the result and return. */
@@ -289,35 +596,46 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+/*
+ * sfs_dobmap, under sv_maplock, since writers to different parts of a
+ * file may be mapping blocks at once (see sfs.h).
+ */
+static
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	 uint32_t *diskblock)
+{
+	int result;
+
+	lock_acquire(sv->sv_maplock);
+	result = sfs_dobmap(sv, fileblock, doalloc, diskblock);
+	lock_release(sv->sv_maplock);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to all or part of one block of a file.
  *
  * skipstart is the number of bytes to skip past at the beginning of
  * the sector; len is the number of bytes to actually read or write.
  * uio is the area to do the I/O into.
+ *
+ * The data goes through a bounce buffer rather than straight between
+ * the uio and the buffer cache, since a fault on a user page may need
+ * to read a block itself.
  */
 static
 int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio,
+	    uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
+	char *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -338,117 +656,399 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	if (diskblock == 0) {
 		/*
-		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * There was no block mapped at this point in the file,
+		 * so it reads as zeros. (If we were writing, sfs_bmap
+		 * would have allocated one.)
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
+
+	iobuf = kmalloc(len);
+	if (iobuf == NULL) {
+		return ENOMEM;
+	}
+
+	if (uio->uio_rw == UIO_READ) {
+		result = buf_read(sfs->sfs_device, diskblock, &b);
 		if (result) {
-			return result;
+			goto out;
 		}
-	}
+		memcpy(iobuf, (char *)buf_data(b) + skipstart, len);
+		buf_release(b);
 
-	/*
-	 * Now perform the requested operation into/out of the buffer.
-	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
+		result = uiomove(iobuf, len, uio);
 	}
+	else {
+		result = uiomove(iobuf, len, uio);
+		if (result) {
+			goto out;
+		}
 
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
+		/*
+		 * If we're not writing the whole block, we need the
+		 * original contents so we don't clobber the rest.
+		 */
+		if (len == SFS_BLOCKSIZE) {
+			result = buf_get(sfs->sfs_device, diskblock, &b);
+		}
+		else {
+			result = buf_read(sfs->sfs_device, diskblock, &b);
+		}
 		if (result) {
-			return result;
+			goto out;
+		}
+		if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+			result = sfs_journal_hold(sfs, b, diskblock);
+			if (result) {
+				buf_release(b);
+				goto out;
+			}
 		}
+		memcpy((char *)buf_data(b) + skipstart, iobuf, len);
+		buf_markdirty(b);
+		buf_release(b);
 	}
 
-	return 0;
+ out:
+	kfree(iobuf);
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Read NBLOCKS whole blocks into UIO, which is in kernel space, with
+ * buf_readdirect. Blocks that are consecutive on disk go in one call;
+ * holes read as zeros.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_directread(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
+	uint32_t fileblock, diskblock, next, run;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	while (nblocks > 0) {
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result) {
+			return result;
+		}
+		if (diskblock == 0) {
+			result = uiomovezeros(SFS_BLOCKSIZE, uio);
+			if (result) {
+				return result;
+			}
+			fileblock++;
+			nblocks--;
+			continue;
+		}
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
+		for (run = 1; run < nblocks; run++) {
+			result = sfs_bmap(sv, fileblock + run, 0, &next);
+			if (result) {
+				return result;
+			}
+			if (next != diskblock + run) {
+				break;
+			}
+		}
 
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		result = buf_readdirect(sfs->sfs_device, diskblock, run, uio);
+		if (result) {
+			return result;
+		}
+		fileblock += run;
+		nblocks -= run;
 	}
-
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
-	return result;
+	return 0;
 }
 
 /*
- * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * Fill NPAGES consecutive pages of SV, which the caller got from
+ * filecache_get to fill, with one sfs_directread, and mark them filled
+ * (or not, if that failed). The caller holds sv_lock, at least shared.
  */
 static
 int
-sfs_io(struct sfs_vnode *sv, struct uio *uio)
+sfs_fillpages(struct sfs_vnode *sv, struct fcpage **pps, unsigned npages)
 {
-	uint32_t blkoff;
-	uint32_t nblocks, i;
+	struct iovec iov[SFS_RA_PAGES];
+	struct uio u;
+	unsigned i;
+	int result;
+
+	KASSERT(npages > 0 && npages <= SFS_RA_PAGES);
+
+	for (i=0; i<npages; i++) {
+		KASSERT(filecache_index(pps[i]) == filecache_index(pps[0]) + i);
+		iov[i].iov_kbase = filecache_data(pps[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = (off_t)filecache_index(pps[0]) * PAGE_SIZE;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = NULL;
+
+	result = sfs_directread(sv, &u, npages * SFS_PAGEBLOCKS);
+	for (i=0; i<npages; i++) {
+		filecache_filldone(pps[i], result == 0);
+	}
+	return result;
+}
+
+/*
+ * Get page INDEX of regular file SV from the page cache, reading it in
+ * if it isn't there. The caller holds sv_lock, at least shared, and
+ * lets go of the page with filecache_release.
+ */
+static
+int
+sfs_getfilepage(struct sfs_vnode *sv, uint32_t index, struct fcpage **ret)
+{
+	struct fcpage *pp;
+	bool fill;
+	int result;
+
+	result = filecache_get(sv->sv_pages, index, &fill, &pp);
+	if (result) {
+		return result;
+	}
+	if (fill) {
+		result = sfs_fillpages(sv, &pp, 1);
+		if (result) {
+			filecache_release(pp);
+			return result;
+		}
+	}
+	*ret = pp;
+	return 0;
+}
+
+/*
+ * Write page PP of SV back, leaving out holes and blocks past the end
+ * of the file. Every block with data in it was allocated when it was
+ * written, so nothing is allocated here. The caller holds sv_lock, at
+ * least shared.
+ */
+static
+int
+sfs_writepage(struct sfs_vnode *sv, struct fcpage *pp)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct iovec iov;
+	struct uio u;
+	uint32_t first, fileblocks, i, run, diskblock, next;
+	char *data;
+	int result;
+
+	first = filecache_index(pp) * SFS_PAGEBLOCKS;
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	data = filecache_data(pp);
+
+	for (i=0; i<SFS_PAGEBLOCKS && first + i < fileblocks; i += run) {
+		run = 1;
+		result = sfs_bmap(sv, first + i, 0, &diskblock);
+		if (result) {
+			return result;
+		}
+		if (diskblock == 0) {
+			continue;
+		}
+		while (i + run < SFS_PAGEBLOCKS && first + i + run < fileblocks) {
+			result = sfs_bmap(sv, first + i + run, 0, &next);
+			if (result) {
+				return result;
+			}
+			if (next != diskblock + run) {
+				break;
+			}
+			run++;
+		}
+
+		uio_kinit(&iov, &u, data + i * SFS_BLOCKSIZE,
+			  run * SFS_BLOCKSIZE,
+			  (off_t)(first + i) * SFS_BLOCKSIZE, UIO_WRITE);
+		result = buf_writedirect(sfs->sfs_device, diskblock, run, &u);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write SV's dirty pages from page FIRST up to LAST back. Keeps going
+ * past errors, but returns the first one; pages that didn't make it
+ * stay dirty. The caller holds sv_lock, at least shared, and no byte
+ * range of the file: each page is written holding a read range over
+ * it, so a write to it can't be half done (see sfs.h).
+ */
+static
+int
+sfs_writerange(struct sfs_vnode *sv, uint32_t first, uint32_t last)
+{
+	struct rangelock *rl = &sv->sv_v.vn_rangelock;
+	struct rlrange rr;
+	struct fcpage *pp;
+	uint32_t index;
+	off_t pos;
+	int result, firsterr = 0;
+
+	if (sv->sv_pages == NULL) {
+		return 0;
+	}
+	index = first;
+	while (index < last &&
+	       (pp = filecache_nextdirty(sv->sv_pages, index)) != NULL) {
+		index = filecache_index(pp) + 1;
+		if (index > last) {
+			filecache_release(pp);
+			break;
+		}
+		pos = (off_t)filecache_index(pp) * PAGE_SIZE;
+		rangelock_acquire(rl, &rr, pos, pos + PAGE_SIZE, false);
+		result = sfs_writepage(sv, pp);
+		if (result == 0) {
+			filecache_cleaned(pp);
+		}
+		else if (firsterr == 0) {
+			firsterr = result;
+		}
+		rangelock_release(rl, &rr);
+		filecache_release(pp);
+	}
+	return firsterr;
+}
+
+/*
+ * Write all of SV's dirty pages back, as sfs_writerange.
+ */
+static
+int
+sfs_writepages(struct sfs_vnode *sv)
+{
+	return sfs_writerange(sv, 0, SFS_NOPAGE);
+}
+
+/*
+ * Move a file's data out of its inode and into block 0, so it can
+ * grow past SFS_INLINE_MAX. The caller holds sv_lock exclusively.
+ */
+static
+int
+sfs_inline_unpack(struct sfs_vnode *sv)
+{
+	struct fcpage *pp;
+	uint32_t diskblock;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_flags & SFS_IF_INLINE);
+
+	result = sfs_bmap(sv, 0, 1, &diskblock);
+	if (result) {
+		return result;
+	}
+	/* (A mapping may have page 0 already, past the end of the file) */
+	result = sfs_getfilepage(sv, 0, &pp);
+	if (result) {
+		return result;
+	}
+	memcpy(filecache_data(pp), sv->sv_i.sfi_inline, sv->sv_i.sfi_size);
+	filecache_markdirty(pp);
+	filecache_release(pp);
+
+	bzero(sv->sv_i.sfi_inline, sizeof(sv->sv_i.sfi_inline));
+	sv->sv_i.sfi_flags &= ~SFS_IF_INLINE;
+	sfs_dirty_inode(sv);
+	return 0;
+}
+
+/*
+ * Do I/O to a regular file through the page cache, a page at a time,
+ * straight between the uio and the page: unlike a buffer, a pinned page
+ * can be held across a fault. A write allocates the blocks it covers
+ * first, so a dirty page never has data over a hole, and doesn't read
+ * in a page it covers all of.
+ */
+static
+int
+sfs_pageio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct fcpage *pp;
+	uint32_t index, skip, len, fileblock, diskblock;
+	bool fill;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		index = uio->uio_offset / PAGE_SIZE;
+		skip = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - skip;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		if (uio->uio_rw == UIO_WRITE) {
+			for (fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+			     fileblock <= (uio->uio_offset + len - 1) /
+				     SFS_BLOCKSIZE;
+			     fileblock++) {
+				result = sfs_bmap(sv, fileblock, 1, &diskblock);
+				if (result) {
+					return result;
+				}
+			}
+		}
+
+		result = filecache_get(sv->sv_pages, index, &fill, &pp);
+		if (result) {
+			return result;
+		}
+		if (fill && uio->uio_rw == UIO_WRITE && len == PAGE_SIZE) {
+			/* Nothing to read; if the copy fails it stays unfilled */
+			result = uiomove(filecache_data(pp), PAGE_SIZE, uio);
+			filecache_filldone(pp, result == 0);
+			if (result == 0) {
+				filecache_markdirty(pp);
+			}
+		}
+		else {
+			if (fill) {
+				result = sfs_fillpages(sv, &pp, 1);
+				if (result) {
+					filecache_release(pp);
+					return result;
+				}
+			}
+			result = uiomove((char *)filecache_data(pp) + skip,
+					 len, uio);
+			/* (even if it failed partway, some may have changed) */
+			if (uio->uio_rw == UIO_WRITE) {
+				filecache_markdirty(pp);
+			}
+		}
+		filecache_release(pp);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do I/O of a whole region of data, whether or not it's block-aligned.
+ */
+static
+int
+sfs_io(struct sfs_vnode *sv, struct uio *uio)
+{
+	uint32_t blkoff;
+	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -473,6 +1073,32 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * Inline files are read and written right in the inode, unless
+	 * the write would make them too big for it.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINE_MAX) {
+			if (uio->uio_rw == UIO_WRITE) {
+				sfs_dirty_inode(sv);
+			}
+			result = uiomove(sv->sv_i.sfi_inline + uio->uio_offset,
+					 uio->uio_resid, uio);
+			goto out;
+		}
+		result = sfs_inline_unpack(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* Regular files' data is in the page cache */
+	if (sv->sv_pages != NULL) {
+		result = sfs_pageio(sv, uio);
+		goto out;
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -489,8 +1115,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			len = uio->uio_resid;
 		}
 
-		/* Call sfs_partialio() to do it. */
-		result = sfs_partialio(sv, uio, skip, len);
+		/* Call sfs_blockio() to do it. */
+		result = sfs_blockio(sv, uio, skip, len);
 		if (result) {
 			goto out;
 		}
@@ -506,8 +1132,17 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	if (uio->uio_rw == UIO_READ && uio->uio_segflg == UIO_SYSSPACE &&
+	    nblocks >= SFS_DIRECT_MIN) {
+		/* Nothing to fault on, so no bounce buffer needed */
+		result = sfs_directread(sv, uio, nblocks);
+		if (result) {
+			goto out;
+		}
+		nblocks = 0;
+	}
 	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+		result = sfs_blockio(sv, uio, 0, SFS_BLOCKSIZE);
 		if (result) {
 			goto out;
 		}
@@ -519,7 +1154,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
 
 	if (uio->uio_resid > 0) {
-		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
+		result = sfs_blockio(sv, uio, 0, uio->uio_resid);
 		if (result) {
 			goto out;
 		}
@@ -527,11 +1162,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
-	/* If writing, adjust file length */
-	if (uio->uio_rw == UIO_WRITE &&
-	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
-		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+	/* If writing, adjust file length (other writers may be too) */
+	if (uio->uio_rw == UIO_WRITE) {
+		lock_acquire(sv->sv_maplock);
+		if (uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
+			sv->sv_i.sfi_size = uio->uio_offset;
+			sfs_dirty_inode(sv);
+		}
+		lock_release(sv->sv_maplock);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -545,40 +1183,6 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 //
 // Directory I/O
 
-/*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
- */
-static
-int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
-{
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
-
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
-
-	/* Set up a uio to do the read */
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
-
-	/* do it */
-	result = sfs_io(sv, &ku);
-	if (result) {
-		return result;
-	}
-
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
-	}
-
-	/* Done */
-	return 0;
-}
-
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
  * vnode.
@@ -637,68 +1241,429 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Read the directory entry in slot SLOT of a directory vnode. A slot
+ * in a hole reads as empty.
  */
-
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_readslot(struct sfs_vnode *sv, int slot, struct sfs_dir *sd)
 {
-	struct sfs_dir tsd;
-	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	struct buf *b;
+	uint32_t diskblock;
+	int result;
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	KASSERT(slot>=0 && slot < sfs_dir_nentries(sv));
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
-		if (result) {
-			return result;
-		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
-			}
-		}
-		else {
-			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
+	result = sfs_bmap(sv, slot / perblock, 0, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		bzero(sd, sizeof(*sd));
+		return 0;
+	}
+	result = buf_read(sfs->sfs_device, diskblock, &b);
+	if (result) {
+		return result;
+	}
+	*sd = ((struct sfs_dir *)buf_data(b))[slot % perblock];
+	buf_release(b);
 
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+	/* Ensure null termination, just in case */
+	sd->sfd_name[sizeof(sd->sfd_name)-1] = 0;
+	return 0;
+}
 
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
-			}
-		}
+////////////////////////////////////////////////////////////
+//
+// Directory index (see sfs.h)
+
+/* One slot of an indexed directory, either named or free. */
+struct sfs_dirslot {
+	uint32_t ds_hash;		/* hash of the name, if named */
+	int ds_slot;
+	struct sfs_dirslot *ds_next;	/* in bucket or free list */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirslot **di_buckets;
+	unsigned di_nbuckets;
+	unsigned di_nnames;		/* named slots */
+	struct sfs_dirslot *di_free;	/* free slots */
+};
+
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
 	}
+	return h;
+}
 
-	return found ? 0 : ENOENT;
+static
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	struct sfs_dirslot *ds;
+	unsigned i;
+
+	for (i=0; i<di->di_nbuckets; i++) {
+		while ((ds = di->di_buckets[i]) != NULL) {
+			di->di_buckets[i] = ds->ds_next;
+			kfree(ds);
+		}
+	}
+	while ((ds = di->di_free) != NULL) {
+		di->di_free = ds->ds_next;
+		kfree(ds);
+	}
+	kfree(di->di_buckets);
+	kfree(di);
 }
 
 /*
- * Create a link in a directory to the specified inode by number, with
- * the specified name, and optionally hand back the slot.
+ * Throw away the index of SV, after something went wrong keeping it
+ * up to date. Lookups go back to scanning.
  */
 static
-int
-sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
+void
+sfs_dirindex_drop(struct sfs_vnode *sv)
 {
-	int emptyslot = -1;
-	int result;
-	struct sfs_dir sd;
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_destroy(sv->sv_dirindex);
+		sv->sv_dirindex = NULL;
+	}
+}
+
+/*
+ * Double the number of buckets. If there's no memory for that, just
+ * carry on with longer chains.
+ */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirslot **nb, *ds;
+	unsigned n, i;
+
+	n = di->di_nbuckets * 2;
+	nb = kmalloc(n * sizeof(*nb));
+	if (nb == NULL) {
+		return;
+	}
+	for (i=0; i<n; i++) {
+		nb[i] = NULL;
+	}
+	for (i=0; i<di->di_nbuckets; i++) {
+		while ((ds = di->di_buckets[i]) != NULL) {
+			di->di_buckets[i] = ds->ds_next;
+			ds->ds_next = nb[ds->ds_hash % n];
+			nb[ds->ds_hash % n] = ds;
+		}
+	}
+	kfree(di->di_buckets);
+	di->di_buckets = nb;
+	di->di_nbuckets = n;
+}
+
+/*
+ * Record DS, with its hash and slot filled in, as a named slot.
+ */
+static
+void
+sfs_dirindex_addname(struct sfs_dirindex *di, struct sfs_dirslot *ds)
+{
+	unsigned b;
+
+	if (di->di_nnames >= 2 * di->di_nbuckets) {
+		sfs_dirindex_grow(di);
+	}
+	b = ds->ds_hash % di->di_nbuckets;
+	ds->ds_next = di->di_buckets[b];
+	di->di_buckets[b] = ds;
+	di->di_nnames++;
+}
+
+/*
+ * Build the index for a directory being loaded. On failure the
+ * directory just doesn't get one.
+ */
+static
+void
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	struct sfs_dir sd;
+	int nentries = sfs_dir_nentries(sv);
+	unsigned i;
+	int slot;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return;
+	}
+	di->di_nbuckets = SFS_DIRINDEX_MINBUCKETS;
+	while (di->di_nbuckets * 2 < (unsigned)nentries) {
+		di->di_nbuckets *= 2;
+	}
+	di->di_buckets = kmalloc(di->di_nbuckets * sizeof(*di->di_buckets));
+	if (di->di_buckets == NULL) {
+		kfree(di);
+		return;
+	}
+	for (i=0; i<di->di_nbuckets; i++) {
+		di->di_buckets[i] = NULL;
+	}
+	di->di_nnames = 0;
+	di->di_free = NULL;
+
+	/* Go backwards so the free list comes out lowest slot first */
+	for (slot = nentries-1; slot >= 0; slot--) {
+		if (sfs_dir_readslot(sv, slot, &sd)) {
+			sfs_dirindex_destroy(di);
+			return;
+		}
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			sfs_dirindex_destroy(di);
+			return;
+		}
+		ds->ds_slot = slot;
+		if (sd.sfd_ino == SFS_NOINO) {
+			ds->ds_next = di->di_free;
+			di->di_free = ds;
+		}
+		else {
+			ds->ds_hash = sfs_dir_hash(sd.sfd_name);
+			sfs_dirindex_addname(di, ds);
+		}
+	}
+
+	sv->sv_dirindex = di;
+}
+
+/*
+ * Find NAME with the index. Same interface as sfs_dir_findname.
+ */
+static
+int
+sfs_dirindex_findname(struct sfs_vnode *sv, const char *name,
+		      uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds;
+	struct sfs_dir sd;
+	uint32_t hash;
+	int result;
+
+	if (emptyslot != NULL && di->di_free != NULL) {
+		*emptyslot = di->di_free->ds_slot;
+	}
+
+	hash = sfs_dir_hash(name);
+	for (ds = di->di_buckets[hash % di->di_nbuckets]; ds != NULL;
+	     ds = ds->ds_next) {
+		if (ds->ds_hash != hash) {
+			continue;
+		}
+		result = sfs_dir_readslot(sv, ds->ds_slot, &sd);
+		if (result) {
+			return result;
+		}
+		KASSERT(sd.sfd_ino != SFS_NOINO);
+		if (!strcmp(sd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = ds->ds_slot;
+			}
+			if (ino != NULL) {
+				*ino = sd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Update the index after NAME was written into slot SLOT.
+ */
+static
+void
+sfs_dirindex_link(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds, **pp;
+
+	if (di == NULL) {
+		return;
+	}
+
+	/* Normally it's the free slot findname handed out */
+	for (pp = &di->di_free; *pp != NULL; pp = &(*pp)->ds_next) {
+		if ((*pp)->ds_slot == slot) {
+			break;
+		}
+	}
+	if (*pp != NULL) {
+		ds = *pp;
+		*pp = ds->ds_next;
+	}
+	else {
+		/* The directory grew */
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			sfs_dirindex_drop(sv);
+			return;
+		}
+		ds->ds_slot = slot;
+	}
+	ds->ds_hash = sfs_dir_hash(name);
+	sfs_dirindex_addname(di, ds);
+}
+
+/*
+ * Update the index after the entry in slot SLOT, whose name hashed to
+ * HASH, was cleared.
+ */
+static
+void
+sfs_dirindex_unlink(struct sfs_vnode *sv, uint32_t hash, int slot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds, **pp;
+
+	if (di == NULL) {
+		return;
+	}
+
+	for (pp = &di->di_buckets[hash % di->di_nbuckets]; *pp != NULL;
+	     pp = &(*pp)->ds_next) {
+		if ((*pp)->ds_slot == slot) {
+			break;
+		}
+	}
+	KASSERT(*pp != NULL);
+	ds = *pp;
+	*pp = ds->ds_next;
+	di->di_nnames--;
+
+	ds->ds_next = di->di_free;
+	di->di_free = ds;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * This uses the directory's index if it has one. Otherwise it scans
+ * the directory a block at a time in the buffer cache.
+ */
+
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	struct sfs_dir tsd;
+	struct buf *b = NULL;
+	struct sfs_dir *sd = NULL;
+	uint32_t diskblock;
+	int found = 0;
+	int nentries = sfs_dir_nentries(sv);
+	int i, result;
+
+	if (sv->sv_dirindex != NULL) {
+		return sfs_dirindex_findname(sv, name, ino, slot, emptyslot);
+	}
+
+	/* For each slot... */
+	for (i=0; i<nentries; i++) {
+
+		/* At the start of each block, move to the next one */
+		if (i % perblock == 0) {
+			if (b != NULL) {
+				buf_release(b);
+				b = NULL;
+			}
+			result = sfs_bmap(sv, i / perblock, 0, &diskblock);
+			if (result) {
+				return result;
+			}
+			if (diskblock != 0) {
+				result = buf_read(sfs->sfs_device, diskblock,
+						  &b);
+				if (result) {
+					return result;
+				}
+				sd = buf_data(b);
+			}
+		}
+
+		/* Get the entry from that slot (a hole reads as zeros) */
+		if (b != NULL) {
+			tsd = sd[i % perblock];
+		}
+		else {
+			bzero(&tsd, sizeof(tsd));
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			/* Free slot - report it back if one was requested */
+			if (emptyslot != NULL) {
+				*emptyslot = i;
+			}
+		}
+		else {
+			/* Ensure null termination, just in case */
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (!strcmp(tsd.sfd_name, name)) {
+
+				/* Each name may legally appear only once... */
+				KASSERT(found==0);
+
+				found = 1;
+				if (slot != NULL) {
+					*slot = i;
+				}
+				if (ino != NULL) {
+					*ino = tsd.sfd_ino;
+				}
+			}
+		}
+	}
+
+	if (b != NULL) {
+		buf_release(b);
+	}
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Create a link in a directory to the specified inode by number, with
+ * the specified name, and optionally hand back the slot.
+ */
+static
+int
+sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
+{
+	int emptyslot = -1;
+	int result;
+	struct sfs_dir sd;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -729,8 +1694,14 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		/* Don't know what made it to the directory */
+		sfs_dirindex_drop(sv);
+		return result;
+	}
+	sfs_dirindex_link(sv, name, emptyslot);
+	return 0;
 }
 
 /*
@@ -741,13 +1712,30 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_dir sd;
+	uint32_t hash = 0;
+	int result;
+
+	/* The index needs the name that's going away */
+	if (sv->sv_dirindex != NULL) {
+		result = sfs_dir_readslot(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		hash = sfs_dir_hash(sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		sfs_dirindex_drop(sv);
+		return result;
+	}
+	sfs_dirindex_unlink(sv, hash, slot);
+	return 0;
 }
 
 /*
@@ -801,7 +1789,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -880,120 +1868,1059 @@ sfs_close(struct vnode *v)
 }
 
 /*
- * Called when the vnode refcount (in-memory usage count) hits zero.
- *
- * This function should try to avoid returning errors other than EBUSY.
+ * Inactive vnode LRU list. All of these need sfs_vnlock.
  */
 static
-int
-sfs_reclaim(struct vnode *v)
+void
+sfs_lruremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
 {
-	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
-	int result;
-
-	vfs_biglock_acquire();
-
-	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
-	 */
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		vfs_biglock_release();
-		return EBUSY;
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
 	}
-
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
 	}
-
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
 	}
-
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
 	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sfs->sfs_ninactive--;
+}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
+static
+void
+sfs_lruaddtail(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	sv->sv_lruprev = sfs->sfs_lrutail;
+	sv->sv_lrunext = NULL;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->sv_lrunext = sv;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	else {
+		sfs->sfs_lruhead = sv;
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs->sfs_lrutail = sv;
+	sfs->sfs_ninactive++;
+}
 
+/*
+ * Free a vnode that is out of sfs_vnodes (or never got in), holding
+ * the last reference.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_vnode *sv)
+{
 	VOP_CLEANUP(&sv->sv_v);
-
-	vfs_biglock_release();
-
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
-
-	/* Done */
-	return 0;
+	sfs_dirindex_drop(sv);
+	if (sv->sv_pages != NULL) {
+		filecache_destroy(sv->sv_pages);
+	}
+	spinlock_cleanup(&sv->sv_ralock);
+	rwlock_destroy(sv->sv_lock);
+	lock_destroy(sv->sv_maplock);
+	kmem_cache_free(sfs_vnode_cache, sv);
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Free up to MAX of SFS's inactive vnodes, oldest first, and return
+ * how many went. Ones sfs_sync has a reference to just now are
+ * skipped. Called with sfs_vnlock held; references are only handed
+ * out under it, so a count of 1 here means nobody else has the vnode
+ * and nobody can get it. Ones with dirty pages (from a mapping that
+ * outlived the last reference) stay until sfs_sync writes them.
  */
 static
-int
-sfs_read(struct vnode *v, struct uio *uio)
+unsigned
+sfs_evict(struct sfs_fs *sfs, unsigned max)
 {
-	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_vnode *sv, *next;
+	unsigned n = 0;
 
-	KASSERT(uio->uio_rw==UIO_READ);
-
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
 
-	return result;
+	for (sv = sfs->sfs_lruhead; sv != NULL && n < max; sv = next) {
+		next = sv->sv_lrunext;
+		KASSERT(sv->sv_inactive);
+		if (sv->sv_v.vn_refcount != 1) {
+			continue;
+		}
+		if (sv->sv_pages != NULL && filecache_ndirty(sv->sv_pages) > 0) {
+			continue;
+		}
+		sfs_lruremove(sfs, sv);
+		sfs_vnhash_remove(&sfs->sfs_vnodes, sv);
+		sfs_vnode_destroy(sv);
+		n++;
+	}
+	return n;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Shrinker: free inactive vnodes across all volumes. A thread that
+ * faulted holding a volume's sfs_vnlock leaves that volume alone.
  */
 static
-int
+unsigned
+sfs_vnode_shrink(unsigned npages)
+{
+	struct sfs_fs *sfs;
+	unsigned want, n = 0;
+
+	if (sfs_volumes_lock == NULL || lock_do_i_hold(sfs_volumes_lock)) {
+		return 0;
+	}
+	want = npages * (PAGE_SIZE / sizeof(struct sfs_vnode));
+
+	lock_acquire(sfs_volumes_lock);
+	for (sfs = sfs_volumes; sfs != NULL && n < want; sfs = sfs->sfs_next) {
+		if (lock_do_i_hold(sfs->sfs_vnlock)) {
+			continue;
+		}
+		lock_acquire(sfs->sfs_vnlock);
+		n += sfs_evict(sfs, want - n);
+		lock_release(sfs->sfs_vnlock);
+	}
+	lock_release(sfs_volumes_lock);
+
+	/* The pages themselves come back when kmem's shrinker runs */
+	return n * sizeof(struct sfs_vnode) / PAGE_SIZE;
+}
+
+void
+sfs_attach(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs_volumes_lock);
+	sfs->sfs_next = sfs_volumes;
+	sfs_volumes = sfs;
+	lock_release(sfs_volumes_lock);
+}
+
+int
+sfs_detach(struct sfs_fs *sfs)
+{
+	struct sfs_fs **pp;
+
+	lock_acquire(sfs_volumes_lock);
+	lock_acquire(sfs->sfs_vnlock);
+
+	sfs_evict(sfs, sfs->sfs_ninactive);
+	if (sfs_vnhash_count(&sfs->sfs_vnodes) > 0 || sfs->sfs_nerasing > 0) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs_volumes_lock);
+		return EBUSY;
+	}
+	KASSERT(sfs->sfs_ninactive == 0);
+
+	for (pp = &sfs_volumes; *pp != sfs; pp = &(*pp)->sfs_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = sfs->sfs_next;
+
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sfs_volumes_lock);
+	return 0;
+}
+
+/*
+ * Called when the vnode refcount (in-memory usage count) hits zero.
+ *
+ * This function should try to avoid returning errors other than EBUSY.
+ */
+static
+int
+sfs_reclaim(struct vnode *v)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+
+	/*
+	 * Write the file's pages back first, without sfs_vnlock, so an
+	 * inactive vnode is normally clean. If it fails the pages stay
+	 * dirty for sfs_sync to try again.
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		result = sfs_writepages(sv);
+		if (result) {
+			kprintf("sfs: %s: inode %u: writing pages: %s\n",
+				sfs->sfs_super.sp_volname, sv->sv_ino,
+				strerror(result));
+		}
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. sfs_loadvnode only hands out
+	 * references while holding sfs_vnlock, so once we have it and
+	 * see a count of 1 nobody else can find the vnode.
+	 */
+	if (vnode_decref_notlast(v)) {
+		/* that consumed the reference VOP_DECREF gave us */
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
+		return EBUSY;
+	}
+	KASSERT(!sv->sv_inactive);
+
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it. Nothing can find it once it's out of the table, so that's
+	 * done without sfs_vnlock, which would hold up every lookup on
+	 * the volume while a big file's blocks are freed. sfs_nerasing
+	 * keeps the volume from being unmounted meanwhile.
+	 *
+	 * On a journaled volume it's left for the next commit instead,
+	 * since we may be inside an operation's transaction and can't
+	 * start one of our own.
+	 */
+	if (sv->sv_i.sfi_linkcount==0) {
+		sfs_vnhash_remove(&sfs->sfs_vnodes, sv);
+		if (sfs->sfs_journal != NULL) {
+			lock_release(sfs->sfs_vnlock);
+			rwlock_release_write(sv->sv_lock);
+			sfs_journal_orphan(sfs, sv);
+			return 0;
+		}
+		sfs->sfs_nerasing++;
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
+
+		sfs_vnode_reap(sv);
+
+		lock_acquire(sfs->sfs_vnlock);
+		sfs->sfs_nerasing--;
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+
+	/* Sync the inode to disk */
+	result = sfs_sync_inode(sv);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
+		return result;
+	}
+
+	/*
+	 * The file is still linked, so keep the vnode, with the last
+	 * reference, as an inactive one; trim the oldest of those if
+	 * there are too many now. This one is newest, and with sv_lock
+	 * released it can go too if it's all there is.
+	 */
+	sfs_prealloc_release(sv);
+	sv->sv_pawindow = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raadvice = POSIX_FADV_NORMAL;
+	sv->sv_inactive = true;
+	sfs_lruaddtail(sfs, sv);
+	rwlock_release_write(sv->sv_lock);
+	if (sfs->sfs_ninactive > SFS_INACTIVE_MAX) {
+		sfs_evict(sfs, sfs->sfs_ninactive - SFS_INACTIVE_MAX);
+	}
+	lock_release(sfs->sfs_vnlock);
+	return 0;
+}
+
+void
+sfs_vnode_reap(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_linkcount == 0);
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_dotruncate(sv, 0);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	rwlock_release_write(sv->sv_lock);
+
+	if (result) {
+		/* Leave the inode for sfsck to find */
+		kprintf("sfs: %s: erasing inode %u: %s\n",
+			sfs->sfs_super.sp_volname, sv->sv_ino,
+			strerror(result));
+	}
+	else {
+		sfs_bfree(sfs, sv->sv_ino);
+	}
+	sfs_vnode_destroy(sv);
+}
+
+/*
+ * Read pages FROM up to TO of SV into the page cache, skipping ones
+ * that are there already, with runs of missing pages read together,
+ * up to SFS_RA_PAGES at a time. Pages are got in order, so two threads
+ * doing this can't each wait for one the other is filling. It's only
+ * read-ahead, so errors are dropped. The caller holds sv_lock, at
+ * least shared.
+ */
+static
+void
+sfs_readpages(struct sfs_vnode *sv, uint32_t from, uint32_t to)
+{
+	struct fcpage *pps[SFS_RA_PAGES];
+	struct fcpage *pp;
+	unsigned n = 0;
+	uint32_t index;
+	bool fill;
+
+	for (index = from; index < to; index++) {
+		if (filecache_get(sv->sv_pages, index, &fill, &pp)) {
+			break;
+		}
+		if (!fill) {
+			filecache_release(pp);
+		}
+		else {
+			pps[n++] = pp;
+		}
+		if (n > 0 && (!fill || n == SFS_RA_PAGES)) {
+			sfs_fillpages(sv, pps, n);
+			while (n > 0) {
+				filecache_release(pps[--n]);
+			}
+		}
+	}
+	if (n > 0) {
+		sfs_fillpages(sv, pps, n);
+		while (n > 0) {
+			filecache_release(pps[--n]);
+		}
+	}
+}
+
+/*
+ * After a read of the bytes from START to END, update the read-ahead
+ * window (see sfs.h) and read in any pages in it that haven't been
+ * yet. The caller holds sv_lock, at least shared.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	uint32_t first, last, from, to;
+	uint32_t fileblocks;
+	bool continuing;
+
+	if (end <= start) {
+		return;
+	}
+	first = start / SFS_BLOCKSIZE;
+	last = (end - 1) / SFS_BLOCKSIZE;
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+
+	spinlock_acquire(&sv->sv_ralock);
+	/* Continuing from the last read, possibly in the same block */
+	continuing = first == sv->sv_ranext || first + 1 == sv->sv_ranext;
+	if (!continuing) {
+		sv->sv_radone = 0;
+	}
+	switch (sv->sv_raadvice) {
+	    case POSIX_FADV_RANDOM:
+		sv->sv_rawindow = 0;
+		break;
+	    case POSIX_FADV_SEQUENTIAL:
+		sv->sv_rawindow = SFS_RA_MAX;
+		break;
+	    default:
+		if (!continuing) {
+			sv->sv_rawindow = 0;
+		}
+		else if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RA_MIN;
+		}
+		else if (sv->sv_rawindow < SFS_RA_MAX) {
+			sv->sv_rawindow *= 2;
+		}
+		break;
+	}
+	sv->sv_ranext = last + 1;
+
+	from = last + 1;
+	if (from < sv->sv_radone) {
+		from = sv->sv_radone;
+	}
+	to = last + 1 + sv->sv_rawindow;
+	if (to > fileblocks) {
+		to = fileblocks;
+	}
+	if (from < to) {
+		sv->sv_radone = to;
+	}
+	spinlock_release(&sv->sv_ralock);
+
+	if (from < to && sv->sv_pages != NULL) {
+		sfs_readpages(sv, from / SFS_PAGEBLOCKS,
+			      DIVROUNDUP(to, SFS_PAGEBLOCKS));
+	}
+}
+
+/*
+ * The pages from *FIRST up to *LAST hold the LEN bytes of SV from POS,
+ * or from POS to the end of the file if LEN is 0; a range past the end
+ * is left empty. The caller holds sv_lock, at least shared.
+ */
+static
+void
+sfs_pagerange(struct sfs_vnode *sv, off_t pos, off_t len,
+	      uint32_t *first, uint32_t *last)
+{
+	off_t end;
+
+	end = sv->sv_i.sfi_size;
+	if (len != 0 && pos + len < end) {
+		end = pos + len;
+	}
+	if (pos >= end) {
+		*first = *last = 0;
+	}
+	else {
+		*first = pos / PAGE_SIZE;
+		*last = DIVROUNDUP(end, PAGE_SIZE);
+	}
+}
+
+/*
+ * Called for posix_fadvise(). NORMAL, RANDOM and SEQUENTIAL set how
+ * reads are read ahead (see sfs.h) for the whole file, whatever the
+ * range. WILLNEED reads the range into the page cache now. DONTNEED
+ * writes back its dirty pages and then moves it to the old end of the
+ * page cache, to be the next given back. NOREUSE does nothing.
+ */
+static
+int
+sfs_advise(struct vnode *v, off_t pos, off_t len, int advice)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	uint32_t first, last;
+
+	rwlock_acquire_read(sv->sv_lock);
+	sfs_pagerange(sv, pos, len, &first, &last);
+
+	switch (advice) {
+	    case POSIX_FADV_NORMAL:
+	    case POSIX_FADV_RANDOM:
+	    case POSIX_FADV_SEQUENTIAL:
+		spinlock_acquire(&sv->sv_ralock);
+		sv->sv_raadvice = advice;
+		sv->sv_rawindow = 0;
+		sv->sv_radone = 0;
+		spinlock_release(&sv->sv_ralock);
+		break;
+	    case POSIX_FADV_WILLNEED:
+		if (sv->sv_pages != NULL &&
+		    !(sv->sv_i.sfi_flags & SFS_IF_INLINE)) {
+			sfs_readpages(sv, first, last);
+		}
+		break;
+	    case POSIX_FADV_DONTNEED:
+		if (sv->sv_pages == NULL) {
+			break;
+		}
+		/* Pages that don't make it to disk just stay dirty */
+		(void)sfs_writerange(sv, first, last);
+		filecache_dontneed(sv->sv_pages, first, last);
+		break;
+	}
+	rwlock_release_read(sv->sv_lock);
+	return 0;
+}
+
+/*
+ * Work function: write back the vnodes on the writeback list, each in
+ * the I/O class of whoever last asked for it.
+ */
+static
+void
+sfs_wbwork_run(void *unused)
+{
+	struct sfs_vnode *sv;
+	uint32_t first, last;
+	int ioprio, myioprio;
+	int result;
+
+	(void)unused;
+
+	myioprio = thread_getioprio();
+	lock_acquire(sfs_wblistlock);
+	while ((sv = sfs_wbhead) != NULL) {
+		sfs_wbhead = sv->sv_wbnext;
+		if (sfs_wbhead == NULL) {
+			sfs_wbtail = NULL;
+		}
+		sv->sv_wbqueued = false;
+		sv->sv_wbbusy = true;
+		first = sv->sv_wbfirst;
+		last = sv->sv_wblast;
+		ioprio = sv->sv_wbioprio;
+		lock_release(sfs_wblistlock);
+
+		thread_setioprio(ioprio);
+		rwlock_acquire_read(sv->sv_lock);
+		result = sfs_writerange(sv, first, last);
+		rwlock_release_read(sv->sv_lock);
+		thread_setioprio(myioprio);
+
+		lock_acquire(sfs_wblistlock);
+		sv->sv_wbbusy = false;
+		if (result && sv->sv_wberr == 0) {
+			sv->sv_wberr = result;
+		}
+		cv_broadcast(sfs_wbcv, sfs_wblistlock);
+		lock_release(sfs_wblistlock);
+
+		/* This may be the last reference; it's ours to drop */
+		VOP_DECREF(&sv->sv_v);
+		lock_acquire(sfs_wblistlock);
+	}
+	lock_release(sfs_wblistlock);
+}
+
+/*
+ * Called for sync_file_range(). SYNC_FILE_RANGE_WRITE puts the file on
+ * the writeback list, or widens the range it's there with, for
+ * sfs_wbwork_run. The waits are for the whole file's writeback, not
+ * only the range's. Only data goes: the inode, and whatever blocks of
+ * the file the buffer cache holds, go with the flusher.
+ */
+static
+int
+sfs_syncrange(struct vnode *v, off_t pos, off_t len, unsigned flags)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	uint32_t first, last;
+	int result = 0;
+
+	lock_acquire(sfs_wblistlock);
+	if (flags & SYNC_FILE_RANGE_WAIT_BEFORE) {
+		while (sv->sv_wbqueued || sv->sv_wbbusy) {
+			cv_wait(sfs_wbcv, sfs_wblistlock);
+		}
+		result = sv->sv_wberr;
+		sv->sv_wberr = 0;
+	}
+	lock_release(sfs_wblistlock);
+	if (result) {
+		return result;
+	}
+
+	if (flags & SYNC_FILE_RANGE_WRITE) {
+		rwlock_acquire_read(sv->sv_lock);
+		sfs_pagerange(sv, pos, len, &first, &last);
+		rwlock_release_read(sv->sv_lock);
+
+		lock_acquire(sfs_wblistlock);
+		if (sv->sv_wbqueued) {
+			if (first < sv->sv_wbfirst) {
+				sv->sv_wbfirst = first;
+			}
+			if (last > sv->sv_wblast) {
+				sv->sv_wblast = last;
+			}
+		}
+		else if (first < last) {
+			VOP_INCREF(v);
+			sv->sv_wbfirst = first;
+			sv->sv_wblast = last;
+			sv->sv_wbqueued = true;
+			sv->sv_wbnext = NULL;
+			if (sfs_wbtail != NULL) {
+				sfs_wbtail->sv_wbnext = sv;
+			}
+			else {
+				sfs_wbhead = sv;
+			}
+			sfs_wbtail = sv;
+		}
+		sv->sv_wbioprio = thread_getioprio();
+		lock_release(sfs_wblistlock);
+		work_enqueue(kworkq, &sfs_wbwork);
+	}
+
+	if (flags & SYNC_FILE_RANGE_WAIT_AFTER) {
+		lock_acquire(sfs_wblistlock);
+		while (sv->sv_wbqueued || sv->sv_wbbusy) {
+			cv_wait(sfs_wbcv, sfs_wblistlock);
+		}
+		result = sv->sv_wberr;
+		sv->sv_wberr = 0;
+		lock_release(sfs_wblistlock);
+	}
+	return result;
+}
+
+/*
+ * Whether I/O to SV's data can be done with sv_lock shared and a byte
+ * range (see sfs.h): only for a regular file the inode doesn't hold.
+ * The caller holds sv_lock, so this can't change.
+ */
+static
+bool
+sfs_rangeio_ok(struct sfs_vnode *sv)
+{
+	return sv->sv_pages != NULL &&
+		(sv->sv_i.sfi_flags & SFS_IF_INLINE) == 0;
+}
+
+/*
+ * Called for read(). sfs_io() does the work.
+ */
+static
+int
+sfs_read(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct rlrange rr;
+	bool ranged;
+	off_t start;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	/*
+	 * Reads don't change anything, so they can share the vnode; but
+	 * now writes can too, so they keep out of the way of any that
+	 * overlap.
+	 */
+	rwlock_acquire_read(sv->sv_lock);
+	start = uio->uio_offset;
+	ranged = sfs_rangeio_ok(sv);
+	if (ranged) {
+		rangelock_acquire(&v->vn_rangelock, &rr, start,
+				  start + uio->uio_resid, false);
+	}
+	result = sfs_io(sv, uio);
+	if (ranged) {
+		rangelock_release(&v->vn_rangelock, &rr);
+	}
+	if (result == 0) {
+		sfs_readahead(sv, start, uio->uio_offset);
+	}
+	rwlock_release_read(sv->sv_lock);
+
+	return result;
+}
+
+/*
+ * Called for write(). sfs_io() does the work, for a regular file under
+ * a write range with sv_lock shared, so writers to different parts of
+ * it don't wait for each other; otherwise with sv_lock exclusive.
+ */
+static
+int
 sfs_write(struct vnode *v, struct uio *uio)
 {
-	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct rlrange rr;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_WRITE);
+
+	sfs_tx_begin(sfs);
+	rwlock_acquire_read(sv->sv_lock);
+	if (sfs_rangeio_ok(sv)) {
+		rangelock_acquire(&v->vn_rangelock, &rr, uio->uio_offset,
+				  uio->uio_offset + uio->uio_resid, true);
+		result = sfs_io(sv, uio);
+		rangelock_release(&v->vn_rangelock, &rr);
+		/* Don't let one writer fill memory with dirty pages */
+		if (filecache_ndirty(sv->sv_pages) > SFS_DIRTY_MAX) {
+			sfs_writepages(sv);
+		}
+		rwlock_release_read(sv->sv_lock);
+		sfs_tx_end(sfs);
+		return result;
+	}
+	rwlock_release_read(sv->sv_lock);
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_io(sv, uio);
+	if (sv->sv_pages != NULL &&
+	    filecache_ndirty(sv->sv_pages) > SFS_DIRTY_MAX) {
+		sfs_writepages(sv);
+	}
+	rwlock_release_write(sv->sv_lock);
+	sfs_tx_end(sfs);
+
+	return result;
+}
+
+/*
+ * Stat-ahead (see sfs.h). Getdirentry is about to return SLOT of
+ * directory SV, out of the directory block SDS, which holds the slots
+ * up to END. If lookups have been following getdirentry, start reading
+ * the inodes in that block from SLOT on, unless that's been done, and
+ * the directory's next block. The caller holds sv_lock shared.
+ */
+static
+void
+sfs_statahead(struct sfs_vnode *sv, const struct sfs_dir *sds, int slot,
+	      int end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	uint32_t next;
+	int first, i;
+
+	spinlock_acquire(&sv->sv_ralock);
+	if (slot < sv->sv_saslot) {
+		/*
+		 * Back to the start, or someone else reading it too. (The
+		 * same slot again is getdirentries retrying the entry that
+		 * didn't fit last time.)
+		 */
+		sv->sv_salook = -1;
+		sv->sv_sahits = 0;
+		sv->sv_sadone = 0;
+	}
+	sv->sv_saslot = slot;
+	first = slot > sv->sv_sadone ? slot : sv->sv_sadone;
+	if (sv->sv_sahits < SFS_SA_HITS || first >= end) {
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+	sv->sv_sadone = end;
+	spinlock_release(&sv->sv_ralock);
+
+	for (i = first; i < end; i++) {
+		if (sds[i % perblock].sfd_ino != SFS_NOINO) {
+			buf_readahead(sfs->sfs_device,
+				      sds[i % perblock].sfd_ino);
+		}
+	}
+	if (end < sfs_dir_nentries(sv) &&
+	    sfs_bmap(sv, end / perblock, 0, &next) == 0 && next != 0) {
+		buf_readahead(sfs->sfs_device, next);
+	}
+}
+
+/*
+ * A lookup in directory SV found SLOT. Count it for stat-ahead if it's
+ * past the last one found but not past what getdirentry has returned.
+ */
+static
+void
+sfs_statahead_hit(struct sfs_vnode *sv, int slot)
+{
+	spinlock_acquire(&sv->sv_ralock);
+	if (slot > sv->sv_salook && slot <= sv->sv_saslot) {
+		sv->sv_salook = slot;
+		if (sv->sv_sahits < SFS_SA_HITS) {
+			sv->sv_sahits++;
+		}
+	}
+	spinlock_release(&sv->sv_ralock);
+}
+
+/*
+ * Called for getdirentry(). The offset is a slot number: send back the
+ * name in the first used slot at or after it, and leave the offset just
+ * past that slot. At the end, send back nothing.
+ *
+ * Each directory block is read once and scanned in place, rather than
+ * a slot at a time through sfs_dir_readslot, and holes are skipped
+ * whole; the buffer cache then has the block for the caller's next
+ * entry.
+ */
+static
+int
+sfs_getdirentry(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	struct sfs_dir *sd;
+	struct buf *b;
+	uint32_t diskblock;
+	int nentries, slot, end;
+	size_t len;
+	int result;
+
+	KASSERT(uio->uio_rw==UIO_READ);
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+
+	rwlock_acquire_read(sv->sv_lock);
+
+	nentries = sfs_dir_nentries(sv);
+	if (uio->uio_offset >= nentries) {
+		/* also catches offsets too big for an int */
+		rwlock_release_read(sv->sv_lock);
+		return 0;
+	}
+	slot = uio->uio_offset;
+
+	while (slot < nentries) {
+		end = (slot / perblock + 1) * perblock;
+		if (end > nentries) {
+			end = nentries;
+		}
+
+		result = sfs_bmap(sv, slot / perblock, 0, &diskblock);
+		if (result) {
+			rwlock_release_read(sv->sv_lock);
+			return result;
+		}
+		if (diskblock == 0) {
+			/* a hole; all its slots are empty */
+			slot = end;
+			continue;
+		}
+
+		result = buf_read(sfs->sfs_device, diskblock, &b);
+		if (result) {
+			rwlock_release_read(sv->sv_lock);
+			return result;
+		}
+		for (; slot < end; slot++) {
+			sd = &((struct sfs_dir *)buf_data(b))[slot % perblock];
+			if (sd->sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			/* The name may lack its NUL on a damaged disk */
+			for (len = 0; len < sizeof(sd->sfd_name) - 1; len++) {
+				if (sd->sfd_name[len] == 0) {
+					break;
+				}
+			}
+			sfs_statahead(sv, buf_data(b), slot, end);
+			result = uiomove(sd->sfd_name, len, uio);
+			buf_release(b);
+			if (result == 0) {
+				uio->uio_offset = slot + 1;
+			}
+			rwlock_release_read(sv->sv_lock);
+			return result;
+		}
+		buf_release(b);
+	}
+
+	uio->uio_offset = slot;
+	rwlock_release_read(sv->sv_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Defragmentation
+
+/*
+ * State for going through all of a file's blocks, indirect blocks
+ * included, in the order a file written from start to end is laid out:
+ * the direct blocks, then each indirect block just before the blocks
+ * under it. The first pass counts them and checks whether each comes
+ * right after the last on disk; the second moves them, in the same
+ * order, to DF_START onward.
+ */
+struct sfs_defrag {
+	bool df_move;                   /* second pass */
+	uint32_t df_n;                  /* blocks gone through so far */
+	uint32_t df_prev;               /* first pass: the last one */
+	bool df_scattered;              /* first pass: any not in order */
+	uint32_t df_start;              /* second pass: the new run */
+	struct sfs_freerun df_fr;       /* second pass: the old blocks */
+};
+
+/*
+ * Copy block OLDBLOCK to NEWBLOCK, which is free. If it's an indirect
+ * block it goes in the transaction, since its entries are changed next.
+ */
+static
+int
+sfs_defrag_copy(struct sfs_fs *sfs, uint32_t oldblock, uint32_t newblock,
+		bool metadata)
+{
+	struct buf *ob, *nb;
+	int result;
+
+	result = buf_read(sfs->sfs_device, oldblock, &ob);
+	if (result) {
+		return result;
+	}
+	result = buf_get(sfs->sfs_device, newblock, &nb);
+	if (result) {
+		buf_release(ob);
+		return result;
+	}
+	if (metadata) {
+		result = sfs_journal_hold(sfs, nb, newblock);
+		if (result) {
+			buf_release(nb);
+			buf_release(ob);
+			return result;
+		}
+	}
+	memcpy(buf_data(nb), buf_data(ob), SFS_BLOCKSIZE);
+	buf_markdirty(nb);
+	buf_release(nb);
+	buf_release(ob);
+	return 0;
+}
+
+/*
+ * Go through the block in *ENTRY, which is a data block if LEVEL is 0
+ * and otherwise an indirect block with LEVEL levels below it counting
+ * itself (as for sfs_truncate_indirect), and everything under it.
+ */
+static
+int
+sfs_defrag_block(struct sfs_vnode *sv, uint32_t *entry, unsigned level,
+		 struct sfs_defrag *df)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idb;
+	uint32_t *idbuf;
+	uint32_t block = *entry, newblock;
+	unsigned j;
+	int result;
+
+	if (block == 0) {
+		return 0;
+	}
+
+	if (!df->df_move) {
+		if (df->df_n > 0 && block != df->df_prev + 1) {
+			df->df_scattered = true;
+		}
+		df->df_prev = block;
+	}
+	else {
+		/* The run was free, so it can't overlap the old blocks */
+		newblock = df->df_start + df->df_n;
+		result = sfs_defrag_copy(sfs, block, newblock, level > 0);
+		if (result) {
+			return result;
+		}
+		*entry = newblock;
+		sfs_freerun_add(sfs, &df->df_fr, block);
+		block = newblock;
+	}
+	df->df_n++;
+
+	if (level == 0) {
+		return 0;
+	}
+
+	result = buf_read(sfs->sfs_device, block, &idb);
+	if (result) {
+		return result;
+	}
+	idbuf = buf_data(idb);
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		result = sfs_defrag_block(sv, &idbuf[j], level - 1, df);
+		if (result) {
+			break;
+		}
+	}
+	if (df->df_move) {
+		buf_markdirty(idb);
+	}
+	buf_release(idb);
+	return result;
+}
+
+/*
+ * Go through all of SV's blocks, for one pass of sfs_defrag.
+ */
+static
+int
+sfs_defrag_pass(struct sfs_vnode *sv, struct sfs_defrag *df)
+{
+	unsigned i;
 	int result;
 
-	KASSERT(uio->uio_rw==UIO_WRITE);
+	df->df_n = 0;
+	for (i=0; i<SFS_NDIRECT; i++) {
+		result = sfs_defrag_block(sv, &sv->sv_i.sfi_direct[i], 0, df);
+		if (result) {
+			return result;
+		}
+	}
+	result = sfs_defrag_block(sv, &sv->sv_i.sfi_indirect, 1, df);
+	if (result) {
+		return result;
+	}
+	result = sfs_defrag_block(sv, &sv->sv_i.sfi_dindirect, 2, df);
+	if (result) {
+		return result;
+	}
+	return sfs_defrag_block(sv, &sv->sv_i.sfi_tindirect, 3, df);
+}
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+/*
+ * Defragment a file: if its blocks aren't already one run in order,
+ * move them all into a new one, near the inode if there's room there,
+ * and free the old ones. This is done with sv_lock held exclusively,
+ * in one transaction, so readers and writers just wait and a crash
+ * leaves either the old layout or the new one. It fails with ENOSPC,
+ * leaving the file as it was, if no free run is big enough. The number
+ * of blocks moved is handed back in MOVED.
+ */
+static
+int
+sfs_defrag(struct sfs_vnode *sv, uint32_t *moved)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_defrag df;
+	uint32_t total;
+	int result;
+
+	*moved = 0;
+	if (sv->sv_i.sfi_type != SFS_TYPE_FILE) {
+		return EINVAL;
+	}
+
+	sfs_tx_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
+
+	/* Inline files have no blocks; preallocated ones would be in the way */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		rwlock_release_write(sv->sv_lock);
+		sfs_tx_end(sfs);
+		return 0;
+	}
+	sfs_prealloc_release(sv);
+
+	df.df_move = false;
+	df.df_scattered = false;
+	result = sfs_defrag_pass(sv, &df);
+	if (result || !df.df_scattered) {
+		goto out;
+	}
+
+	total = df.df_n;
+	result = sfs_balloc_run(sfs, total, sv->sv_ino + 1, &df.df_start);
+	if (result) {
+		goto out;
+	}
+
+	df.df_move = true;
+	df.df_fr.fr_n = 0;
+	result = sfs_defrag_pass(sv, &df);
+	sfs_dirty_inode(sv);
+	sfs_freerun_flush(sfs, &df.df_fr);
+	if (result && df.df_n < total) {
+		/* What was moved stays moved; give back the rest of the run */
+		sfs_bfree_run(sfs, df.df_start + df.df_n, total - df.df_n);
+	}
+	*moved = df.df_n;
 
+ out:
+	rwlock_release_write(sv->sv_lock);
+	sfs_tx_end(sfs);
 	return result;
 }
 
@@ -1004,14 +2931,18 @@ static
 int
 sfs_ioctl(struct vnode *v, int op, userptr_t data)
 {
-	/*
-	 * No ioctls.
-	 */
-
-	(void)v;
-	(void)op;
-	(void)data;
+	struct sfs_vnode *sv = v->vn_data;
+	uint32_t moved;
+	int result;
 
+	switch (op) {
+	    case SFS_IOC_DEFRAG:
+		result = sfs_defrag(sv, &moved);
+		if (result == 0 && data != NULL) {
+			result = copyout(&moved, data, sizeof(moved));
+		}
+		return result;
+	}
 	return EINVAL;
 }
 
@@ -1033,7 +2964,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,175 +2986,638 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	/* The type is fixed when the vnode is loaded; no lock needed */
+	switch (sv->sv_i.sfi_type) {
+	case SFS_TYPE_FILE:
+		*ret = S_IFREG;
+		return 0;
+	case SFS_TYPE_DIR:
+		*ret = S_IFDIR;
+		return 0;
+	}
+	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
+	      sv->sv_ino, sv->sv_i.sfi_type);
+	return EINVAL;
+}
+
+/*
+ * Check for legal seeks on files. Allow anything non-negative.
+ * We could conceivably, here, prohibit seeking past the maximum
+ * file size our inode structure can support, but we don't - few
+ * people ever bother to check lseek() for failure and having
+ * read() or write() fail is sufficient.
+ */
+static
+int
+sfs_tryseek(struct vnode *v, off_t pos)
+{
+	if (pos<0) {
+		return EINVAL;
+	}
+
+	/* Allow anything else */
+	(void)v;
+
+	return 0;
+}
+
+/*
+ * Called for fsync(), and also on filesystem unmount, global sync(),
+ * and some other cases.
+ */
+static
+int
+sfs_fsync(struct vnode *v)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	/*
+	 * With a journal, a commit does it: the data goes out, and the
+	 * metadata only as far as the journal. It covers the whole
+	 * volume, so fsyncs at once can share it.
+	 */
+	if (sfs->sfs_journal != NULL) {
+		return sfs_journal_commit(sfs);
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_writepages(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	rwlock_release_write(sv->sv_lock);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Writes are delayed in the buffer cache, so push them out.
+	 * This flushes the whole volume, not just this file.
+	 */
+	return buf_flush(sfs->sfs_device);
+}
+
+int
+sfs_vnode_writeback(struct sfs_vnode *sv)
+{
+	int result;
+
+	if (sv->sv_pages == NULL) {
+		return 0;
+	}
+	rwlock_acquire_read(sv->sv_lock);
+	result = sfs_writepages(sv);
+	rwlock_release_read(sv->sv_lock);
+	return result;
+}
+
+int
+sfs_vnode_sync(struct sfs_vnode *sv)
+{
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	rwlock_release_write(sv->sv_lock);
+	return result;
+}
+
+/*
+ * Called for mmap(). Any regular file can be mapped; the VM system
+ * maps the file's own pages from the page cache (see sfs_getpage), so
+ * a mapping and read/write see the same copy.
+ */
+static
+int
+sfs_mmap(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+/*
+ * Called for VOP_GETPAGE: hand the VM system page INDEX of the file,
+ * pinned. If it's for writing, the blocks under it that are inside the
+ * file are allocated first, so writing it back later never needs to
+ * allocate; the part past the end of the file isn't part of the file
+ * and is never written. An inline file is unpacked to get a page.
+ * The VM system calls this with none of its locks held, and gets the
+ * pages a read's or write's user buffer maps before the I/O starts
+ * (vm_prefault), so we never already hold sv_lock here.
+ */
+static
+int
+sfs_getpage(struct vnode *v, uint32_t index, bool forwrite,
+	    struct fcpage **ret)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t fileblock, fileblocks, diskblock;
+	unsigned i;
+	int result;
+
+	KASSERT(sv->sv_pages != NULL);
+
+	if (!forwrite) {
+		rwlock_acquire_read(sv->sv_lock);
+		if (!(sv->sv_i.sfi_flags & SFS_IF_INLINE)) {
+			result = sfs_getfilepage(sv, index, ret);
+			rwlock_release_read(sv->sv_lock);
+			return result;
+		}
+		rwlock_release_read(sv->sv_lock);
+	}
+
+	sfs_tx_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
+	result = 0;
+	/* Even when empty, or a write to it would miss the mapping */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		result = sfs_inline_unpack(sv);
+	}
+	if (result == 0 && forwrite) {
+		fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+		fileblock = index * SFS_PAGEBLOCKS;
+		for (i=0; i<SFS_PAGEBLOCKS && fileblock + i < fileblocks; i++) {
+			result = sfs_bmap(sv, fileblock + i, 1, &diskblock);
+			if (result) {
+				break;
+			}
+		}
+	}
+	if (result == 0) {
+		result = sfs_getfilepage(sv, index, ret);
+	}
+	rwlock_release_write(sv->sv_lock);
+	sfs_tx_end(sfs);
+	return result;
+}
+
+/*
+ * Called for poll(). Disk I/O waits for the disk, but never for
+ * anything that poll could wait for, so files are always ready.
+ */
+static
+int
+sfs_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	(void)v;
+	(void)pw;
+	*revents = events & (POLLIN | POLLOUT);
+	return 0;
+}
+
+/*
+ * Free the blocks at or past BLOCKLEN under the indirect block in
+ * *IENTRY, which has LEVEL levels of indirect blocks below it counting
+ * itself and whose first file block is BASEBLOCK. If that leaves it
+ * empty, free it too and clear *IENTRY. Blocks freed go through FR.
+ */
+static
+int
+sfs_truncate_indirect(struct sfs_vnode *sv, uint32_t *ientry, unsigned level,
+		      uint32_t baseblock, uint32_t blocklen,
+		      struct sfs_freerun *fr)
+{
+	/*
+	 * The indirect block, used in place in the buffer cache.
+	 */
+	struct buf *idb;
+	uint32_t *idbuf;
+
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t idblock = *ientry;
+	uint32_t span, entry, j;
+	unsigned k;
+	int result;
+	int hasnonzero, iddirty;
+
+	/* File blocks under each entry */
+	span = 1;
+	for (k=1; k<level; k++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	if (idblock == 0 || blocklen >= baseblock + span * SFS_DBPERIDB) {
+		/* Nothing here, or all of it is before the new EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = buf_read(sfs->sfs_device, idblock, &idb);
+	if (result) {
+		return result;
+	}
+	result = sfs_journal_hold(sfs, idb, idblock);
+	if (result) {
+		buf_release(idb);
+		return result;
+	}
+	idbuf = buf_data(idb);
+
+	hasnonzero = 0;
+	iddirty = 0;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		/* Discard what's past the new EOF under each entry */
+		entry = idbuf[j];
+		if (entry != 0 && blocklen < baseblock + (j+1) * span) {
+			if (level == 1) {
+				sfs_freerun_add(sfs, fr, entry);
+				entry = 0;
+			}
+			else {
+				result = sfs_truncate_indirect(sv, &entry,
+					level - 1, baseblock + j * span,
+					blocklen, fr);
+				if (result) {
+					break;
+				}
+			}
+			if (entry != idbuf[j]) {
+				idbuf[j] = entry;
+				iddirty = 1;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j]!=0) {
+			hasnonzero=1;
+		}
+	}
+
+	if (iddirty) {
+		buf_markdirty(idb);
+	}
+	buf_release(idb);
+	if (result) {
+		return result;
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_freerun_add(sfs, fr, idblock);
+		*ientry = 0;
+	}
+	return 0;
+}
+
+/*
+ * Truncate a file. Used by ftruncate() and by sfs_reclaim; the caller
+ * holds sv_lock exclusively.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	uint32_t i, block, *ientry;
+	uint32_t baseblock, span;
+	struct sfs_freerun fr;
+	unsigned level;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (len > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	/* Anything preallocated past the old end goes first */
+	sfs_prealloc_release(sv);
+	sv->sv_pawindow = 0;
+
+	/* Cached pages past the new end are no longer the file's */
+	if (sv->sv_pages != NULL) {
+		filecache_truncate(sv->sv_pages, len);
+	}
+
+	/* Inline files just clear what's past the new end */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (len <= SFS_INLINE_MAX) {
+			if (len < sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_inline + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sfs_dirty_inode(sv);
+			return 0;
+		}
+		result = sfs_inline_unpack(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	fr.fr_n = 0;
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_freerun_add(sfs, &fr, block);
+			sv->sv_i.sfi_direct[i] = 0;
+			sfs_dirty_inode(sv);
+		}
+	}
 
-	switch (sv->sv_i.sfi_type) {
-	case SFS_TYPE_FILE:
-		*ret = S_IFREG;
-		vfs_biglock_release();
-		return 0;
-	case SFS_TYPE_DIR:
-		*ret = S_IFDIR;
-		vfs_biglock_release();
-		return 0;
+	/* Then everything under the indirect blocks */
+	baseblock = SFS_NDIRECT;
+	span = SFS_DBPERIDB;
+	for (level=1; level<=3; level++) {
+		switch (level) {
+		    case 1: ientry = &sv->sv_i.sfi_indirect; break;
+		    case 2: ientry = &sv->sv_i.sfi_dindirect; break;
+		    default: ientry = &sv->sv_i.sfi_tindirect; break;
+		}
+		block = *ientry;
+		result = sfs_truncate_indirect(sv, ientry, level, baseblock,
+					       blocklen, &fr);
+		if (*ientry != block) {
+			sfs_dirty_inode(sv);
+		}
+		if (result) {
+			sfs_freerun_flush(sfs, &fr);
+			return result;
+		}
+		baseblock += span;
+		span *= SFS_DBPERIDB;
 	}
-	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
-	      sv->sv_ino, sv->sv_i.sfi_type);
-	return EINVAL;
-}
+	sfs_freerun_flush(sfs, &fr);
 
-/*
- * Check for legal seeks on files. Allow anything non-negative.
- * We could conceivably, here, prohibit seeking past the maximum
- * file size our inode structure can support, but we don't - few
- * people ever bother to check lseek() for failure and having
- * read() or write() fail is sufficient.
- */
-static
-int
-sfs_tryseek(struct vnode *v, off_t pos)
-{
-	if (pos<0) {
-		return EINVAL;
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* An empty file has no blocks left, so it can go back inline */
+	if (len == 0 && sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		sv->sv_i.sfi_flags |= SFS_IF_INLINE;
 	}
 
-	/* Allow anything else */
-	(void)v;
+	/* Mark the inode dirty */
+	sfs_dirty_inode(sv);
 
 	return 0;
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for ftruncate().
  */
 static
 int
-sfs_fsync(struct vnode *v)
+sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	sfs_tx_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	rwlock_release_write(sv->sv_lock);
+	sfs_tx_end(sfs);
 
 	return result;
 }
 
 /*
- * Called for mmap().
- */
-static
-int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
-{
-	(void)v;
-	return EUNIMP;
-}
-
-/*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for fallocate(). Each hole in the range is allocated as one
+ * run (see sfs.h), so the file's blocks there come out contiguous.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_fallocate(struct vnode *v, off_t pos, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	off_t end = pos + len;
+	uint32_t fileblock, endblock, hole, diskblock;
+	int result = 0;
 
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	if (end > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
-	int result;
-	int hasnonzero, iddirty;
+	sfs_tx_begin(sfs);
+	rwlock_acquire_write(sv->sv_lock);
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	/* An inline file has the space already, if it stays inline */
+	if ((sv->sv_i.sfi_flags & SFS_IF_INLINE) && end > SFS_INLINE_MAX) {
+		result = sfs_inline_unpack(sv);
+	}
 
-	vfs_biglock_acquire();
+	fileblock = pos / SFS_BLOCKSIZE;
+	endblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		endblock = 0;
+	}
+	while (result == 0 && fileblock < endblock) {
+		/* Find the next hole, and how long it is */
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			fileblock++;
+			continue;
+		}
+		for (hole = 1; fileblock + hole < endblock; hole++) {
+			result = sfs_bmap(sv, fileblock + hole, 0, &diskblock);
+			if (result || diskblock != 0) {
+				break;
+			}
+		}
+		if (result) {
+			break;
+		}
 
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+		/* Fill it, taking it all at once */
+		sv->sv_pawant = hole;
+		for (; hole > 0; hole--) {
+			result = sfs_bmap(sv, fileblock++, 1, &diskblock);
+			if (result) {
+				break;
+			}
 		}
 	}
+	sv->sv_pawant = 0;
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+	if (result == 0 && end > (off_t)sv->sv_i.sfi_size) {
+		sv->sv_i.sfi_size = end;
+		sfs_dirty_inode(sv);
+	}
 
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
+	rwlock_release_write(sv->sv_lock);
+	sfs_tx_end(sfs);
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	return result;
+}
+
+/*
+ * Copy the LEN bytes at SPOS in SRC to POS in DST, which start at the
+ * same place in their blocks, a block at a time straight from one
+ * file's page to the other's. A whole block that's a hole in SRC stays a hole in DST if
+ * it was one there. (With reference counts on blocks, this is where
+ * DST would share SRC's blocks instead.) The caller holds SRC's lock,
+ * at least shared, and DST's exclusively.
+ */
+static
+int
+sfs_copyblocks(struct sfs_vnode *dst, off_t pos, struct sfs_vnode *src,
+	       off_t spos, off_t len, off_t *copied)
+{
+	struct fcpage *sp, *dp;
+	uint32_t sblock, dblock, skip, n;
+	off_t done;
+	int result = 0;
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	KASSERT(pos % SFS_BLOCKSIZE == spos % SFS_BLOCKSIZE);
 
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	for (done = 0; done < len; done += n) {
+		skip = (pos + done) % SFS_BLOCKSIZE;
+		n = SFS_BLOCKSIZE - skip;
+		if (n > len - done) {
+			n = len - done;
 		}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
+		result = sfs_bmap(src, (spos + done) / SFS_BLOCKSIZE, 0,
+				  &sblock);
+		if (result) {
+			break;
+		}
+		if (sblock == 0 && n == SFS_BLOCKSIZE) {
+			result = sfs_bmap(dst, (pos + done) / SFS_BLOCKSIZE,
+					  0, &dblock);
+			if (result) {
+				break;
 			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+			if (dblock == 0) {
+				continue;
 			}
 		}
+		result = sfs_bmap(dst, (pos + done) / SFS_BLOCKSIZE, 1,
+				  &dblock);
+		if (result) {
+			break;
+		}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+		/*
+		 * DST's page is filled before SRC's is got, so if they're
+		 * the same page it isn't still waiting to be filled.
+		 */
+		result = sfs_getfilepage(dst, (pos + done) / PAGE_SIZE, &dp);
+		if (result) {
+			break;
+		}
+		if (sblock == 0) {
+			bzero((char *)filecache_data(dp) +
+			      (pos + done) % PAGE_SIZE, n);
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
+		else {
+			result = sfs_getfilepage(src, (spos + done) / PAGE_SIZE,
+						 &sp);
 			if (result) {
-				vfs_biglock_release();
-				return result;
+				filecache_release(dp);
+				break;
 			}
+			memmove((char *)filecache_data(dp) +
+				(pos + done) % PAGE_SIZE,
+				(char *)filecache_data(sp) +
+				(spos + done) % PAGE_SIZE, n);
+			filecache_release(sp);
 		}
+		filecache_markdirty(dp);
+		filecache_release(dp);
 	}
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+	if (pos + done > (off_t)dst->sv_i.sfi_size) {
+		dst->sv_i.sfi_size = pos + done;
+		sfs_dirty_inode(dst);
+	}
+	*copied = done;
+	return result;
+}
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+/*
+ * Called for copy_file_range(). Between two files on the same volume
+ * the data moves page to page in the file page cache; anything else
+ * (another filesystem, offsets at different places in their blocks,
+ * or an inline file that would stay inline) goes back to the caller
+ * with ENOSYS, to copy through a buffer.
+ */
+static
+int
+sfs_copyrange(struct vnode *v, off_t pos, struct vnode *srcv, off_t spos,
+	      off_t len, off_t *copied)
+{
+	struct sfs_vnode *dst = v->vn_data;
+	struct sfs_vnode *src = srcv->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	off_t size;
+	int result;
 
-	vfs_biglock_release();
-	return 0;
+	if (srcv->vn_ops != v->vn_ops || srcv->vn_fs != v->vn_fs ||
+	    pos % SFS_BLOCKSIZE != spos % SFS_BLOCKSIZE) {
+		return ENOSYS;
+	}
+
+	/* In inode order, so copies the other way round can't deadlock */
+	sfs_tx_begin(sfs);
+	if (src == dst) {
+		rwlock_acquire_write(dst->sv_lock);
+	}
+	else if (src->sv_ino < dst->sv_ino) {
+		rwlock_acquire_read(src->sv_lock);
+		rwlock_acquire_write(dst->sv_lock);
+	}
+	else {
+		rwlock_acquire_write(dst->sv_lock);
+		rwlock_acquire_read(src->sv_lock);
+	}
+
+	size = src->sv_i.sfi_size;
+	if (spos >= size) {
+		len = 0;
+	}
+	else if (len > size - spos) {
+		len = size - spos;
+	}
+
+	if (len == 0) {
+		*copied = 0;
+		result = 0;
+	}
+	else if (pos + len > SFS_MAXFILESIZE) {
+		result = EFBIG;
+	}
+	else if ((src->sv_i.sfi_flags & SFS_IF_INLINE) ||
+		 ((dst->sv_i.sfi_flags & SFS_IF_INLINE) &&
+		  pos + len <= SFS_INLINE_MAX)) {
+		result = ENOSYS;
+	}
+	else {
+		result = 0;
+		if (dst->sv_i.sfi_flags & SFS_IF_INLINE) {
+			result = sfs_inline_unpack(dst);
+		}
+		if (result == 0) {
+			result = sfs_copyblocks(dst, pos, src, spos, len,
+						copied);
+		}
+	}
+
+	if (src != dst) {
+		rwlock_release_read(src->sv_lock);
+	}
+	rwlock_release_write(dst->sv_lock);
+	sfs_tx_end(sfs);
+
+	return result;
 }
 
 /*
@@ -1250,8 +3646,8 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
  */
 static
 int
-sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
-	  struct vnode **ret)
+sfs_docreat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	    struct vnode **ret)
 {
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
@@ -1259,37 +3655,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		rwlock_release_write(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +3694,23 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* Update the linkcount of the new file */
+	/* Update the linkcount of the new file, which starts out inline */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
+	newguy->sv_i.sfi_flags |= SFS_IF_INLINE;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
+	rwlock_release_write(newguy->sv_lock);
 
-	*ret = &newguy->sv_v;
+	rwlock_release_write(sv->sv_lock);
 
-	vfs_biglock_release();
+	*ret = &newguy->sv_v;
 	return 0;
 }
 
@@ -1323,7 +3721,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
  */
 static
 int
-sfs_link(struct vnode *dir, const char *name, struct vnode *file)
+sfs_dolink(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
@@ -1331,20 +3729,22 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	rwlock_acquire_write(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
+	rwlock_release_write(f->sv_lock);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1353,19 +3753,19 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
  */
 static
 int
-sfs_remove(struct vnode *dir, const char *name)
+sfs_doremove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +3773,18 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		rwlock_release_write(victim->sv_lock);
 	}
 
+	rwlock_release_write(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1393,23 +3796,23 @@ sfs_remove(struct vnode *dir, const char *name)
  */
 static
 int
-sfs_rename(struct vnode *d1, const char *n1,
-	   struct vnode *d2, const char *n2)
+sfs_dorename(struct vnode *d1, const char *n1,
+	     struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +3833,9 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	rwlock_acquire_write(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1445,12 +3849,14 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 */
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+	rwlock_release_write(g1->sv_lock);
+
+	rwlock_release_write(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1465,10 +3871,69 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: rename: Cannot recover\n");
 	}
 	g1->sv_i.sfi_linkcount--;
+	rwlock_release_write(g1->sv_lock);
  puke:
+	rwlock_release_write(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	return result;
+}
+
+/*
+ * The directory operations above each run as one transaction, so a
+ * crash can't leave half of one on disk.
+ */
+static
+int
+sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	  struct vnode **ret)
+{
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_tx_begin(sfs);
+	result = sfs_docreat(v, name, excl, mode, ret);
+	sfs_tx_end(sfs);
+	return result;
+}
+
+static
+int
+sfs_link(struct vnode *dir, const char *name, struct vnode *file)
+{
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
+	int result;
+
+	sfs_tx_begin(sfs);
+	result = sfs_dolink(dir, name, file);
+	sfs_tx_end(sfs);
+	return result;
+}
+
+static
+int
+sfs_remove(struct vnode *dir, const char *name)
+{
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
+	int result;
+
+	sfs_tx_begin(sfs);
+	result = sfs_doremove(dir, name);
+	sfs_tx_end(sfs);
+	return result;
+}
+
+static
+int
+sfs_rename(struct vnode *d1, const char *n1,
+	   struct vnode *d2, const char *n2)
+{
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
+	int result;
+
+	sfs_tx_begin(sfs);
+	result = sfs_dorename(d1, n1, d2, n2);
+	sfs_tx_end(sfs);
 	return result;
 }
 
@@ -1481,20 +3946,17 @@ sfs_rename(struct vnode *d1, const char *n1,
  */
 static
 int
-sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
+sfs_lookparent(struct vnode *v, const char *path, struct vnode **ret,
 		  char *buf, size_t buflen)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* sfi_type never changes once loaded, so no lock is needed */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +3964,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1510,32 +3971,30 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. Lookups only read the directory, so they can run together.
  */
 static
 int
-sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
+sfs_lookup(struct vnode *v, const char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *final;
-	int result;
-
-	vfs_biglock_acquire();
+	int slot, result;
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
-	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_acquire_read(sv->sv_lock);
+	result = sfs_lookonce(sv, path, &final, &slot);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
+	sfs_statahead_hit(sv, slot);
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1592,7 +4051,13 @@ static const struct vnode_ops sfs_fileops = {
 	sfs_tryseek,
 	sfs_fsync,
 	sfs_mmap,
+	sfs_getpage,
+	sfs_advise,
+	sfs_syncrange,
+	sfs_poll,
 	sfs_truncate,
+	sfs_fallocate,
+	sfs_copyrange,
 	NOTDIR,  /* namefile */
 
 	NOTDIR,  /* creat */
@@ -1619,15 +4084,21 @@ static const struct vnode_ops sfs_dirops = {
 
 	ISDIR,   /* read */
 	ISDIR,   /* readlink */
-	UNIMP,   /* getdirentry */
+	sfs_getdirentry,
 	ISDIR,   /* write */
 	sfs_ioctl,
 	sfs_stat,
 	sfs_gettype,
-	UNIMP,   /* tryseek */
+	sfs_tryseek,
 	sfs_fsync,
 	ISDIR,   /* mmap */
+	ISDIR,   /* getpage */
+	ISDIR,   /* advise */
+	ISDIR,   /* syncrange */
+	sfs_poll,
 	ISDIR,   /* truncate */
+	ISDIR,   /* fallocate */
+	ISDIR,   /* copyrange */
 	sfs_namefile,
 
 	sfs_creat,
@@ -1651,42 +4122,56 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_lookup(&sfs->sfs_vnodes, &ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
+		if (!sfs_bused(sfs, ino)) {
+			panic("sfs: Found inode %u in unallocated "
+			      "block\n", ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_inactive) {
+			/* The reference it was kept with becomes ours */
+			sfs_lruremove(sfs, sv);
+			sv->sv_inactive = false;
+		}
+		else {
 			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kmem_cache_free(sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_maplock = lock_create("sfs_map");
+	if (sv->sv_maplock == NULL) {
+		rwlock_destroy(sv->sv_lock);
+		kmem_cache_free(sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,13 +4184,40 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		rwlock_destroy(sv->sv_lock);
+		lock_destroy(sv->sv_maplock);
+		kmem_cache_free(sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet */
+	spinlock_init(&sv->sv_ralock);
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_radone = 0;
+	sv->sv_raadvice = POSIX_FADV_NORMAL;
+	sv->sv_saslot = -1;
+	sv->sv_salook = -1;
+	sv->sv_sahits = 0;
+	sv->sv_sadone = 0;
+
+	/* No writeback started */
+	sv->sv_wbnext = NULL;
+	sv->sv_wbqueued = false;
+	sv->sv_wbbusy = false;
+	sv->sv_wberr = 0;
+
+	/* Nothing preallocated */
+	sv->sv_panext = 0;
+	sv->sv_pablock = 0;
+	sv->sv_pacount = 0;
+	sv->sv_pawindow = 0;
+	sv->sv_pawant = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1714,7 +4226,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		/* (sfs_dirty_inode needs the vnode set up, so by hand) */
 		sv->sv_dirty = true;
+		sfs_journal_note(sfs, 1);
 	}
 
 	/*
@@ -1733,24 +4247,50 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	/* File data is kept in the page cache; directories use buffers */
+	sv->sv_pages = NULL;
+	if (sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		sv->sv_pages = filecache_create();
+		if (sv->sv_pages == NULL) {
+			spinlock_cleanup(&sv->sv_ralock);
+			rwlock_destroy(sv->sv_lock);
+			lock_destroy(sv->sv_maplock);
+			kmem_cache_free(sfs_vnode_cache, sv);
+			lock_release(sfs->sfs_vnlock);
+			return ENOMEM;
+		}
+	}
+
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		if (sv->sv_pages != NULL) {
+			filecache_destroy(sv->sv_pages);
+		}
+		spinlock_cleanup(&sv->sv_ralock);
+		rwlock_destroy(sv->sv_lock);
+		lock_destroy(sv->sv_maplock);
+		kmem_cache_free(sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_inactive = false;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
+	/* Index directories before anyone else can see them */
+	sv->sv_dirindex = NULL;
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_dirindex_build(sv);
 	}
 
+	/* Add it to our table */
+	sfs_vnhash_add(&sfs->sfs_vnodes, sv, &ino);
+
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +4307,50 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
+
+/*
+ * Create the sfs_vnode object cache and the volume list for its
+ * shrinker. Called from mount, under the biglock vfs_mount holds, so
+ * two volumes can't race to make them.
+ */
+int
+sfs_vnode_cache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	if (sfs_volumes_lock == NULL) {
+		sfs_volumes_lock = lock_create("sfs_volumes");
+		if (sfs_volumes_lock == NULL) {
+			return ENOMEM;
+		}
+	}
+	if (sfs_wblistlock == NULL) {
+		sfs_wblistlock = lock_create("sfs_wblist");
+		if (sfs_wblistlock == NULL) {
+			return ENOMEM;
+		}
+	}
+	if (sfs_wbcv == NULL) {
+		sfs_wbcv = cv_create("sfs_wbcv");
+		if (sfs_wbcv == NULL) {
+			return ENOMEM;
+		}
+		work_init(&sfs_wbwork, sfs_wbwork_run, NULL);
+	}
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+		vm_register_shrinker(&sfs_vnode_shrinker);
+	}
+	return 0;
+}
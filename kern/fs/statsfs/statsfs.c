@@ -0,0 +1,801 @@
+/*
+ * statsfs: a read-only filesystem of kernel statistics, mounted as
+ * "stats:". See statsfs.h.
+ *
+ * There is a root directory and a fixed set of files in it. The
+ * vnodes are static and live forever. Reading a file formats a fresh
+ * snapshot of what it reports into a buffer and hands back the part
+ * at the read's offset, so the text is only consistent within one
+ * read; a reader should ask for the whole file (STATSFS_BUFSIZE
+ * bytes) at once.
+ */
+
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/poll.h>
+#include <kern/cputime.h>
+#include <stat.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <uio.h>
+#include <cpu.h>
+#include <proc.h>
+#include <syscall.h>
+#include <uw-vmstats.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+#include <device.h>
+#include <statsfs.h>
+
+#define STATSFS_BUFSIZE 8192
+
+/*
+ * Output buffer. Text past the end is dropped.
+ */
+struct statbuf {
+	char *sb_data;
+	size_t sb_len;
+};
+
+static
+void
+sb_printf(struct statbuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (sb->sb_len >= STATSFS_BUFSIZE - 1) {
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(sb->sb_data + sb->sb_len, STATSFS_BUFSIZE - sb->sb_len,
+		      fmt, ap);
+	va_end(ap);
+	sb->sb_len += n;
+	if (sb->sb_len > STATSFS_BUFSIZE - 1) {
+		sb->sb_len = STATSFS_BUFSIZE - 1;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// The files
+
+static
+int
+statsfs_fill_vm(struct statbuf *sb)
+{
+	unsigned counts[VMSTAT_COUNT];
+	unsigned i;
+
+	vmstats_get(counts);
+	for (i=0; i<VMSTAT_COUNT; i++) {
+		sb_printf(sb, "%s: %u\n", vmstats_name(i), counts[i]);
+	}
+	return 0;
+}
+
+static
+int
+statsfs_fill_cpu(struct statbuf *sb)
+{
+	struct cputimes ct;
+	unsigned i;
+
+	sb_printf(sb, "%-4s %16s %16s %16s %16s\n", "cpu",
+		  "user ns", "kernel ns", "intr ns", "idle ns");
+	for (i=0; cpu_gettimes(i, &ct) == 0; i++) {
+		sb_printf(sb, "%-4u %16llu %16llu %16llu %16llu\n", i,
+			  ct.ct_nsecs[CPUTIME_USER],
+			  ct.ct_nsecs[CPUTIME_KERNEL],
+			  ct.ct_nsecs[CPUTIME_INTR],
+			  ct.ct_nsecs[CPUTIME_IDLE]);
+	}
+	return 0;
+}
+
+static
+int
+statsfs_fill_procs(struct statbuf *sb)
+{
+	struct procinfo *info;
+	unsigned i, n;
+
+	info = kmalloc(PROC_MAX * sizeof(struct procinfo));
+	if (info == NULL) {
+		return ENOMEM;
+	}
+	n = proc_getinfo(info, PROC_MAX);
+
+	sb_printf(sb, "%6s %6s %8s %4s %-6s %s\n", "pid", "ppid", "threads",
+		  "nice", "state", "name");
+	for (i=0; i<n; i++) {
+		sb_printf(sb, "%6d %6d %8u %4d %-6s %s\n", info[i].pi_pid,
+			  info[i].pi_ppid, info[i].pi_nthreads, info[i].pi_nice,
+			  info[i].pi_zombie ? "zombie" : "run",
+			  info[i].pi_name);
+	}
+	kfree(info);
+	return 0;
+}
+
+static
+int
+statsfs_fill_syscalls(struct statbuf *sb)
+{
+	struct syscall_stat total;
+	const char *name;
+	unsigned i;
+
+	sb_printf(sb, "%-10s %10s %10s %14s\n", "syscall", "calls", "errors",
+		  "total nsecs");
+	for (i=0; i<SYSCALL_NCALLS; i++) {
+		if (syscall_getstats(i, &name, &total) || total.ss_calls == 0) {
+			continue;
+		}
+		sb_printf(sb, "%-10s %10u %10u %14llu\n", name, total.ss_calls,
+			  total.ss_errors, total.ss_nsecs);
+	}
+	return 0;
+}
+
+/*
+ * Raw counts, for scripts: sizes in sectors and times in ns, with
+ * the time covered last so rates can be worked out.
+ */
+static
+int
+statsfs_fill_iostat(struct statbuf *sb)
+{
+	struct iocounts ic;
+	const char *name;
+	uint64_t elapsed;
+	unsigned i;
+
+	sb_printf(sb, "%-8s %8s %8s %10s %10s %6s %5s %5s %14s %14s %14s\n",
+		  "device", "reads", "writes", "rsectors", "wsectors",
+		  "errors", "depth", "max", "busy ns", "total ns", "elapsed ns");
+	for (i=0; iostat_get(i, &name, &ic, &elapsed) == 0; i++) {
+		sb_printf(sb, "%-8s %8u %8u %10llu %10llu %6u %5u %5u "
+			  "%14llu %14llu %14llu\n", name,
+			  ic.ic_reads, ic.ic_writes,
+			  ic.ic_rbytes / IOSTAT_SECTSIZE,
+			  ic.ic_wbytes / IOSTAT_SECTSIZE,
+			  ic.ic_errors, ic.ic_depth, ic.ic_maxdepth,
+			  ic.ic_busyns, ic.ic_totalns, elapsed);
+	}
+	return 0;
+}
+
+static struct fs statsfs_fs;
+static struct vnode statsfs_root;
+
+static struct statsfs_file {
+	const char *sf_name;
+	int (*sf_fill)(struct statbuf *sb);
+	struct vnode sf_vnode;
+} statsfs_files[] = {
+	{ "vm",       statsfs_fill_vm,       {} },
+	{ "cpu",      statsfs_fill_cpu,      {} },
+	{ "procs",    statsfs_fill_procs,    {} },
+	{ "syscalls", statsfs_fill_syscalls, {} },
+	{ "iostat",   statsfs_fill_iostat,   {} },
+};
+#define STATSFS_NFILES (sizeof(statsfs_files) / sizeof(statsfs_files[0]))
+
+////////////////////////////////////////////////////////////
+// Vnode operations
+
+/*
+ * VOP_OPEN for files. Nothing can be written.
+ */
+static
+int
+statsfs_open(struct vnode *v, int openflags)
+{
+	(void)v;
+	if ((openflags & O_ACCMODE) != O_RDONLY ||
+	    (openflags & (O_TRUNC | O_APPEND))) {
+		return EROFS;
+	}
+	return 0;
+}
+
+/*
+ * VOP_OPEN for the root directory.
+ */
+static
+int
+statsfs_opendir(struct vnode *v, int openflags)
+{
+	(void)v;
+	if ((openflags & O_ACCMODE) != O_RDONLY) {
+		return EISDIR;
+	}
+	return 0;
+}
+
+static
+int
+statsfs_close(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+/*
+ * VOP_RECLAIM. The vnodes are never freed; keep the last reference.
+ */
+static
+int
+statsfs_reclaim(struct vnode *v)
+{
+	(void)v;
+	return EBUSY;
+}
+
+/*
+ * VOP_READ: generate the file and copy out the part asked for.
+ */
+static
+int
+statsfs_read(struct vnode *v, struct uio *uio)
+{
+	struct statsfs_file *sf = v->vn_data;
+	struct statbuf sb;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+
+	sb.sb_data = kmalloc(STATSFS_BUFSIZE);
+	if (sb.sb_data == NULL) {
+		return ENOMEM;
+	}
+	sb.sb_len = 0;
+
+	result = sf->sf_fill(&sb);
+	if (result == 0 && uio->uio_offset < (off_t)sb.sb_len) {
+		result = uiomove(sb.sb_data + uio->uio_offset,
+				 sb.sb_len - uio->uio_offset, uio);
+	}
+	kfree(sb.sb_data);
+	return result;
+}
+
+/*
+ * VOP_GETDIRENTRY: the offset is the index of the next file.
+ */
+static
+int
+statsfs_getdirentry(struct vnode *v, struct uio *uio)
+{
+	const char *name;
+	off_t slot;
+	int result;
+
+	(void)v;
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	slot = uio->uio_offset;
+	if (slot < 0) {
+		return EINVAL;
+	}
+	if (slot >= (off_t)STATSFS_NFILES) {
+		return 0;
+	}
+	name = statsfs_files[slot].sf_name;
+	result = uiomove((char *)name, strlen(name), uio);
+	if (result) {
+		return result;
+	}
+	uio->uio_offset = slot + 1;
+	return 0;
+}
+
+static
+int
+statsfs_stat(struct vnode *v, struct stat *statbuf)
+{
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	/* The size isn't known until it's read */
+	statbuf->st_mode |= v == &statsfs_root ? 0555 : 0444;
+	statbuf->st_nlink = v == &statsfs_root ? 2 : 1;
+	return 0;
+}
+
+static
+int
+statsfs_file_gettype(struct vnode *v, uint32_t *result)
+{
+	(void)v;
+	*result = S_IFREG;
+	return 0;
+}
+
+static
+int
+statsfs_dir_gettype(struct vnode *v, uint32_t *result)
+{
+	(void)v;
+	*result = S_IFDIR;
+	return 0;
+}
+
+static
+int
+statsfs_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	if (pos < 0) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+int
+statsfs_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+/*
+ * Reads never wait.
+ */
+static
+int
+statsfs_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	(void)v;
+	(void)pw;
+	*revents = events & POLLIN;
+	return 0;
+}
+
+static
+int
+statsfs_namefile(struct vnode *v, struct uio *uio)
+{
+	struct statsfs_file *sf = v->vn_data;
+
+	if (v == &statsfs_root) {
+		/* Root directory - name is empty string */
+		return 0;
+	}
+	return uiomove((char *)sf->sf_name, strlen(sf->sf_name), uio);
+}
+
+/*
+ * VOP_LOOKUP: "" and "." are the root, and the files have no
+ * subdirectories to look in.
+ */
+static
+int
+statsfs_lookup(struct vnode *dir, const char *pathname, struct vnode **ret)
+{
+	unsigned i;
+
+	KASSERT(dir == &statsfs_root);
+
+	if (!strcmp(pathname, "") || !strcmp(pathname, ".")) {
+		VOP_INCREF(dir);
+		*ret = dir;
+		return 0;
+	}
+	for (i=0; i<STATSFS_NFILES; i++) {
+		if (!strcmp(pathname, statsfs_files[i].sf_name)) {
+			VOP_INCREF(&statsfs_files[i].sf_vnode);
+			*ret = &statsfs_files[i].sf_vnode;
+			return 0;
+		}
+	}
+	return strchr(pathname, '/') != NULL ? ENOTDIR : ENOENT;
+}
+
+static
+int
+statsfs_lookparent(struct vnode *dir, const char *pathname,
+		   struct vnode **ret, char *buf, size_t len)
+{
+	if (strchr(pathname, '/') != NULL) {
+		return ENOENT;
+	}
+	if (strlen(pathname)+1 > len) {
+		return ENAMETOOLONG;
+	}
+	VOP_INCREF(dir);
+	*ret = dir;
+	strcpy(buf, pathname);
+	return 0;
+}
+
+//////////////////////////////
+
+/*
+ * Everything that would change something.
+ */
+
+static
+int
+statsfs_uio_rofs(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EROFS;
+}
+
+static
+int
+statsfs_truncate_rofs(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EROFS;
+}
+
+static
+int
+statsfs_fallocate_rofs(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return EROFS;
+}
+
+static
+int
+statsfs_copyrange_rofs(struct vnode *v, off_t pos, struct vnode *src,
+		       off_t spos, off_t len, off_t *copied)
+{
+	(void)v;
+	(void)pos;
+	(void)src;
+	(void)spos;
+	(void)len;
+	(void)copied;
+	return EROFS;
+}
+
+static
+int
+statsfs_creat_rofs(struct vnode *v, const char *name, bool excl, mode_t mode,
+		   struct vnode **ret)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)ret;
+	return EROFS;
+}
+
+static
+int
+statsfs_symlink_rofs(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return EROFS;
+}
+
+static
+int
+statsfs_mkdir_rofs(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return EROFS;
+}
+
+static
+int
+statsfs_link_rofs(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return EROFS;
+}
+
+static
+int
+statsfs_name_rofs(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return EROFS;
+}
+
+static
+int
+statsfs_rename_rofs(struct vnode *v1, const char *n1,
+		    struct vnode *v2, const char *n2)
+{
+	(void)v1;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return EROFS;
+}
+
+/*
+ * Bits that make no sense for what they're called on.
+ */
+
+static
+int
+statsfs_uio_isdir(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EISDIR;
+}
+
+static
+int
+statsfs_uio_notdir(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return ENOTDIR;
+}
+
+static
+int
+statsfs_uio_inval(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+statsfs_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+statsfs_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+statsfs_getpage(struct vnode *v, uint32_t index, bool forwrite,
+	        struct fcpage **ret)
+{
+	(void)v;
+	(void)index;
+	(void)forwrite;
+	(void)ret;
+	return ENOSYS;
+}
+
+static
+int
+statsfs_advise(struct vnode *v, off_t pos, off_t len, int advice)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)advice;
+	return 0;
+}
+
+static
+int
+statsfs_syncrange(struct vnode *v, off_t pos, off_t len, unsigned flags)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)flags;
+	return 0;
+}
+
+static
+int
+statsfs_creat_notdir(struct vnode *v, const char *name, bool excl,
+		     mode_t mode, struct vnode **ret)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)ret;
+	return ENOTDIR;
+}
+
+static
+int
+statsfs_lookup_notdir(struct vnode *v, const char *pathname,
+		      struct vnode **ret)
+{
+	(void)v;
+	(void)pathname;
+	(void)ret;
+	return ENOTDIR;
+}
+
+static
+int
+statsfs_lookparent_notdir(struct vnode *v, const char *pathname,
+			  struct vnode **ret, char *buf, size_t len)
+{
+	(void)v;
+	(void)pathname;
+	(void)ret;
+	(void)buf;
+	(void)len;
+	return ENOTDIR;
+}
+
+//////////////////////////////
+
+/*
+ * Function table for statsfs files.
+ */
+static const struct vnode_ops statsfs_fileops = {
+	VOP_MAGIC,	/* mark this a valid vnode ops table */
+
+	statsfs_open,
+	statsfs_close,
+	statsfs_reclaim,
+
+	statsfs_read,
+	statsfs_uio_inval,	/* readlink */
+	statsfs_uio_notdir,	/* getdirentry */
+	statsfs_uio_rofs,	/* write */
+	statsfs_ioctl,
+	statsfs_stat,
+	statsfs_file_gettype,
+	statsfs_tryseek,
+	statsfs_fsync,
+	statsfs_mmap,
+	statsfs_getpage,
+	statsfs_advise,
+	statsfs_syncrange,
+	statsfs_poll,
+	statsfs_truncate_rofs,
+	statsfs_fallocate_rofs,
+	statsfs_copyrange_rofs,
+	statsfs_namefile,
+
+	statsfs_creat_notdir,
+	statsfs_symlink_rofs,
+	statsfs_mkdir_rofs,
+	statsfs_link_rofs,
+	statsfs_name_rofs,	/* remove */
+	statsfs_name_rofs,	/* rmdir */
+	statsfs_rename_rofs,
+
+	statsfs_lookup_notdir,
+	statsfs_lookparent_notdir,
+};
+
+/*
+ * Function table for the root directory.
+ */
+static const struct vnode_ops statsfs_dirops = {
+	VOP_MAGIC,	/* mark this a valid vnode ops table */
+
+	statsfs_opendir,
+	statsfs_close,
+	statsfs_reclaim,
+
+	statsfs_uio_isdir,	/* read */
+	statsfs_uio_inval,	/* readlink */
+	statsfs_getdirentry,
+	statsfs_uio_isdir,	/* write */
+	statsfs_ioctl,
+	statsfs_stat,
+	statsfs_dir_gettype,
+	statsfs_tryseek,
+	statsfs_fsync,
+	statsfs_mmap,
+	statsfs_getpage,
+	statsfs_advise,
+	statsfs_syncrange,
+	statsfs_poll,
+	statsfs_truncate_rofs,
+	statsfs_fallocate_rofs,
+	statsfs_copyrange_rofs,
+	statsfs_namefile,
+
+	statsfs_creat_rofs,
+	statsfs_symlink_rofs,
+	statsfs_mkdir_rofs,
+	statsfs_link_rofs,
+	statsfs_name_rofs,	/* remove */
+	statsfs_name_rofs,	/* rmdir */
+	statsfs_rename_rofs,
+
+	statsfs_lookup,
+	statsfs_lookparent,
+};
+
+////////////////////////////////////////////////////////////
+// Filesystem operations
+
+static
+int
+statsfs_sync(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
+static
+const char *
+statsfs_getvolname(struct fs *fs)
+{
+	(void)fs;
+	return NULL;
+}
+
+static
+struct vnode *
+statsfs_getroot(struct fs *fs)
+{
+	(void)fs;
+	VOP_INCREF(&statsfs_root);
+	return &statsfs_root;
+}
+
+static
+int
+statsfs_unmount(struct fs *fs)
+{
+	/* Like emufs, we're not really mounted */
+	(void)fs;
+	return EBUSY;
+}
+
+void
+statsfs_bootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	statsfs_fs.fs_sync = statsfs_sync;
+	statsfs_fs.fs_getvolname = statsfs_getvolname;
+	statsfs_fs.fs_getroot = statsfs_getroot;
+	statsfs_fs.fs_unmount = statsfs_unmount;
+	statsfs_fs.fs_data = NULL;
+
+	VOP_INIT(&statsfs_root, &statsfs_dirops, &statsfs_fs, NULL);
+	for (i=0; i<STATSFS_NFILES; i++) {
+		VOP_INIT(&statsfs_files[i].sf_vnode, &statsfs_fileops,
+			 &statsfs_fs, &statsfs_files[i]);
+	}
+
+	result = vfs_addfs("stats", &statsfs_fs);
+	if (result) {
+		panic("statsfs: vfs_addfs: %s\n", strerror(result));
+	}
+}
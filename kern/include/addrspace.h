@@ -36,8 +36,15 @@
 
 
 #include <vm.h>
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
+struct mmapregion;
+
+// How many TLB entries an address space keeps (in as_tlbsnap) across
+// being switched out
+#define AS_TLBSNAP 16
 
 
 /*
@@ -48,6 +55,7 @@ struct vnode;
  */
 
 struct addrspace {
+#if OPT_DUMBVM
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -62,6 +70,87 @@ struct addrspace {
 
   // The address space is officially ready
   bool as_ready;
+#else
+  // Bounds of the two ELF segments (the stack is fixed below USERSTACK)
+  vaddr_t as_vbase1;
+  size_t as_npages1;
+  bool as_dirtiable1;
+
+  vaddr_t as_vbase2;
+  size_t as_npages2;
+  bool as_dirtiable2;
+
+  // Where each segment's initialized data lives in the executable.
+  // Pages are read from here the first time they are touched; anything
+  // past filesz (bss) is zero filled.
+  vaddr_t as_filevaddr1;
+  off_t as_fileoffset1;
+  size_t as_filesz1;
+
+  vaddr_t as_filevaddr2;
+  off_t as_fileoffset2;
+  size_t as_filesz2;
+
+  // The (open) executable the segments are backed by, or NULL
+  struct vnode *as_vnode;
+
+  // Virtual to physical translation for every mapped user page
+  struct pagetable *as_pt;
+
+  // Held by a fault while it fills in a page and by anything else that
+  // gives a PTE a frame or a swap slot or takes them away (sbrk, munmap,
+  // vm_mappages, fork's copy), since the threads of a process share it.
+  // Only stealmem_lock is needed to look at a PTE, or for eviction.
+  // Taken before mmap_lock.
+  struct lock *as_faultlock;
+
+  // Names us in the coremap entries of frames only we map
+  unsigned as_ownerid;
+
+  // Heap, from just past the highest segment up to the current break
+  // (as_heaptop is a byte address; its last page is mapped in full)
+  vaddr_t as_heapbase;
+  vaddr_t as_heaptop;
+
+  // Files mapped with mmap, placed downwards from just below the stack
+  // guard. as_mmaps is a table of as_nmmaps of them (with room for
+  // as_mmapslots) sorted by address, so a fault finds its mapping with a
+  // binary search; as_lastmap is the one found last, tried first.
+  // as_mmapbase is the lowest mapped address (the heap's limit). All
+  // protected by mmap_lock in smartvm.c.
+  struct mmapregion **as_mmaps;
+  unsigned as_nmmaps;
+  unsigned as_mmapslots;
+  struct mmapregion *as_lastmap;
+  vaddr_t as_mmapbase;
+
+  // The address space is officially ready
+  bool as_ready;
+
+  // TLB tag for this address space, valid while as_asidgen matches the
+  // current ASID generation
+  unsigned as_asid;
+  unsigned as_asidgen;
+
+  // Cpus (one bit per cpu number) that have no stale TLB entries for
+  // this ASID. A shootdown clears the bit of a cpu not running us at the
+  // time instead of interrupting it, and that cpu purges the ASID from
+  // its TLB when it next activates us. Protected by asid_lock.
+  uint32_t as_cpus;
+  // Pages this address space last had in a TLB, newest first: noted as
+  // it leaves a cpu and loaded again, if their PTEs are still good, when
+  // it next comes back to one, so it doesn't have to miss on its working
+  // set all over. Only hints. Protected by asid_lock.
+  vaddr_t as_tlbsnap[AS_TLBSNAP];
+  unsigned as_ntlbsnap;
+  // Set by as_doom: the process is gone and its frames are waiting for
+  // the reaper, which frees them from page table slot as_reapnext on.
+  // as_reaplink is the next one waiting. Protected by reap_lock in
+  // smartvm.c (as_doomed is also read under stealmem_lock).
+  bool as_doomed;
+  unsigned as_reapnext;
+  struct addrspace *as_reaplink;
+#endif
 };
 
 /*
@@ -86,6 +175,11 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_doom   - dispose of an address space, for _exit: the mappings
+ *                and the executable are let go of now, but the frames
+ *                are freed later, in batches, by a kernel job. Memory
+ *                pressure hurries it along.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -98,6 +192,25 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_sbrk - move the end of the heap by AMOUNT bytes, handing back
+ *                the old end in OLDBREAK.
+ *
+ *    as_mmap   - map LEN bytes of the file V, from OFFSET, into the
+ *                address space and hand back where. SHARED mappings
+ *                write to the file and are shared with children after
+ *                fork; private ones are copy-on-write. A NULL V maps
+ *                zero-filled anonymous memory instead.
+ *
+ *    as_munmap - remove the mapping that starts at VADDR, writing any
+ *                changes back to the file.
+ *
+ *    as_madvise - take the madvise() hint ADVICE (MADV_*) for the LEN
+ *                bytes from page aligned VADDR.
+ *
+ *    as_define_backing - (smartvm) record that the region containing
+ *                VADDR gets its first FILESIZE bytes from OFFSET in the
+ *                executable V. Nothing is read until the page faults.
  */
 
 struct addrspace *as_create(void);
@@ -105,6 +218,7 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_doom(struct addrspace *);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
@@ -114,6 +228,19 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          size_t len, off_t offset, bool writable,
+                          bool shared, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len,
+                             int advice);
+#if !OPT_DUMBVM
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    vaddr_t vaddr, off_t offset,
+                                    size_t filesize);
+#endif
 
 
 /*
@@ -57,9 +57,18 @@
  *       INDEX_RET isn't null; may fail and return error.
  * remove - excise entry INDEX and slide following entries down to
  *       close the resulting gap.
+ * remove_unordered - excise entry INDEX by moving the last entry into
+ *       its place. Constant time, but changes the order of what's left.
+ * preallocate - make room for at least NUM elements without changing
+ *       the size, so growing up to NUM with setsize/add doesn't
+ *       allocate or copy; may fail and return error.
  *
  * Note that expanding an array with setsize doesn't initialize the new
  * elements. (Usually the caller is about to store into them anyway.)
+ *
+ * Growth doubles the space, so adding N elements one at a time copies
+ * fewer than 2N pointers in all; callers that know how big an array
+ * is going to get can preallocate to avoid even that.
  */
 
 struct array {
@@ -75,8 +84,10 @@ unsigned array_num(const struct array *);
 void *array_get(const struct array *, unsigned index);
 void array_set(const struct array *, unsigned index, void *val);
 int array_setsize(struct array *, unsigned num);
+int array_preallocate(struct array *, unsigned num);
 int array_add(struct array *, void *val, unsigned *index_ret);
 void array_remove(struct array *, unsigned index);
+void array_remove_unordered(struct array *, unsigned index);
 
 /*
  * Inlining for base operations
@@ -124,6 +135,14 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 	return 0;
 }
 
+ARRAYINLINE void
+array_remove_unordered(struct array *a, unsigned index)
+{
+	ARRAYASSERT(index < a->num);
+	a->num--;
+	a->v[index] = a->v[a->num];
+}
+
 /*
  * Bits for declaring and defining typed arrays.
  *
@@ -176,8 +195,10 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 	T *ARRAY##_get(const struct ARRAY *a, unsigned index);	\
 	void ARRAY##_set(struct ARRAY *a, unsigned index, T *val); \
 	int ARRAY##_setsize(struct ARRAY *a, unsigned num);	\
+	int ARRAY##_preallocate(struct ARRAY *a, unsigned num);	\
 	int ARRAY##_add(struct ARRAY *a, T *val, unsigned *index_ret); \
-	void ARRAY##_remove(struct ARRAY *a, unsigned index)
+	void ARRAY##_remove(struct ARRAY *a, unsigned index);	\
+	void ARRAY##_remove_unordered(struct ARRAY *a, unsigned index)
 
 #define DEFARRAY_BYTYPE(ARRAY, T, INLINE) \
 	INLINE struct ARRAY *					\
@@ -235,6 +256,12 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 	}							\
 								\
 	INLINE int						\
+	ARRAY##_preallocate(struct ARRAY *a, unsigned num)	\
+	{							\
+		return array_preallocate(&a->arr, num);		\
+	}							\
+								\
+	INLINE int						\
 	ARRAY##_add(struct ARRAY *a, T *val, unsigned *index_ret) \
 	{							\
 		return array_add(&a->arr, (void *)val, index_ret); \
@@ -244,6 +271,12 @@ array_add(struct array *a, void *val, unsigned *index_ret)
 	ARRAY##_remove(struct ARRAY *a, unsigned index)		\
 	{							\
 		return array_remove(&a->arr, index);		\
+	}							\
+								\
+	INLINE void						\
+	ARRAY##_remove_unordered(struct ARRAY *a, unsigned index) \
+	{							\
+		array_remove_unordered(&a->arr, index);		\
 	}
 
 #define DECLARRAY(T) DECLARRAY_BYTYPE(T##array, struct T)
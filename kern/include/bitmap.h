@@ -37,7 +37,18 @@
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_resync  - recompute the bitmap's summary of free bits;
+ *                      call after changing the raw data (e.g. reading
+ *                      it in from disk).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - same, but take the first cleared bit at or
+ *                      after HINT, wrapping around to the start.
+ *     bitmap_alloc_run - locate N consecutive cleared bits, the first
+ *                      such run starting at or after HINT (wrapping
+ *                      around), set them, and return the first index.
+ *     bitmap_find_next_zero - return the index of the first cleared bit
+ *                      at or after HINT, without setting it.
+ *     bitmap_unmark_run - clear N set bits starting at INDEX.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -49,9 +60,17 @@ struct bitmap;  /* Opaque. */
 
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
+void           bitmap_resync(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned hint,
+                                 unsigned *index);
+int            bitmap_alloc_run(struct bitmap *, unsigned n, unsigned hint,
+                                unsigned *index);
+int            bitmap_find_next_zero(struct bitmap *, unsigned hint,
+                                     unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_unmark_run(struct bitmap *, unsigned index, unsigned n);
 int            bitmap_isset(struct bitmap *, unsigned index);
 void           bitmap_destroy(struct bitmap *);
 
@@ -0,0 +1,88 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Keeps recently used disk blocks in memory, keyed by (device, block
+ * number). Blocks are BUF_SIZE bytes; only devices with that block
+ * size can use the cache. Writes are delayed: a modified buffer is
+ * only marked dirty, and goes to disk when a background flusher gets
+ * to it, when it is evicted, or when buf_flush is called for its
+ * device. Buffers are recycled in least-recently-used order once
+ * BUF_MAX of them exist.
+ *
+ * A buffer handed out by buf_read or buf_get belongs to the caller
+ * until buf_release; anyone else asking for the same block waits.
+ * Don't hold a buffer across anything that can fault (uiomove to or
+ * from user space), since paging in may need the same block.
+ *
+ * Functions:
+ *     buf_bootstrap - set up the cache. Called once at boot.
+ *     buf_read      - get block BLOCK of DEV, reading it from disk if it
+ *                     isn't cached.
+ *     buf_get       - same, but without reading; for callers that will
+ *                     overwrite the whole block. The contents are
+ *                     undefined until they do.
+ *     buf_data      - the BUF_SIZE bytes of data in a buffer.
+ *     buf_markdirty - record that the caller changed the data.
+ *     buf_release   - give a buffer back.
+ *     buf_readahead - start reading block BLOCK of DEV into the cache in
+ *                     the background, if it isn't there already. Never
+ *                     waits for the disk.
+ *     buf_readdirect - read the N blocks of DEV from BLOCK into UIO,
+ *                     which must be in kernel space, as uiomove would.
+ *                     Blocks that are cached are copied from the cache;
+ *                     the others go from the device straight to UIO,
+ *                     and aren't cached. For page-sized reads into
+ *                     kernel memory, which then skip the copies into
+ *                     and out of the cache.
+ *     buf_writedirect - write the N blocks of DEV from BLOCK out of UIO,
+ *                     which must be in kernel space. The same the other
+ *                     way round: blocks that are cached are changed in
+ *                     the cache, and go out with it; the others go
+ *                     straight to the device. For a journal, which is
+ *                     only ever read back at mount, and for file pages.
+ *     buf_flush     - write out every dirty buffer of DEV.
+ *     buf_purge     - forget everything cached for DEV (at unmount; the
+ *                     caller must have flushed first).
+ *
+ * Journaling filesystems hold the buffers a transaction changes, so
+ * that none of them goes to its place on disk before the transaction
+ * is committed to the journal:
+ *     buf_hold      - hold a buffer the caller has, before changing it.
+ *                     If it was dirty with changes from before (already
+ *                     committed, then) those are written out first.
+ *                     Held buffers are never written back or recycled.
+ *     buf_unhold    - let it go to disk like any other buffer again.
+ *     buf_isheld    - whether it is held.
+ */
+
+#define BUF_SIZE     512	/* bytes per block */
+#define BUF_MAX      256	/* buffers kept at most */
+
+struct buf;	/* Opaque. */
+struct device;
+struct uio;
+
+void buf_bootstrap(void);
+
+int buf_read(struct device *dev, uint32_t block, struct buf **ret);
+int buf_get(struct device *dev, uint32_t block, struct buf **ret);
+void *buf_data(struct buf *b);
+void buf_markdirty(struct buf *b);
+void buf_release(struct buf *b);
+void buf_readahead(struct device *dev, uint32_t block);
+int buf_readdirect(struct device *dev, uint32_t block, unsigned n,
+		   struct uio *uio);
+int buf_writedirect(struct device *dev, uint32_t block, unsigned n,
+		    struct uio *uio);
+
+int buf_hold(struct buf *b);
+void buf_unhold(struct buf *b);
+bool buf_isheld(struct buf *b);
+
+int buf_flush(struct device *dev);
+void buf_purge(struct device *dev);
+
+#endif /* _BUF_H_ */
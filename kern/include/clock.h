@@ -35,13 +35,22 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for scheduling.
+ * A CPU with nothing to run slows its timer down and gets only an
+ * occasional hardclock until it has work again.
+ *
+ * hardclock_setquantum() sets how many hardclocks a thread may run
+ * before it is preempted (1 to HARDCLOCK_QUANTUM_MAX; EINVAL
+ * otherwise). hardclock_getquantum() returns the current setting.
  *
  * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timed operations. (This is a fairly simpleminded interface.) Finer
+ * timed operations use timeouts, below, which run at HZ resolution.
  *
- * gettime() may be used to fetch the current time of day.
+ * gettime() may be used to fetch the current time of day. cpu 0's
+ * hardclock also copies it into the time page, which user code reads
+ * (see <kern/timepage.h>) once timepage_start() has been called,
+ * after the clock is attached; timepage_paddr() says where it is.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -56,12 +65,20 @@
 #define HZ  100
 #endif
 
+/* preemption quantum, in hardclocks */
+#define HARDCLOCK_QUANTUM_DEFAULT  1
+#define HARDCLOCK_QUANTUM_MAX      HZ
+
 void hardclock_bootstrap(void);
+unsigned hardclock_getquantum(void);
+int hardclock_setquantum(unsigned ticks);
 
 void hardclock(void);
 void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
+void timepage_start(void);
+paddr_t timepage_paddr(void);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
@@ -73,5 +90,43 @@ void getinterval(time_t secs1, uint32_t nsecs,
  */
 void clocksleep(int seconds);
 
+/*
+ * Timeouts: call a function once some number of hardclocks from now.
+ *
+ * timeout_init sets up a timeout to call FUNC(ARG). timeout_add arms
+ * it to fire TICKS hardclocks from now (at least 1, at most
+ * TIMEOUT_MAXTICKS; it must not already be armed). timeout_cancel
+ * disarms it, returning true if that stopped it from firing; if the
+ * function is running at that moment it waits for it to finish, so
+ * once it returns the timeout may be freed. (So the function must not
+ * cancel its own timeout.)
+ *
+ * The function is called from cpu 0's timer interrupt with no locks
+ * held; it may take spinlocks and wake threads, but not sleep.
+ *
+ * ticks_from_timespec converts a duration to hardclocks, rounding up
+ * and clamping at TIMEOUT_MAXTICKS.
+ *
+ * clocksleep_ticks() is clocksleep() for TICKS hardclocks.
+ */
+struct timeout {
+	struct timeout *to_next;	/* Next in the same wheel slot */
+	struct timeout **to_prevp;	/* What points to us; NULL if idle */
+	unsigned to_expire;		/* Wheel tick to fire on */
+	void (*to_func)(void *);
+	void *to_arg;
+};
+
+#define TIMEOUT_MAXTICKS  0x7fffffff
+
+struct timespec;
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_add(struct timeout *to, unsigned ticks);
+bool timeout_cancel(struct timeout *to);
+unsigned ticks_from_timespec(const struct timespec *ts);
+
+void clocksleep_ticks(unsigned ticks);
+
 
 #endif /* _CLOCK_H_ */
@@ -59,6 +59,17 @@
  * The const qualifiers and types will help protect against mistakes
  * in this regard but are obviously not foolproof.
  *
+ * copyinv and copyoutv do the same as copyin and copyout for each of
+ * an array of N (kernel, user, length) ranges, but validate all of
+ * them first and set up the fault recovery just once. Nothing is
+ * guaranteed about which ranges were copied if they fail.
+ *
+ * copyinstrs copies the strings of a null-terminated user array of
+ * string pointers UARGV end to end into DEST, which holds LEN bytes.
+ * It returns the total bytes used (including each null) in GOT and the
+ * number of strings in COUNT. It fails with E2BIG if they don't fit,
+ * or EFAULT for a bad pointer anywhere.
+ *
  * These functions are machine-dependent; however, a common version
  * that can be used by a number of machine types is found in
  * vm/copyinout.c.
@@ -69,5 +80,16 @@ int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
 
+struct copyvec {
+	void *cv_kaddr;
+	userptr_t cv_uaddr;
+	size_t cv_len;
+};
+
+int copyinv(const struct copyvec *vec, unsigned n);
+int copyoutv(const struct copyvec *vec, unsigned n);
+int copyinstrs(const_userptr_t uargv, char *dest, size_t len, size_t *got,
+	       unsigned long *count);
+
 
 #endif /* _COPYINOUT_H_ */
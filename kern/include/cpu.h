@@ -34,8 +34,18 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <syscall.h>     /* for SYSCALL_NCALLS */
+#include <kern/cputime.h> /* for CPUTIME_NSTATES */
+#include <uw-vmstats.h>   /* for VMSTAT_COUNT */
 
 
+/*
+ * Size of the per-cpu free page cache, and how many pages are moved
+ * between it and the coremap at a time.
+ */
+#define CPU_PAGECACHE_MAX	16
+#define CPU_PAGECACHE_BATCH	8
+
 /*
  * Per-cpu structure
  *
@@ -46,6 +56,10 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+struct klogbuf;
+struct tracebuf;
+struct softint;
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -53,19 +67,138 @@ struct cpu {
 	struct cpu *c_self;		/* Canonical address of this struct */
 	unsigned c_number;		/* This cpu's cpu number */
 	unsigned c_hardware_number;	/* Hardware-defined cpu number */
+	void *c_percpu;			/* Per-cpu variables (percpu.h) */
 
 	/*
 	 * Accessed only by this cpu.
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct thread *c_migrating;	/* Switched away from, to move off */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	bool c_tickless;		/* Timer slowed down while idle */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Cycle clock (see kclock.h): cycles counted before the last
+	 * reset of the hardware count, the count it resets at, and
+	 * nanoseconds per cycle << KCLOCK_SHIFT.
+	 */
+	uint64_t c_cyclebase;
+	uint32_t c_cyclecompare;
+	uint32_t c_kclock_mult;
+
+	/*
+	 * Written only by this cpu; read by the rcu thread. Bumped at
+	 * each quiescent state (see rcu.h).
+	 */
+	volatile unsigned c_rcu_qs;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Magazine of free physical pages kept by the VM system so the
+	 * common single-page alloc/free doesn't take the coremap lock.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_pagecache_count;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Queue nodes for the SPINLOCK_MCS locks this cpu holds or is
+	 * waiting for, and which of them are in use (one bit each).
+	 * Other cpus do write into a node while it's queued.
+	 */
+	struct spinlock_mcsnode c_mcsnodes[SPINLOCK_MCS_NODES];
+	unsigned c_mcsused;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Pending software interrupts, oldest first (see softint.h).
+	 */
+	struct softint *c_softints;
+	struct softint **c_softinttail;
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Exited threads kept with their stacks and name buffers, so
+	 * thread_fork can usually reuse one instead of allocating.
+	 */
+	struct threadlist c_threadpool;
+
+	/*
+	 * TLB slot bookkeeping for the VM system: which slots hold a
+	 * valid entry (one bit per slot), and the round-robin victim
+	 * hand used once they all do; and the last page a fault here
+	 * loaded, to spot sequential scans. Only touched with
+	 * interrupts off.
+	 */
+	uint64_t c_tlb_used;
+	unsigned c_tlb_hand;
+	vaddr_t c_tlb_lastfault;
+
+	/*
+	 * ASID this cpu's TLB is currently matching against, and the
+	 * ASID generation its TLB contents belong to. c_curas is the
+	 * address space that ASID belongs to, or NULL; TLB shootdowns
+	 * for other address spaces don't need to interrupt this cpu.
+	 */
+	unsigned c_asid;
+	unsigned c_asid_generation;
+	struct addrspace *c_curas;
+
+	/*
+	 * System call counts and times, indexed by call number. Only
+	 * updated with interrupts off; read by syscall_printstats().
+	 */
+	struct syscall_stat c_syscall_stats[SYSCALL_NCALLS];
+
+	/*
+	 * Time accounting: what this cpu is doing now (CPUTIME_*), when
+	 * it started, and the total time spent in each state so far.
+	 * Only updated by this cpu with interrupts off. See cputime.c.
+	 */
+	unsigned c_timestate;
+	uint64_t c_timestamp;
+	uint64_t c_times[CPUTIME_NSTATES];
+
+	/*
+	 * VM statistics, indexed by VMSTAT_*. Only updated by this cpu,
+	 * with interrupts off, under the sequence count c_vmstatseq (see
+	 * seqlock.h) so vmstats_get can copy them out whole.
+	 */
+	volatile uint32_t c_vmstatseq;
+	unsigned c_vmstats[VMSTAT_COUNT];
+
+	/*
+	 * Log ring for DEBUG() output. Written only by this cpu, with
+	 * interrupts off; emptied by the klog job. See kprintf.c.
+	 */
+	struct klogbuf *c_klog;
+
+	/*
+	 * Event trace ring. Written only by this cpu, with interrupts
+	 * off. See trace.c.
+	 */
+	struct tracebuf *c_trace;
+
+	/*
+	 * Decayed count of threads running and ready here (see
+	 * thread_loadtick). Written only by this cpu, with interrupts
+	 * off; other cpus read it without a lock to pick whom to balance
+	 * with.
+	 */
+	volatile unsigned c_loadavg;
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
+	uint32_t c_stealseed;		/* Picks work stealing victims */
+	uint64_t c_minvruntime;		/* Least virtual runtime run lately */
+	unsigned c_rtticks;		/* Real-time ticks this period */
+	bool c_rtthrottled;		/* Real-time threads used them up */
+	volatile bool c_resched;	/* Something ready outranks curthread */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
@@ -82,10 +215,16 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Shootdowns queued here are numbered in c_shootdown_queued;
+	 * c_shootdown_done is the number of the last one carried out,
+	 * so a sender can wait for its own without a semaphore.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_queued;
+	volatile unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -105,6 +244,13 @@ struct cpu {
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+
+/*
+ * For code that reports on every cpu: the number of cpus, and cpu
+ * number NUM (0 to cpu_count()-1).
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -139,6 +285,21 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+/*
+ * Time accounting (see <kern/cputime.h> for the states).
+ *
+ * cpu_timeswitch puts the current cpu in STATE, charging the time
+ * since the last switch to the state it was in, and returns that old
+ * state so the caller can put it back afterwards. cpu_gettimes fills in
+ * the totals for cpu number NUM, or returns EINVAL if there's no such
+ * cpu; cpu_printtimes prints them all. Nothing is counted before
+ * cputime_start, which is called once the clock is attached.
+ */
+unsigned cpu_timeswitch(unsigned state);
+int cpu_gettimes(unsigned num, struct cputimes *ct);
+void cpu_printtimes(void);
+void cputime_start(void);
+
 /*
  * Interprocessor interrupts.
  *
@@ -151,7 +312,12 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries N mappings of TLB
+ * shootdown data at once (N of 0 means the whole TLB). Shootdowns to a
+ * CPU that hasn't taken the last one yet are added to the same IPI.
+ * It returns a ticket, which ipi_tlbshootdown_wait waits for the
+ * target to have handled; that spins, so it must be called with
+ * interrupts on, or two CPUs shooting at each other would deadlock.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -162,10 +328,13 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_RESCHED		4	/* Preempt the current thread */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mappings, unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
@@ -34,24 +34,88 @@
  * Devices.
  */
 
+#include <spinlock.h>
 
 struct uio;  /* in <uio.h> */
+struct pollwaiter;  /* in <poll.h> */
+
+/*
+ * I/O statistics for a disk.
+ *
+ * The driver calls iostat_start as a request comes in and iostat_done
+ * with the same start time when it's finished, however it went; the
+ * time between includes waiting behind other requests for the device.
+ * Sizes are counted in bytes, since emu's requests aren't in sectors;
+ * the stats file gives them in IOSTAT_SECTSIZE units whatever the
+ * device's own block size, so one disk compares with another. The
+ * depth is the number of requests between the two calls; the device
+ * is busy whenever that isn't zero. Dividing the busy time by the
+ * requests done gives the average service time; dividing each
+ * request's whole time, added up, by the same gives the average wait,
+ * and by the time elapsed the average depth.
+ *
+ * Each disk's is registered under its name once, with iostat_register
+ * (they are never taken out again). iostat_get copies out the counts
+ * for the NUMth one, with the busy time brought up to date, and the
+ * time they cover; ENOENT if there is no such one. iostat_report
+ * prints them all and iostat_reset zeroes them.
+ *
+ * Times are from kclock_ns, so I/O before its clock starts is counted
+ * but not timed.
+ */
+#define IOSTAT_SECTSIZE  512
+#define IOSTAT_NAMELEN   15
+
+struct iocounts {
+	unsigned ic_reads;		/* requests */
+	unsigned ic_writes;
+	uint64_t ic_rbytes;		/* moved */
+	uint64_t ic_wbytes;
+	unsigned ic_errors;		/* requests that failed */
+	unsigned ic_depth;		/* requests now in progress */
+	unsigned ic_maxdepth;
+	uint64_t ic_busyns;		/* time with ic_depth > 0 */
+	uint64_t ic_totalns;		/* requests' times added up */
+};
+
+struct iostat {
+	struct spinlock is_lock;
+	char is_name[IOSTAT_NAMELEN+1];
+	struct iocounts is_counts;
+	uint64_t is_busysince;		/* when ic_depth last left 0 */
+	uint64_t is_since;		/* when counting began */
+	struct iostat *is_next;		/* registered list */
+};
+
+void iostat_register(struct iostat *is, const char *name);
+uint64_t iostat_start(struct iostat *is);
+void iostat_done(struct iostat *is, uint64_t start, bool write,
+		 size_t bytes, int result);
+int iostat_get(unsigned num, const char **name, struct iocounts *ret,
+	       uint64_t *elapsed);
+void iostat_report(void);
+void iostat_reset(void);
 
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_poll is as vop_poll; NULL means the device is always ready.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_poll)(struct device *, int events, struct pollwaiter *pw,
+		      int *revents);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
 
 	dev_t d_devnumber;	/* serial number for this device */
 
+	struct iostat d_iostat;	/* kept by disk drivers that do */
+
 	void *d_data;		/* device-specific data */
 };
 
@@ -61,6 +125,15 @@ struct vnode *dev_create_vnode(struct device *dev);
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
+void devwait_create(void);
+
+/*
+ * Create a striping (RAID-0) device, "stripeN:", over the NMEMBERS
+ * disks named in MEMBERS (e.g. "lhd1"), with UNIT blocks per stripe
+ * unit. See devstripe.c.
+ */
+#define DEVSTRIPE_MAXMEMBERS  8
+int devstripe_create(unsigned nmembers, char **members, unsigned unit);
 
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
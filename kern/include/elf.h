@@ -37,6 +37,7 @@
  * Restrictions:
  *     32-bit only
  *     No support for .o files or linker structures
+ *     Section headers only as far as finding the symbol table
  *     Does not define all the random symbols a standard elf header would.
  */
 
@@ -55,13 +56,13 @@ typedef struct {
 	uint32_t	e_version;             /* ELF version */
 	uint32_t	e_entry;           /* address of program entry point */
 	uint32_t	e_phoff;           /* location in file of phdrs */
-	uint32_t	e_shoff;           /* ignore */
+	uint32_t	e_shoff;           /* location in file of shdrs */
 	uint32_t	e_flags;	   /* ignore */
 	uint16_t	e_ehsize;          /* actual size of file header */
 	uint16_t	e_phentsize;       /* actual size of phdr */
 	uint16_t	e_phnum;           /* number of phdrs */
-	uint16_t	e_shentsize;       /* ignore */
-	uint16_t	e_shnum;           /* ignore */
+	uint16_t	e_shentsize;       /* actual size of shdr */
+	uint16_t	e_shnum;           /* number of shdrs */
 	uint16_t	e_shstrndx;        /* ignore */
 } Elf32_Ehdr;
 
@@ -193,8 +194,51 @@ typedef struct {
 #define	PF_X		0x1	/* Segment is executable */
 
 
+/*
+ * Section header. Only needed to find the symbol table, which the
+ * kernel profiler reads from the kernel image.
+ */
+typedef struct {
+	uint32_t	sh_name;     /* Name (index into section name table) */
+	uint32_t	sh_type;     /* Type of section */
+	uint32_t	sh_flags;    /* Flags */
+	uint32_t	sh_addr;     /* Address in memory, if loaded */
+	uint32_t	sh_offset;   /* Location of data within file */
+	uint32_t	sh_size;     /* Size of data within file */
+	uint32_t	sh_link;     /* For a symbol table, its string table */
+	uint32_t	sh_info;     /* Ignore */
+	uint32_t	sh_addralign;/* Ignore */
+	uint32_t	sh_entsize;  /* Size of each entry, for tables */
+} Elf32_Shdr;
+
+/* values for sh_type */
+#define	SHT_NULL	0		/* Section header unused */
+#define	SHT_PROGBITS	1		/* Program data */
+#define	SHT_SYMTAB	2		/* Symbol table */
+#define	SHT_STRTAB	3		/* String table */
+
+/*
+ * Symbol table entry.
+ */
+typedef struct {
+	uint32_t	st_name;     /* Name (index into string table) */
+	uint32_t	st_value;    /* Value (for a function, its address) */
+	uint32_t	st_size;     /* Size of the object */
+	unsigned char	st_info;     /* Type and binding */
+	unsigned char	st_other;    /* Ignore */
+	uint16_t	st_shndx;    /* Section it's in */
+} Elf32_Sym;
+
+/* type part of st_info */
+#define	ELF32_ST_TYPE(info)	((info) & 0xf)
+#define	STT_NOTYPE	0		/* Unspecified */
+#define	STT_OBJECT	1		/* Data */
+#define	STT_FUNC	2		/* Function */
+
 typedef Elf32_Ehdr Elf_Ehdr;
 typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym Elf_Sym;
 
 
 #endif /* _ELF_H_ */
@@ -36,6 +36,36 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
+#include <workqueue.h>
+
+/*
+ * Each file vnode caches its size and up to EMUFS_NCBLOCKS blocks of
+ * its data, EMUFS_CBSIZE bytes each, so repeated stats and reads
+ * don't go back to the device. Writes and truncates through the vnode
+ * throw the cache away; changes made on the host behind our back are
+ * not noticed.
+ */
+#define EMUFS_CBSIZE    4096
+#define EMUFS_NCBLOCKS  4
+
+/*
+ * Writes are held back in a per-vnode buffer of up to EMU_MAXIO bytes,
+ * so a run of small sequential writes goes to the device as one. The
+ * buffer goes out when a write doesn't follow on from it or doesn't
+ * fit, when it fills, before anything that reads the file back (read,
+ * stat, truncate), at close, fsync and sync, and at the latest
+ * EMUFS_WB_SECS seconds after it was started. An error then is
+ * returned by whatever flushed it, and the data is dropped.
+ */
+#define EMUFS_WB_SECS   1
+
+struct emufs_cblock {
+	off_t cb_offset;		/* file offset, or -1 if unused */
+	uint32_t cb_len;		/* bytes valid; short at EOF */
+	unsigned cb_stamp;		/* when last used, for LRU */
+	void *cb_data;			/* EMUFS_CBSIZE bytes, or NULL */
+};
 
 /*
  * Our structures
@@ -45,6 +75,18 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+
+	/* Cache; protected by ev_lock */
+	struct lock *ev_lock;
+	bool ev_sizevalid;
+	off_t ev_size;
+	unsigned ev_clock;
+	struct emufs_cblock ev_cache[EMUFS_NCBLOCKS];
+
+	/* Write-behind buffer; also protected by ev_lock */
+	void *ev_wbuf;			/* EMU_MAXIO bytes, or NULL */
+	off_t ev_wboff;			/* file offset of ev_wbuf */
+	uint32_t ev_wblen;		/* bytes waiting; 0 if none */
 };
 
 struct emufs_fs {
@@ -52,6 +94,12 @@ struct emufs_fs {
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+	struct lock *ef_vnlock;		/* protects ef_vnodes */
+
+	/* Flushes write-behind buffers once EMUFS_WB_SECS are up */
+	struct work ef_wbwork;
+	struct spinlock ef_wbspin;	/* protects ef_wbarmed */
+	bool ef_wbarmed;		/* ef_wbwork is on its way */
 };
 
 
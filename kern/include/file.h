@@ -0,0 +1,74 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * An openfile is what open() creates: a vnode, the access mode and the
+ * current offset. File descriptors point at openfiles, and several can
+ * share one (after dup2, or in a parent and child after fork), in which
+ * case they also share the offset. The openfile is closed when the last
+ * descriptor pointing at it goes away.
+ *
+ * The descriptor table itself is a fixed OPEN_MAX array in struct proc,
+ * indexed directly by fd, under the process's p_fdlock: with threadfork
+ * several threads may open, close and dup2 in it at once. The lock is
+ * only held to look at or change the table, never across I/O, so
+ * fd_get hands back a reference of its own; the openfile stays valid
+ * until the caller drops it with openfile_decref, even if another
+ * thread closes the descriptor meanwhile.
+ */
+
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+struct proc;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_flags;				/* open() flags, less O_CREAT/O_EXCL/O_TRUNC */
+	off_t of_offset;			/* protected by of_lock */
+	struct lock *of_lock;		/* held across each read, write and seek */
+	unsigned of_refcount;		/* descriptors pointing here */
+	struct spinlock of_reflock;	/* protects of_refcount */
+};
+
+/**
+	Open PATH (which may be destroyed) and make an openfile for it with a
+	single reference.
+*/
+int openfile_open(const char *path, int flags, mode_t mode, struct openfile **ret);
+
+/**
+	Make an openfile for VN, which is already open; on success the
+	openfile takes over that open reference.
+*/
+int openfile_create(struct vnode *vn, int flags, struct openfile **ret);
+
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);	/* closes on the last one */
+
+/**
+	Descriptor table operations on process P.
+
+	fd_get     - look up FD and take a reference to its openfile, which
+	             the caller must openfile_decref; EBADF if it isn't open.
+	fd_alloc   - put OF (whose reference the table takes over) in the lowest
+	             free descriptor; EMFILE if there are none.
+	fd_dup2    - make NEWFD point at OLDFD's openfile too, closing what
+	             NEWFD had; EBADF if OLDFD isn't open or NEWFD is out of
+	             range.
+	fd_close   - close FD; EBADF if it isn't open.
+	fd_copyall - give TO a reference to each of FROM's open files, at the
+	             same descriptors (for fork).
+	fd_closeall - close everything (at exit).
+*/
+int fd_get(struct proc *p, int fd, struct openfile **ret);
+int fd_alloc(struct proc *p, struct openfile *of, int *fd);
+int fd_dup2(struct proc *p, int oldfd, int newfd);
+int fd_close(struct proc *p, int fd);
+void fd_copyall(struct proc *from, struct proc *to);
+void fd_closeall(struct proc *p);
+
+#endif /* _FILE_H_ */
@@ -0,0 +1,88 @@
+#ifndef _FILECACHE_H_
+#define _FILECACHE_H_
+
+/*
+ * File page cache.
+ *
+ * File data is cached a whole page at a time, and the same pages serve
+ * read and write (which copy to and from them) and mmap (which maps
+ * them), so a page of a file is in memory only once however it is got
+ * at. A file system keeps one struct fcobj for each file it caches
+ * this way; its pages are found by page number in a radix tree. The
+ * buffer cache is then left with the file system's own metadata.
+ *
+ * The file system does the I/O and the locking of each file; this
+ * only keeps the pages. A page handed out by filecache_get is pinned,
+ * so it stays put until filecache_release, and several threads may
+ * have the same one. Unpinned pages are kept in least-recently-used
+ * order, and when memory runs low the clean ones are given back from
+ * the old end. Dirty pages are only written by the file system, so
+ * they stay until it does (see filecache_nextdirty).
+ *
+ * The frames come from the VM system (vm_getpage), the same ones user
+ * pages come from, so memory divides itself between file data and
+ * anonymous memory by what is being used.
+ *
+ * Functions:
+ *     filecache_bootstrap - set up. Called once at boot.
+ *     filecache_create    - a new, empty cache for a file. NULL if out
+ *                           of memory.
+ *     filecache_destroy   - free one, and every page in it, dirty or
+ *                           not. None may be pinned.
+ *     filecache_get       - pin page INDEX, adding it if it isn't there.
+ *                           If *FILL comes back true, the page's
+ *                           contents are undefined and it's the
+ *                           caller's to fill: anyone else asking for
+ *                           it waits until the caller calls
+ *                           filecache_filldone, with OK false if that
+ *                           didn't work (then the next one to ask
+ *                           tries). ENOMEM if there's no frame for it.
+ *     filecache_data      - a page's contents, in kernel memory.
+ *     filecache_paddr     - the frame they are in, for mapping.
+ *     filecache_index     - its page number.
+ *     filecache_markdirty - record that the caller changed the page.
+ *     filecache_mapwrite  - record that it is mapped writable, so it
+ *                           may change at any time: it stays dirty,
+ *                           even when written back, until it is next
+ *                           unpinned by everyone.
+ *     filecache_release   - unpin a page.
+ *     filecache_nextdirty - pin the first dirty page from page START
+ *                           on, or return NULL if there is none. Write
+ *                           it out, call filecache_cleaned if that
+ *                           worked, and release it.
+ *     filecache_ndirty    - how many pages are dirty.
+ *     filecache_dontneed  - the pages from FIRST up to LAST won't be
+ *                           wanted again soon: move the unpinned ones
+ *                           to the old end, to be given back first.
+ *     filecache_truncate  - forget what lies from byte LEN on: pages
+ *                           wholly past it are dropped (or, if pinned,
+ *                           zeroed and made clean) and the rest of the
+ *                           page LEN is in is zeroed and made dirty.
+ */
+
+struct fcobj;	/* Opaque. */
+struct fcpage;	/* Opaque. */
+
+void filecache_bootstrap(void);
+
+struct fcobj *filecache_create(void);
+void filecache_destroy(struct fcobj *fo);
+
+int filecache_get(struct fcobj *fo, uint32_t index, bool *fill,
+		  struct fcpage **ret);
+void filecache_filldone(struct fcpage *pp, bool ok);
+void *filecache_data(struct fcpage *pp);
+paddr_t filecache_paddr(struct fcpage *pp);
+uint32_t filecache_index(struct fcpage *pp);
+void filecache_markdirty(struct fcpage *pp);
+void filecache_mapwrite(struct fcpage *pp);
+void filecache_release(struct fcpage *pp);
+
+struct fcpage *filecache_nextdirty(struct fcobj *fo, uint32_t start);
+void filecache_cleaned(struct fcpage *pp);
+unsigned filecache_ndirty(struct fcobj *fo);
+void filecache_dontneed(struct fcobj *fo, uint32_t first, uint32_t last);
+
+void filecache_truncate(struct fcobj *fo, off_t len);
+
+#endif /* _FILECACHE_H_ */
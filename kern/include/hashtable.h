@@ -0,0 +1,165 @@
+#ifndef _HASHTABLE_H_
+#define _HASHTABLE_H_
+
+/*
+ * Intrusive chained hash table.
+ *
+ * Objects in a table embed a struct hashlink, which holds the chain
+ * pointers, the object's hash value, and a pointer back to the object
+ * (as with threadlistnode). The number of chains is a power of two.
+ * Adding doubles it when there are more than two entries per chain on
+ * average, if that memory can be had; if not, the chains just get
+ * longer. Nothing else allocates, lookups included.
+ *
+ * The table does no locking of its own.
+ *
+ * Base operations:
+ *     hashtable_init     - set up with at least SIZE chains. Returns
+ *                          ENOMEM on failure.
+ *     hashtable_cleanup  - free the chains. The table must be empty.
+ *     hashtable_count    - return the number of entries.
+ *     hashtable_add      - add LINK, for object SELF with hash value
+ *                          HASH. May call kmalloc.
+ *     hashtable_remove   - take LINK out.
+ *     hashtable_first    - return the first entry with hash value HASH,
+ *                          or NULL; hashtable_nexthash then returns the
+ *                          next one after LINK. Different keys can
+ *                          share a hash value, so the caller still has
+ *                          to compare keys.
+ *     hashtable_next     - return the entry after LINK in no particular
+ *                          order (the first one if LINK is NULL), or
+ *                          NULL after the last. The table must not be
+ *                          changed during such a walk.
+ *
+ * Hash functions:
+ *     hash_uint32        - for integer keys, with the bits well mixed
+ *                          (keys are often sequential).
+ *     hash_string        - for NUL-terminated strings.
+ */
+
+struct hashlink {
+	struct hashlink *hl_next;
+	struct hashlink **hl_prevp;
+	void *hl_self;			/* the object this link is in */
+	uint32_t hl_hash;
+};
+
+struct hashtable {
+	struct hashlink **ht_chains;
+	unsigned ht_size;		/* number of chains */
+	unsigned ht_count;		/* number of entries */
+};
+
+int hashtable_init(struct hashtable *ht, unsigned size);
+void hashtable_cleanup(struct hashtable *ht);
+unsigned hashtable_count(const struct hashtable *ht);
+void hashtable_add(struct hashtable *ht, struct hashlink *link, void *self,
+		   uint32_t hash);
+void hashtable_remove(struct hashtable *ht, struct hashlink *link);
+struct hashlink *hashtable_first(const struct hashtable *ht, uint32_t hash);
+struct hashlink *hashtable_nexthash(const struct hashlink *link);
+struct hashlink *hashtable_next(const struct hashtable *ht,
+				const struct hashlink *link);
+
+uint32_t hash_uint32(uint32_t key);
+uint32_t hash_string(const char *key);
+
+/*
+ * Typed tables.
+ *
+ * DECLHASH(HT, T, K) declares "struct HT", a table of "T" objects
+ * looked up by keys of type "K", and the operations on it.
+ *
+ * DEFHASH(HT, T, K, LINK, HASHFN, MATCHFN, INLINE) defines the
+ * operations. LINK is the struct hashlink member of T. HASHFN(key)
+ * takes a const K * and returns its hash value; MATCHFN(obj, key)
+ * takes a const T * and a const K * and returns true if the object has
+ * that key. INLINE is used as for DEFARRAY in array.h.
+ *
+ * Example, for foos looked up by number in foo.h:
+ *
+ * DECLHASH(foohash, struct foo, uint32_t);
+ * #define FOO_HASH(k) hash_uint32(*(k))
+ * #define FOO_MATCH(f, k) ((f)->f_num == *(k))
+ * DEFHASH(foohash, struct foo, uint32_t, f_link, FOO_HASH, FOO_MATCH,
+ *         FOOINLINE);
+ *
+ * The operations are:
+ *     HT_init(t, size)   - as hashtable_init.
+ *     HT_cleanup(t)      - as hashtable_cleanup.
+ *     HT_count(t)        - as hashtable_count.
+ *     HT_add(t, obj, k)  - add OBJ, whose key is K.
+ *     HT_remove(t, obj)  - take OBJ out.
+ *     HT_lookup(t, k)    - return an object with key K, or NULL.
+ *     HT_next(t, obj)    - as hashtable_next, by object.
+ */
+
+#define DECLHASH(HT, T, K) \
+	struct HT {						\
+		struct hashtable ht;				\
+	};							\
+								\
+	int HT##_init(struct HT *t, unsigned size);		\
+	void HT##_cleanup(struct HT *t);			\
+	unsigned HT##_count(const struct HT *t);		\
+	void HT##_add(struct HT *t, T *obj, const K *key);	\
+	void HT##_remove(struct HT *t, T *obj);			\
+	T *HT##_lookup(const struct HT *t, const K *key);	\
+	T *HT##_next(const struct HT *t, T *obj)
+
+#define DEFHASH(HT, T, K, LINK, HASHFN, MATCHFN, INLINE) \
+	INLINE int						\
+	HT##_init(struct HT *t, unsigned size)			\
+	{							\
+		return hashtable_init(&t->ht, size);		\
+	}							\
+								\
+	INLINE void						\
+	HT##_cleanup(struct HT *t)				\
+	{							\
+		hashtable_cleanup(&t->ht);			\
+	}							\
+								\
+	INLINE unsigned						\
+	HT##_count(const struct HT *t)				\
+	{							\
+		return hashtable_count(&t->ht);			\
+	}							\
+								\
+	INLINE void						\
+	HT##_add(struct HT *t, T *obj, const K *key)		\
+	{							\
+		hashtable_add(&t->ht, &obj->LINK, obj, HASHFN(key)); \
+	}							\
+								\
+	INLINE void						\
+	HT##_remove(struct HT *t, T *obj)			\
+	{							\
+		hashtable_remove(&t->ht, &obj->LINK);		\
+	}							\
+								\
+	INLINE T *						\
+	HT##_lookup(const struct HT *t, const K *key)		\
+	{							\
+		struct hashlink *hl;				\
+								\
+		hl = hashtable_first(&t->ht, HASHFN(key));	\
+		while (hl != NULL) {				\
+			if (MATCHFN((const T *)hl->hl_self, key)) { \
+				return hl->hl_self;		\
+			}					\
+			hl = hashtable_nexthash(hl);		\
+		}						\
+		return NULL;					\
+	}							\
+								\
+	INLINE T *						\
+	HT##_next(const struct HT *t, T *obj)			\
+	{							\
+		struct hashlink *hl;				\
+								\
+		hl = hashtable_next(&t->ht, obj == NULL ? NULL : &obj->LINK); \
+		return hl == NULL ? NULL : hl->hl_self;		\
+	}
+
+#endif /* _HASHTABLE_H_ */
@@ -0,0 +1,26 @@
+#ifndef _IORING_H_
+#define _IORING_H_
+
+/*
+ * Kernel side of the submission/completion rings (see <kern/ioring.h>).
+ *
+ * A process has at most one ring, set up by ioring_setup and kept
+ * until it exits or execs. Reads, writes and fsyncs go through kernel
+ * buffers and are run by the "ioring" work queue's threads, so data
+ * is copied in when an entry is taken and out when its completion is
+ * posted, both in the process's own context.
+ *
+ * Functions:
+ *     ioring_bootstrap - create the work queue.
+ *     ioring_destroy   - wait for P's operations in flight and throw
+ *                        its ring away (at exit and exec).
+ */
+
+#define IORING_NTHREADS  8
+
+struct proc;
+
+void ioring_bootstrap(void);
+void ioring_destroy(struct proc *p);
+
+#endif /* _IORING_H_ */
@@ -0,0 +1,91 @@
+#ifndef _KCLOCK_H_
+#define _KCLOCK_H_
+
+/*
+ * Cheap timestamps from the cpu cycle counter, for instrumentation
+ * that can't afford gettime()'s trip to the rtclock on every lock or
+ * fault.
+ *
+ * The hardware counter is only 32 bits and is reset by the timer, so
+ * each cpu keeps the cycles counted before the last reset in
+ * c_cyclebase and adds the live count to it. When its timer starts,
+ * each cpu measures its own clock rate against the rtclock; the later
+ * ones also move their base so their count lines up with cpu 0's, so
+ * timestamps from different cpus can be compared to within the
+ * calibration error.
+ *
+ * Functions:
+ *     kclock_cycles - cycles since cpu 0's timer started, counted on
+ *                     this cpu. Never goes backwards on one cpu.
+ *     kclock_tons   - convert a number of cycles to nanoseconds at
+ *                     this cpu's measured rate (0 before kclock_start).
+ *     kclock_ns     - kclock_tons(kclock_cycles()).
+ *     kclock_start  - calibrate the calling cpu. Called from the timer
+ *                     setup with interrupts off, once the rtclock is
+ *                     attached.
+ */
+
+#include <cdefs.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <machine/kclock.h>
+
+#ifndef KCLOCK_INLINE
+#define KCLOCK_INLINE INLINE
+#endif
+
+/* Fixed-point shift of c_kclock_mult, nanoseconds per cycle */
+#define KCLOCK_SHIFT  24
+
+uint64_t kclock_cycles(void);
+uint64_t kclock_tons(uint64_t cycles);
+uint64_t kclock_ns(void);
+void kclock_start(void);
+
+KCLOCK_INLINE
+uint64_t
+kclock_cycles(void)
+{
+	uint64_t base;
+	uint32_t count;
+	bool pending;
+	int spl;
+
+	spl = splhigh();
+	/*
+	 * If the count reached c0_compare and wrapped but the timer
+	 * interrupt hasn't been taken yet, the base is one period
+	 * behind. Check on both sides of the read so the count and the
+	 * pending bit agree.
+	 */
+	do {
+		pending = kclock_timerpending();
+		count = kclock_readcount();
+	} while (pending != kclock_timerpending());
+	base = curcpu->c_cyclebase;
+	if (pending) {
+		base += curcpu->c_cyclecompare;
+	}
+	splx(spl);
+	return base + count;
+}
+
+KCLOCK_INLINE
+uint64_t
+kclock_tons(uint64_t cycles)
+{
+	uint32_t mult = curcpu->c_kclock_mult;
+
+	return (cycles >> KCLOCK_SHIFT) * mult +
+		(((cycles & ((1U << KCLOCK_SHIFT) - 1)) * mult) >> KCLOCK_SHIFT);
+}
+
+KCLOCK_INLINE
+uint64_t
+kclock_ns(void)
+{
+	return kclock_tons(kclock_cycles());
+}
+
+#endif /* _KCLOCK_H_ */
@@ -0,0 +1,21 @@
+#ifndef _KERN_CPUTIME_H_
+#define _KERN_CPUTIME_H_
+
+/*
+ * Per-cpu time accounting, as returned by cputimes(). Each cpu's time
+ * is split by what it was doing: running user code, running in the
+ * kernel for a thread, handling interrupts, or idling with nothing to
+ * run. Times are in nanoseconds since the clock was attached at boot.
+ */
+
+#define CPUTIME_USER	0
+#define CPUTIME_KERNEL	1
+#define CPUTIME_INTR	2
+#define CPUTIME_IDLE	3
+#define CPUTIME_NSTATES	4
+
+struct cputimes {
+	__u64 ct_nsecs[CPUTIME_NSTATES];	/* Indexed by CPUTIME_* */
+};
+
+#endif /* _KERN_CPUTIME_H_ */
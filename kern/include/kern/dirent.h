@@ -0,0 +1,20 @@
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+/*
+ * Directory entries as getdirentries() packs them into the caller's
+ * buffer, one after another. Each holds a name and its terminating
+ * NUL, and is padded so the next one starts 4-byte aligned; d_reclen
+ * is the distance to the next one.
+ */
+
+struct dirent {
+	__u16 d_reclen;		/* length of this record */
+	__u16 d_namlen;		/* length of d_name, not counting the NUL */
+	char d_name[];		/* the name, NUL-terminated */
+};
+
+/* Record length needed for a name NAMLEN characters long */
+#define DIRENT_RECLEN(namlen)	((4 + (namlen) + 1 + 3) & ~3)
+
+#endif /* _KERN_DIRENT_H_ */
@@ -63,6 +63,19 @@
 #define LOCK_UN         3       /* release the lock */
 #define LOCK_NB         4       /* flag: don't block */
 
+/* hints for posix_fadvise() */
+#define POSIX_FADV_NORMAL      0	/* no particular pattern */
+#define POSIX_FADV_RANDOM      1	/* read in no order; don't read ahead */
+#define POSIX_FADV_SEQUENTIAL  2	/* read from start to end */
+#define POSIX_FADV_WILLNEED    3	/* will be read soon; read it in now */
+#define POSIX_FADV_DONTNEED    4	/* won't be read again soon */
+#define POSIX_FADV_NOREUSE     5	/* will be read once */
+
+/* flags for sync_file_range() */
+#define SYNC_FILE_RANGE_WAIT_BEFORE 1	/* wait for writeback already started */
+#define SYNC_FILE_RANGE_WRITE       2	/* start writing the range back */
+#define SYNC_FILE_RANGE_WAIT_AFTER  4	/* then wait for that too */
+
 /*
  * Mostly pretty useless
  */
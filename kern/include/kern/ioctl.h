@@ -34,6 +34,11 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * SFS: defragment the open file, moving its blocks into one run on
+ * disk. The argument is a uint32_t * (or NULL) that gets the number
+ * of blocks moved.
+ */
+#define SFS_IOC_DEFRAG  1
 
 #endif /* _KERN_IOCTL_H_*/
@@ -0,0 +1,19 @@
+#ifndef _KERN_IOPRIO_H_
+#define _KERN_IOPRIO_H_
+
+/*
+ * I/O priority classes, for ioprio_set(). A thread's disk requests
+ * carry its class, and the disk serves IOPRIO_RT requests first, then
+ * IOPRIO_BE (best effort, the default), then IOPRIO_IDLE ones, which
+ * only go when nothing else is waiting. Within a class requests go in
+ * elevator order. Past a point a passed-over request goes anyway, so
+ * the lower classes are slowed down rather than stopped. Threads get
+ * the class of the thread that made them, and a process its parent's.
+ */
+
+#define IOPRIO_RT	0
+#define IOPRIO_BE	1
+#define IOPRIO_IDLE	2
+#define IOPRIO_NCLASSES	3
+
+#endif /* _KERN_IOPRIO_H_ */
@@ -0,0 +1,97 @@
+#ifndef _KERN_IORING_H_
+#define _KERN_IORING_H_
+
+/*
+ * Submission and completion rings, for doing a batch of file
+ * operations in one system call and overlapping them with the
+ * process's own work.
+ *
+ * The process sets up a struct ioring and two arrays of ir_entries
+ * slots in its own memory and hands the struct to ioring_setup().
+ * ir_entries must be a power of two, at most IORING_MAXENTRIES. The
+ * four indexes count up forever; slot i of an array is entry
+ * i & (ir_entries - 1).
+ *
+ * To queue operations, fill in sq[ir_sqtail] onwards and move
+ * ir_sqtail past them. ioring_enter(n, min) then takes up to N of
+ * them (moving ir_sqhead), starts them, posts what has finished into
+ * cq[ir_cqtail] onwards (moving ir_cqtail), and waits until at least
+ * MIN completions are there to be taken, if that many could ever
+ * come. It returns how many entries it took. The process takes
+ * completions by moving ir_cqhead past them.
+ *
+ * The kernel only looks at the rings inside ioring_enter, so new
+ * completions only show up there; ioring_enter(0, 0) just collects.
+ * Completions are not in submission order; match them by cqe_data.
+ * The kernel stops taking entries while ir_entries operations are in
+ * flight or waiting to be collected, so the completion ring can't
+ * overflow.
+ *
+ * Operations:
+ *     IORING_OP_NOP   - nothing; completes with 0.
+ *     IORING_OP_READ  - read sqe_len bytes from sqe_fd into sqe_buf.
+ *     IORING_OP_WRITE - write sqe_len bytes from sqe_buf to sqe_fd.
+ *     IORING_OP_FSYNC - fsync sqe_fd.
+ *     IORING_OP_OPEN  - open path sqe_buf with flags sqe_flags and
+ *                       mode sqe_mode; completes with the new fd.
+ *     IORING_OP_CLOSE - close sqe_fd.
+ * Reads and writes are at sqe_offset, like pread/pwrite, or at and
+ * moving the file's own offset if it is IORING_OFF_CUR; they are at
+ * most IORING_MAXIO bytes. Write data is taken when the entry is,
+ * and read data lands in sqe_buf when the completion is posted.
+ * Open and close are done right away, in order with the entries
+ * around them; the rest run in the background in any order.
+ *
+ * cqe_res is what the call would return (bytes moved, the fd, or 0),
+ * or minus the error code.
+ */
+
+#define IORING_MAXENTRIES  256
+#define IORING_MAXIO       65536
+
+#define IORING_OFF_CUR     (-1)
+
+/* sqe_op */
+#define IORING_OP_NOP      0
+#define IORING_OP_READ     1
+#define IORING_OP_WRITE    2
+#define IORING_OP_FSYNC    3
+#define IORING_OP_OPEN     4
+#define IORING_OP_CLOSE    5
+
+struct ioring_sqe {
+	__u32 sqe_op;			/* IORING_OP_* */
+	__i32 sqe_fd;			/* file, except for open */
+#ifdef _KERNEL
+	userptr_t sqe_buf;
+#else
+	void *sqe_buf;			/* data, or the path to open */
+#endif
+	__u32 sqe_len;			/* bytes to move */
+	__i32 sqe_flags;		/* for open */
+	__u32 sqe_mode;			/* for open */
+	__u32 sqe_data;			/* handed back in the completion */
+	__off_t sqe_offset;		/* or IORING_OFF_CUR */
+};
+
+struct ioring_cqe {
+	__u32 cqe_data;			/* the entry's sqe_data */
+	__i32 cqe_res;			/* result, or -errno */
+};
+
+struct ioring {
+	volatile __u32 ir_sqhead;	/* next entry to take; kernel moves */
+	volatile __u32 ir_sqtail;	/* past the last entry; process moves */
+	volatile __u32 ir_cqhead;	/* next completion; process moves */
+	volatile __u32 ir_cqtail;	/* past the last completion; kernel moves */
+	__u32 ir_entries;		/* slots in each array */
+#ifdef _KERNEL
+	userptr_t ir_sq;
+	userptr_t ir_cq;
+#else
+	struct ioring_sqe *ir_sq;	/* submission array */
+	struct ioring_cqe *ir_cq;	/* completion array */
+#endif
+};
+
+#endif /* _KERN_IORING_H_ */
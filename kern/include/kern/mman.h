@@ -0,0 +1,32 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap().
+ */
+
+/* Protection, any combination (pages are always readable) */
+#define PROT_NONE    0
+#define PROT_READ    1
+#define PROT_WRITE   2
+#define PROT_EXEC    4
+
+/* Kind of mapping, exactly one of these */
+#define MAP_SHARED   1	/* writes go to the file and every process mapping it */
+#define MAP_PRIVATE  2	/* writes are copy-on-write and stay in this process */
+
+/* Also may be given */
+#define MAP_ANONYMOUS 4	/* zeroed memory, not a file; fd and offset are ignored */
+#define MAP_ANON     MAP_ANONYMOUS
+
+/* Hints for madvise() */
+#define MADV_NORMAL     0	/* no particular pattern (the default) */
+#define MADV_RANDOM     1	/* touched in no order; don't read ahead */
+#define MADV_SEQUENTIAL 2	/* touched in address order, once */
+#define MADV_WILLNEED   3	/* will be touched soon; read it in now */
+#define MADV_DONTNEED   4	/* won't be touched again soon */
+
+/* What mmap() returns at user level on error */
+#define MAP_FAILED   ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,27 @@
+#ifndef _KERN_POLL_H_
+#define _KERN_POLL_H_
+
+/*
+ * Definitions for poll(). (nfds_t is in <kern/types.h>.)
+ */
+
+struct pollfd {
+	int fd;			/* descriptor to watch; negative to skip */
+	short events;		/* what to watch for */
+	short revents;		/* what happened */
+};
+
+/* Events; POLLERR, POLLHUP and POLLNVAL are reported even if not asked for */
+#define POLLIN     0x01	/* reading won't block */
+#define POLLOUT    0x04	/* writing won't block */
+#define POLLERR    0x08	/* error, e.g. a pipe with no reader left */
+#define POLLHUP    0x10	/* hung up, e.g. a pipe with no writer left */
+#define POLLNVAL   0x20	/* fd isn't open */
+
+#define POLLRDNORM POLLIN
+#define POLLWRNORM POLLOUT
+
+/* Timeout meaning wait forever */
+#define INFTIM     (-1)
+
+#endif /* _KERN_POLL_H_ */
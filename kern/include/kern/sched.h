@@ -0,0 +1,20 @@
+#ifndef _KERN_SCHED_H_
+#define _KERN_SCHED_H_
+
+/*
+ * Scheduling classes, for sched_setscheduler(). SCHED_OTHER is the
+ * normal fair share scheduler. SCHED_FIFO and SCHED_RR threads have a
+ * fixed priority, SCHED_RTPRIO_MIN to SCHED_RTPRIO_MAX (higher runs
+ * first), and run ahead of every SCHED_OTHER thread; a SCHED_FIFO one
+ * keeps the cpu until it sleeps or something of a higher priority is
+ * ready, and SCHED_RR ones of the same priority take turns.
+ */
+
+#define SCHED_OTHER	0
+#define SCHED_FIFO	1
+#define SCHED_RR	2
+
+#define SCHED_RTPRIO_MIN	1
+#define SCHED_RTPRIO_MAX	32
+
+#endif /* _KERN_SCHED_H_ */
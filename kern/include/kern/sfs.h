@@ -40,6 +40,7 @@
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
+#define SFS_INLINE_MAX    ((128-6-SFS_NDIRECT)*4) /* inline data bytes */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
@@ -71,7 +72,9 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_journal;			/* 1st journal block, or 0 */
+	uint32_t sp_journalsize;		/* Blocks in the journal */
+	uint32_t reserved[116];
 };
 
 /*
@@ -83,9 +86,30 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IF_* below */
+	char sfi_inline[SFS_INLINE_MAX];	/* Data, if SFS_IF_INLINE */
 };
 
+/*
+ * A file of at most SFS_INLINE_MAX bytes can keep its data in the
+ * inode itself, in sfi_inline, instead of in a data block. Such a file
+ * has SFS_IF_INLINE set and no blocks; the bytes of sfi_inline past
+ * sfi_size are zero. Volumes made before this have sfi_flags 0.
+ */
+#define SFS_IF_INLINE	0x1
+
+/* For sfsck, which handles any of the indirect block layouts */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
+/* Largest file the direct and indirect blocks can map */
+#define SFS_MAXFILEBLOCKS (SFS_NDIRECT + SFS_DBPERIDB + \
+			   SFS_DBPERIDB * SFS_DBPERIDB + \
+			   SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+#define SFS_MAXFILESIZE   (SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE)
+
 /*
  * On-disk directory entry
  */
@@ -94,5 +118,32 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Metadata journal. Volumes made without one have sp_journal 0.
+ *
+ * The journal is sp_journalsize blocks, mksfs puts it right after the
+ * freemap, and they are marked in use. It holds at most one
+ * transaction: a header in its first block, then jh_nblocks
+ * blocks of new contents, one for each block listed in jh_blocks,
+ * in that order. jh_nblocks is 0 when there is nothing to replay.
+ *
+ * jh_sum covers the transaction. Start with jh_seq. Then, for every
+ * 32-bit word of jh_nblocks, jh_blocks[0..jh_nblocks) and the logged
+ * blocks, in that order and in on-disk byte order, do
+ * sum = sum * 31 + word. A header whose magic or sum is wrong belongs
+ * to a transaction that didn't finish, and is ignored.
+ */
+#define SFS_JOURNAL_MAGIC  0x4a524e4c	/* "JRNL" */
+#define SFS_JOURNAL_MAX    124		/* most blocks one transaction logs */
+#define SFS_JOURNAL_SIZE   (1 + SFS_JOURNAL_MAX)	/* what mksfs makes */
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JOURNAL_MAGIC */
+	uint32_t jh_seq;			/* Transaction number */
+	uint32_t jh_nblocks;			/* Blocks logged */
+	uint32_t jh_sum;			/* Checksum, as above */
+	uint32_t jh_blocks[SFS_JOURNAL_MAX];	/* Where each one goes */
+};
+
 
 #endif /* _KERN_SFS_H_ */
@@ -49,12 +49,14 @@
 #define AF_UNIX		1
 #define AF_INET		2
 #define AF_INET6	3
+#define AF_LNET		4	/* System/161 hub network */
 
 /* Protocol families. Pointless layer of indirection in the standard API. */
 #define PF_UNSPEC	AF_UNSPEC
 #define PF_UNIX		AF_UNIX
 #define PF_INET		AF_INET
 #define PF_INET6	AF_INET6
+#define PF_LNET		AF_LNET
 
 /*
  * Socket address structures. Socket addresses are polymorphic, and
@@ -86,6 +88,21 @@ struct sockaddr_storage {
    char __ss_pad5[_SS_SIZE - sizeof(__u64) - sizeof(__u32) - 4*sizeof(__u8)];
 };
 
+/*
+ * AF_LNET addresses: a station's 16-bit hardware address on the hub
+ * and a 16-bit datagram port. Sending to LNADDR_BROADCAST reaches
+ * every station on the hub.
+ */
+#define LNADDR_BROADCAST	0xffff
+
+struct sockaddr_ln {
+   __u8 sln_len;
+   __u8 sln_family;	/* AF_LNET */
+   __u16 sln_port;
+   __u16 sln_addr;
+   __u16 __sln_pad;
+};
+
 
 /*
  * Not very important.
@@ -0,0 +1,29 @@
+/*
+ * Word-at-a-time support for the string functions. Like them, this is
+ * shared between libc and the kernel; the kernel's copyinstr uses it
+ * too.
+ *
+ * The string functions move a long at a time once their pointers are
+ * word-aligned, and go back to bytes for the ends. An aligned word
+ * never straddles a page, so reading the whole word that holds a
+ * string's terminator can't fault even if the string's page is the
+ * last one mapped.
+ *
+ * STRWORD_HASZERO(w) is nonzero if (and only if) some byte of W is
+ * zero: subtracting 1 from each byte borrows into its top bit only if
+ * the byte was 0 (or already had its top bit set, which ~w rules out).
+ * It doesn't say which byte, so callers finish that word by bytes.
+ * STRWORD_REPEAT(c) is byte C in every byte of a word, so that
+ * STRWORD_HASZERO(w ^ STRWORD_REPEAT(c)) finds a byte equal to C.
+ */
+
+#ifndef _KERN_STRWORD_H_
+#define _KERN_STRWORD_H_
+
+#define STRWORD_ONES		((unsigned long)-1 / 0xff)
+#define STRWORD_HIGHS		(STRWORD_ONES << 7)
+#define STRWORD_HASZERO(w)	(((w) - STRWORD_ONES) & ~(w) & STRWORD_HIGHS)
+#define STRWORD_REPEAT(c)	(STRWORD_ONES * (unsigned char)(c))
+#define STRWORD_ALIGNED(p)	((uintptr_t)(p) % sizeof(unsigned long) == 0)
+
+#endif /* _KERN_STRWORD_H_ */
@@ -59,7 +59,7 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
+#define SYS_madvise      11
 //#define SYS_mincore    12
 //#define SYS_mlock      13
 //#define SYS_munlock    14
@@ -86,7 +86,7 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage    35
 //                              (resource limits)
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
@@ -109,12 +109,12 @@
 #define SYS_close        49
 #define SYS_read         50
 #define SYS_pread        51
-//#define SYS_readv      52
+#define SYS_readv        52
 //#define SYS_preadv     53
 #define SYS_getdirentry  54
 #define SYS_write        55
 #define SYS_pwrite       56
-//#define SYS_writev     57
+#define SYS_writev       57
 //#define SYS_pwritev    58
 #define SYS_lseek        59
 #define SYS_flock        60
@@ -180,8 +180,8 @@
 #define SYS_getpeername  106
 #define SYS_getsockopt   107
 #define SYS_setsockopt   108
-//#define SYS_recvfrom   109
-//#define SYS_sendto     110
+#define SYS_recvfrom     109
+#define SYS_sendto       110
 //#define SYS_recvmsg    111
 //#define SYS_sendmsg    112
 
@@ -197,6 +197,51 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Threads --
+#define SYS_threadfork   121
+#define SYS_threadexit   122
+#define SYS_threadjoin   123
+#define SYS_futex_wait   124
+#define SYS_futex_wake   125
+#define SYS_setaffinity  126
+#define SYS_getaffinity  127
+
+//                              -- Statistics --
+#define SYS_cputimes     128
+#define SYS_vmstats      129
+
+//                              -- File-handle-related, more --
+#define SYS_getdirentries 130
+#define SYS_fallocate    131
+
+//                              -- Batched I/O --
+#define SYS_ioring_setup 132
+#define SYS_ioring_enter 133
+
+//                              -- In-kernel file copy --
+#define SYS_copy_file_range 134
+
+//                              -- Fair share --
+#define SYS_setnice      135
+#define SYS_getnice      136
+
+//                              -- Real-time scheduling --
+#define SYS_sched_setscheduler 137
+#define SYS_sched_getscheduler 138
+
+//                              -- I/O priority --
+#define SYS_ioprio_set   139
+#define SYS_ioprio_get   140
+
+//                              -- File access hints --
+#define SYS_posix_fadvise 141
+
+//                              -- Ranged writeback --
+#define SYS_sync_file_range 142
+
+//                              -- User trace events --
+#define SYS_utrace       143
+
 /*CALLEND*/
 
 
@@ -0,0 +1,25 @@
+#ifndef _KERN_TIMEPAGE_H_
+#define _KERN_TIMEPAGE_H_
+
+/*
+ * The time page: a page the kernel keeps the time of day in, mapped
+ * read-only at TIMEPAGE_VADDR in every address space so user code can
+ * read the clock without a system call. It is updated on every
+ * hardclock, so it is only as fine as HZ; use __time for intervals
+ * shorter than that.
+ *
+ * tp_seq is odd while the kernel is changing the time. To read it,
+ * read tp_seq, then the time, then tp_seq again, and start over if
+ * tp_seq was odd or has changed. It is 0 until the time is first set.
+ */
+struct timepage {
+	volatile __u32 tp_seq;
+	volatile __u32 tp_nsec;		/* nanoseconds */
+	volatile __time_t tp_sec;	/* seconds */
+};
+
+/* This defines TIMEPAGE_VADDR. */
+#include <kern/machine/timepage.h>
+
+
+#endif /* _KERN_TIMEPAGE_H_ */
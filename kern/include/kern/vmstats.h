@@ -0,0 +1,29 @@
+#ifndef _KERN_VMSTATS_H_
+#define _KERN_VMSTATS_H_
+
+/*
+ * Virtual memory statistics, as counted by the kernel (see
+ * uw-vmstats.h) and copied out by the vmstats() system call, which
+ * fills in an array of VMSTAT_COUNT unsigned ints indexed by these.
+ */
+
+/* DO NOT ADD OR CHANGE WITHOUT ALSO CHANGING uw-vmstats.c */
+#define VMSTAT_TLB_FAULT              (0)
+#define VMSTAT_TLB_FAULT_FREE         (1)
+#define VMSTAT_TLB_FAULT_REPLACE      (2)
+#define VMSTAT_TLB_INVALIDATE         (3)
+#define VMSTAT_TLB_RELOAD             (4)
+#define VMSTAT_PAGE_FAULT_ZERO        (5)
+#define VMSTAT_PAGE_FAULT_DISK        (6)
+#define VMSTAT_ELF_FILE_READ          (7)
+#define VMSTAT_SWAP_FILE_READ         (8)
+#define VMSTAT_SWAP_FILE_WRITE        (9)
+#define VMSTAT_SWAP_POOL_READ        (10)
+#define VMSTAT_SWAP_POOL_WRITE       (11)
+#define VMSTAT_SWAP_READAROUND       (12)
+#define VMSTAT_SWAP_DISK_IO          (13)
+#define VMSTAT_COMPACT               (14)
+#define VMSTAT_COMPACT_MOVE          (15)
+#define VMSTAT_COUNT                 (16)
+
+#endif /* _KERN_VMSTATS_H_ */
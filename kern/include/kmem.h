@@ -0,0 +1,36 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches for kernel structures that are created and destroyed
+ * all the time (procs, threads, wchans, vnodes).
+ *
+ * A cache hands out objects of one size, carved from whole pages
+ * ("slabs") taken with alloc_kpages, so they never touch the general
+ * subpage allocator. Freed objects go into a small per-cpu magazine
+ * first and are handed straight back out by the next allocation on that
+ * cpu without taking the cache lock.
+ *
+ * If a constructor is given it is run once on each object when its slab
+ * is set up, not on every allocation. Objects must be handed back to
+ * kmem_cache_free in the same (constructed) state.
+ *
+ * Functions:
+ *     kmem_cache_create  - make a cache of SIZE-byte objects.
+ *     kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *     kmem_cache_free    - give an object back. NULL is ignored.
+ *     kmem_printstats    - print usage of every cache (called from
+ *                          kheap_printstats).
+ */
+
+#include <types.h>
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_printstats(void);
+
+#endif /* _KMEM_H_ */
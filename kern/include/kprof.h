@@ -0,0 +1,39 @@
+#ifndef _KPROF_H_
+#define _KPROF_H_
+
+/*
+ * Sampling kernel profiler (options kprof).
+ *
+ * While it's on, every timer interrupt records the pc it interrupted
+ * and the process that was running into a buffer for that cpu. Idle
+ * cpus aren't sampled, only counted. The report sorts the kernel pcs
+ * into functions using the symbol table of the kernel image, read
+ * from a file (normally the "kernel" next to sys161, as emu0:kernel);
+ * if that can't be read, it lists raw pcs instead, for os161-addr2line.
+ *
+ * Functions:
+ *     kprof_sample - record one sample. Called by the timer interrupt
+ *                    with the interrupted PC, and USER true if it was
+ *                    in user mode.
+ *     kprof_start  - start sampling (allocating the buffers the first
+ *                    time). Returns ENOMEM if they can't be had.
+ *     kprof_stop   - stop sampling; the samples are kept.
+ *     kprof_reset  - throw away the samples.
+ *     kprof_report - stop sampling and print the KPROF_TOP functions
+ *                    with the most samples, and the processes. KERNEL
+ *                    is the kernel image to take symbols from.
+ *
+ * Each buffer is only touched by its own cpu with interrupts off, so
+ * there's no locking; stopping first is what makes reading them safe.
+ */
+
+#define KPROF_NSAMPLES  4096	/* per cpu */
+#define KPROF_TOP       20	/* lines in a report */
+
+void kprof_sample(vaddr_t pc, bool user);
+int kprof_start(void);
+void kprof_stop(void);
+void kprof_reset(void);
+void kprof_report(const char *kernel);
+
+#endif /* _KPROF_H_ */
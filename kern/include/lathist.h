@@ -0,0 +1,58 @@
+#ifndef _LATHIST_H_
+#define _LATHIST_H_
+
+/*
+ * Latency histograms.
+ *
+ * Each histogram counts durations in log-linear buckets: LATHIST_SUB
+ * buckets for each power of two nanoseconds, so a bucket is never
+ * more than 1/LATHIST_SUB of its value wide. Every cpu has its own set
+ * and records into it with interrupts off; reports add them up.
+ *
+ * There are fixed histograms for page faults, buffer cache I/O and
+ * disk requests, and one per wait channel name for time spent asleep.
+ * Wait channels get their slot from lat_wchanslot when created; names
+ * are kept by content, since a lot of them are freed with the lock
+ * they belong to, and once LAT_NWCHANS are taken the rest share one.
+ *
+ * Functions:
+ *     lat_start     - start timing; called once the clock is up and
+ *                     all the cpus are known.
+ *     lat_now       - a start time to hand to lat_record later, or 0
+ *                     before lat_start.
+ *     lat_record    - count the time since START (unless it's 0) in
+ *                     histogram WHICH.
+ *     lat_wchanslot - the histogram for wait channel name NAME.
+ *     lat_report    - print count, p50, p99 and max of each histogram
+ *                     that has anything in it.
+ *     lat_reset     - zero them all.
+ */
+
+#define LATHIST_SUBSHIFT  1
+#define LATHIST_SUB       (1U << LATHIST_SUBSHIFT)
+#define LATHIST_MAXSHIFT  37	/* 2^37 ns is 137 s; longer goes in the top */
+#define LATHIST_NBUCKETS  ((LATHIST_MAXSHIFT - LATHIST_SUBSHIFT + 2) * \
+			   LATHIST_SUB)
+
+struct lathist {
+	unsigned lh_count;
+	uint64_t lh_max;
+	unsigned lh_buckets[LATHIST_NBUCKETS];
+};
+
+/* Histograms */
+#define LAT_FAULT    0		/* vm_fault */
+#define LAT_BUFIO    1		/* buffer cache reads and writebacks */
+#define LAT_DISK     2		/* lhd requests, including the queue */
+#define LAT_NFIXED   3
+#define LAT_NWCHANS  24		/* the last is every other name */
+#define LAT_NHISTS   (LAT_NFIXED + LAT_NWCHANS)
+
+void lat_start(void);
+uint64_t lat_now(void);
+void lat_record(unsigned which, uint64_t start);
+unsigned lat_wchanslot(const char *name);
+void lat_report(void);
+void lat_reset(void);
+
+#endif /* _LATHIST_H_ */
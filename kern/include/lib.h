@@ -107,8 +107,13 @@ extern uint32_t dbflags;
  * messages actually present in the system yet. Feel free to add more.
  *
  * DEBUG is a varargs macro. These were added to the language in C99.
+ *
+ * DEBUG messages go through klog_printf, which never waits: it puts
+ * the text in a per-cpu ring and a work queue thread prints it later, so
+ * leaving tracing on doesn't serialize the machine on the console.
+ * If the ring fills up, the excess is dropped (and counted).
  */
-#define DEBUG(d, ...) ((dbflags & (d)) ? kprintf(__VA_ARGS__) : 0)
+#define DEBUG(d, ...) ((dbflags & (d)) ? klog_printf(__VA_ARGS__) : 0)
 
 /*
  * Random number generator, using the random device.
@@ -122,22 +127,56 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kheap_printstats dumps every subpage allocator page; kheap_printfrag
+ * sums them up by size class and lists the pages that are nearly
+ * empty. With options kmsites, kheap_printsites lists the callers of
+ * kmalloc with the most memory live.
+ *
+ * With options kmtags, memory is also charged to the subsystem that
+ * asked for it, and kheap_printtags shows the live bytes and high-water
+ * mark of each. A file's kmalloc and kstrdup calls are charged to
+ * KMTAG if it defines that before including this header, and to
+ * KMT_OTHER if not.
  */
-void *kmalloc(size_t size);
+#define KMT_OTHER	0
+#define KMT_VM		1
+#define KMT_VFS		2
+#define KMT_SFS		3
+#define KMT_PROC	4
+#define KMT_THREAD	5
+#define KMT_SYNCH	6
+#define KMT_NET		7
+#define KMT_DEV		8
+#define KMT_NTAGS	9
+
+#ifndef KMTAG
+#define KMTAG KMT_OTHER
+#endif
+
+void *kmalloc_tagged(size_t size, unsigned tag);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_printfrag(void);
+void kheap_printsites(void);
+void kheap_printtags(void);
+#define kmalloc(size) kmalloc_tagged(size, KMTAG)
 
 /*
  * C string functions.
  *
  * kstrdup is like strdup, but calls kmalloc instead of malloc.
  * If out of memory, it returns NULL.
+ *
+ * memzero_page and memcpy_page are bzero and memcpy for exactly one
+ * page-aligned page.
  */
 size_t strlen(const char *str);
 int strcmp(const char *str1, const char *str2);
 char *strcpy(char *dest, const char *src);
 char *strcat(char *dest, const char *src);
-char *kstrdup(const char *str);
+char *kstrdup_tagged(const char *str, unsigned tag);
+#define kstrdup(str) kstrdup_tagged(str, KMTAG)
 char *strchr(const char *searched, int searchfor);
 char *strrchr(const char *searched, int searchfor);
 char *strtok_r(char *buf, const char *seps, char **context);
@@ -145,6 +184,8 @@ char *strtok_r(char *buf, const char *seps, char **context);
 void *memcpy(void *dest, const void *src, size_t len);
 void *memmove(void *dest, const void *src, size_t len);
 void bzero(void *ptr, size_t len);
+void memzero_page(void *page);
+void memcpy_page(void *dest, const void *src);
 int atoi(const char *str);
 
 int snprintf(char *buf, size_t maxlen, const char *fmt, ...) __PF(3,4);
@@ -175,9 +216,16 @@ void beep(void);
  *
  * kprintf_bootstrap sets up a lock for kprintf and should be called
  * during boot once malloc is available and before any additional
- * threads are created.
+ * threads are created. It also sets up the klog job.
+ *
+ * klog_printf is the non-blocking printf behind DEBUG(). klog_tick
+ * is called from hardclock to queue the klog job. klog_dmesg prints
+ * the most recent klog output again.
  */
 int kprintf(const char *format, ...) __PF(1,2);
+int klog_printf(const char *format, ...) __PF(1,2);
+void klog_tick(void);
+void klog_dmesg(void);
 void panic(const char *format, ...) __PF(1,2);
 void badassert(const char *expr, const char *file, int line, const char *func);
 
@@ -0,0 +1,55 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiling (options lockprof).
+ *
+ * Statistics are kept per lock *name*, so e.g. all the vnode locks of
+ * one filesystem add up together. Sleep locks get profiled from
+ * lock_create by their lk_name; spinlocks have no name and are only
+ * profiled once given one with spinlock_profile().
+ *
+ * Functions:
+ *     lockprof_get      - find or make the statistics for NAME. Returns
+ *                         NULL if out of memory (the lock just isn't
+ *                         profiled then).
+ *     lockprof_acquired - count an acquisition. If CONTENDED, START is
+ *                         when the wait began. Stores the time now in
+ *                         *HOLDSTART for lockprof_released.
+ *     lockprof_released - count the hold time since HOLDSTART.
+ *     lockprof_start    - start timing; called once the clock is up.
+ *                         (Before that, only counts are kept.)
+ *     lockprof_now      - the time, in ns, or 0 before lockprof_start.
+ *     lockprof_report   - print the most contended locks.
+ *     lockprof_reset    - zero all the statistics.
+ *
+ * The statistics are not protected by any struct spinlock, since that
+ * would profile itself; each has a raw lock word instead.
+ */
+
+#include <spinlock.h>
+
+#define LOCKPROF_NAMELEN 23
+
+struct lockstat {
+	char ls_name[LOCKPROF_NAMELEN+1];
+	volatile spinlock_data_t ls_word;	/* protects the counters */
+	unsigned ls_acquires;
+	unsigned ls_contended;
+	uint64_t ls_waitns;		/* total time spent waiting */
+	uint64_t ls_maxwaitns;
+	uint64_t ls_holdns;		/* total time held */
+	uint64_t ls_maxholdns;
+	struct lockstat *ls_next;	/* all of them, for reporting */
+};
+
+struct lockstat *lockprof_get(const char *name);
+void lockprof_acquired(struct lockstat *ls, bool contended, uint64_t start,
+		       uint64_t *holdstart);
+void lockprof_released(struct lockstat *ls, uint64_t holdstart);
+void lockprof_start(void);
+uint64_t lockprof_now(void);
+void lockprof_report(void);
+void lockprof_reset(void);
+
+#endif /* _LOCKPROF_H_ */
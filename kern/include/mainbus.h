@@ -48,6 +48,22 @@ void mainbus_start_cpus(void);
 /* Bus-level interrupt handler, called from cpu-level trap/interrupt code */
 void mainbus_interrupt(struct trapframe *);
 
+/*
+ * Start the calling cpu's timer at HZ, and its cycle clock; called on
+ * each secondary cpu as it hatches. (Interrupts off.)
+ */
+void mainbus_timer_start(void);
+
+/*
+ * Slow the calling cpu's timer down to a rare backstop tick while it is
+ * idle, and put it back to HZ once it has work. (Interrupts off.)
+ */
+void mainbus_timer_idle(void);
+void mainbus_timer_resume(void);
+
+/* The cpus' clock rate, in Hz. */
+uint32_t mainbus_cpufreq(void);
+
 /* Find the size of main memory. */
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
@@ -55,6 +71,19 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Send device interrupts only to the cpus in CPUS (bit N for cpu
+ * number N), spread over them a device at a time, so the others run
+ * uninterrupted except by their own timers. Device bottom halves run
+ * where the interrupt came in, so they go too. EINVAL if CPUS has no
+ * cpu in it. mainbus_iocpus gives the set last chosen (at boot, just
+ * the boot cpu), and mainbus_irqreport prints where each device's
+ * interrupts go.
+ */
+int mainbus_set_iocpus(uint32_t cpus);
+uint32_t mainbus_iocpus(void);
+void mainbus_irqreport(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,22 @@
+#ifndef _MEMBAR_H_
+#define _MEMBAR_H_
+
+/*
+ * Memory barriers, for code that shares memory between cpus (or with
+ * interrupt handlers) without a lock. Spinlocks and the other synch
+ * primitives already include whatever barriers they need.
+ *
+ *     membar_any_any     - all accesses before, before all after.
+ *     membar_load_load   - loads before, before loads after.
+ *     membar_store_store - stores before, before stores after; e.g.
+ *                          fill in data, then publish an index to it.
+ *     membar_load_any    - loads before, before everything after; e.g.
+ *                          read an index, then the data it covers.
+ *     membar_any_store   - everything before, before stores after; e.g.
+ *                          finish with data, then release its slot.
+ */
+
+#include <cdefs.h>
+#include <machine/membar.h>
+
+#endif /* _MEMBAR_H_ */
@@ -0,0 +1,130 @@
+#ifndef _NET_H_
+#define _NET_H_
+
+/*
+ * Networking: a pool of packet buffers, network interfaces, and
+ * datagram sockets on top of them.
+ *
+ * Packets live in pbufs from a fixed pool, allocated at boot, so
+ * drivers can get one in an interrupt handler. A received frame is
+ * copied off the card once into a pbuf, and the pbuf itself is then
+ * passed up to the socket it's for; the data is copied again only into
+ * the reader's buffer. Sending is the same the other way round.
+ *
+ * The datagram protocol is about as simple as it gets: a header with
+ * the source and destination ports and the length, then the data. A
+ * datagram is one link-level frame; there's no fragmentation.
+ *
+ * pbufs:
+ *     pbuf_get       - take a pbuf from the pool, with room for
+ *                      PBUF_HEADROOM bytes of headers in front of the
+ *                      data; NULL if the pool is empty. Never sleeps,
+ *                      so it can be used in interrupt handlers.
+ *     pbuf_put       - give a pbuf back. Also fine in interrupts.
+ *     pbuf_push      - grow the data backwards by LEN bytes (to add a
+ *                      header) and return the new start.
+ *     pbuf_pull      - drop LEN bytes from the front (a header that's
+ *                      been read) and return the new start.
+ *
+ * Interfaces:
+ *     net_attach     - add an interface, set up by its driver.
+ *     net_input      - hand up a frame's payload that came in on an
+ *                      interface from station SRC. Takes the pbuf.
+ *                      Thread context; may sleep.
+ *     net_output     - send the datagram in PB from port SRCPORT to
+ *                      port DSTPORT at station DST. Takes the pbuf.
+ *     net_firstif    - the first interface attached, or NULL; the
+ *                      rest follow on if_next. The first one is the
+ *                      one datagrams go out on.
+ *
+ * Sockets (vnodes, so they go in the file table like anything else):
+ *     socket_create  - make an unbound socket, opened once.
+ *     socket_bind    - give the socket a local port; port 0 picks one.
+ *     socket_sendto  - send the data in UIO to ADDR as one datagram.
+ *                      Binds an unbound socket to some port first.
+ *     socket_recvfrom - wait for a datagram and read it into UIO;
+ *                      whatever doesn't fit is thrown away. The
+ *                      sender's address goes in ADDR if it isn't NULL.
+ * The socket calls return ENOTSOCK if VN isn't a socket.
+ */
+
+#include <kern/socket.h>
+
+struct uio;
+struct vnode;
+
+#define PBUF_SIZE	4096	/* bytes in a pbuf, headers and all */
+#define PBUF_HEADROOM	64	/* bytes pbuf_get leaves for headers */
+
+struct pbuf {
+	struct pbuf *pb_next;		/* on a queue (or the free list) */
+	char *pb_buf;			/* PBUF_SIZE bytes */
+	unsigned pb_off;		/* where the data starts in pb_buf */
+	unsigned pb_len;		/* bytes of data */
+	struct sockaddr_ln pb_from;	/* sender, once it's on a socket */
+};
+
+void pbuf_bootstrap(void);
+struct pbuf *pbuf_get(void);
+void pbuf_put(struct pbuf *pb);
+void *pbuf_push(struct pbuf *pb, unsigned len);
+void *pbuf_pull(struct pbuf *pb, unsigned len);
+
+/* Start of PB's data */
+#define PBUF_DATA(pb) ((void *)((pb)->pb_buf + (pb)->pb_off))
+
+/*
+ * A network interface. The driver fills in everything but if_next
+ * and calls net_attach.
+ *
+ * if_output sends PB, whose data is the frame's payload, to station
+ * DST; it pushes its own header, which must fit in PBUF_HEADROOM
+ * bytes less the datagram header. It takes the pbuf whether or not it
+ * succeeds, and may be called from any thread, but not from an
+ * interrupt handler.
+ *
+ * The statistics are kept by the driver, and only approximately.
+ */
+struct netif {
+	char if_name[16];
+	uint16_t if_addr;		/* our station address */
+	int (*if_output)(struct netif *nif, uint16_t dst, struct pbuf *pb);
+	void *if_data;			/* for the driver */
+	struct netif *if_next;
+
+	unsigned if_ipackets;		/* frames received */
+	unsigned if_idrops;		/* frames dropped on the way in */
+	unsigned if_opackets;		/* frames sent */
+	unsigned if_odrops;		/* frames dropped on the way out */
+};
+
+/* The datagram header, in front of the data in each frame */
+struct net_dghdr {
+	uint16_t dg_srcport;
+	uint16_t dg_dstport;
+	uint16_t dg_len;		/* bytes of data after the header */
+	uint16_t dg_pad;
+};
+
+/* Largest datagram that can be sent */
+#define NET_MAXDGRAM	(PBUF_SIZE - PBUF_HEADROOM)
+
+void net_bootstrap(void);
+void net_attach(struct netif *nif);
+void net_input(struct netif *nif, uint16_t src, struct pbuf *pb);
+int net_output(uint16_t dst, uint16_t srcport, uint16_t dstport,
+	       struct pbuf *pb);
+struct netif *net_firstif(void);
+
+int socket_create(int domain, int type, int protocol, struct vnode **ret);
+int socket_bind(struct vnode *vn, const struct sockaddr_ln *addr);
+int socket_sendto(struct vnode *vn, struct uio *uio,
+		  const struct sockaddr_ln *addr);
+int socket_recvfrom(struct vnode *vn, struct uio *uio,
+		    struct sockaddr_ln *addr);
+
+/* For net.c: set up, and hand PB (with pb_from set) to port PORT */
+void socket_bootstrap(void);
+void socket_deliver(uint16_t port, struct pbuf *pb);
+
+#endif /* _NET_H_ */
@@ -0,0 +1,69 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table for user address spaces (smartvm).
+ *
+ * A 32-bit virtual address is split 10/10/12: the top ten bits index the
+ * page directory, the next ten index a second-level table of 1024 PTEs,
+ * and the low twelve are the offset into the 4K page. Second-level tables
+ * are only allocated once something in their 4MB range is mapped, so a
+ * process with a small text/data segment and a stack only pays for three
+ * of them.
+ *
+ * A PTE keeps the physical frame in its top 20 bits (same layout as the
+ * MIPS EntryLo PFN) and software flags in the low bits.
+ *
+ * The MIPS fast-path TLB refill walks this structure directly, in
+ * assembler; see exception-mips1.S before changing the layout.
+ */
+
+#include <types.h>
+#include <machine/vm.h>
+
+typedef uint32_t pte_t;
+
+#define PT_DIR_ENTRIES		1024
+#define PT_TABLE_ENTRIES	1024
+
+#define PT_DIR_INDEX(va)	(((va) >> 22) & (PT_DIR_ENTRIES - 1))
+#define PT_TABLE_INDEX(va)	(((va) >> 12) & (PT_TABLE_ENTRIES - 1))
+#define PT_VADDR(dir, table)	(((vaddr_t)(dir) << 22) | ((vaddr_t)(table) << 12))
+
+/* PTE flag bits */
+#define PTE_VALID	0x001	/* frame is resident and mapped */
+#define PTE_WRITABLE	0x002	/* writes allowed (sets TLBLO_DIRTY) */
+#define PTE_COW		0x004	/* shared after fork; copy on first write */
+#define PTE_SWAPPED	0x008	/* not resident; frame bits hold a swap slot */
+#define PTE_BUSY	0x010	/* being evicted; frame bits still valid */
+#define PTE_REF		0x020	/* referenced; fast TLB refill may use it */
+#define PTE_SHARED	0x040	/* MAP_SHARED file page; fork doesn't COW it */
+#define PTE_FLAGMASK	0x07f
+
+#define PTE_FRAME(pte)	((paddr_t)((pte) & PAGE_FRAME))
+#define PTE_MAKE(paddr, flags)	(((paddr) & PAGE_FRAME) | (flags))
+#define PTE_SWAPSLOT(pte)	((unsigned)((pte) >> 12))
+#define PTE_MAKE_SWAP(slot, flags)	(((pte_t)(slot) << 12) | (flags))
+
+struct pagetable {
+	pte_t *pt_dir[PT_DIR_ENTRIES];	/* second-level tables, or NULL */
+};
+
+/*
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on error.
+ *     pt_destroy - free the table structures. Does not touch the frames
+ *                  the PTEs point at; the address space frees those.
+ *     pt_lookup  - return a pointer to the PTE for VADDR, or NULL if its
+ *                  second-level table was never allocated.
+ *     pt_lookup_create - like pt_lookup, but allocates the second-level
+ *                  table if needed. Returns NULL on out-of-memory. The
+ *                  caller makes sure nobody else can be adding tables
+ *                  at the same time (smartvm's as_faultlock).
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr);
+pte_t *pt_lookup_create(struct pagetable *pt, vaddr_t vaddr);
+
+#endif /* _PAGETABLE_H_ */
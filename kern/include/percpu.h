@@ -0,0 +1,77 @@
+#ifndef _PERCPU_H_
+#define _PERCPU_H_
+
+/*
+ * Per-cpu variables, so a subsystem can keep something for each cpu
+ * without adding it to struct cpu.
+ *
+ * DEFINE_PERCPU(type, name) defines the variable, static or not. The
+ * linker gathers these into one template (the .percpu section), and
+ * cpu_create gives each cpu its own copy of the whole thing; after
+ * that the template itself is never used. So an initializer gives
+ * every cpu's copy its starting value, and arrays work too
+ * (DEFINE_PERCPU(unsigned, foo[4])).
+ *
+ *     PERCPU(name)          - this cpu's copy, as an lvalue. Only use it
+ *                             with interrupts off (or while otherwise
+ *                             sure of not moving to another cpu).
+ *     PERCPU_PTR(c, name)   - a pointer to cpu C's copy.
+ *     percpu_ptr(c, var)    - the same, untyped, for the address VAR of
+ *                             any part of a per-cpu variable.
+ *
+ * Other cpus may read a cpu's copy, but it is up to the user to make
+ * that safe.
+ *
+ * Per-cpu counters are built on this: each cpu adds to its own with
+ * interrupts off and no lock, and they are only added up when someone
+ * asks. Define one with DEFINE_PERCPU_COUNTER(name) and pass &name.
+ *
+ *     percpu_counter_add - add N (which may be negative) on this cpu.
+ *     percpu_counter_inc - add 1.
+ *     percpu_counter_sum - the total over all cpus. Each cpu's part is
+ *                          read whole (see seqlock.h), but the cpus
+ *                          aren't in step, so it's only exact once
+ *                          counting has stopped.
+ */
+
+#include <cpu.h>
+
+/* Ends of the template, from the linker script */
+extern char _percpu_start[], _percpu_end[];
+
+#define DEFINE_PERCPU(type, name) \
+	type name __attribute__((__section__(".percpu")))
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef PERCPU_INLINE
+#define PERCPU_INLINE INLINE
+#endif
+
+void *percpu_ptr(struct cpu *c, const void *var);
+
+PERCPU_INLINE
+void *
+percpu_ptr(struct cpu *c, const void *var)
+{
+	return (char *)c->c_percpu + ((const char *)var - _percpu_start);
+}
+
+#define PERCPU_PTR(c, name)	((__typeof__(&(name)))percpu_ptr(c, &(name)))
+#define PERCPU(name)		(*PERCPU_PTR(curcpu->c_self, name))
+
+/* Make a cpu's copy of the template; called by cpu_create. */
+void *percpu_create(void);
+
+struct percpu_counter {
+	volatile uint32_t pc_seq;	/* see seqlock.h */
+	int64_t pc_count;
+};
+
+#define DEFINE_PERCPU_COUNTER(name) \
+	DEFINE_PERCPU(struct percpu_counter, name)
+
+void percpu_counter_add(struct percpu_counter *pc, int64_t n);
+int64_t percpu_counter_sum(struct percpu_counter *pc);
+#define percpu_counter_inc(pc)	percpu_counter_add(pc, 1)
+
+#endif /* _PERCPU_H_ */
@@ -0,0 +1,20 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Pipes: a ring buffer in kernel memory with a vnode for each end.
+ *
+ *    pipe_create - make a new pipe and hand back its read and write
+ *                  ends, each opened once. Close them with vfs_close.
+ *                  Reads block until there is data or the write end
+ *                  has been closed (end of file). Writes block until
+ *                  there is room, and get EPIPE once the read end is
+ *                  closed; writes of up to PIPE_BUF bytes are never
+ *                  interleaved with other writes.
+ */
+
+struct vnode;
+
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+
+#endif /* _PIPE_H_ */
@@ -0,0 +1,39 @@
+#ifndef _POLL_H_
+#define _POLL_H_
+
+/*
+ * Kernel support for poll().
+ *
+ * Anything that can be polled has a pollqueue of the threads in poll()
+ * that are waiting on it. Its VOP_POLL first adds the pollwaiter it is
+ * given (which may be NULL) to the queue with pollqueue_add and then
+ * works out which events are ready, in that order so it can't miss a
+ * change in between. Whenever something changes that might make an
+ * event ready, it calls pollqueue_wakeup, which is safe in an interrupt
+ * handler. A pollqueue must be empty when it is cleaned up; the thread
+ * in poll() holds a reference to the file for as long as it waits.
+ */
+
+#include <spinlock.h>
+
+struct pollent;
+struct pollwaiter;
+struct proc;
+
+struct pollqueue {
+	struct spinlock pq_lock;
+	struct pollent *pq_ents;
+};
+
+void pollqueue_init(struct pollqueue *pq);
+void pollqueue_cleanup(struct pollqueue *pq);
+void pollqueue_add(struct pollqueue *pq, struct pollwaiter *pw);
+void pollqueue_wakeup(struct pollqueue *pq);
+
+/* Wake threads in poll() so they notice timeouts (from timerclock) */
+void poll_timerclock(void);
+
+/* Wake P's threads in poll() so they notice it exiting */
+void poll_wakeproc(struct proc *p);
+
+#endif /* _POLL_H_ */
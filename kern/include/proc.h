@@ -38,17 +38,35 @@
 
 #include <types.h>
 #include <array.h>
+#include <limits.h>
 #include <spinlock.h>
+#include <poll.h>
+#include <rcu.h>
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
 struct vnode;
-#ifdef UW
+struct openfile;
 struct semaphore;
-#endif // UW
+struct ioring_ctx;
 
 struct proc;
 
+/*
+	A thread started with threadfork that hasn't been joined yet. The
+	records live in the process's p_uthreads and are covered by
+	proc_family_lk.
+*/
+struct uthread {
+	int ut_id;						/* thread ID handed to the user */
+	struct thread *ut_thread;		/* the thread itself, once it is running */
+	bool ut_exited;					/* has it called threadexit yet? */
+	int ut_status;					/* its exit code if so */
+	vaddr_t ut_entry;				/* where to start it in user mode */
+	vaddr_t ut_arg;					/* ...with this in a0 */
+	vaddr_t ut_stack;				/* ...and this as its stack pointer */
+};
+
 /*
 	Array of processes.
 	NOTE: This is stupid and doesn't work
@@ -70,6 +88,7 @@ struct proc;
  * Process structure.
  */
 struct proc {
+	struct rcu_head p_rcu;			/* Freed through call_rcu; must be first */
 	char *p_name;					/* Name of this process */
 	struct spinlock p_lock;			/* Lock for this structure */
 	struct threadarray p_threads;	/* Threads in this process */
@@ -80,31 +99,44 @@ struct proc {
 	/* VFS */ // forked processes can have the same one
 	struct vnode *p_cwd;		/* current working directory */
 
-#ifdef UW
-	/* a vnode to refer to the console device */
-	/* this is a quick-and-dirty way to get console writes working */
-	/* you will probably need to change this when implementing file-related
-	 system calls, since each process will need to keep track of all files
-	 it has opened, not just the console. */
-	struct vnode *console;			/* a vnode for the console device */
-
-#endif
+	/* Open files, indexed by file descriptor (see <file.h>) */
+	struct spinlock p_fdlock;		/* Protects p_fds */
+	struct openfile *p_fds[OPEN_MAX];
+	struct ioring_ctx *p_ioring;	/* Batched I/O ring (see ioring.h), or NULL */
 
  	pid_t p_id;						/* process ID */
-	struct array p_children;/* Child processes for this process */
+	struct proc *p_parent;			/* Parent process, NULL once it has exited */
+	struct array p_children;		/* Child processes not yet reaped */
 
-	bool p_did_exit;				/* Did the thread exit yet? */
+	bool p_did_exit;				/* Did the thread exit yet? (now a zombie) */
 	int p_exitcode;					/* Exit code for this process */
 
-	struct lock *p_exit_lk;			/* Grabbing this lock prevents this thread from exiting */
-	struct lock *p_wait_lk;			/* Use with p_wait_cv to check when lock exists */
-	struct cv *p_wait_cv;			/* Conditional variable for checking whether we've existed */
+	struct cv *p_wait_cv;			/* Signalled when one of our children exits */
+	struct pollqueue p_waitpq;		/* Our threads polling wait: (see devwait.c) */
+	struct semaphore *p_vfork_sem;	/* Set while we borrow our vfork parent's address space */
+
+	/* User threads; all under proc_family_lk */
+	struct array p_uthreads;		/* struct uthread for each unjoined thread */
+	int p_nextutid;					/* ID for the next threadfork */
+	bool p_exiting;					/* A thread is in _exit or execv; the rest must leave */
+	bool p_oomkilled;				/* Picked by the OOM killer; exits on its way to user mode */
+	struct cv *p_thread_cv;			/* Signalled when one of our threads leaves */
 
+	/* Resource usage; under p_lock */
+	struct thread_usage p_usage;		/* Threads that have left */
+	struct thread_usage p_childusage;	/* Children we have reaped */
+
+	/* Fair share scheduling (see thread.h); under p_lock */
+	int p_nice;						/* SCHED_NICE_MIN..SCHED_NICE_MAX */
+	uint64_t p_vruntime;			/* Virtual runtime of all our threads */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
+/* Protects the parent/child links and exit status of every process. */
+extern struct lock *proc_family_lk;
+
 /* Semaphore used to signal when there are no more processes */
 #ifdef UW
 extern struct semaphore *no_proc_sem;
@@ -114,11 +146,14 @@ extern struct semaphore *no_proc_sem;
 void proc_bootstrap(void);
 
 /* Create a fresh process for use by runprogram(). */
-struct proc *proc_create_runprogram(const char *name);
+struct proc *proc_create_runprogram(const char *name, struct proc *from);
 
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/* Hand a vfork parent back its address space, if we were borrowing it. */
+bool proc_vfork_done(struct proc *proc);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -131,34 +166,59 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+/**
+	Resource usage. proc_getusage adds up what a process's threads have
+	used, the ones still in it and the ones that have left; the live ones'
+	counts are read without stopping them, so are a little behind.
+	proc_getchildusage gets what its reaped children used, and
+	proc_reapusage charges a child being reaped to its parent.
+*/
+void proc_getusage(struct proc *proc, struct thread_usage *tu);
+void proc_getchildusage(struct proc *proc, struct thread_usage *tu);
+void proc_reapusage(struct proc *parent, struct proc *child);
+
 // PID and processes helpers
 
 /**
-	A list of processes is a dynamic array ordered by PID
+	Size of the process table: the most processes (including kproc) that can
+	exist at once. Each slot hands out PIDs congruent to its index modulo
+	PROC_MAX, so a PID maps straight to its slot.
 */
+#define PROC_MAX 128
 
 /**
-	Returns the process for the given process ID
+	Returns the process with the given PID, or NULL if there is none.
+	Takes no locks; nothing keeps the process from exiting afterwards
 */
-unsigned procarray_proc_index_by_pid(struct array *procs, pid_t pid); // returns index for process (or -1 if fail)
-struct proc * procarray_proc_by_pid(struct array *procs, pid_t pid); // returns actual process
-struct proc * procarray_allprocs_proc_by_pid(pid_t pid);
+struct proc * proc_by_pid(pid_t pid);
 
 /**
-	Add a process to the complete list of processes.
-	At this point it can be looked up with proc_by_pid
+	Out of memory: mark the user process SIZE says is biggest to be
+	killed. It exits the next time one of its threads heads back to user
+	mode. Only one process is killed at a time; while an earlier victim
+	is still on its way out it is returned again instead. Returns the
+	victim's PID, or 0 if there is no process to kill. SIZE is called with
+	spinlocks held, so it must not sleep.
 */
-void procarray_add_proc(struct array *procs, struct proc *p);
-void procarray_allprocs_add_proc(struct proc *p);
+pid_t proc_oomkill(unsigned (*size)(struct addrspace *));
 
 /**
-	Remove a process from the complete list of processes
-	This should only be called by proc_destroy
+	A snapshot of one process, for statistics
 */
-void procarray_remove_proc(struct array *procs, pid_t pid);
-void procarray_allprocs_remove_proc(pid_t pid);
+#define PROCINFO_NAMELEN 15
+struct procinfo {
+	pid_t pi_pid;
+	pid_t pi_ppid;					/* 0 once the parent has gone */
+	unsigned pi_nthreads;
+	int pi_nice;
+	bool pi_zombie;					/* exited, not reaped yet */
+	char pi_name[PROCINFO_NAMELEN+1];	/* cut short if need be */
+};
 
-// Generates a unique process ID
-pid_t gen_pid(void);
+/**
+	Fill in INFO for up to MAX processes, kproc included, in process
+	table order. Returns how many were filled in. May sleep.
+*/
+unsigned proc_getinfo(struct procinfo *info, unsigned max);
 
 #endif /* _PROC_H_ */
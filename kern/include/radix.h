@@ -0,0 +1,99 @@
+#ifndef _RADIX_H_
+#define _RADIX_H_
+
+/*
+ * Radix tree mapping 32-bit keys to non-NULL pointers.
+ *
+ * Each node has RADIX_FANOUT slots and takes RADIX_BITS of the key,
+ * from the top down; the tree is only as tall as the largest key in it
+ * needs, so small keys (PIDs, file block numbers) stay one or two
+ * levels deep while page numbers take a few more. Lookups never
+ * allocate; nodes are allocated on insert and freed when they empty.
+ *
+ * The tree does no locking of its own.
+ *
+ * Base operations:
+ *     radix_init     - set up an empty tree.
+ *     radix_cleanup  - free the nodes. The tree must be empty.
+ *     radix_lookup   - return the value for KEY, or NULL.
+ *     radix_insert   - set the value for KEY to VAL. Returns EEXIST if
+ *                      KEY already has one, or ENOMEM.
+ *     radix_remove   - clear KEY and return its old value, or NULL.
+ *     radix_next     - return the value with the smallest key that is
+ *                      at least START, putting the key in KEY_RET, or
+ *                      NULL if there is none.
+ */
+
+#define RADIX_BITS	6
+#define RADIX_FANOUT	(1 << RADIX_BITS)
+
+struct radix {
+	void *rt_root;			/* a node, or NULL if empty */
+	unsigned rt_height;		/* levels of nodes below rt_root */
+};
+
+void radix_init(struct radix *rt);
+void radix_cleanup(struct radix *rt);
+void *radix_lookup(const struct radix *rt, uint32_t key);
+int radix_insert(struct radix *rt, uint32_t key, void *val);
+void *radix_remove(struct radix *rt, uint32_t key);
+void *radix_next(const struct radix *rt, uint32_t start, uint32_t *key_ret);
+
+/*
+ * Typed trees.
+ *
+ * DECLRADIX(RT, T) declares "struct RT", a tree of pointers to T, and
+ * DEFRADIX(RT, T, INLINE) defines its operations, which are the same
+ * as the base ones but typed. INLINE is used as for DEFARRAY.
+ */
+
+#define DECLRADIX(RT, T) \
+	struct RT {						\
+		struct radix rt;				\
+	};							\
+								\
+	void RT##_init(struct RT *t);				\
+	void RT##_cleanup(struct RT *t);			\
+	T *RT##_lookup(const struct RT *t, uint32_t key);	\
+	int RT##_insert(struct RT *t, uint32_t key, T *val);	\
+	T *RT##_remove(struct RT *t, uint32_t key);		\
+	T *RT##_next(const struct RT *t, uint32_t start, uint32_t *key_ret)
+
+#define DEFRADIX(RT, T, INLINE) \
+	INLINE void						\
+	RT##_init(struct RT *t)					\
+	{							\
+		radix_init(&t->rt);				\
+	}							\
+								\
+	INLINE void						\
+	RT##_cleanup(struct RT *t)				\
+	{							\
+		radix_cleanup(&t->rt);				\
+	}							\
+								\
+	INLINE T *						\
+	RT##_lookup(const struct RT *t, uint32_t key)		\
+	{							\
+		return radix_lookup(&t->rt, key);		\
+	}							\
+								\
+	INLINE int						\
+	RT##_insert(struct RT *t, uint32_t key, T *val)		\
+	{							\
+		return radix_insert(&t->rt, key, val);		\
+	}							\
+								\
+	INLINE T *						\
+	RT##_remove(struct RT *t, uint32_t key)			\
+	{							\
+		return radix_remove(&t->rt, key);		\
+	}							\
+								\
+	INLINE T *						\
+	RT##_next(const struct RT *t, uint32_t start, uint32_t *key_ret) \
+	{							\
+		return radix_next(&t->rt, start, key_ret);	\
+	}
+
+#endif /* _RADIX_H_ */
@@ -0,0 +1,45 @@
+#ifndef _RCU_H_
+#define _RCU_H_
+
+/*
+ * Read-copy-update, for tables that are read far more often than they
+ * change.
+ *
+ * Readers bracket their accesses with rcu_read_lock/rcu_read_unlock,
+ * which take no lock and touch only the current thread. In between
+ * they may not sleep or yield (hardclock won't preempt them), and
+ * interrupt handlers may not be readers at all. Writers still exclude
+ * each other with whatever lock the table already has; to change
+ * something a reader may be looking at, they store a pointer to a new
+ * version and hand the old one to call_rcu, which calls back once every
+ * reader that might have seen it is done.
+ *
+ * Readers are known to be done from quiescent states: each cpu counts
+ * its thread switches, and the hardclocks that interrupt a thread that
+ * isn't reading, in c_rcu_qs, and an idle cpu is quiescent throughout.
+ * Once every cpu has been through one since a batch of callbacks was
+ * taken (a grace period), the rcu thread runs the batch.
+ *
+ * Functions:
+ *     rcu_bootstrap   - start the rcu thread. Callbacks queued earlier
+ *                       are run once it is going.
+ *     rcu_read_lock   - begin a read section. These nest.
+ *     rcu_read_unlock - end one.
+ *     call_rcu        - call FUNC(HEAD) from the rcu thread after a
+ *                       grace period. FUNC may sleep. HEAD is usually
+ *                       embedded at the start of the object to free.
+ *     rcu_synchronize - wait for a grace period. Not in a read section.
+ */
+
+struct rcu_head {
+	struct rcu_head *rh_next;
+	void (*rh_func)(struct rcu_head *);
+};
+
+void rcu_bootstrap(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+void rcu_synchronize(void);
+
+#endif /* _RCU_H_ */
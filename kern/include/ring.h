@@ -0,0 +1,76 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+/*
+ * Lock-free rings of fixed-size items, for passing data from interrupt
+ * handlers (or another cpu) to a thread without a spinlock.
+ *
+ * The caller supplies the storage, so nothing here allocates, sleeps,
+ * or spins; the size in items must be a power of two. Head and tail
+ * are free-running counters, so a full ring uses every slot.
+ *
+ * spscring: one producer and one consumer. Each end writes only its
+ * own index, so the only synchronization is a memory barrier per
+ * batch, and items move in bulk.
+ *     spscring_init      - set up over BUF, NITEMS items of ESIZE bytes.
+ *     spscring_put       - copy in up to N items; returns how many fit.
+ *     spscring_get       - copy out up to N items; returns how many
+ *                          there were.
+ *     spscring_count     - return the number of items waiting. Exact at
+ *                          either end; only a hint anywhere else.
+ *
+ * mpscring: any number of producers, on any cpus and in interrupt
+ * handlers, and one consumer. Producers claim a slot with a
+ * compare-and-swap on the head, then fill it; each slot has a sequence
+ * number that says whether it is free, filled, or drained, so the
+ * consumer never reads a claimed slot before it's filled. Items go one
+ * at a time. Storage is MPSCRING_BUFSIZE(esize, nitems) bytes, aligned
+ * for an unsigned int.
+ *     mpscring_init      - set up over BUF.
+ *     mpscring_put       - add ITEM; returns false if the ring is full.
+ *     mpscring_get       - take the oldest item into ITEM; returns false
+ *                          if there is none (or the oldest claimed slot
+ *                          is still being filled).
+ *
+ * Neither kind checks that there is really only one producer or
+ * consumer, where that's required; that's up to the caller, e.g. by
+ * only touching a per-cpu ring at splhigh on that cpu.
+ */
+
+#include <spinlock.h>	/* for spinlock_data_t */
+
+struct spscring {
+	volatile unsigned r_head;	/* next to put; written by producer */
+	volatile unsigned r_tail;	/* next to get; written by consumer */
+	unsigned r_size;		/* in items; a power of two */
+	size_t r_esize;			/* bytes per item */
+	char *r_buf;
+};
+
+void spscring_init(struct spscring *r, void *buf, size_t esize,
+		   unsigned nitems);
+unsigned spscring_put(struct spscring *r, const void *items, unsigned n);
+unsigned spscring_get(struct spscring *r, void *items, unsigned n);
+unsigned spscring_count(const struct spscring *r);
+
+/* Bytes per slot (sequence number, then the item), and for the ring */
+#define MPSCRING_STRIDE(esize) \
+	(sizeof(unsigned) + ROUNDUP((esize), sizeof(unsigned)))
+#define MPSCRING_BUFSIZE(esize, nitems) \
+	((nitems) * MPSCRING_STRIDE(esize))
+
+struct mpscring {
+	volatile spinlock_data_t r_head; /* next to claim; CAS by producers */
+	unsigned r_tail;		/* next to get; consumer only */
+	unsigned r_size;		/* in items; a power of two */
+	size_t r_esize;			/* bytes per item */
+	size_t r_stride;		/* bytes per slot */
+	char *r_buf;
+};
+
+void mpscring_init(struct mpscring *r, void *buf, size_t esize,
+		   unsigned nitems);
+bool mpscring_put(struct mpscring *r, const void *item);
+bool mpscring_get(struct mpscring *r, void *item);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,139 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+/*
+ * Sequence locks, for small data that is read far more often than it
+ * is written.
+ *
+ * Writers take a spinlock and make the sequence count odd while they
+ * change the data. Readers take nothing: they note the count, copy the
+ * data out, and start over if a writer was in the middle or has been
+ * since. So a reader never holds up a writer, but a reader can see a
+ * half-written copy before it retries; it must only copy, never follow
+ * pointers or act on what it read until seqlock_readretry says it's
+ * good.
+ *
+ * Writers run with interrupts off (the spinlock sees to that), so a
+ * reader on another cpu only ever spins for the length of one write.
+ * Don't read from an interrupt handler on the cpu that may be writing.
+ *
+ * Data that already has only one writer (one cpu, with interrupts
+ * off) can use the count alone, without the spinlock: the seqcount_*
+ * functions. The time page does this so its count can be the tp_seq
+ * user programs read.
+ *
+ * Functions:
+ *     seqlock_write_acquire - lock out other writers and make the count
+ *                             odd.
+ *     seqlock_write_release - make the count even again and unlock.
+ *     seqlock_readbegin     - wait for any writer to finish, and return
+ *                             the count to hand to seqlock_readretry.
+ *     seqlock_readretry     - true if the data may have changed since
+ *                             seqlock_readbegin returned START.
+ *
+ * Use them like this:
+ *
+ *      do {
+ *              seq = seqlock_readbegin(&sl);
+ *              copy = data;
+ *      } while (seqlock_readretry(&sl, seq));
+ */
+
+#include <cdefs.h>
+#include <spinlock.h>
+#include <membar.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef SEQLOCK_INLINE
+#define SEQLOCK_INLINE INLINE
+#endif
+
+struct seqlock {
+	struct spinlock sl_lock;	/* Held by the writer. */
+	volatile uint32_t sl_seq;	/* Odd while being written. */
+};
+
+#define SEQLOCK_INITIALIZER	{ SPINLOCK_INITIALIZER, 0 }
+
+void seqlock_init(struct seqlock *sl);
+void seqlock_cleanup(struct seqlock *sl);
+
+uint32_t seqcount_readbegin(const volatile uint32_t *seq);
+bool seqcount_readretry(const volatile uint32_t *seq, uint32_t start);
+void seqcount_writebegin(volatile uint32_t *seq);
+void seqcount_writeend(volatile uint32_t *seq);
+
+uint32_t seqlock_readbegin(struct seqlock *sl);
+bool seqlock_readretry(struct seqlock *sl, uint32_t start);
+void seqlock_write_acquire(struct seqlock *sl);
+void seqlock_write_release(struct seqlock *sl);
+
+SEQLOCK_INLINE
+uint32_t
+seqcount_readbegin(const volatile uint32_t *seq)
+{
+	uint32_t start;
+
+	while ((start = *seq) & 1) {
+		/* a writer is busy; it won't be long */
+	}
+	membar_load_load();
+	return start;
+}
+
+SEQLOCK_INLINE
+bool
+seqcount_readretry(const volatile uint32_t *seq, uint32_t start)
+{
+	membar_load_load();
+	return *seq != start;
+}
+
+SEQLOCK_INLINE
+void
+seqcount_writebegin(volatile uint32_t *seq)
+{
+	KASSERT((*seq & 1) == 0);
+	*seq = *seq + 1;
+	membar_store_store();
+}
+
+SEQLOCK_INLINE
+void
+seqcount_writeend(volatile uint32_t *seq)
+{
+	membar_store_store();
+	*seq = *seq + 1;
+}
+
+SEQLOCK_INLINE
+uint32_t
+seqlock_readbegin(struct seqlock *sl)
+{
+	return seqcount_readbegin(&sl->sl_seq);
+}
+
+SEQLOCK_INLINE
+bool
+seqlock_readretry(struct seqlock *sl, uint32_t start)
+{
+	return seqcount_readretry(&sl->sl_seq, start);
+}
+
+SEQLOCK_INLINE
+void
+seqlock_write_acquire(struct seqlock *sl)
+{
+	spinlock_acquire(&sl->sl_lock);
+	seqcount_writebegin(&sl->sl_seq);
+}
+
+SEQLOCK_INLINE
+void
+seqlock_write_release(struct seqlock *sl)
+{
+	seqcount_writeend(&sl->sl_seq);
+	spinlock_release(&sl->sl_lock);
+}
+
+#endif /* _SEQLOCK_H_ */
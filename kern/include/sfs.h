@@ -39,8 +39,10 @@
 /*
  * Get abstract structure definitions
  */
+#include <spinlock.h>
 #include <fs.h>
 #include <vnode.h>
+#include <hashtable.h>
 
 /*
  * Get on-disk structures and constants that are made available to
@@ -48,21 +50,235 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * SFS does not use vfs_biglock. Each vnode has sv_lock, a
+ * reader-writer lock covering its inode (sv_i, sv_dirty) and the
+ * contents of the file or directory; reads, stats and directory
+ * lookups take it shared. Each volume has sfs_vnlock for its table of
+ * loaded vnodes and sfs_fslock for the superblock and the free block
+ * bitmap. A journaled volume also has the journal's txlock and lock
+ * (see below). Locks are taken in this order:
+ *
+ *     0. the journal's txlock
+ *     1. sv_lock of the directory (SFS has only the root directory)
+ *     2. sv_lock of a file in it
+ *     2a. byte ranges of that file (vn_rangelock)
+ *     2b. sv_maplock of that file
+ *     3. sfs_vnlock
+ *     4. sfs_fslock
+ *     5. the journal's lock
+ *
+ * Reads and writes of a regular file's data (not inline) take sv_lock
+ * only shared, and a range of vn_rangelock for the bytes they cover,
+ * so those to different parts of the file go on at once; write ranges
+ * are exclusive. Writing back a page takes a read range over it, so a
+ * page isn't marked clean while a write is changing it. What those
+ * writes share is behind sv_maplock: sfs_bmap takes it, so looking up
+ * and allocating blocks (and the preallocation window) are one at a
+ * time, and it covers sfi_size and sv_dirty for them. Anything else
+ * that changes the inode or the block map holds sv_lock exclusively,
+ * which keeps all of them out.
+ *
+ * Disk blocks come from the buffer cache (buf.h), and a buffer may be
+ * taken while holding any of these. The locks taken while holding a
+ * buffer are sfs_fslock, when sfs_bmap or sfs_dotruncate allocate or
+ * free blocks with a file's indirect block in hand, which is safe since
+ * the buffers used under sfs_fslock are only ever the freemap's; and
+ * the journal's lock, under which no buffer is taken.
+ *
+ * The VFS layer may hold vfs_biglock when calling in (lookups, mount,
+ * sync), so it comes before all of these.
+ */
+
+struct rwlock;
+struct lock;
+struct buf;
+struct sfs_dirindex;
+struct sfs_journal;
+struct fcobj;
+
+/*
+ * File data: regular files keep theirs in the file page cache (see
+ * filecache.h), a page of SFS_PAGEBLOCKS blocks at a time, which read
+ * and write copy to and from and mmap maps; the buffer cache is left
+ * the metadata and directories. Pages are read with buf_readdirect and
+ * written with buf_writedirect, runs of blocks that are together on
+ * disk in one transfer. Dirty pages are written back by sync, fsync
+ * and commits, when the file's last reference goes, and by a write
+ * that leaves more than SFS_DIRTY_MAX of the file's pages dirty.
+ */
+#define SFS_PAGEBLOCKS  (PAGE_SIZE / SFS_BLOCKSIZE)
+#define SFS_NOPAGE      ((uint32_t)-1)	/* past any page of any file */
+#define SFS_DIRTY_MAX   64
+
+/*
+ * Read-ahead: reads of a file that pick up where the last one left off
+ * open a window of blocks past the end of each read, whose pages are
+ * read into the page cache before the read returns, up to SFS_RA_PAGES
+ * of them in one transfer. The window doubles on each such read, up to
+ * SFS_RA_MAX blocks, and closes on any other read. posix_fadvise can
+ * say better: after POSIX_FADV_SEQUENTIAL every read opens the whole
+ * window, and after POSIX_FADV_RANDOM none does, until the hint is
+ * changed or the file's last reference goes.
+ */
+#define SFS_RA_MIN  4
+#define SFS_RA_MAX  32
+#define SFS_RA_PAGES  (SFS_RA_MAX / SFS_PAGEBLOCKS)
+
+/*
+ * Direct reads: a read of a directory into kernel memory of at least
+ * SFS_DIRECT_MIN whole blocks goes through buf_readdirect, so uncached
+ * blocks come from the device straight to the destination.
+ */
+#define SFS_DIRECT_MIN  SFS_PAGEBLOCKS
+
+/*
+ * Stat-ahead: a long listing reads directory entries and then looks
+ * each up in turn to stat it, and each lookup loads the entry's inode
+ * on its own. Once SFS_SA_HITS lookups in a directory have gone forward
+ * through entries getdirentry has returned, getdirentry starts reading
+ * the inodes of the entries it is about to return, a directory block's
+ * worth at a time, and the directory's next block, into the buffer
+ * cache in the background. Going back to an earlier entry starts
+ * counting again.
+ */
+#define SFS_SA_HITS  2
+
+/*
+ * Preallocation: when a write extends a regular file, the block it
+ * needs is allocated in one run with a window of the blocks after it,
+ * which are kept (marked in use) for the file's next blocks. The
+ * window doubles with each refill, from SFS_PA_MIN up to SFS_PA_MAX
+ * blocks, so a file appended to in order comes out contiguous even
+ * while other files are growing too. fallocate takes each hole it
+ * fills as one run the same way. Blocks left over go back at truncate
+ * and when the file's last reference does; after a crash, sfsck finds
+ * them marked used but unreferenced.
+ */
+#define SFS_PA_MIN  8
+#define SFS_PA_MAX  64
+
+/* Starting size of each volume's table of loaded vnodes; it grows */
+#define SFS_VNHASH_MINSIZE  64
+
+/*
+ * Directory index: when a directory is loaded, its entries are hashed
+ * by name in memory (sv_dirindex), along with a list of its free
+ * slots, so lookups and inserts don't scan the whole directory. The
+ * on-disk format is unchanged. If the index can't be built or kept up
+ * to date (out of memory, I/O error) it is thrown away and the
+ * directory is scanned the old way until it is next loaded. It is
+ * covered by sv_lock like the directory's contents.
+ */
+#define SFS_DIRINDEX_MINBUCKETS  16
+
+/*
+ * Inactive vnodes: when the last reference to a file that still has
+ * links goes away, sfs_reclaim writes its inode back but leaves the
+ * vnode in sfs_vnodes, marked sv_inactive and on the volume's LRU
+ * list, holding the one reference VOP_DECREF handed it. sfs_loadvnode
+ * then revives it, passing that reference to the caller, without
+ * going to disk. Each volume keeps at most SFS_INACTIVE_MAX of them;
+ * past that, and when memory is short (see the shrinker in vm.h), the
+ * oldest ones are freed. The LRU list and sv_inactive are covered by
+ * sfs_vnlock.
+ */
+#define SFS_INACTIVE_MAX  64
+
+/*
+ * Journaling. On a volume with a journal (see kern/sfs.h), each block
+ * of metadata a change touches -- inodes, directory and indirect
+ * blocks, freemap sectors, the superblock -- is held in the buffer
+ * cache (buf_hold) until the next commit. A commit writes the file
+ * data out first, then logs all the held blocks to the journal as one
+ * transaction, and only then lets them go to their places on disk;
+ * after a crash, mount replays the last complete transaction, so the
+ * metadata is never left with half a change in it. Commits happen at
+ * fsync and sync, every SFS_JOURNAL_SECS seconds, and early when the
+ * journal is filling up. An fsync that finds a commit under way waits
+ * for it, and returns at once if that covered its changes.
+ *
+ * Operations that change metadata run between sfs_tx_begin and
+ * sfs_tx_end, which hold the journal's txlock shared; a commit holds it
+ * exclusively, so it sees only whole operations. sfs_reclaim can't
+ * (it runs inside other operations, from VOP_DECREF), so it leaves
+ * unlinked files on the journal's orphan list for the commit to erase.
+ *
+ * A volume without a journal has sfs_journal NULL, and all of this
+ * does nothing.
+ */
+#define SFS_JOURNAL_SECS  5
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct rwlock *sv_lock;         /* inode and data */
+	struct lock *sv_maplock;        /* block map, under shared sv_lock */
+
+	/* Read-ahead state; readers share sv_lock, so these have their own */
+	struct spinlock sv_ralock;
+	uint32_t sv_ranext;             /* file block a sequential read is at */
+	uint32_t sv_rawindow;           /* blocks to read ahead, or 0 */
+	uint32_t sv_radone;             /* blocks before this already queued */
+	int sv_raadvice;                /* POSIX_FADV_* for reads */
+	int sv_saslot;                  /* dir: last slot getdirentry gave */
+	int sv_salook;                  /* dir: last slot a lookup found */
+	unsigned sv_sahits;             /* dir: lookups following since */
+	int sv_sadone;                  /* dir: slots before this fetched */
+
+	/* Writeback from sync_file_range; covered by sfs_wblistlock */
+	struct sfs_vnode *sv_wbnext;    /* on the writeback list */
+	uint32_t sv_wbfirst;            /* pages to write, while queued */
+	uint32_t sv_wblast;
+	bool sv_wbqueued;               /* on the list */
+	bool sv_wbbusy;                 /* being written now */
+	int sv_wbioprio;                /* I/O class to write in */
+	int sv_wberr;                   /* first error, for the next wait */
+
+	/* Preallocated blocks; covered by sv_maplock or exclusive sv_lock */
+	uint32_t sv_panext;             /* file block the next one is for */
+	uint32_t sv_pablock;            /* next preallocated disk block */
+	uint32_t sv_pacount;            /* how many are left, or 0 */
+	uint32_t sv_pawindow;           /* size of the last window */
+	uint32_t sv_pawant;             /* size for the next one, or 0 */
+
+	/* Directories only: name index, or NULL */
+	struct sfs_dirindex *sv_dirindex;
+
+	/* Regular files only: the cached pages; covered by sv_lock */
+	struct fcobj *sv_pages;
+
+	/* Link in sfs_vnodes, and inactive state; protected by sfs_vnlock */
+	struct hashlink sv_hashlink;
+	bool sv_inactive;               /* unreferenced, on the LRU list */
+	struct sfs_vnode *sv_lruprev;   /* LRU list; oldest at the head */
+	struct sfs_vnode *sv_lrunext;   /* also the journal's orphan list */
 };
 
+/* Table of loaded vnodes, by inode number */
+DECLHASH(sfs_vnhash, struct sfs_vnode, uint32_t);
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnhash sfs_vnodes;   /* loaded vnodes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_mapdirty;    /* freemap sectors needing writes */
+	struct lock *sfs_vnlock;        /* sfs_vnodes and the LRU list */
+	struct lock *sfs_fslock;        /* superblock and freemap */
+	struct sfs_vnode *sfs_lruhead;  /* inactive vnodes */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_ninactive;
+	unsigned sfs_nerasing;          /* unlinked vnodes being erased */
+	struct sfs_fs *sfs_next;        /* list of mounted volumes */
+	struct sfs_journal *sfs_journal; /* NULL if not journaled */
 };
 
 /*
@@ -75,17 +291,78 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/*
+ * Convenience functions for block I/O, copying a whole block between
+ * DATA and the buffer cache. Code that only looks at or changes part
+ * of a block uses buf_read/buf_get on sfs_device directly.
+ */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
-int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
+int sfs_wblock(struct sfs_fs *sfs, const void *data, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Set up the sfs_vnode object cache and shrinker (called by mount) */
+int sfs_vnode_cache_init(void);
+
+/*
+ * Add a newly mounted volume to the list the shrinker looks at, and
+ * take it off again at unmount. sfs_detach frees the inactive vnodes
+ * first, and fails with EBUSY if any others are still loaded.
+ */
+void sfs_attach(struct sfs_fs *sfs);
+int sfs_detach(struct sfs_fs *sfs);
+
+/*
+ * Write SV's inode to the buffer cache if it's dirty, for sfs_sync.
+ * Unlike VOP_FSYNC this doesn't flush the device afterwards.
+ */
+int sfs_vnode_sync(struct sfs_vnode *sv);
+
+/* Write SV's dirty pages back, for sfs_writedata */
+int sfs_vnode_writeback(struct sfs_vnode *sv);
+
+/*
+ * Write every file's dirty pages back, for sfs_sync and commits. They
+ * go to the device, or to the buffer cache for the odd block that's
+ * in it.
+ */
+int sfs_writedata(struct sfs_fs *sfs);
+
+/*
+ * Write every dirty inode, the changed freemap sectors and the
+ * superblock to the buffer cache, for sfs_sync and commits.
+ */
+int sfs_writemeta(struct sfs_fs *sfs);
+
+/* Erase an unlinked file and free its vnode, once it's out of the table */
+void sfs_vnode_reap(struct sfs_vnode *sv);
+
+/*
+ * The journal (sfs_journal.c):
+ *     sfs_journal_recover - at mount, replay what a crash left.
+ *     sfs_journal_start   - at mount, set up journaling if the volume
+ *                           has a journal.
+ *     sfs_journal_stop    - at unmount, put everything in place and
+ *                           clear the journal.
+ *     sfs_journal_commit  - commit what's been done so far.
+ *     sfs_tx_begin/end    - bracket an operation that changes metadata.
+ *                           May commit first to make room.
+ *     sfs_journal_hold    - hold B, which is BLOCK, before changing it
+ *                           as metadata.
+ *     sfs_journal_note    - note that NBLOCKS more inodes or freemap
+ *                           sectors will need writing at commit.
+ *     sfs_journal_orphan  - leave unlinked SV for the commit to erase.
+ */
+int sfs_journal_recover(struct sfs_fs *sfs);
+int sfs_journal_start(struct sfs_fs *sfs);
+void sfs_journal_stop(struct sfs_fs *sfs);
+int sfs_journal_commit(struct sfs_fs *sfs);
+void sfs_tx_begin(struct sfs_fs *sfs);
+void sfs_tx_end(struct sfs_fs *sfs);
+int sfs_journal_hold(struct sfs_fs *sfs, struct buf *b, uint32_t block);
+void sfs_journal_note(struct sfs_fs *sfs, unsigned nblocks);
+void sfs_journal_orphan(struct sfs_fs *sfs, struct sfs_vnode *sv);
+
 
 #endif /* _SFS_H_ */
@@ -0,0 +1,44 @@
+#ifndef _SOFTINT_H_
+#define _SOFTINT_H_
+
+/*
+ * Software interrupts ("bottom halves"): the part of interrupt
+ * handling that doesn't have to happen with interrupts off.
+ *
+ * A hardware interrupt handler does only what the device needs right
+ * away (reading and clearing its status, say) and calls
+ * softint_schedule for the rest: waking threads, handing data on.
+ * Pending softints run on the same cpu on the way out of the
+ * outermost interrupt, with interrupts back on, or from the idle loop
+ * if that's what was interrupted.
+ *
+ * Softint functions are still in interrupt context: they may take
+ * spinlocks and wake threads, but not sleep, and may not read under
+ * RCU. One that is scheduled again while it runs runs again
+ * afterwards; one scheduled several times before it gets to run runs
+ * once.
+ *
+ * Functions:
+ *     softint_init     - set up SI to call FUNC(ARG).
+ *     softint_schedule - queue SI on this cpu, unless it is already
+ *                        queued somewhere. Callable from anywhere.
+ *     softint_run      - run this cpu's queue, with the spl at SPL
+ *                        while each function runs. Call at splhigh
+ *                        and with no spinlocks held. For the trap and
+ *                        idle code.
+ */
+
+#include <spinlock.h>	/* for spinlock_data_t */
+
+struct softint {
+	struct softint *si_next;	/* on the cpu's queue */
+	void (*si_func)(void *);
+	void *si_arg;
+	volatile spinlock_data_t si_pending;
+};
+
+void softint_init(struct softint *si, void (*func)(void *), void *arg);
+void softint_schedule(struct softint *si);
+void softint_run(int spl);
+
+#endif /* _SOFTINT_H_ */
@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockprof.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -53,36 +54,93 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * There are three kinds, picked per lock with spinlock_setkind:
+ *
+ * SPINLOCK_TAS		Test-and-test-and-set on lk_lock. Cheapest
+ *			uncontended, but whoever's cache wins gets it,
+ *			so under contention some cpus can starve.
+ * SPINLOCK_TICKET	lk_lock hands out tickets, and lk_serving is the
+ *			one whose turn it is: strictly FIFO, but all the
+ *			waiters still spin on the same word.
+ * SPINLOCK_MCS		lk_lock points to the last of a queue of waiters
+ *			(struct spinlock_mcsnode, one from each cpu's
+ *			c_mcsnodes), each spinning on its own node until
+ *			the one ahead hands over. FIFO, and a release
+ *			only disturbs the next waiter.
+ *
+ * All kinds are all zeros when unheld, so an unheld lock can change
+ * kind.
  */
+#define SPINLOCK_TAS		0
+#define SPINLOCK_TICKET		1
+#define SPINLOCK_MCS		2
+
+struct spinlock_mcsnode {
+	struct spinlock_mcsnode *volatile mn_next; /* Next waiter. */
+	volatile bool mn_waiting;	/* Cleared when it's our turn. */
+};
+
+/* How many MCS locks one cpu can hold (or wait for) at once */
+#define SPINLOCK_MCS_NODES	4
+
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_serving; /* Ticket now served. */
+	struct spinlock_mcsnode *lk_mcsnode; /* MCS holder's queue node. */
+	unsigned lk_kind;		/* SPINLOCK_TAS, _TICKET or _MCS. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKPROF
+	struct lockstat *lk_stat;	/* Contention stats, or NULL. */
+	uint64_t lk_holdstart;		/* When the holder got it. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * It makes a SPINLOCK_TAS lock.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKPROF
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL, \
+				  SPINLOCK_TAS, NULL, NULL, 0 }
+#else
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL, \
+				  SPINLOCK_TAS, NULL }
+#endif
 
 /*
  * Spinlock functions.
  *
- * init		Initialize the contents of a spinlock.
+ * init		Initialize the contents of a spinlock, as SPINLOCK_TAS.
  * cleanup	Opposite of init. Lock must be unlocked.
+ * setkind	Make the lock SPINLOCK_TAS, _TICKET or _MCS. Lock must be
+ *		unlocked and nobody may be waiting for it.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * profile	Keep contention statistics for the lock under NAME, which
+ *		must stay valid. Does nothing without options lockprof.
  */
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
+void spinlock_setkind(struct spinlock *lk, unsigned kind);
 
 void spinlock_acquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKPROF
+void spinlock_profile(struct spinlock *lk, const char *name);
+#else
+#define spinlock_profile(lk, name) ((void)(lk), (void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
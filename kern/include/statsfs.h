@@ -0,0 +1,20 @@
+#ifndef _STATSFS_H_
+#define _STATSFS_H_
+
+/*
+ * Kernel statistics filesystem.
+ *
+ * statsfs_bootstrap adds a read-only filesystem named "stats:" whose
+ * files each report one set of counters as text:
+ *     stats:vm       - the vm event counts
+ *     stats:cpu      - time spent user/kernel/intr/idle on each cpu
+ *     stats:procs    - the process table
+ *     stats:syscalls - calls, errors and time for each system call
+ *     stats:iostat   - requests, sectors, depth and time for each disk
+ * Each read makes a new snapshot; read a file in one go to get a
+ * consistent one.
+ */
+
+void statsfs_bootstrap(void);
+
+#endif /* _STATSFS_H_ */
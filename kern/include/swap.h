@@ -0,0 +1,61 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for smartvm.
+ *
+ * Evicted user pages are written to a raw disk (SWAP_DEVICE), one page
+ * per slot. Slot n lives at byte offset n * PAGE_SIZE on the device.
+ *
+ * In front of the disk is a pool of memory, 1/SWAP_POOLFRAC of RAM, that
+ * holds compressed copies of pages; pages that are all zeros take no
+ * room at all. A slot's page only goes to the disk if it doesn't
+ * compress to half a page or the pool is full. Either way it keeps its
+ * slot, so the pool adds speed, not space.
+ *
+ * Pages go to and from the disk in clusters of up to SWAP_CLUSTER pages
+ * in consecutive slots, each cluster one disk request: eviction writes
+ * a run of neighbouring pages together, and a fault reads in the ones
+ * that went out with it.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device and set up a pool for a
+ *                      machine with RAMPAGES pages. If the device isn't
+ *                      there we just run without swap.
+ *     swap_enabled   - true if there is a swap device.
+ *     swap_alloc     - reserve a free slot. Returns ENOSPC if full.
+ *     swap_alloc_cluster - reserve *N consecutive slots starting at
+ *                      *FIRST, or if there's no such run, fewer (at
+ *                      least one) and set *N to how many.
+ *     swap_free      - release a slot.
+ *     swap_ondisk    - true if SLOT's page is on the disk (not in the
+ *                      pool).
+ *     swap_write     - write the frame at PADDR out to SLOT.
+ *     swap_write_cluster - write the N frames at PADDRS out to N slots
+ *                      starting at FIRST.
+ *     swap_read      - read SLOT into the frame at PADDR.
+ *     swap_read_cluster - read N slots starting at FIRST, all on the
+ *                      disk, into the frames at PADDRS. Counts as one
+ *                      swapfile read and N-1 pages of read-around.
+ *
+ * swap_write and swap_read sleep; don't call them holding a spinlock.
+ */
+
+#include <types.h>
+
+#define SWAP_DEVICE "lhd1raw:"
+#define SWAP_POOLFRAC 16
+#define SWAP_CLUSTER 8
+
+void swap_bootstrap(unsigned rampages);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot);
+int swap_alloc_cluster(unsigned *first, unsigned *n);
+void swap_free(unsigned slot);
+bool swap_ondisk(unsigned slot);
+int swap_write(unsigned slot, paddr_t paddr);
+int swap_write_cluster(unsigned first, const paddr_t *paddrs, unsigned n);
+int swap_read(unsigned slot, paddr_t paddr);
+int swap_read_cluster(unsigned first, paddr_t *paddrs, unsigned n);
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <wchan.h>
 
 /*
  * Dijkstra-style semaphore.
@@ -45,12 +46,20 @@
  */
 struct semaphore {
 	char *sem_name;
-	struct wchan *sem_wchan;
+	struct wchan sem_wchan;
 	struct spinlock sem_lock;
 	volatile int sem_count;
+	bool sem_fifo;			/* hand V's count to the first waiter */
+	unsigned sem_waiters;		/* threads asleep in P (FIFO mode) */
 };
 
+/*
+ * sem_create_fifo makes a semaphore with strict FIFO ordering: V
+ * hands its count straight to the longest waiting thread instead of
+ * waking it to race for it, and P never gets ahead of a waiter.
+ */
 struct semaphore *sem_create(const char *name, int initial_count);
+struct semaphore *sem_create_fifo(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
 
 /*
@@ -75,27 +84,53 @@ void V(struct semaphore *);
 struct lock {
 
 	char *lk_name;
-	struct wchan *lk_wchan;
-	struct spinlock lk_slk;		// for enforcing atomic lock functions
-	struct thread *lk_holder;	// Thread holding this lock
+	struct wchan lk_wchan;
+	struct spinlock lk_slk;		// protects lk_waiters (slow path only)
+	struct thread *volatile lk_holder;	// Thread holding this lock
 
-	volatile bool locked; // current lock locked?
+	volatile spinlock_data_t lk_word;	// 1 while held; taken with testandset
+	volatile unsigned lk_waiters;	// threads in the sleep path
+	bool lk_fifo;			// hand off to the first waiter
+
+	// Priority inheritance (under synch.c's pi_lock)
+	struct thread *volatile lk_piwaiters;	// real-time waiters
+	struct thread *lk_piholder;	// holder whose t_pilocks we're on
+	struct lock *lk_pinext;		// next on that list
+#if OPT_LOCKPROF
+	struct lockstat *lk_stat;	// contention stats (by name), or NULL
+	uint64_t lk_holdstart;		// when the holder got it
+#endif
 
 	// (don't forget to mark things volatile as needed)
 };
 
 struct lock *lock_create(const char *name);
+struct lock *lock_create_fifo(const char *name);
 void lock_acquire(struct lock *);
 
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
- *                   same time.
+ *                   same time. If the holder is running on another cpu
+ *                   the caller spins for a while before going to sleep.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
  *
+ * A lock made with lock_create_fifo is granted in arrival order: on
+ * release it passes directly to the longest waiting thread, and
+ * acquirers don't spin or cut in while anyone is waiting. This bounds
+ * waits at the cost of throughput under contention.
+ *
+ * Locks have priority inheritance. A real-time thread (see thread.h)
+ * waiting for a lock lends its priority to the holder, and on up the
+ * chain when the holder is waiting for another lock in turn, up to
+ * PI_MAXDEPTH holders along; each goes back to its own priority when
+ * it releases the lock it was lent it through. So a real-time thread
+ * waits for the critical sections between it and the lock, not for
+ * everything else that would run ahead of their holders.
+ *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
@@ -119,7 +154,7 @@ void lock_destroy(struct lock *);
 
 struct cv {
 	char *cv_name;
-	struct wchan *cv_wchan;
+	struct wchan cv_wchan;
 };
 
 struct cv *cv_create(const char *name);
@@ -129,6 +164,8 @@ void cv_destroy(struct cv *);
  * Operations:
  *    cv_wait      - Release the supplied lock, go to sleep, and, after
  *                   waking up again, re-acquire the lock.
+ *    cv_timedwait - Like cv_wait, but give up after TICKS hardclocks;
+ *                   returns ETIMEDOUT if it did, 0 if woken.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
@@ -139,8 +176,163 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers queue
+ * behind it. Ownership is handed off directly on release, alternating
+ * between the whole batch of waiting readers and one waiting writer,
+ * so neither side can be starved.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;	// protects everything below
+	struct wchan rw_readwchan;	// waiting readers
+	struct wchan rw_writewchan;	// waiting writers
+	struct thread *rw_writer;	// writer holding the lock, if any
+	unsigned rw_readers;		// readers holding the lock
+	unsigned rw_waitreaders;	// readers asleep on rw_readwchan
+	unsigned rw_waitwriters;	// writers asleep on rw_writewchan
+	bool rw_writergrant;		// lock handed to a writer not yet awake
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared.
+ *    rwlock_release_read  - Drop a shared hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Drop an exclusive hold. Only the writer may
+ *                           do this.
+ *    rwlock_do_i_hold_write - True if the current thread is the writer.
+ *
+ * Neither side is recursive; a reader asking for the lock again while
+ * a writer waits will deadlock.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
+/*
+ * Barrier for a fixed number of parties.
+ *
+ * Each party calls barrier_wait, which blocks until all b_parties
+ * have, then lets them all go with one wakeup. It can then be used
+ * again straight away for the next round.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct barrier {
+	char *b_name;
+	struct spinlock b_lock;		// protects everything below
+	struct wchan b_wchan;		// parties waiting for the rest
+	unsigned b_parties;		// how many make up a round
+	unsigned b_arrived;		// how many of this round are in
+};
+
+struct barrier *barrier_create(const char *name, unsigned parties);
+void barrier_destroy(struct barrier *);
+
+/*
+ * Operations:
+ *    barrier_wait - Wait for the rest of the round. Returns true in
+ *                   the last party to arrive, false in the others.
+ *
+ * Any party may destroy the barrier once its barrier_wait returns, as
+ * long as nobody has started on another round.
+ */
+bool barrier_wait(struct barrier *);
+
+
+/*
+ * Completion: a one-shot event threads can wait for.
+ *
+ * completion_wait blocks until complete has been called; complete
+ * wakes everyone waiting with one wakeup, and everyone waiting after
+ * that goes straight through.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct completion {
+	char *cm_name;
+	struct spinlock cm_lock;	// protects everything below
+	struct wchan cm_wchan;		// threads waiting for it
+	bool cm_done;			// complete has been called
+};
+
+struct completion *completion_create(const char *name);
+void completion_destroy(struct completion *);
+
+/*
+ * Operations:
+ *    completion_wait - Wait until the event has happened.
+ *    complete        - Say it has. Only the first call does anything.
+ *
+ * As with barriers, a waiter may destroy the completion once its
+ * completion_wait returns.
+ */
+void completion_wait(struct completion *);
+void complete(struct completion *);
+
+
+/*
+ * Byte-range lock: locks on ranges of something, like a file, that
+ * only get in each other's way if they overlap. Any number of readers
+ * may hold overlapping ranges, but a writer's range overlaps nobody
+ * else's. Requests are granted in the order they were made among those
+ * that overlap, so a writer isn't starved by a stream of readers, and
+ * ones that don't overlap go straight through.
+ *
+ * Each holder supplies a struct rlrange, usually on its stack, for as
+ * long as it holds or waits for the range. A range lock is meant to be
+ * embedded, as in struct vnode, so there is no create and destroy;
+ * the name, as for wchan_init, must stay valid until rangelock_cleanup.
+ */
+struct rlrange {
+	off_t rr_start;			// first byte
+	off_t rr_end;			// one past the last
+	bool rr_write;			// held exclusively
+	struct rlrange *rr_next;	// next range asked for
+};
+
+struct rangelock {
+	struct spinlock rl_lock;	// protects everything below
+	struct wchan rl_wchan;		// threads waiting for a range
+	struct rlrange *rl_head;	// ranges held or waited for, oldest
+	struct rlrange **rl_tail;	//   first
+};
+
+void rangelock_init(struct rangelock *, const char *name);
+void rangelock_cleanup(struct rangelock *);
+
+/*
+ * Operations:
+ *    rangelock_acquire - Get bytes START up to END, exclusively if
+ *                        WRITE is true, filling in RR.
+ *    rangelock_release - Drop the range held in RR.
+ *
+ * Not recursive: asking for a range overlapping one you hold, unless
+ * both are reads and nobody is waiting, deadlocks.
+ */
+void rangelock_acquire(struct rangelock *, struct rlrange *rr,
+		       off_t start, off_t end, bool write);
+void rangelock_release(struct rangelock *, struct rlrange *rr);
+
+
 #endif /* _SYNCH_H_ */
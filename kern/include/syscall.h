@@ -34,10 +34,33 @@
 struct trapframe; /* from <machine/trapframe.h> */
 
 /*
- * The system call dispatcher.
+ * The system call dispatcher, and the shortcut the exception code tries
+ * first for the few calls that need no trapframe (see syscall.c).
  */
 
 void syscall(struct trapframe *tf);
+bool syscall_fast(int callno, int32_t *retval);
+
+/*
+ * Per-syscall accounting. Each cpu keeps a syscall_stat for every call
+ * number below SYSCALL_NCALLS (in struct cpu), updated with interrupts
+ * off on the cpu the call ran on, so the dispatcher never takes a lock.
+ * syscall_printstats() adds them up across cpus and prints them, and
+ * syscall_getstats() returns the sums for call number CALLNO and its
+ * name, or ENOSYS if there's no such call. The sums of another cpu's
+ * counters are only approximate while it's busy.
+ */
+#define SYSCALL_NCALLS  144		/* one past the highest SYS_* number */
+
+struct syscall_stat {
+	uint32_t ss_calls;		/* times the call was made */
+	uint32_t ss_errors;		/* ...and failed */
+	uint64_t ss_nsecs;		/* total time spent in it */
+};
+
+void syscall_printstats(void);
+int syscall_getstats(unsigned callno, const char **name,
+		     struct syscall_stat *total);
 
 /*
  * Support functions.
@@ -49,26 +72,162 @@ void enter_forked_process(void *tf, unsigned long data);
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr, vaddr_t entrypoint);
 
+/* On the way back to user mode: leave if another thread is exiting the process,
+   or exit if the OOM killer picked it. */
+void uthread_checkexit(void);
+
+/* Set up the futex hash table. */
+void futex_bootstrap(void);
+
+/* Wake every futex_wait sleeper in an address space. */
+struct addrspace;
+void futex_wakeas(struct addrspace *as);
+
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
  */
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
+int sys_cputimes(int cpu, userptr_t times, int *retval);
+int sys_vmstats(userptr_t counts, int *retval);
+int sys_utrace(unsigned code, unsigned arg);
 
 #ifdef UW
-int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_open(const_userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fd);
+int sys_read(int fd, userptr_t ubuf, size_t buflen, int *retval);
+int sys_write(int fd, userptr_t ubuf, size_t nbytes, int *retval);
+int sys_pread(int fd, userptr_t ubuf, size_t buflen, off_t offset, int *retval);
+int sys_pwrite(int fd, userptr_t ubuf, size_t nbytes, off_t offset, int *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_getdirentry(int fd, userptr_t ubuf, size_t buflen, int *retval);
+int sys_getdirentries(int fd, userptr_t ubuf, size_t buflen, int *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_fstat(int fd, userptr_t statbuf);
+int sys_fallocate(int fd, off_t pos, off_t len);
+int sys_copy_file_range(int infd, userptr_t inoff, int outfd,
+			userptr_t outoff, size_t len, unsigned flags,
+			int *retval);
+int sys_ioctl(int fd, int code, userptr_t data);
+int sys_pipe(userptr_t fds);
+int sys_ioring_setup(userptr_t uring);
+int sys_ioring_enter(unsigned tosubmit, unsigned mincomplete, int *retval);
+int sys_socket(int domain, int type, int protocol, int *retval);
+int sys_bind(int fd, const_userptr_t addr, socklen_t len);
+int sys_sendto(int fd, userptr_t buf, size_t len, int flags,
+	       const_userptr_t addr, socklen_t addrlen, int *retval);
+int sys_recvfrom(int fd, userptr_t buf, size_t len, int flags,
+		 userptr_t addr, userptr_t addrlen, int *retval);
+int sys_remove(const_userptr_t path);
 void sys__exit(int exitcode);
+void sys__exit_sig(int sig);
 int sys_fork(struct trapframe *ctf, pid_t *retval);
+int sys_vfork(struct trapframe *ctf, pid_t *retval);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
+/**
+	getrusage copies out the resources used so far by the calling process
+	(`who` is RUSAGE_SELF) or by the children it has reaped with waitpid
+	(RUSAGE_CHILDREN).
+*/
+int sys_getrusage(int who, userptr_t usage);
+
+/**
+	User threads. threadfork starts a thread in our address space at
+	`entry`, with `arg` as its argument and `stack` as its stack pointer,
+	and returns its thread ID. threadexit ends the calling thread (and the
+	process, if it is the last one); threadjoin waits for another thread to
+	end and collects its exit code.
+*/
+int sys_threadfork(vaddr_t entry, vaddr_t arg, vaddr_t stack, int *retval);
+void sys_threadexit(int exitcode);
+int sys_threadjoin(int tid, userptr_t status);
+
+/**
+	Cpu affinity. setaffinity limits the calling thread to the cpus whose
+	bits are set in `mask`; getaffinity copies out its current mask.
+	Threads it starts afterwards inherit the mask.
+*/
+int sys_setaffinity(unsigned mask);
+int sys_getaffinity(userptr_t mask);
+
+/**
+	Fair share. setnice sets the nice value of process `pid` (0 for the
+	caller), from SCHED_NICE_MIN to SCHED_NICE_MAX, which weights its
+	share of the CPU; getnice copies it out. Children inherit it.
+*/
+int sys_setnice(pid_t pid, int nice);
+int sys_getnice(pid_t pid, userptr_t nice);
+
+/**
+	Real-time scheduling. sched_setscheduler puts the calling thread in
+	class `policy` (see <kern/sched.h>) at priority `prio`;
+	sched_getscheduler returns its class and copies out its priority.
+	Threads it starts afterwards are SCHED_OTHER.
+*/
+int sys_sched_setscheduler(int policy, int prio);
+int sys_sched_getscheduler(userptr_t prio, int *retval);
+
+/**
+	I/O priority. ioprio_set puts the calling thread in I/O class `class`
+	(see <kern/ioprio.h>); ioprio_get returns its class. Unlike the
+	scheduling class, it's passed on to threads and processes it starts.
+*/
+int sys_ioprio_set(int class);
+int sys_ioprio_get(int *retval);
+
+/**
+	Futexes. futex_wait sleeps while the int at `addr` equals `val`;
+	futex_wake wakes up to `n` sleepers on `addr` and returns how many.
+*/
+int sys_futex_wait(userptr_t addr, int val);
+int sys_futex_wake(userptr_t addr, int n, int *retval);
+
+/**
+	File mapping. mmap maps `len` bytes of the file open on `fd`, from
+	`offset`, and returns the address; munmap removes a whole mapping.
+*/
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+
+/**
+	madvise tells the VM system how the `len` bytes at `addr` will be
+	used (MADV_*); posix_fadvise does the same for a range of the file
+	open on `fd` (POSIX_FADV_*). Both are only hints.
+*/
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_posix_fadvise(int fd, off_t pos, off_t len, int advice);
+
+/**
+	sync_file_range starts writing back the dirty data in `len` bytes of
+	the file open on `fd` from `pos`, and/or waits for writeback of the
+	file already started, as `flags` (SYNC_FILE_RANGE_*) say.
+*/
+int sys_sync_file_range(int fd, off_t pos, off_t len, unsigned flags);
+
+/**
+	poll waits for any of the `nfds` struct pollfds at `fds` to be ready,
+	for up to `timeout` milliseconds, and returns how many are.
+*/
+int sys_poll(userptr_t fds, nfds_t nfds, int timeout, int *retval);
+
 /**
 	`args` should be an array of consecutive strings pointers in user space.
 	The strings each pointer points to are also stored in user space
 */
 int sys_execv(const_userptr_t program, const_userptr_t args[], int *retval);
 
+/**
+	Grow or shrink the heap by `amount` bytes. `retval` gets the old break.
+*/
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+
 #endif // UW
 
 #endif /* _SYSCALL_H_ */
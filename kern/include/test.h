@@ -50,6 +50,9 @@ int catmouse(int, char **);
 /* lib tests */
 int arraytest(int, char **);
 int bitmaptest(int, char **);
+int hashtest(int, char **);
+int radixtest(int, char **);
+int ringtest(int, char **);
 int queuetest(int, char **);
 
 /* thread tests */
@@ -59,6 +62,9 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int synchbench(int, char **);
+int threadbench(int, char **);
+int worktest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -73,18 +79,34 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int fsbench(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallockva(int, char **);
 int nettest(int, char **);
 
-// See runprogram
-int aligned_bytes_required_for(int count, size_t typesize);
-
-/* Routine for running a user-level program. */
-int runprogram(char *progname, char **args, unsigned long argc);
+/*
+ * Arguments for a new program, gathered into one ARG_MAX kernel buffer.
+ * The strings are packed up from the start of ea_buf and their offsets
+ * are kept down from the end, so runprogram can put the whole lot on the
+ * new user stack with two block copies.
+ */
+struct execargs {
+	char *ea_buf;
+	size_t ea_used;			/* bytes of strings */
+	unsigned long ea_argc;
+};
+
+int execargs_init(struct execargs *ea);
+int execargs_add(struct execargs *ea, const char *arg);
+int execargs_copyin(struct execargs *ea, userptr_t uargv);
+void execargs_cleanup(struct execargs *ea);
+
+/* Routine for running a user-level program. Consumes EA. */
+int runprogram(const char *progname, struct execargs *ea);
 
 /* Kernel menu system. */
 void menu(char *argstr);
@@ -39,8 +39,10 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <kern/sched.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -64,6 +66,82 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Scheduling. Ready threads are kept in priority order in each cpu's
+ * run queue, as a multi-level feedback queue: level 0 runs first.
+ * Threads start at level 0, move down a level each time they use up
+ * SCHED_QUANTUM(level) ticks of CPU, move up one when woken from a
+ * wait channel, and go back to level 0 if they sit ready for
+ * SCHED_STARVE_TICKS.
+ *
+ * Within a level, the CPU is shared out fairly between processes
+ * rather than threads. Each process has a virtual runtime that goes up
+ * by SCHED_VTICK / weight for every tick any of its threads runs, the
+ * weight coming from its nice value (SCHED_NICE_MIN..SCHED_NICE_MAX,
+ * 0 being SCHED_VTICK itself and each step about 1.25 times the
+ * next). Threads of a level are ordered by the virtual runtime their
+ * process had when they were queued, least first, so a process with
+ * eight threads gets no more than one with one. Kernel threads each
+ * count as a process of their own. A process that has been asleep is
+ * brought up to SCHED_VCREDIT behind the least virtual runtime its
+ * cpu has dispatched lately, so it gets a head start but can't hold
+ * the cpu for long catching up.
+ *
+ * Real-time threads (SCHED_FIFO and SCHED_RR, see <kern/sched.h>) go
+ * ahead of all of that, by their fixed priority, and aren't charged or
+ * demoted. Waking one that outranks what its cpu is running preempts
+ * it straight away, by IPI if that's another cpu, rather than at its
+ * next tick. So they can't lock the system up, they get at most
+ * SCHED_RT_RUNTIME of every SCHED_RT_PERIOD ticks on a cpu that has
+ * normal threads ready; past that they wait for the next period.
+ */
+#define SCHED_NLEVELS		4
+#define SCHED_QUANTUM(level)	(2U << (level))
+#define SCHED_STARVE_TICKS	50
+#define SCHED_NICE_MIN		(-20)
+#define SCHED_NICE_MAX		19
+#define SCHED_VTICK		1024
+#define SCHED_VCREDIT		(8 * SCHED_VTICK)
+#define SCHED_RT_PERIOD		100
+#define SCHED_RT_RUNTIME	95
+
+/*
+ * Cpu affinity: a set of cpus, one bit per cpu number. There are at
+ * most MAXCPUS (32) of those, so this is enough.
+ */
+typedef uint32_t cpumask_t;
+#define CPUMASK_ALL		((cpumask_t)0xffffffff)
+#define CPUMASK_CPU(num)	((cpumask_t)1 << (num))
+
+/* Per-thread scheduler statistics. Times are in hardclock ticks. */
+struct thread_schedstats {
+	unsigned ss_runs;		/* Times dispatched */
+	unsigned ss_ticks;		/* Ticks spent running */
+	unsigned ss_boosts;		/* Times moved up a level */
+	unsigned ss_demotions;		/* Times moved down a level */
+	unsigned ss_waitticks;		/* Total ticks ready but not running */
+	unsigned ss_maxwait;		/* Longest single such wait */
+	unsigned ss_pulls;		/* Wakeups moved to the waker's cpu */
+	unsigned ss_migrations;		/* Times moved to another cpu */
+};
+
+/*
+ * Resource usage, counted per thread and added up per process (see
+ * proc_getusage). Only the thread itself, or its cpu with interrupts
+ * off, updates these.
+ */
+struct thread_usage {
+	uint64_t tu_utime;		/* Nanoseconds running user code */
+	uint64_t tu_stime;		/* Nanoseconds in the kernel for it */
+	unsigned tu_faults;		/* TLB faults handled */
+	unsigned tu_majflt;		/* ...of those, ones that read the disk */
+	unsigned tu_inblock;		/* Blocks read from disk */
+	unsigned tu_oublock;		/* Blocks dirtied for writing */
+	unsigned tu_nvcsw;		/* Switches from going to sleep */
+	unsigned tu_nivcsw;		/* Switches from yielding or preemption */
+	unsigned tu_syscalls;		/* System calls made */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -72,6 +150,7 @@ struct thread {
 	 */
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	struct wchan *t_sleepwc;	/* Wait channel, if on a sleep queue */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
@@ -101,6 +180,52 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * RCU read sections the thread is in (see rcu.h). Only touched
+	 * by the thread itself, and by hardclock on its cpu.
+	 */
+	unsigned t_rcu_depth;
+
+	/*
+	 * True while the thread is running softints (see softint.h);
+	 * hardclock doesn't preempt it then.
+	 */
+	bool t_in_softint;
+
+	/*
+	 * Scheduler fields. Protected by the run queue lock of t_cpu
+	 * while the thread is ready; otherwise only touched by the
+	 * thread's own cpu with interrupts off. (t_policy and t_rtprio
+	 * may also be changed by thread_setboost, under the run queue
+	 * lock, as may t_basepolicy and t_basertprio by the thread.)
+	 */
+	int t_policy;			/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	unsigned t_rtprio;		/* Real-time priority, if not OTHER */
+	int t_basepolicy;		/* Our own class, without inheritance */
+	unsigned t_basertprio;
+	unsigned t_piboost;		/* Priority inherited through locks */
+	unsigned t_priority;		/* MLFQ level, 0..SCHED_NLEVELS-1 */
+	unsigned t_slice_used;		/* Ticks used at this level */
+	unsigned t_readytick;		/* When last put on a run queue */
+	unsigned t_migratetick;		/* When last moved to another cpu */
+	uint64_t t_vkey;		/* Virtual runtime when queued */
+	uint64_t t_vruntime;		/* Our own, if not in a user process */
+	struct thread *t_lastwaker;	/* Who last woke us; only compared */
+	struct thread *t_handoff;	/* Who we woke here; only compared */
+	cpumask_t t_affinity;		/* Cpus we may run on */
+	struct thread_schedstats t_schedstats;
+
+	/* Charged to t_proc when the thread leaves it */
+	struct thread_usage t_usage;
+
+	/* I/O class (IOPRIO_*) for disk requests; only the thread's own */
+	int t_ioprio;
+
+	/* Priority inheritance; see synch.c. Protected by its pi_lock. */
+	struct lock *t_pilock;		/* Lock we're waiting for */
+	struct thread *t_pinext;	/* Next real-time waiter for it */
+	struct lock *t_pilocks;		/* Held locks with real-time waiters */
+
 	/*
 	 * Public fields
 	 */
@@ -121,8 +246,13 @@ DEFARRAY(thread, THREADINLINE);
 /* Call once during system startup to allocate data structures. */
 void thread_bootstrap(void);
 
-/* Call late in system startup to get secondary CPUs running. */
+/*
+ * Call late in system startup to get secondary CPUs running.
+ * thread_start_cpus only starts them; thread_wait_cpus waits until
+ * they've all checked in, so other boot work can go on in between.
+ */
 void thread_start_cpus(void);
+void thread_wait_cpus(void);
 
 /* Call during panic to stop other threads in their tracks */
 void thread_panic(void);
@@ -144,6 +274,66 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread may only run on the cpus in
+ * AFFINITY rather than on those its creator may. Returns EINVAL if
+ * none of them exist.
+ */
+int thread_fork_pinned(const char *name, struct proc *proc,
+                       cpumask_t affinity,
+                       void (*func)(void *, unsigned long),
+                       void *data1, unsigned long data2);
+
+/*
+ * Like thread_fork, but the new thread is in scheduling class POLICY
+ * at real-time priority RTPRIO from the start (see thread_setsched).
+ * Threads made otherwise start out SCHED_OTHER, whoever made them.
+ */
+int thread_fork_rt(const char *name, struct proc *proc,
+                   int policy, unsigned rtprio,
+                   void (*func)(void *, unsigned long),
+                   void *data1, unsigned long data2);
+
+/*
+ * Restrict the current thread to the cpus in MASK, moving it off this
+ * one at its next context switch if need be. Returns EINVAL if none
+ * of them exist. thread_getaffinity returns the current thread's mask.
+ */
+int thread_setaffinity(cpumask_t mask);
+cpumask_t thread_getaffinity(void);
+
+/*
+ * The fair share weight (see above) for nice value NICE, which must be
+ * between SCHED_NICE_MIN and SCHED_NICE_MAX.
+ */
+unsigned thread_niceweight(int nice);
+
+/*
+ * Put the current thread in scheduling class POLICY, at real-time
+ * priority RTPRIO: SCHED_RTPRIO_MIN..SCHED_RTPRIO_MAX for SCHED_FIFO
+ * and SCHED_RR, 0 for SCHED_OTHER. Returns EINVAL for anything else.
+ * thread_getsched returns the current thread's.
+ */
+int thread_setsched(int policy, unsigned rtprio);
+void thread_getsched(int *policy, unsigned *rtprio);
+
+/*
+ * Put the current thread in I/O class IOCLASS (see <kern/ioprio.h>),
+ * or return EINVAL if there's no such class. Threads it makes from then
+ * on start in it too. thread_getioprio returns the current thread's.
+ */
+int thread_setioprio(int ioclass);
+int thread_getioprio(void);
+
+/*
+ * Have thread T, which needn't be the current one, run at real-time
+ * priority BOOST (as SCHED_FIFO if it's SCHED_OTHER) when that's above
+ * its own class, and in its own class otherwise; a BOOST of 0 takes a
+ * boost away. Re-sorts T if it's in a run queue. For lock priority
+ * inheritance; see synch.h.
+ */
+void thread_setboost(struct thread *t, unsigned boost);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -158,15 +348,29 @@ void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge the current thread for a tick and reshuffle the run queue.
+ * Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Update this cpu's load average and balance load between busy cpus.
+ * Called from the timer interrupt, even when idle.
+ */
+void thread_loadtick(void);
+
+/*
+ * Yield if a thread that goes ahead of the current one has been made
+ * runnable on this cpu since the current one was picked, unless it's
+ * in an RCU read section or running softints. Called on the way out of
+ * interrupts and system calls.
+ */
+void thread_preempt(void);
+
+/*
+ * Print run queue wait times and other scheduler statistics.
  */
-void thread_consider_migration(void);
+void thread_printschedstats(void);
 
 
 #endif /* _THREAD_H_ */
@@ -0,0 +1,55 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Kernel event tracing.
+ *
+ * TRACE(event, a1, a2) records a timestamped event with two words of
+ * data in the current cpu's trace ring, if that event is enabled in
+ * traceflags (bit 1<<event). Like DEBUG(), events are switched on and
+ * off at runtime, by the "trace" menu command or with the debugger,
+ * and cost a test and branch when off. Recording never blocks; the
+ * oldest entries are overwritten.
+ *
+ * Functions:
+ *     trace_bootstrap - allocate the rings. Call before starting the
+ *                       secondary cpus.
+ *     trace_record    - backend for TRACE().
+ *     trace_dump      - print all rings, merged in time order.
+ *     trace_clear     - empty all rings.
+ *     trace_setmirror - also send each event to trace161 through
+ *                       ltrace_debug, as (event << 24) | (a2 & 0xffffff).
+ *
+ * User programs add their own events with the utrace system call,
+ * which records TR_USER with the two words it is given. They go in the
+ * same rings with the same clock, so a dump shows a program's phases
+ * among the switches, faults and I/O they caused.
+ */
+
+/* Events */
+#define TR_SWITCH	0	/* thread_switch: a1 = old thread, a2 = new */
+#define TR_SLEEP	1	/* wchan_sleep: a1 = wchan */
+#define TR_WAKE		2	/* wchan_wake*: a1 = wchan, a2 = thread or 0 */
+#define TR_VMFAULT	3	/* vm_fault: a1 = fault type, a2 = address */
+#define TR_SFSIO	4	/* sfs_rblock/wblock: a1 = 1 if write, a2 = block */
+#define TR_LHDIO	5	/* lhd_io: a1 = 1 if write, a2 = sector */
+#define TR_SYSENTER	6	/* syscall: a1 = call number */
+#define TR_SYSEXIT	7	/* syscall: a1 = call number, a2 = error */
+#define TR_USER		8	/* utrace: a1 = code, a2 = arg, from user */
+#define TR_NEVENTS	9
+
+#define TR_ALL		((1 << TR_NEVENTS) - 1)
+
+extern uint32_t traceflags;
+
+#define TRACE(ev, a1, a2) \
+	((traceflags & (1 << (ev))) ? \
+	 trace_record(ev, (uint32_t)(a1), (uint32_t)(a2)) : (void)0)
+
+void trace_bootstrap(void);
+void trace_record(unsigned event, uint32_t a1, uint32_t a2);
+void trace_dump(void);
+void trace_clear(void);
+void trace_setmirror(bool on);
+
+#endif /* _TRACE_H_ */
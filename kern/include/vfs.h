@@ -74,16 +74,53 @@ const char *vfs_getdevname(struct fs *fs);
  *                     goes to the correct filesystem.
  *    vfs_lookparent - Likewise, for VOP_LOOKPARENT.
  *
- * Both of these may destroy the path passed in.
+ * Neither changes the path passed in, and nor does anything below
+ * them, so callers need not copy it first.
+ *
+ *    vfs_path_next  - Step through PATH a component at a time. Skips
+ *                     any slashes at *PATH and, if a component
+ *                     follows, sets *NAME and *LEN to it, moves *PATH
+ *                     past it, and returns true; returns false at the
+ *                     end of the path. The component is not
+ *                     NUL-terminated unless it is the last one.
  */
 
-int vfs_lookup(char *path, struct vnode **result);
-int vfs_lookparent(char *path, struct vnode **result,
+int vfs_lookup(const char *path, struct vnode **result);
+int vfs_lookparent(const char *path, struct vnode **result,
 		   char *buf, size_t buflen);
+bool vfs_path_next(const char **path, const char **name, size_t *len);
+
+/*
+ * Name cache (vfsnamecache.c). vfs_lookup and vfs_lookparent walk paths
+ * through it a component at a time, to skip VOP_LOOKUP for names seen
+ * recently.
+ *
+ *    vfs_nc_lookup     - Look up NAME in directory DIR. Returns false on a
+ *                        miss, and sets *GEN for a later vfs_nc_enter.
+ *                        On a hit, returns true with *RESULT set to a new
+ *                        reference, or to NULL if NAME is known not to
+ *                        exist.
+ *    vfs_nc_enter      - Remember VN (or NULL, for ENOENT) as the result
+ *                        of looking up NAME in DIR. GEN is what the miss
+ *                        handed back; if anything was invalidated since,
+ *                        nothing is entered.
+ *    vfs_nc_invalidate - Forget NAME in DIR. Must be called after any
+ *                        operation that adds, removes or renames it.
+ *    vfs_nc_purge      - Forget everything, dropping the vnode references
+ *                        the cache holds. Done before unmounting.
+ */
+
+void vfs_nc_bootstrap(void);
+bool vfs_nc_lookup(struct vnode *dir, const char *name,
+		   struct vnode **result, unsigned *gen);
+void vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  unsigned gen);
+void vfs_nc_invalidate(struct vnode *dir, const char *name);
+void vfs_nc_purge(void);
 
 /*
  * VFS layer high-level operations on pathnames
- * Because namei may destroy pathnames, these all may too.
+ * Like vfs_lookup, these leave the pathnames they're given alone.
  *
  *    vfs_open         - Open or create a file. FLAGS/MODE per the syscall.
  *    vfs_readlink     - Read contents of a symlink into a uio.
@@ -101,17 +138,17 @@ int vfs_lookparent(char *path, struct vnode **result,
  *                 (See vfspath.c for a discussion of why.)
  */
 
-int vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret);
+int vfs_open(const char *path, int openflags, mode_t mode, struct vnode **ret);
 void vfs_close(struct vnode *vn);
-int vfs_readlink(char *path, struct uio *data);
-int vfs_symlink(const char *contents, char *path);
-int vfs_mkdir(char *path, mode_t mode);
-int vfs_link(char *oldpath, char *newpath);
-int vfs_remove(char *path);
-int vfs_rmdir(char *path);
-int vfs_rename(char *oldpath, char *newpath);
-
-int vfs_chdir(char *path);
+int vfs_readlink(const char *path, struct uio *data);
+int vfs_symlink(const char *contents, const char *path);
+int vfs_mkdir(const char *path, mode_t mode);
+int vfs_link(const char *oldpath, const char *newpath);
+int vfs_remove(const char *path);
+int vfs_rmdir(const char *path);
+int vfs_rename(const char *oldpath, const char *newpath);
+
+int vfs_chdir(const char *path);
 int vfs_getcwd(struct uio *buf);
 
 /*
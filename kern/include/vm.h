@@ -39,6 +39,10 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+struct uio;
+struct vnode;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -49,14 +53,50 @@ int totalpagecount;
 paddr_t pmemstart;
 paddr_t pmemend;
 
+/*
+ * Largest block the coremap buddy allocator manages, as a power of two
+ * number of pages (2^14 pages = 64MB, more than sys161 will give us).
+ */
+#define COREMAP_MAXORDER 14
+
+/*
+ * Owners in the coremap are indices into a table of address spaces
+ * (see coremap_owner in smartvm.c) rather than pointers. 0 is no owner.
+ */
+#define COREMAP_OWNERS 1024
+
 /**
-	Core map ent
+	Core map entry, one per physical page. Packed into 16 bytes so the
+	clock hand sweeps through four of them per cache line. Every field is
+	protected by stealmem_lock.
 */
 struct coremapentry {
-	bool used; // is this core-map entry being used
-	int nextentry; // if this is a contiguous entry, the next entry should >= 0
-
-	// TODO: RWX here maybe? Could be a quick way of doing it.
+	unsigned used:1; // is this core-map entry being used
+	unsigned isfreehead:1; // first page of a block on a free list
+	unsigned busy:1; // being written out to swap
+	unsigned referenced:1; // touched since the clock hand last passed
+	unsigned order:4; // block is 2^order pages (valid if isfreehead)
+	unsigned refcount:24; // page tables mapping this (user) frame
+
+	// Reverse mapping for page replacement: the one address space mapping
+	// this frame (0 for kernel pages and shared frames, which are never
+	// evicted), and the virtual page it is mapped at
+	unsigned owner:10;
+	unsigned vpage:20;
+	unsigned unused:2;
+
+	// A free block's first page links it into its free list; an allocated
+	// run's first page has its length. A page is never both.
+	union {
+		struct {
+			int freenext; // next/previous free blocks of the same order
+			int freeprev;
+		};
+		struct {
+			int nextentry; // next run of the same allocation, or -1
+			unsigned runlength; // pages in the allocated run starting here (0 if not a start)
+		};
+	};
 };
 
 // Coremap helper method
@@ -68,17 +108,80 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Convert virtual address to physical
-(so long as virtual page is in Coremap) */
-paddr_t vaddr_to_paddr(vaddr_t addr, vaddr_t vbase, paddr_t pbase);
-
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * For tests: with ON, have alloc_kpages map every multi-page request
+ * page by page, as it does when memory is too broken up for a
+ * contiguous run. Returns the old setting; always false without that
+ * fallback.
+ */
+bool vm_kva_force(bool on);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * Forget cached executable pages of a vnode (all of them if NULL); called
+ * before it can be written and before unmounting. Must not be called with
+ * the vfs biglock held.
+ */
+void vm_textcache_purge(struct vnode *v);
+
+/*
+ * Zero-copy pipes: lend the frames behind some whole user pages (they
+ * become copy-on-write), map lent frames copy-on-write over pages of
+ * the reader, and give a loan back. Both of the first two return how
+ * many pages they managed, which may be none.
+ */
+unsigned vm_loanpages(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+		      paddr_t *paddrs);
+unsigned vm_mappages(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+		     const paddr_t *paddrs);
+void vm_unloanpage(paddr_t paddr);
+
+/*
+ * Before a VOP_READ or VOP_WRITE on user buffers: have any pages of
+ * mapped files among them read in first, so that faulting on them with
+ * the file system's locks held never has to call back into it. Returns
+ * the error reading one in, if any.
+ */
+int vm_prefault(struct uio *uio);
+
+/*
+ * Frames for the file page cache (vfs/filecache.c). vm_getpage hands
+ * back a frame with one reference, evicting a user page for it if
+ * memory is full, or 0 if even that fails; its contents are undefined.
+ * It can be mapped into address spaces like any other user frame, each
+ * mapping taking a reference of its own, and vm_putpage drops the
+ * cache's reference.
+ */
+paddr_t vm_getpage(void);
+void vm_putpage(paddr_t paddr);
+
+/*
+ * Memory pressure callbacks (vm/shrink.c). A cache that can give memory
+ * back registers a shrinker; when free memory runs low the VM system
+ * calls vm_shrink, which asks each shrinker in turn to free about
+ * NPAGES pages' worth from its least recently used end until that much
+ * has come back, and returns how much did. sh_shrink returns what it
+ * freed. It is called from a thread that can sleep and holds no VM
+ * locks, but it may be one that faulted with the cache's own lock held,
+ * so it must check for that and give up rather than deadlock.
+ * Shrinkers can be registered at any time, even before vm_bootstrap,
+ * and are never taken off again.
+ */
+struct shrinker {
+	const char *sh_name;
+	unsigned (*sh_shrink)(unsigned npages);
+	struct shrinker *sh_next;
+};
+
+void vm_register_shrinker(struct shrinker *sh);
+unsigned vm_shrink(unsigned npages);
+
 
 #endif /* _VM_H_ */
@@ -30,9 +30,13 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
+#include <synch.h>
 
 struct uio;
 struct stat;
+struct pollwaiter;
+struct fcpage;
 
 /*
  * A struct vnode is an abstract representation of a file.
@@ -50,15 +54,27 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_refcount is changed only atomically (see vnode_incref and
+ * vnode_decref), so taking and dropping references needs no lock.
+ * vn_opencount is protected by vn_countlock, which is the innermost
+ * lock in the filesystem: nothing else may be acquired while holding
+ * it.
+ *
+ * vn_rangelock is there for the filesystem, to let I/O to different
+ * parts of one file go on at once; the VFS layer doesn't touch it.
  */
 struct vnode {
-	int vn_refcount;                /* Reference count */
+	volatile spinlock_data_t vn_refcount;	/* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for vn_opencount */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
 	void *vn_data;                  /* Filesystem-specific data */
 
+	struct rangelock vn_rangelock;  /* Byte ranges of the file */
+
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
 };
 
@@ -135,13 +151,60 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file can be mapped into
+ *                      memory. Mapped pages are moved in and out with
+ *                      vop_getpage if the file system has it, and
+ *                      vop_read and vop_write if not, so it only has
+ *                      to say yes (0) or no (an error code).
+ *
+ *    vop_getpage     - Hand back in *RET page INDEX of the file from
+ *                      the file page cache (see filecache.h), read in
+ *                      and pinned; the caller lets go of it with
+ *                      filecache_release. If FORWRITE is set, the page
+ *                      is about to be written through a mapping, so
+ *                      whatever of it lies within the file must have
+ *                      its storage allocated now. ENOSYS means the
+ *                      file system doesn't cache the file that way.
+ *
+ *    vop_advise      - Take the posix_fadvise() hint ADVICE (one of
+ *                      POSIX_FADV_*) for the LEN bytes of the file from
+ *                      POS, or up to its end if LEN is 0. As it's only
+ *                      a hint, ignoring it is fine; ESPIPE for objects
+ *                      that have no positions, like pipes.
+ *
+ *    vop_syncrange   - For sync_file_range(): with SYNC_FILE_RANGE_WRITE
+ *                      in FLAGS, start writing back the dirty data in
+ *                      the LEN bytes from POS (or to the end if LEN is
+ *                      0), without waiting for it. With _WAIT_BEFORE,
+ *                      first wait for any writeback started earlier,
+ *                      and with _WAIT_AFTER, wait last of all. A wait
+ *                      returns the first error since the last one.
+ *                      Objects with nothing to write back just return 0.
+ *
+ *    vop_poll        - Set *REVENTS to which of the poll() EVENTS (and
+ *                      POLLERR and POLLHUP) are ready now, first adding
+ *                      the pollwaiter, if not NULL, to the object's
+ *                      pollqueue (see <poll.h>). Objects that never
+ *                      block are simply always ready.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
  *
+ *    vop_fallocate   - Allocate storage for the LEN bytes of the file
+ *                      starting at POS, so writing them later won't
+ *                      run out of space, and grow the file to POS+LEN
+ *                      if it was shorter. POS is at least 0 and LEN
+ *                      more than 0.
+ *
+ *    vop_copyrange   - Copy up to LEN bytes of file SRC from SPOS into
+ *                      this file at POS, without going through a uio,
+ *                      and hand back in *COPIED how many went (fewer
+ *                      than LEN only at SRC's end of file). SRC may be
+ *                      on another filesystem, and may be this file if
+ *                      the two ranges don't overlap. ENOSYS means the
+ *                      filesystem can't do this one itself and the
+ *                      caller should copy through a buffer instead.
+ *
  *    vop_namefile    - Compute pathname relative to filesystem root
  *                      of the file and copy to the specified
  *                      uio. Need not work on objects that are not
@@ -178,15 +241,15 @@ struct vnode {
  *
  *    vop_lookup      - Parse PATHNAME relative to the passed directory
  *                      DIR, and hand back the vnode for the file it
- *                      refers to. May destroy PATHNAME. Should increment
- *                      refcount on vnode handed back.
+ *                      refers to. Must not change PATHNAME. Should
+ *                      increment refcount on vnode handed back.
  *
  *    vop_lookparent  - Parse PATHNAME relative to the passed directory
  *                      DIR, and hand back (1) the vnode for the
  *                      parent directory of the file it refers to, and
  *                      (2) the last component of the filename, copied
- *                      into kernel buffer BUF with max length LEN. May
- *                      destroy PATHNAME. Should increment refcount on
+ *                      into kernel buffer BUF with max length LEN. Must
+ *                      not change PATHNAME. Should increment refcount on
  *                      vnode handed back.
  */
 
@@ -209,8 +272,19 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	int (*vop_tryseek)(struct vnode *object, off_t pos);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file);
+	int (*vop_getpage)(struct vnode *file, uint32_t index, bool forwrite,
+			   struct fcpage **ret);
+	int (*vop_advise)(struct vnode *file, off_t pos, off_t len,
+			  int advice);
+	int (*vop_syncrange)(struct vnode *file, off_t pos, off_t len,
+			     unsigned flags);
+	int (*vop_poll)(struct vnode *object, int events,
+			struct pollwaiter *pw, int *revents);
 	int (*vop_truncate)(struct vnode *file, off_t len);
+	int (*vop_fallocate)(struct vnode *file, off_t pos, off_t len);
+	int (*vop_copyrange)(struct vnode *file, off_t pos, struct vnode *src,
+			     off_t spos, off_t len, off_t *copied);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
 
@@ -233,9 +307,9 @@ struct vnode_ops {
 
 
 	int (*vop_lookup)(struct vnode *dir,
-			  char *pathname, struct vnode **result);
+			  const char *pathname, struct vnode **result);
 	int (*vop_lookparent)(struct vnode *dir,
-			      char *pathname, struct vnode **result,
+			      const char *pathname, struct vnode **result,
 			      char *buf, size_t len);
 };
 
@@ -254,8 +328,15 @@ struct vnode_ops {
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_TRYSEEK(vn, pos)            (__VOP(vn, tryseek)(vn, pos))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_MMAP(vn)                    (__VOP(vn, mmap)(vn))
+#define VOP_GETPAGE(vn, idx, wr, res)   (__VOP(vn, getpage)(vn, idx, wr, res))
+#define VOP_ADVISE(vn, pos, len, adv)   (__VOP(vn, advise)(vn, pos, len, adv))
+#define VOP_SYNCRANGE(vn, pos, len, fl) (__VOP(vn, syncrange)(vn, pos, len, fl))
+#define VOP_POLL(vn, ev, pw, rev)       (__VOP(vn, poll)(vn, ev, pw, rev))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_FALLOCATE(vn, pos, len)     (__VOP(vn, fallocate)(vn, pos, len))
+#define VOP_COPYRANGE(vn, pos, src, spos, len, res) \
+	(__VOP(vn, copyrange)(vn, pos, src, spos, len, res))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -276,9 +357,18 @@ void vnode_check(struct vnode *, const char *op);
 
 /*
  * Reference count manipulation (handled above filesystem level)
+ *
+ * VOP_DECREF calls VOP_RECLAIM without holding any locks when the
+ * count it saw was 1; the reclaim routine must recheck the count
+ * under its own vnode table lock and, if someone has picked the vnode
+ * up again meanwhile, drop that one reference itself and return EBUSY.
+ * vnode_decref_notlast does both: it drops the reference and returns
+ * true unless it was the last one, in which case it returns false and
+ * leaves the count at 1 for the reclaim to go ahead with.
  */
 void vnode_incref(struct vnode *);
 void vnode_decref(struct vnode *);
+bool vnode_decref_notlast(struct vnode *);
 
 #define VOP_INCREF(vn) 			vnode_incref(vn)
 #define VOP_DECREF(vn) 			vnode_decref(vn)
@@ -32,10 +32,43 @@
 
 /*
  * Wait channel.
+ *
+ * A wait channel holds no threads and no lock of its own. Sleepers go
+ * on one of a fixed set of sleep queues, picked by hashing the
+ * channel's address, and locking the channel locks that queue. So a
+ * channel is only a few words and can be embedded in the thing that
+ * waits on it, which is what the synchronization primitives do.
+ *
+ * There are two sets of queues. Locks and rwlocks use the second
+ * (wchan_init_lock), because cv_wait releases a lock with its own
+ * channel locked; were the two in one set they might share a queue.
+ * For the same reason, don't wake or lock one channel while holding
+ * another's lock unless they come from different sets.
  */
 
 
-struct wchan; /* Opaque */
+struct sleepq;
+
+struct wchan {
+	const char *wc_name;		/* name for this channel */
+	struct sleepq *wc_sq;		/* where its sleepers go */
+	unsigned wc_latslot;		/* histogram for time asleep */
+};
+
+/*
+ * Set up a wait channel embedded in something else. Use NAME as a
+ * symbolic name for the channel; it must stay valid until the channel
+ * is cleaned up. wchan_init_lock is the same, for the wait channel of
+ * a lock (see above).
+ */
+void wchan_init(struct wchan *wc, const char *name);
+void wchan_init_lock(struct wchan *wc, const char *name);
+
+/*
+ * Clean up a wait channel set up with wchan_init. Must be empty and
+ * unlocked.
+ */
+void wchan_cleanup(struct wchan *wc);
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -81,5 +114,13 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up thread T, but only if it's sleeping on WC; returns whether
+ * it was. For timeouts, which need to wake one particular sleeper.
+ * The queue should not already be locked.
+ */
+struct thread;
+bool wchan_wakethread(struct wchan *wc, struct thread *t);
+
 
 #endif /* _WCHAN_H_ */
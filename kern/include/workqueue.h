@@ -0,0 +1,67 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Work queues: run functions later, in a thread.
+ *
+ * A work queue is a list of work items and a pool of kernel threads
+ * that take them off it one at a time and call them. Work functions
+ * run in ordinary thread context and may sleep, take locks, and do
+ * I/O. Anything can queue work, interrupt handlers and timeouts
+ * included, so a background job that used to need a thread of its own
+ * can be a work item queued whenever there's something to do.
+ *
+ * kworkq is the system's queue. Since its threads are shared, work
+ * that waits a long time (for the disk, say) ties one of them up; a
+ * job that blocks indefinitely should have a thread of its own.
+ *
+ * A work item is never on more than one queue, and never runs on two
+ * threads at once: if it's queued again while it runs, it runs again
+ * once it returns. Queueing one that is already waiting does nothing.
+ * It may not be freed while queued or running; in particular a work
+ * function can't free its own item.
+ *
+ * Functions:
+ *     workqueue_bootstrap  - create kworkq.
+ *     workqueue_create     - create a queue run by NTHREADS threads
+ *                            called NAME. Panics on failure, since
+ *                            queues are set up at boot.
+ *     work_init            - set up W to call FUNC(ARG).
+ *     work_enqueue         - queue W on WQ. Returns false if it was
+ *                            already waiting there.
+ *     work_enqueue_delayed - queue W on WQ in TICKS hardclocks. W must
+ *                            not already be waiting for that.
+ *     work_wait            - wait until W is neither queued nor running,
+ *                            so it can be freed. Not from W's own
+ *                            function, and not while W is waiting on a
+ *                            delay.
+ */
+
+#include <clock.h>	/* for struct timeout */
+
+struct workqueue;
+
+struct work {
+	struct work *w_next;		/* on the queue */
+	void (*w_func)(void *);
+	void *w_arg;
+	unsigned w_state;		/* WORK_*; under the queue's lock */
+	struct workqueue *w_wq;		/* queue it goes on */
+	struct timeout w_timeout;	/* for work_enqueue_delayed */
+};
+
+/* w_state bits */
+#define WORK_QUEUED	1	/* waiting to run (again) */
+#define WORK_RUNNING	2	/* a thread is calling it */
+
+extern struct workqueue *kworkq;
+
+void workqueue_bootstrap(void);
+struct workqueue *workqueue_create(const char *name, unsigned nthreads);
+void work_init(struct work *w, void (*func)(void *), void *arg);
+bool work_enqueue(struct workqueue *wq, struct work *w);
+void work_enqueue_delayed(struct workqueue *wq, struct work *w,
+			  unsigned ticks);
+void work_wait(struct work *w);
+
+#endif /* _WORKQUEUE_H_ */
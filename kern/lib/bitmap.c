@@ -27,8 +27,19 @@
  * SUCH DAMAGE.
  */
 
+
 /*
  * Fixed-size array of bits. (Intended for storage management.)
+ *
+ * To keep allocation from getting slower as the bitmap fills up, the
+ * bits are split into groups of BITS_PER_GROUP and a count of clear
+ * bits is kept for each, so searches skip full groups without looking
+ * at them. bitmap_alloc also remembers the first group that might have
+ * a clear bit, since everything before it is known to be full.
+ *
+ * Within a group, scans skip 32 bits at a time while they're all set
+ * (or, looking for a set bit, all clear), then find the bit in a word
+ * with a count-trailing-zeros instruction.
  */
 
 #include <types.h>
@@ -47,9 +58,23 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+#define WORDS_PER_GROUP 64
+#define BITS_PER_GROUP  (WORDS_PER_GROUP * BITS_PER_WORD)
+
+/*
+ * Chunk of words looked at in one go. Whether a chunk is all ones or
+ * all zeros doesn't depend on byte order, so this is safe with the
+ * byte-wide words above.
+ */
+#define WORDS_PER_CHUNK (sizeof(uint32_t) / sizeof(WORD_TYPE))
+#define BITS_PER_CHUNK  (WORDS_PER_CHUNK * BITS_PER_WORD)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned ngroups;
+        unsigned *groupfree;    /* clear bits in each group */
+        unsigned firstgroup;    /* groups before this are full */
 };
 
 
@@ -69,6 +94,13 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->ngroups = DIVROUNDUP(words, WORDS_PER_GROUP);
+        b->groupfree = kmalloc(b->ngroups*sizeof(unsigned));
+        if (b->groupfree == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
@@ -86,6 +118,7 @@ bitmap_create(unsigned nbits)
                 }
         }
 
+        bitmap_resync(b);
         return b;
 }
 
@@ -95,27 +128,147 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+void
+bitmap_resync(struct bitmap *b)
+{
+        unsigned words = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, g;
+        WORD_TYPE w;
+
+        for (g=0; g<b->ngroups; g++) {
+                b->groupfree[g] = 0;
+        }
+        for (ix=0; ix<words; ix++) {
+                for (w = ~b->v[ix] & WORD_ALLBITS; w != 0; w &= w-1) {
+                        b->groupfree[ix / WORDS_PER_GROUP]++;
+                }
+        }
+        b->firstgroup = 0;
+}
+
+/*
+ * The chunk starting at word IX, if BIT (the first bit in word IX) is
+ * at the start of one and the whole chunk is before END; otherwise
+ * something that is neither all ones nor all zeros.
+ */
+static
+inline
+uint32_t
+bitmap_chunk(struct bitmap *b, unsigned bit, unsigned end, unsigned ix)
+{
+        uint32_t chunk;
+
+        if (bit % BITS_PER_CHUNK != 0 || end - bit < BITS_PER_CHUNK) {
+                return 1;
+        }
+        memcpy(&chunk, &b->v[ix], sizeof(chunk));
+        return chunk;
+}
+
+/*
+ * Find the first clear bit from START up to (not including) END.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findclear(struct bitmap *b, unsigned start, unsigned end,
+                 unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned bit = start;
+        unsigned ix, found;
+        WORD_TYPE w;
+
+        while (bit < end) {
+                if (b->groupfree[bit / BITS_PER_GROUP] == 0) {
+                        /* Skip to the next group */
+                        bit = (bit / BITS_PER_GROUP + 1) * BITS_PER_GROUP;
+                        continue;
+                }
+
+                ix = bit / BITS_PER_WORD;
+                if (bitmap_chunk(b, bit, end, ix) == 0xffffffff) {
+                        bit += BITS_PER_CHUNK;
+                        continue;
+                }
+
+                /* Look at this word, ignoring bits before START */
+                w = b->v[ix] | (((WORD_TYPE)1 << (bit % BITS_PER_WORD)) - 1);
+                if (w != WORD_ALLBITS) {
+                        found = ix*BITS_PER_WORD +
+                                __builtin_ctz(~w & WORD_ALLBITS);
+                        if (found >= end) {
+                                break;
+                        }
+                        *index = found;
+                        return 0;
+                }
+                bit = (ix+1) * BITS_PER_WORD;
+        }
+        return ENOSPC;
+}
+
+/*
+ * Find the first set bit from START up to (not including) END.
+ */
+static
+int
+bitmap_findset(struct bitmap *b, unsigned start, unsigned end,
+               unsigned *index)
+{
+        unsigned bit = start;
+        unsigned ix, found;
+        WORD_TYPE w;
+
+        while (bit < end) {
+                if (b->groupfree[bit / BITS_PER_GROUP] == BITS_PER_GROUP) {
+                        /* Skip to the next group */
+                        bit = (bit / BITS_PER_GROUP + 1) * BITS_PER_GROUP;
+                        continue;
+                }
+
+                ix = bit / BITS_PER_WORD;
+                if (bitmap_chunk(b, bit, end, ix) == 0) {
+                        bit += BITS_PER_CHUNK;
+                        continue;
+                }
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
+                /* Look at this word, ignoring bits before START */
+                w = b->v[ix] & ~(((WORD_TYPE)1 << (bit % BITS_PER_WORD)) - 1);
+                if (w != 0) {
+                        found = ix*BITS_PER_WORD + __builtin_ctz(w);
+                        if (found >= end) {
+                                break;
                         }
-                        KASSERT(0);
+                        *index = found;
+                        return 0;
+                }
+                bit = (ix+1) * BITS_PER_WORD;
+        }
+        return ENOENT;
+}
+
+/*
+ * Find the first run of N clear bits that starts from START up to (not
+ * including) LIMIT. The run itself may go past LIMIT.
+ */
+static
+int
+bitmap_findrun(struct bitmap *b, unsigned n, unsigned start, unsigned limit,
+               unsigned *index)
+{
+        unsigned first, set;
+
+        while (start < limit) {
+                if (bitmap_findclear(b, start, limit, &first)) {
+                        break;
+                }
+                if (n > b->nbits - first) {
+                        break;
+                }
+                if (bitmap_findset(b, first, first + n, &set)) {
+                        *index = first;
+                        return 0;
                 }
+                start = set + 1;
         }
         return ENOSPC;
 }
@@ -131,6 +284,63 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_findclear(b, b->firstgroup * BITS_PER_GROUP,
+                                  b->nbits, index);
+        if (result) {
+                b->firstgroup = b->ngroups;
+                return result;
+        }
+        KASSERT(*index < b->nbits);
+        b->firstgroup = *index / BITS_PER_GROUP;
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        if (bitmap_findclear(b, hint, b->nbits, index) &&
+            bitmap_findclear(b, 0, hint, index)) {
+                return ENOSPC;
+        }
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+int
+bitmap_alloc_run(struct bitmap *b, unsigned n, unsigned hint,
+                 unsigned *index)
+{
+        unsigned i;
+
+        KASSERT(n > 0);
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+        if (bitmap_findrun(b, n, hint, b->nbits, index) &&
+            bitmap_findrun(b, n, 0, hint, index)) {
+                return ENOSPC;
+        }
+        for (i=0; i<n; i++) {
+                bitmap_mark(b, *index + i);
+        }
+        return 0;
+}
+
+int
+bitmap_find_next_zero(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        return bitmap_findclear(b, hint, b->nbits, index);
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
@@ -142,6 +352,8 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        KASSERT(b->groupfree[index / BITS_PER_GROUP] > 0);
+        b->groupfree[index / BITS_PER_GROUP]--;
 }
 
 void
@@ -155,6 +367,40 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        b->groupfree[index / BITS_PER_GROUP]++;
+        if (index / BITS_PER_GROUP < b->firstgroup) {
+                b->firstgroup = index / BITS_PER_GROUP;
+        }
+}
+
+/*
+ * Bits at the ends of the run go one at a time; whole words in the
+ * middle are cleared at once.
+ */
+void
+bitmap_unmark_run(struct bitmap *b, unsigned index, unsigned n)
+{
+        unsigned end = index + n;
+        unsigned ix;
+
+        KASSERT(end <= b->nbits);
+
+        while (index < end && index % BITS_PER_WORD != 0) {
+                bitmap_unmark(b, index++);
+        }
+        while (end - index >= BITS_PER_WORD) {
+                ix = index / BITS_PER_WORD;
+                KASSERT(b->v[ix] == WORD_ALLBITS);
+                b->v[ix] = 0;
+                b->groupfree[index / BITS_PER_GROUP] += BITS_PER_WORD;
+                if (index / BITS_PER_GROUP < b->firstgroup) {
+                        b->firstgroup = index / BITS_PER_GROUP;
+                }
+                index += BITS_PER_WORD;
+        }
+        while (index < end) {
+                bitmap_unmark(b, index++);
+        }
 }
 
 
@@ -171,6 +417,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->groupfree);
         kfree(b->v);
         kfree(b);
 }
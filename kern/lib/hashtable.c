@@ -0,0 +1,199 @@
+/*
+ * Intrusive hash table. See hashtable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <hashtable.h>
+
+/* Smallest table, and average chain length before it doubles */
+#define HT_MINSIZE	8
+#define HT_MAXLOAD	2
+
+#define HT_CHAIN(ht, hash) (&(ht)->ht_chains[(hash) & ((ht)->ht_size - 1)])
+
+static
+void
+hashtable_link(struct hashlink **chain, struct hashlink *link)
+{
+	link->hl_next = *chain;
+	link->hl_prevp = chain;
+	if (*chain != NULL) {
+		(*chain)->hl_prevp = &link->hl_next;
+	}
+	*chain = link;
+}
+
+int
+hashtable_init(struct hashtable *ht, unsigned size)
+{
+	unsigned i;
+
+	ht->ht_size = HT_MINSIZE;
+	while (ht->ht_size < size) {
+		ht->ht_size *= 2;
+	}
+	ht->ht_chains = kmalloc(ht->ht_size * sizeof(struct hashlink *));
+	if (ht->ht_chains == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<ht->ht_size; i++) {
+		ht->ht_chains[i] = NULL;
+	}
+	ht->ht_count = 0;
+	return 0;
+}
+
+void
+hashtable_cleanup(struct hashtable *ht)
+{
+	/* As with arrays, we can't free what the entries point to. */
+	KASSERT(ht->ht_count == 0);
+	kfree(ht->ht_chains);
+	ht->ht_chains = NULL;
+}
+
+unsigned
+hashtable_count(const struct hashtable *ht)
+{
+	return ht->ht_count;
+}
+
+/*
+ * Double the number of chains, if we can get the memory.
+ */
+static
+void
+hashtable_grow(struct hashtable *ht)
+{
+	struct hashlink **oldchains, *link;
+	unsigned i, oldsize;
+
+	oldchains = ht->ht_chains;
+	oldsize = ht->ht_size;
+
+	ht->ht_chains = kmalloc(2 * oldsize * sizeof(struct hashlink *));
+	if (ht->ht_chains == NULL) {
+		ht->ht_chains = oldchains;
+		return;
+	}
+	ht->ht_size = 2 * oldsize;
+	for (i=0; i<ht->ht_size; i++) {
+		ht->ht_chains[i] = NULL;
+	}
+
+	for (i=0; i<oldsize; i++) {
+		while (oldchains[i] != NULL) {
+			link = oldchains[i];
+			oldchains[i] = link->hl_next;
+			hashtable_link(HT_CHAIN(ht, link->hl_hash), link);
+		}
+	}
+	kfree(oldchains);
+}
+
+void
+hashtable_add(struct hashtable *ht, struct hashlink *link, void *self,
+	      uint32_t hash)
+{
+	if (ht->ht_count >= ht->ht_size * HT_MAXLOAD) {
+		hashtable_grow(ht);
+	}
+
+	link->hl_self = self;
+	link->hl_hash = hash;
+	hashtable_link(HT_CHAIN(ht, hash), link);
+	ht->ht_count++;
+}
+
+void
+hashtable_remove(struct hashtable *ht, struct hashlink *link)
+{
+	KASSERT(ht->ht_count > 0);
+	KASSERT(*link->hl_prevp == link);
+
+	*link->hl_prevp = link->hl_next;
+	if (link->hl_next != NULL) {
+		link->hl_next->hl_prevp = link->hl_prevp;
+	}
+	link->hl_next = NULL;
+	link->hl_prevp = NULL;
+	ht->ht_count--;
+}
+
+/*
+ * Next entry on LINK's chain with the same hash value, starting with
+ * LINK itself.
+ */
+static
+struct hashlink *
+hashtable_samehash(struct hashlink *link, uint32_t hash)
+{
+	while (link != NULL && link->hl_hash != hash) {
+		link = link->hl_next;
+	}
+	return link;
+}
+
+struct hashlink *
+hashtable_first(const struct hashtable *ht, uint32_t hash)
+{
+	return hashtable_samehash(*HT_CHAIN(ht, hash), hash);
+}
+
+struct hashlink *
+hashtable_nexthash(const struct hashlink *link)
+{
+	return hashtable_samehash(link->hl_next, link->hl_hash);
+}
+
+struct hashlink *
+hashtable_next(const struct hashtable *ht, const struct hashlink *link)
+{
+	unsigned i;
+
+	if (link != NULL) {
+		if (link->hl_next != NULL) {
+			return link->hl_next;
+		}
+		i = (link->hl_hash & (ht->ht_size - 1)) + 1;
+	}
+	else {
+		i = 0;
+	}
+
+	for (; i<ht->ht_size; i++) {
+		if (ht->ht_chains[i] != NULL) {
+			return ht->ht_chains[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Hash functions.
+ */
+
+uint32_t
+hash_uint32(uint32_t key)
+{
+	/* The MurmurHash3 finalizer: every input bit affects the low bits */
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+	return key;
+}
+
+uint32_t
+hash_string(const char *key)
+{
+	uint32_t h = 5381;
+
+	while (*key) {
+		h = h*33 + (unsigned char)*key++;
+	}
+	return h;
+}
@@ -34,8 +34,12 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
 #include <mainbus.h>
+#include <membar.h>
+#include <ring.h>
+#include <workqueue.h>
 #include <vfs.h>          // for vfs_sync()
 
 
@@ -48,6 +52,33 @@ static struct lock *kprintf_lock;
 /* Lock for polled kprintfs */
 static struct spinlock kprintf_spinlock;
 
+/*
+ * Per-cpu log ring for klog_printf. The owning cpu is the only
+ * producer, at splhigh; the klog job is the only consumer (or
+ * panic, once nothing else is running).
+ */
+#define KLOG_SIZE 4096		/* must be a power of 2 */
+#define KLOG_HISTSIZE 4096	/* must be a power of 2 */
+#define KLOG_CHUNK 128
+
+struct klogbuf {
+	struct spscring kb_ring;
+	char kb_buf[KLOG_SIZE];
+	volatile bool kb_signalled;	/* klog job already queued */
+	unsigned kb_dropped;		/* bytes lost to a full ring */
+	unsigned kb_dropreported;	/* kb_dropped last time we said so */
+};
+
+static bool klog_ready;
+static struct work klog_work;		/* drains the rings */
+
+/* Copy of recent klog output for klog_dmesg */
+static struct lock *klog_histlock;
+static char klog_hist[KLOG_HISTSIZE];
+static unsigned klog_histhead;
+
+static void klog_drainall(void *);
+
 
 /*
  * Warning: all this has to work from interrupt handlers and when
@@ -64,11 +95,35 @@ kprintf_bootstrap(void)
 {
 	KASSERT(kprintf_lock == NULL);
 
+	unsigned i;
+	struct cpu *c;
+
 	kprintf_lock = lock_create("kprintf_lock");
 	if (kprintf_lock == NULL) {
 		panic("Could not create kprintf_lock\n");
 	}
 	spinlock_init(&kprintf_spinlock);
+
+	klog_histlock = lock_create("klog_hist");
+	if (klog_histlock == NULL) {
+		panic("Could not create klog synchronization\n");
+	}
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		c->c_klog = kmalloc(sizeof(struct klogbuf));
+		if (c->c_klog == NULL) {
+			panic("Could not allocate klog buffer for cpu %u\n", i);
+		}
+		spscring_init(&c->c_klog->kb_ring, c->c_klog->kb_buf, 1,
+			      KLOG_SIZE);
+		c->c_klog->kb_signalled = false;
+		c->c_klog->kb_dropped = 0;
+		c->c_klog->kb_dropreported = 0;
+	}
+	klog_histhead = 0;
+
+	work_init(&klog_work, klog_drainall, NULL);
+	klog_ready = true;
 }
 
 /*
@@ -124,6 +179,183 @@ kprintf(const char *fmt, ...)
 	return chars;
 }
 
+////////////////////////////////////////////////////////////
+//
+// klog
+
+/*
+ * Backend for __printf: append to the current cpu's ring. Anything
+ * that doesn't fit is dropped. Runs at splhigh.
+ */
+static
+void
+klog_send(void *vkb, const char *data, size_t len)
+{
+	struct klogbuf *kb = vkb;
+	unsigned n;
+
+	n = spscring_put(&kb->kb_ring, data, len);
+	kb->kb_dropped += len - n;
+}
+
+/*
+ * Printf into the log. Never sleeps or spins; usable from anywhere,
+ * including with spinlocks held. Before the klog job is set up this
+ * just calls kprintf.
+ */
+int
+klog_printf(const char *fmt, ...)
+{
+	int chars, spl;
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (!klog_ready) {
+		chars = __vprintf(console_send, NULL, fmt, ap);
+		va_end(ap);
+		return chars;
+	}
+
+	/* Stay on this cpu, and keep its interrupt handlers out */
+	spl = splhigh();
+	chars = __vprintf(klog_send, curcpu->c_klog, fmt, ap);
+	splx(spl);
+	va_end(ap);
+
+	return chars;
+}
+
+/*
+ * Called from hardclock: if this cpu has logged something, queue the
+ * klog job. (klog_printf can't do it itself, since that takes locks.)
+ */
+void
+klog_tick(void)
+{
+	struct klogbuf *kb = curcpu->c_klog;
+
+	if (kb == NULL || kb->kb_signalled ||
+	    spscring_count(&kb->kb_ring) == 0) {
+		return;
+	}
+	kb->kb_signalled = true;
+	work_enqueue(kworkq, &klog_work);
+}
+
+/*
+ * Remember LEN bytes of output for klog_dmesg.
+ */
+static
+void
+klog_remember(const char *data, size_t len)
+{
+	size_t i;
+
+	KASSERT(lock_do_i_hold(klog_histlock));
+	for (i=0; i<len; i++) {
+		klog_hist[klog_histhead % KLOG_HISTSIZE] = data[i];
+		klog_histhead++;
+	}
+}
+
+/*
+ * Move everything pending in one cpu's ring to the console.
+ */
+static
+void
+klog_drain(struct klogbuf *kb, unsigned cpunum)
+{
+	char chunk[KLOG_CHUNK + 1];
+	unsigned n, dropped;
+
+	/* Clear this first, so output added while we drain gets a wakeup */
+	kb->kb_signalled = false;
+	membar_any_any();
+
+	lock_acquire(klog_histlock);
+	while ((n = spscring_get(&kb->kb_ring, chunk, KLOG_CHUNK)) > 0) {
+		chunk[n] = 0;
+		klog_remember(chunk, n);
+		kprintf("%s", chunk);
+	}
+
+	dropped = kb->kb_dropped;
+	if (dropped != kb->kb_dropreported) {
+		kprintf("klog: cpu%u: dropped %u bytes\n", cpunum,
+			dropped - kb->kb_dropreported);
+		kb->kb_dropreported = dropped;
+	}
+	lock_release(klog_histlock);
+}
+
+/*
+ * The klog job on kworkq: empty every cpu's ring.
+ */
+static
+void
+klog_drainall(void *junk)
+{
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<cpu_count(); i++) {
+		klog_drain(cpu_get(i)->c_klog, i);
+	}
+}
+
+/*
+ * Print the most recent klog output again.
+ */
+void
+klog_dmesg(void)
+{
+	char chunk[KLOG_CHUNK + 1];
+	unsigned pos, end, n, i;
+
+	lock_acquire(klog_histlock);
+	end = klog_histhead;
+	pos = end > KLOG_HISTSIZE ? end - KLOG_HISTSIZE : 0;
+	while (pos != end) {
+		n = end - pos;
+		if (n > KLOG_CHUNK) {
+			n = KLOG_CHUNK;
+		}
+		for (i=0; i<n; i++) {
+			chunk[i] = klog_hist[(pos + i) % KLOG_HISTSIZE];
+		}
+		chunk[n] = 0;
+		pos += n;
+		kprintf("%s", chunk);
+	}
+	lock_release(klog_histlock);
+}
+
+/*
+ * Print whatever is still sitting in the rings, by polling. For
+ * panic, so the trace leading up to it isn't lost.
+ */
+static
+void
+klog_flushpolled(void)
+{
+	struct klogbuf *kb;
+	char ch;
+	unsigned i;
+
+	if (!klog_ready) {
+		return;
+	}
+	putch_prepare();
+	for (i=0; i<cpu_count(); i++) {
+		kb = cpu_get(i)->c_klog;
+		while (spscring_get(&kb->kb_ring, &ch, 1) > 0) {
+			putch(ch);
+		}
+	}
+	putch_complete();
+}
+
 /*
  * panic() is for fatal errors. It prints the printf arguments it's
  * passed and then halts the system.
@@ -169,7 +401,8 @@ panic(const char *fmt, ...)
 	if (evil == 2) {
 		evil = 3;
 
-		/* Print the message. */
+		/* Print the message, after any pending log output. */
+		klog_flushpolled();
 		kprintf("panic: ");
 		putch_prepare();
 		va_start(ap, fmt);
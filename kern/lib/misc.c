@@ -30,16 +30,17 @@
 #include <types.h>
 #include <kern/errmsg.h>
 #include <lib.h>
+#include <vm.h>
 
 /*
- * Like strdup, but calls kmalloc.
+ * Like strdup, but calls kmalloc, charging the copy to TAG.
  */
 char *
-kstrdup(const char *s)
+kstrdup_tagged(const char *s, unsigned tag)
 {
 	char *z;
 
-	z = kmalloc(strlen(s)+1);
+	z = kmalloc_tagged(strlen(s)+1, tag);
 	if (z == NULL) {
 		return NULL;
         }
@@ -60,3 +61,63 @@ strerror(int errcode)
 	panic("Invalid error code %d\n", errcode);
 	return NULL;
 }
+
+/*
+ * Zero one whole page. With the alignment and size known up front
+ * there are no edge cases, so just store a 32-byte line of words per
+ * iteration.
+ */
+void
+memzero_page(void *page)
+{
+	uint32_t *p = page;
+	uint32_t *end = p + PAGE_SIZE / sizeof(*p);
+
+	KASSERT((vaddr_t)page % PAGE_SIZE == 0);
+
+	for (; p < end; p += 8) {
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = 0;
+		p[3] = 0;
+		p[4] = 0;
+		p[5] = 0;
+		p[6] = 0;
+		p[7] = 0;
+	}
+}
+
+/*
+ * Copy one whole page, a 32-byte line at a time. Loads all go before
+ * the stores so they can overlap.
+ */
+void
+memcpy_page(void *dest, const void *src)
+{
+	uint32_t *d = dest;
+	const uint32_t *s = src;
+	const uint32_t *end = s + PAGE_SIZE / sizeof(*s);
+	uint32_t a, b, c, e, f, g, h, i;
+
+	KASSERT((vaddr_t)dest % PAGE_SIZE == 0);
+	KASSERT((vaddr_t)src % PAGE_SIZE == 0);
+
+	for (; s < end; s += 8, d += 8) {
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		e = s[3];
+		f = s[4];
+		g = s[5];
+		h = s[6];
+		i = s[7];
+		d[0] = a;
+		d[1] = b;
+		d[2] = c;
+		d[3] = e;
+		d[4] = f;
+		d[5] = g;
+		d[6] = h;
+		d[7] = i;
+	}
+}
@@ -0,0 +1,252 @@
+/*
+ * Radix tree. See radix.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <radix.h>
+
+/* Enough levels for any 32-bit key */
+#define RADIX_MAXHEIGHT	((32 + RADIX_BITS - 1) / RADIX_BITS)
+
+/*
+ * Level 1 nodes hold the values; higher ones hold nodes. A node is
+ * exactly one kmalloc size class, so there's no count of used slots;
+ * emptiness is checked by looking.
+ */
+struct radix_node {
+	void *rn_slots[RADIX_FANOUT];
+};
+
+/* Slot in a node at LEVEL that KEY goes through */
+static
+unsigned
+radix_slot(uint32_t key, unsigned level)
+{
+	return (key >> ((level - 1) * RADIX_BITS)) & (RADIX_FANOUT - 1);
+}
+
+/* Whether a tree HEIGHT levels tall has room for KEY */
+static
+bool
+radix_fits(unsigned height, uint32_t key)
+{
+	return height >= RADIX_MAXHEIGHT || (key >> (height * RADIX_BITS)) == 0;
+}
+
+static
+struct radix_node *
+radix_node_create(void)
+{
+	struct radix_node *node;
+	unsigned i;
+
+	node = kmalloc(sizeof(*node));
+	if (node == NULL) {
+		return NULL;
+	}
+	for (i=0; i<RADIX_FANOUT; i++) {
+		node->rn_slots[i] = NULL;
+	}
+	return node;
+}
+
+static
+bool
+radix_node_empty(const struct radix_node *node)
+{
+	unsigned i;
+
+	for (i=0; i<RADIX_FANOUT; i++) {
+		if (node->rn_slots[i] != NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Free NODE, at LEVEL, and everything under it. Only empty nodes can
+ * be left (after a failed insert), so there are no values to find.
+ */
+static
+void
+radix_node_destroy(struct radix_node *node, unsigned level)
+{
+	unsigned i;
+
+	for (i=0; i<RADIX_FANOUT; i++) {
+		if (node->rn_slots[i] != NULL) {
+			KASSERT(level > 1);
+			radix_node_destroy(node->rn_slots[i], level - 1);
+		}
+	}
+	kfree(node);
+}
+
+void
+radix_init(struct radix *rt)
+{
+	rt->rt_root = NULL;
+	rt->rt_height = 0;
+}
+
+void
+radix_cleanup(struct radix *rt)
+{
+	if (rt->rt_root != NULL) {
+		radix_node_destroy(rt->rt_root, rt->rt_height);
+		rt->rt_root = NULL;
+	}
+	rt->rt_height = 0;
+}
+
+void *
+radix_lookup(const struct radix *rt, uint32_t key)
+{
+	struct radix_node *node;
+	unsigned level;
+
+	if (rt->rt_root == NULL || !radix_fits(rt->rt_height, key)) {
+		return NULL;
+	}
+
+	node = rt->rt_root;
+	for (level = rt->rt_height; level > 1; level--) {
+		node = node->rn_slots[radix_slot(key, level)];
+		if (node == NULL) {
+			return NULL;
+		}
+	}
+	return node->rn_slots[radix_slot(key, 1)];
+}
+
+int
+radix_insert(struct radix *rt, uint32_t key, void *val)
+{
+	struct radix_node *node;
+	void **slotp;
+	unsigned level;
+
+	KASSERT(val != NULL);
+
+	/* Grow upwards until KEY fits, keeping what's there in slot 0 */
+	while (rt->rt_height == 0 || !radix_fits(rt->rt_height, key)) {
+		if (rt->rt_root != NULL) {
+			node = radix_node_create();
+			if (node == NULL) {
+				return ENOMEM;
+			}
+			node->rn_slots[0] = rt->rt_root;
+			rt->rt_root = node;
+		}
+		rt->rt_height++;
+	}
+
+	slotp = &rt->rt_root;
+	for (level = rt->rt_height; level > 0; level--) {
+		if (*slotp == NULL) {
+			*slotp = radix_node_create();
+			if (*slotp == NULL) {
+				return ENOMEM;
+			}
+		}
+		node = *slotp;
+		slotp = &node->rn_slots[radix_slot(key, level)];
+	}
+
+	if (*slotp != NULL) {
+		return EEXIST;
+	}
+	*slotp = val;
+	return 0;
+}
+
+void *
+radix_remove(struct radix *rt, uint32_t key)
+{
+	struct radix_node *path[RADIX_MAXHEIGHT];
+	struct radix_node *node;
+	void **slotp;
+	void *val;
+	unsigned level;
+
+	if (rt->rt_root == NULL || !radix_fits(rt->rt_height, key)) {
+		return NULL;
+	}
+
+	slotp = &rt->rt_root;
+	for (level = rt->rt_height; level > 0; level--) {
+		node = *slotp;
+		if (node == NULL) {
+			return NULL;
+		}
+		path[level - 1] = node;
+		slotp = &node->rn_slots[radix_slot(key, level)];
+	}
+
+	val = *slotp;
+	if (val == NULL) {
+		return NULL;
+	}
+	*slotp = NULL;
+
+	/* Free the nodes that are now empty, from the bottom up */
+	for (level = 1; level <= rt->rt_height; level++) {
+		node = path[level - 1];
+		if (!radix_node_empty(node)) {
+			break;
+		}
+		kfree(node);
+		if (level == rt->rt_height) {
+			rt->rt_root = NULL;
+			rt->rt_height = 0;
+			break;
+		}
+		path[level]->rn_slots[radix_slot(key, level + 1)] = NULL;
+	}
+
+	return val;
+}
+
+/*
+ * radix_next for the subtree NODE, at LEVEL, whose smallest key is BASE.
+ * Only the first slot searched can hold keys below START.
+ */
+static
+void *
+radix_next_under(const struct radix_node *node, unsigned level, uint32_t base,
+		 uint32_t start, uint32_t *key_ret)
+{
+	unsigned i;
+	uint32_t key;
+	void *val;
+
+	i = (start > base) ? radix_slot(start, level) : 0;
+	for (; i<RADIX_FANOUT; i++) {
+		if (node->rn_slots[i] == NULL) {
+			continue;
+		}
+		key = base + ((uint32_t)i << ((level - 1) * RADIX_BITS));
+		if (level == 1) {
+			*key_ret = key;
+			return node->rn_slots[i];
+		}
+		val = radix_next_under(node->rn_slots[i], level - 1, key,
+				       start, key_ret);
+		if (val != NULL) {
+			return val;
+		}
+	}
+	return NULL;
+}
+
+void *
+radix_next(const struct radix *rt, uint32_t start, uint32_t *key_ret)
+{
+	if (rt->rt_root == NULL || !radix_fits(rt->rt_height, start)) {
+		return NULL;
+	}
+	return radix_next_under(rt->rt_root, rt->rt_height, 0, start, key_ret);
+}
@@ -0,0 +1,217 @@
+/*
+ * Lock-free rings. See ring.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <membar.h>
+#include <ring.h>
+
+/*
+ * Single producer, single consumer.
+ */
+
+void
+spscring_init(struct spscring *r, void *buf, size_t esize, unsigned nitems)
+{
+	KASSERT(nitems > 0 && (nitems & (nitems - 1)) == 0);
+	KASSERT(esize > 0);
+
+	r->r_head = 0;
+	r->r_tail = 0;
+	r->r_size = nitems;
+	r->r_esize = esize;
+	r->r_buf = buf;
+}
+
+/*
+ * Copy N items into the ring starting at index POS, or out of it. The
+ * run can wrap, so it's done in at most two pieces.
+ */
+static
+void
+spscring_copyin(struct spscring *r, unsigned pos, const char *items,
+		unsigned n)
+{
+	unsigned slot, first;
+
+	slot = pos & (r->r_size - 1);
+	first = r->r_size - slot;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(r->r_buf + slot * r->r_esize, items, first * r->r_esize);
+	memcpy(r->r_buf, items + first * r->r_esize, (n - first) * r->r_esize);
+}
+
+static
+void
+spscring_copyout(struct spscring *r, unsigned pos, char *items, unsigned n)
+{
+	unsigned slot, first;
+
+	slot = pos & (r->r_size - 1);
+	first = r->r_size - slot;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(items, r->r_buf + slot * r->r_esize, first * r->r_esize);
+	memcpy(items + first * r->r_esize, r->r_buf, (n - first) * r->r_esize);
+}
+
+unsigned
+spscring_put(struct spscring *r, const void *items, unsigned n)
+{
+	unsigned head, tail;
+
+	head = r->r_head;
+	tail = r->r_tail;
+	/* Don't write the slots until we've seen the consumer free them */
+	membar_load_any();
+
+	if (n > r->r_size - (head - tail)) {
+		n = r->r_size - (head - tail);
+	}
+	if (n == 0) {
+		return 0;
+	}
+	spscring_copyin(r, head, items, n);
+
+	/* The items have to be visible before the index that covers them */
+	membar_store_store();
+	r->r_head = head + n;
+	return n;
+}
+
+unsigned
+spscring_get(struct spscring *r, void *items, unsigned n)
+{
+	unsigned head, tail;
+
+	tail = r->r_tail;
+	head = r->r_head;
+	/* Don't read the slots until we've seen the index that covers them */
+	membar_load_any();
+
+	if (n > head - tail) {
+		n = head - tail;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	spscring_copyout(r, tail, items, n);
+
+	/* Finish reading the slots before handing them back */
+	membar_any_store();
+	r->r_tail = tail + n;
+	return n;
+}
+
+unsigned
+spscring_count(const struct spscring *r)
+{
+	return r->r_head - r->r_tail;
+}
+
+/*
+ * Multiple producers, single consumer.
+ *
+ * Slot I's sequence number is I when it is free for the producer that
+ * claims index I, I+1 once that producer has filled it, and I+size
+ * once the consumer has drained it (i.e., free for index I+size).
+ */
+
+static
+volatile unsigned *
+mpscring_seq(struct mpscring *r, unsigned pos)
+{
+	return (volatile unsigned *)
+		(r->r_buf + (pos & (r->r_size - 1)) * r->r_stride);
+}
+
+static
+void *
+mpscring_data(struct mpscring *r, unsigned pos)
+{
+	return r->r_buf + (pos & (r->r_size - 1)) * r->r_stride
+		+ sizeof(unsigned);
+}
+
+void
+mpscring_init(struct mpscring *r, void *buf, size_t esize, unsigned nitems)
+{
+	unsigned i;
+
+	KASSERT(nitems > 0 && (nitems & (nitems - 1)) == 0);
+	KASSERT(esize > 0);
+	KASSERT(((uintptr_t)buf & (sizeof(unsigned) - 1)) == 0);
+
+	r->r_head = 0;
+	r->r_tail = 0;
+	r->r_size = nitems;
+	r->r_esize = esize;
+	r->r_stride = MPSCRING_STRIDE(esize);
+	r->r_buf = buf;
+	for (i=0; i<nitems; i++) {
+		*mpscring_seq(r, i) = i;
+	}
+}
+
+bool
+mpscring_put(struct mpscring *r, const void *item)
+{
+	unsigned pos, seq;
+	int spl;
+
+	/*
+	 * Keep interrupts out between claiming the slot and filling it:
+	 * the consumer can't get past a claimed slot until it's filled,
+	 * so the window should be as short as possible.
+	 */
+	spl = splhigh();
+
+	pos = r->r_head;
+	while (1) {
+		seq = *mpscring_seq(r, pos);
+		membar_load_any();
+		if (seq == pos) {
+			/* Free for us, if nobody else claims it first */
+			if (spinlock_data_cas(&r->r_head, pos, pos + 1)) {
+				break;
+			}
+		}
+		else if ((int)(seq - pos) < 0) {
+			/* Still holds the item from a lap ago: full */
+			splx(spl);
+			return false;
+		}
+		/* Someone else got there; try the new head */
+		pos = r->r_head;
+	}
+
+	memcpy(mpscring_data(r, pos), item, r->r_esize);
+	membar_store_store();
+	*mpscring_seq(r, pos) = pos + 1;
+
+	splx(spl);
+	return true;
+}
+
+bool
+mpscring_get(struct mpscring *r, void *item)
+{
+	unsigned pos;
+
+	pos = r->r_tail;
+	if (*mpscring_seq(r, pos) != pos + 1) {
+		return false;
+	}
+	membar_load_any();
+
+	memcpy(item, mpscring_data(r, pos), r->r_esize);
+	membar_any_store();
+	*mpscring_seq(r, pos) = pos + r->r_size;
+	r->r_tail = pos + 1;
+	return true;
+}
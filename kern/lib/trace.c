@@ -0,0 +1,195 @@
+/*
+ * Kernel event tracing; see trace.h.
+ *
+ * Each cpu has a ring of TRACE_NENTS entries that only it writes, at
+ * splhigh, so recording needs no lock. Timestamps come from the
+ * real-time clock, which is good to the nanosecond on System/161 and
+ * the same on every cpu, so trace_dump can merge the rings.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
+#include <thread.h>
+#include <trace.h>
+#include <lamebus/ltrace.h>
+
+#define TRACE_NENTS 512		/* per cpu */
+
+struct traceent {
+	uint32_t te_secs;
+	uint32_t te_nsecs;
+	struct thread *te_thread;	/* who; may be gone by dump time */
+	uint32_t te_event;
+	uint32_t te_a1;
+	uint32_t te_a2;
+};
+
+struct tracebuf {
+	struct traceent tb_ents[TRACE_NENTS];
+	unsigned tb_next;		/* total entries ever recorded */
+};
+
+/* Enable bits for TRACE() */
+uint32_t traceflags = 0;
+
+static bool trace_mirror;
+
+static const char *const trace_names[TR_NEVENTS] = {
+	"switch",
+	"sleep",
+	"wake",
+	"vmfault",
+	"sfsio",
+	"lhdio",
+	"sysenter",
+	"sysexit",
+	"user",
+};
+
+void
+trace_bootstrap(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		c->c_trace = kmalloc(sizeof(struct tracebuf));
+		if (c->c_trace == NULL) {
+			panic("trace: Could not allocate ring for cpu %u\n", i);
+		}
+		c->c_trace->tb_next = 0;
+	}
+}
+
+void
+trace_record(unsigned event, uint32_t a1, uint32_t a2)
+{
+	struct tracebuf *tb;
+	struct traceent *te;
+	time_t secs;
+	uint32_t nsecs;
+	int spl;
+
+	spl = splhigh();
+	tb = curcpu->c_trace;
+	if (tb == NULL) {
+		/* before trace_bootstrap */
+		splx(spl);
+		return;
+	}
+	gettime(&secs, &nsecs);
+
+	te = &tb->tb_ents[tb->tb_next % TRACE_NENTS];
+	tb->tb_next++;
+	te->te_secs = secs;
+	te->te_nsecs = nsecs;
+	te->te_thread = curthread;
+	te->te_event = event;
+	te->te_a1 = a1;
+	te->te_a2 = a2;
+
+	if (trace_mirror) {
+		ltrace_debug((event << 24) | (a2 & 0xffffff));
+	}
+	splx(spl);
+}
+
+void
+trace_setmirror(bool on)
+{
+	trace_mirror = on;
+}
+
+void
+trace_clear(void)
+{
+	uint32_t flags;
+	unsigned i;
+
+	flags = traceflags;
+	traceflags = 0;
+	for (i=0; i<cpu_count(); i++) {
+		cpu_get(i)->c_trace->tb_next = 0;
+	}
+	traceflags = flags;
+}
+
+/*
+ * Earlier of two entries.
+ */
+static
+bool
+trace_before(const struct traceent *a, const struct traceent *b)
+{
+	if (a->te_secs != b->te_secs) {
+		return a->te_secs < b->te_secs;
+	}
+	return a->te_nsecs < b->te_nsecs;
+}
+
+/*
+ * Print every ring, oldest first, merging the cpus by timestamp.
+ * Tracing is switched off while we do it, so the rings hold still and
+ * our own kprintfs don't show up.
+ */
+void
+trace_dump(void)
+{
+	unsigned ncpus, i, best, total;
+	unsigned *pos;
+	struct tracebuf *tb;
+	const struct traceent *te, *bestte;
+	uint32_t flags;
+
+	ncpus = cpu_count();
+	pos = kmalloc(ncpus * sizeof(unsigned));
+	if (pos == NULL) {
+		kprintf("trace: Out of memory\n");
+		return;
+	}
+
+	flags = traceflags;
+	traceflags = 0;
+
+	total = 0;
+	for (i=0; i<ncpus; i++) {
+		tb = cpu_get(i)->c_trace;
+		pos[i] = tb->tb_next > TRACE_NENTS ?
+			tb->tb_next - TRACE_NENTS : 0;
+		total += tb->tb_next - pos[i];
+	}
+
+	kprintf("trace: %u events\n", total);
+	while (total-- > 0) {
+		bestte = NULL;
+		best = 0;
+		for (i=0; i<ncpus; i++) {
+			tb = cpu_get(i)->c_trace;
+			if (pos[i] == tb->tb_next) {
+				continue;
+			}
+			te = &tb->tb_ents[pos[i] % TRACE_NENTS];
+			if (bestte == NULL || trace_before(te, bestte)) {
+				bestte = te;
+				best = i;
+			}
+		}
+		KASSERT(bestte != NULL);
+		pos[best]++;
+
+		kprintf("%u.%09u cpu%u %p %-8s 0x%x 0x%x\n",
+			bestte->te_secs, bestte->te_nsecs, best,
+			bestte->te_thread,
+			bestte->te_event < TR_NEVENTS ?
+			trace_names[bestte->te_event] : "?",
+			bestte->te_a1, bestte->te_a2);
+	}
+
+	traceflags = flags;
+	kfree(pos);
+}
@@ -0,0 +1,91 @@
+/*
+ * Network interfaces and the datagram protocol. See net.h.
+ *
+ * Interfaces are only attached at boot and never go away, so the list
+ * is read without locking once it's built.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <net.h>
+
+static struct netif *net_ifs;		/* all interfaces, in attach order */
+static struct netif **net_lastif = &net_ifs;
+
+void
+net_bootstrap(void)
+{
+	pbuf_bootstrap();
+	socket_bootstrap();
+}
+
+void
+net_attach(struct netif *nif)
+{
+	nif->if_next = NULL;
+	*net_lastif = nif;
+	net_lastif = &nif->if_next;
+	kprintf("%s: station address %u\n", nif->if_name, nif->if_addr);
+}
+
+struct netif *
+net_firstif(void)
+{
+	return net_ifs;
+}
+
+void
+net_input(struct netif *nif, uint16_t src, struct pbuf *pb)
+{
+	struct net_dghdr *dg;
+
+	if (pb->pb_len < sizeof(struct net_dghdr)) {
+		goto drop;
+	}
+	dg = PBUF_DATA(pb);
+	if (dg->dg_len > pb->pb_len - sizeof(struct net_dghdr)) {
+		goto drop;
+	}
+
+	pb->pb_from.sln_len = sizeof(struct sockaddr_ln);
+	pb->pb_from.sln_family = AF_LNET;
+	pb->pb_from.sln_port = dg->dg_srcport;
+	pb->pb_from.sln_addr = src;
+
+	/* Anything after the datagram is link-level padding */
+	pbuf_pull(pb, sizeof(struct net_dghdr));
+	pb->pb_len = dg->dg_len;
+	socket_deliver(dg->dg_dstport, pb);
+	return;
+
+ drop:
+	nif->if_idrops++;
+	pbuf_put(pb);
+}
+
+int
+net_output(uint16_t dst, uint16_t srcport, uint16_t dstport, struct pbuf *pb)
+{
+	struct netif *nif = net_ifs;
+	struct net_dghdr *dg;
+
+	if (nif == NULL) {
+		pbuf_put(pb);
+		return ENETDOWN;
+	}
+
+	KASSERT(pb->pb_len <= NET_MAXDGRAM);
+	dg = pbuf_push(pb, sizeof(struct net_dghdr));
+	dg->dg_srcport = srcport;
+	dg->dg_dstport = dstport;
+	dg->dg_len = pb->pb_len - sizeof(struct net_dghdr);
+	dg->dg_pad = 0;
+
+	/* The hub doesn't send our own frames back to us */
+	if (dst == nif->if_addr) {
+		net_input(nif, dst, pb);
+		return 0;
+	}
+
+	return nif->if_output(nif, dst, pb);
+}
@@ -0,0 +1,89 @@
+/*
+ * Packet buffer pool. See net.h.
+ *
+ * The pool is allocated once at boot and never grows, since drivers
+ * take pbufs in interrupt handlers where kmalloc can't be used. When
+ * it runs dry, incoming frames are dropped.
+ */
+#define KMTAG KMT_NET
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <net.h>
+
+#define NET_NPBUFS  32
+
+static struct spinlock pbuf_lock = SPINLOCK_INITIALIZER;
+static struct pbuf *pbuf_free;		/* free list, under pbuf_lock */
+
+void
+pbuf_bootstrap(void)
+{
+	struct pbuf *pb;
+	unsigned i;
+
+	for (i=0; i<NET_NPBUFS; i++) {
+		pb = kmalloc(sizeof(struct pbuf));
+		if (pb == NULL) {
+			break;
+		}
+		pb->pb_buf = kmalloc(PBUF_SIZE);
+		if (pb->pb_buf == NULL) {
+			kfree(pb);
+			break;
+		}
+		pbuf_put(pb);
+	}
+	if (i < NET_NPBUFS) {
+		kprintf("net: only %u of %u packet buffers\n", i, NET_NPBUFS);
+	}
+}
+
+struct pbuf *
+pbuf_get(void)
+{
+	struct pbuf *pb;
+
+	spinlock_acquire(&pbuf_lock);
+	pb = pbuf_free;
+	if (pb != NULL) {
+		pbuf_free = pb->pb_next;
+	}
+	spinlock_release(&pbuf_lock);
+
+	if (pb != NULL) {
+		pb->pb_next = NULL;
+		pb->pb_off = PBUF_HEADROOM;
+		pb->pb_len = 0;
+		bzero(&pb->pb_from, sizeof(pb->pb_from));
+	}
+	return pb;
+}
+
+void
+pbuf_put(struct pbuf *pb)
+{
+	spinlock_acquire(&pbuf_lock);
+	pb->pb_next = pbuf_free;
+	pbuf_free = pb;
+	spinlock_release(&pbuf_lock);
+}
+
+void *
+pbuf_push(struct pbuf *pb, unsigned len)
+{
+	KASSERT(len <= pb->pb_off);
+	pb->pb_off -= len;
+	pb->pb_len += len;
+	return PBUF_DATA(pb);
+}
+
+void *
+pbuf_pull(struct pbuf *pb, unsigned len)
+{
+	KASSERT(len <= pb->pb_len);
+	pb->pb_off += len;
+	pb->pb_len -= len;
+	return PBUF_DATA(pb);
+}
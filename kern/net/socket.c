@@ -0,0 +1,577 @@
+/*
+ * Datagram sockets. See net.h.
+ *
+ * A socket is a vnode with a queue of received datagrams, each still
+ * in the pbuf the driver copied it into. Bound sockets are found by
+ * port in socket_ports, under socket_lock; delivery holds socket_lock
+ * while it queues on a socket, so once a socket has been taken out of
+ * the table nothing else can get at it. socket_lock comes before any
+ * socket's so_lock.
+ *
+ * A socket only holds SOCKET_MAXQUEUE datagrams; more are dropped, so
+ * a socket nobody reads can't hog the pbuf pool.
+ */
+#define KMTAG KMT_NET
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <poll.h>
+#include <radix.h>
+#include <net.h>
+
+#define SOCKET_MAXQUEUE   8	/* datagrams waiting on one socket */
+
+/* Ports given to sockets that don't pick one */
+#define SOCKET_FIRSTAUTO  49152
+#define SOCKET_LASTAUTO   65535
+
+struct socket {
+	struct vnode so_vn;
+
+	struct lock *so_lock;
+	struct cv *so_cv;		/* signalled when a datagram comes */
+	struct pollqueue so_pollq;
+
+	struct pbuf *so_head;		/* datagrams waiting to be read */
+	struct pbuf *so_tail;
+	unsigned so_count;
+
+	uint16_t so_port;		/* 0 if unbound; under socket_lock */
+};
+
+DECLRADIX(sockradix, struct socket);
+DEFRADIX(sockradix, struct socket, /*no inline*/);
+
+static struct lock *socket_lock;
+static struct sockradix socket_ports;	/* bound sockets, by port */
+static uint32_t socket_nextauto = SOCKET_FIRSTAUTO;
+
+static const struct vnode_ops socket_vnode_ops;
+
+void
+socket_bootstrap(void)
+{
+	socket_lock = lock_create("sockets");
+	if (socket_lock == NULL) {
+		panic("socket_bootstrap: Out of memory\n");
+	}
+	sockradix_init(&socket_ports);
+}
+
+/*
+ * The socket VN is, or NULL if it isn't one.
+ */
+static
+struct socket *
+socket_get(struct vnode *vn)
+{
+	if (vn->vn_ops != &socket_vnode_ops) {
+		return NULL;
+	}
+	return vn->vn_data;
+}
+
+/*
+ * Put SO in the table at PORT, or at a free automatic port if PORT is
+ * 0. Call with socket_lock held.
+ */
+static
+int
+socket_bindport(struct socket *so, uint16_t port)
+{
+	uint32_t tries;
+	int result;
+
+	KASSERT(lock_do_i_hold(socket_lock));
+	KASSERT(so->so_port == 0);
+
+	if (port == 0) {
+		for (tries = SOCKET_FIRSTAUTO; tries <= SOCKET_LASTAUTO;
+		     tries++) {
+			port = socket_nextauto;
+			socket_nextauto = (port == SOCKET_LASTAUTO) ?
+				SOCKET_FIRSTAUTO : port + 1;
+			if (sockradix_lookup(&socket_ports, port) == NULL) {
+				break;
+			}
+		}
+		if (tries > SOCKET_LASTAUTO) {
+			return EADDRINUSE;
+		}
+	}
+
+	result = sockradix_insert(&socket_ports, port, so);
+	if (result == EEXIST) {
+		return EADDRINUSE;
+	}
+	if (result) {
+		return result;
+	}
+	so->so_port = port;
+	return 0;
+}
+
+int
+socket_bind(struct vnode *vn, const struct sockaddr_ln *addr)
+{
+	struct socket *so;
+	int result;
+
+	so = socket_get(vn);
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+	if (addr->sln_family != AF_LNET) {
+		return EAFNOSUPPORT;
+	}
+
+	lock_acquire(socket_lock);
+	if (so->so_port != 0) {
+		result = EINVAL;
+	}
+	else {
+		result = socket_bindport(so, addr->sln_port);
+	}
+	lock_release(socket_lock);
+	return result;
+}
+
+void
+socket_deliver(uint16_t port, struct pbuf *pb)
+{
+	struct socket *so;
+
+	lock_acquire(socket_lock);
+	so = sockradix_lookup(&socket_ports, port);
+	if (so != NULL) {
+		lock_acquire(so->so_lock);
+		if (so->so_count < SOCKET_MAXQUEUE) {
+			pb->pb_next = NULL;
+			if (so->so_tail == NULL) {
+				so->so_head = pb;
+			}
+			else {
+				so->so_tail->pb_next = pb;
+			}
+			so->so_tail = pb;
+			so->so_count++;
+			pb = NULL;
+			cv_signal(so->so_cv, so->so_lock);
+			pollqueue_wakeup(&so->so_pollq);
+		}
+		lock_release(so->so_lock);
+	}
+	lock_release(socket_lock);
+
+	if (pb != NULL) {
+		pbuf_put(pb);
+	}
+}
+
+int
+socket_sendto(struct vnode *vn, struct uio *uio, const struct sockaddr_ln *addr)
+{
+	struct socket *so;
+	struct pbuf *pb;
+	size_t len;
+	int result;
+
+	so = socket_get(vn);
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+	if (addr->sln_family != AF_LNET) {
+		return EAFNOSUPPORT;
+	}
+	len = uio->uio_resid;
+	if (len > NET_MAXDGRAM) {
+		return EMSGSIZE;
+	}
+
+	lock_acquire(socket_lock);
+	result = so->so_port == 0 ? socket_bindport(so, 0) : 0;
+	lock_release(socket_lock);
+	if (result) {
+		return result;
+	}
+
+	pb = pbuf_get();
+	if (pb == NULL) {
+		return EAGAIN;
+	}
+	/* The only copy on the way out, besides the driver's to the card */
+	result = uiomove(PBUF_DATA(pb), len, uio);
+	if (result) {
+		pbuf_put(pb);
+		return result;
+	}
+	pb->pb_len = len;
+
+	return net_output(addr->sln_addr, so->so_port, addr->sln_port, pb);
+}
+
+int
+socket_recvfrom(struct vnode *vn, struct uio *uio, struct sockaddr_ln *addr)
+{
+	struct socket *so;
+	struct pbuf *pb;
+	size_t len;
+	int result;
+
+	so = socket_get(vn);
+	if (so == NULL) {
+		return ENOTSOCK;
+	}
+
+	lock_acquire(so->so_lock);
+	while (so->so_head == NULL) {
+		cv_wait(so->so_cv, so->so_lock);
+	}
+	pb = so->so_head;
+	so->so_head = pb->pb_next;
+	if (so->so_head == NULL) {
+		so->so_tail = NULL;
+	}
+	so->so_count--;
+	lock_release(so->so_lock);
+
+	/* Straight from the pbuf the driver filled */
+	len = pb->pb_len;
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	result = uiomove(PBUF_DATA(pb), len, uio);
+	if (result == 0 && addr != NULL) {
+		*addr = pb->pb_from;
+	}
+	pbuf_put(pb);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// vnode operations
+
+/*
+ * Sockets are only made by socket_create; there's no name to open one
+ * by.
+ */
+static
+int
+socket_open(struct vnode *v, int openflags)
+{
+	(void)v;
+	(void)openflags;
+	return EINVAL;
+}
+
+/*
+ * Last close: give the port up, so nothing more is delivered.
+ */
+static
+int
+socket_close(struct vnode *v)
+{
+	struct socket *so = v->vn_data;
+
+	lock_acquire(socket_lock);
+	if (so->so_port != 0) {
+		sockradix_remove(&socket_ports, so->so_port);
+		so->so_port = 0;
+	}
+	lock_release(socket_lock);
+	return 0;
+}
+
+static
+int
+socket_reclaim(struct vnode *v)
+{
+	struct socket *so = v->vn_data;
+	struct pbuf *pb;
+
+	KASSERT(so->so_port == 0);
+	VOP_CLEANUP(v);
+
+	while (so->so_head != NULL) {
+		pb = so->so_head;
+		so->so_head = pb->pb_next;
+		pbuf_put(pb);
+	}
+	pollqueue_cleanup(&so->so_pollq);
+	cv_destroy(so->so_cv);
+	lock_destroy(so->so_lock);
+	kfree(so);
+	return 0;
+}
+
+/*
+ * read() is recvfrom without the sender's address.
+ */
+static
+int
+socket_read(struct vnode *v, struct uio *uio)
+{
+	return socket_recvfrom(v, uio, NULL);
+}
+
+/*
+ * There's no connect, so write() has nowhere to send to.
+ */
+static
+int
+socket_write(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return ENOTCONN;
+}
+
+static
+int
+socket_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFSOCK;
+	return 0;
+}
+
+static
+int
+socket_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct socket *so = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_mode |= 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = NET_MAXDGRAM;
+
+	/* The next datagram, which is what a read would get */
+	lock_acquire(so->so_lock);
+	if (so->so_head != NULL) {
+		statbuf->st_size = so->so_head->pb_len;
+	}
+	lock_release(so->so_lock);
+
+	return 0;
+}
+
+/*
+ * Readable when a datagram is waiting; always writable, since sending
+ * never waits.
+ */
+static
+int
+socket_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	struct socket *so = v->vn_data;
+	int ready = POLLOUT;
+
+	lock_acquire(so->so_lock);
+	pollqueue_add(&so->so_pollq, pw);
+	if (so->so_head != NULL) {
+		ready |= POLLIN;
+	}
+	lock_release(so->so_lock);
+
+	*revents = ready & events;
+	return 0;
+}
+
+static
+int
+socket_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+socket_fallocate(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return ESPIPE;
+}
+
+static
+int
+socket_copyrange(struct vnode *v, off_t pos, struct vnode *src,
+		 off_t spos, off_t len, off_t *copied)
+{
+	(void)v;
+	(void)pos;
+	(void)src;
+	(void)spos;
+	(void)len;
+	(void)copied;
+	return ESPIPE;
+}
+
+static
+int
+socket_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+socket_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+socket_getpage(struct vnode *v, uint32_t index, bool forwrite,
+	       struct fcpage **ret)
+{
+	(void)v;
+	(void)index;
+	(void)forwrite;
+	(void)ret;
+	return ENOSYS;
+}
+
+static
+int
+socket_advise(struct vnode *v, off_t pos, off_t len, int advice)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)advice;
+	return ESPIPE;
+}
+
+static
+int
+socket_syncrange(struct vnode *v, off_t pos, off_t len, unsigned flags)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)flags;
+	return ESPIPE;
+}
+
+static
+int
+socket_notdir(void)
+{
+	return ENOTDIR;
+}
+
+static
+int
+socket_inval(void)
+{
+	return EINVAL;
+}
+
+/*
+ * Casting through void * prevents warnings, as in sfs_vnode.c.
+ */
+#define NOTDIR ((void *)socket_notdir)
+#define INVAL ((void *)socket_inval)
+
+static const struct vnode_ops socket_vnode_ops = {
+	VOP_MAGIC,	/* mark this a valid vnode ops table */
+
+	socket_open,
+	socket_close,
+	socket_reclaim,
+
+	socket_read,
+	INVAL,   /* readlink */
+	NOTDIR,  /* getdirentry */
+	socket_write,
+	INVAL,   /* ioctl */
+	socket_stat,
+	socket_gettype,
+	socket_tryseek,
+	socket_fsync,
+	socket_mmap,
+	socket_getpage,
+	socket_advise,
+	socket_syncrange,
+	socket_poll,
+	INVAL,   /* truncate */
+	socket_fallocate,
+	socket_copyrange,
+	NOTDIR,  /* namefile */
+
+	NOTDIR,  /* creat */
+	NOTDIR,  /* symlink */
+	NOTDIR,  /* mkdir */
+	NOTDIR,  /* link */
+	NOTDIR,  /* remove */
+	NOTDIR,  /* rmdir */
+	NOTDIR,  /* rename */
+
+	NOTDIR,  /* lookup */
+	NOTDIR,  /* lookparent */
+};
+
+int
+socket_create(int domain, int type, int protocol, struct vnode **ret)
+{
+	struct socket *so;
+
+	if (domain != AF_LNET) {
+		return EAFNOSUPPORT;
+	}
+	if (type != SOCK_DGRAM) {
+		return EPROTOTYPE;
+	}
+	if (protocol != 0) {
+		return EPROTONOSUPPORT;
+	}
+
+	so = kmalloc(sizeof(struct socket));
+	if (so == NULL) {
+		return ENOMEM;
+	}
+	so->so_lock = lock_create("socket");
+	if (so->so_lock == NULL) {
+		kfree(so);
+		return ENOMEM;
+	}
+	so->so_cv = cv_create("socket");
+	if (so->so_cv == NULL) {
+		lock_destroy(so->so_lock);
+		kfree(so);
+		return ENOMEM;
+	}
+	pollqueue_init(&so->so_pollq);
+	so->so_head = so->so_tail = NULL;
+	so->so_count = 0;
+	so->so_port = 0;
+
+	/* vnode_init can't fail */
+	VOP_INIT(&so->so_vn, &socket_vnode_ops, NULL, so);
+
+	/* As if vfs_open had opened it */
+	VOP_INCOPEN(&so->so_vn);
+
+	*ret = &so->so_vn;
+	return 0;
+}
@@ -42,21 +42,43 @@
  * process that will have more than one thread is the kernel process.
  */
 
+#define KMTAG KMT_PROC
+
 #include <types.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/unistd.h>
 #include <array.h>
+#include <limits.h>
+#include <kmem.h>
+#include <file.h>
+#include <ioring.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Object cache that struct procs are allocated from.
+ */
+static struct kmem_cache *proc_cache;
+
+/*
+ * Protects every process's p_parent, p_children, p_did_exit and
+ * p_exitcode, and goes with the parents' p_wait_cv. Also covers the
+ * user thread fields (p_uthreads, p_nextutid, p_exiting) and
+ * p_thread_cv.
+ */
+struct lock *proc_family_lk;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -70,97 +92,223 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;
 #endif  // UW
 
-// The complete array of all active processes
-// Processes are active if they have not exited or if their parent has not existed
-struct array *allprocs;
+/*
+ * The process table. Processes are active (and stay in here) if they have
+ * not exited or if their parent has not exited.
+ *
+ * Slot i only ever holds PIDs that are congruent to i modulo PROC_MAX, so
+ * lookup is a single index. Each slot remembers the last PID it gave out
+ * and steps by PROC_MAX for the next one, so a PID is not reused until the
+ * whole PID range has gone round for that slot.
+ *
+ * The slots are split into PIDTABLE_BUCKETS buckets (slot i is in bucket
+ * i % PIDTABLE_BUCKETS), each with its own lock and its own FIFO ring of
+ * free slots, so the slot freed longest ago is reused first. A fork starts
+ * looking for a free slot in the bucket picked by its cpu number, so forks
+ * on different cpus normally touch different locks.
+ *
+ * Lookups by PID take no lock at all: slots are read under RCU, and
+ * proc_destroy frees a proc through call_rcu, so one seen in the table
+ * stays readable until the lookup is done.
+ */
+#define PIDTABLE_BUCKETS 8
+#define PIDBUCKET_SLOTS (PROC_MAX / PIDTABLE_BUCKETS)
 
-// PIDs will be > 0
-pid_t base_pid = 0;
+struct pidbucket {
+	struct spinlock pb_lock;			/* protects the bucket's slots */
+	unsigned pb_free[PIDBUCKET_SLOTS];	/* ring of free slot numbers */
+	unsigned pb_freehead;
+	unsigned pb_nfree;
+};
 
-/**
-	Returns the index of the given process in the processes array
-	Binary search implementation
-*/
-unsigned procarray_proc_index_by_pid(struct array *procs, pid_t pid) {
-	unsigned low = 0;
-	unsigned high = array_num(procs) - 1;
-
-	while (high >= low) {
-		unsigned probe = (high + low) / 2;
-		struct proc * p = array_get(procs, probe);
-		if (pid == p->p_id) {
-			return probe;
-		} else if (pid < p->p_id) {
-			high = probe - 1;
-		} else {
-			low = probe + 1;
-		}
-	}
+static struct proc *pidtable[PROC_MAX];
+static pid_t pidtable_lastpid[PROC_MAX];
+static struct pidbucket pidbuckets[PIDTABLE_BUCKETS];
 
-	// No process found for this pid
-	return -1;
-}
+#define PIDBUCKET(slot) (&pidbuckets[(slot) % PIDTABLE_BUCKETS])
 
 /**
-	proc_by_pid returns the process for a given PID by performing a binary
-	search on the processes array.
+	Sets up the process table with every slot free
 */
-struct proc * procarray_proc_by_pid(struct array *procs, pid_t pid) {
-	return array_get(procs, procarray_proc_index_by_pid(procs, pid));
-}
+static void pidtable_init(void) {
+	unsigned i, slot;
+	struct pidbucket *pb;
+
+	KASSERT(PROC_MAX % PIDTABLE_BUCKETS == 0);
 
-struct proc * procarray_allprocs_proc_by_pid(pid_t pid) {
-	return procarray_proc_by_pid(allprocs, pid);
+	for (i = 0; i < PIDTABLE_BUCKETS; i++) {
+		spinlock_init(&pidbuckets[i].pb_lock);
+		pidbuckets[i].pb_freehead = 0;
+		pidbuckets[i].pb_nfree = 0;
+	}
+	for (i = 0; i < PROC_MAX; i++) {
+		/* hand out PID_MIN first; slots below PID_MIN go at the end */
+		slot = (i + PID_MIN) % PROC_MAX;
+		pidtable[slot] = NULL;
+		pidtable_lastpid[slot] = (pid_t)slot - PROC_MAX;
+		pb = PIDBUCKET(slot);
+		pb->pb_free[pb->pb_nfree++] = slot;
+	}
 }
 
 /**
-	Adds a newly created process to the end of the processes array
-	To be called by proc_create
+	Gives the process a PID and enters it in the process table.
+	Returns ENPROC if the table is full.
 */
-void procarray_add_proc(struct array *procs, struct proc *p) {
-	array_add(procs, p, NULL);
-}
+static int pidtable_add(struct proc *p) {
+	struct pidbucket *pb;
+	unsigned i, start, slot;
+	pid_t pid;
+
+	/* kproc is made before curcpu is set up */
+	start = (kproc == NULL) ? 0 : curcpu->c_number;
+	for (i = 0; i < PIDTABLE_BUCKETS; i++) {
+		pb = &pidbuckets[(start + i) % PIDTABLE_BUCKETS];
+		spinlock_acquire(&pb->pb_lock);
+		if (pb->pb_nfree > 0) {
+			break;
+		}
+		spinlock_release(&pb->pb_lock);
+	}
+	if (i == PIDTABLE_BUCKETS) {
+		return ENPROC;
+	}
+
+	slot = pb->pb_free[pb->pb_freehead];
+	pb->pb_freehead = (pb->pb_freehead + 1) % PIDBUCKET_SLOTS;
+	pb->pb_nfree--;
 
-void procarray_allprocs_add_proc(struct proc *p) {
-	if (allprocs == NULL) {
-		allprocs = array_create();
-		array_init(allprocs);
+	pid = pidtable_lastpid[slot] + PROC_MAX;
+	if (pid > PID_MAX) {
+		pid = slot;
 	}
-	procarray_add_proc(allprocs, p);
+	if (pid < PID_MIN) {
+		pid += PROC_MAX;
+	}
+	KASSERT(pidtable[slot] == NULL);
+	pidtable_lastpid[slot] = pid;
+	/* set the PID before lookups can see the proc */
+	p->p_id = pid;
+	pidtable[slot] = p;
+	spinlock_release(&pb->pb_lock);
+
+	return 0;
 }
 
 /**
-	To be called by proc_destroy
+	Takes the process out of the process table and puts its slot on its
+	bucket's free list. To be called by proc_destroy
 */
-void procarray_remove_proc(struct array *procs, pid_t pid) {
-	array_remove(procs, procarray_proc_index_by_pid(procs, pid));
+static void pidtable_remove(struct proc *p) {
+	unsigned slot = p->p_id % PROC_MAX;
+	struct pidbucket *pb = PIDBUCKET(slot);
+
+	spinlock_acquire(&pb->pb_lock);
+	KASSERT(pidtable[slot] == p);
+	pidtable[slot] = NULL;
+	pb->pb_free[(pb->pb_freehead + pb->pb_nfree) % PIDBUCKET_SLOTS] = slot;
+	pb->pb_nfree++;
+	spinlock_release(&pb->pb_lock);
 }
 
-void procarray_allprocs_remove_proc(pid_t pid) {
-	procarray_remove_proc(allprocs, pid);
+struct proc * proc_by_pid(pid_t pid) {
+	struct proc *p;
 
-	// Deinit the processes array
-	if (array_num(allprocs) == 0) {
-		array_cleanup(allprocs);
-		array_destroy(allprocs);
-		allprocs = NULL;
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
 	}
+
+	rcu_read_lock();
+	p = pidtable[pid % PROC_MAX];
+	if (p != NULL && p->p_id != pid) {
+		/* the slot has moved on to a different PID */
+		p = NULL;
+	}
+	rcu_read_unlock();
+
+	return p;
 }
 
-/**
-	Generates a unique PID for a process.
+pid_t proc_oomkill(unsigned (*size)(struct addrspace *)) {
+	struct pidbucket *pb;
+	struct proc *p;
+	pid_t victim = 0;
+	unsigned slot, n, biggest = 0;
+	bool pending = false;
+
+	for (slot = 0; slot < PROC_MAX && !pending; slot++) {
+		pb = PIDBUCKET(slot);
+		spinlock_acquire(&pb->pb_lock);
+		p = pidtable[slot];
+		if (p != NULL && p != kproc && !p->p_did_exit) {
+			spinlock_acquire(&p->p_lock);
+			/* no address space: exiting already, or not started */
+			if (p->p_addrspace != NULL) {
+				if (p->p_oomkilled) {
+					victim = p->p_id;
+					pending = true;
+				} else {
+					n = size(p->p_addrspace);
+					if (victim == 0 || n > biggest) {
+						victim = p->p_id;
+						biggest = n;
+					}
+				}
+			}
+			spinlock_release(&p->p_lock);
+		}
+		spinlock_release(&pb->pb_lock);
+	}
 
-	TODO: I didn't have time to get to this by refactor this to allow
-	(potentially) unlimited different processes to run by allowing recycling of
-	process IDs that have exited and been fully removed.
+	if (victim == 0 || pending) {
+		return victim;
+	}
 
-	We would have to generate the PID by finding the largest array index `i` in
-	allprocesses whose process ID is <= i (specified binary search) then insert
-	into the allprocesses array when we create the new process in that order (to
-	maintion ordering by PID).
-*/
-pid_t gen_pid() {
-	return ++base_pid;
+	/* it may have exited in the meantime, which is just as good */
+	slot = victim % PROC_MAX;
+	pb = PIDBUCKET(slot);
+	spinlock_acquire(&pb->pb_lock);
+	p = pidtable[slot];
+	if (p != NULL && p->p_id == victim && !p->p_did_exit) {
+		p->p_oomkilled = true;
+		kprintf("Out of memory: killing process %d (%s), %u pages\n",
+			victim, p->p_name, biggest);
+	}
+	spinlock_release(&pb->pb_lock);
+
+	return victim;
+}
+
+unsigned proc_getinfo(struct procinfo *info, unsigned max) {
+	struct pidbucket *pb;
+	struct proc *p;
+	unsigned slot, n = 0, i;
+
+	/* Keeps p_parent from changing under us */
+	lock_acquire(proc_family_lk);
+	for (slot = 0; slot < PROC_MAX && n < max; slot++) {
+		pb = PIDBUCKET(slot);
+		spinlock_acquire(&pb->pb_lock);
+		p = pidtable[slot];
+		if (p != NULL) {
+			spinlock_acquire(&p->p_lock);
+			info[n].pi_pid = p->p_id;
+			info[n].pi_ppid = p->p_parent != NULL ? p->p_parent->p_id : 0;
+			info[n].pi_nthreads = threadarray_num(&p->p_threads);
+			info[n].pi_nice = p->p_nice;
+			info[n].pi_zombie = p->p_did_exit;
+			for (i = 0; i < PROCINFO_NAMELEN && p->p_name[i] != 0; i++) {
+				info[n].pi_name[i] = p->p_name[i];
+			}
+			info[n].pi_name[i] = 0;
+			spinlock_release(&p->p_lock);
+			n++;
+		}
+		spinlock_release(&pb->pb_lock);
+	}
+	lock_release(proc_family_lk);
+
+	return n;
 }
 
 /*
@@ -170,13 +318,13 @@ static struct proc * proc_create(const char *name) {
 
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
@@ -189,47 +337,68 @@ static struct proc * proc_create(const char *name) {
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-#ifdef UW
-	proc->console = NULL;
-#endif // UW
+	spinlock_init(&proc->p_fdlock);
+	for (int i = 0; i < OPEN_MAX; i++) {
+		proc->p_fds[i] = NULL;
+	}
 
 	// Added for A2
 
-	// Generate a process ID and add it to the processes array
-	proc->p_id = gen_pid();
 	proc->p_did_exit = false;
 	proc->p_exitcode = 0;
 
-	proc->p_exit_lk = lock_create("p_exit_lk");
-	if (proc->p_exit_lk == NULL) {
+	proc->p_parent = NULL;
+	proc->p_vfork_sem = NULL;
+	proc->p_ioring = NULL;
+
+	proc->p_wait_cv = cv_create("p_wait_cv");
+	if (proc->p_wait_cv == NULL) {
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
-	proc->p_wait_lk = lock_create("p_wait_lk");
-	if (proc->p_exit_lk == NULL) {
-		lock_destroy(proc->p_exit_lk);
+
+	proc->p_thread_cv = cv_create("p_thread_cv");
+	if (proc->p_thread_cv == NULL) {
+		cv_destroy(proc->p_wait_cv);
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
+	array_init(&proc->p_uthreads);
+	proc->p_nextutid = 1;
+	proc->p_exiting = false;
+	proc->p_oomkilled = false;
 
-	proc->p_wait_cv = cv_create("p_wait_cv");
-	if (proc->p_exit_lk == NULL) {
-		lock_destroy(proc->p_wait_lk);
-		lock_destroy(proc->p_exit_lk);
+	array_init(&proc->p_children); // initialize the children
+	pollqueue_init(&proc->p_waitpq);
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_childusage, sizeof(proc->p_childusage));
+	proc->p_nice = 0;
+	proc->p_vruntime = 0;
+
+	// Process created successfully, give it a PID in the process table
+	if (pidtable_add(proc)) {
+		pollqueue_cleanup(&proc->p_waitpq);
+		array_cleanup(&proc->p_children);
+		array_cleanup(&proc->p_uthreads);
+		cv_destroy(proc->p_thread_cv);
+		cv_destroy(proc->p_wait_cv);
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	proc->p_children = *array_create();
-	array_init(&proc->p_children); // initialize the children
+	return proc;
+}
 
-	// Process created successfully, add it to the array of all processes
-	procarray_allprocs_add_proc(proc);
+/*
+ * Free a proc once no proc_by_pid can still be looking at it.
+ */
+static void proc_free_rcu(struct rcu_head *head) {
+	struct proc *proc = (struct proc *)head;
 
-	return proc;
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -248,8 +417,8 @@ void proc_destroy(struct proc *proc) {
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
-	// Remove the process from the global process array.
-	procarray_allprocs_remove_proc(proc->p_id);
+	// Remove the process from the process table, freeing its PID.
+	pidtable_remove(proc);
 
 	/*
 	 * We don't take p_lock in here because we must have the only
@@ -285,23 +454,29 @@ void proc_destroy(struct proc *proc) {
 	}
 #endif // UW
 
-#ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
-	}
-#endif // UW
+	/* normally already closed by sys__exit */
+	ioring_destroy(proc);
+	fd_closeall(proc);
+	spinlock_cleanup(&proc->p_fdlock);
 
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
 	// Added for A2
 	array_cleanup(&proc->p_children);
-	lock_destroy(proc->p_exit_lk);
-	lock_destroy(proc->p_wait_lk);
+	pollqueue_cleanup(&proc->p_waitpq);
 	cv_destroy(proc->p_wait_cv);
 
+	// Threads nobody joined
+	for (unsigned i = 0; i < array_num(&proc->p_uthreads); i++) {
+		kfree(array_get(&proc->p_uthreads, i));
+	}
+	array_setsize(&proc->p_uthreads, 0);
+	array_cleanup(&proc->p_uthreads);
+	cv_destroy(proc->p_thread_cv);
+
 	kfree(proc->p_name);
-	kfree(proc);
+	call_rcu(&proc->p_rcu, proc_free_rcu);
 
 #ifdef UW
 	/* decrement the process count */
@@ -326,6 +501,16 @@ void proc_destroy(struct proc *proc) {
  */
 void proc_bootstrap(void) {
 
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc), NULL);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: could not create proc cache\n");
+	}
+	pidtable_init();
+	proc_family_lk = lock_create("proc_family_lk");
+	if (proc_family_lk == NULL) {
+		panic("proc_bootstrap: could not create proc_family_lk\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -343,32 +528,63 @@ void proc_bootstrap(void) {
 #endif // UW
 }
 
+/*
+ * Open the console as stdin, stdout and stderr of PROC. stdout and stderr
+ * share one open file.
+ */
+static int proc_open_console(struct proc *proc) {
+	struct openfile *in, *out;
+	char path[sizeof("con:")];
+	int fd, result;
+
+	strcpy(path, "con:");
+	result = openfile_open(path, O_RDONLY, 0, &in);
+	if (result) {
+		return result;
+	}
+	strcpy(path, "con:");
+	result = openfile_open(path, O_WRONLY, 0, &out);
+	if (result) {
+		openfile_decref(in);
+		return result;
+	}
+	openfile_incref(out);
+
+	fd_alloc(proc, in, &fd);
+	KASSERT(fd == STDIN_FILENO);
+	fd_alloc(proc, out, &fd);
+	KASSERT(fd == STDOUT_FILENO);
+	fd_alloc(proc, out, &fd);
+	KASSERT(fd == STDERR_FILENO);
+	return 0;
+}
+
 /*
  * Create a fresh proc for use by runprogram.
  *
  * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * process's (that is, the kernel menu's) current directory. If FROM
+ * is not NULL (fork) it shares FROM's open files; otherwise it gets
+ * the console on its standard descriptors.
  */
-struct proc * proc_create_runprogram(const char *name) {
+struct proc * proc_create_runprogram(const char *name, struct proc *from) {
 	struct proc *proc;
-	char *console_path;
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 
-#ifdef UW
-	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
+	if (from != NULL) {
+		fd_copyall(from, proc);
+		/* A child starts where its parent is; forking resets nothing */
+		spinlock_acquire(&from->p_lock);
+		proc->p_nice = from->p_nice;
+		proc->p_vruntime = from->p_vruntime;
+		spinlock_release(&from->p_lock);
+	} else if (proc_open_console(proc)) {
+		panic("unable to open the console during process creation\n");
 	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
-	}
-	kfree(console_path);
-#endif // UW
 
 	/* VM fields */
 
@@ -405,6 +621,24 @@ struct proc * proc_create_runprogram(const char *name) {
 	return proc;
 }
 
+/*
+ * If PROC is a vfork child still running in its parent's address space,
+ * hand the address space back (the caller must already have switched
+ * away from it) and let the parent run again. Returns true if so, in
+ * which case the caller must not destroy the old address space.
+ */
+bool proc_vfork_done(struct proc *proc) {
+	struct semaphore *sem = proc->p_vfork_sem;
+
+	if (sem == NULL) {
+		return false;
+	}
+	/* the parent destroys the semaphore once it wakes up */
+	proc->p_vfork_sem = NULL;
+	V(sem);
+	return true;
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -424,6 +658,49 @@ int proc_addthread(struct proc *proc, struct thread *t) {
 	return 0;
 }
 
+static void usage_add(struct thread_usage *to, const struct thread_usage *from) {
+	to->tu_utime += from->tu_utime;
+	to->tu_stime += from->tu_stime;
+	to->tu_faults += from->tu_faults;
+	to->tu_majflt += from->tu_majflt;
+	to->tu_inblock += from->tu_inblock;
+	to->tu_oublock += from->tu_oublock;
+	to->tu_nvcsw += from->tu_nvcsw;
+	to->tu_nivcsw += from->tu_nivcsw;
+	to->tu_syscalls += from->tu_syscalls;
+}
+
+void proc_getusage(struct proc *proc, struct thread_usage *tu) {
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&proc->p_lock);
+	*tu = proc->p_usage;
+	for (i = 0; i < threadarray_num(&proc->p_threads); i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		usage_add(tu, &t->t_usage);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+void proc_getchildusage(struct proc *proc, struct thread_usage *tu) {
+	spinlock_acquire(&proc->p_lock);
+	*tu = proc->p_childusage;
+	spinlock_release(&proc->p_lock);
+}
+
+void proc_reapusage(struct proc *parent, struct proc *child) {
+	struct thread_usage tu, grandchildren;
+
+	proc_getusage(child, &tu);
+	proc_getchildusage(child, &grandchildren);
+	usage_add(&tu, &grandchildren);
+
+	spinlock_acquire(&parent->p_lock);
+	usage_add(&parent->p_childusage, &tu);
+	spinlock_release(&parent->p_lock);
+}
+
 /*
  * Remove a thread from its process. Either the thread or the process
  * might or might not be current.
@@ -440,7 +717,8 @@ void proc_remthread(struct thread *t) {
 	num = threadarray_num(&proc->p_threads);
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
-			threadarray_remove(&proc->p_threads, i);
+			threadarray_remove_unordered(&proc->p_threads, i);
+			usage_add(&proc->p_usage, &t->t_usage);
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
 			return;
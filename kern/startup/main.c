@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -49,7 +50,25 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <trace.h>
+#include <rcu.h>
+#include <workqueue.h>
+#include <lathist.h>
+#include <statsfs.h>
+#include <ioring.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#include "opt-lockprof.h"
+#include "opt-net.h"
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
+#if OPT_NET
+#include <net.h>
+#endif
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif
 
 
 /*
@@ -71,6 +90,57 @@ static const char harvard_copyright[] =
     "Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009\n"
     "   President and Fellows of Harvard College.  All rights reserved.\n";
 
+/*
+ * Boot phase timing. There's no clock until mainbus_bootstrap has
+ * attached one, so everything up to the end of the device probe can't
+ * be timed; each later phase is timed from the mark before it, and the
+ * lot is printed once boot is done.
+ */
+#define BOOT_MAXMARKS 12
+
+static struct {
+	const char *bm_name;
+	time_t bm_secs;
+	uint32_t bm_nsecs;
+} boot_marks[BOOT_MAXMARKS];
+static unsigned boot_nmarks;
+
+static
+void
+boot_mark(const char *name)
+{
+	KASSERT(boot_nmarks < BOOT_MAXMARKS);
+	boot_marks[boot_nmarks].bm_name = name;
+	gettime(&boot_marks[boot_nmarks].bm_secs,
+		&boot_marks[boot_nmarks].bm_nsecs);
+	boot_nmarks++;
+}
+
+static
+void
+boot_report(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+
+	kprintf("Boot phases:");
+	for (i=1; i<boot_nmarks; i++) {
+		getinterval(boot_marks[i-1].bm_secs, boot_marks[i-1].bm_nsecs,
+			    boot_marks[i].bm_secs, boot_marks[i].bm_nsecs,
+			    &secs, &nsecs);
+		kprintf(" %s %lu.%03lu", boot_marks[i].bm_name,
+			(unsigned long)secs * 1000 + nsecs / 1000000,
+			(unsigned long)(nsecs / 1000) % 1000);
+	}
+	getinterval(boot_marks[0].bm_secs, boot_marks[0].bm_nsecs,
+		    boot_marks[boot_nmarks-1].bm_secs,
+		    boot_marks[boot_nmarks-1].bm_nsecs,
+		    &secs, &nsecs);
+	kprintf(" (ms); %lu.%09lu seconds after the probe\n",
+		(unsigned long)secs, (unsigned long)nsecs);
+}
+
 
 /*
  * Initial boot sequence.
@@ -108,27 +178,58 @@ boot(void)
 	/* Early initialization. */
 	ram_bootstrap();
 	proc_bootstrap();
+	futex_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
+	workqueue_bootstrap();
+	ioring_bootstrap();
 	vfs_bootstrap();
+	statsfs_bootstrap();
+#if OPT_NET
+	/* Before the network cards attach */
+	net_bootstrap();
+#endif
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+	/* The clock is attached now */
+	boot_mark("probe");
+	cputime_start();
+	lat_start();
+	timepage_start();
+#if OPT_LOCKPROF
+	/* The clock is attached now */
+	lockprof_start();
+#endif
 	/* Now do pseudo-devices. */
 	pseudoconfig();
+	boot_mark("pseudo");
 	kprintf("\n");
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	boot_mark("vm");
 	kprintf_bootstrap();
+	trace_bootstrap();
+	rcu_bootstrap();
+	boot_mark("late");
+
+	/*
+	 * The other cpus hatch while we carry on; nothing between here
+	 * and thread_wait_cpus may assume they're running yet.
+	 */
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
+	boot_mark("bootfs");
 
+	thread_wait_cpus();
+	boot_mark("cpus");
+	boot_report();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -147,6 +248,10 @@ shutdown(void)
 
 	kprintf("Shutting down.\n");
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	vfs_clearbootfs();
 	vfs_clearcurdir();
 	vfs_unmountall();
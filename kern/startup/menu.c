@@ -31,20 +31,36 @@
 #include <kern/errno.h>
 #include <kern/reboot.h>
 #include <kern/unistd.h>
+#include <kern/fcntl.h>
 #include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <device.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <trace.h>
+#include <mainbus.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
+#if OPT_LOCKPROF
+#include <lockprof.h>
+#endif
+#include <lathist.h>
+#include "opt-kprof.h"
+#if OPT_KPROF
+#include <kprof.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -56,6 +72,12 @@
 
 extern uint32_t dbflags;
 
+typedef int (*menucmd_t)(int nargs, char **args);
+
+/* In the command table, further down */
+static menucmd_t cmd_lookup(const char *name);
+static int cmd_split(char *cmd, char **args, int *nargs);
+
 // XXX this should not be in this file
 void
 getinterval(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2,
@@ -80,26 +102,32 @@ getinterval(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2,
  * Note: this cannot pass arguments to the program. You may wish to
  * change it so it can, because that will make testing much easier
  * in the future.
- *
- * It copies the program name because runprogram destroys the copy
- * it gets by passing it to vfs_open().
  */
 static
 void
 cmd_progthread(void *ptr, unsigned long nargs)
 {
 	char **args = ptr;
-	char progname[128];
+	struct execargs ea;
+	unsigned long i;
 	int result;
 
 	KASSERT(nargs >= 1);
 
-	/* Hope we fit. */
-	KASSERT(strlen(args[0]) < sizeof(progname));
-
-	strcpy(progname, args[0]);
+	result = execargs_init(&ea);
+	for (i = 0; result == 0 && i < nargs; i++) {
+		result = execargs_add(&ea, args[i]);
+	}
+	if (result) {
+		if (ea.ea_buf != NULL) {
+			execargs_cleanup(&ea);
+		}
+		kprintf("Running program %s failed: %s\n", args[0],
+			strerror(result));
+		return;
+	}
 
-	result = runprogram(progname, args, nargs);
+	result = runprogram(args[0], &ea);
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
@@ -134,7 +162,7 @@ common_prog(int nargs, char **args)
 #endif
 
 	/* Create a process for the new program to run in. */
-	proc = proc_create_runprogram(args[0] /* name */);
+	proc = proc_create_runprogram(args[0] /* name */, NULL);
 	if (proc == NULL) {
 		return ENOMEM;
 	}
@@ -360,6 +388,40 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command for making a striping device out of several disks.
+ */
+
+/* Blocks per stripe unit unless -u says otherwise */
+#define STRIPE_DEFAULT_UNIT  8
+
+static
+int
+cmd_stripe(int nargs, char **args)
+{
+	unsigned unit = STRIPE_DEFAULT_UNIT;
+	int i;
+
+	if (nargs >= 3 && !strcmp(args[1], "-u")) {
+		unit = atoi(args[2]);
+		nargs -= 2;
+		args += 2;
+	}
+	if (nargs < 2) {
+		kprintf("Usage: stripe [-u blocks] disk...\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colons after the disk names */
+	for (i=1; i<nargs; i++) {
+		if (args[i][strlen(args[i])-1]==':') {
+			args[i][strlen(args[i])-1] = 0;
+		}
+	}
+
+	return devstripe_create(nargs - 1, args + 1, unit);
+}
+
 /*
  * Command to set the "boot fs".
  *
@@ -401,6 +463,725 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Commands for summing up the kernel heap.
+ */
+static
+int
+cmd_kheapfrag(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printfrag();
+
+	return 0;
+}
+
+static
+int
+cmd_kheapsites(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printsites();
+
+	return 0;
+}
+
+static
+int
+cmd_kheaptags(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printtags();
+
+	return 0;
+}
+
+/*
+ * Command for reprinting recent DEBUG() output.
+ */
+static
+int
+cmd_dmesg(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	klog_dmesg();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printschedstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing system call counts and times.
+ */
+static
+int
+cmd_syscallstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	syscall_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing how each cpu has spent its time.
+ */
+static
+int
+cmd_cputimes(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpu_printtimes();
+
+	return 0;
+}
+
+/*
+ * Command for showing or setting the preemption quantum.
+ */
+static
+int
+cmd_quantum(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("Quantum: %u hardclocks (%u Hz)\n",
+			hardclock_getquantum(), (unsigned)HZ);
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: quantum [ticks]\n");
+		return EINVAL;
+	}
+
+	result = hardclock_setquantum(atoi(args[1]));
+	if (result) {
+		kprintf("quantum: must be between 1 and %u\n",
+			(unsigned)HARDCLOCK_QUANTUM_MAX);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Command for showing or choosing the cpus device interrupts go to.
+ */
+static
+int
+cmd_irq(int nargs, char **args)
+{
+	uint32_t cpus;
+	unsigned cpu;
+	int i, result;
+
+	if (nargs == 1) {
+		kprintf("I/O cpus:");
+		for (cpu=0; cpu<cpu_count(); cpu++) {
+			if (mainbus_iocpus() & ((uint32_t)1 << cpu)) {
+				kprintf(" %u", cpu);
+			}
+		}
+		kprintf("\n");
+		mainbus_irqreport();
+		return 0;
+	}
+
+	cpus = 0;
+	for (i=1; i<nargs; i++) {
+		cpu = atoi(args[i]);
+		if (cpu >= cpu_count() || cpu >= 32) {
+			kprintf("irq: no cpu %s\n", args[i]);
+			return EINVAL;
+		}
+		cpus |= (uint32_t)1 << cpu;
+	}
+	result = mainbus_set_iocpus(cpus);
+	if (result) {
+		kprintf("Usage: irq [cpu ...]\n");
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Command for controlling and dumping the event trace.
+ */
+static
+int
+cmd_trace(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		traceflags = TR_ALL;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "on")) {
+		traceflags = atoi(args[2]) & TR_ALL;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		traceflags = 0;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "dump")) {
+		trace_dump();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clear")) {
+		trace_clear();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "ltrace")) {
+		trace_setmirror(!strcmp(args[2], "on"));
+	}
+	else {
+		kprintf("Usage: trace on [mask] | off | dump | clear | "
+			"ltrace on|off\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Command for printing (or clearing) the latency histograms.
+ */
+static
+int
+cmd_latency(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lat_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: lat [reset]\n");
+		return EINVAL;
+	}
+	lat_report();
+	return 0;
+}
+
+/*
+ * Command for printing (or clearing) the per-disk I/O statistics.
+ */
+static
+int
+cmd_iostat(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		iostat_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: iostat [reset]\n");
+		return EINVAL;
+	}
+	iostat_report();
+	return 0;
+}
+
+#if OPT_LOCKPROF
+/*
+ * Command for printing (or clearing) lock contention statistics.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: lockstat [reset]\n");
+		return EINVAL;
+	}
+	lockprof_report();
+	return 0;
+}
+#endif
+
+#if OPT_KPROF
+/*
+ * Command for the sampling profiler. The report takes its symbols
+ * from the kernel image sys161 was started with, unless told where
+ * another one is.
+ */
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = kprof_start();
+		if (result) {
+			kprintf("kprof: %s\n", strerror(result));
+		}
+		return result;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kprof_stop();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kprof_reset();
+	}
+	else if ((nargs == 2 || nargs == 3) && !strcmp(args[1], "report")) {
+		kprof_report(nargs == 3 ? args[2] : "emu0:kernel");
+	}
+	else {
+		kprintf("Usage: kprof on | off | reset | report [kernel]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+#endif
+
+////////////////////////////////////////
+//
+// Benchmarking: time, repeat, and scripts of commands.
+
+#define SCRIPT_MAXSIZE   8192	/* bytes in a script file */
+#define SCRIPT_MAXDEPTH  4	/* scripts running scripts */
+
+/*
+ * What a benchmark report compares: the time, the vm counters, and
+ * how each cpu has spent its time.
+ */
+struct benchsnap {
+	uint64_t bs_nsecs;
+	unsigned bs_vmstats[VMSTAT_COUNT];
+	unsigned bs_ncpus;
+	struct cputimes *bs_cpus;
+};
+
+static unsigned script_depth;
+
+static
+int
+benchsnap_init(struct benchsnap *bs)
+{
+	bs->bs_ncpus = cpu_count();
+	bs->bs_cpus = kmalloc(bs->bs_ncpus * sizeof(struct cputimes));
+	if (bs->bs_cpus == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+benchsnap_cleanup(struct benchsnap *bs)
+{
+	kfree(bs->bs_cpus);
+}
+
+static
+void
+benchsnap_take(struct benchsnap *bs)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+
+	vmstats_get(bs->bs_vmstats);
+	for (i=0; i<bs->bs_ncpus; i++) {
+		cpu_gettimes(i, &bs->bs_cpus[i]);
+	}
+	gettime(&secs, &nsecs);
+	bs->bs_nsecs = (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Print what changed between BEFORE and AFTER, over NRUNS runs of a
+ * command. Cycles are worked out from the time at the nominal clock
+ * rate, since the cycle counter is reset whenever a cpu idles.
+ */
+static
+void
+bench_report(const struct benchsnap *before, const struct benchsnap *after,
+	     unsigned nruns)
+{
+	uint64_t nsecs, cycles, total, d[CPUTIME_NSTATES];
+	uint32_t freq = mainbus_cpufreq();
+	unsigned i, j, delta;
+	bool any;
+
+	nsecs = after->bs_nsecs - before->bs_nsecs;
+	cycles = nsecs / 1000000000 * freq +
+		nsecs % 1000000000 * freq / 1000000000;
+	kprintf("Elapsed: %llu.%09llu seconds, %llu cycles",
+		(unsigned long long)(nsecs / 1000000000),
+		(unsigned long long)(nsecs % 1000000000),
+		(unsigned long long)cycles);
+	if (nruns > 1) {
+		kprintf(" (%llu per run)", (unsigned long long)(cycles / nruns));
+	}
+	kprintf("\n");
+
+	any = false;
+	for (i=0; i<VMSTAT_COUNT; i++) {
+		delta = after->bs_vmstats[i] - before->bs_vmstats[i];
+		if (delta != 0) {
+			kprintf("%s %s +%u", any ? "," : "VM:",
+				vmstats_name(i), delta);
+			any = true;
+		}
+	}
+	if (any) {
+		kprintf("\n");
+	}
+
+	for (i=0; i<after->bs_ncpus; i++) {
+		total = 0;
+		for (j=0; j<CPUTIME_NSTATES; j++) {
+			d[j] = after->bs_cpus[i].ct_nsecs[j] -
+				before->bs_cpus[i].ct_nsecs[j];
+			total += d[j];
+		}
+		if (total == 0) {
+			continue;
+		}
+		kprintf("cpu%u: %u%% busy (user %u%%, kernel %u%%, "
+			"intr %u%%)\n", i,
+			(unsigned)((total - d[CPUTIME_IDLE]) * 100 / total),
+			(unsigned)(d[CPUTIME_USER] * 100 / total),
+			(unsigned)(d[CPUTIME_KERNEL] * 100 / total),
+			(unsigned)(d[CPUTIME_INTR] * 100 / total));
+	}
+}
+
+/*
+ * Run the command in ARGS NRUNS times, or until it fails, and report
+ * on it.
+ */
+static
+int
+bench_run(int nargs, char **args, unsigned nruns)
+{
+	struct benchsnap before, after;
+	menucmd_t func;
+	unsigned i;
+	int result;
+
+	func = cmd_lookup(args[0]);
+	if (func == NULL) {
+		kprintf("%s: Command not found\n", args[0]);
+		return EINVAL;
+	}
+
+	result = benchsnap_init(&before);
+	if (result) {
+		return result;
+	}
+	result = benchsnap_init(&after);
+	if (result) {
+		benchsnap_cleanup(&before);
+		return result;
+	}
+
+	benchsnap_take(&before);
+	result = 0;
+	for (i=0; i<nruns && result == 0; i++) {
+		result = func(nargs, args);
+	}
+	benchsnap_take(&after);
+
+	bench_report(&before, &after, i);
+	benchsnap_cleanup(&after);
+	benchsnap_cleanup(&before);
+	return result;
+}
+
+/*
+ * Command for timing another command.
+ */
+static
+int
+cmd_time(int nargs, char **args)
+{
+	if (nargs < 2) {
+		kprintf("Usage: time command [arguments]\n");
+		return EINVAL;
+	}
+	return bench_run(nargs - 1, args + 1, 1);
+}
+
+/*
+ * Command for running another command a number of times.
+ */
+static
+int
+cmd_repeat(int nargs, char **args)
+{
+	int n;
+
+	if (nargs < 3 || (n = atoi(args[1])) <= 0) {
+		kprintf("Usage: repeat count command [arguments]\n");
+		return EINVAL;
+	}
+	return bench_run(nargs - 2, args + 2, n);
+}
+
+/*
+ * One of the threads cmd_scale runs a command in.
+ */
+struct scalerun {
+	menucmd_t sr_func;
+	int sr_nargs;
+	char **sr_args;
+	struct semaphore *sr_done;
+	volatile int sr_result;		/* first failure, or 0 */
+};
+
+static
+void
+scale_thread(void *vsr, unsigned long num)
+{
+	struct scalerun *sr = vsr;
+	int result;
+
+	(void)num;
+	result = sr->sr_func(sr->sr_nargs, sr->sr_args);
+	if (result) {
+		sr->sr_result = result;
+	}
+	V(sr->sr_done);
+}
+
+/*
+ * Command for seeing how a command scales: run 1, 2, ... N copies of
+ * it at once, each in its own thread, and for each report the time,
+ * the throughput, the speedup over one copy and the parallel
+ * efficiency, and how busy the cpus were. If efficiency drops while
+ * the cpus stay busy, the copies are fighting over something (see
+ * lockstat). The command has to be one that can run in several
+ * threads at once; for user programs, use /testbin/scale.
+ */
+static
+int
+cmd_scale(int nargs, char **args)
+{
+	struct benchsnap before, after;
+	struct scalerun sr;
+	uint64_t t, t1 = 0, total, idle, speedup;
+	unsigned max, n, i, j;
+	int result;
+
+	if (nargs < 3 || atoi(args[1]) <= 0) {
+		kprintf("Usage: scale maxcopies command [arguments]\n");
+		return EINVAL;
+	}
+	max = atoi(args[1]);
+	sr.sr_func = cmd_lookup(args[2]);
+	if (sr.sr_func == NULL) {
+		kprintf("%s: Command not found\n", args[2]);
+		return EINVAL;
+	}
+	sr.sr_nargs = nargs - 2;
+	sr.sr_args = args + 2;
+	sr.sr_result = 0;
+	sr.sr_done = sem_create("scale", 0);
+	if (sr.sr_done == NULL) {
+		return ENOMEM;
+	}
+	result = benchsnap_init(&before);
+	if (result) {
+		sem_destroy(sr.sr_done);
+		return result;
+	}
+	result = benchsnap_init(&after);
+	if (result) {
+		benchsnap_cleanup(&before);
+		sem_destroy(sr.sr_done);
+		return result;
+	}
+
+	kprintf("copies     ms  copies/min  speedup  efficiency  busy\n");
+	for (n = 1; n <= max && sr.sr_result == 0; n++) {
+		benchsnap_take(&before);
+		for (i=0; i<n; i++) {
+			result = thread_fork("scale", NULL, scale_thread,
+					     &sr, i);
+			if (result) {
+				kprintf("thread_fork failed: %s\n",
+					strerror(result));
+				break;
+			}
+		}
+		for (j=0; j<i; j++) {
+			P(sr.sr_done);
+		}
+		benchsnap_take(&after);
+		if (result) {
+			break;
+		}
+
+		t = after.bs_nsecs - before.bs_nsecs;
+		if (t == 0) {
+			t = 1;
+		}
+		if (n == 1) {
+			t1 = t;
+		}
+		total = idle = 0;
+		for (i=0; i<after.bs_ncpus; i++) {
+			for (j=0; j<CPUTIME_NSTATES; j++) {
+				total += after.bs_cpus[i].ct_nsecs[j] -
+					before.bs_cpus[i].ct_nsecs[j];
+			}
+			idle += after.bs_cpus[i].ct_nsecs[CPUTIME_IDLE] -
+				before.bs_cpus[i].ct_nsecs[CPUTIME_IDLE];
+		}
+		speedup = t1 * n * 100 / t;
+		kprintf("%6u %6u  %10u  %3u.%02u  %9u%%  %3u%%\n", n,
+			(unsigned)(t / 1000000),
+			(unsigned)((uint64_t)n * 60 * 1000000000 / t),
+			(unsigned)(speedup / 100), (unsigned)(speedup % 100),
+			(unsigned)(speedup / n),
+			total == 0 ? 0 : (unsigned)(100 - idle * 100 / total));
+	}
+	if (result == 0) {
+		result = sr.sr_result;
+	}
+
+	benchsnap_cleanup(&after);
+	benchsnap_cleanup(&before);
+	sem_destroy(sr.sr_done);
+	return result;
+}
+
+/*
+ * Read the script PATH into a fresh, null-terminated buffer.
+ */
+static
+int
+script_read(const char *path, char **ret)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char *name, *buf;
+	int result;
+
+	name = kstrdup(path);
+	if (name == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(name, O_RDONLY, 0, &vn);
+	kfree(name);
+	if (result) {
+		return result;
+	}
+
+	buf = kmalloc(SCRIPT_MAXSIZE + 1);
+	if (buf == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
+	/* One byte more than fits, to tell if there's more */
+	uio_kinit(&iov, &ku, buf, SCRIPT_MAXSIZE + 1, 0, UIO_READ);
+	while (ku.uio_resid > 0) {
+		size_t resid = ku.uio_resid;
+
+		result = VOP_READ(vn, &ku);
+		if (result || ku.uio_resid == resid) {
+			break;
+		}
+	}
+	vfs_close(vn);
+	if (result == 0 && ku.uio_resid == 0) {
+		result = EFBIG;
+	}
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+
+	buf[SCRIPT_MAXSIZE + 1 - ku.uio_resid] = 0;
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Command for running a file of commands, reporting on each one as if
+ * it had been run with "time". A line holds commands separated by
+ * semicolons, as at the prompt; blank lines and lines starting with #
+ * are skipped. The script stops at the first command that fails.
+ */
+static
+int
+cmd_script(int nargs, char **args)
+{
+	char *buf, *line, *command, *lctx, *cctx;
+	char *cargs[MAXMENUARGS];
+	int cnargs, i, result;
+
+	if (nargs != 2) {
+		kprintf("Usage: script file\n");
+		return EINVAL;
+	}
+	if (script_depth >= SCRIPT_MAXDEPTH) {
+		kprintf("script: scripts nested too deeply\n");
+		return ELOOP;
+	}
+
+	result = script_read(args[1], &buf);
+	if (result) {
+		kprintf("script: %s: %s\n", args[1], strerror(result));
+		return result;
+	}
+
+	script_depth++;
+	result = 0;
+	for (line = strtok_r(buf, "\n", &lctx);
+	     line != NULL && result == 0;
+	     line = strtok_r(NULL, "\n", &lctx)) {
+		while (*line == ' ' || *line == '\t') {
+			line++;
+		}
+		if (*line == '#') {
+			continue;
+		}
+		for (command = strtok_r(line, ";", &cctx);
+		     command != NULL && result == 0;
+		     command = strtok_r(NULL, ";", &cctx)) {
+			result = cmd_split(command, cargs, &cnargs);
+			if (result || cnargs == 0) {
+				continue;
+			}
+			kprintf("script: %s", cargs[0]);
+			for (i=1; i<cnargs; i++) {
+				kprintf(" %s", cargs[i]);
+			}
+			kprintf("\n");
+			result = bench_run(cnargs, cargs, 1);
+		}
+	}
+	script_depth--;
+
+	kfree(buf);
+	return result;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -435,11 +1216,16 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[stripe]  Stripe disks together     ",
 	"[bootfs]  Set \"boot\" filesystem   ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[time]    Time a command            ",
+	"[repeat]  Repeat a command          ",
+	"[scale]   Run copies of a command   ",
+	"[script]  Run commands from a file  ",
 	"[dth]     Enable thread debugging   ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
@@ -460,17 +1246,24 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[bt]  Bitmap test                   ",
+	"[ht]  Hash table test               ",
+	"[rt]  Radix tree test               ",
+	"[ring] Ring buffer test             ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc mapped-pages test     ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tbench] Thread benchmarks          ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
+	"[wq]  Softint/work queue test       ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[bench] Synch benchmarks    (1)     ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -480,6 +1273,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fsb] FS benchmarks                 ",
 	NULL
 };
 
@@ -510,6 +1304,24 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[khf] Kernel heap fragmentation     ",
+	"[khs] Kernel heap by call site      ",
+	"[kht] Kernel heap by subsystem      ",
+	"[ss] Scheduler stats                ",
+	"[sc] Syscall stats                  ",
+	"[ct] Cpu time stats                 ",
+	"[quantum] Show/set time slice       ",
+	"[irq] Show/set interrupt cpus       ",
+	"[dmesg] Show recent debug output    ",
+	"[trace] Event tracing               ",
+	"[lat] Latency percentiles           ",
+	"[iostat] Disk I/O stats             ",
+#if OPT_LOCKPROF
+	"[lockstat] Lock contention stats    ",
+#endif
+#if OPT_KPROF
+	"[kprof] Sampling profiler           ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -545,11 +1357,16 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",cmd_unmount },
+	{ "stripe",	cmd_stripe },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "time",	cmd_time },
+	{ "repeat",	cmd_repeat },
+	{ "scale",	cmd_scale },
+	{ "script",	cmd_script },
 	{ "dth",	cmd_dth },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
@@ -566,23 +1383,48 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "khf",        cmd_kheapfrag },
+	{ "khs",        cmd_kheapsites },
+	{ "kht",        cmd_kheaptags },
+	{ "ss",         cmd_schedstats },
+	{ "sc",         cmd_syscallstats },
+	{ "ct",         cmd_cputimes },
+	{ "quantum",    cmd_quantum },
+	{ "irq",        cmd_irq },
+	{ "dmesg",      cmd_dmesg },
+	{ "trace",      cmd_trace },
+	{ "lat",        cmd_latency },
+	{ "iostat",     cmd_iostat },
+#if OPT_LOCKPROF
+	{ "lockstat",   cmd_lockstat },
+#endif
+#if OPT_KPROF
+	{ "kprof",      cmd_kprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
+	{ "ht",		hashtest },
+	{ "rt",		radixtest },
+	{ "ring",	ringtest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallockva },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tbench",	threadbench },
 	{ "sy1",	semtest },
+	{ "wq",		worktest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "bench",	synchbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -594,63 +1436,96 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fsb",	fsbench },
 
 	{ NULL, NULL }
 };
 
 /*
- * Process a single command.
+ * Find the function for command NAME, or NULL.
+ */
+static
+menucmd_t
+cmd_lookup(const char *name)
+{
+	int i;
+
+	for (i=0; cmdtable[i].name; i++) {
+		if (*cmdtable[i].name && !strcmp(name, cmdtable[i].name)) {
+			KASSERT(cmdtable[i].func!=NULL);
+			return cmdtable[i].func;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Split CMD into words, in ARGS, at most MAXMENUARGS of them.
  */
 static
 int
-cmd_dispatch(char *cmd)
+cmd_split(char *cmd, char **args, int *nargs)
 {
-	time_t beforesecs, aftersecs, secs;
-	uint32_t beforensecs, afternsecs, nsecs;
-	char *args[MAXMENUARGS];
-	int nargs=0;
 	char *word;
 	char *context;
-	int i, result;
 
+	*nargs = 0;
 	for (word = strtok_r(cmd, " \t", &context);
 	     word != NULL;
 	     word = strtok_r(NULL, " \t", &context)) {
 
-		if (nargs >= MAXMENUARGS) {
+		if (*nargs >= MAXMENUARGS) {
 			kprintf("Command line has too many words\n");
 			return E2BIG;
 		}
-		args[nargs++] = word;
+		args[(*nargs)++] = word;
+	}
+	return 0;
+}
+
+/*
+ * Process a single command.
+ */
+static
+int
+cmd_dispatch(char *cmd)
+{
+	time_t beforesecs, aftersecs, secs;
+	uint32_t beforensecs, afternsecs, nsecs;
+	char *args[MAXMENUARGS];
+	int nargs;
+	menucmd_t func;
+	int result;
+
+	result = cmd_split(cmd, args, &nargs);
+	if (result) {
+		return result;
 	}
 
 	if (nargs==0) {
 		return 0;
 	}
 
-	for (i=0; cmdtable[i].name; i++) {
-		if (*cmdtable[i].name && !strcmp(args[0], cmdtable[i].name)) {
-			KASSERT(cmdtable[i].func!=NULL);
-
-			gettime(&beforesecs, &beforensecs);
+	func = cmd_lookup(args[0]);
+	if (func == NULL) {
+		kprintf("%s: Command not found\n", args[0]);
+		return EINVAL;
+	}
 
-			result = cmdtable[i].func(nargs, args);
+	gettime(&beforesecs, &beforensecs);
 
-			gettime(&aftersecs, &afternsecs);
-			getinterval(beforesecs, beforensecs,
-				    aftersecs, afternsecs,
-				    &secs, &nsecs);
+	result = func(nargs, args);
 
-			kprintf("Operation took %lu.%09lu seconds\n",
-				(unsigned long) secs,
-				(unsigned long) nsecs);
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs,
+		    aftersecs, afternsecs,
+		    &secs, &nsecs);
 
-			return result;
-		}
-	}
+	kprintf("Operation took %lu.%09lu seconds\n",
+		(unsigned long) secs,
+		(unsigned long) nsecs);
 
-	kprintf("%s: Command not found\n", args[0]);
-	return EINVAL;
+	return result;
 }
 
 /*
@@ -702,6 +1577,10 @@ menu_execute(char *line, int isargs)
  * the kernel command line
  *
  *      "mount sfs lhd0; bootfs lhd0; s"
+ *
+ * and to run a list of benchmarks unattended and then shut down,
+ *
+ *      "script emu0:bench/regress; q"
  */
 
 void
@@ -8,6 +8,8 @@
  * 05-01-2012: TBB : added comments to try to clarify use/non use of volatile
  * 22-08-2013: TBB: made cat and mouse eating and sleeping time optional parameters
  * 27-04-2014: KMS: change this to simulation driver that invokes student-implemented synch functions
+ * added per-creature wait statistics, meals per second, the starvation
+ *   ratio between species, and an optional number of cpus to run on
  *
  */
 
@@ -32,11 +34,18 @@
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
+#include <cpu.h>
 #include <synchprobs.h>
 
+struct creature_stats;
+
 /* functions defined and used internally */
 static void initialize_bowls(void);
 static void cleanup_bowls(void);
+static uint64_t sim_now(void);
+static void record_wait(struct creature_stats *cs, uint64_t before);
+static uint64_t report_species(const char *name, struct creature_stats *stats,
+                               int count);
 static void cat_eat(unsigned int bowlnumber, int eat_time);
 static void cat_sleep(int sleep_time);
 static void mouse_eat(unsigned int bowlnumber, int eat_time);
@@ -67,13 +76,14 @@ static int CatEatTime = 1;      // length of time a cat spends eating
 static int CatSleepTime = 2;    // length of time a cat spends sleeping
 static int MouseEatTime = 1;    // length of time a mouse spends eating
 static int MouseSleepTime = 2;  // length of time a mouse spends sleeping
+static unsigned NumCpus;        // cats and mice are spread over cpus 0..NumCpus-1
 
 /*
  * Once the main driver function (catmouse()) has created the cat and mouse
- * simulation threads, it uses this semaphore to block until all of the
+ * simulation threads, it uses this barrier to block until all of the
  * cat and mouse simulations are finished.
  */
-static struct semaphore *CatMouseWait;
+static struct barrier *CatMouseWait;
 
 /*
  *
@@ -111,16 +121,17 @@ static volatile int eating_mice_count;
  */
 static struct semaphore *mutex;
 
-/* performance statistics */
-static volatile time_t cat_total_wait_secs;
-static volatile uint32_t cat_total_wait_nsecs;
-static volatile int cat_wait_count;
-static volatile time_t mouse_total_wait_secs;
-static volatile uint32_t mouse_total_wait_nsecs;
-static volatile int mouse_wait_count;
-
-/* mutex to provide mutual exclusion to performance stats */
-static struct semaphore *perf_mutex;
+/* performance statistics, one for each cat and each mouse
+ * each is written only by its own creature's thread, and read by the
+ * driver once they have all finished, so no mutex is needed
+ */
+struct creature_stats {
+  uint64_t cs_totalwait;  // nanoseconds spent in *_before_eating
+  uint64_t cs_maxwait;    // longest single wait
+  unsigned cs_meals;
+};
+static struct creature_stats *cat_stats;
+static struct creature_stats *mouse_stats;
 
 
 /*
@@ -158,18 +169,14 @@ initialize_bowls()
   if (mutex == NULL) {
     panic("initialize_bowls: could not create mutex\n");
   }
-  /* intialize perf_mutex semaphore */
-  perf_mutex = sem_create("stats mutex",1);
-  if (perf_mutex == NULL) {
-    panic("initialize_bowls: could not create perf_mutex\n");
+  /* intialize the statistics (kmalloc(0) is not allowed) */
+  cat_stats = kmalloc((NumCats+1)*sizeof(struct creature_stats));
+  mouse_stats = kmalloc((NumMice+1)*sizeof(struct creature_stats));
+  if (cat_stats == NULL || mouse_stats == NULL) {
+    panic("initialize_bowls: could not allocate statistics\n");
   }
-
-  cat_total_wait_secs = 0;
-  cat_total_wait_nsecs = 0;
-  cat_wait_count = 0;
-  mouse_total_wait_secs = 0;
-  mouse_total_wait_nsecs = 0;
-  mouse_wait_count = 0;
+  bzero(cat_stats, (NumCats+1)*sizeof(struct creature_stats));
+  bzero(mouse_stats, (NumMice+1)*sizeof(struct creature_stats));
 
   return;
 }
@@ -195,9 +202,13 @@ cleanup_bowls()
     sem_destroy( mutex );
     mutex = NULL;
   }
-  if (perf_mutex != NULL) {
-    sem_destroy( perf_mutex );
-    perf_mutex = NULL;
+  if (cat_stats != NULL) {
+    kfree(cat_stats);
+    cat_stats = NULL;
+  }
+  if (mouse_stats != NULL) {
+    kfree(mouse_stats);
+    mouse_stats = NULL;
   }
   if (bowls != NULL) {
     kfree( (void *) bowls );
@@ -205,6 +216,92 @@ cleanup_bowls()
   }
 }
 
+/*
+ * sim_now()
+ *
+ * Purpose:
+ *   the time of day in nanoseconds, for timing waits; unlike the
+ *   cycle counter, it is the same clock on every cpu
+ */
+
+static uint64_t
+sim_now()
+{
+  time_t secs;
+  uint32_t nsecs;
+
+  gettime(&secs,&nsecs);
+  return (uint64_t)secs*1000000000 + nsecs;
+}
+
+/*
+ * record_wait()
+ *
+ * Purpose:
+ *   counts a meal, and the wait for it since BEFORE, in the
+ *   calling creature's statistics
+ */
+
+static void
+record_wait(struct creature_stats *cs, uint64_t before)
+{
+  uint64_t wait;
+
+  wait = sim_now() - before;
+  cs->cs_totalwait += wait;
+  if (wait > cs->cs_maxwait) {
+    cs->cs_maxwait = wait;
+  }
+  cs->cs_meals++;
+}
+
+/*
+ * report_species()
+ *
+ * Purpose:
+ *   prints the waiting statistics for all cats or all mice:
+ *   the mean and longest wait, and the spread of each creature's
+ *   own mean wait, which shows whether some went hungry
+ *
+ * Returns:
+ *   the mean wait in nanoseconds, or 0 if there were no meals
+ */
+
+static uint64_t
+report_species(const char *name, struct creature_stats *stats, int count)
+{
+  uint64_t total, mean, maxwait, cmean, cmin, cmax;
+  unsigned meals;
+  int i;
+
+  total = maxwait = cmax = 0;
+  cmin = ~(uint64_t)0;
+  meals = 0;
+  for (i=0;i<count;i++) {
+    total += stats[i].cs_totalwait;
+    meals += stats[i].cs_meals;
+    if (stats[i].cs_maxwait > maxwait) {
+      maxwait = stats[i].cs_maxwait;
+    }
+    if (stats[i].cs_meals > 0) {
+      cmean = stats[i].cs_totalwait / stats[i].cs_meals;
+      if (cmean < cmin) cmin = cmean;
+      if (cmean > cmax) cmax = cmean;
+    }
+  }
+  if (meals == 0) {
+    return 0;
+  }
+  mean = total / meals;
+  kprintf("%s waiting time (usecs): mean %llu, max %llu; "
+          "per-%s mean from %llu to %llu\n", name,
+          (unsigned long long)(mean/1000),
+          (unsigned long long)(maxwait/1000), name,
+          (unsigned long long)(cmin/1000),
+          (unsigned long long)(cmax/1000));
+  return mean;
+}
+
 /*
  * print_state()
  *
@@ -436,12 +533,10 @@ cat_simulation(void * unusedpointer,
 {
   int i;
   unsigned int bowl;
-  time_t before_sec, after_sec, wait_sec;
-  uint32_t before_nsec, after_nsec, wait_nsec;
+  uint64_t before;
 
   /* avoid unused variable warnings. */
   (void) unusedpointer;
-  (void) catnumber;
 
 
   for(i=0;i<NumLoops;i++) {
@@ -452,30 +547,18 @@ cat_simulation(void * unusedpointer,
     /* choose bowl.  legal bowl numbers range from 1 to NumBowls */
     bowl = ((unsigned int)random() % NumBowls) + 1;
 
-    gettime(&before_sec,&before_nsec);
+    before = sim_now();
     cat_before_eating(bowl); /* student-implemented function */
-    gettime(&after_sec,&after_nsec);
+    record_wait(&cat_stats[catnumber], before);
 
     /* make the cat eat */
     cat_eat(bowl, CatEatTime);
 
     cat_after_eating(bowl); /* student-implemented function */
-
-    /* update wait time statistics */
-    getinterval(before_sec,before_nsec,after_sec,after_nsec,&wait_sec,&wait_nsec);
-    P(perf_mutex);
-    cat_total_wait_secs += wait_sec;
-    cat_total_wait_nsecs += wait_nsec;
-    if (cat_total_wait_nsecs > 1000000000) {
-      cat_total_wait_nsecs -= 1000000000;
-      cat_total_wait_secs ++;
-    }
-    cat_wait_count++;
-    V(perf_mutex);
   }
 
   /* indicate that this cat simulation is finished */
-  V(CatMouseWait);
+  barrier_wait(CatMouseWait);
 }
 
 /*
@@ -500,12 +583,10 @@ mouse_simulation(void * unusedpointer,
 {
   int i;
   unsigned int bowl;
-  time_t before_sec, after_sec, wait_sec;
-  uint32_t before_nsec, after_nsec, wait_nsec;
+  uint64_t before;
 
   /* Avoid unused variable warnings. */
   (void) unusedpointer;
-  (void) mousenumber;
 
   for(i=0;i<NumLoops;i++) {
 
@@ -515,37 +596,25 @@ mouse_simulation(void * unusedpointer,
     /* choose bowl.  legal bowl numbers range from 1 to NumBowls */
     bowl = ((unsigned int)random() % NumBowls) + 1;
 
-    gettime(&before_sec,&before_nsec);
+    before = sim_now();
     mouse_before_eating(bowl); /* student-implemented function */
-    gettime(&after_sec,&after_nsec);
+    record_wait(&mouse_stats[mousenumber], before);
 
     /* make the mouse eat */
     mouse_eat(bowl, MouseEatTime);
 
     mouse_after_eating(bowl); /* student-implemented function */
-
-    /* update wait time statistics */
-    getinterval(before_sec,before_nsec,after_sec,after_nsec,&wait_sec,&wait_nsec);
-    P(perf_mutex);
-    mouse_total_wait_secs += wait_sec;
-    mouse_total_wait_nsecs += wait_nsec;
-    if (mouse_total_wait_nsecs > 1000000000) {
-      mouse_total_wait_nsecs -= 1000000000;
-      mouse_total_wait_secs ++;
-    }
-    mouse_wait_count++;
-    V(perf_mutex);
   }
 
   /* indicate that this mouse is finished */
-  V(CatMouseWait);
+  barrier_wait(CatMouseWait);
 }
 
 /*
  * catmouse()
  *
  * Arguments:
- *      int nargs: should be 5 or 9
+ *      int nargs: should be 5, 9 or 10
  *      char ** args: args[1] = number of food bowls
  *                    args[2] = number of cats
  *                    args[3] = number of mice
@@ -555,6 +624,7 @@ mouse_simulation(void * unusedpointer,
  *                    args[6] = cat sleeping time
  *                    args[7] = mouse eating time
  *                    args[8] = mouse sleeping time
+ *                    args[9] = number of cpus to use
  *
  * Returns:
  *      0 on success.
@@ -569,18 +639,16 @@ catmouse(int nargs,
          char ** args)
 {
   int catindex, mouseindex, error;
-  int i;
-  int mean_cat_wait_usecs, mean_mouse_wait_usecs;
-  time_t before_sec, after_sec, wait_sec;
-  uint32_t before_nsec, after_nsec, wait_nsec;
-  int total_bowl_milliseconds, total_eating_milliseconds, utilization_percent;
+  uint64_t before, elapsed, mean_cat_wait, mean_mouse_wait, ratio;
+  uint64_t total_bowl_milliseconds, total_eating_milliseconds;
+  unsigned meals, creature;
 
   /* check and process command line arguments */
-  if ((nargs != 9) && (nargs != 5)) {
+  if ((nargs != 10) && (nargs != 9) && (nargs != 5)) {
     kprintf("Usage: <command> NUM_BOWLS NUM_CATS NUM_MICE NUM_LOOPS\n");
     kprintf("or\n");
     kprintf("Usage: <command> NUM_BOWLS NUM_CATS NUM_MICE NUM_LOOPS ");
-    kprintf("CAT_EATING_TIME CAT_SLEEPING_TIME MOUSE_EATING_TIME MOUSE_SLEEPING_TIME\n");
+    kprintf("CAT_EATING_TIME CAT_SLEEPING_TIME MOUSE_EATING_TIME MOUSE_SLEEPING_TIME [NUM_CPUS]\n");
     return 1;  // return failure indication
   }
 
@@ -606,7 +674,8 @@ catmouse(int nargs,
     return 1;
   }
 
-  if (nargs == 9) {
+  NumCpus = cpu_count();
+  if (nargs >= 9) {
     CatEatTime = atoi(args[5]);
     if (CatEatTime < 0) {
       kprintf("catmouse: invalid cat eating time: %d\n",CatEatTime);
@@ -631,17 +700,26 @@ catmouse(int nargs,
       return 1;
     }
   }
+  if (nargs == 10) {
+    NumCpus = atoi(args[9]);
+    if (NumCpus < 1 || NumCpus > cpu_count()) {
+      kprintf("catmouse: invalid number of cpus: %u (1 to %u)\n",
+              NumCpus,cpu_count());
+      return 1;
+    }
+  }
 
   kprintf("Using %d bowls, %d cats, and %d mice. Looping %d times.\n",
           NumBowls,NumCats,NumMice,NumLoops);
   kprintf("Using cat eating time %d, cat sleeping time %d\n", CatEatTime, CatSleepTime);
   kprintf("Using mouse eating time %d, mouse sleeping time %d\n", MouseEatTime, MouseSleepTime);
+  kprintf("Using %u cpus\n", NumCpus);
 
-  /* create the semaphore that is used to make the main thread
+  /* create the barrier that is used to make the main thread
      wait for all of the cats and mice to finish */
-  CatMouseWait = sem_create("CatMouseWait",0);
+  CatMouseWait = barrier_create("CatMouseWait",NumCats+NumMice+1);
   if (CatMouseWait == NULL) {
-    panic("catmouse: could not create semaphore\n");
+    panic("catmouse: could not create barrier\n");
   }
 
   /* initialize our simulation state */
@@ -651,19 +729,24 @@ catmouse(int nargs,
   catmouse_sync_init(NumBowls);
 
   /* get current time, for measuring total simulation time */
-  gettime(&before_sec,&before_nsec);
+  before = sim_now();
 
   /*
    * Start NumCats cat_simulation() threads and NumMice mouse_simulation() threads.
-   * Alternate cat and mouse creation.
+   * Alternate cat and mouse creation, and deal them out over the cpus.
    */
+  creature = 0;
   for (catindex = 0; catindex < NumCats; catindex++) {
-    error = thread_fork("cat_simulation thread", NULL, cat_simulation, NULL, catindex);
+    error = thread_fork_pinned("cat_simulation thread", NULL,
+                               CPUMASK_CPU(creature++ % NumCpus),
+                               cat_simulation, NULL, catindex);
     if (error) {
       panic("cat_simulation: thread_fork failed: %s\n", strerror(error));
     }
     if (catindex < NumMice) {
-      error = thread_fork("mouse_simulation thread", NULL, mouse_simulation, NULL, catindex);
+      error = thread_fork_pinned("mouse_simulation thread", NULL,
+                                 CPUMASK_CPU(creature++ % NumCpus),
+                                 mouse_simulation, NULL, catindex);
       if (error) {
 	panic("mouse_simulation: thread_fork failed: %s\n",strerror(error));
       }
@@ -671,7 +754,9 @@ catmouse(int nargs,
   }
   /* launch any remaining mice */
   for(mouseindex = catindex; mouseindex < NumMice; mouseindex++) {
-    error = thread_fork("mouse_simulation thread", NULL, mouse_simulation, NULL, mouseindex);
+    error = thread_fork_pinned("mouse_simulation thread", NULL,
+                               CPUMASK_CPU(creature++ % NumCpus),
+                               mouse_simulation, NULL, mouseindex);
     if (error) {
       panic("mouse_simulation: thread_fork failed: %s\n",strerror(error));
     }
@@ -679,24 +764,45 @@ catmouse(int nargs,
 
   /* wait for all of the cats and mice to finish before
      terminating */
-  for(i=0;i<(NumCats+NumMice);i++) {
-    P(CatMouseWait);
-  }
+  barrier_wait(CatMouseWait);
 
-  /* get current time, for measuring total simulation time */
-  gettime(&after_sec,&after_nsec);
   /* compute total simulation time */
-  getinterval(before_sec,before_nsec,after_sec,after_nsec,&wait_sec,&wait_nsec);
-  /* compute and report bowl utilization */
-  total_bowl_milliseconds = (wait_sec*1000 + wait_nsec/1000000)*NumBowls;
-  total_eating_milliseconds = (NumCats*CatEatTime + NumMice*MouseEatTime)*NumLoops*1000;
+  elapsed = sim_now() - before;
+  kprintf("Simulation time: %llu.%06llu seconds\n",
+          (unsigned long long)(elapsed/1000000000),
+          (unsigned long long)(elapsed/1000%1000000));
+
+  /* compute and report bowl utilization and throughput */
+  total_bowl_milliseconds = elapsed/1000000*NumBowls;
+  total_eating_milliseconds = (uint64_t)(NumCats*CatEatTime + NumMice*MouseEatTime)*NumLoops*1000;
   if (total_bowl_milliseconds > 0) {
-    utilization_percent = total_eating_milliseconds*100/total_bowl_milliseconds;
-    kprintf("Bowl utilization: %d%%\n",utilization_percent);
+    kprintf("Bowl utilization: %llu%%\n",
+            (unsigned long long)(total_eating_milliseconds*100/total_bowl_milliseconds));
+  }
+  meals = (NumCats + NumMice)*NumLoops;
+  if (elapsed > 0) {
+    kprintf("Meals per second: %llu.%02llu\n",
+            (unsigned long long)(meals*(uint64_t)1000000000/elapsed),
+            (unsigned long long)(meals*(uint64_t)100000000000ULL/elapsed%100));
   }
 
-  /* clean up the semaphore that we created */
-  sem_destroy(CatMouseWait);
+  /* report waiting times, and how much worse off the hungrier species was */
+  mean_cat_wait = report_species("cat", cat_stats, NumCats);
+  mean_mouse_wait = report_species("mouse", mouse_stats, NumMice);
+  if (mean_cat_wait > 0 && mean_mouse_wait > 0) {
+    if (mean_cat_wait >= mean_mouse_wait) {
+      ratio = mean_cat_wait*100/mean_mouse_wait;
+    }
+    else {
+      ratio = mean_mouse_wait*100/mean_cat_wait;
+    }
+    kprintf("Starvation ratio: %llu.%02llu (%s wait longer)\n",
+            (unsigned long long)(ratio/100), (unsigned long long)(ratio%100),
+            mean_cat_wait >= mean_mouse_wait ? "cats" : "mice");
+  }
+
+  /* clean up the barrier that we created */
+  barrier_destroy(CatMouseWait);
 
   /* clean up the synchronization state */
   catmouse_sync_cleanup(NumBowls);
@@ -704,17 +810,6 @@ catmouse(int nargs,
   /* clean up resources used for tracking bowl use */
   cleanup_bowls();
 
-  if (cat_wait_count > 0) {
-    /* some rounding error here - not significant if cat_wait_count << 1000000 */
-    mean_cat_wait_usecs = (cat_total_wait_secs*1000000+cat_total_wait_nsecs/1000)/cat_wait_count;
-    kprintf("Mean cat waiting time: %d.%d seconds\n",mean_cat_wait_usecs/1000000,mean_cat_wait_usecs%1000000);
-  }
-  if (mouse_wait_count > 0) {
-    /* some rounding error here - not significant if mouse_wait_count << 1000000 */
-    mean_mouse_wait_usecs = (mouse_total_wait_secs*1000000+mouse_total_wait_nsecs/1000)/mouse_wait_count;
-    kprintf("Mean mouse waiting time: %d.%d seconds\n",mean_mouse_wait_usecs/1000000,mean_mouse_wait_usecs%1000000);
-  }
-
   return 0;
 }
 
@@ -29,94 +29,253 @@
 
 /*
  * Driver code for whale mating problem
+ *
+ * NMATING males, females and matchmakers (or as many of each as the
+ * first argument says) each turn up once, and a mating takes one of
+ * each: males and females announce themselves and wait, and a
+ * matchmaker takes one of each kind and sends them off together. The
+ * driver times how long every whale waited, and reports the mean and
+ * longest wait for each kind, matings per second, and the starvation
+ * ratio (the worst kind's mean wait over the best's). The optional
+ * second argument spreads the whales over only that many cpus.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <synch.h>
 #include <test.h>
 
 #define NMATING 10
 
+#define WHALE_MALE		0
+#define WHALE_FEMALE		1
+#define WHALE_MATCHMAKER	2
+#define WHALE_KINDS		3
+
+static const char *const whale_names[WHALE_KINDS] = {
+	"male", "female", "matchmaker",
+};
+
+static struct semaphore *whale_males;		/* males waiting */
+static struct semaphore *whale_females;		/* females waiting */
+static struct semaphore *whale_maledone;	/* males sent off */
+static struct semaphore *whale_femaledone;	/* females sent off */
+static struct barrier *whale_finished;
+
+/* How long each whale waited, in nanoseconds; each writes its own */
+static uint64_t *whale_waits[WHALE_KINDS];
+
+static
+uint64_t
+whale_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
 static
 void
 male(void *p, unsigned long which)
 {
+	uint64_t start;
+
 	(void)p;
-	kprintf("male whale #%ld starting\n", which);
+	DEBUG(DB_SYNCPROB, "male whale #%lu starting\n", which);
 
-	// Implement this function
+	start = whale_now();
+	V(whale_males);
+	P(whale_maledone);
+	whale_waits[WHALE_MALE][which] = whale_now() - start;
+
+	barrier_wait(whale_finished);
 }
 
 static
 void
 female(void *p, unsigned long which)
 {
+	uint64_t start;
+
 	(void)p;
-	kprintf("female whale #%ld starting\n", which);
+	DEBUG(DB_SYNCPROB, "female whale #%lu starting\n", which);
+
+	start = whale_now();
+	V(whale_females);
+	P(whale_femaledone);
+	whale_waits[WHALE_FEMALE][which] = whale_now() - start;
 
-	// Implement this function
+	barrier_wait(whale_finished);
 }
 
 static
 void
 matchmaker(void *p, unsigned long which)
 {
+	uint64_t start;
+
 	(void)p;
-	kprintf("matchmaker whale #%ld starting\n", which);
+	DEBUG(DB_SYNCPROB, "matchmaker whale #%lu starting\n", which);
+
+	start = whale_now();
+	P(whale_males);
+	P(whale_females);
+	V(whale_maledone);
+	V(whale_femaledone);
+	whale_waits[WHALE_MATCHMAKER][which] = whale_now() - start;
 
-	// Implement this function
+	barrier_wait(whale_finished);
 }
 
+/*
+ * Print the mean and longest wait of the N whales of kind KIND, and
+ * return the mean.
+ */
+static
+uint64_t
+whale_report(unsigned kind, unsigned n)
+{
+	uint64_t total, longest;
+	unsigned i;
+
+	total = longest = 0;
+	for (i=0; i<n; i++) {
+		total += whale_waits[kind][i];
+		if (whale_waits[kind][i] > longest) {
+			longest = whale_waits[kind][i];
+		}
+	}
+	kprintf("%-10s waiting time (usecs): mean %llu, max %llu\n",
+		whale_names[kind], (unsigned long long)(total / n / 1000),
+		(unsigned long long)(longest / 1000));
+	return total / n;
+}
+
+static
+void
+whale_cleanup(void)
+{
+	unsigned i;
+
+	for (i=0; i<WHALE_KINDS; i++) {
+		if (whale_waits[i] != NULL) {
+			kfree(whale_waits[i]);
+			whale_waits[i] = NULL;
+		}
+	}
+	if (whale_males != NULL) {
+		sem_destroy(whale_males);
+		whale_males = NULL;
+	}
+	if (whale_females != NULL) {
+		sem_destroy(whale_females);
+		whale_females = NULL;
+	}
+	if (whale_maledone != NULL) {
+		sem_destroy(whale_maledone);
+		whale_maledone = NULL;
+	}
+	if (whale_femaledone != NULL) {
+		sem_destroy(whale_femaledone);
+		whale_femaledone = NULL;
+	}
+	if (whale_finished != NULL) {
+		barrier_destroy(whale_finished);
+		whale_finished = NULL;
+	}
+}
 
-// Change this function as necessary
 int
 whalemating(int nargs, char **args)
 {
+	static void (*const whales[WHALE_KINDS])(void *, unsigned long) = {
+		male, female, matchmaker,
+	};
+	uint64_t start, elapsed, mean, best, worst;
+	unsigned nmating, ncpus, i, j;
+	int err;
 
-	int i, j, err=0;
-
-	(void)nargs;
-	(void)args;
-
-	for (i = 0; i < 3; i++) {
-		for (j = 0; j < NMATING; j++) {
-#ifdef UW
-			switch(i) {
-			    case 0:
-				err = thread_fork("Male Whale Thread", NULL,
-						  male, NULL, j);
-				break;
-			    case 1:
-				err = thread_fork("Female Whale Thread", NULL,
-						  female, NULL, j);
-				break;
-			    case 2:
-				err = thread_fork("Matchmaker Whale Thread", NULL,
-						  matchmaker, NULL, j);
-				break;
-			}
-#else
-			switch(i) {
-			    case 0:
-				err = thread_fork("Male Whale Thread",
-						  male, NULL, j, NULL);
-				break;
-			    case 1:
-				err = thread_fork("Female Whale Thread",
-						  female, NULL, j, NULL);
-				break;
-			    case 2:
-				err = thread_fork("Matchmaker Whale Thread",
-						  matchmaker, NULL, j, NULL);
-				break;
-			}
-#endif /* UW */
+	nmating = NMATING;
+	ncpus = cpu_count();
+	if (nargs > 3) {
+		kprintf("Usage: sp1 [NUM_MATINGS [NUM_CPUS]]\n");
+		return EINVAL;
+	}
+	if (nargs > 1) {
+		nmating = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		ncpus = atoi(args[2]);
+	}
+	if (nmating < 1 || ncpus < 1 || ncpus > cpu_count()) {
+		kprintf("whalemating: need at least one mating, "
+			"and 1 to %u cpus\n", cpu_count());
+		return EINVAL;
+	}
+
+	whale_males = sem_create("whale males", 0);
+	whale_females = sem_create("whale females", 0);
+	whale_maledone = sem_create("whale maledone", 0);
+	whale_femaledone = sem_create("whale femaledone", 0);
+	whale_finished = barrier_create("whale finished",
+					WHALE_KINDS * nmating + 1);
+	for (i=0; i<WHALE_KINDS; i++) {
+		whale_waits[i] = kmalloc(nmating * sizeof(uint64_t));
+	}
+	if (whale_males == NULL || whale_females == NULL ||
+	    whale_maledone == NULL || whale_femaledone == NULL ||
+	    whale_finished == NULL || whale_waits[WHALE_MALE] == NULL ||
+	    whale_waits[WHALE_FEMALE] == NULL ||
+	    whale_waits[WHALE_MATCHMAKER] == NULL) {
+		whale_cleanup();
+		return ENOMEM;
+	}
+
+	kprintf("Mating %u times on %u cpus\n", nmating, ncpus);
+	start = whale_now();
+	for (i = 0; i < WHALE_KINDS; i++) {
+		for (j = 0; j < nmating; j++) {
+			err = thread_fork_pinned("Whale Thread", NULL,
+					CPUMASK_CPU((i * nmating + j) % ncpus),
+					whales[i], NULL, j);
 			if (err) {
 				panic("whalemating: thread_fork failed: %s)\n",
 				      strerror(err));
 			}
 		}
 	}
+	barrier_wait(whale_finished);
+	elapsed = whale_now() - start;
+
+	kprintf("Simulation time: %llu.%06llu seconds\n",
+		(unsigned long long)(elapsed / 1000000000),
+		(unsigned long long)(elapsed / 1000 % 1000000));
+	if (elapsed > 0) {
+		kprintf("Matings per second: %llu\n",
+			(unsigned long long)(nmating * 1000000000ULL /
+					     elapsed));
+	}
+	best = worst = whale_report(0, nmating);
+	for (i=1; i<WHALE_KINDS; i++) {
+		mean = whale_report(i, nmating);
+		if (mean < best) {
+			best = mean;
+		}
+		if (mean > worst) {
+			worst = mean;
+		}
+	}
+	if (best > 0) {
+		kprintf("Starvation ratio: %llu.%02llu\n",
+			(unsigned long long)(worst / best),
+			(unsigned long long)(worst * 100 / best % 100));
+	}
 
+	whale_cleanup();
 	return 0;
 }
@@ -1,60 +1,889 @@
+#define KMTAG KMT_VFS
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/dirent.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <limits.h>
 #include <uio.h>
+#include <synch.h>
 #include <syscall.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <file.h>
+#include <pipe.h>
+
+/**
+	Copy a user pathname into a fresh PATH_MAX kernel buffer
+*/
+static int copyin_path(const_userptr_t upath, char **ret) {
+	char *path;
+	int result;
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(upath, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+	*ret = path;
+	return 0;
+}
+
+/**
+	The open system call
+
+	Returns the lowest free file descriptor in retval
+*/
+int sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval) {
+	struct openfile *of;
+	char *path;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: open(%p, 0x%x)\n", upath, flags);
+
+	result = copyin_path(upath, &path);
+	if (result) {
+		return result;
+	}
+	result = openfile_open(path, flags, mode, &of);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = fd_alloc(curproc, of, retval);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	return 0;
+}
+
+/**
+	The close system call
+*/
+int sys_close(int fd) {
+	DEBUG(DB_SYSCALL, "Syscall: close(%d)\n", fd);
+
+	return fd_close(curproc, fd);
+}
+
+/**
+	Move LEN bytes, spread over the IOVCNT user buffers in IOV, between
+	memory and OF at OFFSET in a single VOP_READ/VOP_WRITE. Hands back the
+	number of bytes moved and the offset just past them.
+*/
+static int file_io(struct openfile *of, struct iovec *iov, unsigned iovcnt,
+		   size_t len, enum uio_rw rw, off_t offset, int *retval,
+		   off_t *endoffset) {
+	struct uio u;
+	int result;
+
+	/* set up a uio structure to refer to the user program's buffers */
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_offset = offset;
+	u.uio_resid = len;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curproc_getas();
+
+	result = vm_prefault(&u);
+	if (result) {
+		return result;
+	}
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(of->of_vnode, &u);
+	} else {
+		result = VOP_WRITE(of->of_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+
+	/* pass back the number of bytes actually moved */
+	*retval = len - u.uio_resid;
+	*endoffset = u.uio_offset;
+	return 0;
+}
+
+/**
+	Look up FD and check it was opened for RW. Like fd_get, hands back a
+	reference the caller must drop.
+*/
+static int file_get_rw(int fd, enum uio_rw rw, struct openfile **ret) {
+	struct openfile *of;
+	int accmode;
+	int result;
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	accmode = of->of_flags & O_ACCMODE;
+	if ((rw == UIO_READ && accmode == O_WRONLY) ||
+	    (rw == UIO_WRITE && accmode == O_RDONLY)) {
+		openfile_decref(of);
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
+
+/**
+	Common code for read, write, readv and writev: do the I/O at the file's
+	current offset and advance it. The openfile's lock keeps processes
+	sharing it from interleaving.
+*/
+static int file_rw(int fd, struct iovec *iov, unsigned iovcnt, size_t len,
+		   enum uio_rw rw, int *retval) {
+	struct openfile *of;
+	off_t endoffset;
+	int result;
+
+	result = file_get_rw(fd, rw, &of);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(of->of_lock);
+
+	if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+		struct stat st;
+
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_lock);
+			openfile_decref(of);
+			return result;
+		}
+		of->of_offset = st.st_size;
+	}
+
+	result = file_io(of, iov, iovcnt, len, rw, of->of_offset, retval,
+			 &endoffset);
+	if (result == 0) {
+		of->of_offset = endoffset;
+	}
+	lock_release(of->of_lock);
+	openfile_decref(of);
+
+	return result;
+}
+
+/**
+	Common code for pread and pwrite: do the I/O at an explicit offset.
+	The file's own offset is neither used nor changed, so this doesn't
+	take the openfile's lock and callers sharing the file run in parallel.
+*/
+static int file_prw(int fd, userptr_t ubuf, size_t len, off_t offset,
+		    enum uio_rw rw, int *retval) {
+	struct openfile *of;
+	struct iovec iov;
+	off_t endoffset;
+	int result;
+
+	result = file_get_rw(fd, rw, &of);
+	if (result) {
+		return result;
+	}
+
+	/* ESPIPE for devices that can't seek, EINVAL for bad offsets */
+	result = VOP_TRYSEEK(of->of_vnode, offset);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+
+	iov.iov_ubase = ubuf;
+	iov.iov_len = len;
+	result = file_io(of, &iov, 1, len, rw, offset, retval, &endoffset);
+	openfile_decref(of);
+	return result;
+}
+
+int sys_pread(int fd, userptr_t ubuf, size_t buflen, off_t offset, int *retval) {
+	DEBUG(DB_SYSCALL, "Syscall: pread(%d, %p, %u, %lld)\n", fd, ubuf, buflen, offset);
+
+	return file_prw(fd, ubuf, buflen, offset, UIO_READ, retval);
+}
+
+int sys_pwrite(int fd, userptr_t ubuf, size_t nbytes, off_t offset, int *retval) {
+	DEBUG(DB_SYSCALL, "Syscall: pwrite(%d, %p, %u, %lld)\n", fd, ubuf, nbytes, offset);
+
+	return file_prw(fd, ubuf, nbytes, offset, UIO_WRITE, retval);
+}
+
+int sys_read(int fd, userptr_t ubuf, size_t buflen, int *retval) {
+	struct iovec iov;
+
+	DEBUG(DB_SYSCALL, "Syscall: read(%d, %p, %u)\n", fd, ubuf, buflen);
+
+	iov.iov_ubase = ubuf;
+	iov.iov_len = buflen;
+	return file_rw(fd, &iov, 1, buflen, UIO_READ, retval);
+}
+
+int sys_write(int fd, userptr_t ubuf, size_t nbytes, int *retval) {
+	struct iovec iov;
+
+	DEBUG(DB_SYSCALL, "Syscall: write(%d, %p, %u)\n", fd, ubuf, nbytes);
+
+	iov.iov_ubase = ubuf;
+	iov.iov_len = nbytes;
+	return file_rw(fd, &iov, 1, nbytes, UIO_WRITE, retval);
+}
+
+/**
+	Common code for readv and writev. The user's iovec array is copied in
+	once and used as the uio's iovecs directly.
+*/
+static int file_rwv(int fd, const_userptr_t uiov, int iovcnt, enum uio_rw rw,
+		    int *retval) {
+	struct iovec *iov;
+	size_t len = 0;
+	int result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	iov = kmalloc(iovcnt * sizeof(struct iovec));
+	if (iov == NULL) {
+		return ENOMEM;
+	}
+	result = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+	if (result) {
+		kfree(iov);
+		return result;
+	}
+
+	/* the total has to fit in the (int) return value */
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t)0x7fffffff - len) {
+			kfree(iov);
+			return EINVAL;
+		}
+		len += iov[i].iov_len;
+	}
+
+	result = file_rw(fd, iov, iovcnt, len, rw, retval);
+	kfree(iov);
+	return result;
+}
+
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval) {
+	DEBUG(DB_SYSCALL, "Syscall: readv(%d, %p, %d)\n", fd, iov, iovcnt);
+
+	return file_rwv(fd, iov, iovcnt, UIO_READ, retval);
+}
+
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval) {
+	DEBUG(DB_SYSCALL, "Syscall: writev(%d, %p, %d)\n", fd, iov, iovcnt);
+
+	return file_rwv(fd, iov, iovcnt, UIO_WRITE, retval);
+}
+
+/**
+	The lseek system call
+
+	Hands back the new offset in retval
+*/
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval) {
+	struct openfile *of;
+	struct stat st;
+	off_t newpos;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: lseek(%d, %lld, %d)\n", fd, pos, whence);
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(of->of_lock);
+	switch (whence) {
+	    case SEEK_SET:
+		newpos = pos;
+		break;
+	    case SEEK_CUR:
+		newpos = of->of_offset + pos;
+		break;
+	    case SEEK_END:
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_lock);
+			openfile_decref(of);
+			return result;
+		}
+		newpos = st.st_size + pos;
+		break;
+	    default:
+		lock_release(of->of_lock);
+		openfile_decref(of);
+		return EINVAL;
+	}
+
+	/* ESPIPE for devices that can't seek, EINVAL for bad positions */
+	result = VOP_TRYSEEK(of->of_vnode, newpos);
+	if (result) {
+		lock_release(of->of_lock);
+		openfile_decref(of);
+		return result;
+	}
+	of->of_offset = newpos;
+	lock_release(of->of_lock);
+	openfile_decref(of);
+
+	*retval = newpos;
+	return 0;
+}
+
+/* Most getdirentries packs in one call, so the staging buffer stays small */
+#define GETDIRENTRIES_MAX	4096
+
+/**
+	The getdirentry system call
+
+	Reads the name of the next entry in the directory FD into UBUF, without
+	a terminating NUL, and hands back its length; 0 at the end.
+*/
+int sys_getdirentry(int fd, userptr_t ubuf, size_t buflen, int *retval) {
+	struct openfile *of;
+	struct iovec iov;
+	off_t endoffset;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: getdirentry(%d, %p, %u)\n", fd, ubuf, buflen);
+
+	result = file_get_rw(fd, UIO_READ, &of);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(of->of_lock);
+	iov.iov_ubase = ubuf;
+	iov.iov_len = buflen;
+	result = file_io(of, &iov, 1, buflen, UIO_READ, of->of_offset, retval,
+			 &endoffset);
+	if (result == 0) {
+		of->of_offset = endoffset;
+	}
+	lock_release(of->of_lock);
+	openfile_decref(of);
+
+	return result;
+}
+
+/**
+	The getdirentries system call
+
+	Fills UBUF with as many struct dirent records, from the directory FD's
+	current position on, as will fit, and hands back the number of bytes
+	used; 0 at the end. The entries are gathered in a kernel buffer and
+	copied out once. An entry that doesn't fit is left for the next call;
+	if not even the first one fits, that's EINVAL.
+*/
+int sys_getdirentries(int fd, userptr_t ubuf, size_t buflen, int *retval) {
+	struct openfile *of;
+	struct dirent *d;
+	struct iovec iov;
+	struct uio u;
+	char name[NAME_MAX];
+	char *kbuf;
+	size_t len, used, namlen, reclen;
+	off_t pos;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: getdirentries(%d, %p, %u)\n", fd, ubuf, buflen);
+
+	result = file_get_rw(fd, UIO_READ, &of);
+	if (result) {
+		return result;
+	}
+
+	len = buflen < GETDIRENTRIES_MAX ? buflen : GETDIRENTRIES_MAX;
+	kbuf = kmalloc(len);
+	if (kbuf == NULL && len > 0) {
+		openfile_decref(of);
+		return ENOMEM;
+	}
+
+	lock_acquire(of->of_lock);
+	used = 0;
+	pos = of->of_offset;
+	while (1) {
+		uio_kinit(&iov, &u, name, NAME_MAX, pos, UIO_READ);
+		result = VOP_GETDIRENTRY(of->of_vnode, &u);
+		if (result) {
+			break;
+		}
+		namlen = NAME_MAX - u.uio_resid;
+		if (namlen == 0) {
+			/* end of directory */
+			break;
+		}
+		reclen = DIRENT_RECLEN(namlen);
+		if (reclen > len - used) {
+			/* doesn't fit; leave it for next time */
+			if (used == 0) {
+				result = EINVAL;
+			}
+			break;
+		}
+
+		d = (struct dirent *)(kbuf + used);
+		bzero(d, reclen);
+		d->d_reclen = reclen;
+		d->d_namlen = namlen;
+		memcpy(d->d_name, name, namlen);
+		used += reclen;
+		pos = u.uio_offset;
+	}
+
+	/* whatever was gathered before an error is still handed back */
+	if (used > 0) {
+		result = copyout(kbuf, ubuf, used);
+		if (result == 0) {
+			of->of_offset = pos;
+		}
+	}
+	lock_release(of->of_lock);
+	openfile_decref(of);
+	kfree(kbuf);
+
+	if (result) {
+		return result;
+	}
+	*retval = used;
+	return 0;
+}
+
+/**
+	The dup2 system call
+*/
+int sys_dup2(int oldfd, int newfd, int *retval) {
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: dup2(%d, %d)\n", oldfd, newfd);
+
+	result = fd_dup2(curproc, oldfd, newfd);
+	if (result) {
+		return result;
+	}
+
+	*retval = newfd;
+	return 0;
+}
+
+/**
+	The pipe system call
+
+	Puts the read end of a new pipe in fds[0] and the write end in fds[1]
+*/
+int sys_pipe(userptr_t fds) {
+	struct proc *p = curproc;
+	struct vnode *readvn, *writevn;
+	struct openfile *readof, *writeof;
+	int kfds[2];
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: pipe(%p)\n", fds);
+
+	result = pipe_create(&readvn, &writevn);
+	if (result) {
+		return result;
+	}
+	result = openfile_create(readvn, O_RDONLY, &readof);
+	if (result) {
+		vfs_close(readvn);
+		vfs_close(writevn);
+		return result;
+	}
+	result = openfile_create(writevn, O_WRONLY, &writeof);
+	if (result) {
+		openfile_decref(readof);
+		vfs_close(writevn);
+		return result;
+	}
+
+	result = fd_alloc(p, readof, &kfds[0]);
+	if (result) {
+		openfile_decref(readof);
+		openfile_decref(writeof);
+		return result;
+	}
+	result = fd_alloc(p, writeof, &kfds[1]);
+	if (result) {
+		fd_close(p, kfds[0]);
+		openfile_decref(writeof);
+		return result;
+	}
+
+	result = copyout(kfds, fds, sizeof(kfds));
+	if (result) {
+		fd_close(p, kfds[0]);
+		fd_close(p, kfds[1]);
+		return result;
+	}
+	return 0;
+}
+
+/**
+	The fstat system call
+*/
+int sys_fstat(int fd, userptr_t statbuf) {
+	struct openfile *of;
+	struct stat st;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: fstat(%d, %p)\n", fd, statbuf);
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = VOP_STAT(of->of_vnode, &st);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	return copyout(&st, statbuf, sizeof(st));
+}
+
+/**
+	The fallocate system call
+
+	Allocates disk space for LEN bytes from POS, growing the file if
+	that goes past its end
+*/
+int sys_fallocate(int fd, off_t pos, off_t len) {
+	struct openfile *of;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: fallocate(%d, %lld, %lld)\n", fd, pos, len);
+
+	result = file_get_rw(fd, UIO_WRITE, &of);
+	if (result) {
+		return result;
+	}
+	if (pos < 0 || len <= 0) {
+		openfile_decref(of);
+		return EINVAL;
+	}
+	result = VOP_FALLOCATE(of->of_vnode, pos, len);
+	openfile_decref(of);
+	return result;
+}
+
+/**
+	The posix_fadvise system call
+
+	Passes the hint for LEN bytes from POS (to the end of the file if LEN
+	is 0) to the file system. The hint is the file's, not the open
+	file's, as that is where read-ahead is kept.
+*/
+int sys_posix_fadvise(int fd, off_t pos, off_t len, int advice) {
+	struct openfile *of;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: posix_fadvise(%d, %lld, %lld, %d)\n",
+		fd, pos, len, advice);
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (pos < 0 || len < 0 ||
+	    advice < POSIX_FADV_NORMAL || advice > POSIX_FADV_NOREUSE) {
+		openfile_decref(of);
+		return EINVAL;
+	}
+	result = VOP_ADVISE(of->of_vnode, pos, len, advice);
+	openfile_decref(of);
+	return result;
+}
+
+/**
+	The sync_file_range system call
+
+	A writer can keep its dirty data in check without stopping for the
+	disk: start the last stretch written on its way with
+	SYNC_FILE_RANGE_WRITE, and now and then wait for what it started
+	before with SYNC_FILE_RANGE_WAIT_BEFORE. No metadata goes, so it's
+	no stand-in for fsync.
+*/
+int sys_sync_file_range(int fd, off_t pos, off_t len, unsigned flags) {
+	struct openfile *of;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: sync_file_range(%d, %lld, %lld, 0x%x)\n",
+		fd, pos, len, flags);
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (pos < 0 || len < 0 ||
+	    (flags & ~(SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		       SYNC_FILE_RANGE_WAIT_AFTER)) != 0) {
+		openfile_decref(of);
+		return EINVAL;
+	}
+	result = VOP_SYNCRANGE(of->of_vnode, pos, len, flags);
+	openfile_decref(of);
+	return result;
+}
+
+/* How much copy_file_range moves per VOP_COPYRANGE or buffer load */
+#define COPY_CHUNK 65536
+
+/**
+	Copy up to LEN bytes from IN at INPOS to OUT at OUTPOS through the
+	kernel buffer BUF, which holds at least LEN. Hands back the number
+	copied, which is short if IN ends first.
+*/
+static int file_copychunk(struct vnode *in, off_t inpos, struct vnode *out,
+			  off_t outpos, char *buf, size_t len, off_t *copied) {
+	struct iovec iov;
+	struct uio u;
+	size_t got;
+	int result;
+
+	uio_kinit(&iov, &u, buf, len, inpos, UIO_READ);
+	result = VOP_READ(in, &u);
+	if (result) {
+		return result;
+	}
+	got = len - u.uio_resid;
+
+	uio_kinit(&iov, &u, buf, got, outpos, UIO_WRITE);
+	result = VOP_WRITE(out, &u);
+	if (result) {
+		return result;
+	}
+	*copied = got - u.uio_resid;
+	return 0;
+}
+
+/**
+	The work of copy_file_range, once both files are looked up.
+*/
+static int file_copyrange(struct openfile *in, userptr_t uinoff,
+			  struct openfile *out, userptr_t uoutoff, size_t len,
+			  int *retval) {
+	struct lock *first, *second, *tmp;
+	off_t inpos, outpos, done, total;
+	size_t n;
+	char *buf = NULL;
+	int result;
+
+	if (out->of_flags & O_APPEND) {
+		return EBADF;
+	}
+	if (uinoff != NULL) {
+		result = copyin(uinoff, &inpos, sizeof(inpos));
+		if (result) {
+			return result;
+		}
+	}
+	if (uoutoff != NULL) {
+		result = copyin(uoutoff, &outpos, sizeof(outpos));
+		if (result) {
+			return result;
+		}
+	}
+	/* So the count fits in the return value */
+	if (len > 0x7fffffff) {
+		len = 0x7fffffff;
+	}
+
+	/* Take the offset locks needed, in address order */
+	first = uinoff == NULL ? in->of_lock : NULL;
+	second = uoutoff == NULL ? out->of_lock : NULL;
+	if (first == second) {
+		second = NULL;
+	}
+	else if (first != NULL && second != NULL && first > second) {
+		tmp = first;
+		first = second;
+		second = tmp;
+	}
+	if (first != NULL) {
+		lock_acquire(first);
+	}
+	if (second != NULL) {
+		lock_acquire(second);
+	}
+	if (uinoff == NULL) {
+		inpos = in->of_offset;
+	}
+	if (uoutoff == NULL) {
+		outpos = out->of_offset;
+	}
+
+	result = VOP_TRYSEEK(in->of_vnode, inpos);
+	if (result == 0) {
+		result = VOP_TRYSEEK(out->of_vnode, outpos);
+	}
+	if (result == 0 && in->of_vnode == out->of_vnode &&
+	    inpos < outpos + (off_t)len && outpos < inpos + (off_t)len) {
+		result = EINVAL;
+	}
+
+	total = 0;
+	while (result == 0 && total < (off_t)len) {
+		n = len - total;
+		if (n > COPY_CHUNK) {
+			n = COPY_CHUNK;
+		}
+		result = VOP_COPYRANGE(out->of_vnode, outpos, in->of_vnode,
+				       inpos, n, &done);
+		if (result == ENOSYS) {
+			if (buf == NULL) {
+				buf = kmalloc(COPY_CHUNK);
+				if (buf == NULL) {
+					result = ENOMEM;
+					break;
+				}
+			}
+			result = file_copychunk(in->of_vnode, inpos,
+						out->of_vnode, outpos, buf, n,
+						&done);
+		}
+		if (result) {
+			break;
+		}
+		total += done;
+		inpos += done;
+		outpos += done;
+		if (done < (off_t)n) {
+			break;
+		}
+	}
+	kfree(buf);
+
+	/* As for write, an error after some of it was copied isn't one */
+	if (total > 0) {
+		result = 0;
+	}
+	if (result == 0 && uinoff == NULL) {
+		in->of_offset = inpos;
+	}
+	if (result == 0 && uoutoff == NULL) {
+		out->of_offset = outpos;
+	}
+	if (second != NULL) {
+		lock_release(second);
+	}
+	if (first != NULL) {
+		lock_release(first);
+	}
+	if (result) {
+		return result;
+	}
+
+	if (uinoff != NULL) {
+		result = copyout(&inpos, uinoff, sizeof(inpos));
+		if (result) {
+			return result;
+		}
+	}
+	if (uoutoff != NULL) {
+		result = copyout(&outpos, uoutoff, sizeof(outpos));
+		if (result) {
+			return result;
+		}
+	}
+	*retval = total;
+	return 0;
+}
+
+/**
+	The copy_file_range system call
+
+	Copies up to LEN bytes from INFD to OUTFD without the data leaving
+	the kernel. Each offset pointer, if not NULL, says where to start in
+	its file and gets back where the copy ended; a NULL one means the
+	file's own offset, which is used and advanced under the openfile's
+	lock as for read and write. The filesystem can do each chunk itself
+	(VOP_COPYRANGE); if it can't, the chunk goes through a kernel buffer.
+*/
+int sys_copy_file_range(int infd, userptr_t uinoff, int outfd,
+			userptr_t uoutoff, size_t len, unsigned flags,
+			int *retval) {
+	struct openfile *in, *out;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: copy_file_range(%d, %p, %d, %p, %u)\n",
+	      infd, uinoff, outfd, uoutoff, len);
+
+	if (flags != 0) {
+		return EINVAL;
+	}
+	result = file_get_rw(infd, UIO_READ, &in);
+	if (result) {
+		return result;
+	}
+	result = file_get_rw(outfd, UIO_WRITE, &out);
+	if (result) {
+		openfile_decref(in);
+		return result;
+	}
+	result = file_copyrange(in, uinoff, out, uoutoff, len, retval);
+	openfile_decref(out);
+	openfile_decref(in);
+	return result;
+}
+
+/**
+	The ioctl system call
+
+	Passes CODE and DATA to the file's vnode; what they mean is up to it
+*/
+int sys_ioctl(int fd, int code, userptr_t data) {
+	struct openfile *of;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: ioctl(%d, %d, %p)\n", fd, code, data);
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = VOP_IOCTL(of->of_vnode, code, data);
+	openfile_decref(of);
+	return result;
+}
+
+/**
+	The remove system call
+*/
+int sys_remove(const_userptr_t upath) {
+	char *path;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: remove(%p)\n", upath);
 
-/* handler for write() system call                  */
-/*
- * n.b.
- * This implementation handles only writes to standard output
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
- *
- * You will need to improve this implementation
- */
-
-int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
-{
-  struct iovec iov;
-  struct uio u;
-  int res;
-
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
-  }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
-  KASSERT(curproc->p_addrspace != NULL);
-
-  /* set up a uio structure to refer to the user program's buffer (ubuf) */
-  iov.iov_ubase = ubuf;
-  iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
-  u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
-  u.uio_space = curproc->p_addrspace;
-
-  res = VOP_WRITE(curproc->console,&u);
-  if (res) {
-    return res;
-  }
-
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
-  KASSERT(*retval >= 0);
-  return 0;
+	result = copyin_path(upath, &path);
+	if (result) {
+		return result;
+	}
+	result = vfs_remove(path);
+	kfree(path);
+	return result;
 }
@@ -0,0 +1,183 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <wchan.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/**
+	Futexes: sleeping on a word of user memory.
+
+	futex_wait(addr, val) sleeps as long as *addr still holds val, and
+	futex_wake(addr, n) wakes up to n threads sleeping on addr. A user lock
+	built on them only enters the kernel when it is contended.
+
+	Sleepers are hashed by (address space, address) into buckets, each with
+	a wait channel. The bucket's list of sleepers is protected by that wait
+	channel's lock. A sleeper puts itself on the list before it looks at
+	*addr, so a waker that changes *addr and then calls futex_wake can't
+	miss it. Waking marks the sleeper and then wakes the whole bucket; any
+	other sleepers in it just look at their mark and go back to sleep.
+*/
+
+#define FUTEX_HASHSIZE 64
+
+struct futexwaiter {
+	struct addrspace *fw_as;
+	vaddr_t fw_addr;
+	bool fw_woken;
+	struct futexwaiter *fw_next;
+};
+
+struct futexbucket {
+	struct wchan *fb_wchan;				/* also locks fb_waiters */
+	struct futexwaiter *fb_waiters;
+};
+
+static struct futexbucket futex_buckets[FUTEX_HASHSIZE];
+
+void futex_bootstrap(void) {
+	for (unsigned i = 0; i < FUTEX_HASHSIZE; i++) {
+		futex_buckets[i].fb_wchan = wchan_create("futex");
+		if (futex_buckets[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_buckets[i].fb_waiters = NULL;
+	}
+}
+
+static struct futexbucket *futex_bucket(struct addrspace *as, vaddr_t addr) {
+	unsigned h = ((uintptr_t)as / sizeof(void *)) ^ (addr / sizeof(int));
+
+	return &futex_buckets[h % FUTEX_HASHSIZE];
+}
+
+/* Take FW off its bucket's list. Call with the bucket locked. */
+static void futex_unlink(struct futexbucket *fb, struct futexwaiter *fw) {
+	struct futexwaiter **pp;
+
+	for (pp = &fb->fb_waiters; *pp != fw; pp = &(*pp)->fw_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = fw->fw_next;
+}
+
+/**
+	The futex_wait system call
+
+	Returns 0 once woken, EAGAIN straight away if *addr isn't val, and EINTR
+	if another thread of ours is exiting.
+*/
+int sys_futex_wait(userptr_t addr, int val) {
+	struct addrspace *as = curproc_getas();
+	struct futexwaiter fw;
+	struct futexbucket *fb;
+	int cur;
+	int result;
+
+	if ((vaddr_t)addr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	fw.fw_as = as;
+	fw.fw_addr = (vaddr_t)addr;
+	fw.fw_woken = false;
+	fb = futex_bucket(as, fw.fw_addr);
+
+	wchan_lock(fb->fb_wchan);
+	fw.fw_next = fb->fb_waiters;
+	fb->fb_waiters = &fw;
+	wchan_unlock(fb->fb_wchan);
+
+	// Can fault (and sleep), so not under the bucket lock
+	result = copyin(addr, &cur, sizeof(cur));
+	if (result == 0 && cur != val) {
+		result = EAGAIN;
+	}
+
+	wchan_lock(fb->fb_wchan);
+	while (result == 0 && !fw.fw_woken && !curproc->p_exiting) {
+		wchan_sleep(fb->fb_wchan);
+		wchan_lock(fb->fb_wchan);
+	}
+	if (!fw.fw_woken) {
+		futex_unlink(fb, &fw);
+	}
+	wchan_unlock(fb->fb_wchan);
+
+	if (result == 0 && curproc->p_exiting) {
+		result = EINTR;
+	}
+	return result;
+}
+
+/**
+	The futex_wake system call
+
+	Wakes up to n threads waiting on addr; retval gets how many.
+*/
+int sys_futex_wake(userptr_t addr, int n, int *retval) {
+	struct addrspace *as = curproc_getas();
+	struct futexwaiter **pp, *fw;
+	struct futexbucket *fb;
+	int woken = 0;
+
+	if ((vaddr_t)addr % sizeof(int) != 0 || n < 0) {
+		return EINVAL;
+	}
+
+	fb = futex_bucket(as, (vaddr_t)addr);
+	wchan_lock(fb->fb_wchan);
+	pp = &fb->fb_waiters;
+	while (*pp != NULL && woken < n) {
+		fw = *pp;
+		if (fw->fw_as == as && fw->fw_addr == (vaddr_t)addr) {
+			*pp = fw->fw_next;
+			fw->fw_woken = true;
+			woken++;
+		} else {
+			pp = &fw->fw_next;
+		}
+	}
+	wchan_unlock(fb->fb_wchan);
+
+	if (woken > 0) {
+		wchan_wakeall(fb->fb_wchan);
+	}
+	*retval = woken;
+	return 0;
+}
+
+/**
+	Wake everything sleeping in address space `as`, so a process's threads
+	can get out of the way of one that is exiting.
+*/
+void futex_wakeas(struct addrspace *as) {
+	struct futexwaiter **pp, *fw;
+	struct futexbucket *fb;
+	bool any;
+
+	for (unsigned i = 0; i < FUTEX_HASHSIZE; i++) {
+		fb = &futex_buckets[i];
+		any = false;
+		wchan_lock(fb->fb_wchan);
+		pp = &fb->fb_waiters;
+		while (*pp != NULL) {
+			fw = *pp;
+			if (fw->fw_as == as) {
+				*pp = fw->fw_next;
+				fw->fw_woken = true;
+				any = true;
+			} else {
+				pp = &fw->fw_next;
+			}
+		}
+		wchan_unlock(fb->fb_wchan);
+		if (any) {
+			wchan_wakeall(fb->fb_wchan);
+		}
+	}
+}
@@ -0,0 +1,539 @@
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/iovec.h>
+#include <kern/ioring.h>
+#include <lib.h>
+#include <limits.h>
+#include <stat.h>
+#include <uio.h>
+#include <synch.h>
+#include <current.h>
+#include <proc.h>
+#include <thread.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <file.h>
+#include <workqueue.h>
+#include <syscall.h>
+#include <ioring.h>
+
+/**
+	Submission/completion rings; see <kern/ioring.h> and <ioring.h>.
+
+	Everything about a ring is under its ic_lock, which ioring_enter holds
+	while it reads and writes the process's copy. The work queue threads
+	only take it to hand back a finished operation.
+*/
+
+/* Where field F of the process's struct ioring is */
+#define IORING_FIELD(ic, f) \
+	((userptr_t)((char *)(ic)->ic_uring + __builtin_offsetof(struct ioring, f)))
+
+/**
+	An operation taken off the submission ring and not yet posted
+*/
+struct ioreq {
+	struct ioreq *ir_next;			/* on ic_done */
+	struct ioring_ctx *ir_ctx;
+	struct work ir_work;
+	struct ioring_sqe ir_sqe;
+	struct openfile *ir_of;			/* referenced, for read/write/fsync */
+	void *ir_kbuf;					/* data for read/write */
+	int ir_res;						/* the cqe_res to post */
+	int ir_ioprio;					/* the submitter's I/O class */
+};
+
+struct ioring_ctx {
+	userptr_t ic_uring;				/* the process's struct ioring */
+	userptr_t ic_sq;
+	userptr_t ic_cq;
+	uint32_t ic_entries;
+	uint32_t ic_sqhead;				/* our copy of ir_sqhead */
+	uint32_t ic_cqtail;				/* our copy of ir_cqtail */
+	struct lock *ic_lock;
+	struct cv *ic_cv;				/* an operation finished */
+	unsigned ic_busy;				/* taken and not yet posted */
+	unsigned ic_inflight;			/* of those, with a work queue thread */
+	struct ioreq *ic_done;			/* finished, oldest first */
+	struct ioreq **ic_donetail;
+};
+
+static struct workqueue *ioring_wq;
+
+void ioring_bootstrap(void) {
+	ioring_wq = workqueue_create("ioring", IORING_NTHREADS);
+}
+
+/**
+	Put REQ on the list to be posted
+*/
+static void ioring_done(struct ioring_ctx *ic, struct ioreq *req) {
+	KASSERT(lock_do_i_hold(ic->ic_lock));
+
+	req->ir_next = NULL;
+	*ic->ic_donetail = req;
+	ic->ic_donetail = &req->ir_next;
+}
+
+/**
+	Read or write REQ's buffer, at its offset or the file's
+*/
+static int ioring_rw(struct ioreq *req, enum uio_rw rw) {
+	struct openfile *of = req->ir_of;
+	struct ioring_sqe *sqe = &req->ir_sqe;
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	int result;
+
+	if (sqe->sqe_offset != IORING_OFF_CUR) {
+		uio_kinit(&iov, &u, req->ir_kbuf, sqe->sqe_len, sqe->sqe_offset, rw);
+		result = rw == UIO_READ ? VOP_READ(of->of_vnode, &u) :
+			VOP_WRITE(of->of_vnode, &u);
+		if (result) {
+			return -result;
+		}
+		return sqe->sqe_len - u.uio_resid;
+	}
+
+	// As in read and write
+	lock_acquire(of->of_lock);
+	if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_lock);
+			return -result;
+		}
+		of->of_offset = st.st_size;
+	}
+	uio_kinit(&iov, &u, req->ir_kbuf, sqe->sqe_len, of->of_offset, rw);
+	result = rw == UIO_READ ? VOP_READ(of->of_vnode, &u) :
+		VOP_WRITE(of->of_vnode, &u);
+	if (result == 0) {
+		of->of_offset = u.uio_offset;
+	}
+	lock_release(of->of_lock);
+	if (result) {
+		return -result;
+	}
+	return sqe->sqe_len - u.uio_resid;
+}
+
+/**
+	Work function: do one read, write or fsync
+*/
+static void ioring_run(void *data) {
+	struct ioreq *req = data;
+	struct ioring_ctx *ic = req->ir_ctx;
+	int ioprio;
+
+	// The disk should see the submitter's class, not the work thread's
+	ioprio = thread_getioprio();
+	thread_setioprio(req->ir_ioprio);
+
+	switch (req->ir_sqe.sqe_op) {
+	case IORING_OP_READ:
+		req->ir_res = ioring_rw(req, UIO_READ);
+		break;
+	case IORING_OP_WRITE:
+		req->ir_res = ioring_rw(req, UIO_WRITE);
+		break;
+	case IORING_OP_FSYNC:
+		req->ir_res = -VOP_FSYNC(req->ir_of->of_vnode);
+		break;
+	default:
+		panic("ioring_run: op %u\n", req->ir_sqe.sqe_op);
+	}
+	thread_setioprio(ioprio);
+
+	lock_acquire(ic->ic_lock);
+	ioring_done(ic, req);
+	ic->ic_inflight--;
+	cv_broadcast(ic->ic_cv, ic->ic_lock);
+	lock_release(ic->ic_lock);
+}
+
+/**
+	Look up the file for a read, write or fsync and check its mode. Hands
+	back the reference fd_get took, for the request to hold.
+*/
+static int ioring_getfile(struct ioring_sqe *sqe, struct openfile **ret) {
+	struct openfile *of;
+	int accmode;
+	int result;
+
+	result = fd_get(curproc, sqe->sqe_fd, &of);
+	if (result) {
+		return result;
+	}
+	accmode = of->of_flags & O_ACCMODE;
+	if ((sqe->sqe_op == IORING_OP_READ && accmode == O_WRONLY) ||
+	    (sqe->sqe_op == IORING_OP_WRITE && accmode == O_RDONLY)) {
+		openfile_decref(of);
+		return EBADF;
+	}
+	if (sqe->sqe_op != IORING_OP_FSYNC) {
+		if (sqe->sqe_len > IORING_MAXIO) {
+			openfile_decref(of);
+			return EINVAL;
+		}
+		if (sqe->sqe_offset != IORING_OFF_CUR) {
+			result = VOP_TRYSEEK(of->of_vnode, sqe->sqe_offset);
+			if (result) {
+				openfile_decref(of);
+				return result;
+			}
+		}
+	}
+	*ret = of;
+	return 0;
+}
+
+/**
+	Open the path in SQE and give it a descriptor. Returns the fd or
+	-errno.
+*/
+static int ioring_open(struct ioring_sqe *sqe) {
+	struct openfile *of;
+	char *path;
+	int fd, result;
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return -ENOMEM;
+	}
+	result = copyinstr(sqe->sqe_buf, path, PATH_MAX, NULL);
+	if (result == 0) {
+		result = openfile_open(path, sqe->sqe_flags, sqe->sqe_mode, &of);
+	}
+	kfree(path);
+	if (result) {
+		return -result;
+	}
+	result = fd_alloc(curproc, of, &fd);
+	if (result) {
+		openfile_decref(of);
+		return -result;
+	}
+	return fd;
+}
+
+/**
+	Start the operation in SQE. Open, close, nop and anything that fails
+	up front are done here; the rest go to the work queue.
+*/
+static int ioring_start(struct ioring_ctx *ic, struct ioring_sqe *sqe) {
+	struct ioreq *req;
+	int result;
+
+	req = kmalloc(sizeof(struct ioreq));
+	if (req == NULL) {
+		return ENOMEM;
+	}
+	req->ir_ctx = ic;
+	req->ir_ioprio = thread_getioprio();
+	req->ir_sqe = *sqe;
+	req->ir_of = NULL;
+	req->ir_kbuf = NULL;
+	req->ir_res = 0;
+	work_init(&req->ir_work, ioring_run, req);
+	ic->ic_busy++;
+
+	switch (sqe->sqe_op) {
+	case IORING_OP_NOP:
+		break;
+	case IORING_OP_OPEN:
+		req->ir_res = ioring_open(sqe);
+		break;
+	case IORING_OP_CLOSE:
+		req->ir_res = -fd_close(curproc, sqe->sqe_fd);
+		break;
+	case IORING_OP_READ:
+	case IORING_OP_WRITE:
+	case IORING_OP_FSYNC:
+		result = ioring_getfile(sqe, &req->ir_of);
+		if (result) {
+			req->ir_of = NULL;
+			req->ir_res = -result;
+			break;
+		}
+		if (sqe->sqe_op != IORING_OP_FSYNC) {
+			if (sqe->sqe_len == 0) {
+				break;
+			}
+			req->ir_kbuf = kmalloc(sqe->sqe_len);
+			if (req->ir_kbuf == NULL) {
+				req->ir_res = -ENOMEM;
+				break;
+			}
+		}
+		if (sqe->sqe_op == IORING_OP_WRITE) {
+			result = copyin(sqe->sqe_buf, req->ir_kbuf, sqe->sqe_len);
+			if (result) {
+				req->ir_res = -result;
+				break;
+			}
+		}
+		/* The request holds the reference until ioring_free */
+		ic->ic_inflight++;
+		work_enqueue(ioring_wq, &req->ir_work);
+		return 0;
+	default:
+		req->ir_res = -EINVAL;
+		break;
+	}
+
+	ioring_done(ic, req);
+	return 0;
+}
+
+/**
+	Free a request that has finished
+*/
+static void ioring_free(struct ioreq *req) {
+	// The thread that ran it may not quite have let go of it yet
+	work_wait(&req->ir_work);
+	if (req->ir_of != NULL) {
+		openfile_decref(req->ir_of);
+	}
+	if (req->ir_kbuf != NULL) {
+		kfree(req->ir_kbuf);
+	}
+	kfree(req);
+}
+
+/**
+	Take up to TOSUBMIT entries off the submission ring, while there's
+	room for their completions; hands back how many in *NTAKEN
+*/
+static int ioring_submit(struct ioring_ctx *ic, unsigned tosubmit,
+			 unsigned *ntaken) {
+	struct ioring_sqe sqe;
+	uint32_t sqtail, cqhead;
+	userptr_t slot;
+	int result;
+
+	*ntaken = 0;
+	result = copyin(IORING_FIELD(ic, ir_sqtail), &sqtail, sizeof(sqtail));
+	if (result) {
+		return result;
+	}
+	result = copyin(IORING_FIELD(ic, ir_cqhead), &cqhead, sizeof(cqhead));
+	if (result) {
+		return result;
+	}
+	if (sqtail - ic->ic_sqhead > ic->ic_entries ||
+	    ic->ic_cqtail - cqhead > ic->ic_entries) {
+		return EINVAL;
+	}
+
+	while (*ntaken < tosubmit && ic->ic_sqhead != sqtail &&
+	       ic->ic_busy + (ic->ic_cqtail - cqhead) < ic->ic_entries) {
+		slot = (userptr_t)((struct ioring_sqe *)ic->ic_sq +
+				   (ic->ic_sqhead & (ic->ic_entries - 1)));
+		result = copyin(slot, &sqe, sizeof(sqe));
+		if (result) {
+			break;
+		}
+		result = ioring_start(ic, &sqe);
+		if (result) {
+			break;
+		}
+		ic->ic_sqhead++;
+		(*ntaken)++;
+	}
+
+	if (*ntaken > 0) {
+		// Report what we took even if something went wrong after
+		copyout(&ic->ic_sqhead, IORING_FIELD(ic, ir_sqhead),
+			sizeof(ic->ic_sqhead));
+		return 0;
+	}
+	return result;
+}
+
+/**
+	Post finished operations on the completion ring; hands back how many
+	completions are there waiting for the process in *NREADY
+*/
+static int ioring_post(struct ioring_ctx *ic, unsigned *nready) {
+	struct ioring_cqe cqe;
+	struct ioreq *req;
+	uint32_t cqhead, oldtail;
+	userptr_t slot;
+	int result;
+
+	result = copyin(IORING_FIELD(ic, ir_cqhead), &cqhead, sizeof(cqhead));
+	if (result) {
+		return result;
+	}
+	if (ic->ic_cqtail - cqhead > ic->ic_entries) {
+		return EINVAL;
+	}
+
+	oldtail = ic->ic_cqtail;
+	while (ic->ic_done != NULL && ic->ic_cqtail - cqhead < ic->ic_entries) {
+		req = ic->ic_done;
+		if (req->ir_sqe.sqe_op == IORING_OP_READ && req->ir_res > 0) {
+			result = copyout(req->ir_kbuf, req->ir_sqe.sqe_buf,
+					 req->ir_res);
+			if (result) {
+				req->ir_res = -result;
+			}
+		}
+		cqe.cqe_data = req->ir_sqe.sqe_data;
+		cqe.cqe_res = req->ir_res;
+		slot = (userptr_t)((struct ioring_cqe *)ic->ic_cq +
+				   (ic->ic_cqtail & (ic->ic_entries - 1)));
+		result = copyout(&cqe, slot, sizeof(cqe));
+		if (result) {
+			break;
+		}
+
+		ic->ic_done = req->ir_next;
+		if (ic->ic_done == NULL) {
+			ic->ic_donetail = &ic->ic_done;
+		}
+		ic->ic_busy--;
+		ic->ic_cqtail++;
+		ioring_free(req);
+	}
+
+	if (ic->ic_cqtail != oldtail) {
+		// The entries are out before the tail that covers them
+		copyout(&ic->ic_cqtail, IORING_FIELD(ic, ir_cqtail),
+			sizeof(ic->ic_cqtail));
+	}
+	*nready = ic->ic_cqtail - cqhead;
+	return result;
+}
+
+/**
+	The ioring_setup system call
+*/
+int sys_ioring_setup(userptr_t uring) {
+	struct proc *p = curproc;
+	struct ioring_ctx *ic;
+	struct ioring ir;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: ioring_setup(%p)\n", uring);
+
+	result = copyin(uring, &ir, sizeof(ir));
+	if (result) {
+		return result;
+	}
+	if (ir.ir_entries == 0 || ir.ir_entries > IORING_MAXENTRIES ||
+	    (ir.ir_entries & (ir.ir_entries - 1)) != 0) {
+		return EINVAL;
+	}
+
+	ic = kmalloc(sizeof(struct ioring_ctx));
+	if (ic == NULL) {
+		return ENOMEM;
+	}
+	ic->ic_lock = lock_create("ioring");
+	if (ic->ic_lock == NULL) {
+		kfree(ic);
+		return ENOMEM;
+	}
+	ic->ic_cv = cv_create("ioring");
+	if (ic->ic_cv == NULL) {
+		lock_destroy(ic->ic_lock);
+		kfree(ic);
+		return ENOMEM;
+	}
+	ic->ic_uring = uring;
+	ic->ic_sq = ir.ir_sq;
+	ic->ic_cq = ir.ir_cq;
+	ic->ic_entries = ir.ir_entries;
+	ic->ic_sqhead = ir.ir_sqhead;
+	ic->ic_cqtail = ir.ir_cqtail;
+	ic->ic_busy = 0;
+	ic->ic_inflight = 0;
+	ic->ic_done = NULL;
+	ic->ic_donetail = &ic->ic_done;
+
+	spinlock_acquire(&p->p_lock);
+	if (p->p_ioring != NULL) {
+		spinlock_release(&p->p_lock);
+		cv_destroy(ic->ic_cv);
+		lock_destroy(ic->ic_lock);
+		kfree(ic);
+		return EBUSY;
+	}
+	p->p_ioring = ic;
+	spinlock_release(&p->p_lock);
+	return 0;
+}
+
+/**
+	The ioring_enter system call
+
+	Returns the number of submission entries taken in retval. If some were
+	taken, problems after that are left for the next call to report.
+*/
+int sys_ioring_enter(unsigned tosubmit, unsigned mincomplete, int *retval) {
+	struct ioring_ctx *ic = curproc->p_ioring;
+	unsigned ntaken, nready = 0;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: ioring_enter(%u, %u)\n", tosubmit,
+	      mincomplete);
+
+	if (ic == NULL) {
+		return EINVAL;
+	}
+	if (mincomplete > ic->ic_entries) {
+		mincomplete = ic->ic_entries;
+	}
+
+	lock_acquire(ic->ic_lock);
+	result = ioring_submit(ic, tosubmit, &ntaken);
+	while (result == 0) {
+		result = ioring_post(ic, &nready);
+		// Done once there are enough, or no more can come
+		if (result || nready >= mincomplete || ic->ic_inflight == 0) {
+			break;
+		}
+		cv_wait(ic->ic_cv, ic->ic_lock);
+	}
+	lock_release(ic->ic_lock);
+
+	if (result && ntaken == 0) {
+		return result;
+	}
+	*retval = ntaken;
+	return 0;
+}
+
+void ioring_destroy(struct proc *p) {
+	struct ioring_ctx *ic;
+	struct ioreq *req;
+
+	spinlock_acquire(&p->p_lock);
+	ic = p->p_ioring;
+	p->p_ioring = NULL;
+	spinlock_release(&p->p_lock);
+	if (ic == NULL) {
+		return;
+	}
+
+	lock_acquire(ic->ic_lock);
+	while (ic->ic_inflight > 0) {
+		cv_wait(ic->ic_cv, ic->ic_lock);
+	}
+	while (ic->ic_done != NULL) {
+		req = ic->ic_done;
+		ic->ic_done = req->ir_next;
+		ioring_free(req);
+	}
+	lock_release(ic->ic_lock);
+
+	cv_destroy(ic->ic_cv);
+	lock_destroy(ic->ic_lock);
+	kfree(ic);
+}
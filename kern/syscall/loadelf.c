@@ -45,6 +45,10 @@
  * If you wanted to support memory-mapped executables you would need
  * to rearrange this to map each segment.
  *
+ * Under smartvm that is what happens: instead of reading each segment
+ * here we hand its file offset and size to as_define_backing, and the
+ * pages are read in by vm_fault the first time they are touched.
+ *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
  * linker). And you'd have to write a dynamic linker...
@@ -74,6 +78,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +149,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +294,18 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_backing(as, v, ph.p_vaddr, ph.p_offset,
+					   ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
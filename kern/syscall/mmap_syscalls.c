@@ -0,0 +1,106 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <file.h>
+#include <syscall.h>
+
+/**
+	The mmap system call
+
+	Maps len bytes of the open file fd, from offset, and returns where.
+	addr is only a hint, and we don't take it: mappings go downwards from
+	just below the stack. The file must be open for reading, and for
+	writing too if a shared mapping is to be writable. Its file system has
+	the final say through VOP_MMAP.
+
+	With MAP_ANONYMOUS there is no file and the memory starts out zeroed.
+	MAP_ANONYMOUS|MAP_SHARED memory stays shared with children after fork,
+	so forked workers can talk through it.
+*/
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	off_t offset, vaddr_t *retval) {
+
+	struct openfile *of;
+	bool writable = (prot & PROT_WRITE) != 0;
+	bool shared;
+	int accmode;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: mmap(%p, %u, 0x%x, 0x%x, %d)\n",
+		addr, (unsigned)len, prot, flags, fd);
+	(void)addr;
+
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	switch (flags & ~MAP_ANONYMOUS) {
+	    case MAP_SHARED:
+		shared = true;
+		break;
+	    case MAP_PRIVATE:
+		shared = false;
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (flags & MAP_ANONYMOUS) {
+		return as_mmap(curproc_getas(), NULL, len, 0,
+			writable, shared, retval);
+	}
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	accmode = of->of_flags & O_ACCMODE;
+	if (accmode == O_WRONLY || (shared && writable && accmode != O_RDWR)) {
+		openfile_decref(of);
+		return EACCES;
+	}
+
+	result = VOP_MMAP(of->of_vnode);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+
+	/* The mapping keeps a vnode reference of its own */
+	result = as_mmap(curproc_getas(), of->of_vnode, len, offset,
+		writable, shared, retval);
+	openfile_decref(of);
+	return result;
+}
+
+/**
+	The munmap system call
+
+	Removes the whole mapping at addr, writing a shared one's changes
+	back to the file.
+*/
+int sys_munmap(userptr_t addr, size_t len) {
+	DEBUG(DB_SYSCALL, "Syscall: munmap(%p, %u)\n", addr, (unsigned)len);
+
+	return as_munmap(curproc_getas(), (vaddr_t)addr, len);
+}
+
+/**
+	The madvise system call
+
+	ADDR must be page aligned; the hint covers every page LEN touches.
+*/
+int sys_madvise(userptr_t addr, size_t len, int advice) {
+	DEBUG(DB_SYSCALL, "Syscall: madvise(%p, %u, %d)\n", addr,
+		(unsigned)len, advice);
+
+	if (advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+		return EINVAL;
+	}
+	return as_madvise(curproc_getas(), (vaddr_t)addr, len, advice);
+}
@@ -0,0 +1,200 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/iovec.h>
+#include <kern/socket.h>
+#include <lib.h>
+#include <uio.h>
+#include <syscall.h>
+#include <vfs.h>
+#include <current.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <file.h>
+#include <net.h>
+
+/**
+	Datagram sockets; the work is done in net/socket.c. Only AF_LNET
+	addresses are understood, and no flags.
+*/
+
+/**
+	Copy in a socket address of LEN bytes from user space
+*/
+static int copyin_sockaddr(const_userptr_t uaddr, socklen_t len,
+			   struct sockaddr_ln *addr) {
+	if (len < (socklen_t)sizeof(struct sockaddr_ln)) {
+		return EINVAL;
+	}
+	return copyin(uaddr, addr, sizeof(struct sockaddr_ln));
+}
+
+/**
+	Set up a uio for a user buffer
+*/
+static void socket_uio(struct iovec *iov, struct uio *u, userptr_t ubuf,
+		       size_t len, enum uio_rw rw) {
+	iov->iov_ubase = ubuf;
+	iov->iov_len = len;
+	u->uio_iov = iov;
+	u->uio_iovcnt = 1;
+	u->uio_offset = 0;
+	u->uio_resid = len;
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = curproc_getas();
+}
+
+/**
+	The socket system call
+
+	Returns the new socket's file descriptor in retval
+*/
+int sys_socket(int domain, int type, int protocol, int *retval) {
+	struct vnode *vn;
+	struct openfile *of;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: socket(%d, %d, %d)\n", domain, type,
+	      protocol);
+
+	result = socket_create(domain, type, protocol, &vn);
+	if (result) {
+		return result;
+	}
+	result = openfile_create(vn, O_RDWR, &of);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	result = fd_alloc(curproc, of, retval);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	return 0;
+}
+
+/**
+	The bind system call
+*/
+int sys_bind(int fd, const_userptr_t uaddr, socklen_t len) {
+	struct openfile *of;
+	struct sockaddr_ln addr;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: bind(%d, %p, %d)\n", fd, uaddr, len);
+
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = copyin_sockaddr(uaddr, len, &addr);
+	if (result == 0) {
+		result = socket_bind(of->of_vnode, &addr);
+	}
+	openfile_decref(of);
+	return result;
+}
+
+/**
+	The sendto system call
+
+	Returns the number of bytes sent, which is all of them, in retval
+*/
+int sys_sendto(int fd, userptr_t ubuf, size_t len, int flags,
+	       const_userptr_t uaddr, socklen_t addrlen, int *retval) {
+	struct openfile *of;
+	struct sockaddr_ln addr;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: sendto(%d, %p, %u, %d, %p, %d)\n", fd,
+	      ubuf, len, flags, uaddr, addrlen);
+
+	if (flags != 0) {
+		return EINVAL;
+	}
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	result = copyin_sockaddr(uaddr, addrlen, &addr);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+
+	socket_uio(&iov, &u, ubuf, len, UIO_WRITE);
+	result = socket_sendto(of->of_vnode, &u, &addr);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+	*retval = len;
+	return 0;
+}
+
+/**
+	The recvfrom system call
+
+	Returns the number of bytes received in retval. If uaddr isn't NULL,
+	the sender's address goes there, cut to *uaddrlen bytes, and
+	*uaddrlen is set to its real size.
+*/
+int sys_recvfrom(int fd, userptr_t ubuf, size_t len, int flags,
+		 userptr_t uaddr, userptr_t uaddrlen, int *retval) {
+	struct openfile *of;
+	struct sockaddr_ln addr;
+	struct iovec iov;
+	struct uio u;
+	socklen_t addrlen = 0;
+	int result;
+
+	DEBUG(DB_SYSCALL, "Syscall: recvfrom(%d, %p, %u, %d, %p, %p)\n", fd,
+	      ubuf, len, flags, uaddr, uaddrlen);
+
+	if (flags != 0) {
+		return EINVAL;
+	}
+	result = fd_get(curproc, fd, &of);
+	if (result) {
+		return result;
+	}
+	if (uaddr != NULL) {
+		result = copyin(uaddrlen, &addrlen, sizeof(addrlen));
+		if (result) {
+			openfile_decref(of);
+			return result;
+		}
+		if (addrlen < 0) {
+			openfile_decref(of);
+			return EINVAL;
+		}
+	}
+
+	socket_uio(&iov, &u, ubuf, len, UIO_READ);
+	result = socket_recvfrom(of->of_vnode, &u, &addr);
+	openfile_decref(of);
+	if (result) {
+		return result;
+	}
+
+	if (uaddr != NULL) {
+		if (addrlen > (socklen_t)sizeof(addr)) {
+			addrlen = sizeof(addr);
+		}
+		result = copyout(&addr, uaddr, addrlen);
+		if (result) {
+			return result;
+		}
+		addrlen = sizeof(addr);
+		result = copyout(&addrlen, uaddrlen, sizeof(addrlen));
+		if (result) {
+			return result;
+		}
+	}
+	*retval = len - u.uio_resid;
+	return 0;
+}
@@ -0,0 +1,180 @@
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <limits.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <proc.h>
+#include <file.h>
+
+int openfile_create(struct vnode *vn, int flags, struct openfile **ret) {
+	struct openfile *of;
+
+	of = kmalloc(sizeof(struct openfile));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	of->of_vnode = vn;
+	of->of_flags = flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+	of->of_offset = 0;
+	of->of_refcount = 1;
+	spinlock_init(&of->of_reflock);
+
+	*ret = of;
+	return 0;
+}
+
+int openfile_open(const char *path, int flags, mode_t mode, struct openfile **ret) {
+	struct vnode *vn;
+	int result;
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		return result;
+	}
+
+	result = openfile_create(vn, flags, ret);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	return 0;
+}
+
+void openfile_incref(struct openfile *of) {
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void openfile_decref(struct openfile *of) {
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	last = --of->of_refcount == 0;
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		vfs_close(of->of_vnode);
+		spinlock_cleanup(&of->of_reflock);
+		lock_destroy(of->of_lock);
+		kfree(of);
+	}
+}
+
+int fd_get(struct proc *p, int fd, struct openfile **ret) {
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+	spinlock_acquire(&p->p_fdlock);
+	of = p->p_fds[fd];
+	if (of != NULL) {
+		openfile_incref(of);
+	}
+	spinlock_release(&p->p_fdlock);
+	if (of == NULL) {
+		return EBADF;
+	}
+	*ret = of;
+	return 0;
+}
+
+int fd_alloc(struct proc *p, struct openfile *of, int *fd) {
+	spinlock_acquire(&p->p_fdlock);
+	for (int i = 0; i < OPEN_MAX; i++) {
+		if (p->p_fds[i] == NULL) {
+			p->p_fds[i] = of;
+			spinlock_release(&p->p_fdlock);
+			*fd = i;
+			return 0;
+		}
+	}
+	spinlock_release(&p->p_fdlock);
+	return EMFILE;
+}
+
+int fd_dup2(struct proc *p, int oldfd, int newfd) {
+	struct openfile *of, *old;
+
+	if (oldfd < 0 || oldfd >= OPEN_MAX || newfd < 0 || newfd >= OPEN_MAX) {
+		return EBADF;
+	}
+	spinlock_acquire(&p->p_fdlock);
+	of = p->p_fds[oldfd];
+	if (of == NULL) {
+		spinlock_release(&p->p_fdlock);
+		return EBADF;
+	}
+	old = p->p_fds[newfd];
+	if (old == of) {
+		/* Already the same; dup2 to itself does nothing */
+		spinlock_release(&p->p_fdlock);
+		return 0;
+	}
+	openfile_incref(of);
+	p->p_fds[newfd] = of;
+	spinlock_release(&p->p_fdlock);
+
+	/* Closing may sleep, so only once the table is let go of */
+	if (old != NULL) {
+		openfile_decref(old);
+	}
+	return 0;
+}
+
+int fd_close(struct proc *p, int fd) {
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+	spinlock_acquire(&p->p_fdlock);
+	of = p->p_fds[fd];
+	p->p_fds[fd] = NULL;
+	spinlock_release(&p->p_fdlock);
+	if (of == NULL) {
+		return EBADF;
+	}
+	openfile_decref(of);
+	return 0;
+}
+
+void fd_copyall(struct proc *from, struct proc *to) {
+	spinlock_acquire(&from->p_fdlock);
+	for (int i = 0; i < OPEN_MAX; i++) {
+		KASSERT(to->p_fds[i] == NULL);
+		if (from->p_fds[i] != NULL) {
+			openfile_incref(from->p_fds[i]);
+			to->p_fds[i] = from->p_fds[i];
+		}
+	}
+	spinlock_release(&from->p_fdlock);
+}
+
+void fd_closeall(struct proc *p) {
+	struct openfile *of;
+
+	for (int i = 0; i < OPEN_MAX; i++) {
+		spinlock_acquire(&p->p_fdlock);
+		of = p->p_fds[i];
+		p->p_fds[i] = NULL;
+		spinlock_release(&p->p_fdlock);
+		if (of != NULL) {
+			openfile_decref(of);
+		}
+	}
+}
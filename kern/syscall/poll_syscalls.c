@@ -0,0 +1,300 @@
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <lib.h>
+#include <limits.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <current.h>
+#include <proc.h>
+#include <file.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <poll.h>
+#include <syscall.h>
+
+/**
+	poll: waiting for any of several descriptors to become ready.
+
+	A thread can only sleep on one wait channel, so each call to poll has
+	its own (in its pollwaiter), and instead the pollwaiter goes on the
+	pollqueue of every file being watched, through one pollent per file.
+	Whichever file changes first wakes it. See <poll.h> for the side of
+	this the files see.
+
+	Timeouts are only looked at once a second, when timerclock wakes every
+	thread in poll, so they are rounded up to the next tick.
+*/
+
+struct pollent {
+	struct pollwaiter *pe_waiter;
+	struct pollqueue *pe_queue;
+	struct pollent *pe_next;			/* on pe_queue, under its lock */
+};
+
+struct pollwaiter {
+	struct wchan *pw_wchan;				/* also locks pw_woken */
+	bool pw_woken;
+	struct proc *pw_proc;
+	struct pollent *pw_ents;			/* one for each file */
+	unsigned pw_nents;
+	unsigned pw_maxents;
+	struct pollwaiter *pw_next;			/* on poll_waiters */
+};
+
+// Every thread in poll, for poll_timerclock and poll_wakeproc
+static struct pollwaiter *poll_waiters = NULL;
+static struct spinlock poll_lock = SPINLOCK_INITIALIZER;
+
+void pollqueue_init(struct pollqueue *pq) {
+	spinlock_init(&pq->pq_lock);
+	pq->pq_ents = NULL;
+}
+
+void pollqueue_cleanup(struct pollqueue *pq) {
+	KASSERT(pq->pq_ents == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+void pollqueue_add(struct pollqueue *pq, struct pollwaiter *pw) {
+	struct pollent *pe;
+
+	if (pw == NULL) {
+		return;
+	}
+	KASSERT(pw->pw_nents < pw->pw_maxents);
+	pe = &pw->pw_ents[pw->pw_nents++];
+	pe->pe_waiter = pw;
+	pe->pe_queue = pq;
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_next = pq->pq_ents;
+	pq->pq_ents = pe;
+	spinlock_release(&pq->pq_lock);
+}
+
+static void pollwaiter_poke(struct pollwaiter *pw) {
+	wchan_lock(pw->pw_wchan);
+	pw->pw_woken = true;
+	wchan_unlock(pw->pw_wchan);
+	wchan_wakeall(pw->pw_wchan);
+}
+
+void pollqueue_wakeup(struct pollqueue *pq) {
+	struct pollent *pe;
+
+	// Holding the queue lock keeps the waiters from going away
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_ents; pe != NULL; pe = pe->pe_next) {
+		pollwaiter_poke(pe->pe_waiter);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+void poll_timerclock(void) {
+	struct pollwaiter *pw;
+
+	spinlock_acquire(&poll_lock);
+	for (pw = poll_waiters; pw != NULL; pw = pw->pw_next) {
+		pollwaiter_poke(pw);
+	}
+	spinlock_release(&poll_lock);
+}
+
+void poll_wakeproc(struct proc *p) {
+	struct pollwaiter *pw;
+
+	spinlock_acquire(&poll_lock);
+	for (pw = poll_waiters; pw != NULL; pw = pw->pw_next) {
+		if (pw->pw_proc == p) {
+			pollwaiter_poke(pw);
+		}
+	}
+	spinlock_release(&poll_lock);
+}
+
+/* Take PW off every pollqueue it got onto, and off poll_waiters. */
+static void pollwaiter_remove(struct pollwaiter *pw) {
+	struct pollwaiter **pwp;
+	struct pollent **pp, *pe;
+
+	for (unsigned i = 0; i < pw->pw_nents; i++) {
+		pe = &pw->pw_ents[i];
+		spinlock_acquire(&pe->pe_queue->pq_lock);
+		for (pp = &pe->pe_queue->pq_ents; *pp != pe; pp = &(*pp)->pe_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = pe->pe_next;
+		spinlock_release(&pe->pe_queue->pq_lock);
+	}
+	pw->pw_nents = 0;
+
+	spinlock_acquire(&poll_lock);
+	for (pwp = &poll_waiters; *pwp != pw; pwp = &(*pwp)->pw_next) {
+		KASSERT(*pwp != NULL);
+	}
+	*pwp = pw->pw_next;
+	spinlock_release(&poll_lock);
+}
+
+/**
+	Fill in revents for every entry, putting PW (if not NULL) on each
+	file's queue. Returns how many entries have something to report.
+*/
+static unsigned poll_scan(struct pollfd *pfds, struct openfile **ofs, nfds_t nfds,
+			  struct pollwaiter *pw) {
+	unsigned nready = 0;
+	int revents;
+
+	for (nfds_t i = 0; i < nfds; i++) {
+		revents = 0;
+		if (ofs[i] != NULL) {
+			if (VOP_POLL(ofs[i]->of_vnode, pfds[i].events, pw, &revents)) {
+				revents = POLLERR;
+			}
+			revents &= pfds[i].events | POLLERR | POLLHUP;
+		} else if (pfds[i].fd >= 0) {
+			revents = POLLNVAL;
+		}
+		pfds[i].revents = revents;
+		if (revents != 0) {
+			nready++;
+		}
+	}
+	return nready;
+}
+
+/* Has the time given by SECS and NSECS come? */
+static bool poll_expired(time_t secs, uint32_t nsecs) {
+	time_t nowsecs;
+	uint32_t nownsecs;
+
+	gettime(&nowsecs, &nownsecs);
+	return nowsecs > secs || (nowsecs == secs && nownsecs >= nsecs);
+}
+
+/**
+	Wait for any of the files in OFS (the open ones of PFDS) to be ready,
+	or for TIMEOUT milliseconds, and return how many are in NREADY.
+*/
+static int poll_wait(struct pollfd *pfds, struct openfile **ofs, nfds_t nfds,
+		     struct pollwaiter *pw, int timeout, unsigned *nready) {
+	time_t secs = 0;
+	uint32_t nsecs = 0;
+	int result = 0;
+
+	if (timeout > 0) {
+		gettime(&secs, &nsecs);
+		secs += timeout / 1000;
+		nsecs += (timeout % 1000) * 1000000;
+		if (nsecs >= 1000000000) {
+			secs++;
+			nsecs -= 1000000000;
+		}
+	}
+
+	pw->pw_woken = false;
+	pw->pw_proc = curproc;
+	pw->pw_nents = 0;
+	pw->pw_maxents = nfds;
+	spinlock_acquire(&poll_lock);
+	pw->pw_next = poll_waiters;
+	poll_waiters = pw;
+	spinlock_release(&poll_lock);
+
+	// The first scan gets us on every queue; after that, any change to
+	// one of the files sets pw_woken, so clearing it before each scan
+	// means nothing that happens during the scan is missed
+	*nready = poll_scan(pfds, ofs, nfds, pw);
+	while (*nready == 0 && timeout != 0) {
+		wchan_lock(pw->pw_wchan);
+		if (!pw->pw_woken) {
+			wchan_sleep(pw->pw_wchan);
+		} else {
+			wchan_unlock(pw->pw_wchan);
+		}
+
+		if (curproc->p_exiting) {
+			result = EINTR;
+			break;
+		}
+		wchan_lock(pw->pw_wchan);
+		pw->pw_woken = false;
+		wchan_unlock(pw->pw_wchan);
+
+		*nready = poll_scan(pfds, ofs, nfds, NULL);
+		if (*nready == 0 && timeout > 0 && poll_expired(secs, nsecs)) {
+			break;
+		}
+	}
+
+	pollwaiter_remove(pw);
+	return result;
+}
+
+/**
+	The poll system call
+
+	Waits until at least one of the `nfds` descriptors in `fds` has one of
+	the events asked for, or `timeout` milliseconds go by (forever if it's
+	negative), and returns how many have something to report.
+*/
+int sys_poll(userptr_t fds, nfds_t nfds, int timeout, int *retval) {
+	struct pollfd *pfds;
+	struct openfile **ofs;
+	struct pollwaiter pw;
+	unsigned nready;
+	nfds_t i;
+	int result;
+
+	if (nfds < 0 || nfds > OPEN_MAX) {
+		return EINVAL;
+	}
+
+	// (+1 so nfds == 0 doesn't look like running out of memory)
+	pfds = kmalloc((nfds + 1) * sizeof(*pfds));
+	ofs = kmalloc((nfds + 1) * sizeof(*ofs));
+	pw.pw_ents = kmalloc((nfds + 1) * sizeof(*pw.pw_ents));
+	pw.pw_wchan = wchan_create("poll");
+	if (pfds == NULL || ofs == NULL || pw.pw_ents == NULL || pw.pw_wchan == NULL) {
+		result = ENOMEM;
+	} else {
+		result = copyin(fds, pfds, nfds * sizeof(*pfds));
+	}
+
+	if (result == 0) {
+		// fd_get's references hold on to the files, in case another
+		// of our threads closes them
+		for (i = 0; i < nfds; i++) {
+			if (fd_get(curproc, pfds[i].fd, &ofs[i])) {
+				ofs[i] = NULL;
+			}
+		}
+
+		result = poll_wait(pfds, ofs, nfds, &pw, timeout, &nready);
+
+		for (i = 0; i < nfds; i++) {
+			if (ofs[i] != NULL) {
+				openfile_decref(ofs[i]);
+			}
+		}
+	}
+
+	if (result == 0) {
+		result = copyout(pfds, fds, nfds * sizeof(*pfds));
+	}
+	if (result == 0) {
+		*retval = nready;
+	}
+
+	if (pw.pw_wchan != NULL) {
+		wchan_destroy(pw.pw_wchan);
+	}
+	kfree(pw.pw_ents);
+	kfree(ofs);
+	kfree(pfds);
+	return result;
+}
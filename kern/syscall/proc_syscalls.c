@@ -1,7 +1,12 @@
+#define KMTAG KMT_PROC
+
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <signal.h>
 #include <lib.h>
 #include <mips/trapframe.h>
 #include <syscall.h>
@@ -14,35 +19,135 @@
 #include <array.h>
 #include <limits.h>
 #include <test.h>
+#include <file.h>
+#include <ioring.h>
+#include <vm.h>
+#include <poll.h>
 
-// Maximum length of a single execv argument (1024 in this case)
-#define EXECV_MAX_ARG_SIZE PATH_MAX
+/**
+	Leave the process as one of several threads: record STATUS for
+	threadjoin, detach from the process and wake anyone waiting on that.
+	Call with proc_family_lk held. Does not return.
+*/
+static void uthread_leave(struct proc *p, int status) {
+	KASSERT(lock_do_i_hold(proc_family_lk));
+	KASSERT(threadarray_num(&p->p_threads) > 1);
+
+	for (unsigned i = 0; i < array_num(&p->p_uthreads); i++) {
+		struct uthread *ut = array_get(&p->p_uthreads, i);
+		if (ut->ut_thread == curthread) {
+			ut->ut_exited = true;
+			ut->ut_status = status;
+			break;
+		}
+	}
 
-/* this implementation of sys__exit does not do anything with the exit code */
-/* this needs to be fixed to get exit() and waitpid() working properly */
+	as_deactivate();
+	proc_remthread(curthread);
+	cv_broadcast(p->p_thread_cv, proc_family_lk);
+	lock_release(proc_family_lk);
 
-void sys__exit(int exitcode) {
+	// p may be gone as soon as the lock is dropped
+	thread_exit();
+}
 
-	struct addrspace *as;
+/**
+	For _exit and execv: make all the other threads in the process leave,
+	and wait until they have. They notice p_exiting on their way back to
+	user mode (see uthread_checkexit); threads asleep in threadjoin,
+	waitpid, futex_wait or poll are woken to do so, but one blocked elsewhere in
+	the kernel holds us up until its call finishes.
+
+	Returns false if another thread got here first, in which case the
+	caller should leave instead. Call with proc_family_lk held.
+*/
+static bool uthread_stopothers(struct proc *p) {
+	KASSERT(lock_do_i_hold(proc_family_lk));
+
+	if (p->p_exiting) {
+		return false;
+	}
+	if (threadarray_num(&p->p_threads) == 1) {
+		return true;
+	}
+	p->p_exiting = true;
+	cv_broadcast(p->p_thread_cv, proc_family_lk);
+	cv_broadcast(p->p_wait_cv, proc_family_lk);
+	futex_wakeas(p->p_addrspace);
+	poll_wakeproc(p);
+	while (threadarray_num(&p->p_threads) > 1) {
+		cv_wait(p->p_thread_cv, proc_family_lk);
+	}
+	return true;
+}
+
+/**
+	Called on every trap back to user mode. If another thread of ours is
+	exiting or exec'ing, leave instead of returning; if the OOM killer
+	picked the process, exit as if killed.
+*/
+void uthread_checkexit(void) {
 	struct proc *p = curproc;
 
-	DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+	if (p == NULL || p == kproc) {
+		return;
+	}
+	if (p->p_oomkilled) {
+		sys__exit_sig(SIGKILL);
+	}
+	if (!p->p_exiting) {
+		return;
+	}
+	lock_acquire(proc_family_lk);
+	if (!p->p_exiting) {
+		// execv finished with the others already
+		lock_release(proc_family_lk);
+		return;
+	}
+	uthread_leave(p, 0);
+}
+
+/**
+	Common code for _exit and being killed: WAITSTATUS is what waitpid
+	will report, made with _MKWAIT_EXIT or _MKWAIT_SIG
+*/
+static void do_exit(int waitstatus) {
+
+	struct addrspace *as;
+	struct proc *p = curproc;
 
 	KASSERT(curproc->p_addrspace != NULL);
 
-	// Signal all the child processes that it is now OKAY to kill themselves
-	for (unsigned int i = array_num(&p->p_children); i > 0 ; i--) {
+	// Other threads go first; if one of them is already exiting, let it
+	lock_acquire(proc_family_lk);
+	if (!uthread_stopothers(p)) {
+		uthread_leave(p, 0);
+	}
+	lock_release(proc_family_lk);
 
-		// This allows children to destroy themselves
-		struct proc *cproc = array_get(&p->p_children, i - 1);
-		lock_release(cproc->p_exit_lk);
+	// Close our files now rather than when we are reaped, once the ring
+	// has let go of the ones it has
+	ioring_destroy(p);
+	fd_closeall(p);
 
-		// Remove the child from the children array
-		array_remove(&p->p_children, i - 1);
+	// Orphan the children that are still running; they reap themselves when
+	// they exit. Children that already exited stay in the array as zombies
+	// that only we can get to, and are reaped all at once below.
+	lock_acquire(proc_family_lk);
+	for (unsigned int i = array_num(&p->p_children); i > 0 ; i--) {
+		struct proc *cproc = array_get(&p->p_children, i - 1);
+		if (!cproc->p_did_exit) {
+			cproc->p_parent = NULL;
+			// we've been past whatever moves into its place
+			array_remove_unordered(&p->p_children, i - 1);
+		}
 	}
+	lock_release(proc_family_lk);
 
-	// All children must have been removed from the array
-	KASSERT(array_num(&p->p_children) == 0);
+	for (unsigned int i = array_num(&p->p_children); i > 0 ; i--) {
+		proc_destroy(array_get(&p->p_children, i - 1));
+	}
+	array_setsize(&p->p_children, 0);
 
 	as_deactivate();
 	/*
@@ -53,61 +158,89 @@ void sys__exit(int exitcode) {
 	 * messily fatal.
 	 */
 	as = curproc_setas(NULL);
-	as_destroy(as);
+	if (!proc_vfork_done(p)) {
+		// The frames are freed later, so the parent hears sooner
+		as_doom(as);
+	}
 
 	/* detach this thread from its process */
 	/* note: curproc cannot be used after this call */
 	proc_remthread(curthread);
 
+	// Become a zombie and let the parent know. Once the lock is dropped the
+	// parent may reap (destroy) us at any time, so don't touch p after that.
+	// With no parent left nobody will wait for us, so clean up right away.
+	lock_acquire(proc_family_lk);
 	p->p_did_exit = true;
-	p->p_exitcode = _MKWAIT_EXIT(exitcode);
-
-	// Let anyone waiting for this thread know that it has exited
-	cv_broadcast(p->p_wait_cv, p->p_wait_lk);
-
-	// Signal parent processes that we're finished!
-
-	// Okay, at this point, we need to wait for the parent process to exit
-	// before fully destroying ourselves. This way, the parent process can call
-	// waitpid on its children at any time.
-	lock_acquire(p->p_exit_lk);
-	lock_release(p->p_exit_lk);
+	p->p_exitcode = waitstatus;
+	struct proc *parent = p->p_parent;
+	if (parent != NULL) {
+		cv_broadcast(parent->p_wait_cv, proc_family_lk);
+		pollqueue_wakeup(&parent->p_waitpq);
+	}
+	lock_release(proc_family_lk);
 
 	/* if this is the last user process in the system, proc_destroy()
 		 will wake up the kernel menu thread */
-	proc_destroy(p);
+	if (parent == NULL) {
+		proc_destroy(p);
+	}
 
 	thread_exit();
 	/* thread_exit() does not return, so we should never get here */
 	panic("return from thread_exit in sys_exit\n");
 }
 
+void sys__exit(int exitcode) {
+	DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+	do_exit(_MKWAIT_EXIT(exitcode));
+}
+
 /**
-	The fork system call
+	Exit the current process as if killed by signal SIG, for fatal traps
+	and the OOM killer
+*/
+void sys__exit_sig(int sig) {
+	DEBUG(DB_SYSCALL,"Killing process %d with signal %d\n",curproc->p_id,sig);
+	do_exit(_MKWAIT_SIG(sig));
+}
+
+/**
+	Common code for fork and vfork
 
 	* ctf is the current trap frame
 	* retval will be the PID of the child process
 		* The child process will get a return value via `enter_forked_process`
+	* vfork_sem is NULL for fork. For vfork the child borrows our address
+	  space instead of getting a copy, and we sleep on vfork_sem until it
+	  gives it back by calling execv or _exit
 */
-int sys_fork(struct trapframe *ctf, pid_t *retval) {
+static int do_fork(struct trapframe *ctf, pid_t *retval, struct semaphore *vfork_sem) {
 
 	// Create a new process from the current one
 	struct proc *curp = curproc;
-	struct proc *newp = proc_create_runprogram(curp->p_name);
+	struct proc *newp = proc_create_runprogram(curp->p_name, curp);
 	if (newp == NULL) {
 		DEBUG(DB_SYSCALL, "sys_fork error: could not create a process.\n");
 		return ENPROC; // too many processes in system?
 	}
 	DEBUG(DB_SYSCALL, "sys_fork: New process created.\n");
 
-	// Create new address space for the new process
-	as_copy(curproc_getas(), &(newp->p_addrspace));
-	if (newp->p_addrspace == NULL) {
-		DEBUG(DB_SYSCALL, "sys_fork error: Could not create address space for new process.\n");
-		proc_destroy(newp);
-		return ENOMEM; // could not create address space (out of memory?)
+	if (vfork_sem != NULL) {
+		// Share our address space; it isn't refcounted, but we won't touch
+		// it (or go away) until the child hands it back
+		newp->p_addrspace = curproc_getas();
+		newp->p_vfork_sem = vfork_sem;
+	} else {
+		// Create new address space for the new process
+		as_copy(curproc_getas(), &(newp->p_addrspace));
+		if (newp->p_addrspace == NULL) {
+			DEBUG(DB_SYSCALL, "sys_fork error: Could not create address space for new process.\n");
+			proc_destroy(newp);
+			return ENOMEM; // could not create address space (out of memory?)
+		}
+		DEBUG(DB_SYSCALL, "sys_fork: New address space created.\n");
 	}
-	DEBUG(DB_SYSCALL, "sys_fork: New address space created.\n");
 
 	// Duplicate the trap frame? Using the old trap frame's [virtual] pointer...
 	// ... but how do we put it into the new address space?
@@ -120,11 +253,29 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 	memcpy(ntf, ctf, sizeof(struct trapframe));
 	DEBUG(DB_SYSCALL, "sys_fork: New trap frame created.\n");
 
+	// Add the child process to the current one's children array. This has to
+	// happen before the child runs, or it could exit thinking it's an orphan.
+	unsigned childindex;
+	lock_acquire(proc_family_lk);
+	int add_err = array_add(&curp->p_children, newp, &childindex);
+	if (!add_err) {
+		newp->p_parent = curp;
+	}
+	lock_release(proc_family_lk);
+	if (add_err) {
+		proc_destroy(newp);
+		kfree(ntf);
+		return add_err;
+	}
+
 	// Fork the current thread into the new process and enter it
 	// The current trap frame should have the same virtual address...?
 	int thread_fork_err = thread_fork(curthread->t_name, newp, &enter_forked_process, ntf, 0);
 	if (thread_fork_err) {
 		DEBUG(DB_SYSCALL, "sys_fork error: Could not fork curren thread.\n");
+		lock_acquire(proc_family_lk);
+		array_remove(&curp->p_children, childindex);
+		lock_release(proc_family_lk);
 		proc_destroy(newp); // removes address space as well
 		kfree(ntf);
 		ntf = NULL;
@@ -132,131 +283,526 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 	}
 	DEBUG(DB_SYSCALL, "sys_fork: Current thread forked successfully.\n");
 
-	// Add the child process to the current one's children array
-	array_add(&curp->p_children, newp, NULL);
-
-	// Grab the child's exit lock to prevent it from exiting
-	lock_acquire(newp->p_exit_lk);
-
-	// Return the new processes's ID
+	// Return the new processes's ID. The child can't be reaped until we wait
+	// for it, so newp is still good even if it has already exited.
 	*retval = newp->p_id;
 
+	if (vfork_sem != NULL) {
+		// Stay off the shared address space until the child is done with it
+		P(vfork_sem);
+	}
+
 	// No errors
 	return 0;
 }
 
+/**
+	The fork system call
+*/
+int sys_fork(struct trapframe *ctf, pid_t *retval) {
+	return do_fork(ctf, retval, NULL);
+}
+
+/**
+	The vfork system call
+
+	Like fork, but the child runs in our address space, and we don't return
+	until it calls execv or _exit. Saves copying the address space when the
+	child is only going to exec something.
+*/
+int sys_vfork(struct trapframe *ctf, pid_t *retval) {
+	struct semaphore *sem;
+	int result;
+
+	sem = sem_create("vfork", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+	result = do_fork(ctf, retval, sem);
+	sem_destroy(sem);
+	return result;
+}
+
 /* stub handler for getpid() system call                */
 int sys_getpid(pid_t *retval) {
 	*retval = curproc->p_id;
 	return 0 ;
 }
 
-/* stub handler for waitpid() system call                */
-
+/**
+	The waitpid system call
+
+	* pid may be a child's PID, or WAIT_ANY (-1) for whichever child exits
+	  first
+	* with WNOHANG in options, returns 0 straight away if no matching child
+	  has exited yet
+	* the child that is waited for is reaped: its PID is freed and its proc
+	  destroyed
+*/
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval) {
 
+	struct proc *curp = curproc;
+	struct proc *child;
+	unsigned childindex;
 	int exitstatus;
 	int result;
 
-	// Get the process for the given PID
-	struct proc * p = procarray_allprocs_proc_by_pid(pid);
-
-	if (p == NULL) {
-		// Requested PID does not exist
-		return ESRCH;
+	if (options & ~WNOHANG) {
+		return EINVAL;
 	}
 
-	if (p == curproc) {
-		// Current process can't wait on itself
-		return ECHILD;
+	lock_acquire(proc_family_lk);
+	for (;;) {
+		bool found = false;
+		child = NULL;
+		for (unsigned i = 0; i < array_num(&curp->p_children); i++) {
+			struct proc *cproc = array_get(&curp->p_children, i);
+			if (pid == WAIT_ANY || cproc->p_id == pid) {
+				found = true;
+				if (cproc->p_did_exit) {
+					child = cproc;
+					childindex = i;
+					break;
+				}
+			}
+		}
+
+		if (!found) {
+			lock_release(proc_family_lk);
+			// Tell a PID that doesn't exist apart from someone else's process
+			if (pid != WAIT_ANY && proc_by_pid(pid) == NULL) {
+				return ESRCH;
+			}
+			return ECHILD;
+		}
+		if (child != NULL) {
+			break;
+		}
+		if (options & WNOHANG) {
+			lock_release(proc_family_lk);
+			*retval = 0;
+			return 0;
+		}
+		if (curp->p_exiting) {
+			// Another of our threads is exiting; get out of its way
+			lock_release(proc_family_lk);
+			return EINTR;
+		}
+
+		// Wait for one of our children to exit before looking again.
+		cv_wait(curp->p_wait_cv, proc_family_lk);
+	}
+	array_remove_unordered(&curp->p_children, childindex);
+	lock_release(proc_family_lk);
+
+	exitstatus = child->p_exitcode;
+	*retval = child->p_id;
+	proc_reapusage(curp, child);
+	proc_destroy(child);
+
+	if (status != NULL) {
+		result = copyout((void *)&exitstatus, status, sizeof(int));
+		if (result) {
+			return result;
+		}
 	}
 
-	if (options != 0) {
+	return 0;
+}
+
+static void ns_to_timeval(uint64_t ns, struct timeval *tv) {
+	tv->tv_sec = ns / 1000000000;
+	tv->tv_usec = (ns % 1000000000) / 1000;
+}
+
+/**
+	The getrusage system call
+
+	Faults that had to read the disk are the major ones; the rest of the
+	TLB faults are minor. Blocks are counted when they are read from disk
+	and when they are first dirtied in the buffer cache, since the write
+	itself happens later, in the flusher.
+*/
+int sys_getrusage(int who, userptr_t usage) {
+	struct thread_usage tu;
+	struct rusage ru;
+
+	if (who == RUSAGE_SELF) {
+		proc_getusage(curproc, &tu);
+	} else if (who == RUSAGE_CHILDREN) {
+		proc_getchildusage(curproc, &tu);
+	} else {
 		return EINVAL;
 	}
 
-	// Wait for the thread to exit before returning.
-	lock_acquire(p->p_wait_lk);
-		while (!p->p_did_exit) {
-			cv_wait(p->p_wait_cv, p->p_wait_lk);
-		}
-	lock_release(p->p_wait_lk);
+	bzero(&ru, sizeof(ru));
+	ns_to_timeval(tu.tu_utime, &ru.ru_utime);
+	ns_to_timeval(tu.tu_stime, &ru.ru_stime);
+	ru.ru_minflt = tu.tu_faults > tu.tu_majflt ? tu.tu_faults - tu.tu_majflt : 0;
+	ru.ru_majflt = tu.tu_majflt;
+	ru.ru_inblock = tu.tu_inblock;
+	ru.ru_oublock = tu.tu_oublock;
+	ru.ru_nvcsw = tu.tu_nvcsw;
+	ru.ru_nivcsw = tu.tu_nivcsw;
+	ru.ru_nsyscalls = tu.tu_syscalls;
+
+	return copyout(&ru, usage, sizeof(ru));
+}
 
-	exitstatus = p->p_exitcode;
-	result = copyout((void *)&exitstatus, status, sizeof(int));
+/**
+	execv implementation
+*/
+int sys_execv(const_userptr_t program, const_userptr_t args[], int32_t *retval) {
+
+	DEBUG(DB_SYSCALL, "sys_execv: Entering execv syscall\n");
 
+	struct execargs ea;
+	char *kprogram;
+	int result;
+
+	// execv never returns a value; it either replaces us or fails
+	(void)retval;
+
+	kprogram = kmalloc(PATH_MAX);
+	if (kprogram == NULL) {
+		return ENOMEM;
+	}
+
+	// Copy program name into `kprogram`
+	result = copyinstr(program, kprogram, PATH_MAX, NULL);
 	if (result) {
+		// Copy error
+		DEBUG(DB_SYSCALL, "sys_execv: Program name copy error\n");
+		kfree(kprogram);
 		return result;
 	}
 
-	*retval = pid;
+	DEBUG(DB_SYSCALL, "sys_execv: Program name copied: %s\n", kprogram);
+
+	// Copy user arguments straight into the exec argument region
+	result = execargs_init(&ea);
+	if (result) {
+		kfree(kprogram);
+		return result;
+	}
+	result = execargs_copyin(&ea, (userptr_t)args);
+	if (result) {
+		DEBUG(DB_SYSCALL, "sys_execv: Program argument copy error\n");
+		execargs_cleanup(&ea);
+		kfree(kprogram);
+		return result;
+	}
+
+	DEBUG(DB_SYSCALL, "sys_execv: Calling %s with %lu arguments\n", kprogram, ea.ea_argc);
+
+	// The new image only gets this thread
+	lock_acquire(proc_family_lk);
+	if (!uthread_stopothers(curproc)) {
+		lock_release(proc_family_lk);
+		execargs_cleanup(&ea);
+		kfree(kprogram);
+		return EINTR;
+	}
+	curproc->p_exiting = false;
+	lock_release(proc_family_lk);
+
+	// The ring is in the old image's memory
+	ioring_destroy(curproc);
+
+	// Should not return, this implies an error
+	result = runprogram(kprogram, &ea);
+	kfree(kprogram);
+	return result;
+}
+
+/**
+	sbrk implementation
+*/
+int sys_sbrk(intptr_t amount, vaddr_t *retval) {
+	struct addrspace *as = curproc_getas();
+
+	DEBUG(DB_SYSCALL, "Syscall: sbrk(%ld)\n", (long)amount);
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/**
+	First thing a threadfork thread runs, in the kernel
+*/
+static void enter_uthread(void *data, unsigned long unused) {
+	struct uthread *ut = data;
+
+	(void)unused;
+
+	// Only we ever look at this, so no lock needed
+	ut->ut_thread = curthread;
+
+	enter_new_process((int)ut->ut_arg, NULL, ut->ut_stack, ut->ut_entry);
+}
+
+/**
+	The threadfork system call
+*/
+int sys_threadfork(vaddr_t entry, vaddr_t arg, vaddr_t stack, int *retval) {
+	struct proc *p = curproc;
+	struct uthread *ut;
+	unsigned index;
+	int result;
+
+	if (entry >= USERSPACETOP || stack >= USERSPACETOP) {
+		return EFAULT;
+	}
+	if (stack % 8 != 0) {
+		// The MIPS ABI wants doubleword-aligned stacks
+		return EINVAL;
+	}
+
+	ut = kmalloc(sizeof(*ut));
+	if (ut == NULL) {
+		return ENOMEM;
+	}
+	ut->ut_thread = NULL;
+	ut->ut_exited = false;
+	ut->ut_status = 0;
+	ut->ut_entry = entry;
+	ut->ut_arg = arg;
+	ut->ut_stack = stack;
+
+	// Hold the lock across thread_fork so _exit can't miss the new thread
+	lock_acquire(proc_family_lk);
+	if (p->p_exiting) {
+		lock_release(proc_family_lk);
+		kfree(ut);
+		return EINTR;
+	}
+	ut->ut_id = p->p_nextutid++;
+	result = array_add(&p->p_uthreads, ut, &index);
+	if (result) {
+		lock_release(proc_family_lk);
+		kfree(ut);
+		return result;
+	}
+	result = thread_fork(curthread->t_name, p, enter_uthread, ut, 0);
+	if (result) {
+		array_remove_unordered(&p->p_uthreads, index);
+		lock_release(proc_family_lk);
+		kfree(ut);
+		return result;
+	}
+	*retval = ut->ut_id;
+	lock_release(proc_family_lk);
+
+	DEBUG(DB_SYSCALL, "sys_threadfork: started thread %d\n", *retval);
 	return 0;
 }
 
 /**
-	execv implementation
+	The threadexit system call
+
+	Ends the calling thread. The last thread out ends the process, as if
+	it had called _exit.
 */
-int sys_execv(const_userptr_t program, const_userptr_t args[], int32_t *retval) {
+void sys_threadexit(int exitcode) {
+	struct proc *p = curproc;
 
-	DEBUG(DB_SYSCALL, "sys_execv: Entering execv syscall\n");
+	DEBUG(DB_SYSCALL, "Syscall: threadexit(%d)\n", exitcode);
+
+	lock_acquire(proc_family_lk);
+	if (threadarray_num(&p->p_threads) == 1) {
+		lock_release(proc_family_lk);
+		sys__exit(exitcode);
+	}
+	uthread_leave(p, exitcode);
+}
+
+/**
+	The threadjoin system call
+
+	Waits for thread `tid` of this process to exit, then forgets it and
+	copies out its exit code. Each thread can be joined once.
+*/
+int sys_threadjoin(int tid, userptr_t status) {
+	struct proc *p = curproc;
+	struct uthread *ut;
+	unsigned i;
+	int exitcode;
+
+	lock_acquire(proc_family_lk);
+	for (;;) {
+		// Look it up again each time; another joiner may have taken it
+		ut = NULL;
+		for (i = 0; i < array_num(&p->p_uthreads); i++) {
+			ut = array_get(&p->p_uthreads, i);
+			if (ut->ut_id == tid) {
+				break;
+			}
+			ut = NULL;
+		}
+		if (ut == NULL) {
+			lock_release(proc_family_lk);
+			return ESRCH;
+		}
+		if (ut->ut_thread == curthread) {
+			lock_release(proc_family_lk);
+			return EINVAL;
+		}
+		if (ut->ut_exited) {
+			break;
+		}
+		if (p->p_exiting) {
+			lock_release(proc_family_lk);
+			return EINTR;
+		}
+		cv_wait(p->p_thread_cv, proc_family_lk);
+	}
+	array_remove_unordered(&p->p_uthreads, i);
+	lock_release(proc_family_lk);
+
+	exitcode = ut->ut_status;
+	kfree(ut);
+
+	if (status != NULL) {
+		return copyout(&exitcode, status, sizeof(int));
+	}
+	return 0;
+}
+
+/**
+	The setaffinity system call
+
+	Only the calling thread's mask changes; if it leaves out the cpu we're
+	on, we move at the next chance the scheduler gets.
+*/
+int sys_setaffinity(unsigned mask) {
+	DEBUG(DB_SYSCALL, "Syscall: setaffinity(0x%x)\n", mask);
+	return thread_setaffinity(mask);
+}
 
-	unsigned long argc = 0;
+/**
+	The getaffinity system call
+*/
+int sys_getaffinity(userptr_t mask) {
+	unsigned cur = thread_getaffinity();
+
+	return copyout(&cur, mask, sizeof(cur));
+}
 
-	size_t programlen = strlen((char *)program) + 1; // + 1 for '\0'
-	size_t totalargslen = 0;
+/**
+	Look up PID for setnice and getnice, 0 meaning ourselves, and call
+	FUNC on it with p_lock held. Under rcu_read_lock, so the process
+	can't be freed while we're at it.
+*/
+static int nice_access(pid_t pid, int *nice, void (*func)(struct proc *, int *)) {
+	struct proc *p;
+
+	rcu_read_lock();
+	p = pid == 0 ? curproc : proc_by_pid(pid);
+	if (p == NULL || p == kproc) {
+		rcu_read_unlock();
+		return ESRCH;
+	}
+	spinlock_acquire(&p->p_lock);
+	func(p, nice);
+	spinlock_release(&p->p_lock);
+	rcu_read_unlock();
+	return 0;
+}
+
+static void nice_set(struct proc *p, int *nice) {
+	p->p_nice = *nice;
+}
+
+static void nice_get(struct proc *p, int *nice) {
+	*nice = p->p_nice;
+}
+
+/**
+	The setnice system call
+
+	Sets the nice value of process PID (0 for the caller), which decides
+	its share of the CPU against other processes (see thread.h). Values
+	past either end are taken as that end.
+*/
+int sys_setnice(pid_t pid, int nice) {
+	DEBUG(DB_SYSCALL, "Syscall: setnice(%d, %d)\n", pid, nice);
 
-	// Figure out how many arguments there are
-	while (args[argc] != NULL) {
-		totalargslen += strlen(((char **)args)[argc]) + 1; // + 1 for '\0'
-		argc++;
+	if (nice < SCHED_NICE_MIN) {
+		nice = SCHED_NICE_MIN;
 	}
+	if (nice > SCHED_NICE_MAX) {
+		nice = SCHED_NICE_MAX;
+	}
+	return nice_access(pid, &nice, nice_set);
+}
+
+/**
+	The getnice system call
+*/
+int sys_getnice(pid_t pid, userptr_t unice) {
+	int nice;
+	int result;
 
-	if (programlen + totalargslen > ARG_MAX || argc > ARG_MAX / EXECV_MAX_ARG_SIZE) {
-		// Args too big
-		DEBUG(DB_SYSCALL, "sys_execv: Too many execv arguments ");
-		DEBUG(DB_SYSCALL, "(%lu arguments with a total length of %d)\n", argc, totalargslen);
-		*retval = E2BIG;
-		return 1;
+	result = nice_access(pid, &nice, nice_get);
+	if (result) {
+		return result;
 	}
+	return copyout(&nice, unice, sizeof(nice));
+}
 
-	DEBUG(DB_SYSCALL, "sys_execv: Calling %s with %lu arguments\n", (char *)program, argc);
+/**
+	The sched_setscheduler system call
 
-	char kprogram[programlen];
-	char kargsraw[totalargslen]; // string containing all args
-	char *kargs[argc];
-	int copyresult;
-	int copiedsofar = 0; // number of characters copied so far
+	Only the calling thread changes, as with setaffinity; see thread.h for
+	what the classes do.
+*/
+int sys_sched_setscheduler(int policy, int prio) {
+	DEBUG(DB_SYSCALL, "Syscall: sched_setscheduler(%d, %d)\n",
+	      policy, prio);
 
-	// Copy program name into `kprogram`
-	copyresult = copyinstr(program, kprogram, programlen, NULL);
-	if (copyresult) {
-		// Copy error
-		DEBUG(DB_SYSCALL, "sys_execv: Program name copy error\n");
-		*retval = copyresult;
-		return 1;
+	if (prio < 0) {
+		return EINVAL;
 	}
+	return thread_setsched(policy, prio);
+}
 
-	DEBUG(DB_SYSCALL, "sys_execv: Program name copied: %s\n", kprogram);
+/**
+	The sched_getscheduler system call
+*/
+int sys_sched_getscheduler(userptr_t uprio, int *retval) {
+	int policy;
+	unsigned prio;
+	int result;
 
-	// Copy user arguments into kernel address space
-	for (unsigned long i = 0; i < argc; i++) {
-		size_t got;
-		size_t arglen = strlen(((char **)args)[i]) + 1; // + 1 for '\0'
-		copyresult = copyinstr(args[i], (char *)(kargsraw + copiedsofar), arglen, &got);
-		if (copyresult) {
-			// Copy error
-			DEBUG(DB_SYSCALL, "sys_execv: Program argument copy error");
-			*retval = copyresult;
-			return 1;
+	thread_getsched(&policy, &prio);
+	if (uprio != NULL) {
+		result = copyout(&prio, uprio, sizeof(prio));
+		if (result) {
+			return result;
 		}
-		kargs[i] = kargsraw + copiedsofar;
-		copiedsofar += got;
-		DEBUG(DB_SYSCALL, "sys_execv: Program argument copied: %s\n", kargs[i]);
 	}
+	*retval = policy;
+	return 0;
+}
 
-	int err = runprogram(kprogram, kargs, argc);
+/**
+	The ioprio_set system call
 
-	// Should not return, this implies an error
-	*retval = err;
-	return 1;
+	Only the calling thread changes, but what it starts from now on gets
+	the new class too.
+*/
+int sys_ioprio_set(int class) {
+	DEBUG(DB_SYSCALL, "Syscall: ioprio_set(%d)\n", class);
+
+	return thread_setioprio(class);
+}
+
+/**
+	The ioprio_get system call
+*/
+int sys_ioprio_get(int *retval) {
+	*retval = thread_getioprio();
+	return 0;
 }
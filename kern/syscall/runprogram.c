@@ -33,6 +33,8 @@
  * that execv() needs to do more than this function does.
  */
 
+#define KMTAG KMT_PROC
+
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
@@ -47,42 +49,165 @@
 #include <copyinout.h>
 #include <limits.h>
 
+/*
+ * Offset slot K of an execargs; the slots grow down from the end of the
+ * buffer while the strings grow up from the start.
+ */
+#define EA_SLOT(ea, k) \
+	((vaddr_t *)((ea)->ea_buf + ARG_MAX) - ((k) + 1))
+
+/**
+	Set up an empty argument region. Returns ENOMEM if the buffer can't be
+	had.
+*/
+int execargs_init(struct execargs *ea) {
+	ea->ea_buf = kmalloc(ARG_MAX);
+	if (ea->ea_buf == NULL) {
+		return ENOMEM;
+	}
+	ea->ea_used = 0;
+	ea->ea_argc = 0;
+	return 0;
+}
+
+void execargs_cleanup(struct execargs *ea) {
+	kfree(ea->ea_buf);
+	ea->ea_buf = NULL;
+}
+
+/**
+	Space left for the next string, keeping a slot for its offset and one
+	for the NULL that ends argv.
+*/
+static size_t execargs_space(struct execargs *ea) {
+	size_t slots = (ea->ea_argc + 2) * sizeof(vaddr_t);
+
+	if (ea->ea_used + slots >= ARG_MAX) {
+		return 0;
+	}
+	return ARG_MAX - ea->ea_used - slots;
+}
+
 /**
-	How much memory is required for `count` items of the given
-	typesize, keeping alignment in mind?
+	Append a kernel string. Returns E2BIG if it doesn't fit.
+*/
+int execargs_add(struct execargs *ea, const char *arg) {
+	size_t len = strlen(arg) + 1;
+
+	if (len > execargs_space(ea)) {
+		return E2BIG;
+	}
+	memcpy(ea->ea_buf + ea->ea_used, arg, len);
+	*EA_SLOT(ea, ea->ea_argc) = ea->ea_used;
+	ea->ea_used += len;
+	ea->ea_argc++;
+	return 0;
+}
+
+/**
+	Append every string of the NULL-terminated user argv UARGV, copying
+	them all straight into the region in one copyinstrs, then filling in
+	the slots. Returns E2BIG if they don't all fit, or EFAULT for a bad
+	pointer.
+*/
+int execargs_copyin(struct execargs *ea, userptr_t uargv) {
+	size_t got, pos;
+	unsigned long count, i;
+	int result;
+
+	result = copyinstrs((const_userptr_t)uargv, ea->ea_buf + ea->ea_used,
+			    execargs_space(ea), &got, &count);
+	if (result) {
+		return result;
+	}
+
+	/* The slots weren't reserved for all of them up front */
+	if (ea->ea_used + got + (ea->ea_argc + count + 1) * sizeof(vaddr_t)
+	    > ARG_MAX) {
+		return E2BIG;
+	}
 
-	Assumes `typesize` is <= the size of a virtual address
+	pos = ea->ea_used;
+	for (i = 0; i < count; i++) {
+		*EA_SLOT(ea, ea->ea_argc) = pos;
+		pos += strlen(ea->ea_buf + pos) + 1;
+		ea->ea_argc++;
+	}
+	ea->ea_used += got;
+	return 0;
+}
+
+/**
+	Copy the region onto the user stack below *STACKPTR: argv (with its
+	NULL) at the new *STACKPTR, the strings right after it.
 */
-int aligned_bytes_required_for(int count, size_t typesize) {
-	size_t addrsize = sizeof(userptr_t);
-	int bytes = (typesize * count);
-	bytes += bytes % addrsize == 0 ? 0 : addrsize - (bytes % addrsize);
-	return bytes;
+static int execargs_copyout(struct execargs *ea, vaddr_t *stackptr) {
+	size_t strbytes = ROUNDUP(ea->ea_used, sizeof(vaddr_t));
+	size_t ptrbytes = (ea->ea_argc + 1) * sizeof(vaddr_t);
+	vaddr_t *argv = EA_SLOT(ea, ea->ea_argc);
+	vaddr_t uargv, ustrings, tmp;
+	struct copyvec vec[2];
+	unsigned long i;
+	int result;
+
+	uargv = (*stackptr - strbytes - ptrbytes) & ~(vaddr_t)7;
+	ustrings = uargv + ptrbytes;
+
+	/*
+	 * The slots run backwards in memory, with the spare one for NULL
+	 * lowest; turn the offsets into user pointers and flip them over
+	 * into argv order.
+	 */
+	*EA_SLOT(ea, ea->ea_argc) = 0;
+	for (i = 0; i < ea->ea_argc; i++) {
+		*EA_SLOT(ea, i) += ustrings;
+	}
+	for (i = 0; i < (ea->ea_argc + 1) / 2; i++) {
+		tmp = argv[i];
+		argv[i] = argv[ea->ea_argc - i];
+		argv[ea->ea_argc - i] = tmp;
+	}
+
+	/* Strings and argv go out together */
+	vec[0].cv_kaddr = ea->ea_buf;
+	vec[0].cv_uaddr = (userptr_t)ustrings;
+	vec[0].cv_len = ea->ea_used;
+	vec[1].cv_kaddr = argv;
+	vec[1].cv_uaddr = (userptr_t)uargv;
+	vec[1].cv_len = ptrbytes;
+	result = copyoutv(vec, 2);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = uargv;
+	return 0;
 }
 
 /*
  * Load program "progname" and start running it in usermode.
  * Does not return except on error.
  *
- * Calls vfs_open on progname and thus may destroy it.
- *
- * The second `oldas` param referes to the processes's previous address space
- * which is no longer required (e.g., if the process just called execv).
+ * The process's previous address space (e.g., if the process just called
+ * execv) is destroyed once the new one is in place.
  *
  * Params
  * - progname
- * - args - Array of arguments for the program
+ * - ea - Arguments for the program. runprogram always cleans this up,
+ *   whether or not it returns.
  */
-int runprogram(char *progname, char **args, unsigned long argc) {
+int runprogram(const char *progname, struct execargs *ea) {
 
 	struct addrspace *as;
 	struct vnode *v;
 	vaddr_t entrypoint, stackptr; // these are just integers
+	unsigned long argc = ea->ea_argc;
 	int result;
 
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
+		execargs_cleanup(ea);
 		return result;
 	}
 
@@ -93,6 +218,7 @@ int runprogram(char *progname, char **args, unsigned long argc) {
 	as = as_create();
 	if (as == NULL) {
 		vfs_close(v);
+		execargs_cleanup(ea);
 		return ENOMEM;
 	}
 
@@ -101,18 +227,22 @@ int runprogram(char *progname, char **args, unsigned long argc) {
 		as_deactivate();
 	}
 
-	/* Switch to it and activate it (clean up old one). */
+	/*
+	 * Switch to it and activate it, then clean up the old one - unless it
+	 * was borrowed from a vfork parent, which gets it back instead.
+	 */
 	struct addrspace * oldas = curproc_setas(as);
-	if (oldas != NULL) {
+	as_activate();
+	if (oldas != NULL && !proc_vfork_done(curproc)) {
 		as_destroy(oldas);
 	}
-	as_activate();
 
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		vfs_close(v);
+		execargs_cleanup(ea);
 		return result;
 	}
 
@@ -123,71 +253,20 @@ int runprogram(char *progname, char **args, unsigned long argc) {
 	result = as_define_stack(as, &stackptr);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
+		execargs_cleanup(ea);
 		return result;
 	}
 
-	// newargs, in case args isn't defined
-	char *newargs[1];
-	newargs[0] = NULL;
-	if (args == NULL) {
-		args = newargs;
-	}
-
-	// calculate total combined length of arguments, including \0 terminators
-	int totalargslen = 0;
-
-	for (unsigned long i = 0; i < argc; i++) {
-		int arglen = strlen(args[i]);
-		totalargslen += arglen + 1; // +1 for \0
-	}
-
-	if (totalargslen > ARG_MAX) {
-		return E2BIG;
-	}
-
-	// Allocate stack space for the params
-	// +1 for NULL-terminated array
-
-	// Bytes required for argv, accounting for alignment
-	int argvmem = aligned_bytes_required_for(argc + 1, sizeof(char **));
-	int argvvalmem = aligned_bytes_required_for(totalargslen, sizeof(char));
-
-	// Total memory required for all arguments
-	int totalmem = argvmem + argvvalmem;
-
-	// Allocate memory on the stack for the new params
-	stackptr -= totalmem;
-
-	// Address of argument values on the user stack
-	char *argv[argc + 1]; // + 1 for NULL at the end
-	userptr_t uargv = (userptr_t)stackptr;
-	userptr_t uargvval = (userptr_t)(stackptr + argvmem);
-
-	size_t got;
-	int argvvaloffset = 0;
-
-	for (unsigned long j = 0; j < argc; j++) {
-		char * arg = args[j];
-		userptr_t dest = (userptr_t)((char *)uargvval + argvvaloffset);
-		result = copyoutstr(arg, dest, strlen(arg) + 1, &got);
-		if (result) {
-			// Address space copy error
-			return result;
-		}
-		argv[j] = (char *)dest;
-		argvvaloffset += got;
-	}
-
-	argv[argc] = NULL;
-	result = copyout(argv, uargv, (argc + 1) * sizeof(char *));
+	/* Put argv and its strings on the stack */
+	result = execargs_copyout(ea, &stackptr);
+	execargs_cleanup(ea);
 	if (result) {
 		// Address space copy error
 		return result;
 	}
 
-
 	/* Warp to user mode. */
-	enter_new_process(argc, uargv, stackptr, entrypoint);
+	enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
 
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
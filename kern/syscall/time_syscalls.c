@@ -28,9 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/cputime.h>
+#include <kern/time.h>
 #include <clock.h>
+#include <cpu.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include <trace.h>
+#include <uw-vmstats.h>
 
 /*
  * Example system call: get the time of day.
@@ -56,3 +62,95 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the interval at USER_REQ, rounded up to whole hardclocks.
+ * Nothing interrupts the sleep, so if USER_REM isn't NULL it just gets
+ * zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	clocksleep_ticks(ticks_from_timespec(&ts));
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Get how cpu number CPU has spent its time, and return the number of
+ * cpus so the caller knows how many there are to ask about.
+ */
+int
+sys_cputimes(int cpu, userptr_t times, int *retval)
+{
+	struct cputimes ct;
+	int result;
+
+	if (cpu < 0) {
+		return EINVAL;
+	}
+	result = cpu_gettimes(cpu, &ct);
+	if (result) {
+		return result;
+	}
+
+	result = copyout(&ct, times, sizeof(ct));
+	if (result) {
+		return result;
+	}
+
+	*retval = cpu_count();
+	return 0;
+}
+
+/*
+ * Copy out the VM statistics counters, summed over all cpus, as an
+ * array of VMSTAT_COUNT unsigned ints, and return VMSTAT_COUNT. They
+ * are system-wide and keep counting; callers look at differences.
+ */
+int
+sys_vmstats(userptr_t counts, int *retval)
+{
+	unsigned int stats[VMSTAT_COUNT];
+	int result;
+
+	vmstats_get(stats);
+	result = copyout(stats, counts, sizeof(stats));
+	if (result) {
+		return result;
+	}
+
+	*retval = VMSTAT_COUNT;
+	return 0;
+}
+
+/*
+ * Record a user event in the trace (see trace.h). Like any other event
+ * it costs a test and branch when TR_USER isn't switched on, so it's
+ * cheap enough for programs to leave in.
+ */
+int
+sys_utrace(unsigned code, unsigned arg)
+{
+	TRACE(TR_USER, code, arg);
+	return 0;
+}
@@ -98,6 +98,15 @@ testa(struct array *a)
 	p = array_get(a, 0);
 	KASSERT(*p == TESTSIZE-1);
 
+	/* the last entry moves into the hole */
+	n = array_num(a);
+	array_remove_unordered(a, 2);
+	KASSERT(array_num(a) == (unsigned)n-1);
+	p = array_get(a, 2);
+	KASSERT(*p == TESTSIZE-(n-1)-2);
+	p = array_get(a, 3);
+	KASSERT(*p == TESTSIZE-3-2);
+
 	array_setsize(a, 2);
 	p = array_get(a, 0);
 	KASSERT(*p == TESTSIZE-1);
@@ -116,6 +125,13 @@ testa(struct array *a)
 	KASSERT(*p == TESTSIZE-1);
 	p = array_get(a, 1);
 	KASSERT(p==NULL);
+
+	/* preallocating leaves the contents alone */
+	r = array_preallocate(a, TESTSIZE*20);
+	KASSERT(r==0);
+	KASSERT(array_num(a) == TESTSIZE*10);
+	p = array_get(a, 0);
+	KASSERT(*p == TESTSIZE-1);
 }
 
 int
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,32 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Allocating near a hint takes the next free bit, wrapping around */
+	bitmap_unmark(b, 5);
+	bitmap_unmark(b, 100);
+	bitmap_unmark(b, 101);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==100);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==101);
+	KASSERT(bitmap_alloc_near(b, 300, &x)==0 && x==5);
+	KASSERT(bitmap_alloc_near(b, 0, &x)==ENOSPC);
+
+	/* Runs of clear bits, found from a hint and wrapping around */
+	bitmap_unmark_run(b, 10, 10);
+	bitmap_unmark_run(b, 40, 4);
+	KASSERT(bitmap_find_next_zero(b, 0, &x)==0 && x==10);
+	KASSERT(bitmap_find_next_zero(b, 20, &x)==0 && x==40);
+	KASSERT(bitmap_find_next_zero(b, 44, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_run(b, 4, 30, &x)==0 && x==40);
+	KASSERT(bitmap_alloc_run(b, 5, 30, &x)==0 && x==10);
+	KASSERT(bitmap_alloc_run(b, 6, 0, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_run(b, 5, 0, &x)==0 && x==15);
+	bitmap_unmark_run(b, 100, 300);
+	bitmap_unmark(b, 450);
+	KASSERT(bitmap_alloc_run(b, 301, 0, &x)==ENOSPC);
+	KASSERT(bitmap_alloc_run(b, 300, 0, &x)==0 && x==100);
+	KASSERT(bitmap_alloc_run(b, 1, 0, &x)==0 && x==450);
+	KASSERT(bitmap_find_next_zero(b, 0, &x)==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,476 @@
+/*
+ * Filesystem benchmarks.
+ *
+ *    fsb filesystem seq|rand|meta|all [filekb [blocksize [threads]]]
+ *
+ * seq and rand have each of THREADS threads write its own FILEKB
+ * kilobyte file in BLOCKSIZE byte blocks, then read it back: seq in
+ * order, rand in a scattered order that still touches every block once.
+ * The write phase includes the vfs_sync at its end, so it measures
+ * getting the data to disk and not just into the buffer cache; the read
+ * phase reads whatever the cache still holds.
+ *
+ * meta has each thread create FSB_NFILES empty files, then stat each
+ * of them, then remove each of them.
+ *
+ * Each phase reports operations per second (and MB/s for reads and
+ * writes) over the whole phase, and latency percentiles from timing a
+ * sample of the operations. Try it on both an sfs volume (lhd0:) and
+ * emu0: for a baseline.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FSB_FILEKB      256	/* default file size */
+#define FSB_BLOCKSIZE  4096	/* default block size */
+#define FSB_THREADS       4	/* default number of threads */
+#define FSB_NFILES       64	/* files per thread for meta */
+#define FSB_MAXTHREADS   16
+#define FSB_MAXBLOCK  65536
+#define FSB_SAMPLES      64	/* latencies timed per thread, at most */
+
+enum fsb_phase {
+	FSB_WRITE,
+	FSB_READ,
+	FSB_CREATE,
+	FSB_STAT,
+	FSB_REMOVE,
+	FSB_NPHASES
+};
+
+static const char *const fsb_names[FSB_NPHASES] = {
+	"write", "read", "create", "stat", "remove",
+};
+
+struct fsbench {
+	const char *fb_fs;
+	unsigned fb_threads;
+	size_t fb_blocksize;
+	unsigned fb_nblocks;		/* per file */
+	unsigned fb_step;		/* block order for rand, or 1 for seq */
+
+	enum fsb_phase fb_phase;
+	unsigned fb_nops;		/* per thread, this phase */
+	unsigned fb_stride;		/* time every fb_stride'th op */
+	struct semaphore *fb_startsem;
+	struct semaphore *fb_donesem;
+	int fb_errors[FSB_MAXTHREADS];
+	uint32_t fb_samples[FSB_MAXTHREADS * FSB_SAMPLES];
+	unsigned fb_nsamples[FSB_MAXTHREADS];
+};
+
+static
+uint64_t
+fsb_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+unsigned
+fsb_gcd(unsigned a, unsigned b)
+{
+	unsigned t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Name of the data file of thread NUM, or with I >= 0 of its I'th
+ * meta file.
+ */
+static
+void
+fsb_makename(char *buf, size_t buflen, struct fsbench *fb,
+	     unsigned long num, int i)
+{
+	if (i < 0) {
+		snprintf(buf, buflen, "%s:fsbench%lu", fb->fb_fs, num);
+	}
+	else {
+		snprintf(buf, buflen, "%s:fsbench%lu.%d", fb->fb_fs, num, i);
+	}
+	KASSERT(strlen(buf) < buflen);
+}
+
+/*
+ * The I'th operation of this phase by thread NUM. VN is its data file,
+ * for reads and writes.
+ */
+static
+int
+fsb_op(struct fsbench *fb, unsigned long num, unsigned i,
+       struct vnode *vn, char *buf)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	struct vnode *v;
+	char name[64];
+	off_t pos;
+	int result;
+
+	switch (fb->fb_phase) {
+	    case FSB_WRITE:
+	    case FSB_READ:
+		pos = (off_t)((uint64_t)i * fb->fb_step % fb->fb_nblocks)
+			* fb->fb_blocksize;
+		if (fb->fb_phase == FSB_WRITE) {
+			uio_kinit(&iov, &ku, buf, fb->fb_blocksize, pos,
+				  UIO_WRITE);
+			result = VOP_WRITE(vn, &ku);
+		}
+		else {
+			uio_kinit(&iov, &ku, buf, fb->fb_blocksize, pos,
+				  UIO_READ);
+			result = VOP_READ(vn, &ku);
+		}
+		if (result == 0 && ku.uio_resid > 0) {
+			result = EIO;
+		}
+		return result;
+	    case FSB_CREATE:
+		fsb_makename(name, sizeof(name), fb, num, i);
+		result = vfs_open(name, O_WRONLY|O_CREAT|O_EXCL, 0664, &v);
+		if (result) {
+			return result;
+		}
+		vfs_close(v);
+		return 0;
+	    case FSB_STAT:
+		fsb_makename(name, sizeof(name), fb, num, i);
+		result = vfs_lookup(name, &v);
+		if (result) {
+			return result;
+		}
+		result = VOP_STAT(v, &st);
+		VOP_DECREF(v);
+		return result;
+	    case FSB_REMOVE:
+		fsb_makename(name, sizeof(name), fb, num, i);
+		return vfs_remove(name);
+	    default:
+		panic("fsb_op: bad phase %d\n", fb->fb_phase);
+	}
+	return 0;
+}
+
+static
+void
+fsb_thread(void *vfb, unsigned long num)
+{
+	struct fsbench *fb = vfb;
+	uint32_t *samples = fb->fb_samples + num * FSB_SAMPLES;
+	struct vnode *vn = NULL;
+	char name[64];
+	char *buf = NULL;
+	unsigned i, n = 0;
+	uint64_t start;
+	int result = 0;
+
+	if (fb->fb_phase == FSB_WRITE || fb->fb_phase == FSB_READ) {
+		buf = kmalloc(fb->fb_blocksize);
+		if (buf == NULL) {
+			result = ENOMEM;
+		}
+		else {
+			for (i=0; i<fb->fb_blocksize; i++) {
+				buf[i] = 'a' + (num + i) % 26;
+			}
+		}
+	}
+
+	P(fb->fb_startsem);
+
+	if (result == 0 && buf != NULL) {
+		fsb_makename(name, sizeof(name), fb, num, -1);
+		result = vfs_open(name, fb->fb_phase == FSB_WRITE ?
+				  O_WRONLY|O_CREAT|O_TRUNC : O_RDONLY,
+				  0664, &vn);
+	}
+	for (i=0; result == 0 && i<fb->fb_nops; i++) {
+		if (i % fb->fb_stride == 0 && n < FSB_SAMPLES) {
+			start = fsb_now();
+			result = fsb_op(fb, num, i, vn, buf);
+			samples[n++] = fsb_now() - start;
+		}
+		else {
+			result = fsb_op(fb, num, i, vn, buf);
+		}
+	}
+	if (vn != NULL) {
+		vfs_close(vn);
+	}
+	kfree(buf);
+
+	fb->fb_errors[num] = result;
+	fb->fb_nsamples[num] = n;
+	V(fb->fb_donesem);
+}
+
+/*
+ * Shell sort; there are at most about a thousand samples.
+ */
+static
+void
+fsb_sort(uint32_t *v, unsigned n)
+{
+	unsigned gap, i, j;
+	uint32_t x;
+
+	for (gap = n/2; gap > 0; gap /= 2) {
+		for (i=gap; i<n; i++) {
+			x = v[i];
+			for (j=i; j>=gap && v[j-gap] > x; j -= gap) {
+				v[j] = v[j-gap];
+			}
+			v[j] = x;
+		}
+	}
+}
+
+static
+int
+fsb_phase(struct fsbench *fb, enum fsb_phase phase)
+{
+	uint64_t start, elapsed, ops, bps;
+	unsigned t, i, n;
+	int result;
+
+	fb->fb_phase = phase;
+	fb->fb_nops = (phase == FSB_WRITE || phase == FSB_READ) ?
+		fb->fb_nblocks : FSB_NFILES;
+	fb->fb_stride = (fb->fb_nops + FSB_SAMPLES - 1) / FSB_SAMPLES;
+
+	for (t=0; t<fb->fb_threads; t++) {
+		result = thread_fork("fsbench", NULL, fsb_thread, fb, t);
+		if (result) {
+			panic("fsbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	start = fsb_now();
+	for (t=0; t<fb->fb_threads; t++) {
+		V(fb->fb_startsem);
+	}
+	for (t=0; t<fb->fb_threads; t++) {
+		P(fb->fb_donesem);
+	}
+	result = 0;
+	if (phase == FSB_WRITE) {
+		result = vfs_sync();
+	}
+	elapsed = fsb_now() - start;
+
+	for (t=0; t<fb->fb_threads; t++) {
+		if (fb->fb_errors[t]) {
+			result = fb->fb_errors[t];
+		}
+	}
+	if (result) {
+		kprintf("fsb %s on %s: %s\n", fsb_names[phase], fb->fb_fs,
+			strerror(result));
+		return result;
+	}
+
+	/* Gather the samples to the front and sort them */
+	n = 0;
+	for (t=0; t<fb->fb_threads; t++) {
+		for (i=0; i<fb->fb_nsamples[t]; i++) {
+			fb->fb_samples[n++] = fb->fb_samples[t * FSB_SAMPLES + i];
+		}
+	}
+	fsb_sort(fb->fb_samples, n);
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	ops = (uint64_t)fb->fb_threads * fb->fb_nops;
+	kprintf("%-6s %2u threads: %7llu ops/sec", fsb_names[phase],
+		fb->fb_threads,
+		(unsigned long long)(ops * 1000000000 / elapsed));
+	if (phase == FSB_WRITE || phase == FSB_READ) {
+		bps = ops * fb->fb_blocksize * 1000000000 / elapsed;
+		kprintf(", %llu.%02llu MB/s",
+			(unsigned long long)(bps / (1024*1024)),
+			(unsigned long long)(bps % (1024*1024) * 100
+					     / (1024*1024)));
+	}
+	if (n > 0) {
+		kprintf(", us p50 %u p90 %u p99 %u max %u",
+			fb->fb_samples[n / 2] / 1000,
+			fb->fb_samples[n * 9 / 10] / 1000,
+			fb->fb_samples[n * 99 / 100] / 1000,
+			fb->fb_samples[n - 1] / 1000);
+	}
+	kprintf("\n");
+	return 0;
+}
+
+/*
+ * Write and read back each thread's data file, then remove them.
+ */
+static
+int
+fsb_data(struct fsbench *fb, bool scatter)
+{
+	char name[64];
+	unsigned t;
+	int result;
+
+	/* A step coprime to the block count visits every block once */
+	fb->fb_step = 1;
+	if (scatter && fb->fb_nblocks > 2) {
+		fb->fb_step = fb->fb_nblocks * 5 / 8 + 1;
+		while (fsb_gcd(fb->fb_step, fb->fb_nblocks) != 1) {
+			fb->fb_step++;
+		}
+	}
+
+	kprintf("fsb %s: %u KB files, %lu byte blocks\n",
+		scatter ? "rand" : "seq",
+		(unsigned)(fb->fb_nblocks * fb->fb_blocksize / 1024),
+		(unsigned long)fb->fb_blocksize);
+	result = fsb_phase(fb, FSB_WRITE);
+	if (result == 0) {
+		result = fsb_phase(fb, FSB_READ);
+	}
+	for (t=0; t<fb->fb_threads; t++) {
+		fsb_makename(name, sizeof(name), fb, t, -1);
+		vfs_remove(name);
+	}
+	return result;
+}
+
+static
+int
+fsb_meta(struct fsbench *fb)
+{
+	char name[64];
+	unsigned t;
+	int i, result;
+
+	kprintf("fsb meta: %u files per thread\n", FSB_NFILES);
+	result = fsb_phase(fb, FSB_CREATE);
+	if (result == 0) {
+		result = fsb_phase(fb, FSB_STAT);
+	}
+	if (result == 0) {
+		return fsb_phase(fb, FSB_REMOVE);
+	}
+
+	/* Clean up after a failure */
+	for (t=0; t<fb->fb_threads; t++) {
+		for (i=0; i<FSB_NFILES; i++) {
+			fsb_makename(name, sizeof(name), fb, t, i);
+			vfs_remove(name);
+		}
+	}
+	return result;
+}
+
+int
+fsbench(int nargs, char **args)
+{
+	struct fsbench *fb;
+	char *device;
+	const char *test;
+	unsigned filekb = FSB_FILEKB;
+	unsigned blocksize = FSB_BLOCKSIZE;
+	unsigned nthreads = FSB_THREADS;
+	int result;
+
+	if (nargs < 3 || nargs > 6) {
+		goto usage;
+	}
+	if (nargs > 3) {
+		filekb = atoi(args[3]);
+	}
+	if (nargs > 4) {
+		blocksize = atoi(args[4]);
+	}
+	if (nargs > 5) {
+		nthreads = atoi(args[5]);
+	}
+	if (blocksize < 1 || blocksize > FSB_MAXBLOCK ||
+	    filekb < 1 || (filekb * 1024) % blocksize != 0 ||
+	    nthreads < 1 || nthreads > FSB_MAXTHREADS) {
+		kprintf("fsb: block size 1-%u dividing the file size, "
+			"1-%u threads\n", FSB_MAXBLOCK, FSB_MAXTHREADS);
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device name */
+	device = args[1];
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+	test = args[2];
+	if (strcmp(test, "seq") && strcmp(test, "rand") &&
+	    strcmp(test, "meta") && strcmp(test, "all")) {
+		goto usage;
+	}
+
+	fb = kmalloc(sizeof(*fb));
+	if (fb == NULL) {
+		return ENOMEM;
+	}
+	bzero(fb, sizeof(*fb));
+	fb->fb_fs = device;
+	fb->fb_threads = nthreads;
+	fb->fb_blocksize = blocksize;
+	fb->fb_nblocks = filekb * 1024 / blocksize;
+	fb->fb_startsem = sem_create("fsbench_start", 0);
+	fb->fb_donesem = sem_create("fsbench_done", 0);
+	if (fb->fb_startsem == NULL || fb->fb_donesem == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	result = 0;
+	if (!strcmp(test, "seq") || !strcmp(test, "all")) {
+		result = fsb_data(fb, false);
+	}
+	if (result == 0 && (!strcmp(test, "rand") || !strcmp(test, "all"))) {
+		result = fsb_data(fb, true);
+	}
+	if (result == 0 && (!strcmp(test, "meta") || !strcmp(test, "all"))) {
+		result = fsb_meta(fb);
+	}
+
+ out:
+	if (fb->fb_donesem != NULL) {
+		sem_destroy(fb->fb_donesem);
+	}
+	if (fb->fb_startsem != NULL) {
+		sem_destroy(fb->fb_startsem);
+	}
+	kfree(fb);
+	return result;
+
+ usage:
+	kprintf("Usage: fsb filesystem seq|rand|meta|all "
+		"[filekb [blocksize [threads]]]\n");
+	return EINVAL;
+}
@@ -56,16 +56,17 @@
 #define NTHREADS 12
 #define NCREATES 32
 
-static struct semaphore *threadsem = NULL;
+/* Stress test threads and the one that started them meet here */
+static struct barrier *threadbarrier = NULL;
 
 static
 void
-init_threadsem(void)
+init_threadbarrier(void)
 {
-	if (threadsem==NULL) {
-		threadsem = sem_create("fstestsem", 0);
-		if (threadsem == NULL) {
-			panic("fstest: sem_create failed\n");
+	if (threadbarrier==NULL) {
+		threadbarrier = barrier_create("fstestbarrier", NTHREADS + 1);
+		if (threadbarrier == NULL) {
+			panic("fstest: barrier_create failed\n");
 		}
 	}
 }
@@ -114,13 +115,11 @@ int
 fstest_remove(const char *fs, const char *namesuffix)
 {
 	char name[32];
-	char buf[32];
 	int err;
 
 	MAKENAME();
 
-	strcpy(buf, name);
-	err = vfs_remove(buf);
+	err = vfs_remove(name);
 	if (err) {
 		kprintf("Could not remove %s: %s\n", name, strerror(err));
 		return -1;
@@ -155,9 +154,7 @@ fstest_write(const char *fs, const char *namesuffix,
 		flags |= O_TRUNC;
 	}
 
-	/* vfs_open destroys the string it's passed */
-	strcpy(buf, name);
-	err = vfs_open(buf, flags, 0664, &vn);
+	err = vfs_open(name, flags, 0664, &vn);
 	if (err) {
 		kprintf("Could not open %s for write: %s\n",
 			name, strerror(err));
@@ -222,9 +219,7 @@ fstest_read(const char *fs, const char *namesuffix)
 
 	MAKENAME();
 
-	/* vfs_open destroys the string it's passed */
-	strcpy(buf, name);
-	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	err = vfs_open(name, O_RDONLY, 0664, &vn);
 	if (err) {
 		kprintf("Could not open test file for read: %s\n",
 			strerror(err));
@@ -306,7 +301,7 @@ readstress_thread(void *fs, unsigned long num)
 	if (fstest_read(filesys, "")) {
 		kprintf("*** Thread %lu: failed\n", num);
 	}
-	V(threadsem);
+	barrier_wait(threadbarrier);
 }
 
 static
@@ -315,7 +310,7 @@ doreadstress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
+	init_threadbarrier();
 
 	kprintf("*** Starting fs read stress test on %s:\n", filesys);
 
@@ -333,9 +328,7 @@ doreadstress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	barrier_wait(threadbarrier);
 
 	if (fstest_remove(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -357,13 +350,13 @@ writestress_thread(void *fs, unsigned long num)
 
 	if (fstest_write(filesys, numstr, 1, 0)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		barrier_wait(threadbarrier);
 		return;
 	}
 
 	if (fstest_read(filesys, numstr)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		barrier_wait(threadbarrier);
 		return;
 	}
 
@@ -373,7 +366,7 @@ writestress_thread(void *fs, unsigned long num)
 
 	kprintf("*** Thread %lu: done\n", num);
 
-	V(threadsem);
+	barrier_wait(threadbarrier);
 }
 
 static
@@ -382,7 +375,7 @@ dowritestress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
+	init_threadbarrier();
 
 	kprintf("*** Starting fs write stress test on %s:\n", filesys);
 
@@ -394,9 +387,7 @@ dowritestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	barrier_wait(threadbarrier);
 
 	kprintf("*** fs write stress test done\n");
 }
@@ -411,11 +402,11 @@ writestress2_thread(void *fs, unsigned long num)
 
 	if (fstest_write(filesys, "", NTHREADS, num)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		barrier_wait(threadbarrier);
 		return;
 	}
 
-	V(threadsem);
+	barrier_wait(threadbarrier);
 }
 
 static
@@ -426,7 +417,7 @@ dowritestress2(const char *filesys)
 	char name[32];
 	struct vnode *vn;
 
-	init_threadsem();
+	init_threadbarrier();
 
 	kprintf("*** Starting fs write stress test 2 on %s:\n", filesys);
 
@@ -449,9 +440,7 @@ dowritestress2(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	barrier_wait(threadbarrier);
 
 	if (fstest_read(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -482,25 +471,25 @@ createstress_thread(void *fs, unsigned long num)
 
 		if (fstest_write(filesys, numstr, 1, 0)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			barrier_wait(threadbarrier);
 			return;
 		}
 
 		if (fstest_read(filesys, numstr)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			barrier_wait(threadbarrier);
 			return;
 		}
 
 		if (fstest_remove(filesys, numstr)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			barrier_wait(threadbarrier);
 			return;
 		}
 
 	}
 
-	V(threadsem);
+	barrier_wait(threadbarrier);
 }
 
 static
@@ -509,7 +498,7 @@ docreatestress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
+	init_threadbarrier();
 
 	kprintf("*** Starting fs create stress test on %s:\n", filesys);
 
@@ -528,9 +517,7 @@ docreatestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	barrier_wait(threadbarrier);
 
 	kprintf("*** fs create stress test done\n");
 }
@@ -587,7 +574,6 @@ printfile(int nargs, char **args)
 	struct uio ku;
 	off_t rpos=0, wpos=0;
 	char buf[128];
-	char outfile[16];
 	int result;
 	int done=0;
 
@@ -596,16 +582,13 @@ printfile(int nargs, char **args)
 		return EINVAL;
 	}
 
-	/* vfs_open destroys the string it's passed; make a copy */
-	strcpy(outfile, "con:");
-
 	result = vfs_open(args[1], O_RDONLY, 0664, &rv);
 	if (result) {
 		kprintf("printfile: %s\n", strerror(result));
 		return result;
 	}
 
-	result = vfs_open(outfile, O_WRONLY, 0664, &wv);
+	result = vfs_open("con:", O_WRONLY, 0664, &wv);
 	if (result) {
 		kprintf("printfile: output: %s\n", strerror(result));
 		vfs_close(rv);
@@ -0,0 +1,184 @@
+/*
+ * Tests for the hash table and radix tree in kern/lib.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <hashtable.h>
+#include <radix.h>
+#include <test.h>
+
+#define TESTSIZE 733
+
+struct testobj {
+	uint32_t to_key;
+	bool to_in;
+	struct hashlink to_link;
+};
+
+#define TESTOBJ_HASH(k) hash_uint32(*(k))
+#define TESTOBJ_MATCH(o, k) ((o)->to_key == *(k))
+
+DECLHASH(testhash, struct testobj, uint32_t);
+DEFHASH(testhash, struct testobj, uint32_t, to_link,
+	TESTOBJ_HASH, TESTOBJ_MATCH, /*no inline*/);
+
+DECLRADIX(testradix, struct testobj);
+DEFRADIX(testradix, struct testobj, /*no inline*/);
+
+static
+struct testobj *
+testobjs_create(void)
+{
+	struct testobj *objs;
+	unsigned i;
+
+	objs = kmalloc(TESTSIZE * sizeof(struct testobj));
+	KASSERT(objs != NULL);
+	for (i=0; i<TESTSIZE; i++) {
+		/* spread out, with some keys sharing low bits */
+		objs[i].to_key = i * 4099 + (i % 3) * 0x10000000;
+		objs[i].to_in = false;
+	}
+	return objs;
+}
+
+int
+hashtest(int nargs, char **args)
+{
+	struct testhash t;
+	struct testobj *objs, *o;
+	uint32_t key;
+	unsigned i, n;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting hash table test...\n");
+
+	objs = testobjs_create();
+	result = testhash_init(&t, 0);
+	KASSERT(result == 0);
+
+	/* Add them all; the table grows several times */
+	for (i=0; i<TESTSIZE; i++) {
+		testhash_add(&t, &objs[i], &objs[i].to_key);
+		objs[i].to_in = true;
+	}
+	KASSERT(testhash_count(&t) == TESTSIZE);
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(testhash_lookup(&t, &objs[i].to_key) == &objs[i]);
+	}
+	key = 1;
+	KASSERT(testhash_lookup(&t, &key) == NULL);
+
+	/* Take out a random half */
+	for (i=0; i<TESTSIZE; i++) {
+		if (random() % 2) {
+			testhash_remove(&t, &objs[i]);
+			objs[i].to_in = false;
+		}
+	}
+	n = 0;
+	for (i=0; i<TESTSIZE; i++) {
+		o = testhash_lookup(&t, &objs[i].to_key);
+		KASSERT(o == (objs[i].to_in ? &objs[i] : NULL));
+		if (objs[i].to_in) {
+			n++;
+		}
+	}
+	KASSERT(testhash_count(&t) == n);
+
+	/* Walking finds each remaining one exactly once */
+	for (o = testhash_next(&t, NULL); o != NULL; o = testhash_next(&t, o)) {
+		KASSERT(o->to_in);
+		o->to_in = false;
+		n--;
+	}
+	KASSERT(n == 0);
+
+	for (i=0; i<TESTSIZE; i++) {
+		if (testhash_lookup(&t, &objs[i].to_key) != NULL) {
+			testhash_remove(&t, &objs[i]);
+		}
+	}
+	KASSERT(testhash_count(&t) == 0);
+	testhash_cleanup(&t);
+	kfree(objs);
+
+	kprintf("Hash table test complete\n");
+	return 0;
+}
+
+int
+radixtest(int nargs, char **args)
+{
+	struct testradix t;
+	struct testobj *objs, *o;
+	uint32_t key, last;
+	unsigned i, n;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting radix tree test...\n");
+
+	objs = testobjs_create();
+	testradix_init(&t);
+
+	for (i=0; i<TESTSIZE; i++) {
+		result = testradix_insert(&t, objs[i].to_key, &objs[i]);
+		KASSERT(result == 0);
+		objs[i].to_in = true;
+	}
+	result = testradix_insert(&t, objs[0].to_key, &objs[1]);
+	KASSERT(result == EEXIST);
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(testradix_lookup(&t, objs[i].to_key) == &objs[i]);
+	}
+	KASSERT(testradix_lookup(&t, 1) == NULL);
+	KASSERT(testradix_lookup(&t, 0xffffffff) == NULL);
+
+	for (i=0; i<TESTSIZE; i++) {
+		if (random() % 2) {
+			o = testradix_remove(&t, objs[i].to_key);
+			KASSERT(o == &objs[i]);
+			objs[i].to_in = false;
+		}
+	}
+	n = 0;
+	for (i=0; i<TESTSIZE; i++) {
+		o = testradix_lookup(&t, objs[i].to_key);
+		KASSERT(o == (objs[i].to_in ? &objs[i] : NULL));
+		if (objs[i].to_in) {
+			n++;
+		}
+	}
+
+	/* Walking goes in key order and finds each remaining one once */
+	last = 0;
+	key = 0;
+	while (n > 0 && (o = testradix_next(&t, key, &key)) != NULL) {
+		KASSERT(o->to_key == key);
+		KASSERT(key >= last);
+		KASSERT(o->to_in);
+		o->to_in = false;
+		last = key;
+		n--;
+		key++;
+	}
+	KASSERT(n == 0);
+
+	for (i=0; i<TESTSIZE; i++) {
+		testradix_remove(&t, objs[i].to_key);
+	}
+	KASSERT(testradix_next(&t, 0, &key) == NULL);
+	testradix_cleanup(&t);
+	kfree(objs);
+
+	kprintf("Radix tree test complete\n");
+	return 0;
+}
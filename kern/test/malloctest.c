@@ -31,10 +31,12 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
+#include <vm.h>
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -137,3 +139,60 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Multi-page kmallocs that alloc_kpages had to map page by page, as it
+ * does when memory is too broken up for a contiguous run: fill them,
+ * check them, and kfree them, which must give them to free_kpages
+ * rather than take them for subpage blocks.
+ */
+int
+mallockva(int nargs, char **args)
+{
+	static const unsigned npages[] = { 2, 3, 5, 16 };
+	unsigned char *ptrs[4];
+	unsigned i, j;
+	size_t size;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc mapped-pages test...\n");
+	vm_kva_force(true);
+	for (i=0; i<4; i++) {
+		ptrs[i] = kmalloc(npages[i] * PAGE_SIZE);
+	}
+	vm_kva_force(false);
+
+	for (i=0; i<4; i++) {
+		if (ptrs[i] == NULL) {
+			kprintf("kmalloc of %u pages returned NULL\n",
+				npages[i]);
+			ok = false;
+			continue;
+		}
+		size = npages[i] * PAGE_SIZE;
+		for (j=0; j<size; j++) {
+			ptrs[i][j] = (unsigned char)(i + j);
+		}
+	}
+	for (i=0; i<4; i++) {
+		if (ptrs[i] == NULL) {
+			continue;
+		}
+		size = npages[i] * PAGE_SIZE;
+		for (j=0; j<size; j++) {
+			if (ptrs[i][j] != (unsigned char)(i + j)) {
+				kprintf("%u pages at %p: byte %u wrong\n",
+					npages[i], ptrs[i], j);
+				ok = false;
+				break;
+			}
+		}
+		kfree(ptrs[i]);
+	}
+
+	kprintf("kmalloc mapped-pages test %s\n", ok ? "done" : "FAILED");
+	return ok ? 0 : EINVAL;
+}
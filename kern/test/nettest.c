@@ -29,16 +29,148 @@
 
 /*
  * Network test code.
+ *
+ * Sends datagrams between two sockets through the network code, to our
+ * own station address (which the network hands straight back), then
+ * broadcasts a few on the hub, and prints each interface's counters.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <net.h>
 #include <test.h>
 
+#define NETTEST_PORT    7
+#define NETTEST_NDGRAMS 20
+#define NETTEST_LEN     1000
+
+static
+void
+nettest_fill(char *buf, unsigned seq)
+{
+	unsigned i;
+
+	for (i=0; i<NETTEST_LEN; i++) {
+		buf[i] = (char)(seq * 31 + i);
+	}
+}
+
+static
+bool
+nettest_same(const char *a, const char *b)
+{
+	unsigned i;
+
+	for (i=0; i<NETTEST_LEN; i++) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
 int
 nettest(int nargs, char **args)
 {
+	struct netif *nif;
+	struct vnode *rx, *tx;
+	struct sockaddr_ln addr, from;
+	struct iovec iov;
+	struct uio ku;
+	char *buf, *check;
+	unsigned i;
+	int result;
+
 	(void)nargs;
 	(void)args;
-	kprintf("No network support available\n");
-	return 1;
+
+	nif = net_firstif();
+	if (nif == NULL) {
+		kprintf("nettest: no network interfaces\n");
+		return ENETDOWN;
+	}
+
+	buf = kmalloc(NETTEST_LEN);
+	check = kmalloc(NETTEST_LEN);
+	if (buf == NULL || check == NULL) {
+		kfree(buf);
+		kfree(check);
+		return ENOMEM;
+	}
+
+	result = socket_create(AF_LNET, SOCK_DGRAM, 0, &rx);
+	if (result) {
+		kprintf("nettest: socket: %s\n", strerror(result));
+		goto out;
+	}
+	result = socket_create(AF_LNET, SOCK_DGRAM, 0, &tx);
+	if (result) {
+		kprintf("nettest: socket: %s\n", strerror(result));
+		vfs_close(rx);
+		goto out;
+	}
+
+	bzero(&addr, sizeof(addr));
+	addr.sln_len = sizeof(addr);
+	addr.sln_family = AF_LNET;
+	addr.sln_port = NETTEST_PORT;
+	addr.sln_addr = nif->if_addr;
+	result = socket_bind(rx, &addr);
+	if (result) {
+		kprintf("nettest: bind: %s\n", strerror(result));
+		goto done;
+	}
+
+	kprintf("nettest: %u datagrams to ourselves...\n", NETTEST_NDGRAMS);
+	for (i=0; i<NETTEST_NDGRAMS; i++) {
+		nettest_fill(buf, i);
+		uio_kinit(&iov, &ku, buf, NETTEST_LEN, 0, UIO_WRITE);
+		result = socket_sendto(tx, &ku, &addr);
+		if (result) {
+			kprintf("nettest: sendto: %s\n", strerror(result));
+			goto done;
+		}
+
+		uio_kinit(&iov, &ku, check, NETTEST_LEN, 0, UIO_READ);
+		result = socket_recvfrom(rx, &ku, &from);
+		if (result) {
+			kprintf("nettest: recvfrom: %s\n", strerror(result));
+			goto done;
+		}
+		if (ku.uio_resid != 0 || !nettest_same(buf, check) ||
+		    from.sln_addr != nif->if_addr || from.sln_port == 0) {
+			kprintf("nettest: datagram %u came back wrong\n", i);
+			result = EIO;
+			goto done;
+		}
+	}
+
+	kprintf("nettest: %u broadcasts...\n", NETTEST_NDGRAMS);
+	addr.sln_addr = LNADDR_BROADCAST;
+	for (i=0; i<NETTEST_NDGRAMS; i++) {
+		nettest_fill(buf, i);
+		uio_kinit(&iov, &ku, buf, NETTEST_LEN, 0, UIO_WRITE);
+		result = socket_sendto(tx, &ku, &addr);
+		if (result) {
+			kprintf("nettest: sendto: %s\n", strerror(result));
+			goto done;
+		}
+	}
+
+	for (nif = net_firstif(); nif != NULL; nif = nif->if_next) {
+		kprintf("%s: in %u (%u dropped), out %u (%u dropped)\n",
+			nif->if_name, nif->if_ipackets, nif->if_idrops,
+			nif->if_opackets, nif->if_odrops);
+	}
+	kprintf("Network test complete\n");
+
+ done:
+	vfs_close(tx);
+	vfs_close(rx);
+ out:
+	kfree(check);
+	kfree(buf);
+	return result;
 }
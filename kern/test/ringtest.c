@@ -0,0 +1,158 @@
+/*
+ * Tests for the lock-free rings in kern/lib.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <ring.h>
+#include <test.h>
+
+#define RINGSIZE	16
+#define NPRODUCERS	4
+#define NITEMS		5000
+
+static struct spscring testspsc;
+static uint32_t testspsc_buf[RINGSIZE];
+
+static struct mpscring testmpsc;
+static unsigned testmpsc_buf[MPSCRING_BUFSIZE(sizeof(uint32_t), RINGSIZE) /
+			     sizeof(unsigned)];
+
+static struct semaphore *ringdone;
+
+/* Producer number in the top byte, sequence number below */
+#define ITEM(p, i)	(((uint32_t)(p) << 24) | (i))
+
+static
+void
+spscproducer(void *junk, unsigned long junk2)
+{
+	uint32_t items[5];
+	unsigned i, j, n, done;
+
+	(void)junk;
+	(void)junk2;
+
+	for (i=0; i<NITEMS; i+=5) {
+		for (j=0; j<5; j++) {
+			items[j] = i + j;
+		}
+		/* Put them in in odd-sized batches, so they wrap around */
+		done = 0;
+		while (done < 5) {
+			n = spscring_put(&testspsc, items + done, 5 - done);
+			if (n == 0) {
+				thread_yield();
+			}
+			done += n;
+		}
+	}
+	V(ringdone);
+}
+
+static
+void
+mpscproducer(void *junk, unsigned long p)
+{
+	uint32_t item;
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<NITEMS; i++) {
+		item = ITEM(p, i);
+		while (!mpscring_put(&testmpsc, &item)) {
+			thread_yield();
+		}
+	}
+	V(ringdone);
+}
+
+int
+ringtest(int nargs, char **args)
+{
+	uint32_t items[RINGSIZE + 1], item;
+	unsigned next[NPRODUCERS];
+	unsigned i, n, got, p;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting ring test...\n");
+
+	ringdone = sem_create("ringdone", 0);
+	if (ringdone == NULL) {
+		panic("ringtest: sem_create failed\n");
+	}
+
+	/* Fill, overfill, and drain */
+	spscring_init(&testspsc, testspsc_buf, sizeof(uint32_t), RINGSIZE);
+	for (i=0; i<RINGSIZE + 1; i++) {
+		items[i] = i;
+	}
+	KASSERT(spscring_put(&testspsc, items, 3) == 3);
+	KASSERT(spscring_get(&testspsc, items, 2) == 2);
+	KASSERT(spscring_put(&testspsc, items, RINGSIZE + 1) == RINGSIZE - 1);
+	KASSERT(spscring_count(&testspsc) == RINGSIZE);
+	KASSERT(spscring_put(&testspsc, items, 1) == 0);
+	KASSERT(spscring_get(&testspsc, items, RINGSIZE + 1) == RINGSIZE);
+	KASSERT(items[0] == 2);
+	for (i=1; i<RINGSIZE; i++) {
+		KASSERT(items[i] == i - 1);
+	}
+	KASSERT(spscring_get(&testspsc, items, 1) == 0);
+
+	/* One producer thread, with everything arriving in order */
+	result = thread_fork("spscproducer", NULL, spscproducer, NULL, 0);
+	if (result) {
+		panic("ringtest: thread_fork failed: %s\n", strerror(result));
+	}
+	got = 0;
+	while (got < NITEMS) {
+		n = spscring_get(&testspsc, items, 3);
+		if (n == 0) {
+			thread_yield();
+		}
+		for (i=0; i<n; i++) {
+			KASSERT(items[i] == got);
+			got++;
+		}
+	}
+	P(ringdone);
+	KASSERT(spscring_count(&testspsc) == 0);
+
+	/* Several, with each one's items in order */
+	mpscring_init(&testmpsc, testmpsc_buf, sizeof(uint32_t), RINGSIZE);
+	for (p=0; p<NPRODUCERS; p++) {
+		next[p] = 0;
+		result = thread_fork("mpscproducer", NULL, mpscproducer,
+				     NULL, p);
+		if (result) {
+			panic("ringtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	got = 0;
+	while (got < NPRODUCERS * NITEMS) {
+		if (!mpscring_get(&testmpsc, &item)) {
+			thread_yield();
+			continue;
+		}
+		p = item >> 24;
+		KASSERT(p < NPRODUCERS);
+		KASSERT(item == ITEM(p, next[p]));
+		next[p]++;
+		got++;
+	}
+	for (p=0; p<NPRODUCERS; p++) {
+		P(ringdone);
+	}
+	KASSERT(!mpscring_get(&testmpsc, &item));
+
+	sem_destroy(ringdone);
+	kprintf("Ring test complete\n");
+	return 0;
+}
@@ -0,0 +1,428 @@
+/*
+ * Synchronization microbenchmarks.
+ *
+ *    bench sem|lock|cv|bcast|spin|all [threads [cpus [iterations]]]
+ *
+ * Each runs THREADS threads, spread round-robin over the first CPUS
+ * cpus (pinned there), each doing ITERATIONS operations:
+ *
+ *    sem    P then V on one semaphore, initially 1
+ *    lock   lock_acquire then lock_release on one lock
+ *    cv     a round trip between a pair of threads through a lock and
+ *           cv: one signals, the other wakes and signals back
+ *    bcast  thread 0 broadcasts to all the others and waits for every
+ *           one of them to answer
+ *    spin   spinlock_acquire then spinlock_release on one spinlock
+ *
+ * One thread makes the operation uncontended; more make it contended.
+ * "all" runs each with the fewest threads it can (one, or two for cv
+ * and bcast) and then with THREADS. The result is operations per
+ * second over the whole run, and latency percentiles from timing a
+ * sample of the operations.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define BENCH_THREADS     4	/* default number of threads */
+#define BENCH_ITERS    2000	/* default operations per thread */
+#define BENCH_MAXTHREADS 32
+#define BENCH_SAMPLES    64	/* latencies timed per thread, at most */
+
+enum bench_kind {
+	BENCH_SEM,
+	BENCH_LOCK,
+	BENCH_CV,
+	BENCH_BCAST,
+	BENCH_SPIN,
+	BENCH_NKINDS
+};
+
+static const char *const bench_names[BENCH_NKINDS] = {
+	"sem", "lock", "cv", "bcast", "spin",
+};
+
+/* A pair of threads for the cv round trip */
+struct bench_pair {
+	struct lock *bp_lock;
+	struct cv *bp_cv;
+	volatile unsigned bp_turn;	/* which of the two goes next */
+};
+
+struct bench {
+	enum bench_kind b_kind;
+	unsigned b_threads;
+	unsigned b_iters;
+	unsigned b_stride;		/* time every b_stride'th operation */
+
+	struct semaphore *b_startsem;	/* V'd once per thread to start */
+	struct semaphore *b_donesem;	/* V'd by each thread at the end */
+
+	struct semaphore *b_sem;
+	struct lock *b_lock;
+	struct cv *b_cv;		/* broadcast to the waiters */
+	struct cv *b_ackcv;		/* signalled by the last to answer */
+	volatile unsigned b_gen;	/* broadcasts so far */
+	volatile unsigned b_acks;	/* answers to the latest one */
+	struct spinlock b_spin;
+	volatile unsigned long b_spincount;
+	struct bench_pair b_pairs[BENCH_MAXTHREADS / 2];
+
+	uint32_t *b_samples;		/* BENCH_SAMPLES for each thread */
+	unsigned b_nsamples[BENCH_MAXTHREADS];
+};
+
+static
+uint64_t
+bench_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * One operation of the benchmark, by thread NUM. SEEN is the thread's
+ * own count of broadcasts it has answered.
+ */
+static
+void
+bench_op(struct bench *b, unsigned long num, unsigned *seen)
+{
+	struct bench_pair *bp;
+	unsigned me;
+
+	switch (b->b_kind) {
+	    case BENCH_SEM:
+		P(b->b_sem);
+		V(b->b_sem);
+		break;
+	    case BENCH_LOCK:
+		lock_acquire(b->b_lock);
+		lock_release(b->b_lock);
+		break;
+	    case BENCH_CV:
+		bp = &b->b_pairs[num / 2];
+		me = num % 2;
+		lock_acquire(bp->bp_lock);
+		while (bp->bp_turn != me) {
+			cv_wait(bp->bp_cv, bp->bp_lock);
+		}
+		bp->bp_turn = !me;
+		cv_signal(bp->bp_cv, bp->bp_lock);
+		lock_release(bp->bp_lock);
+		break;
+	    case BENCH_BCAST:
+		lock_acquire(b->b_lock);
+		if (num == 0) {
+			/* Everyone has answered the last one, so this is safe */
+			b->b_acks = 0;
+			b->b_gen++;
+			cv_broadcast(b->b_cv, b->b_lock);
+			while (b->b_acks < b->b_threads - 1) {
+				cv_wait(b->b_ackcv, b->b_lock);
+			}
+		}
+		else {
+			while (b->b_gen == *seen) {
+				cv_wait(b->b_cv, b->b_lock);
+			}
+			(*seen)++;
+			b->b_acks++;
+			if (b->b_acks == b->b_threads - 1) {
+				cv_signal(b->b_ackcv, b->b_lock);
+			}
+		}
+		lock_release(b->b_lock);
+		break;
+	    case BENCH_SPIN:
+		spinlock_acquire(&b->b_spin);
+		b->b_spincount++;
+		spinlock_release(&b->b_spin);
+		break;
+	    default:
+		panic("bench_op: bad kind %d\n", b->b_kind);
+	}
+}
+
+static
+void
+bench_thread(void *vb, unsigned long num)
+{
+	struct bench *b = vb;
+	uint32_t *samples = b->b_samples + num * BENCH_SAMPLES;
+	unsigned i, n = 0, seen = 0;
+	uint64_t start;
+
+	P(b->b_startsem);
+	for (i=0; i<b->b_iters; i++) {
+		if (i % b->b_stride == 0 && n < BENCH_SAMPLES) {
+			start = bench_now();
+			bench_op(b, num, &seen);
+			samples[n++] = bench_now() - start;
+		}
+		else {
+			bench_op(b, num, &seen);
+		}
+	}
+	b->b_nsamples[num] = n;
+	V(b->b_donesem);
+}
+
+/*
+ * Shell sort; there are at most a few thousand samples.
+ */
+static
+void
+bench_sort(uint32_t *v, unsigned n)
+{
+	unsigned gap, i, j;
+	uint32_t x;
+
+	for (gap = n/2; gap > 0; gap /= 2) {
+		for (i=gap; i<n; i++) {
+			x = v[i];
+			for (j=i; j>=gap && v[j-gap] > x; j -= gap) {
+				v[j] = v[j-gap];
+			}
+			v[j] = x;
+		}
+	}
+}
+
+/*
+ * Gather the samples into one sorted run at the front of b_samples.
+ * For bcast only thread 0's operations are whole round trips.
+ */
+static
+unsigned
+bench_gather(struct bench *b)
+{
+	unsigned t, i, n = 0, nthreads;
+
+	nthreads = b->b_kind == BENCH_BCAST ? 1 : b->b_threads;
+	for (t=0; t<nthreads; t++) {
+		for (i=0; i<b->b_nsamples[t]; i++) {
+			b->b_samples[n++] = b->b_samples[t * BENCH_SAMPLES + i];
+		}
+	}
+	bench_sort(b->b_samples, n);
+	return n;
+}
+
+static
+void
+bench_cleanup(struct bench *b)
+{
+	unsigned i;
+
+	for (i=0; i<BENCH_MAXTHREADS / 2; i++) {
+		if (b->b_pairs[i].bp_cv != NULL) {
+			cv_destroy(b->b_pairs[i].bp_cv);
+		}
+		if (b->b_pairs[i].bp_lock != NULL) {
+			lock_destroy(b->b_pairs[i].bp_lock);
+		}
+	}
+	if (b->b_ackcv != NULL) {
+		cv_destroy(b->b_ackcv);
+	}
+	if (b->b_cv != NULL) {
+		cv_destroy(b->b_cv);
+	}
+	if (b->b_lock != NULL) {
+		lock_destroy(b->b_lock);
+	}
+	if (b->b_sem != NULL) {
+		sem_destroy(b->b_sem);
+	}
+	if (b->b_donesem != NULL) {
+		sem_destroy(b->b_donesem);
+	}
+	if (b->b_startsem != NULL) {
+		sem_destroy(b->b_startsem);
+	}
+	spinlock_cleanup(&b->b_spin);
+	kfree(b->b_samples);
+	kfree(b);
+}
+
+static
+struct bench *
+bench_create(enum bench_kind kind, unsigned nthreads, unsigned iters)
+{
+	struct bench *b;
+	unsigned i;
+	bool ok;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	bzero(b, sizeof(*b));
+	b->b_kind = kind;
+	b->b_threads = nthreads;
+	b->b_iters = iters;
+	b->b_stride = (iters + BENCH_SAMPLES - 1) / BENCH_SAMPLES;
+	spinlock_init(&b->b_spin);
+
+	b->b_samples = kmalloc(nthreads * BENCH_SAMPLES * sizeof(uint32_t));
+	b->b_startsem = sem_create("bench_start", 0);
+	b->b_donesem = sem_create("bench_done", 0);
+	b->b_sem = sem_create("bench_sem", 1);
+	b->b_lock = lock_create("bench_lock");
+	b->b_cv = cv_create("bench_cv");
+	b->b_ackcv = cv_create("bench_ackcv");
+	ok = b->b_samples != NULL && b->b_startsem != NULL &&
+		b->b_donesem != NULL && b->b_sem != NULL &&
+		b->b_lock != NULL && b->b_cv != NULL && b->b_ackcv != NULL;
+	if (kind == BENCH_CV) {
+		for (i=0; ok && i<nthreads/2; i++) {
+			b->b_pairs[i].bp_lock = lock_create("bench_pairlock");
+			b->b_pairs[i].bp_cv = cv_create("bench_paircv");
+			ok = b->b_pairs[i].bp_lock != NULL &&
+				b->b_pairs[i].bp_cv != NULL;
+		}
+	}
+	if (!ok) {
+		bench_cleanup(b);
+		return NULL;
+	}
+	return b;
+}
+
+static
+int
+bench_run(enum bench_kind kind, unsigned nthreads, unsigned ncpus,
+	  unsigned iters)
+{
+	struct bench *b;
+	uint64_t start, elapsed, ops;
+	unsigned i, n;
+	int result;
+
+	if (kind == BENCH_CV && nthreads % 2 != 0) {
+		kprintf("bench cv: needs an even number of threads\n");
+		return EINVAL;
+	}
+	if (kind == BENCH_BCAST && nthreads < 2) {
+		kprintf("bench bcast: needs at least two threads\n");
+		return EINVAL;
+	}
+
+	b = bench_create(kind, nthreads, iters);
+	if (b == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork_pinned("bench", NULL,
+					    CPUMASK_CPU(i % ncpus),
+					    bench_thread, b, i);
+		if (result) {
+			panic("bench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* Let them all go at once, and time until the last is done */
+	start = bench_now();
+	for (i=0; i<nthreads; i++) {
+		V(b->b_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(b->b_donesem);
+	}
+	elapsed = bench_now() - start;
+
+	switch (kind) {
+	    case BENCH_CV:
+		ops = (uint64_t)(nthreads / 2) * iters;
+		break;
+	    case BENCH_BCAST:
+		ops = iters;
+		break;
+	    default:
+		ops = (uint64_t)nthreads * iters;
+		break;
+	}
+
+	n = bench_gather(b);
+	kprintf("%-5s %2u threads on %2u cpus: %8llu ops/sec", bench_names[kind],
+		nthreads, ncpus,
+		elapsed ? (unsigned long long)(ops * 1000000000 / elapsed) : 0);
+	if (n > 0) {
+		kprintf(", ns p50 %u p90 %u p99 %u max %u",
+			b->b_samples[n / 2], b->b_samples[n * 9 / 10],
+			b->b_samples[n * 99 / 100], b->b_samples[n - 1]);
+	}
+	kprintf("\n");
+
+	bench_cleanup(b);
+	return 0;
+}
+
+int
+synchbench(int nargs, char **args)
+{
+	unsigned nthreads = BENCH_THREADS;
+	unsigned ncpus = cpu_count();
+	unsigned iters = BENCH_ITERS;
+	unsigned i, fewest;
+	int kind, result;
+
+	if (nargs < 2 || nargs > 5) {
+		goto usage;
+	}
+	if (nargs > 2) {
+		nthreads = atoi(args[2]);
+	}
+	if (nargs > 3) {
+		ncpus = atoi(args[3]);
+	}
+	if (nargs > 4) {
+		iters = atoi(args[4]);
+	}
+	if (nthreads < 1 || nthreads > BENCH_MAXTHREADS ||
+	    ncpus < 1 || ncpus > cpu_count() || iters < 1) {
+		kprintf("bench: 1-%u threads, 1-%u cpus, and at least "
+			"one iteration\n", BENCH_MAXTHREADS, cpu_count());
+		return EINVAL;
+	}
+
+	if (!strcmp(args[1], "all")) {
+		for (i=0; i<BENCH_NKINDS; i++) {
+			fewest = (i == BENCH_CV || i == BENCH_BCAST) ? 2 : 1;
+			result = bench_run(i, fewest, ncpus, iters);
+			if (result) {
+				return result;
+			}
+			if (nthreads > fewest) {
+				result = bench_run(i, nthreads, ncpus, iters);
+				if (result) {
+					return result;
+				}
+			}
+		}
+		return 0;
+	}
+
+	for (kind=0; kind<BENCH_NKINDS; kind++) {
+		if (!strcmp(args[1], bench_names[kind])) {
+			return bench_run(kind, nthreads, ncpus, iters);
+		}
+	}
+
+ usage:
+	kprintf("Usage: bench sem|lock|cv|bcast|spin|all "
+		"[threads [cpus [iterations]]]\n");
+	return EINVAL;
+}
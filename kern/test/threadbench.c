@@ -0,0 +1,417 @@
+/*
+ * Thread microbenchmarks.
+ *
+ *    tbench fork|yield|wake|all [iterations]
+ *
+ *    fork   thread_fork a thread that V's a semaphore and exits, and P
+ *           it: with the child on this cpu, so its exit is in the
+ *           time, and then on another cpu, where the exit overlaps
+ *           the next fork
+ *    yield  two threads on one cpu handing it back and forth with
+ *           thread_yield; then two on every cpu at once, which should
+ *           cost the same per cpu if the run queues don't interfere
+ *    wake   a round trip between two threads, each waking the other
+ *           with wchan_wakeone and then going to sleep in wchan_sleep:
+ *           both on one cpu, on two cpus, and then unpinned, so the
+ *           scheduler may place and move them as it likes
+ *
+ * Everything here runs pinned to cpu 0 unless it says otherwise. The
+ * result is the time per operation, over the whole run; for wake also
+ * percentiles of the handoff latency, from just before wchan_wakeone
+ * to the woken thread running, and, unpinned, how often the two
+ * changed cpus.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <kclock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <wchan.h>
+#include <synch.h>
+#include <test.h>
+
+#define TB_ITERS    2000	/* default operations */
+#define TB_SAMPLES   256	/* handoff latencies timed per thread */
+
+struct tbench {
+	unsigned tb_iters;
+	struct semaphore *tb_startsem;	/* V'd once per thread to start */
+	struct semaphore *tb_donesem;	/* V'd by each thread at the end */
+
+	/* for wake */
+	struct wchan *tb_wc[2];		/* each thread sleeps on its own */
+	volatile unsigned tb_turn;	/* set under the wchan lock of... */
+	volatile uint64_t tb_stamp;	/* ...the one whose turn it is */
+	unsigned tb_moves[2];		/* cpu changes seen by each */
+	uint32_t tb_samples[2 * TB_SAMPLES];
+	unsigned tb_nsamples[2];
+};
+
+static
+uint64_t
+tb_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+tb_sort(uint32_t *v, unsigned n)
+{
+	unsigned gap, i, j;
+	uint32_t x;
+
+	for (gap = n/2; gap > 0; gap /= 2) {
+		for (i=gap; i<n; i++) {
+			x = v[i];
+			for (j=i; j>=gap && v[j-gap] > x; j -= gap) {
+				v[j] = v[j-gap];
+			}
+			v[j] = x;
+		}
+	}
+}
+
+static
+void
+tb_report(const char *what, uint64_t elapsed, uint64_t ops)
+{
+	kprintf("%-24s %8llu ns/op", what, ops ? elapsed / ops : 0);
+}
+
+static
+void
+tb_destroy(struct tbench *tb)
+{
+	if (tb->tb_wc[1] != NULL) {
+		wchan_destroy(tb->tb_wc[1]);
+	}
+	if (tb->tb_wc[0] != NULL) {
+		wchan_destroy(tb->tb_wc[0]);
+	}
+	if (tb->tb_donesem != NULL) {
+		sem_destroy(tb->tb_donesem);
+	}
+	if (tb->tb_startsem != NULL) {
+		sem_destroy(tb->tb_startsem);
+	}
+	kfree(tb);
+}
+
+static
+struct tbench *
+tb_create(unsigned iters)
+{
+	struct tbench *tb;
+
+	tb = kmalloc(sizeof(*tb));
+	if (tb == NULL) {
+		return NULL;
+	}
+	bzero(tb, sizeof(*tb));
+	tb->tb_iters = iters;
+	tb->tb_startsem = sem_create("tbench_start", 0);
+	tb->tb_donesem = sem_create("tbench_done", 0);
+	tb->tb_wc[0] = wchan_create("tbench0");
+	tb->tb_wc[1] = wchan_create("tbench1");
+	if (tb->tb_startsem == NULL || tb->tb_donesem == NULL ||
+	    tb->tb_wc[0] == NULL || tb->tb_wc[1] == NULL) {
+		tb_destroy(tb);
+		return NULL;
+	}
+	return tb;
+}
+
+/*
+ * Start NTHREADS threads running FUNC, thread I on the cpus in
+ * MASKS[I % NMASKS], let them all go at once, and return how long it
+ * was until the last one finished.
+ */
+static
+uint64_t
+tb_runthreads(struct tbench *tb, unsigned nthreads, const cpumask_t *masks,
+	      unsigned nmasks, void (*func)(void *, unsigned long))
+{
+	uint64_t start;
+	unsigned i;
+	int result;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork_pinned("tbench", NULL, masks[i % nmasks],
+					    func, tb, i);
+		if (result) {
+			panic("tbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	start = tb_now();
+	for (i=0; i<nthreads; i++) {
+		V(tb->tb_startsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(tb->tb_donesem);
+	}
+	return tb_now() - start;
+}
+
+////////////////////////////////////////////////////////////
+// fork
+
+static
+void
+tb_forkchild(void *vtb, unsigned long junk)
+{
+	struct tbench *tb = vtb;
+
+	(void)junk;
+	V(tb->tb_donesem);
+}
+
+static
+void
+tb_fork(struct tbench *tb, unsigned cpu, const char *what)
+{
+	uint64_t start;
+	unsigned i;
+	int result;
+
+	start = tb_now();
+	for (i=0; i<tb->tb_iters; i++) {
+		result = thread_fork_pinned("tbench-child", NULL,
+					    CPUMASK_CPU(cpu), tb_forkchild,
+					    tb, 0);
+		if (result) {
+			panic("tbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+		P(tb->tb_donesem);
+	}
+	tb_report(what, tb_now() - start, tb->tb_iters);
+	kprintf("\n");
+}
+
+static
+void
+tb_forkall(struct tbench *tb)
+{
+	tb_fork(tb, 0, "fork+exit, same cpu");
+	if (cpu_count() > 1) {
+		tb_fork(tb, 1, "fork, other cpu");
+	}
+}
+
+////////////////////////////////////////////////////////////
+// yield
+
+static
+void
+tb_yieldthread(void *vtb, unsigned long num)
+{
+	struct tbench *tb = vtb;
+	unsigned i;
+
+	(void)num;
+	P(tb->tb_startsem);
+	for (i=0; i<tb->tb_iters; i++) {
+		thread_yield();
+	}
+	V(tb->tb_donesem);
+}
+
+static
+void
+tb_yieldall(struct tbench *tb)
+{
+	cpumask_t masks[32];
+	unsigned i, ncpus;
+	uint64_t elapsed;
+
+	masks[0] = CPUMASK_CPU(0);
+	elapsed = tb_runthreads(tb, 2, masks, 1, tb_yieldthread);
+	tb_report("yield, one cpu", elapsed, 2 * tb->tb_iters);
+	kprintf("\n");
+
+	ncpus = cpu_count();
+	if (ncpus < 2) {
+		return;
+	}
+	if (ncpus > 32) {
+		ncpus = 32;
+	}
+	for (i=0; i<ncpus; i++) {
+		masks[i] = CPUMASK_CPU(i);
+	}
+	/* Each cpu does its own 2 * iters yields in the time */
+	elapsed = tb_runthreads(tb, 2 * ncpus, masks, ncpus, tb_yieldthread);
+	tb_report("yield, every cpu", elapsed, 2 * tb->tb_iters);
+	kprintf(" per cpu, %u cpus\n", ncpus);
+}
+
+////////////////////////////////////////////////////////////
+// wake
+
+/*
+ * Wait for our turn, with our wchan's lock held to check it, then give
+ * the turn to the other thread under its wchan's lock and wake it. The
+ * turn only changes under the lock of the thread it goes to, so that
+ * one can't miss it between checking and sleeping.
+ */
+static
+void
+tb_wakethread(void *vtb, unsigned long me)
+{
+	struct tbench *tb = vtb;
+	struct wchan *mine = tb->tb_wc[me], *theirs = tb->tb_wc[!me];
+	unsigned stride, i, n = 0;
+	struct cpu *lastcpu;
+	uint64_t now;
+
+	stride = (tb->tb_iters + TB_SAMPLES - 1) / TB_SAMPLES;
+	P(tb->tb_startsem);
+	lastcpu = curcpu;
+	for (i=0; i<tb->tb_iters; i++) {
+		wchan_lock(mine);
+		while (tb->tb_turn != me) {
+			wchan_sleep(mine);
+			wchan_lock(mine);
+		}
+		wchan_unlock(mine);
+
+		now = kclock_ns();
+		if (i % stride == 0 && n < TB_SAMPLES && tb->tb_stamp != 0 &&
+		    now > tb->tb_stamp) {
+			tb->tb_samples[me * TB_SAMPLES + n++] =
+				now - tb->tb_stamp;
+		}
+		if (curcpu != lastcpu) {
+			tb->tb_moves[me]++;
+			lastcpu = curcpu;
+		}
+
+		wchan_lock(theirs);
+		tb->tb_turn = !me;
+		tb->tb_stamp = kclock_ns();
+		wchan_unlock(theirs);
+		wchan_wakeone(theirs);
+	}
+	tb->tb_nsamples[me] = n;
+	V(tb->tb_donesem);
+}
+
+static
+void
+tb_wake(struct tbench *tb, cpumask_t m0, cpumask_t m1, const char *what)
+{
+	cpumask_t masks[2];
+	uint64_t elapsed;
+	unsigned i, n;
+
+	masks[0] = m0;
+	masks[1] = m1;
+	tb->tb_turn = 0;
+	tb->tb_stamp = 0;
+	tb->tb_moves[0] = tb->tb_moves[1] = 0;
+	elapsed = tb_runthreads(tb, 2, masks, 2, tb_wakethread);
+
+	/* Gather both threads' samples at the front */
+	n = tb->tb_nsamples[0];
+	for (i=0; i<tb->tb_nsamples[1]; i++) {
+		tb->tb_samples[n++] = tb->tb_samples[TB_SAMPLES + i];
+	}
+	tb_sort(tb->tb_samples, n);
+
+	/* Each turn is one handoff; a round trip is two */
+	tb_report(what, elapsed, tb->tb_iters);
+	if (n > 0) {
+		kprintf(", handoff ns p50 %u p99 %u max %u",
+			tb->tb_samples[n / 2], tb->tb_samples[n * 99 / 100],
+			tb->tb_samples[n - 1]);
+	}
+	if (m0 == CPUMASK_ALL) {
+		kprintf(", %u moves", tb->tb_moves[0] + tb->tb_moves[1]);
+	}
+	kprintf("\n");
+}
+
+static
+void
+tb_wakeall(struct tbench *tb)
+{
+	tb_wake(tb, CPUMASK_CPU(0), CPUMASK_CPU(0), "wake, same cpu");
+	if (cpu_count() > 1) {
+		tb_wake(tb, CPUMASK_CPU(0), CPUMASK_CPU(1), "wake, two cpus");
+		tb_wake(tb, CPUMASK_ALL, CPUMASK_ALL, "wake, unpinned");
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static const struct {
+	const char *name;
+	void (*func)(struct tbench *tb);
+} tb_kinds[] = {
+	{ "fork",  tb_forkall },
+	{ "yield", tb_yieldall },
+	{ "wake",  tb_wakeall },
+};
+#define TB_NKINDS (sizeof(tb_kinds) / sizeof(tb_kinds[0]))
+
+int
+threadbench(int nargs, char **args)
+{
+	struct tbench *tb;
+	unsigned iters = TB_ITERS;
+	unsigned i, kind;
+	cpumask_t oldmask;
+
+	if (nargs < 2 || nargs > 3) {
+		goto usage;
+	}
+	if (nargs > 2) {
+		iters = atoi(args[2]);
+	}
+	if (iters < 1) {
+		kprintf("tbench: at least one iteration\n");
+		return EINVAL;
+	}
+	if (!strcmp(args[1], "all")) {
+		kind = TB_NKINDS;
+	}
+	else {
+		for (kind=0; kind<TB_NKINDS; kind++) {
+			if (!strcmp(args[1], tb_kinds[kind].name)) {
+				break;
+			}
+		}
+		if (kind == TB_NKINDS) {
+			goto usage;
+		}
+	}
+
+	tb = tb_create(iters);
+	if (tb == NULL) {
+		return ENOMEM;
+	}
+	oldmask = thread_getaffinity();
+	thread_setaffinity(CPUMASK_CPU(0));
+	for (i=0; i<TB_NKINDS; i++) {
+		if (kind == TB_NKINDS || kind == i) {
+			tb_kinds[i].func(tb);
+		}
+	}
+	thread_setaffinity(oldmask);
+	tb_destroy(tb);
+	return 0;
+
+ usage:
+	kprintf("Usage: tbench fork|yield|wake|all [iterations]\n");
+	return EINVAL;
+}
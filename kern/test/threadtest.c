@@ -38,16 +38,17 @@
 
 #define NTHREADS  8
 
-static struct semaphore *tsem = NULL;
+/* The test threads and the one running them all meet here */
+static struct barrier *tbarrier = NULL;
 
 static
 void
-init_sem(void)
+init_barrier(void)
 {
-	if (tsem==NULL) {
-		tsem = sem_create("tsem", 0);
-		if (tsem == NULL) {
-			panic("threadtest: sem_create failed\n");
+	if (tbarrier==NULL) {
+		tbarrier = barrier_create("tbarrier", NTHREADS + 1);
+		if (tbarrier == NULL) {
+			panic("threadtest: barrier_create failed\n");
 		}
 	}
 }
@@ -64,7 +65,7 @@ loudthread(void *junk, unsigned long num)
 	for (i=0; i<120; i++) {
 		putch(ch);
 	}
-	V(tsem);
+	barrier_wait(tbarrier);
 }
 
 /*
@@ -90,7 +91,7 @@ quietthread(void *junk, unsigned long num)
 	for (i=0; i<200000; i++);
 	putch(ch);
 
-	V(tsem);
+	barrier_wait(tbarrier);
 }
 
 static
@@ -111,9 +112,7 @@ runthreads(int doloud)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(tsem);
-	}
+	barrier_wait(tbarrier);
 }
 
 
@@ -123,7 +122,7 @@ threadtest(int nargs, char **args)
 	(void)nargs;
 	(void)args;
 
-	init_sem();
+	init_barrier();
 	kprintf("Starting thread test...\n");
 	runthreads(1);
 	kprintf("\nThread test done.\n");
@@ -137,7 +136,7 @@ threadtest2(int nargs, char **args)
 	(void)nargs;
 	(void)args;
 
-	init_sem();
+	init_barrier();
 	kprintf("Starting thread test 2...\n");
 	runthreads(0);
 	kprintf("\nThread test 2 done.\n");
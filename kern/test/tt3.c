@@ -60,23 +60,28 @@ static struct wchan *waitchans[NWAITCHANS];  /* N distinct wait channels */
 
 static volatile int wakerdone;
 static struct semaphore *wakersem;
-static struct semaphore *donesem;
+static struct barrier *donebarrier;	/* the test threads, and us */
+static struct completion *wakerexit;
 
 static
 void
-setup(void)
+setup(int nthreads)
 {
 	char tmp[16];
 	int i;
 
 	if (wakersem == NULL) {
 		wakersem = sem_create("wakersem", 1);
-		donesem = sem_create("donesem", 0);
 		for (i=0; i<NWAITCHANS; i++) {
 			snprintf(tmp, sizeof(tmp), "wc%d", i);
 			waitchans[i] = wchan_create(kstrdup(tmp));
 		}
 	}
+	donebarrier = barrier_create("donebarrier", nthreads + 1);
+	wakerexit = completion_create("wakerexit");
+	if (donebarrier == NULL || wakerexit == NULL) {
+		panic("tt3: out of memory\n");
+	}
 	wakerdone = 0;
 }
 
@@ -98,7 +103,7 @@ sleepalot_thread(void *junk, unsigned long num)
 		}
 		kprintf("[%lu]", num);
 	}
-	V(donesem);
+	barrier_wait(donebarrier);
 }
 
 static
@@ -127,7 +132,7 @@ waker_thread(void *junk1, unsigned long junk2)
 			thread_yield();
 		}
 	}
-	V(donesem);
+	complete(wakerexit);
 }
 
 static
@@ -204,7 +209,7 @@ compute_thread(void *junk1, unsigned long num)
 	kfree(m2);
 	kfree(m3);
 
-	V(donesem);
+	barrier_wait(donebarrier);
 }
 
 static
@@ -225,29 +230,29 @@ make_computes(int howmany)
 
 static
 void
-finish(int howmanytotal)
+finish(void)
 {
-	int i;
-	for (i=0; i<howmanytotal; i++) {
-		P(donesem);
-	}
+	barrier_wait(donebarrier);
 	P(wakersem);
 	wakerdone = 1;
 	V(wakersem);
-	P(donesem);
+	completion_wait(wakerexit);
+
+	barrier_destroy(donebarrier);
+	completion_destroy(wakerexit);
 }
 
 static
 void
 runtest3(int nsleeps, int ncomputes)
 {
-	setup();
+	setup(nsleeps+ncomputes);
 	kprintf("Starting thread test 3 (%d [sleepalots], %d {computes}, "
 		"1 waker)\n",
 		nsleeps, ncomputes);
 	make_sleepalots(nsleeps);
 	make_computes(ncomputes);
-	finish(nsleeps+ncomputes);
+	finish();
 	kprintf("\nThread test 3 done\n");
 }
 
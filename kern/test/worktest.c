@@ -0,0 +1,137 @@
+/*
+ * Tests for software interrupts and work queues.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <synch.h>
+#include <softint.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define NWORK 16
+
+static struct semaphore *worksem;
+static struct semaphore *workstart, *workgate;
+static volatile unsigned workcount;
+static volatile bool workbusy;
+
+static
+void
+worktest_softint(void *junk)
+{
+	(void)junk;
+
+	workcount++;
+	V(worksem);
+}
+
+static
+void
+worktest_count(void *junk)
+{
+	int spl;
+
+	(void)junk;
+
+	/* The work threads may be on any cpu */
+	spl = splhigh();
+	workcount++;
+	splx(spl);
+	V(worksem);
+}
+
+static
+void
+worktest_slow(void *junk)
+{
+	(void)junk;
+
+	KASSERT(!workbusy);
+	workbusy = true;
+	V(workstart);
+	P(workgate);
+	workbusy = false;
+	workcount++;
+	V(worksem);
+}
+
+int
+worktest(int nargs, char **args)
+{
+	struct softint si;
+	struct work w[NWORK];
+	unsigned i;
+	int spl;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting softint and work queue test...\n");
+
+	worksem = sem_create("worksem", 0);
+	workstart = sem_create("workstart", 0);
+	workgate = sem_create("workgate", 0);
+	if (worksem == NULL || workstart == NULL || workgate == NULL) {
+		panic("worktest: sem_create failed\n");
+	}
+
+	/* Scheduled twice before it can run: runs once */
+	workcount = 0;
+	softint_init(&si, worktest_softint, NULL);
+	spl = splhigh();
+	softint_schedule(&si);
+	softint_schedule(&si);
+	splx(spl);
+	P(worksem);
+	clocksleep_ticks(2);
+	KASSERT(workcount == 1);
+
+	/* Lots of separate items all run */
+	workcount = 0;
+	for (i=0; i<NWORK; i++) {
+		work_init(&w[i], worktest_count, NULL);
+		KASSERT(work_enqueue(kworkq, &w[i]));
+	}
+	for (i=0; i<NWORK; i++) {
+		P(worksem);
+	}
+	KASSERT(workcount == NWORK);
+
+	/*
+	 * Queueing one that's waiting does nothing; queueing one that's
+	 * running runs it again afterwards, not alongside.
+	 */
+	workcount = 0;
+	workbusy = false;
+	work_init(&w[0], worktest_slow, NULL);
+	spl = splhigh();
+	KASSERT(work_enqueue(kworkq, &w[0]));
+	KASSERT(!work_enqueue(kworkq, &w[0]));
+	splx(spl);
+	P(workstart);
+	KASSERT(work_enqueue(kworkq, &w[0]));
+	V(workgate);
+	P(worksem);
+	P(workstart);
+	V(workgate);
+	P(worksem);
+	KASSERT(workcount == 2);
+
+	/* Delayed */
+	workcount = 0;
+	work_init(&w[0], worktest_count, NULL);
+	work_enqueue_delayed(kworkq, &w[0], 5);
+	P(worksem);
+	KASSERT(workcount == 1);
+
+	/* Let the threads finish with the items on our stack */
+	clocksleep_ticks(2);
+	sem_destroy(worksem);
+	sem_destroy(workstart);
+	sem_destroy(workgate);
+	kprintf("Softint and work queue test complete\n");
+	return 0;
+}
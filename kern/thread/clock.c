@@ -28,19 +28,28 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/timepage.h>
 #include <lib.h>
+#include <spinlock.h>
+#include <seqlock.h>
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <poll.h>
+#include <vm.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Besides the once-a-second timerclock, callbacks can be scheduled a
+ * given number of hardclocks ahead with timeouts. These are kept on a
+ * hierarchical timer wheel turned by cpu 0's hardclock: cpu 0 never
+ * goes tickless, so the wheel keeps HZ resolution even when every
+ * other cpu is idle.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,14 +59,62 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	1	/* schedule() accounts every tick. */
+
+/*
+ * Number of hardclocks between preemptions (calls to thread_yield).
+ * Longer slices trade interactive latency for fewer context switches.
+ */
+static unsigned hardclock_quantum = HARDCLOCK_QUANTUM_DEFAULT;
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 
+/*
+ * Where clocksleep_ticks sleepers wait for their timeouts.
+ */
+static struct wchan *tsleep;
+
+/*
+ * The timer wheel. Level 0 has a slot for each of the next
+ * TW_ROOTSIZE ticks; each slot of level N > 0 covers as many ticks
+ * as all of level N-1, and when level N-1 comes round to its first
+ * slot again, the next slot of level N is emptied into the levels
+ * below. So adding and cancelling are O(1) and each timeout is only
+ * moved a few times however far off it is.
+ *
+ * timeout_base is the next tick to be processed. timeout_running is
+ * the timeout whose function is being called, for timeout_cancel.
+ * Everything is protected by timeout_lock.
+ */
+#define TW_ROOTBITS	8
+#define TW_ROOTSIZE	(1 << TW_ROOTBITS)
+#define TW_LEVELBITS	6
+#define TW_LEVELSIZE	(1 << TW_LEVELBITS)
+#define TW_LEVELS	3	/* above the root */
+
+/* Ticks covered by the root and the first N upper levels */
+#define TW_SPAN(n)	(1U << (TW_ROOTBITS + (n) * TW_LEVELBITS))
+
+static struct timeout *tw_root[TW_ROOTSIZE];
+static struct timeout *tw_levels[TW_LEVELS][TW_LEVELSIZE];
+static unsigned timeout_base;
+static struct timeout *volatile timeout_running;
+static struct spinlock timeout_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * The time page (see <kern/timepage.h>). Every process can see all of
+ * its page, so it has one to itself. Only cpu 0 writes it, once
+ * timepage_start says the clock is there to read.
+ */
+static union {
+	struct timepage tp;
+	char tp_pad[PAGE_SIZE];
+} timepage __attribute__((__aligned__(PAGE_SIZE)));
+static bool timepage_running;
+
 /*
  * Setup.
  */
@@ -68,6 +125,247 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	tsleep = wchan_create("tsleep");
+	if (tsleep == NULL) {
+		panic("Couldn't create tsleep\n");
+	}
+}
+
+/*
+ * Put TO on the front of the list at *HEAD.
+ */
+static
+void
+timeout_link(struct timeout **head, struct timeout *to)
+{
+	to->to_next = *head;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	to->to_prevp = head;
+	*head = to;
+}
+
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+}
+
+/*
+ * Move the whole list at *HEAD to *LIST, leaving *HEAD empty.
+ */
+static
+void
+timeout_splice(struct timeout **head, struct timeout **list)
+{
+	*list = *head;
+	*head = NULL;
+	if (*list != NULL) {
+		(*list)->to_prevp = list;
+	}
+}
+
+/*
+ * File TO in the wheel slot for its expiry tick. Caller holds
+ * timeout_lock.
+ */
+static
+void
+timeout_insert(struct timeout *to)
+{
+	unsigned delta, expire;
+	unsigned level;
+
+	expire = to->to_expire;
+	delta = expire - timeout_base;
+
+	if ((int)delta < 0) {
+		/* Already due (added while its tick was being run) */
+		timeout_link(&tw_root[timeout_base % TW_ROOTSIZE], to);
+		return;
+	}
+	if (delta < TW_ROOTSIZE) {
+		timeout_link(&tw_root[expire % TW_ROOTSIZE], to);
+		return;
+	}
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < TW_SPAN(level + 1)) {
+			break;
+		}
+	}
+	if (delta >= TW_SPAN(TW_LEVELS)) {
+		/*
+		 * Farther off than the wheel reaches: park it in the
+		 * last slot of the top level, and look again when that
+		 * comes round.
+		 */
+		expire = timeout_base + TW_SPAN(TW_LEVELS) - 1;
+	}
+	timeout_link(&tw_levels[level][(expire >> (TW_ROOTBITS +
+			level * TW_LEVELBITS)) % TW_LEVELSIZE], to);
+}
+
+/*
+ * Empty the current slot of upper level LEVEL back into the wheel.
+ * Returns the slot's index, which is 0 when that level has gone all
+ * the way round too.
+ */
+static
+unsigned
+timeout_cascade(unsigned level)
+{
+	struct timeout *list, *to;
+	unsigned idx;
+
+	idx = (timeout_base >> (TW_ROOTBITS + level * TW_LEVELBITS))
+		% TW_LEVELSIZE;
+	timeout_splice(&tw_levels[level][idx], &list);
+	while ((to = list) != NULL) {
+		timeout_unlink(to);
+		timeout_insert(to);
+	}
+	return idx;
+}
+
+/*
+ * Turn the wheel one tick and call whatever is due. Called on every
+ * hardclock of cpu 0.
+ */
+static
+void
+timeout_tick(void)
+{
+	struct timeout *list, *to;
+	unsigned idx, level;
+
+	spinlock_acquire(&timeout_lock);
+	idx = timeout_base % TW_ROOTSIZE;
+	if (idx == 0) {
+		for (level = 0; level < TW_LEVELS; level++) {
+			if (timeout_cascade(level) != 0) {
+				break;
+			}
+		}
+	}
+	timeout_base++;
+
+	/*
+	 * Take the slot's list first, so anything the functions add
+	 * goes in for a later turn.
+	 */
+	timeout_splice(&tw_root[idx], &list);
+	while ((to = list) != NULL) {
+		timeout_unlink(to);
+		timeout_running = to;
+		spinlock_release(&timeout_lock);
+		to->to_func(to->to_arg);
+		spinlock_acquire(&timeout_lock);
+		timeout_running = NULL;
+	}
+	spinlock_release(&timeout_lock);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_expire = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+}
+
+void
+timeout_add(struct timeout *to, unsigned ticks)
+{
+	KASSERT(ticks > 0 && ticks <= TIMEOUT_MAXTICKS);
+
+	spinlock_acquire(&timeout_lock);
+	KASSERT(to->to_prevp == NULL);
+	to->to_expire = timeout_base + ticks - 1;
+	timeout_insert(to);
+	spinlock_release(&timeout_lock);
+}
+
+bool
+timeout_cancel(struct timeout *to)
+{
+	bool pending;
+
+	spinlock_acquire(&timeout_lock);
+	while (timeout_running == to) {
+		/* Firing on cpu 0 right now; wait for it to finish. */
+		spinlock_release(&timeout_lock);
+		while (timeout_running == to) {
+			/* spin */
+		}
+		spinlock_acquire(&timeout_lock);
+	}
+	pending = to->to_prevp != NULL;
+	if (pending) {
+		timeout_unlink(to);
+	}
+	spinlock_release(&timeout_lock);
+	return pending;
+}
+
+/*
+ * Physical address of the time page, for the VM system to map.
+ */
+paddr_t
+timepage_paddr(void)
+{
+	return KVADDR_TO_PADDR((vaddr_t)&timepage);
+}
+
+void
+timepage_start(void)
+{
+	timepage_running = true;
+}
+
+/*
+ * Copy the time of day into the time page, under its sequence count.
+ * Only cpu 0 writes it, so the count needs no lock to go with it.
+ */
+static
+void
+timepage_update(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!timepage_running) {
+		return;
+	}
+	gettime(&secs, &nsecs);
+	seqcount_writebegin(&timepage.tp.tp_seq);
+	timepage.tp.tp_sec = secs;
+	timepage.tp.tp_nsec = nsecs;
+	seqcount_writeend(&timepage.tp.tp_seq);
+}
+
+/*
+ * Convert a duration to hardclocks, rounding up.
+ */
+unsigned
+ticks_from_timespec(const struct timespec *ts)
+{
+	uint64_t ticks;
+
+	ticks = (uint64_t)ts->tv_sec * HZ +
+		((uint64_t)ts->tv_nsec * HZ + 999999999) / 1000000000;
+	if (ticks > TIMEOUT_MAXTICKS) {
+		return TIMEOUT_MAXTICKS;
+	}
+	return ticks;
 }
 
 /*
@@ -77,13 +375,33 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
+	/* Broadcast on lbolt, and let poll() check its timeouts */
 	wchan_wakeall(lbolt);
+	poll_timerclock();
+}
+
+/*
+ * Get and set the preemption quantum, in hardclocks.
+ */
+unsigned
+hardclock_getquantum(void)
+{
+	return hardclock_quantum;
+}
+
+int
+hardclock_setquantum(unsigned ticks)
+{
+	if (ticks < 1 || ticks > HARDCLOCK_QUANTUM_MAX) {
+		return EINVAL;
+	}
+	hardclock_quantum = ticks;
+	return 0;
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, except on idle cpus, which only get an occasional tick.
  */
 void
 hardclock(void)
@@ -93,13 +411,40 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+
+	klog_tick();
+
+	if (curcpu->c_number == 0) {
+		timepage_update();
+		timeout_tick();
+	}
+
+	thread_loadtick();
+
+	/*
+	 * An idle cpu has nothing to charge or preempt. (cpu 0 still
+	 * has to run schedule() to keep the scheduler's clock going.)
+	 */
+	if (curcpu->c_isidle && curcpu->c_number != 0) {
+		return;
+	}
+
+	/*
+	 * Interrupt handlers don't read under RCU, so the cpu is
+	 * quiescent unless the thread we interrupted is in a read
+	 * section; if it is, it can't be preempted until it leaves.
+	 */
+	if (curthread->t_rcu_depth == 0) {
+		curcpu->c_rcu_qs++;
+	}
+
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	if ((curcpu->c_hardclocks % hardclock_quantum) == 0 &&
+	    curthread->t_rcu_depth == 0 && !curthread->t_in_softint) {
+		thread_yield();
 	}
-	thread_yield();
 }
 
 /*
@@ -114,3 +459,34 @@ clocksleep(int num_secs)
 		num_secs--;
 	}
 }
+
+static
+void
+clocksleep_wake(void *t)
+{
+	wchan_wakethread(tsleep, t);
+}
+
+/*
+ * Suspend execution for TICKS hardclocks.
+ */
+void
+clocksleep_ticks(unsigned ticks)
+{
+	struct timeout to;
+
+	if (ticks == 0) {
+		return;
+	}
+
+	/*
+	 * Lock the channel before arming the timeout, so it can't try
+	 * to wake us before we're asleep; then, once woken, make sure
+	 * the wakeup has finished with TO before it goes away.
+	 */
+	timeout_init(&to, clocksleep_wake, curthread);
+	wchan_lock(tsleep);
+	timeout_add(&to, ticks);
+	wchan_sleep(tsleep);
+	timeout_cancel(&to);
+}
@@ -0,0 +1,125 @@
+/*
+ * Per-cpu time accounting. See <cpu.h>.
+ *
+ * Each cpu has a current state (CPUTIME_*) and the time it entered
+ * it; cpu_timeswitch charges the time since then to the old state
+ * and starts the new one. Traps save the state they interrupted and
+ * put it back on the way out, and thread_switch does the same across
+ * a switch, so the states nest however threads move between cpus.
+ *
+ * User and kernel time is also charged to the thread that was running,
+ * for getrusage.
+ *
+ * The clock is the realtime clock, so nothing is charged until it is
+ * attached and cputime_start has been called.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/cputime.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+
+static bool cputime_running;
+
+static
+uint64_t
+cputime_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+void
+cputime_start(void)
+{
+	cputime_running = true;
+}
+
+unsigned
+cpu_timeswitch(unsigned state)
+{
+	struct cpu *c;
+	unsigned old;
+	uint64_t now, delta;
+	int spl;
+
+	KASSERT(state < CPUTIME_NSTATES);
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (cputime_running) {
+		now = cputime_now();
+		/* A cpu's first switch just starts its clock */
+		if (c->c_timestamp != 0) {
+			delta = now - c->c_timestamp;
+			c->c_times[c->c_timestate] += delta;
+			if (c->c_timestate == CPUTIME_USER) {
+				curthread->t_usage.tu_utime += delta;
+			}
+			else if (c->c_timestate == CPUTIME_KERNEL) {
+				curthread->t_usage.tu_stime += delta;
+			}
+		}
+		c->c_timestamp = now;
+	}
+	old = c->c_timestate;
+	c->c_timestate = state;
+	splx(spl);
+
+	return old;
+}
+
+int
+cpu_gettimes(unsigned num, struct cputimes *ct)
+{
+	struct cpu *c;
+	unsigned i;
+
+	if (num >= cpu_count()) {
+		return EINVAL;
+	}
+	c = cpu_get(num);
+
+	/*
+	 * Another cpu's counters can change under us, and the state
+	 * it's in now hasn't been charged yet, so this is approximate.
+	 */
+	for (i=0; i<CPUTIME_NSTATES; i++) {
+		ct->ct_nsecs[i] = c->c_times[i];
+	}
+	return 0;
+}
+
+void
+cpu_printtimes(void)
+{
+	static const char *const names[CPUTIME_NSTATES] = {
+		"user", "kernel", "intr", "idle",
+	};
+	struct cputimes ct;
+	uint64_t total;
+	unsigned num, i;
+
+	for (num=0; cpu_gettimes(num, &ct) == 0; num++) {
+		total = 0;
+		for (i=0; i<CPUTIME_NSTATES; i++) {
+			total += ct.ct_nsecs[i];
+		}
+		kprintf("cpu%u:", num);
+		for (i=0; i<CPUTIME_NSTATES; i++) {
+			kprintf(" %s %llu ms (%u%%)", names[i],
+				(unsigned long long)(ct.ct_nsecs[i] / 1000000),
+				total ? (unsigned)(ct.ct_nsecs[i] * 100 / total)
+				: 0);
+		}
+		kprintf("\n");
+	}
+}
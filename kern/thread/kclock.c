@@ -0,0 +1,56 @@
+/*
+ * Cycle counter clock. See kclock.h.
+ */
+
+#define KCLOCK_INLINE	/* empty */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <kclock.h>
+
+/* How long to measure each cpu's clock rate for */
+#define KCLOCK_CALIBNS  2000000
+
+/* rtclock time of cycle 0; set by the first cpu to start (cpu 0) */
+static uint64_t kclock_epoch;
+
+static
+uint64_t
+kclock_rtcns(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+void
+kclock_start(void)
+{
+	uint64_t t0, t1, c0, c1, since;
+	uint32_t hz;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	t0 = kclock_rtcns();
+	c0 = kclock_cycles();
+	do {
+		t1 = kclock_rtcns();
+		c1 = kclock_cycles();
+	} while (t1 - t0 < KCLOCK_CALIBNS);
+
+	curcpu->c_kclock_mult = ((t1 - t0) << KCLOCK_SHIFT) / (c1 - c0);
+	hz = (c1 - c0) * 1000000000 / (t1 - t0);
+
+	if (kclock_epoch == 0) {
+		kclock_epoch = t1 - kclock_tons(c1);
+		return;
+	}
+
+	/* Line this cpu's count up with the first one's */
+	since = t1 - kclock_epoch;
+	curcpu->c_cyclebase += since / 1000000000 * hz +
+		since % 1000000000 * hz / 1000000000 - c1;
+}
@@ -0,0 +1,486 @@
+/*
+ * Sampling kernel profiler. See kprof.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <proc.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <elf.h>
+#include <kprof.h>
+
+/* Distinct processes a report tells apart; the rest are lumped */
+#define KPROF_NPROCS 16
+
+/* Symbol tables are read this many entries at a time */
+#define KPROF_SYMCHUNK 32
+
+/* Name of a kprof_sym that came from a raw pc, not the symbol table */
+#define KPROF_NONAME ((uint32_t)-1)
+
+struct kprof_sample {
+	vaddr_t ks_pc;
+	pid_t ks_pid;
+	bool ks_user;
+};
+
+struct kprof_buf {
+	struct kprof_sample *kb_samples;	/* KPROF_NSAMPLES of them */
+	unsigned kb_count;		/* samples taken */
+	unsigned kb_idle;		/* ticks the cpu was idle */
+	unsigned kb_dropped;		/* ticks after the buffer filled */
+};
+
+/* A function, or a single pc, and the samples that landed in it */
+struct kprof_sym {
+	vaddr_t sym_addr;
+	uint32_t sym_size;
+	uint32_t sym_name;		/* string table index */
+	unsigned sym_count;
+};
+
+static struct kprof_buf *kprof_bufs;	/* one per cpu, once started */
+static unsigned kprof_ncpus;
+static volatile bool kprof_on;
+
+void
+kprof_sample(vaddr_t pc, bool user)
+{
+	struct kprof_buf *kb;
+	struct kprof_sample *ks;
+
+	if (!kprof_on || curcpu->c_number >= kprof_ncpus) {
+		return;
+	}
+	kb = &kprof_bufs[curcpu->c_number];
+	if (curcpu->c_isidle) {
+		kb->kb_idle++;
+		return;
+	}
+	if (kb->kb_count >= KPROF_NSAMPLES) {
+		kb->kb_dropped++;
+		return;
+	}
+	ks = &kb->kb_samples[kb->kb_count];
+	ks->ks_pc = pc;
+	ks->ks_pid = curthread->t_proc != NULL ? curthread->t_proc->p_id : 0;
+	ks->ks_user = user;
+	kb->kb_count++;
+}
+
+int
+kprof_start(void)
+{
+	struct kprof_buf *bufs;
+	unsigned i, n;
+
+	if (kprof_bufs == NULL) {
+		/* Cpus don't come and go after boot, so this is enough */
+		n = cpu_count();
+		bufs = kmalloc(n * sizeof(*bufs));
+		if (bufs == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<n; i++) {
+			bzero(&bufs[i], sizeof(bufs[i]));
+			bufs[i].kb_samples = kmalloc(KPROF_NSAMPLES *
+					     sizeof(struct kprof_sample));
+			if (bufs[i].kb_samples == NULL) {
+				while (i-- > 0) {
+					kfree(bufs[i].kb_samples);
+				}
+				kfree(bufs);
+				return ENOMEM;
+			}
+		}
+		kprof_bufs = bufs;
+		membar_store_store();
+		kprof_ncpus = n;
+	}
+	kprof_on = true;
+	return 0;
+}
+
+void
+kprof_stop(void)
+{
+	kprof_on = false;
+	membar_any_any();
+}
+
+void
+kprof_reset(void)
+{
+	unsigned i;
+
+	kprof_stop();
+	for (i=0; i<kprof_ncpus; i++) {
+		kprof_bufs[i].kb_count = 0;
+		kprof_bufs[i].kb_idle = 0;
+		kprof_bufs[i].kb_dropped = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Symbols
+
+/*
+ * Sort by address. (Shell sort; there are a few thousand symbols.)
+ */
+static
+void
+kprof_sortsyms(struct kprof_sym *syms, unsigned n)
+{
+	struct kprof_sym tmp;
+	unsigned gap, i, j;
+
+	for (gap = n/2; gap > 0; gap /= 2) {
+		for (i=gap; i<n; i++) {
+			tmp = syms[i];
+			for (j=i; j>=gap && syms[j-gap].sym_addr > tmp.sym_addr;
+			     j-=gap) {
+				syms[j] = syms[j-gap];
+			}
+			syms[j] = tmp;
+		}
+	}
+}
+
+/*
+ * Read LEN bytes at OFFSET of the kernel image; a short read means
+ * the file is bad.
+ */
+static
+int
+kprof_read(struct vnode *v, off_t offset, void *buf, size_t len)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, offset, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+	return ku.uio_resid != 0 ? ENOEXEC : 0;
+}
+
+/*
+ * Load the function symbols of the kernel image at PATH, sorted by
+ * address, and the string table their names are in.
+ */
+static
+int
+kprof_loadsyms(const char *path, struct kprof_sym **symsret,
+	       unsigned *nret, char **strsret)
+{
+	struct vnode *v;
+	Elf_Ehdr eh;
+	Elf_Shdr *sh = NULL, *symsh, *strsh;
+	Elf_Sym chunk[KPROF_SYMCHUNK];
+	struct kprof_sym *syms = NULL;
+	char *strs = NULL;
+	unsigned i, j, nchunk, nsyms, n;
+	int result;
+
+	result = vfs_open(path, O_RDONLY, 0, &v);
+	if (result) {
+		return result;
+	}
+
+	result = kprof_read(v, 0, &eh, sizeof(eh));
+	if (result) {
+		goto fail;
+	}
+	if (eh.e_ident[EI_MAG0] != ELFMAG0 ||
+	    eh.e_ident[EI_MAG1] != ELFMAG1 ||
+	    eh.e_ident[EI_MAG2] != ELFMAG2 ||
+	    eh.e_ident[EI_MAG3] != ELFMAG3 ||
+	    eh.e_shentsize != sizeof(Elf_Shdr) || eh.e_shnum == 0) {
+		result = ENOEXEC;
+		goto fail;
+	}
+
+	sh = kmalloc(eh.e_shnum * sizeof(Elf_Shdr));
+	if (sh == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = kprof_read(v, eh.e_shoff, sh, eh.e_shnum * sizeof(Elf_Shdr));
+	if (result) {
+		goto fail;
+	}
+	for (i=0; i<eh.e_shnum && sh[i].sh_type != SHT_SYMTAB; i++) {
+		/* nothing */
+	}
+	if (i == eh.e_shnum || sh[i].sh_link >= eh.e_shnum) {
+		/* stripped */
+		result = ENOEXEC;
+		goto fail;
+	}
+	symsh = &sh[i];
+	strsh = &sh[symsh->sh_link];
+
+	strs = kmalloc(strsh->sh_size + 1);
+	nsyms = symsh->sh_size / sizeof(Elf_Sym);
+	syms = kmalloc(nsyms * sizeof(struct kprof_sym));
+	if (strs == NULL || syms == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = kprof_read(v, strsh->sh_offset, strs, strsh->sh_size);
+	if (result) {
+		goto fail;
+	}
+	strs[strsh->sh_size] = 0;
+
+	n = 0;
+	for (i=0; i<nsyms; i+=nchunk) {
+		nchunk = nsyms - i < KPROF_SYMCHUNK ? nsyms - i : KPROF_SYMCHUNK;
+		result = kprof_read(v, symsh->sh_offset + i * sizeof(Elf_Sym),
+				    chunk, nchunk * sizeof(Elf_Sym));
+		if (result) {
+			goto fail;
+		}
+		for (j=0; j<nchunk; j++) {
+			if (ELF32_ST_TYPE(chunk[j].st_info) != STT_FUNC ||
+			    chunk[j].st_value == 0 ||
+			    chunk[j].st_name >= strsh->sh_size) {
+				continue;
+			}
+			syms[n].sym_addr = chunk[j].st_value;
+			syms[n].sym_size = chunk[j].st_size;
+			syms[n].sym_name = chunk[j].st_name;
+			syms[n].sym_count = 0;
+			n++;
+		}
+	}
+	vfs_close(v);
+	kfree(sh);
+
+	kprof_sortsyms(syms, n);
+	*symsret = syms;
+	*nret = n;
+	*strsret = strs;
+	return 0;
+
+ fail:
+	vfs_close(v);
+	kfree(sh);
+	kfree(syms);
+	kfree(strs);
+	return result;
+}
+
+/*
+ * Find the function PC is in, or NULL.
+ */
+static
+struct kprof_sym *
+kprof_lookup(struct kprof_sym *syms, unsigned n, vaddr_t pc)
+{
+	unsigned lo = 0, hi = n, mid;
+
+	/* Find the last symbol at or below pc */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (syms[mid].sym_addr <= pc) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (n == 0 || pc < syms[lo].sym_addr ||
+	    pc - syms[lo].sym_addr >= syms[lo].sym_size) {
+		return NULL;
+	}
+	return &syms[lo];
+}
+
+////////////////////////////////////////////////////////////
+// Report
+
+/*
+ * Make a kprof_sym for every distinct kernel pc sampled, for when
+ * there's no symbol table.
+ */
+static
+int
+kprof_rawsyms(unsigned nkernel, struct kprof_sym **symsret, unsigned *nret)
+{
+	struct kprof_sym *syms;
+	struct kprof_sample *ks;
+	unsigned c, i, n;
+
+	syms = kmalloc((nkernel > 0 ? nkernel : 1) * sizeof(*syms));
+	if (syms == NULL) {
+		return ENOMEM;
+	}
+	n = 0;
+	for (c=0; c<kprof_ncpus; c++) {
+		for (i=0; i<kprof_bufs[c].kb_count; i++) {
+			ks = &kprof_bufs[c].kb_samples[i];
+			if (ks->ks_user) {
+				continue;
+			}
+			syms[n].sym_addr = ks->ks_pc;
+			syms[n].sym_size = 1;
+			syms[n].sym_name = KPROF_NONAME;
+			syms[n].sym_count = 1;
+			n++;
+		}
+	}
+	kprof_sortsyms(syms, n);
+
+	/* Merge the duplicates */
+	for (i=c=0; i<n; i++) {
+		if (c > 0 && syms[c-1].sym_addr == syms[i].sym_addr) {
+			syms[c-1].sym_count++;
+		}
+		else {
+			syms[c++] = syms[i];
+		}
+	}
+	*symsret = syms;
+	*nret = c;
+	return 0;
+}
+
+void
+kprof_report(const char *kernel)
+{
+	struct kprof_sym *syms, *sym, *best;
+	char *strs = NULL;
+	unsigned nsyms, c, i, j, total, nkernel, idle, dropped, unknown;
+	struct kprof_sample *ks;
+	struct {
+		pid_t pid;
+		unsigned kernel, user;
+	} procs[KPROF_NPROCS + 1];	/* the extra one is everyone else */
+	unsigned nprocs = 0;
+	int result;
+
+	kprof_stop();
+	if (kprof_bufs == NULL) {
+		kprintf("kprof: never started\n");
+		return;
+	}
+
+	total = nkernel = idle = dropped = 0;
+	for (c=0; c<kprof_ncpus; c++) {
+		total += kprof_bufs[c].kb_count;
+		idle += kprof_bufs[c].kb_idle;
+		dropped += kprof_bufs[c].kb_dropped;
+		for (i=0; i<kprof_bufs[c].kb_count; i++) {
+			if (!kprof_bufs[c].kb_samples[i].ks_user) {
+				nkernel++;
+			}
+		}
+	}
+	kprintf("kprof: %u samples (%u kernel, %u user), %u idle, "
+		"%u dropped\n", total, nkernel, total - nkernel, idle, dropped);
+	if (nkernel == 0) {
+		return;
+	}
+
+	result = kprof_loadsyms(kernel, &syms, &nsyms, &strs);
+	if (result) {
+		kprintf("kprof: no symbols from %s: %s; raw pcs follow\n",
+			kernel, strerror(result));
+		result = kprof_rawsyms(nkernel, &syms, &nsyms);
+		if (result) {
+			kprintf("kprof: %s\n", strerror(result));
+			return;
+		}
+	}
+
+	/* Count the kernel samples by function, and everything by process */
+	unknown = 0;
+	for (c=0; c<kprof_ncpus; c++) {
+		for (i=0; i<kprof_bufs[c].kb_count; i++) {
+			ks = &kprof_bufs[c].kb_samples[i];
+			for (j=0; j<nprocs && procs[j].pid != ks->ks_pid; j++) {
+				/* nothing */
+			}
+			if (j == nprocs) {
+				if (nprocs == KPROF_NPROCS + 1) {
+					/* full; the last one is everyone else */
+					j = KPROF_NPROCS;
+				}
+				else {
+					procs[j].pid = ks->ks_pid;
+					procs[j].kernel = procs[j].user = 0;
+					nprocs++;
+				}
+			}
+			if (ks->ks_user) {
+				procs[j].user++;
+				continue;
+			}
+			procs[j].kernel++;
+			if (strs != NULL) {
+				sym = kprof_lookup(syms, nsyms, ks->ks_pc);
+				if (sym == NULL) {
+					unknown++;
+				}
+				else {
+					sym->sym_count++;
+				}
+			}
+		}
+	}
+
+	kprintf(" samples     %%  %s\n", strs != NULL ? "function" : "pc");
+	for (i=0; i<KPROF_TOP; i++) {
+		best = NULL;
+		for (j=0; j<nsyms; j++) {
+			if (syms[j].sym_count > 0 &&
+			    (best == NULL || syms[j].sym_count > best->sym_count)) {
+				best = &syms[j];
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		kprintf("%8u %5u  ", best->sym_count,
+			best->sym_count * 100 / nkernel);
+		if (best->sym_name == KPROF_NONAME) {
+			kprintf("0x%08lx\n", (unsigned long)best->sym_addr);
+		}
+		else {
+			kprintf("%s\n", strs + best->sym_name);
+		}
+		/* Done with it */
+		best->sym_count = 0;
+	}
+	if (unknown > 0) {
+		kprintf("%8u %5u  (not in any function)\n", unknown,
+			unknown * 100 / nkernel);
+	}
+
+	kprintf("     pid  kernel    user\n");
+	for (j=0; j<nprocs; j++) {
+		if (j == KPROF_NPROCS) {
+			kprintf("   other");
+		}
+		else if (procs[j].pid == kproc->p_id) {
+			kprintf("  kernel");
+		}
+		else {
+			kprintf("%8d", (int)procs[j].pid);
+		}
+		kprintf(" %7u %7u\n", procs[j].kernel, procs[j].user);
+	}
+
+	kfree(syms);
+	kfree(strs);
+}
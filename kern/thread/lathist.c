@@ -0,0 +1,233 @@
+/*
+ * Latency histograms. See lathist.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <kclock.h>
+#include <cpu.h>
+#include <current.h>
+#include <lathist.h>
+
+#define LAT_NAMELEN 15
+
+static const char *const lat_fixednames[LAT_NFIXED] = {
+	"fault", "bufio", "disk",
+};
+
+/* Wait channel names, claimed in order; the last slot is "other" */
+static struct spinlock lat_namelock = SPINLOCK_INITIALIZER;
+static char lat_wchannames[LAT_NWCHANS][LAT_NAMELEN+1];
+static unsigned lat_nwchannames;
+
+/* LAT_NHISTS histograms for each cpu, once started */
+static struct lathist *lat_hists;
+static unsigned lat_ncpus;
+
+uint64_t
+lat_now(void)
+{
+	if (lat_hists == NULL) {
+		return 0;
+	}
+	return kclock_ns();
+}
+
+void
+lat_start(void)
+{
+	struct lathist *hists;
+	unsigned n;
+
+	n = cpu_count();
+	hists = kmalloc(n * LAT_NHISTS * sizeof(struct lathist));
+	if (hists == NULL) {
+		kprintf("lathist: no memory; latencies won't be kept\n");
+		return;
+	}
+	bzero(hists, n * LAT_NHISTS * sizeof(struct lathist));
+	lat_ncpus = n;
+	lat_hists = hists;
+}
+
+/*
+ * The bucket for NS: below LATHIST_SUB they're one each, then
+ * LATHIST_SUB per power of two.
+ */
+static
+unsigned
+lat_bucket(uint64_t ns)
+{
+	unsigned shift;
+
+	if (ns < LATHIST_SUB) {
+		return ns;
+	}
+	for (shift = LATHIST_SUBSHIFT; shift < LATHIST_MAXSHIFT &&
+		     (ns >> (shift + 1)) != 0; shift++) {
+		/* nothing */
+	}
+	if ((ns >> (shift + 1)) != 0) {
+		return LATHIST_NBUCKETS - 1;
+	}
+	return (shift - LATHIST_SUBSHIFT + 1) * LATHIST_SUB +
+		((ns >> (shift - LATHIST_SUBSHIFT)) - LATHIST_SUB);
+}
+
+/*
+ * The top end of bucket INDEX.
+ */
+static
+uint64_t
+lat_bucketlimit(unsigned index)
+{
+	unsigned shift;
+
+	if (index < LATHIST_SUB) {
+		return index + 1;
+	}
+	shift = index / LATHIST_SUB - 1;
+	return (uint64_t)(LATHIST_SUB + index % LATHIST_SUB + 1) << shift;
+}
+
+void
+lat_record(unsigned which, uint64_t start)
+{
+	struct lathist *lh;
+	uint64_t ns;
+	int spl;
+
+	KASSERT(which < LAT_NHISTS);
+	if (start == 0) {
+		return;
+	}
+	ns = lat_now();
+	/* Started on another cpu, whose clock may be a little ahead */
+	ns = ns > start ? ns - start : 0;
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < lat_ncpus);
+	lh = &lat_hists[curcpu->c_number * LAT_NHISTS + which];
+	lh->lh_count++;
+	lh->lh_buckets[lat_bucket(ns)]++;
+	if (ns > lh->lh_max) {
+		lh->lh_max = ns;
+	}
+	splx(spl);
+}
+
+unsigned
+lat_wchanslot(const char *name)
+{
+	char shortname[LAT_NAMELEN+1];
+	unsigned i;
+
+	for (i=0; i<LAT_NAMELEN && name[i] != 0; i++) {
+		shortname[i] = name[i];
+	}
+	shortname[i] = 0;
+
+	spinlock_acquire(&lat_namelock);
+	for (i=0; i<lat_nwchannames; i++) {
+		if (!strcmp(lat_wchannames[i], shortname)) {
+			break;
+		}
+	}
+	if (i == lat_nwchannames && i < LAT_NWCHANS - 1) {
+		strcpy(lat_wchannames[i], shortname);
+		lat_nwchannames++;
+	}
+	spinlock_release(&lat_namelock);
+	/* With the table full, i is the "other" slot */
+	return LAT_NFIXED + i;
+}
+
+/*
+ * Print the microseconds under which PCT percent of the samples in
+ * merged histogram LH fell.
+ */
+static
+void
+lat_printpct(const struct lathist *lh, unsigned pct)
+{
+	unsigned i, want, seen;
+	uint64_t limit;
+
+	want = (lh->lh_count * pct + 99) / 100;
+	seen = 0;
+	for (i=0; i<LATHIST_NBUCKETS; i++) {
+		seen += lh->lh_buckets[i];
+		if (seen >= want) {
+			break;
+		}
+	}
+	limit = lat_bucketlimit(i);
+	if (limit > lh->lh_max) {
+		limit = lh->lh_max;
+	}
+	kprintf(" %10llu", (unsigned long long)(limit / 1000));
+}
+
+void
+lat_report(void)
+{
+	struct lathist sum;
+	const struct lathist *lh;
+	char label[LAT_NAMELEN+8];
+	unsigned h, c, i;
+
+	if (lat_hists == NULL) {
+		kprintf("lathist: not running\n");
+		return;
+	}
+
+	kprintf("%-22s %8s %10s %10s %10s  (us)\n", "", "count", "p50",
+		"p99", "max");
+	for (h=0; h<LAT_NHISTS; h++) {
+		bzero(&sum, sizeof(sum));
+		for (c=0; c<lat_ncpus; c++) {
+			lh = &lat_hists[c * LAT_NHISTS + h];
+			sum.lh_count += lh->lh_count;
+			if (lh->lh_max > sum.lh_max) {
+				sum.lh_max = lh->lh_max;
+			}
+			for (i=0; i<LATHIST_NBUCKETS; i++) {
+				sum.lh_buckets[i] += lh->lh_buckets[i];
+			}
+		}
+		if (sum.lh_count == 0) {
+			continue;
+		}
+
+		if (h < LAT_NFIXED) {
+			strcpy(label, lat_fixednames[h]);
+		}
+		else if (h - LAT_NFIXED < lat_nwchannames) {
+			snprintf(label, sizeof(label), "sleep %s",
+				 lat_wchannames[h - LAT_NFIXED]);
+		}
+		else {
+			strcpy(label, "sleep (other)");
+		}
+		kprintf("%-22s %8u", label, sum.lh_count);
+		lat_printpct(&sum, 50);
+		lat_printpct(&sum, 99);
+		kprintf(" %10llu\n", (unsigned long long)(sum.lh_max / 1000));
+	}
+}
+
+void
+lat_reset(void)
+{
+	unsigned i;
+	int spl;
+
+	for (i=0; i<lat_ncpus * LAT_NHISTS; i++) {
+		/* Not atomic with respect to other cpus; near enough */
+		spl = splhigh();
+		bzero(&lat_hists[i], sizeof(lat_hists[i]));
+		splx(spl);
+	}
+}
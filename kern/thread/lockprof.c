@@ -0,0 +1,222 @@
+/*
+ * Lock contention profiling. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <kclock.h>
+#include <lockprof.h>
+
+/* How many locks lockprof_report lists */
+#define LOCKPROF_TOP 20
+
+/* List of every lockstat, newest first; entries are never freed */
+static struct lockstat *lockprof_all;
+static volatile spinlock_data_t lockprof_listword = SPINLOCK_DATA_INITIALIZER;
+
+static bool lockprof_timing;
+
+/*
+ * Raw lock word, with interrupts off. (These can't be struct spinlocks,
+ * or profiling a spinlock would recurse.)
+ */
+static
+int
+lockprof_wordlock(volatile spinlock_data_t *word)
+{
+	int spl;
+
+	spl = splhigh();
+	while (spinlock_data_get(word) != 0 ||
+	       spinlock_data_testandset(word) != 0) {
+		/* spin */
+	}
+	return spl;
+}
+
+static
+void
+lockprof_wordunlock(volatile spinlock_data_t *word, int spl)
+{
+	spinlock_data_set(word, 0);
+	splx(spl);
+}
+
+uint64_t
+lockprof_now(void)
+{
+	if (!lockprof_timing) {
+		return 0;
+	}
+	return kclock_ns();
+}
+
+/*
+ * Time from START to NOW. A sleeping thread can wake on another cpu,
+ * whose clock may be a little behind.
+ */
+static
+uint64_t
+lockprof_since(uint64_t start, uint64_t now)
+{
+	return now > start ? now - start : 0;
+}
+
+void
+lockprof_start(void)
+{
+	lockprof_timing = true;
+}
+
+struct lockstat *
+lockprof_get(const char *name)
+{
+	struct lockstat *ls, *newls;
+	size_t i;
+	int spl;
+
+	/* Allocate first; we can't call kmalloc with the list locked */
+	newls = kmalloc(sizeof(*newls));
+	if (newls == NULL) {
+		return NULL;
+	}
+	for (i=0; i<LOCKPROF_NAMELEN && name[i] != 0; i++) {
+		newls->ls_name[i] = name[i];
+	}
+	newls->ls_name[i] = 0;
+	spinlock_data_set(&newls->ls_word, 0);
+	newls->ls_acquires = 0;
+	newls->ls_contended = 0;
+	newls->ls_waitns = 0;
+	newls->ls_maxwaitns = 0;
+	newls->ls_holdns = 0;
+	newls->ls_maxholdns = 0;
+
+	spl = lockprof_wordlock(&lockprof_listword);
+	for (ls = lockprof_all; ls != NULL; ls = ls->ls_next) {
+		if (!strcmp(ls->ls_name, newls->ls_name)) {
+			break;
+		}
+	}
+	if (ls == NULL) {
+		newls->ls_next = lockprof_all;
+		lockprof_all = newls;
+		ls = newls;
+		newls = NULL;
+	}
+	lockprof_wordunlock(&lockprof_listword, spl);
+
+	if (newls != NULL) {
+		/* someone already had the name */
+		kfree(newls);
+	}
+	return ls;
+}
+
+void
+lockprof_acquired(struct lockstat *ls, bool contended, uint64_t start,
+		  uint64_t *holdstart)
+{
+	uint64_t now, wait;
+	int spl;
+
+	now = lockprof_now();
+	*holdstart = now;
+
+	spl = lockprof_wordlock(&ls->ls_word);
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		wait = lockprof_since(start, now);
+		ls->ls_waitns += wait;
+		if (wait > ls->ls_maxwaitns) {
+			ls->ls_maxwaitns = wait;
+		}
+	}
+	lockprof_wordunlock(&ls->ls_word, spl);
+}
+
+void
+lockprof_released(struct lockstat *ls, uint64_t holdstart)
+{
+	uint64_t held;
+	int spl;
+
+	if (holdstart == 0) {
+		/* taken before timing started */
+		return;
+	}
+	held = lockprof_since(holdstart, lockprof_now());
+
+	spl = lockprof_wordlock(&ls->ls_word);
+	ls->ls_holdns += held;
+	if (held > ls->ls_maxholdns) {
+		ls->ls_maxholdns = held;
+	}
+	lockprof_wordunlock(&ls->ls_word, spl);
+}
+
+/*
+ * Print up to LOCKPROF_TOP locks, most contended acquisitions first.
+ * Picks them by repeated scans so it needs no memory; the list doesn't
+ * change while we look except for new entries at the head.
+ */
+void
+lockprof_report(void)
+{
+	struct lockstat *top[LOCKPROF_TOP];
+	struct lockstat *ls, *best;
+	unsigned n, i;
+	bool taken;
+
+	kprintf("%-23s %10s %10s %12s %10s %10s\n", "lock", "acquires",
+		"contended", "wait(us)", "maxwait", "maxhold");
+
+	for (n=0; n<LOCKPROF_TOP; n++) {
+		best = NULL;
+		for (ls = lockprof_all; ls != NULL; ls = ls->ls_next) {
+			taken = false;
+			for (i=0; i<n; i++) {
+				if (top[i] == ls) {
+					taken = true;
+				}
+			}
+			if (taken || ls->ls_contended == 0) {
+				continue;
+			}
+			if (best == NULL || ls->ls_contended > best->ls_contended) {
+				best = ls;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		top[n] = best;
+		kprintf("%-23s %10u %10u %12llu %10llu %10llu\n",
+			best->ls_name, best->ls_acquires, best->ls_contended,
+			best->ls_waitns / 1000, best->ls_maxwaitns / 1000,
+			best->ls_maxholdns / 1000);
+	}
+	if (n == 0) {
+		kprintf("(no contention)\n");
+	}
+}
+
+void
+lockprof_reset(void)
+{
+	struct lockstat *ls;
+	int spl;
+
+	for (ls = lockprof_all; ls != NULL; ls = ls->ls_next) {
+		spl = lockprof_wordlock(&ls->ls_word);
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_waitns = 0;
+		ls->ls_maxwaitns = 0;
+		ls->ls_holdns = 0;
+		ls->ls_maxholdns = 0;
+		lockprof_wordunlock(&ls->ls_word, spl);
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * Per-cpu variables and counters. See percpu.h.
+ */
+
+/* Make sure to build out-of-line versions of the inline functions */
+#define PERCPU_INLINE   /* empty */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <seqlock.h>
+#include <percpu.h>
+
+void *
+percpu_create(void)
+{
+	size_t size;
+	void *area;
+
+	size = _percpu_end - _percpu_start;
+	if (size == 0) {
+		return NULL;
+	}
+	area = kmalloc(size);
+	if (area == NULL) {
+		panic("percpu_create: Out of memory\n");
+	}
+	memcpy(area, _percpu_start, size);
+	return area;
+}
+
+void
+percpu_counter_add(struct percpu_counter *pc, int64_t n)
+{
+	struct percpu_counter *mine;
+	int spl;
+
+	spl = splhigh();
+	mine = percpu_ptr(curcpu->c_self, pc);
+	seqcount_writebegin(&mine->pc_seq);
+	mine->pc_count += n;
+	seqcount_writeend(&mine->pc_seq);
+	splx(spl);
+}
+
+int64_t
+percpu_counter_sum(struct percpu_counter *pc)
+{
+	struct percpu_counter *theirs;
+	int64_t total, count;
+	uint32_t seq;
+	unsigned i;
+
+	total = 0;
+	for (i=0; i<cpu_count(); i++) {
+		theirs = percpu_ptr(cpu_get(i), pc);
+		do {
+			seq = seqcount_readbegin(&theirs->pc_seq);
+			count = theirs->pc_count;
+		} while (seqcount_readretry(&theirs->pc_seq, seq));
+		total += count;
+	}
+	return total;
+}
@@ -0,0 +1,200 @@
+/*
+ * Read-copy-update. See rcu.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <platform/maxcpus.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <wchan.h>
+#include <clock.h>
+#include <rcu.h>
+
+/*
+ * Callbacks queued for the next grace period, oldest first. The rcu
+ * thread is woken when the queue goes from empty to not, so each V of
+ * rcu_sem has a nonempty queue waiting for it.
+ */
+static struct rcu_head *rcu_pending;
+static struct rcu_head **rcu_pendingtail = &rcu_pending;
+static struct spinlock rcu_lock = SPINLOCK_INITIALIZER;
+static struct semaphore *rcu_sem;
+
+/* Where rcu_synchronize waits */
+static struct wchan *rcu_syncwait;
+
+struct rcu_sync {
+	struct rcu_head rs_head;	/* must be first */
+	volatile bool rs_done;
+};
+
+////////////////////////////////////////////////////////////
+// readers
+
+void
+rcu_read_lock(void)
+{
+	KASSERT(!curthread->t_in_interrupt);
+	curthread->t_rcu_depth++;
+}
+
+void
+rcu_read_unlock(void)
+{
+	KASSERT(curthread->t_rcu_depth > 0);
+	curthread->t_rcu_depth--;
+}
+
+////////////////////////////////////////////////////////////
+// grace periods
+
+/*
+ * Wait until every cpu has been quiescent at least once. The cpu we
+ * start on counts straight away, since we aren't reading; any other
+ * has to have switched or taken a tick outside a read section since
+ * we looked, or be idle now.
+ */
+static
+void
+rcu_wait_grace(void)
+{
+	unsigned seen[MAXCPUS];
+	bool done[MAXCPUS];
+	unsigned i, num, left;
+	struct cpu *c;
+
+	num = cpu_count();
+	for (i=0; i<num; i++) {
+		seen[i] = cpu_get(i)->c_rcu_qs;
+		done[i] = false;
+	}
+	done[curcpu->c_number] = true;
+
+	while (1) {
+		left = 0;
+		for (i=0; i<num; i++) {
+			c = cpu_get(i);
+			if (!done[i] &&
+			    (c->c_isidle || c->c_rcu_qs != seen[i])) {
+				done[i] = true;
+			}
+			if (!done[i]) {
+				left++;
+			}
+		}
+		if (left == 0) {
+			break;
+		}
+		clocksleep_ticks(1);
+	}
+}
+
+static
+void
+rcu_thread(void *data1, unsigned long data2)
+{
+	struct rcu_head *batch, *rh;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		P(rcu_sem);
+
+		spinlock_acquire(&rcu_lock);
+		batch = rcu_pending;
+		rcu_pending = NULL;
+		rcu_pendingtail = &rcu_pending;
+		spinlock_release(&rcu_lock);
+		KASSERT(batch != NULL);
+
+		rcu_wait_grace();
+
+		while (batch != NULL) {
+			rh = batch;
+			batch = rh->rh_next;
+			rh->rh_func(rh);
+		}
+	}
+}
+
+void
+call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *))
+{
+	bool wake;
+
+	head->rh_next = NULL;
+	head->rh_func = func;
+
+	spinlock_acquire(&rcu_lock);
+	wake = (rcu_pending == NULL);
+	*rcu_pendingtail = head;
+	rcu_pendingtail = &head->rh_next;
+	spinlock_release(&rcu_lock);
+
+	/* before rcu_bootstrap, the queue is picked up when it runs */
+	if (wake && rcu_sem != NULL) {
+		V(rcu_sem);
+	}
+}
+
+static
+void
+rcu_sync_done(struct rcu_head *head)
+{
+	struct rcu_sync *rs = (struct rcu_sync *)head;
+
+	/* Waking takes the channel's lock itself, so let go of it first */
+	wchan_lock(rcu_syncwait);
+	rs->rs_done = true;
+	wchan_unlock(rcu_syncwait);
+	wchan_wakeall(rcu_syncwait);
+}
+
+void
+rcu_synchronize(void)
+{
+	struct rcu_sync rs;
+
+	KASSERT(rcu_sem != NULL);
+	KASSERT(curthread->t_rcu_depth == 0);
+
+	rs.rs_done = false;
+	call_rcu(&rs.rs_head, rcu_sync_done);
+
+	wchan_lock(rcu_syncwait);
+	while (!rs.rs_done) {
+		wchan_sleep(rcu_syncwait);
+		wchan_lock(rcu_syncwait);
+	}
+	wchan_unlock(rcu_syncwait);
+}
+
+void
+rcu_bootstrap(void)
+{
+	bool queued;
+	int result;
+
+	rcu_syncwait = wchan_create("rcu_sync");
+	rcu_sem = sem_create("rcu", 0);
+	if (rcu_syncwait == NULL || rcu_sem == NULL) {
+		panic("Could not create rcu synchronization\n");
+	}
+
+	result = thread_fork("rcu", NULL, rcu_thread, NULL, 0);
+	if (result) {
+		panic("Could not start rcu thread: %s\n", strerror(result));
+	}
+
+	spinlock_acquire(&rcu_lock);
+	queued = (rcu_pending != NULL);
+	spinlock_release(&rcu_lock);
+	if (queued) {
+		V(rcu_sem);
+	}
+}
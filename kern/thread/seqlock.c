@@ -0,0 +1,24 @@
+/*
+ * Sequence locks. See seqlock.h.
+ */
+
+/* Make sure to build out-of-line versions of the inline functions */
+#define SEQLOCK_INLINE   /* empty */
+
+#include <types.h>
+#include <lib.h>
+#include <seqlock.h>
+
+void
+seqlock_init(struct seqlock *sl)
+{
+	spinlock_init(&sl->sl_lock);
+	sl->sl_seq = 0;
+}
+
+void
+seqlock_cleanup(struct seqlock *sl)
+{
+	KASSERT((sl->sl_seq & 1) == 0);
+	spinlock_cleanup(&sl->sl_lock);
+}
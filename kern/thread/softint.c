@@ -0,0 +1,76 @@
+/*
+ * Software interrupts. See softint.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <membar.h>
+#include <softint.h>
+
+void
+softint_init(struct softint *si, void (*func)(void *), void *arg)
+{
+	si->si_next = NULL;
+	si->si_func = func;
+	si->si_arg = arg;
+	si->si_pending = 0;
+}
+
+void
+softint_schedule(struct softint *si)
+{
+	struct cpu *c;
+	int spl;
+
+	/* Whoever sets si_pending owns the link, until it's run */
+	if (spinlock_data_swap(&si->si_pending, 1) != 0) {
+		return;
+	}
+
+	/* The queue is this cpu's alone, and kept at splhigh */
+	spl = splhigh();
+	c = curcpu->c_self;
+	si->si_next = NULL;
+	*c->c_softinttail = si;
+	c->c_softinttail = &si->si_next;
+	splx(spl);
+}
+
+void
+softint_run(int spl)
+{
+	struct thread *cur = curthread;
+	struct cpu *c;
+	struct softint *si;
+
+	KASSERT(cur->t_curspl == IPL_HIGH);
+
+	/* Interrupts that come in while we run leave the queue to us */
+	if (cur->t_in_softint) {
+		return;
+	}
+	cur->t_in_softint = true;
+
+	/* We don't get preempted (see hardclock), so we stay on this cpu */
+	c = curcpu->c_self;
+	while ((si = c->c_softints) != NULL) {
+		c->c_softints = si->si_next;
+		if (c->c_softints == NULL) {
+			c->c_softinttail = &c->c_softints;
+		}
+
+		/* From here on it can be scheduled again */
+		membar_any_store();
+		si->si_pending = 0;
+
+		splx(spl);
+		si->si_func(si->si_arg);
+		splhigh();
+	}
+
+	cur->t_in_softint = false;
+}
@@ -29,19 +29,22 @@
 
 /* Make sure to build out-of-line versions of spinlock inline functions */
 #define SPINLOCK_INLINE   /* empty */
+#define MEMBAR_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <current.h>	/* for curcpu */
+#include <lockprof.h>
+#include "opt-uniprocessor.h"
 
 /*
  * Spinlocks.
  */
 
-
 /*
  * Initialize spinlock.
  */
@@ -49,8 +52,26 @@ void
 spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
+	lk->lk_mcsnode = NULL;
+	lk->lk_kind = SPINLOCK_TAS;
 	lk->lk_holder = NULL;
+#if OPT_LOCKPROF
+	lk->lk_stat = NULL;
+	lk->lk_holdstart = 0;
+#endif
+}
+
+#if OPT_LOCKPROF
+/*
+ * Start keeping statistics for the lock.
+ */
+void
+spinlock_profile(struct spinlock *lk, const char *name)
+{
+	lk->lk_stat = lockprof_get(name);
 }
+#endif
 
 /*
  * Clean up spinlock.
@@ -59,33 +80,116 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_lock) ==
+		spinlock_data_get(&lk->lk_serving));
+	KASSERT(lk->lk_kind != SPINLOCK_MCS ||
+		spinlock_data_get(&lk->lk_lock) == 0);
 }
 
 /*
- * Get the lock.
- *
- * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * Change the kind of lock. Tickets start over from zero, since nobody
+ * holds one.
  */
 void
-spinlock_acquire(struct spinlock *lk)
+spinlock_setkind(struct spinlock *lk, unsigned kind)
 {
-	struct cpu *mycpu;
+	KASSERT(kind == SPINLOCK_TAS || kind == SPINLOCK_TICKET ||
+		kind == SPINLOCK_MCS);
+	KASSERT(lk->lk_holder == NULL);
+	KASSERT(spinlock_data_get(&lk->lk_lock) ==
+		spinlock_data_get(&lk->lk_serving));
 
-	splraise(IPL_NONE, IPL_HIGH);
+	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
+	lk->lk_kind = kind;
+}
+
+#if !OPT_UNIPROCESSOR
+/*
+ * MCS queue nodes for before curcpu exists, when there's only the one
+ * cpu and it has interrupts off.
+ */
+static struct spinlock_mcsnode spinlock_bootnodes[SPINLOCK_MCS_NODES];
+static unsigned spinlock_bootused;
+
+/*
+ * Take a free MCS node from this cpu's set (or the boot set), and put
+ * it back. Interrupts are off, so nothing else on this cpu can be
+ * doing the same.
+ */
+static
+struct spinlock_mcsnode *
+spinlock_mcsnode_get(void)
+{
+	struct spinlock_mcsnode *nodes;
+	unsigned *used;
+	unsigned i;
 
-	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
-		mycpu = curcpu->c_self;
-		if (lk->lk_holder == mycpu) {
-			panic("Deadlock on spinlock %p\n", lk);
+		nodes = curcpu->c_mcsnodes;
+		used = &curcpu->c_mcsused;
+	}
+	else {
+		nodes = spinlock_bootnodes;
+		used = &spinlock_bootused;
+	}
+	for (i=0; i<SPINLOCK_MCS_NODES; i++) {
+		if ((*used & (1U << i)) == 0) {
+			*used |= 1U << i;
+			nodes[i].mn_next = NULL;
+			nodes[i].mn_waiting = true;
+			return &nodes[i];
 		}
 	}
+	panic("spinlock: more than %d MCS locks held at once\n",
+	      SPINLOCK_MCS_NODES);
+}
+
+static
+void
+spinlock_mcsnode_put(struct spinlock_mcsnode *node)
+{
+	struct spinlock_mcsnode *nodes;
+	unsigned *used;
+
+	if (CURCPU_EXISTS()) {
+		nodes = curcpu->c_mcsnodes;
+		used = &curcpu->c_mcsused;
+	}
 	else {
-		mycpu = NULL;
+		nodes = spinlock_bootnodes;
+		used = &spinlock_bootused;
+	}
+	KASSERT(node >= nodes && node < nodes + SPINLOCK_MCS_NODES);
+	*used &= ~(1U << (node - nodes));
+}
+
+/*
+ * Note when an acquire first has to wait, for the lock's statistics.
+ */
+static
+void
+spinlock_startwait(struct spinlock *lk, uint64_t *start)
+{
+#if OPT_LOCKPROF
+	if (lk->lk_stat != NULL) {
+		*start = lockprof_now();
 	}
+#else
+	(void)lk;
+	(void)start;
+#endif
+}
+
+/*
+ * Wait for the lock, each kind its own way. Return true if we had to
+ * wait at all, with *START set to when we started.
+ */
+static
+bool
+spinlock_wait_tas(struct spinlock *lk, uint64_t *start)
+{
+	bool contended = false;
 
 	while (1) {
 		/*
@@ -98,17 +202,145 @@ spinlock_acquire(struct spinlock *lk)
 		 * previously unheld and we now own it. If it was 1,
 		 * we don't.
 		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+		if (spinlock_data_get(&lk->lk_lock) == 0 &&
+		    spinlock_data_testandset(&lk->lk_lock) == 0) {
+			return contended;
+		}
+		if (!contended) {
+			contended = true;
+			spinlock_startwait(lk, start);
+		}
+	}
+}
+
+static
+bool
+spinlock_wait_ticket(struct spinlock *lk, uint64_t *start)
+{
+	spinlock_data_t ticket;
+
+	ticket = spinlock_data_fetchadd(&lk->lk_lock, 1);
+	if (spinlock_data_get(&lk->lk_serving) == ticket) {
+		return false;
+	}
+	spinlock_startwait(lk, start);
+	while (spinlock_data_get(&lk->lk_serving) != ticket) {
+		/* wait our turn */
+	}
+	return true;
+}
+
+static
+bool
+spinlock_wait_mcs(struct spinlock *lk, uint64_t *start)
+{
+	struct spinlock_mcsnode *node, *pred;
+	bool contended = false;
+
+	/* Join the end of the queue; whoever was last goes before us */
+	node = spinlock_mcsnode_get();
+	pred = (struct spinlock_mcsnode *)
+		spinlock_data_swap(&lk->lk_lock, (uintptr_t)node);
+	if (pred != NULL) {
+		contended = true;
+		spinlock_startwait(lk, start);
+		pred->mn_next = node;
+		while (node->mn_waiting) {
+			/* spin on our own node */
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	}
+	lk->lk_mcsnode = node;
+	return contended;
+}
+#endif /* !OPT_UNIPROCESSOR */
+
+/*
+ * Get the lock.
+ *
+ * First disable interrupts (otherwise, if we get a timer interrupt we
+ * might come back to this lock and deadlock), then use a machine-level
+ * atomic operation to wait for the lock to be free.
+ */
+void
+spinlock_acquire(struct spinlock *lk)
+{
+	struct cpu *mycpu;
+	bool contended;
+	uint64_t start = 0;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (lk->lk_holder == mycpu) {
+			panic("Deadlock on spinlock %p\n", lk);
 		}
+	}
+	else {
+		mycpu = NULL;
+	}
+
+#if OPT_UNIPROCESSOR
+	/*
+	 * With interrupts off nothing else can run here, and there is
+	 * nowhere else, so the lock is ours; the kind doesn't matter.
+	 */
+	contended = false;
+#else
+	switch (lk->lk_kind) {
+	    case SPINLOCK_TICKET:
+		contended = spinlock_wait_ticket(lk, &start);
+		break;
+	    case SPINLOCK_MCS:
+		contended = spinlock_wait_mcs(lk, &start);
+		break;
+	    default:
+		contended = spinlock_wait_tas(lk, &start);
 		break;
 	}
+#endif
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKPROF
+	if (lk->lk_stat != NULL) {
+		lockprof_acquired(lk->lk_stat, contended, start,
+				  &lk->lk_holdstart);
+	}
+#else
+	(void)contended;
+	(void)start;
+#endif
+}
+
+#if !OPT_UNIPROCESSOR
+/*
+ * Hand an MCS lock to the next waiter, or leave it free if there
+ * isn't one.
+ */
+static
+void
+spinlock_release_mcs(struct spinlock *lk)
+{
+	struct spinlock_mcsnode *node;
+
+	node = lk->lk_mcsnode;
+	lk->lk_mcsnode = NULL;
+	if (node->mn_next == NULL) {
+		if (spinlock_data_cas(&lk->lk_lock, (uintptr_t)node, 0)) {
+			/* Nobody behind us */
+			spinlock_mcsnode_put(node);
+			return;
+		}
+		/* Someone's joining; wait until they've linked in */
+		while (node->mn_next == NULL) {
+			/* spin */
+		}
+	}
+	node->mn_next->mn_waiting = false;
+	spinlock_mcsnode_put(node);
 }
+#endif /* !OPT_UNIPROCESSOR */
 
 /*
  * Release the lock.
@@ -121,8 +353,27 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	if (lk->lk_stat != NULL) {
+		lockprof_released(lk->lk_stat, lk->lk_holdstart);
+	}
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+#if !OPT_UNIPROCESSOR
+	switch (lk->lk_kind) {
+	    case SPINLOCK_TICKET:
+		/* Only the holder changes this, so no atomic op needed */
+		spinlock_data_set(&lk->lk_serving,
+				  spinlock_data_get(&lk->lk_serving) + 1);
+		break;
+	    case SPINLOCK_MCS:
+		spinlock_release_mcs(lk);
+		break;
+	    default:
+		spinlock_data_set(&lk->lk_lock, 0);
+		break;
+	}
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -32,13 +32,19 @@
  * The specifications of the functions are in synch.h.
  */
 
+#define KMTAG KMT_SYNCH
+
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <lockprof.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -60,16 +66,22 @@ struct semaphore * sem_create(const char *name, int initial_count) {
 			return NULL;
 	}
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
+	wchan_init(&sem->sem_wchan, sem->sem_name);
 	spinlock_init(&sem->sem_lock);
 	sem->sem_count = initial_count;
+	sem->sem_fifo = false;
+	sem->sem_waiters = 0;
+
+	return sem;
+}
+
+struct semaphore * sem_create_fifo(const char *name, int initial_count) {
+	struct semaphore *sem;
 
+	sem = sem_create(name, initial_count);
+	if (sem != NULL) {
+		sem->sem_fifo = true;
+	}
 	return sem;
 }
 
@@ -78,7 +90,7 @@ void sem_destroy(struct semaphore *sem) {
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
 	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	wchan_cleanup(&sem->sem_wchan);
 	kfree(sem->sem_name);
 	kfree(sem);
 }
@@ -95,6 +107,24 @@ void P(struct semaphore *sem) {
 	KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&sem->sem_lock);
+	if (sem->sem_fifo) {
+		/*
+		 * FIFO mode: take the count only if nobody is queued
+		 * ahead of us. Otherwise sleep; the wchan is FIFO and V
+		 * hands the count to whoever is at its head, so when we
+		 * wake up the count is already ours.
+		 */
+		if (sem->sem_count > 0 && sem->sem_waiters == 0) {
+			sem->sem_count--;
+			spinlock_release(&sem->sem_lock);
+			return;
+		}
+		sem->sem_waiters++;
+		wchan_lock(&sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		wchan_sleep(&sem->sem_wchan);
+		return;
+	}
 		while (sem->sem_count == 0) {
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
@@ -110,11 +140,11 @@ void P(struct semaphore *sem) {
 		 * strict ordering. Too bad. :-)
 		 *
 		 * Exercise: how would you implement strict FIFO
-		 * ordering?
+		 * ordering? (Answer: sem_create_fifo, above.)
 		 */
-		wchan_lock(sem->sem_wchan);
+		wchan_lock(&sem->sem_wchan);
 		spinlock_release(&sem->sem_lock);
-			wchan_sleep(sem->sem_wchan);
+			wchan_sleep(&sem->sem_wchan);
 		spinlock_acquire(&sem->sem_lock);
 		}
 		KASSERT(sem->sem_count > 0);
@@ -129,9 +159,17 @@ void V(struct semaphore *sem) {
 
 	spinlock_acquire(&sem->sem_lock);
 
+	if (sem->sem_fifo && sem->sem_waiters > 0) {
+		/* Hand the count straight to the first waiter */
+		sem->sem_waiters--;
+		wchan_wakeone(&sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		return;
+	}
+
 		sem->sem_count++;
 		KASSERT(sem->sem_count > 0);
-		wchan_wakeone(sem->sem_wchan);
+		wchan_wakeone(&sem->sem_wchan);
 
 	spinlock_release(&sem->sem_lock);
 }
@@ -158,64 +196,359 @@ struct lock * lock_create(const char *name) {
 
 	// Initialize the lock's channel
 	// The channel will control access to threads accessing this same lock
-	lock->lk_wchan = wchan_create(name);
-	if (lock->lk_wchan == NULL) {
-		// No channel, noo!!!
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
+	wchan_init_lock(&lock->lk_wchan, lock->lk_name);
 
 	// Initalize the internal spinlock
-	// The spinlock is used to enforce atomic lock functionality
+	// The sleep path counts waiters under it, and lock_release wakes them
 	spinlock_init(&lock->lk_slk);
 
 	// Set the holding thread to NULL initially
 	lock->lk_holder = NULL;
 
 	// Unlocked initially
-	lock->locked = false;
+	spinlock_data_set(&lock->lk_word, 0);
+	lock->lk_waiters = 0;
+	lock->lk_fifo = false;
+	lock->lk_piwaiters = NULL;
+	lock->lk_piholder = NULL;
+	lock->lk_pinext = NULL;
+
+#if OPT_LOCKPROF
+	// Same statistics as every other lock with this name
+	lock->lk_stat = lockprof_get(name);
+	lock->lk_holdstart = 0;
+#endif
 
 	return lock;
 }
 
+struct lock * lock_create_fifo(const char *name) {
+	struct lock *lock;
+
+	lock = lock_create(name);
+	if (lock != NULL) {
+		lock->lk_fifo = true;
+	}
+	return lock;
+}
+
 void lock_destroy(struct lock *lock) {
 
 	// Make sure it's unlocked
-	KASSERT(lock != NULL && !lock->locked && lock->lk_holder == NULL);
+	KASSERT(lock != NULL && spinlock_data_get(&lock->lk_word) == 0);
+	KASSERT(lock->lk_holder == NULL && lock->lk_waiters == 0);
+	KASSERT(lock->lk_piwaiters == NULL && lock->lk_piholder == NULL);
 
 	// Free up pointers and cleanup spinlock
-	wchan_destroy(lock->lk_wchan);
+	wchan_cleanup(&lock->lk_wchan);
 	spinlock_cleanup(&lock->lk_slk);
 
 	kfree(lock->lk_name);
 	kfree(lock);
 }
 
+// Try once to take the lock without blocking. Checks the word before
+// the test-and-set so waiters don't keep bouncing the cache line.
+static bool lock_tryget(struct lock *lock) {
+	if (spinlock_data_get(&lock->lk_word) != 0 ||
+	    spinlock_data_testandset(&lock->lk_word) != 0) {
+		return false;
+	}
+	lock->lk_holder = curthread;
+	return true;
+}
+
+// Spin while the holder is running on some other cpu, since it is
+// likely to let go before a sleep/wakeup round trip would finish.
+// Gives up after LOCK_SPIN_MAX tries, or as soon as the holder is not
+// running (then it won't release any time soon). The holder may exit
+// while we look at it; thread structs come from a type-stable cache,
+// so at worst we read a stale state and stop spinning.
+#define LOCK_SPIN_MAX 1000
+
+static void lock_spin(struct lock *lock) {
+	struct thread *holder;
+	unsigned i;
+
+	for (i = 0; i < LOCK_SPIN_MAX; i++) {
+		if (spinlock_data_get(&lock->lk_word) == 0) {
+			return;
+		}
+		holder = lock->lk_holder;
+		if (holder == NULL || holder->t_state != S_RUN ||
+		    holder->t_cpu == curcpu->c_self) {
+			return;
+		}
+	}
+}
+
+// Priority inheritance. Every waiter records the lock it's waiting for
+// in t_pilock, so boosts can follow chains of holders; real-time ones
+// (and ones boosted while waiting) also go on the lock's lk_piwaiters.
+// A holder that inherits priority through a lock has the lock on its
+// t_pilocks, and its boost is the highest priority waiting for any of
+// those. All of it is under pi_lock, which is taken before run queue
+// locks and never while holding a lock's lk_slk or wchan lock.
+//
+// The holder of a lock with real-time waiters can't miss them: a
+// waiter joins lk_piwaiters and then looks at lk_holder, while an
+// acquirer sets lk_holder and then looks at lk_piwaiters, so at least
+// one of them sees the other. The releaser clears lk_holder and then
+// checks for PI before the lock can go to anyone else.
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+
+// How far up a chain of holders a boost is passed
+#define PI_MAXDEPTH 8
+
+static unsigned pi_rank(struct thread *t) {
+	return t->t_policy == SCHED_OTHER ? 0 : t->t_rtprio;
+}
+
+// The highest priority waiting for LOCK, 0 if none is real-time.
+static unsigned pi_lockrank(struct lock *lock) {
+	struct thread *t;
+	unsigned rank = 0;
+
+	for (t = lock->lk_piwaiters; t != NULL; t = t->t_pinext) {
+		if (pi_rank(t) > rank) {
+			rank = pi_rank(t);
+		}
+	}
+	return rank;
+}
+
+// What T should inherit from the locks it holds.
+static unsigned pi_boostfor(struct thread *t) {
+	struct lock *lock;
+	unsigned rank, boost = 0;
+
+	for (lock = t->t_pilocks; lock != NULL; lock = lock->lk_pinext) {
+		rank = pi_lockrank(lock);
+		if (rank > boost) {
+			boost = rank;
+		}
+	}
+	return boost;
+}
+
+static void pi_addwaiter(struct lock *lock, struct thread *t) {
+	struct thread *w;
+
+	for (w = lock->lk_piwaiters; w != NULL; w = w->t_pinext) {
+		if (w == t) {
+			return;
+		}
+	}
+	t->t_pinext = lock->lk_piwaiters;
+	lock->lk_piwaiters = t;
+}
+
+static void pi_remwaiter(struct lock *lock, struct thread *t) {
+	struct thread *volatile *wp;
+
+	for (wp = &lock->lk_piwaiters; *wp != NULL; wp = &(*wp)->t_pinext) {
+		if (*wp == t) {
+			*wp = t->t_pinext;
+			t->t_pinext = NULL;
+			return;
+		}
+	}
+}
+
+// LOCK's waiters have changed: work out its holder's boost again, and
+// pass any change on to the holder of the lock that one's waiting for,
+// and so on.
+static void pi_propagate(struct lock *lock) {
+	struct thread *holder;
+	unsigned depth, boost;
+
+	for (depth = 0; lock != NULL && depth < PI_MAXDEPTH; depth++) {
+		holder = lock->lk_holder;
+		if (holder == NULL) {
+			// Between holders; the next one looks when it's in
+			return;
+		}
+		if (lock->lk_piholder == NULL && lock->lk_piwaiters != NULL) {
+			lock->lk_piholder = holder;
+			lock->lk_pinext = holder->t_pilocks;
+			holder->t_pilocks = lock;
+		}
+		KASSERT(lock->lk_piholder == NULL ||
+			lock->lk_piholder == holder);
+
+		boost = pi_boostfor(holder);
+		if (boost == holder->t_piboost) {
+			return;
+		}
+		thread_setboost(holder, boost);
+		lock = holder->t_pilock;
+		if (lock != NULL && pi_rank(holder) > 0) {
+			pi_addwaiter(lock, holder);
+		}
+	}
+}
+
+// We're about to wait for LOCK.
+static void lock_pi_wait(struct lock *lock) {
+	spinlock_acquire(&pi_lock);
+	curthread->t_pilock = lock;
+	if (pi_rank(curthread) > 0) {
+		pi_addwaiter(lock, curthread);
+		pi_propagate(lock);
+	}
+	spinlock_release(&pi_lock);
+}
+
+// We've got LOCK, having waited for it if WAITED; take on what its
+// remaining real-time waiters lend.
+static void lock_pi_acquired(struct lock *lock, bool waited) {
+	spinlock_acquire(&pi_lock);
+	if (waited) {
+		pi_remwaiter(lock, curthread);
+		curthread->t_pilock = NULL;
+	}
+	pi_propagate(lock);
+	spinlock_release(&pi_lock);
+}
+
+// We're letting go of LOCK (lk_holder is already cleared); give back
+// what we inherited through it.
+static void lock_pi_release(struct lock *lock) {
+	struct lock **lp;
+	unsigned boost;
+
+	spinlock_acquire(&pi_lock);
+	if (lock->lk_piholder == curthread) {
+		for (lp = &curthread->t_pilocks; *lp != lock;
+		     lp = &(*lp)->lk_pinext) {
+			KASSERT(*lp != NULL);
+		}
+		*lp = lock->lk_pinext;
+		lock->lk_pinext = NULL;
+		lock->lk_piholder = NULL;
+
+		boost = pi_boostfor(curthread);
+		if (boost != curthread->t_piboost) {
+			thread_setboost(curthread, boost);
+		}
+	}
+	KASSERT(lock->lk_piholder == NULL);
+	spinlock_release(&pi_lock);
+}
+
+// FIFO mode. Everything goes through lk_slk so a releaser and a new
+// waiter agree on whether there's someone to hand off to. The fast
+// path is still lock-free when nobody is waiting. Returns true if we
+// had to wait.
+static bool lock_acquire_fifo(struct lock *lock) {
+	if (lock->lk_waiters == 0 && lock_tryget(lock)) {
+		return false;
+	}
+
+	lock_pi_wait(lock);
+	spinlock_acquire(&lock->lk_slk);
+	if (lock->lk_waiters == 0 && lock_tryget(lock)) {
+		spinlock_release(&lock->lk_slk);
+		return true;
+	}
+	lock->lk_waiters++;
+	wchan_lock(&lock->lk_wchan);
+	spinlock_release(&lock->lk_slk);
+	wchan_sleep(&lock->lk_wchan);
+
+	// lock_release left lk_word set and handed the lock to us
+	KASSERT(spinlock_data_get(&lock->lk_word) != 0);
+	lock->lk_holder = curthread;
+	return true;
+}
+
+// lock_release has already cleared lk_holder.
+static void lock_release_fifo(struct lock *lock) {
+	spinlock_acquire(&lock->lk_slk);
+	if (lock->lk_waiters > 0) {
+		// Keep lk_word set: ownership goes to the head of the wchan
+		lock->lk_waiters--;
+		wchan_wakeone(&lock->lk_wchan);
+	}
+	else {
+		spinlock_data_set(&lock->lk_word, 0);
+	}
+	spinlock_release(&lock->lk_slk);
+}
+
+// Returns true if we had to wait.
+static bool lock_acquire_default(struct lock *lock) {
+	bool waited = false;
+
+	while (!lock_tryget(lock)) {
+		lock_spin(lock);
+		if (lock_tryget(lock)) {
+			break;
+		}
+		if (!waited) {
+			lock_pi_wait(lock);
+			waited = true;
+		}
+
+		// Sleep path. Announce ourselves in lk_waiters before the
+		// last try so a release that misses the try sees the count
+		// and wakes us; the wchan is locked so the wakeup can't
+		// arrive before we're on it.
+		spinlock_acquire(&lock->lk_slk);
+		lock->lk_waiters++;
+		wchan_lock(&lock->lk_wchan);
+		if (lock_tryget(lock)) {
+			wchan_unlock(&lock->lk_wchan);
+			lock->lk_waiters--;
+			spinlock_release(&lock->lk_slk);
+			break;
+		}
+		spinlock_release(&lock->lk_slk);
+		wchan_sleep(&lock->lk_wchan);
+
+		spinlock_acquire(&lock->lk_slk);
+		lock->lk_waiters--;
+		spinlock_release(&lock->lk_slk);
+	}
+	return waited;
+}
+
 void lock_acquire(struct lock *lock) {
+	bool waited;
+#if OPT_LOCKPROF
+	bool contended;
+	uint64_t start;
+#endif
 
-	// Implementation is similar to P
 	KASSERT(lock != NULL);
 
 	// May not block in an interrupt handler.
 	KASSERT(curthread->t_in_interrupt == false);
 
-	spinlock_acquire(&lock->lk_slk);
-		while (lock->locked) {
-			// See P
-			wchan_lock(lock->lk_wchan);
-			spinlock_release(&lock->lk_slk);
-				wchan_sleep(lock->lk_wchan);
-				// thread is now asleep until woken by thread scheduler
-			spinlock_acquire(&lock->lk_slk);
-		}
+	KASSERT(lock->lk_holder != curthread);
 
-		// looks like it's our turn!
-		KASSERT(lock->locked == false && lock->lk_holder == NULL);
-		lock->locked = true;
-		lock->lk_holder = curthread;
+#if OPT_LOCKPROF
+	// Contended means somebody had it when we arrived
+	contended = spinlock_data_get(&lock->lk_word) != 0;
+	start = contended ? lockprof_now() : 0;
+#endif
 
-	spinlock_release(&lock->lk_slk);
+	if (lock->lk_fifo) {
+		waited = lock_acquire_fifo(lock);
+	}
+	else {
+		waited = lock_acquire_default(lock);
+	}
+	if (waited || lock->lk_piwaiters != NULL) {
+		lock_pi_acquired(lock, waited);
+	}
+
+#if OPT_LOCKPROF
+	if (lock->lk_stat != NULL) {
+		lockprof_acquired(lock->lk_stat, contended, start,
+				  &lock->lk_holdstart);
+	}
+#endif
 }
 
 void lock_release(struct lock *lock) {
@@ -225,18 +558,39 @@ void lock_release(struct lock *lock) {
 	// Make sure the running thread is holding the lock before releasing it
 	KASSERT(lock_do_i_hold(lock));
 
-	spinlock_acquire(&lock->lk_slk);
+#if OPT_LOCKPROF
+	if (lock->lk_stat != NULL) {
+		lockprof_released(lock->lk_stat, lock->lk_holdstart);
+	}
+#endif
 
-		lock->locked = false;
-		lock->lk_holder = NULL;
-		wchan_wakeone(lock->lk_wchan);
+	lock->lk_holder = NULL;
+	if (lock->lk_piwaiters != NULL || lock->lk_piholder != NULL) {
+		lock_pi_release(lock);
+	}
+
+	if (lock->lk_fifo) {
+		lock_release_fifo(lock);
+		return;
+	}
 
+	// Clear the word and look for sleepers under lk_slk. Once the word
+	// is clear another thread can take the lock, drop it and destroy
+	// it; doing the wakeup before we let go of lk_slk means that
+	// thread's own lock_release waits for us to be done with the lock.
+	// A sleeper counts itself and makes its last try under lk_slk too,
+	// so it can't slip in between.
+	spinlock_acquire(&lock->lk_slk);
+	spinlock_data_set(&lock->lk_word, 0);
+	if (lock->lk_waiters != 0) {
+		wchan_wakeone(&lock->lk_wchan);
+	}
 	spinlock_release(&lock->lk_slk);
 }
 
 
 bool lock_do_i_hold(struct lock *lock) {
-	return lock->locked && lock->lk_holder == curthread;
+	return lock->lk_holder == curthread;
 }
 
 ////////////////////////////////////////////////////////////
@@ -259,13 +613,7 @@ struct cv * cv_create(const char *name) {
 	}
 
 	// Initialize the CV's channel
-	cv->cv_wchan = wchan_create(name);
-	if (cv->cv_wchan == NULL) {
-		// No channel, noo!!!
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
+	wchan_init(&cv->cv_wchan, cv->cv_name);
 
 	return cv;
 }
@@ -274,7 +622,7 @@ void cv_destroy(struct cv *cv) {
 	KASSERT(cv != NULL);
 
 	// Free up the wait channel
-	wchan_destroy(cv->cv_wchan);
+	wchan_cleanup(&cv->cv_wchan);
 
 	kfree(cv->cv_name);
 	kfree(cv);
@@ -286,21 +634,417 @@ void cv_wait(struct cv *cv, struct lock *lock) {
 	KASSERT(lock != NULL);
 	KASSERT(lock_do_i_hold(lock));
 
-	wchan_lock(cv->cv_wchan);
+	wchan_lock(&cv->cv_wchan);
 	lock_release(lock);
-		wchan_sleep(cv->cv_wchan);
+		wchan_sleep(&cv->cv_wchan);
 		// Now waiting for the signal
 	lock_acquire(lock);
 }
 
+// What a cv_timedwait timeout needs to wake its sleeper
+struct cv_timeout {
+	struct cv *ct_cv;
+	struct thread *ct_thread;
+	bool ct_fired;
+};
+
+static void cv_timedout(void *arg) {
+	struct cv_timeout *ct = arg;
+
+	// Only counts if it's still asleep; cv_signal may have got there first
+	ct->ct_fired = wchan_wakethread(&ct->ct_cv->cv_wchan, ct->ct_thread);
+}
+
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks) {
+	struct cv_timeout ct;
+	struct timeout to;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	if (ticks == 0) {
+		return ETIMEDOUT;
+	}
+	if (ticks > TIMEOUT_MAXTICKS) {
+		ticks = TIMEOUT_MAXTICKS;
+	}
+
+	ct.ct_cv = cv;
+	ct.ct_thread = curthread;
+	ct.ct_fired = false;
+	timeout_init(&to, cv_timedout, &ct);
+
+	// Arm it with the channel locked so it can't fire before we sleep
+	wchan_lock(&cv->cv_wchan);
+	lock_release(lock);
+	timeout_add(&to, ticks);
+		wchan_sleep(&cv->cv_wchan);
+	// Waits for cv_timedout if it's running, so ct is safe to drop
+	timeout_cancel(&to);
+	lock_acquire(lock);
+
+	return ct.ct_fired ? ETIMEDOUT : 0;
+}
+
 void cv_signal(struct cv *cv, struct lock *lock) {
 	KASSERT(cv != NULL);
 	KASSERT(lock != NULL);
-	wchan_wakeone(cv->cv_wchan);
+	wchan_wakeone(&cv->cv_wchan);
 }
 
 void cv_broadcast(struct cv *cv, struct lock *lock) {
 	KASSERT(cv != NULL);
 	KASSERT(lock != NULL);
-	wchan_wakeall(cv->cv_wchan);
+	wchan_wakeall(&cv->cv_wchan);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+struct rwlock * rwlock_create(const char *name) {
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	wchan_init_lock(&rw->rw_readwchan, rw->rw_name);
+	wchan_init_lock(&rw->rw_writewchan, rw->rw_name);
+	spinlock_init(&rw->rw_lock);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 0;
+	rw->rw_waitreaders = 0;
+	rw->rw_waitwriters = 0;
+	rw->rw_writergrant = false;
+
+	return rw;
+}
+
+void rwlock_destroy(struct rwlock *rw) {
+	KASSERT(rw != NULL);
+
+	// Nobody may hold it or be waiting for it
+	KASSERT(rw->rw_writer == NULL && rw->rw_readers == 0);
+	KASSERT(rw->rw_waitreaders == 0 && rw->rw_waitwriters == 0);
+	KASSERT(!rw->rw_writergrant);
+
+	wchan_cleanup(&rw->rw_readwchan);
+	wchan_cleanup(&rw->rw_writewchan);
+	spinlock_cleanup(&rw->rw_lock);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+// Hand the lock to the next waiting writer. The writer finds
+// rw_writergrant set when it wakes and makes itself the owner; until
+// then nobody else can get in. Called with rw_lock held.
+static void rwlock_grant_writer(struct rwlock *rw) {
+	KASSERT(rw->rw_waitwriters > 0);
+	rw->rw_waitwriters--;
+	rw->rw_writergrant = true;
+	wchan_wakeone(&rw->rw_writewchan);
+}
+
+void rwlock_acquire_read(struct rwlock *rw) {
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+
+	// Writer preference: queue behind any writer, held or waiting
+	if (rw->rw_writer == NULL && rw->rw_waitwriters == 0 &&
+	    !rw->rw_writergrant) {
+		rw->rw_readers++;
+		spinlock_release(&rw->rw_lock);
+		return;
+	}
+
+	rw->rw_waitreaders++;
+	wchan_lock(&rw->rw_readwchan);
+	spinlock_release(&rw->rw_lock);
+		wchan_sleep(&rw->rw_readwchan);
+		// The releasing writer already counted us in rw_readers
+}
+
+void rwlock_release_read(struct rwlock *rw) {
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_waitwriters > 0) {
+		rwlock_grant_writer(rw);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void rwlock_acquire_write(struct rwlock *rw) {
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+
+	if (rw->rw_writer == NULL && rw->rw_readers == 0 &&
+	    !rw->rw_writergrant) {
+		rw->rw_writer = curthread;
+		spinlock_release(&rw->rw_lock);
+		return;
+	}
+
+	rw->rw_waitwriters++;
+	wchan_lock(&rw->rw_writewchan);
+	spinlock_release(&rw->rw_lock);
+		wchan_sleep(&rw->rw_writewchan);
+		// Woken only by a grant; claim it
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writergrant && rw->rw_writer == NULL);
+	rw->rw_writergrant = false;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void rwlock_release_write(struct rwlock *rw) {
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+
+	// Waiting readers go next, all together, so a stream of writers
+	// can't shut them out; otherwise the next writer.
+	if (rw->rw_waitreaders > 0) {
+		rw->rw_readers += rw->rw_waitreaders;
+		rw->rw_waitreaders = 0;
+		wchan_wakeall(&rw->rw_readwchan);
+	}
+	else if (rw->rw_waitwriters > 0) {
+		rwlock_grant_writer(rw);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool rwlock_do_i_hold_write(struct rwlock *rw) {
+	return rw->rw_writer == curthread;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Barrier.
+//
+// Nothing else wakes its wchan, so a party that wakes up knows the round
+// is over and returns without looking at the barrier again; the last
+// party does its wakeall holding b_lock, so once barrier_destroy has had
+// b_lock nobody is still using it.
+
+struct barrier * barrier_create(const char *name, unsigned parties) {
+	struct barrier *b;
+
+	KASSERT(parties > 0);
+
+	b = kmalloc(sizeof(struct barrier));
+	if (b == NULL) {
+		return NULL;
+	}
+
+	b->b_name = kstrdup(name);
+	if (b->b_name == NULL) {
+		kfree(b);
+		return NULL;
+	}
+
+	wchan_init(&b->b_wchan, b->b_name);
+	spinlock_init(&b->b_lock);
+	b->b_parties = parties;
+	b->b_arrived = 0;
+
+	return b;
+}
+
+void barrier_destroy(struct barrier *b) {
+	KASSERT(b != NULL);
+
+	// Wait for the last party of the round to finish waking the rest
+	spinlock_acquire(&b->b_lock);
+	KASSERT(b->b_arrived == 0);
+	spinlock_release(&b->b_lock);
+
+	wchan_cleanup(&b->b_wchan);
+	spinlock_cleanup(&b->b_lock);
+
+	kfree(b->b_name);
+	kfree(b);
+}
+
+bool barrier_wait(struct barrier *b) {
+	KASSERT(b != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&b->b_lock);
+	if (++b->b_arrived == b->b_parties) {
+		b->b_arrived = 0;
+		wchan_wakeall(&b->b_wchan);
+		spinlock_release(&b->b_lock);
+		return true;
+	}
+	wchan_lock(&b->b_wchan);
+	spinlock_release(&b->b_lock);
+	wchan_sleep(&b->b_wchan);
+	return false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Completion. Same arrangement as barriers.
+
+struct completion * completion_create(const char *name) {
+	struct completion *cm;
+
+	cm = kmalloc(sizeof(struct completion));
+	if (cm == NULL) {
+		return NULL;
+	}
+
+	cm->cm_name = kstrdup(name);
+	if (cm->cm_name == NULL) {
+		kfree(cm);
+		return NULL;
+	}
+
+	wchan_init(&cm->cm_wchan, cm->cm_name);
+	spinlock_init(&cm->cm_lock);
+	cm->cm_done = false;
+
+	return cm;
+}
+
+void completion_destroy(struct completion *cm) {
+	KASSERT(cm != NULL);
+
+	// Wait for complete to finish waking everyone
+	spinlock_acquire(&cm->cm_lock);
+	spinlock_release(&cm->cm_lock);
+
+	wchan_cleanup(&cm->cm_wchan);
+	spinlock_cleanup(&cm->cm_lock);
+
+	kfree(cm->cm_name);
+	kfree(cm);
+}
+
+void completion_wait(struct completion *cm) {
+	KASSERT(cm != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&cm->cm_lock);
+	if (cm->cm_done) {
+		spinlock_release(&cm->cm_lock);
+		return;
+	}
+	wchan_lock(&cm->cm_wchan);
+	spinlock_release(&cm->cm_lock);
+	wchan_sleep(&cm->cm_wchan);
+}
+
+void complete(struct completion *cm) {
+	KASSERT(cm != NULL);
+
+	spinlock_acquire(&cm->cm_lock);
+	if (!cm->cm_done) {
+		cm->cm_done = true;
+		wchan_wakeall(&cm->cm_wchan);
+	}
+	spinlock_release(&cm->cm_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Byte-range lock.
+//
+// Every range, held or wanted, is on one list in the order it was asked
+// for. A range may be held once nothing ahead of it on the list
+// conflicts with it; a release wakes everyone to look again. The lists
+// are as long as the number of threads using the thing at once, so
+// walking them is cheap.
+
+void rangelock_init(struct rangelock *rl, const char *name) {
+	spinlock_init(&rl->rl_lock);
+	wchan_init(&rl->rl_wchan, name);
+	rl->rl_head = NULL;
+	rl->rl_tail = &rl->rl_head;
+}
+
+void rangelock_cleanup(struct rangelock *rl) {
+	// Nobody may hold a range or be waiting for one
+	KASSERT(rl->rl_head == NULL);
+
+	wchan_cleanup(&rl->rl_wchan);
+	spinlock_cleanup(&rl->rl_lock);
+}
+
+// Whether some range asked for before RR conflicts with it. Called
+// with rl_lock held.
+static bool rangelock_blocked(struct rangelock *rl, struct rlrange *rr) {
+	struct rlrange *r;
+
+	for (r = rl->rl_head; r != rr; r = r->rr_next) {
+		if ((r->rr_write || rr->rr_write) &&
+		    r->rr_start < rr->rr_end && rr->rr_start < r->rr_end) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void rangelock_acquire(struct rangelock *rl, struct rlrange *rr,
+		       off_t start, off_t end, bool write) {
+	KASSERT(rl != NULL);
+	KASSERT(start <= end);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	rr->rr_start = start;
+	rr->rr_end = end;
+	rr->rr_write = write;
+	rr->rr_next = NULL;
+
+	spinlock_acquire(&rl->rl_lock);
+	*rl->rl_tail = rr;
+	rl->rl_tail = &rr->rr_next;
+	while (rangelock_blocked(rl, rr)) {
+		wchan_lock(&rl->rl_wchan);
+		spinlock_release(&rl->rl_lock);
+		wchan_sleep(&rl->rl_wchan);
+		spinlock_acquire(&rl->rl_lock);
+	}
+	spinlock_release(&rl->rl_lock);
+}
+
+void rangelock_release(struct rangelock *rl, struct rlrange *rr) {
+	struct rlrange **rp;
+
+	KASSERT(rl != NULL);
+
+	spinlock_acquire(&rl->rl_lock);
+	for (rp = &rl->rl_head; *rp != rr; rp = &(*rp)->rr_next) {
+		KASSERT(*rp != NULL);
+	}
+	*rp = rr->rr_next;
+	if (rl->rl_tail == &rr->rr_next) {
+		rl->rl_tail = rp;
+	}
+	if (rl->rl_head != NULL) {
+		wchan_wakeall(&rl->rl_wchan);
+	}
+	spinlock_release(&rl->rl_lock);
 }
@@ -33,10 +33,14 @@
 
 #define THREADINLINE
 
+#define KMTAG KMT_THREAD
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/ioprio.h>
 #include <lib.h>
 #include <array.h>
+#include <clock.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -50,19 +54,43 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem.h>
+#include <trace.h>
+#include <softint.h>
+#include <lathist.h>
+#include <percpu.h>
 
 #include "opt-synchprobs.h"
+#include "opt-uniprocessor.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
-/* Wait channel. */
-struct wchan {
-	const char *wc_name;		/* name for this channel */
-	struct threadlist wc_threads;	/* list of waiting threads */
-	struct spinlock wc_lock;	/* lock for mutual exclusion */
+/*
+ * Exited threads each cpu keeps for reuse, and the size of the name
+ * buffer a reusable thread has (longer names get their own).
+ */
+#define THREAD_POOL_MAX 8
+#define THREAD_NAMEBUF 32
+
+/* Object caches for struct thread and struct wchan. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
+/*
+ * Sleep queues: every sleeping thread is on the one its wait channel
+ * hashes to, marked with the channel in t_sleepwc. The first
+ * SLEEPQ_COUNT are for ordinary channels and the rest for those of
+ * locks; see wchan.h.
+ */
+#define SLEEPQ_COUNT 64
+struct sleepq {
+	struct spinlock sq_lock;	/* the lock of each channel here */
+	struct threadlist sq_threads;	/* sleepers, oldest first */
 };
+static struct sleepq sleepqs[2 * SLEEPQ_COUNT];
+static bool sleepqs_ready;
 
 /* Master array of CPUs. */
 DECLARRAY(cpu);
@@ -72,6 +100,86 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Scheduler clock, advanced by cpu 0 once per hardclock. Only used to
+ * time how long threads wait in run queues, so unlocked reads are fine.
+ */
+static volatile unsigned sched_now;
+
+/*
+ * Histogram of run queue waits: bucket i counts waits of less than
+ * 2^i ticks (the last bucket takes everything longer).
+ */
+#define SCHED_WAITBUCKETS 10
+static DEFINE_PERCPU_COUNTER(sched_waithist[SCHED_WAITBUCKETS]);
+static DEFINE_PERCPU_COUNTER(sched_dispatches);
+static DEFINE_PERCPU_COUNTER(sched_handoffs);
+static DEFINE_PERCPU_COUNTER(sched_migrations);
+
+/*
+ * Load balancing between busy cpus (see thread_balance). Each cpu's
+ * load average is the number of threads it has running or ready,
+ * decayed by 1/2^SCHED_LOAD_DECAY every SCHED_LOAD_TICKS, in fixed
+ * point with SCHED_LOAD_SHIFT bits of fraction; about a sixth of a
+ * second's history at the rates here. Every SCHED_BALANCE_TICKS a
+ * busy cpu takes one thread from the busiest if that has been at least
+ * SCHED_BALANCE_MARGIN ahead on average and is two threads ahead now
+ * (one thread ahead is as even as it gets), and only a thread that
+ * hasn't moved cpus in the last SCHED_MIGRATE_HOLD ticks.
+ */
+#define SCHED_LOAD_SHIFT	8
+#define SCHED_LOAD_ONE		(1U << SCHED_LOAD_SHIFT)
+#define SCHED_LOAD_DECAY	4
+#define SCHED_LOAD_TICKS	(HZ / 100)
+#define SCHED_BALANCE_TICKS	(HZ / 10)
+#define SCHED_BALANCE_MARGIN	(SCHED_LOAD_ONE * 3 / 2)
+#define SCHED_MIGRATE_HOLD	(HZ / 2)
+
+/*
+ * Fair share weights by nice value, from SCHED_NICE_MIN up; each is
+ * about 1.25 times the next, so one nice step is about 10% of the CPU.
+ */
+static const unsigned sched_niceweights[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705,
+	14949, 11916,  9548,  7620,  6100,  4904,  3906,  3121,
+	 2501,  1991,  1586,  1277,  1024,   820,   655,   526,
+	  423,   335,   272,   215,   172,   137,   110,    87,
+	   70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static int thread_fork_common(const char *name, struct proc *proc,
+			      cpumask_t affinity, int policy, unsigned rtprio,
+			      void (*entrypoint)(void *, unsigned long),
+			      void *data1, unsigned long data2);
+
+/* Run queue order and accounting, below the scheduler */
+static bool sched_validclass(int policy, unsigned rtprio);
+static void sched_applyclass(struct thread *t);
+static bool sched_before(const struct thread *a, uint64_t akey,
+			 const struct thread *b);
+static void runqueue_insert(struct cpu *c, struct thread *t);
+static struct thread *runqueue_peek(struct cpu *c);
+static bool sched_keepcpu(struct thread *cur, struct thread *next);
+static void sched_wakepreempt(struct cpu *c, struct thread *t);
+static uint64_t sched_vruntime(struct thread *t);
+static void sched_charge(struct thread *t);
+static void thread_wakeboost(struct thread *t);
+static void thread_wakeplace(struct thread *t);
+static void thread_notewake(struct thread *t);
+static struct thread *sched_handoff(struct thread *target,
+				    struct thread *next);
+static bool thread_cpu_ok(const struct thread *t, const struct cpu *c);
+static struct cpu *thread_pickcpu(struct thread *t);
+static void thread_migrate(void);
+static cpumask_t thread_cpus_present(void);
+static void thread_account_dispatch(struct thread *next);
+static void thread_notemigrate(struct thread *t);
+
+/* Work stealing and balancing, below the scheduler */
+static struct thread *thread_steal(void);
+static void thread_balance(void);
+static void thread_kick_idle(struct cpu *targetcpu);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -112,34 +220,60 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Copy a thread name into a new buffer, THREAD_NAMEBUF bytes if it
+ * fits so the buffer can be reused for the thread's successors.
  */
 static
-struct thread *
-thread_create(const char *name)
+char *
+thread_namedup(const char *name)
 {
-	struct thread *thread;
-
-	DEBUGASSERT(name != NULL);
+	size_t len = strlen(name) + 1;
+	char *buf;
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	buf = kmalloc(len < THREAD_NAMEBUF ? THREAD_NAMEBUF : len);
+	if (buf != NULL) {
+		strcpy(buf, name);
 	}
+	return buf;
+}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
-	}
+/*
+ * Set up everything in a new (or reused) thread except its name and
+ * stack.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
+	thread->t_sleepwc = NULL;
 	thread->t_state = S_READY;
 
+	/* Scheduler fields */
+	thread->t_policy = SCHED_OTHER;
+	thread->t_rtprio = 0;
+	thread->t_basepolicy = SCHED_OTHER;
+	thread->t_basertprio = 0;
+	thread->t_piboost = 0;
+	thread->t_priority = 0;
+	thread->t_slice_used = 0;
+	thread->t_readytick = 0;
+	thread->t_migratetick = sched_now - SCHED_MIGRATE_HOLD;
+	thread->t_vkey = 0;
+	thread->t_vruntime = 0;
+	thread->t_lastwaker = NULL;
+	thread->t_handoff = NULL;
+	thread->t_affinity = CPUMASK_ALL;
+	bzero(&thread->t_schedstats, sizeof(thread->t_schedstats));
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+	thread->t_ioprio = IOPRIO_BE;
+	thread->t_pilock = NULL;
+	thread->t_pinext = NULL;
+	thread->t_pilocks = NULL;
+
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -148,8 +282,36 @@ thread_create(const char *name)
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	thread->t_rcu_depth = 0;
+	thread->t_in_softint = false;
 
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmem_cache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = thread_namedup(name);
+	if (thread->t_name == NULL) {
+		kmem_cache_free(thread_cache, thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -176,17 +338,51 @@ cpu_create(unsigned hardware_number)
 
 	c->c_self = c;
 	c->c_hardware_number = hardware_number;
+	c->c_percpu = percpu_create();
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	c->c_migrating = NULL;
+	threadlist_init(&c->c_threadpool);
 	c->c_hardclocks = 0;
+	c->c_tickless = false;
+	c->c_loadavg = 0;
+	c->c_rcu_qs = 0;
+	c->c_pagecache_count = 0;
+	c->c_mcsused = 0;
+	c->c_softints = NULL;
+	c->c_softinttail = &c->c_softints;
+	c->c_tlb_used = 0;
+	c->c_tlb_hand = 0;
+	c->c_tlb_lastfault = 0;
+	c->c_asid = 0;
+	c->c_curas = NULL;
+	c->c_asid_generation = 0;
+	c->c_klog = NULL;
+	c->c_trace = NULL;
+	bzero(c->c_syscall_stats, sizeof(c->c_syscall_stats));
+	c->c_timestate = CPUTIME_KERNEL;
+	c->c_timestamp = 0;
+	bzero(c->c_times, sizeof(c->c_times));
+	c->c_vmstatseq = 0;
+	bzero(c->c_vmstats, sizeof(c->c_vmstats));
 
 	c->c_isidle = false;
+	c->c_stealseed = hardware_number * 2654435761U + 1;
+	c->c_minvruntime = 0;
+	c->c_rtticks = 0;
+	c->c_rtthrottled = false;
+	c->c_resched = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	/* Every idle cpu polls the others' queues; keep handoff fair */
+	spinlock_setkind(&c->c_runqueue_lock, SPINLOCK_TICKET);
+	spinlock_profile(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_queued = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -227,6 +423,18 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -259,14 +467,16 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Unless this cpu's pool
+ * of threads to reuse is full, a zombie with its own stack and a
+ * reusable name buffer goes there instead, still holding them.
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu. Called with interrupts off.
  */
 static
 void
@@ -277,8 +487,46 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (z->t_stack != NULL &&
+		    strlen(z->t_name) < THREAD_NAMEBUF &&
+		    curcpu->c_threadpool.tl_count < THREAD_POOL_MAX) {
+			KASSERT(z->t_proc == NULL);
+			thread_checkstack(z);
+			thread_machdep_cleanup(&z->t_machdep);
+			z->t_wchan_name = "POOLED";
+			threadlist_addhead(&curcpu->c_threadpool, z);
+		}
+		else {
+			thread_destroy(z);
+		}
+	}
+}
+
+/*
+ * Get a thread from this cpu's pool, as thread_create would make it
+ * but with a stack already. Returns NULL if the pool is empty.
+ */
+static
+struct thread *
+thread_reuse(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	if (strlen(name) >= THREAD_NAMEBUF) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadpool);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
 	}
+
+	strcpy(thread->t_name, name);
+	thread_init(thread);
+	return thread;
 }
 
 /*
@@ -351,6 +599,11 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -387,7 +640,7 @@ thread_bootstrap(void)
  * New CPUs come here once MD initialization is finished. curthread
  * and curcpu should already be initialized.
  *
- * Other than clearing thread_start_cpus() to continue, we don't need
+ * Other than clearing thread_wait_cpus() to continue, we don't need
  * to do anything. The startup thread can just exit; we only need it
  * to be able to get into thread_switch() properly.
  */
@@ -398,6 +651,7 @@ cpu_hatch(unsigned software_number)
 	KASSERT(curthread != NULL);
 	KASSERT(curcpu->c_number == software_number);
 
+	mainbus_timer_start();
 	spl0();
 
 	kprintf("cpu%u: %s\n", software_number, cpu_identify());
@@ -407,18 +661,30 @@ cpu_hatch(unsigned software_number)
 }
 
 /*
- * Start up secondary cpus. Called from boot().
+ * Start up secondary cpus. Called from boot(), which must call
+ * thread_wait_cpus later on.
  */
 void
 thread_start_cpus(void)
 {
-	unsigned i;
-
 	kprintf("cpu0: %s\n", cpu_identify());
 
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
+	if (cpu_startup_sem == NULL) {
+		panic("thread_start_cpus: Out of memory\n");
+	}
 	mainbus_start_cpus();
+}
+
+/*
+ * Wait for the secondary cpus thread_start_cpus started to hatch.
+ */
+void
+thread_wait_cpus(void)
+{
+	unsigned i;
 
+	KASSERT(cpu_startup_sem != NULL);
 	for (i=0; i<cpuarray_num(&allcpus) - 1; i++) {
 		P(cpu_startup_sem);
 	}
@@ -450,7 +716,8 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_readytick = sched_now;
+	runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +725,12 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		sched_wakepreempt(targetcpu, target);
+		if (targetcpu->c_runqueue.tl_count > 1) {
+			thread_kick_idle(targetcpu);
+		}
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -472,31 +745,87 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  *
  * The new thread is created in the process P. If P is null, the
  * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * as the caller, unless the scheduler intervenes first. It may run on
+ * the same cpus as the caller too.
  */
 int
 thread_fork(const char *name,
 	    struct proc *proc,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, curthread->t_affinity,
+				  SCHED_OTHER, 0, entrypoint, data1, data2);
+}
+
+/*
+ * Create a new thread that may only run on the cpus in AFFINITY. It
+ * starts on the caller's cpu if that's one of them.
+ */
+int
+thread_fork_pinned(const char *name,
+		   struct proc *proc,
+		   cpumask_t affinity,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, affinity, SCHED_OTHER, 0,
+				  entrypoint, data1, data2);
+}
+
+/*
+ * Create a new thread in scheduling class POLICY at RTPRIO.
+ */
+int
+thread_fork_rt(const char *name,
+	       struct proc *proc,
+	       int policy, unsigned rtprio,
+	       void (*entrypoint)(void *data1, unsigned long data2),
+	       void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, curthread->t_affinity,
+				  policy, rtprio, entrypoint, data1, data2);
+}
+
+/*
+ * The guts of the thread_fork variants.
+ */
+static
+int
+thread_fork_common(const char *name,
+		   struct proc *proc,
+		   cpumask_t affinity,
+		   int policy, unsigned rtprio,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
 
+	if ((affinity & thread_cpus_present()) == 0) {
+		return EINVAL;
+	}
+	if (!sched_validclass(policy, rtprio)) {
+		return EINVAL;
+	}
+
 #ifdef UW
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	newthread = thread_reuse(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -505,7 +834,14 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
+	newthread->t_affinity = affinity;
+	newthread->t_policy = newthread->t_basepolicy = policy;
+	newthread->t_rtprio = newthread->t_basertprio = rtprio;
+	newthread->t_ioprio = curthread->t_ioprio;
 	newthread->t_cpu = curthread->t_cpu;
+	if (!thread_cpu_ok(newthread, newthread->t_cpu)) {
+		newthread->t_cpu = thread_pickcpu(newthread);
+	}
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -547,7 +883,8 @@ static
 void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
-	struct thread *cur, *next;
+	struct thread *cur, *next, *handoff;
+	unsigned timestate;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -570,11 +907,31 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Not allowed inside an RCU read section; otherwise quiescent. */
+	KASSERT(cur->t_rcu_depth == 0);
+	curcpu->c_rcu_qs++;
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Whoever we woke onto this cpu last is only worth going to
+	 * directly if we're blocking now; it's forgotten either way.
+	 */
+	handoff = NULL;
+	if (newstate == S_SLEEP || newstate == S_ZOMBIE) {
+		handoff = cur->t_handoff;
+	}
+	cur->t_handoff = NULL;
+
+	/*
+	 * Micro-optimization: if nothing to do, just return. That
+	 * includes yielding when nothing ready goes ahead of us; see
+	 * sched_keepcpu.
+	 */
+	if (newstate == S_READY &&
+	    sched_keepcpu(cur, runqueue_peek(curcpu->c_self))) {
+		curcpu->c_resched = false;
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -585,7 +942,21 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (thread_cpu_ok(cur, curcpu)) {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
+		else {
+			/*
+			 * We're not allowed here any more. We can't
+			 * go on another cpu's run queue while still on
+			 * our own stack, so leave it to whatever runs
+			 * next here; see thread_migrate. (If nothing
+			 * else is ready we returned above, and stay
+			 * until something is.)
+			 */
+			cur->t_wchan_name = "MIGRATING";
+			curcpu->c_migrating = cur;
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -602,7 +973,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * or want it locked and if it does can lock it itself
 		 * without racing. Exercise: what's the other?)
 		 */
-		threadlist_addtail(&wc->wc_threads, cur);
+		cur->t_sleepwc = wc;
+		threadlist_addtail(&wc->wc_sq->sq_threads, cur);
 		wchan_unlock(wc);
 		break;
 	    case S_ZOMBIE:
@@ -611,6 +983,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	}
 	cur->t_state = newstate;
+	if (newstate == S_SLEEP) {
+		cur->t_usage.tu_nvcsw++;
+	}
+	else if (newstate == S_READY) {
+		cur->t_usage.tu_nivcsw++;
+	}
 
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
@@ -629,17 +1007,50 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * What this cpu was doing for us, for time accounting; we put it
+	 * back when we next run, wherever that is.
+	 */
+	timestate = curcpu->c_timestate;
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
+		next = runqueue_peek(curcpu->c_self);
+		if (next != NULL && handoff != NULL) {
+			next = sched_handoff(handoff, next);
+		}
+		if (next != NULL) {
+			threadlist_remove(&curcpu->c_runqueue, next);
+		}
+		else {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				/*
+				 * Nothing to run: stop taking ticks
+				 * at HZ until there is. cpu 0 keeps
+				 * ticking since it drives the
+				 * scheduler's clock.
+				 */
+				if (curcpu->c_number != 0) {
+					mainbus_timer_idle();
+				}
+				cpu_timeswitch(CPUTIME_IDLE);
+				cpu_idle();
+				/* Finish off what woke us */
+				softint_run(IPL_HIGH);
+				cpu_timeswitch(timestate);
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	curcpu->c_resched = false;
+	mainbus_timer_resume();
+
+	thread_account_dispatch(next);
+	TRACE(TR_SWITCH, (uintptr_t)cur, (uintptr_t)next);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -708,9 +1119,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Charge the cpu's time to whatever we were doing. */
+	cpu_timeswitch(timestate);
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
+	/* Send off the thread we switched from, if it's moving. */
+	thread_migrate();
+
 	/* Clean up dead threads. */
 	exorcise();
 
@@ -741,9 +1158,15 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* New threads start out in the kernel. */
+	cpu_timeswitch(CPUTIME_KERNEL);
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
+	/* Send off the thread we switched from, if it's moving. */
+	thread_migrate();
+
 	/* Clean up dead threads. */
 	exorcise();
 
@@ -829,192 +1252,1139 @@ thread_yield(void)
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
-
-/*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
- */
-void
-thread_consider_migration(void)
-{
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct thread *cur = curthread;
+	struct threadlist aged;
+	struct threadlistnode *node;
 	struct thread *t;
+	int spl;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	spl = splhigh();
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (curcpu->c_number == 0) {
+		sched_now++;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	/*
+	 * Real-time threads aren't charged or demoted, but get only
+	 * SCHED_RT_RUNTIME ticks each period; once they've used them,
+	 * normal threads go first until the next.
+	 */
+	if (curcpu->c_hardclocks % SCHED_RT_PERIOD == 0 &&
+	    curcpu->c_rtticks > 0) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		curcpu->c_rtticks = 0;
+		if (curcpu->c_rtthrottled) {
+			curcpu->c_rtthrottled = false;
+			curcpu->c_resched = true;
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
-
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+	if (!curcpu->c_isidle && cur->t_policy != SCHED_OTHER) {
+		cur->t_schedstats.ss_ticks++;
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		if (++curcpu->c_rtticks >= SCHED_RT_RUNTIME &&
+		    !curcpu->c_rtthrottled) {
+			curcpu->c_rtthrottled = true;
+			curcpu->c_resched = true;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+	else if (!curcpu->c_isidle) {
+		/* Charge the running thread; demote it if its slice is used up */
+		cur->t_schedstats.ss_ticks++;
+		sched_charge(cur);
+		if (++cur->t_slice_used >= SCHED_QUANTUM(cur->t_priority)) {
+			cur->t_slice_used = 0;
+			if (cur->t_priority < SCHED_NLEVELS - 1) {
+				cur->t_priority++;
+				cur->t_schedstats.ss_demotions++;
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * Every so often, pull threads that have been waiting too long
+	 * back up to the top level so CPU hogs can't starve them.
 	 */
-	if (!threadlist_isempty(&victims)) {
+	if (curcpu->c_hardclocks % SCHED_STARVE_TICKS == 0) {
+		threadlist_init(&aged);
 		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		node = curcpu->c_runqueue.tl_head.tln_next;
+		while (node->tln_next != NULL) {
+			t = node->tln_self;
+			node = node->tln_next;
+			if (t->t_policy == SCHED_OTHER &&
+			    t->t_priority > 0 && t != curcpu->c_curthread &&
+			    sched_now - t->t_readytick >= SCHED_STARVE_TICKS) {
+				threadlist_remove(&curcpu->c_runqueue, t);
+				threadlist_addtail(&aged, t);
+			}
+		}
+		while ((t = threadlist_remhead(&aged)) != NULL) {
+			t->t_priority = 0;
+			t->t_slice_used = 0;
+			t->t_schedstats.ss_boosts++;
+			runqueue_insert(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
+		threadlist_cleanup(&aged);
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	splx(spl);
 }
 
-////////////////////////////////////////////////////////////
-
-/*
- * Wait channel functions
- */
-
 /*
- * Create a wait channel. NAME is a symbolic string name for it.
- * This is what's displayed by ps -alx in Unix.
- *
- * NAME should generally be a string constant. If it isn't, alternate
- * arrangements should be made to free it after the wait channel is
- * destroyed.
+ * Update this cpu's load average, and now and then even it out with
+ * the busiest cpu's. Called from hardclock(), idle or not, so an idle
+ * cpu's load decays too; though only as fast as it ticks once it has
+ * stopped ticking at HZ, which is why thread_balance ignores idle cpus.
+ * The run queue length is peeked at without the lock.
  */
-struct wchan *
-wchan_create(const char *name)
+void
+thread_loadtick(void)
 {
-	struct wchan *wc;
+	unsigned load, nthreads;
+	int spl;
 
-	wc = kmalloc(sizeof(*wc));
-	if (wc == NULL) {
-		return NULL;
+	if (curcpu->c_hardclocks % SCHED_LOAD_TICKS != 0) {
+		return;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
-	wc->wc_name = name;
-	return wc;
-}
 
-/*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
- */
-void
-wchan_destroy(struct wchan *wc)
-{
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	spl = splhigh();
+	nthreads = curcpu->c_runqueue.tl_count + (curcpu->c_isidle ? 0 : 1);
+	load = curcpu->c_loadavg;
+	load -= load >> SCHED_LOAD_DECAY;
+	load += (nthreads << SCHED_LOAD_SHIFT) >> SCHED_LOAD_DECAY;
+	curcpu->c_loadavg = load;
+
+	if (!curcpu->c_isidle &&
+	    curcpu->c_hardclocks % SCHED_BALANCE_TICKS == 0) {
+		thread_balance();
+	}
+	splx(spl);
 }
 
 /*
- * Lock and unlock a wait channel, respectively.
+ * Whether POLICY and RTPRIO make a scheduling class.
  */
-void
-wchan_lock(struct wchan *wc)
+static
+bool
+sched_validclass(int policy, unsigned rtprio)
 {
-	spinlock_acquire(&wc->wc_lock);
+	switch (policy) {
+	    case SCHED_OTHER:
+		return rtprio == 0;
+	    case SCHED_FIFO:
+	    case SCHED_RR:
+		return rtprio >= SCHED_RTPRIO_MIN && rtprio <= SCHED_RTPRIO_MAX;
+	}
+	return false;
 }
 
-void
-wchan_unlock(struct wchan *wc)
+int
+thread_setsched(int policy, unsigned rtprio)
 {
-	spinlock_release(&wc->wc_lock);
-}
+	int spl;
 
-/*
- * Yield the cpu to another process, and go to sleep, on the specified
+	if (!sched_validclass(policy, rtprio)) {
+		return EINVAL;
+	}
+	spl = splhigh();
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curthread->t_basepolicy = policy;
+	curthread->t_basertprio = rtprio;
+	sched_applyclass(curthread);
+	curthread->t_slice_used = 0;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	splx(spl);
+
+	/* We may have gone below something that's ready */
+	thread_yield();
+	return 0;
+}
+
+void
+thread_getsched(int *policy, unsigned *rtprio)
+{
+	*policy = curthread->t_basepolicy;
+	*rtprio = curthread->t_basertprio;
+}
+
+int
+thread_setioprio(int ioclass)
+{
+	if (ioclass < 0 || ioclass >= IOPRIO_NCLASSES) {
+		return EINVAL;
+	}
+	curthread->t_ioprio = ioclass;
+	return 0;
+}
+
+int
+thread_getioprio(void)
+{
+	return curthread->t_ioprio;
+}
+
+/*
+ * Set T's class to its own, or to what it has inherited if that's
+ * higher. Called with T's cpu's run queue locked.
+ */
+static
+void
+sched_applyclass(struct thread *t)
+{
+	t->t_policy = t->t_basepolicy;
+	t->t_rtprio = t->t_basertprio;
+	if (t->t_piboost > t->t_rtprio) {
+		if (t->t_policy == SCHED_OTHER) {
+			t->t_policy = SCHED_FIFO;
+		}
+		t->t_rtprio = t->t_piboost;
+	}
+}
+
+void
+thread_setboost(struct thread *t, unsigned boost)
+{
+	struct cpu *c;
+	struct thread *onlist;
+	int spl;
+
+	KASSERT(boost <= SCHED_RTPRIO_MAX);
+
+	/* T may be moving; holding its cpu's run queue lock pins it */
+	spl = splhigh();
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	THREADLIST_FORALL(onlist, c->c_runqueue) {
+		if (onlist == t) {
+			break;
+		}
+	}
+	if (onlist != NULL) {
+		threadlist_remove(&c->c_runqueue, t);
+	}
+	t->t_piboost = boost;
+	sched_applyclass(t);
+	if (onlist != NULL) {
+		runqueue_insert(c, t);
+		if (!c->c_isidle) {
+			sched_wakepreempt(c, t);
+		}
+	}
+
+	spinlock_release(&c->c_runqueue_lock);
+	splx(spl);
+}
+
+void
+thread_preempt(void)
+{
+	if (curcpu->c_resched && curthread->t_rcu_depth == 0 &&
+	    !curthread->t_in_softint) {
+		thread_yield();
+	}
+}
+
+unsigned
+thread_niceweight(int nice)
+{
+	KASSERT(nice >= SCHED_NICE_MIN && nice <= SCHED_NICE_MAX);
+	return sched_niceweights[nice - SCHED_NICE_MIN];
+}
+
+/*
+ * The user process T's virtual runtime is kept in, or NULL if T keeps
+ * its own.
+ */
+static
+struct proc *
+sched_proc(struct thread *t)
+{
+	struct proc *p = t->t_proc;
+
+	return (p == NULL || p == kproc) ? NULL : p;
+}
+
+/*
+ * T's virtual runtime as it stands.
+ */
+static
+uint64_t
+sched_vruntime(struct thread *t)
+{
+	struct proc *p = sched_proc(t);
+	uint64_t v;
+
+	if (p == NULL) {
+		return t->t_vruntime;
+	}
+	spinlock_acquire(&p->p_lock);
+	v = p->p_vruntime;
+	spinlock_release(&p->p_lock);
+	return v;
+}
+
+/*
+ * Charge T for a tick of CPU, weighted by its process's nice value.
+ */
+static
+void
+sched_charge(struct thread *t)
+{
+	struct proc *p = sched_proc(t);
+
+	if (p == NULL) {
+		t->t_vruntime += SCHED_VTICK;
+		return;
+	}
+	spinlock_acquire(&p->p_lock);
+	p->p_vruntime += SCHED_VTICK * SCHED_VTICK /
+		thread_niceweight(p->p_nice);
+	spinlock_release(&p->p_lock);
+}
+
+/*
+ * T's place in C's run queue among threads of its level: its virtual
+ * runtime, after bringing that up to within SCHED_VCREDIT of what C
+ * has been running if it fell behind while asleep.
+ */
+static
+uint64_t
+sched_queuekey(struct cpu *c, struct thread *t)
+{
+	struct proc *p = sched_proc(t);
+	uint64_t floor, v;
+
+	floor = c->c_minvruntime > SCHED_VCREDIT ?
+		c->c_minvruntime - SCHED_VCREDIT : 0;
+	if (p == NULL) {
+		if (t->t_vruntime < floor) {
+			t->t_vruntime = floor;
+		}
+		return t->t_vruntime;
+	}
+	spinlock_acquire(&p->p_lock);
+	if (p->p_vruntime < floor) {
+		p->p_vruntime = floor;
+	}
+	v = p->p_vruntime;
+	spinlock_release(&p->p_lock);
+	return v;
+}
+
+/*
+ * True if A, with fair share key AKEY, goes ahead of B: real-time
+ * threads first, by priority, then the rest by level and fair share.
+ */
+static
+bool
+sched_before(const struct thread *a, uint64_t akey, const struct thread *b)
+{
+	bool art = a->t_policy != SCHED_OTHER;
+	bool brt = b->t_policy != SCHED_OTHER;
+
+	if (art != brt) {
+		return art;
+	}
+	if (art) {
+		return a->t_rtprio > b->t_rtprio;
+	}
+	if (a->t_priority != b->t_priority) {
+		return a->t_priority < b->t_priority;
+	}
+	return akey < b->t_vkey;
+}
+
+/*
+ * Put T in C's run queue behind every thread that goes ahead of it,
+ * and behind those level with it. Searching from the tail makes the
+ * common case, with everything at one level and T the one that's had
+ * the most, constant time.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *onlist;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t->t_vkey = sched_queuekey(c, t);
+	THREADLIST_FORALL_REV(onlist, c->c_runqueue) {
+		if (!sched_before(t, t->t_vkey, onlist)) {
+			threadlist_insertafter(&c->c_runqueue, onlist, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * The thread C should run next, left in the queue: the head, unless
+ * real-time threads are throttled and there's a normal one behind
+ * them. NULL if there's nothing.
+ */
+static
+struct thread *
+runqueue_peek(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (threadlist_isempty(&c->c_runqueue)) {
+		return NULL;
+	}
+	if (c->c_rtthrottled) {
+		THREADLIST_FORALL(t, c->c_runqueue) {
+			if (t->t_policy == SCHED_OTHER) {
+				return t;
+			}
+		}
+	}
+	return c->c_runqueue.tl_head.tln_next->tln_self;
+}
+
+/*
+ * Whether CUR, yielding, should keep the cpu rather than give it to
+ * NEXT (from runqueue_peek): if nothing else is ready, or CUR goes
+ * ahead of it, or CUR is SCHED_FIFO and level with it. A throttled
+ * real-time thread gives way to any normal one.
+ */
+static
+bool
+sched_keepcpu(struct thread *cur, struct thread *next)
+{
+	if (next == NULL) {
+		return true;
+	}
+	if (!thread_cpu_ok(cur, curcpu)) {
+		return false;
+	}
+	if (cur->t_policy != SCHED_OTHER && curcpu->c_rtthrottled &&
+	    next->t_policy == SCHED_OTHER) {
+		return false;
+	}
+	if (cur->t_policy == SCHED_FIFO && next->t_policy != SCHED_OTHER &&
+	    next->t_rtprio == cur->t_rtprio) {
+		return true;
+	}
+	return sched_before(cur, sched_vruntime(cur), next);
+}
+
+/*
+ * The current thread is blocking just after waking TARGET onto this
+ * cpu, as when passing a request or a reply along and waiting for the
+ * answer. If TARGET is still on our run queue, run it now instead of
+ * NEXT (from runqueue_peek), so the exchange doesn't wait out the
+ * whole run queue each way. Real-time threads still come first.
+ * TARGET may have run and gone since, so it's only looked at once it
+ * has been found on the queue. Called with the run queue locked.
+ */
+static
+struct thread *
+sched_handoff(struct thread *target, struct thread *next)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (target == next || next->t_policy != SCHED_OTHER) {
+		return next;
+	}
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		if (t == target) {
+			if (t->t_policy != SCHED_OTHER &&
+			    curcpu->c_rtthrottled) {
+				break;
+			}
+			percpu_counter_inc(&sched_handoffs);
+			return t;
+		}
+	}
+	return next;
+}
+
+/*
+ * T, a real-time thread, has just been put on the run queue of C,
+ * which isn't idle. If it goes ahead of what C is running, have C
+ * switch to it now, by IPI if C isn't us, rather than at its next
+ * tick. Called with C's run queue locked.
+ */
+static
+void
+sched_wakepreempt(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (t->t_policy == SCHED_OTHER || c->c_rtthrottled || c->c_resched ||
+	    !sched_before(t, t->t_vkey, c->c_curthread)) {
+		return;
+	}
+	c->c_resched = true;
+	if (c != curcpu->c_self) {
+		ipi_send(c, IPI_RESCHED);
+	}
+}
+
+/*
+ * A thread woken from a wait channel has been waiting rather than
+ * computing; move it up a level and give it a fresh slice.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+		t->t_schedstats.ss_boosts++;
+	}
+	t->t_slice_used = 0;
+}
+
+/*
+ * Pick the cpu for a thread being woken from a wait channel. It stays
+ * on the one it last ran on unless running it here saves interrupting
+ * that cpu:
+ *
+ *   - we're in an interrupt on an idle cpu (a disk completion, say),
+ *     which looks at its run queue as soon as the interrupt returns;
+ *   - or the thread and we keep waking each other up (ping-pong, or a
+ *     producer and consumer), so we're likely about to sleep ourselves,
+ *     and nothing else is waiting to run here.
+ *
+ * A busy old cpu still gets an idle one kicked to steal the thread, in
+ * thread_make_runnable. Moving the thread must wait for its old cpu to
+ * finish switching away from it, which that cpu does holding its run
+ * queue lock; and if that cpu went idle instead, it's still on the
+ * thread's stack and the thread can't move at all (as in thread_steal).
+ * The run queue length here is peeked at without the lock; a wrong
+ * guess only costs some latency.
+ */
+static
+void
+thread_wakeplace(struct thread *t)
+{
+#if OPT_UNIPROCESSOR
+	/* There's only the one cpu to be on. */
+	(void)t;
+#else
+	struct cpu *prev = t->t_cpu;
+	struct cpu *dest;
+	bool pull;
+
+	if (curthread->t_in_interrupt) {
+		t->t_lastwaker = NULL;
+		pull = curcpu->c_isidle;
+	}
+	else {
+		t->t_lastwaker = curthread;
+		pull = curthread->t_lastwaker == t &&
+			threadlist_isempty(&curcpu->c_runqueue);
+	}
+
+	/* It also has to move if its affinity no longer allows PREV. */
+	if (!thread_cpu_ok(t, prev)) {
+		dest = thread_pickcpu(t);
+	}
+	else if (pull && prev != curcpu->c_self &&
+		 thread_cpu_ok(t, curcpu)) {
+		dest = curcpu->c_self;
+	}
+	else {
+		return;
+	}
+
+	spinlock_acquire(&prev->c_runqueue_lock);
+	if (prev->c_curthread != t) {
+		t->t_cpu = dest;
+		thread_notemigrate(t);
+		if (dest == curcpu->c_self) {
+			t->t_schedstats.ss_pulls++;
+		}
+	}
+	spinlock_release(&prev->c_runqueue_lock);
+#endif
+}
+
+/*
+ * We're waking T; if it's headed for this cpu, remember it, so if we
+ * block before our next switch we can hand the cpu straight to it (see
+ * sched_handoff). Only the first such wakeup counts. Wakeups from
+ * interrupt handlers don't: the thread they interrupted didn't ask.
+ */
+static
+void
+thread_notewake(struct thread *t)
+{
+	if (!curthread->t_in_interrupt && curthread->t_handoff == NULL &&
+	    t->t_cpu == curcpu->c_self) {
+		curthread->t_handoff = t;
+	}
+}
+
+/*
+ * Record how long NEXT waited in the run queue, now that it's about to
+ * run, and move the cpu's fair share clock up to it. Called from
+ * thread_switch with the run queue locked.
+ */
+static
+void
+thread_account_dispatch(struct thread *next)
+{
+	unsigned wait, bucket;
+
+	if (next->t_policy == SCHED_OTHER &&
+	    next->t_vkey > curcpu->c_minvruntime) {
+		curcpu->c_minvruntime = next->t_vkey;
+	}
+
+	wait = sched_now - next->t_readytick;
+	next->t_schedstats.ss_runs++;
+	next->t_schedstats.ss_waitticks += wait;
+	if (wait > next->t_schedstats.ss_maxwait) {
+		next->t_schedstats.ss_maxwait = wait;
+	}
+
+	for (bucket = 0; bucket < SCHED_WAITBUCKETS - 1; bucket++) {
+		if (wait < (1U << bucket)) {
+			break;
+		}
+	}
+
+	percpu_counter_inc(&sched_waithist[bucket]);
+	percpu_counter_inc(&sched_dispatches);
+}
+
+/*
+ * T has just been moved to another cpu. Called with interrupts off.
+ */
+static
+void
+thread_notemigrate(struct thread *t)
+{
+	t->t_migratetick = sched_now;
+	t->t_schedstats.ss_migrations++;
+	percpu_counter_inc(&sched_migrations);
+}
+
+void
+thread_printschedstats(void)
+{
+	static uint64_t lastmigrations, lastnsecs;
+	unsigned hist[SCHED_WAITBUCKETS], total, handoffs, i;
+	uint64_t migrations, nsecs;
+	time_t secs;
+	uint32_t ns;
+	struct thread *t;
+	struct cpu *c;
+
+	for (i=0; i<SCHED_WAITBUCKETS; i++) {
+		hist[i] = percpu_counter_sum(&sched_waithist[i]);
+	}
+	total = percpu_counter_sum(&sched_dispatches);
+	handoffs = percpu_counter_sum(&sched_handoffs);
+
+	/* Migrations per second are since the last time we were asked */
+	migrations = percpu_counter_sum(&sched_migrations);
+	gettime(&secs, &ns);
+	nsecs = (uint64_t)secs * 1000000000 + ns;
+	kprintf("Migrations: %llu, %llu/s\n",
+		(unsigned long long)migrations,
+		nsecs > lastnsecs ? (unsigned long long)
+		((migrations - lastmigrations) * 1000000000 /
+		 (nsecs - lastnsecs)) : 0ULL);
+	lastmigrations = migrations;
+	lastnsecs = nsecs;
+
+	kprintf("Scheduler: %u dispatches (%u handed off), "
+		"run queue wait (ticks):\n", total, handoffs);
+	for (i=0; i<SCHED_WAITBUCKETS; i++) {
+		if (i < SCHED_WAITBUCKETS - 1) {
+			kprintf("    < %4u: %u\n", 1U << i, hist[i]);
+		}
+		else {
+			kprintf("   >= %4u: %u\n", 1U << (i-1), hist[i]);
+		}
+	}
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		kprintf("cpu%u: %u ready, load %u.%02u\n", c->c_number,
+			c->c_runqueue.tl_count,
+			c->c_loadavg >> SCHED_LOAD_SHIFT,
+			(c->c_loadavg & (SCHED_LOAD_ONE - 1)) * 100 /
+			SCHED_LOAD_ONE);
+		THREADLIST_FORALL(t, c->c_runqueue) {
+			if (t->t_policy != SCHED_OTHER) {
+				kprintf("    %-16s %s %u, ", t->t_name,
+					t->t_policy == SCHED_FIFO ?
+					"fifo" : "rr", t->t_rtprio);
+			}
+			else {
+				kprintf("    %-16s level %u, ", t->t_name,
+					t->t_priority);
+			}
+			kprintf("%u runs, %u ticks, "
+				"wait avg %u max %u, +%u -%u, %u pulled, "
+				"%u moved\n",
+				t->t_schedstats.ss_runs, t->t_schedstats.ss_ticks,
+				t->t_schedstats.ss_runs ?
+				t->t_schedstats.ss_waitticks /
+				t->t_schedstats.ss_runs : 0,
+				t->t_schedstats.ss_maxwait,
+				t->t_schedstats.ss_boosts,
+				t->t_schedstats.ss_demotions,
+				t->t_schedstats.ss_pulls,
+				t->t_schedstats.ss_migrations);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
+
+/*
+ * Work stealing.
+ *
+ * Instead of busy CPUs pushing threads away on a timer, a CPU that is
+ * about to go idle takes a ready thread off the tail of some other
+ * CPU's run queue. Victims are tried starting from a random CPU, and
+ * each queue's length is peeked at without its lock so that only a
+ * queue that looks non-empty gets locked.
+ *
+ * Called from thread_switch with interrupts off and without our own
+ * run queue lock held. Returns the stolen thread, now belonging to
+ * this CPU, or NULL.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+#if OPT_UNIPROCESSOR
+	/* Nobody to steal from. */
+	return NULL;
+#else
+	struct cpu *self = curcpu->c_self;
+	struct cpu *c;
+	struct thread *t;
+	unsigned numcpus, start, i;
+	uint32_t x;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 2) {
+		return NULL;
+	}
+
+	/* xorshift; quality doesn't matter much here */
+	x = self->c_stealseed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	self->c_stealseed = x;
+	start = x % numcpus;
+
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c == self || c->c_runqueue.tl_count == 0) {
+			continue;
+		}
+
+		/*
+		 * Take the last thread that may run here. Skip one
+		 * that is the other cpu's current thread: that cpu
+		 * went idle while it slept, and it has been woken but
+		 * the cpu hasn't switched away from it yet; it's still
+		 * running on its stack, so it can't move. (See
+		 * thread_switch.)
+		 */
+		spinlock_acquire(&c->c_runqueue_lock);
+		THREADLIST_FORALL_REV(t, c->c_runqueue) {
+			if (t != c->c_curthread && thread_cpu_ok(t, self)) {
+				break;
+			}
+		}
+		if (t != NULL) {
+			threadlist_remove(&c->c_runqueue, t);
+			t->t_cpu = self;
+			thread_notemigrate(t);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+
+		if (t != NULL) {
+			DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+			      t->t_name, c->c_number, self->c_number);
+			return t;
+		}
+	}
+
+	return NULL;
+#endif
+}
+
+/*
+ * Load balancing between busy cpus, which never steal: take a thread
+ * from the busiest other cpu if it has had more than its share for a
+ * while (see SCHED_BALANCE_MARGIN). Averages and queue lengths are
+ * peeked at without locks. The thread is chosen as thread_steal
+ * chooses, except that threads that moved recently stay put, so a
+ * burst can't bounce them back and forth.
+ *
+ * Called from thread_loadtick with interrupts off.
+ */
+static
+void
+thread_balance(void)
+{
+#if OPT_UNIPROCESSOR
+	/* Nothing to balance with. */
+#else
+	struct cpu *self = curcpu->c_self;
+	struct cpu *c, *busiest;
+	struct thread *t;
+	unsigned numcpus, most, i;
+
+	busiest = NULL;
+	most = self->c_loadavg;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != self && !c->c_isidle && c->c_loadavg > most) {
+			busiest = c;
+			most = c->c_loadavg;
+		}
+	}
+	if (busiest == NULL ||
+	    most - self->c_loadavg < SCHED_BALANCE_MARGIN ||
+	    busiest->c_runqueue.tl_count < self->c_runqueue.tl_count + 2) {
+		return;
+	}
+
+	spinlock_acquire(&busiest->c_runqueue_lock);
+	THREADLIST_FORALL_REV(t, busiest->c_runqueue) {
+		if (t != busiest->c_curthread && thread_cpu_ok(t, self) &&
+		    sched_now - t->t_migratetick >= SCHED_MIGRATE_HOLD) {
+			break;
+		}
+	}
+	if (t != NULL) {
+		threadlist_remove(&busiest->c_runqueue, t);
+		t->t_cpu = self;
+		thread_notemigrate(t);
+	}
+	spinlock_release(&busiest->c_runqueue_lock);
+
+	if (t == NULL) {
+		return;
+	}
+	spinlock_acquire(&self->c_runqueue_lock);
+	runqueue_insert(self, t);
+	spinlock_release(&self->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Balanced thread %s: cpu %u -> %u\n",
+	      t->t_name, busiest->c_number, self->c_number);
+#endif
+}
+
+/*
+ * TARGETCPU has just been given more work than it can start on right
+ * away. Nudge some idle cpu so it comes and steals it rather than
+ * waiting for its next timer tick. The c_isidle flags are read without
+ * locks; a wrong guess only costs an extra interrupt or a tick of
+ * latency.
+ */
+static
+void
+thread_kick_idle(struct cpu *targetcpu)
+{
+#if OPT_UNIPROCESSOR
+	/* No other cpu to kick. */
+	(void)targetcpu;
+#else
+	unsigned numcpus, start, i;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	start = targetcpu->c_number + 1;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c != targetcpu && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Cpu affinity. Each thread has a mask of the cpus it may run on,
+ * inherited by the threads it forks. Nothing puts a thread on a cpu
+ * outside its mask: fork picks another cpu, work stealing and wakeup
+ * placement skip it, and a thread whose mask changes under it moves at
+ * its next context switch (or its next wakeup, if that's sooner).
+ */
+
+/* Is T allowed to run on C? */
+static
+bool
+thread_cpu_ok(const struct thread *t, const struct cpu *c)
+{
+	return (t->t_affinity & CPUMASK_CPU(c->c_number)) != 0;
+}
+
+/* The cpus that exist. */
+static
+cpumask_t
+thread_cpus_present(void)
+{
+	unsigned numcpus = cpuarray_num(&allcpus);
+
+	return numcpus >= 32 ? CPUMASK_ALL : CPUMASK_CPU(numcpus) - 1;
+}
+
+/*
+ * Choose a cpu for T to go to: an idle one it may run on if there is
+ * one, or else the allowed one with the shortest run queue. Queues
+ * are only peeked at, without their locks. T's mask must name some
+ * cpu that exists.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	unsigned numcpus, start, i;
+	struct cpu *c, *best = NULL;
+
+	numcpus = cpuarray_num(&allcpus);
+	start = curcpu->c_number;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (!thread_cpu_ok(t, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		if (best == NULL ||
+		    c->c_runqueue.tl_count < best->c_runqueue.tl_count) {
+			best = c;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Called after each context switch, on the new thread's stack, to
+ * hand the thread switched away from on to a cpu it may run on if it
+ * was leaving this one. Interrupts are off.
+ */
+static
+void
+thread_migrate(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_migrating;
+	if (t == NULL) {
+		return;
+	}
+	curcpu->c_migrating = NULL;
+	t->t_cpu = thread_pickcpu(t);
+	thread_make_runnable(t, false);
+}
+
+int
+thread_setaffinity(cpumask_t mask)
+{
+	if ((mask & thread_cpus_present()) == 0) {
+		return EINVAL;
+	}
+	curthread->t_affinity = mask;
+	if (!thread_cpu_ok(curthread, curcpu)) {
+		thread_yield();
+	}
+	return 0;
+}
+
+cpumask_t
+thread_getaffinity(void)
+{
+	return curthread->t_affinity;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Wait channel functions
+ */
+
+/*
+ * Set up the sleep queues. The first wait channels are made by
+ * proc_bootstrap, before thread_bootstrap and while there is still
+ * only one thread, so this can be done on first use without racing.
+ */
+static
+void
+sleepq_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<2 * SLEEPQ_COUNT; i++) {
+		spinlock_init(&sleepqs[i].sq_lock);
+		spinlock_setkind(&sleepqs[i].sq_lock, SPINLOCK_TICKET);
+		threadlist_init(&sleepqs[i].sq_threads);
+	}
+	sleepqs_ready = true;
+}
+
+/*
+ * Set up a wait channel whose sleepers go in the set of sleep queues
+ * starting at FIRST.
+ */
+static
+void
+wchan_setup(struct wchan *wc, const char *name, unsigned first)
+{
+	uintptr_t key;
+
+	if (!sleepqs_ready) {
+		sleepq_bootstrap();
+	}
+	/* Channels are at least word aligned; skip the bits that aren't */
+	key = (uintptr_t)wc >> 3;
+	key ^= key >> 6;
+	wc->wc_sq = &sleepqs[first + key % SLEEPQ_COUNT];
+	wc->wc_name = name;
+	wc->wc_latslot = lat_wchanslot(name);
+}
+
+/*
+ * Set up a wait channel embedded in some other structure. NAME must
+ * last as long as the channel does.
+ */
+void
+wchan_init(struct wchan *wc, const char *name)
+{
+	wchan_setup(wc, name, 0);
+}
+
+/*
+ * Same, for the wait channel of a lock.
+ */
+void
+wchan_init_lock(struct wchan *wc, const char *name)
+{
+	wchan_setup(wc, name, SLEEPQ_COUNT);
+}
+
+/*
+ * Clean up a wait channel from wchan_init. Must be empty and unlocked.
+ */
+void
+wchan_cleanup(struct wchan *wc)
+{
+	KASSERT(!spinlock_do_i_hold(&wc->wc_sq->sq_lock));
+	KASSERT(wchan_isempty(wc));
+	wc->wc_sq = NULL;
+}
+
+/*
+ * Create a wait channel. NAME is a symbolic string name for it.
+ * This is what's displayed by ps -alx in Unix.
+ *
+ * NAME should generally be a string constant. If it isn't, alternate
+ * arrangements should be made to free it after the wait channel is
+ * destroyed.
+ */
+struct wchan *
+wchan_create(const char *name)
+{
+	struct wchan *wc;
+
+	/* Like the sleep queues, made on first use */
+	if (wchan_cache == NULL) {
+		wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+						NULL);
+		if (wchan_cache == NULL) {
+			return NULL;
+		}
+	}
+
+	wc = kmem_cache_alloc(wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+	wchan_init(wc, name);
+	return wc;
+}
+
+/*
+ * Destroy a wait channel. Must be empty and unlocked.
+ * (The corresponding cleanup functions require this.)
+ */
+void
+wchan_destroy(struct wchan *wc)
+{
+	wchan_cleanup(wc);
+	kmem_cache_free(wchan_cache, wc);
+}
+
+/*
+ * Lock and unlock a wait channel, respectively. This is really its
+ * sleep queue, so no two channels' locks may be held at once unless
+ * they're from different sets of queues.
+ */
+void
+wchan_lock(struct wchan *wc)
+{
+	spinlock_acquire(&wc->wc_sq->sq_lock);
+}
+
+void
+wchan_unlock(struct wchan *wc)
+{
+	spinlock_release(&wc->wc_sq->sq_lock);
+}
+
+/*
+ * Take the longest-sleeping thread on WC off its sleep queue, or
+ * return NULL if there isn't one. The queue must be locked.
+ */
+static
+struct thread *
+sleepq_remove(struct wchan *wc)
+{
+	struct sleepq *sq = wc->wc_sq;
+	struct threadlistnode *tln;
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&sq->sq_lock));
+
+	for (tln = sq->sq_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		t = tln->tln_self;
+		if (t->t_sleepwc == wc) {
+			threadlist_remove(&sq->sq_threads, t);
+			t->t_sleepwc = NULL;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Yield the cpu to another process, and go to sleep, on the specified
  * wait channel WC. Calling wakeup on the channel will make the thread
  * runnable again. The channel must be locked, and will be *unlocked*
  * upon return.
@@ -1022,10 +2392,17 @@ wchan_unlock(struct wchan *wc)
 void
 wchan_sleep(struct wchan *wc)
 {
+	/* The channel may be gone by the time we wake up */
+	unsigned latslot = wc->wc_latslot;
+	uint64_t start;
+
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+	TRACE(TR_SLEEP, (uintptr_t)wc, 0);
+	start = lat_now();
 	thread_switch(S_SLEEP, wc);
+	lat_record(latslot, start);
 }
 
 /*
@@ -1037,22 +2414,50 @@ wchan_wakeone(struct wchan *wc)
 	struct thread *target;
 
 	/* Lock the channel and grab a thread from it */
-	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
+	wchan_lock(wc);
+	target = sleepq_remove(wc);
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
 	 */
-	spinlock_release(&wc->wc_lock);
+	wchan_unlock(wc);
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
 		return;
 	}
 
+	TRACE(TR_WAKE, (uintptr_t)wc, (uintptr_t)target);
+	thread_wakeboost(target);
+	thread_wakeplace(target);
+	thread_notewake(target);
 	thread_make_runnable(target, false);
 }
 
+/*
+ * Wake up thread T if it is sleeping on wait channel WC. Returns true
+ * if it was (and is now runnable), false if it wasn't there.
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct thread *t)
+{
+	wchan_lock(wc);
+	if (t->t_sleepwc != wc) {
+		wchan_unlock(wc);
+		return false;
+	}
+	threadlist_remove(&wc->wc_sq->sq_threads, t);
+	t->t_sleepwc = NULL;
+	wchan_unlock(wc);
+
+	TRACE(TR_WAKE, (uintptr_t)wc, (uintptr_t)t);
+	thread_wakeboost(t);
+	thread_wakeplace(t);
+	thread_notewake(t);
+	thread_make_runnable(t, false);
+	return true;
+}
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
@@ -1060,33 +2465,78 @@ void
 wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct threadlist list, placed;
+	struct cpu *targetcpu;
+	unsigned n, i, count;
+	bool isidle;
 
 	threadlist_init(&list);
+	TRACE(TR_WAKE, (uintptr_t)wc, 0);
 
 	/*
 	 * Lock the channel and grab all the threads, moving them to a
 	 * private list.
 	 */
-	spinlock_acquire(&wc->wc_lock);
-	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+	wchan_lock(wc);
+	while ((target = sleepq_remove(wc)) != NULL) {
 		threadlist_addtail(&list, target);
 	}
 	/*
 	 * Nobody else can wake up these threads now, so we don't need
 	 * to hang onto the lock.
 	 */
-	spinlock_release(&wc->wc_lock);
+	wchan_unlock(wc);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Decide where each thread goes first; thread_wakeplace may
+	 * need the old cpu's run queue lock, so no run queue can be
+	 * locked yet.
 	 */
+	threadlist_init(&placed);
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wakeboost(target);
+		thread_wakeplace(target);
+		thread_notewake(target);
+		threadlist_addtail(&placed, target);
+	}
+
+	/*
+	 * Then hand them out a cpu at a time: take the cpu of the
+	 * first thread left, lock its run queue once, move every
+	 * thread headed there onto it, and wake or kick for the whole
+	 * batch at most once. Threads for other cpus go round to the
+	 * back of the list, so each pass over it is one rotation.
+	 */
+	while (!threadlist_isempty(&placed)) {
+		targetcpu = placed.tl_head.tln_next->tln_self->t_cpu;
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		isidle = targetcpu->c_isidle;
+		count = 0;
+		n = placed.tl_count;
+		for (i=0; i<n; i++) {
+			target = threadlist_remhead(&placed);
+			if (target->t_cpu != targetcpu) {
+				threadlist_addtail(&placed, target);
+				continue;
+			}
+			target->t_readytick = sched_now;
+			runqueue_insert(targetcpu, target);
+			if (!isidle) {
+				sched_wakepreempt(targetcpu, target);
+			}
+			count++;
+		}
+		KASSERT(count > 0);
+		if (isidle) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		if (targetcpu->c_runqueue.tl_count > 1) {
+			thread_kick_idle(targetcpu);
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 
+	threadlist_cleanup(&placed);
 	threadlist_cleanup(&list);
 }
 
@@ -1097,11 +2547,18 @@ wchan_wakeall(struct wchan *wc)
 bool
 wchan_isempty(struct wchan *wc)
 {
-	bool ret;
-
-	spinlock_acquire(&wc->wc_lock);
-	ret = threadlist_isempty(&wc->wc_threads);
-	spinlock_release(&wc->wc_lock);
+	struct threadlistnode *tln;
+	bool ret = true;
+
+	wchan_lock(wc);
+	for (tln = wc->wc_sq->sq_threads.tl_head.tln_next;
+	     tln->tln_next != NULL; tln = tln->tln_next) {
+		if (tln->tln_self->t_sleepwc == wc) {
+			ret = false;
+			break;
+		}
+	}
+	wchan_unlock(wc);
 
 	return ret;
 }
@@ -1118,17 +2575,29 @@ wchan_isempty(struct wchan *wc)
 void
 ipi_send(struct cpu *target, int code)
 {
+#if OPT_UNIPROCESSOR
+	/*
+	 * The only cpu is this one; if it's idle it looks at its run
+	 * queue as soon as the interrupt we're in returns.
+	 */
+	KASSERT(target == curcpu->c_self);
+	(void)code;
+#else
 	KASSERT(code >= 0 && code < 32);
 
 	spinlock_acquire(&target->c_ipi_lock);
 	target->c_ipi_pending |= (uint32_t)1 << code;
 	mainbus_send_ipi(target);
 	spinlock_release(&target->c_ipi_lock);
+#endif
 }
 
 void
 ipi_broadcast(int code)
 {
+#if OPT_UNIPROCESSOR
+	(void)code;
+#else
 	unsigned i;
 	struct cpu *c;
 
@@ -1138,28 +2607,62 @@ ipi_broadcast(int code)
 			ipi_send(c, code);
 		}
 	}
+#endif
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+unsigned
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mappings,
+		 unsigned n)
 {
-	int n;
+#if OPT_UNIPROCESSOR
+	(void)target;
+	(void)mappings;
+	(void)n;
+	panic("ipi_tlbshootdown: only one cpu\n");
+#else
+	unsigned i, ticket;
+	int num;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	num = target->c_numshootdown;
+	if (num != TLBSHOOTDOWN_ALL) {
+		if (n == 0 || num + n > TLBSHOOTDOWN_MAX) {
+			num = TLBSHOOTDOWN_ALL;
+		}
+		else {
+			for (i=0; i<n; i++) {
+				target->c_shootdown[num++] = mappings[i];
+			}
+		}
+		target->c_numshootdown = num;
 	}
+	ticket = ++target->c_shootdown_queued;
 
+	/* If an IPI is already on its way it will pick this up too */
+	if (target->c_ipi_pending == 0) {
+		mainbus_send_ipi(target);
+	}
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+#endif
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+#if OPT_UNIPROCESSOR
+	(void)target;
+	(void)ticket;
+#else
+	KASSERT(curthread->t_curspl == 0);
+
+	while ((int)(target->c_shootdown_done - ticket) < 0) {
+		/* spin; our own interrupts stay on meanwhile */
+	}
+#endif
 }
 
 void
@@ -1192,6 +2695,12 @@ interprocessor_interrupt(void)
 		 * interrupt; don't need to do anything else.
 		 */
 	}
+	if (bits & (1U << IPI_RESCHED)) {
+		/*
+		 * c_resched is already set; we yield on the way out
+		 * of the interrupt (thread_preempt).
+		 */
+	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
@@ -1202,6 +2711,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_queued;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -0,0 +1,203 @@
+/*
+ * Work queues. See workqueue.h.
+ */
+
+#define KMTAG KMT_THREAD
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <workqueue.h>
+
+/* Threads for kworkq */
+#define KWORKQ_THREADS	4
+
+struct workqueue {
+	const char *wq_name;
+	struct work *wq_head;		/* oldest first */
+	struct work **wq_tail;
+	struct spinlock wq_lock;
+	struct wchan *wq_wchan;		/* idle threads wait here */
+	struct wchan *wq_donewchan;	/* work_wait waits here */
+};
+
+struct workqueue *kworkq;
+
+/*
+ * Put W at the end of WQ's list and wake a thread for it. Call with
+ * wq_lock held.
+ */
+static
+void
+workqueue_link(struct workqueue *wq, struct work *w)
+{
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+
+	w->w_next = NULL;
+	*wq->wq_tail = w;
+	wq->wq_tail = &w->w_next;
+	wchan_wakeone(wq->wq_wchan);
+}
+
+static
+struct work *
+workqueue_unlink(struct workqueue *wq)
+{
+	struct work *w;
+
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+
+	w = wq->wq_head;
+	wq->wq_head = w->w_next;
+	if (wq->wq_head == NULL) {
+		wq->wq_tail = &wq->wq_head;
+	}
+	w->w_next = NULL;
+	return w;
+}
+
+static
+void
+workqueue_thread(void *vwq, unsigned long junk)
+{
+	struct workqueue *wq = vwq;
+	struct work *w;
+
+	(void)junk;
+
+	spinlock_acquire(&wq->wq_lock);
+	while (1) {
+		while (wq->wq_head == NULL) {
+			wchan_lock(wq->wq_wchan);
+			spinlock_release(&wq->wq_lock);
+			wchan_sleep(wq->wq_wchan);
+			spinlock_acquire(&wq->wq_lock);
+		}
+
+		w = workqueue_unlink(wq);
+		KASSERT(w->w_state == WORK_QUEUED);
+		w->w_state = WORK_RUNNING;
+		spinlock_release(&wq->wq_lock);
+
+		w->w_func(w->w_arg);
+
+		spinlock_acquire(&wq->wq_lock);
+		w->w_state &= ~WORK_RUNNING;
+		if (w->w_state & WORK_QUEUED) {
+			/* Queued again while it ran; go round again */
+			workqueue_link(wq, w);
+		}
+		else {
+			wchan_wakeall(wq->wq_donewchan);
+		}
+	}
+}
+
+struct workqueue *
+workqueue_create(const char *name, unsigned nthreads)
+{
+	struct workqueue *wq;
+	unsigned i;
+	int result;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		panic("workqueue_create: Out of memory\n");
+	}
+	wq->wq_name = name;
+	wq->wq_head = NULL;
+	wq->wq_tail = &wq->wq_head;
+	spinlock_init(&wq->wq_lock);
+	wq->wq_wchan = wchan_create(name);
+	wq->wq_donewchan = wchan_create(name);
+	if (wq->wq_wchan == NULL || wq->wq_donewchan == NULL) {
+		panic("workqueue_create: Out of memory\n");
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork(name, NULL, workqueue_thread, wq, 0);
+		if (result) {
+			panic("workqueue_create: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	return wq;
+}
+
+void
+workqueue_bootstrap(void)
+{
+	kworkq = workqueue_create("kwork", KWORKQ_THREADS);
+}
+
+/* Timeout function for work_enqueue_delayed */
+static
+void
+work_timedout(void *vw)
+{
+	struct work *w = vw;
+
+	work_enqueue(w->w_wq, w);
+}
+
+void
+work_init(struct work *w, void (*func)(void *), void *arg)
+{
+	w->w_next = NULL;
+	w->w_func = func;
+	w->w_arg = arg;
+	w->w_state = 0;
+	w->w_wq = NULL;
+	timeout_init(&w->w_timeout, work_timedout, w);
+}
+
+bool
+work_enqueue(struct workqueue *wq, struct work *w)
+{
+	KASSERT(w->w_wq == NULL || w->w_wq == wq);
+
+	spinlock_acquire(&wq->wq_lock);
+	w->w_wq = wq;
+	if (w->w_state & WORK_QUEUED) {
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+	w->w_state |= WORK_QUEUED;
+	if ((w->w_state & WORK_RUNNING) == 0) {
+		/* (Otherwise the thread running it puts it back) */
+		workqueue_link(wq, w);
+	}
+	spinlock_release(&wq->wq_lock);
+	return true;
+}
+
+void
+work_enqueue_delayed(struct workqueue *wq, struct work *w, unsigned ticks)
+{
+	KASSERT(w->w_wq == NULL || w->w_wq == wq);
+
+	w->w_wq = wq;
+	timeout_add(&w->w_timeout, ticks);
+}
+
+void
+work_wait(struct work *w)
+{
+	struct workqueue *wq = w->w_wq;
+
+	if (wq == NULL) {
+		/* never queued */
+		return;
+	}
+	spinlock_acquire(&wq->wq_lock);
+	while (w->w_state != 0) {
+		wchan_lock(wq->wq_donewchan);
+		spinlock_release(&wq->wq_lock);
+		wchan_sleep(wq->wq_donewchan);
+		spinlock_acquire(&wq->wq_lock);
+	}
+	spinlock_release(&wq->wq_lock);
+}
@@ -0,0 +1,966 @@
+/*
+ * Buffer cache. See buf.h for the interface.
+ *
+ * Buffers live in a hash table keyed by (device, block) and on one
+ * list in least-recently-used order. buf_lock covers both, and every
+ * field of every buffer except the data; the data belongs to whoever
+ * has the buffer busy. Disk I/O is done with the buffer busy but
+ * without buf_lock, so a miss or a write-back doesn't hold up hits on
+ * other blocks.
+ *
+ * Read-ahead requests go in a small ring and are read from kworkq, so
+ * whoever asked for them keeps going while the disk works. If the ring
+ * is full a request is just dropped.
+ *
+ * Dirty buffers are written by the flusher, a kworkq job that runs once
+ * a second and writes everything out, in ascending block order, when
+ * BUF_FLUSH_SECS have passed or at least BUF_DIRTY_HIGH buffers are
+ * dirty. Runs of consecutive blocks, up to BUF_CLUSTER of them, go to
+ * the device as a single transfer. Recycling prefers clean buffers, so
+ * writers only wait for the disk themselves when the flusher is behind.
+ *
+ * When memory runs low the VM system calls buf_shrink, which frees idle
+ * clean buffers from the old end of the LRU list; the cache grows back
+ * as blocks are asked for again.
+ *
+ * Held buffers (b_held) belong to a journaling filesystem's open
+ * transaction. Nothing here writes or recycles them until the
+ * filesystem lets go, so the filesystem must keep their number well
+ * below BUF_MAX.
+ */
+
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <workqueue.h>
+#include <device.h>
+#include <vm.h>
+#include <buf.h>
+#include <lathist.h>
+
+#define BUF_HASHSIZE  64
+#define BUF_RAQUEUE   32	/* read-aheads waiting at most */
+#define BUF_FLUSH_SECS  5	/* longest a write waits for the flusher */
+#define BUF_DIRTY_HIGH  (BUF_MAX / 2)	/* flush early past this many */
+#define BUF_CLUSTER   8		/* blocks written back in one transfer */
+
+struct buf {
+	struct device *b_dev;		/* NULL if not holding anything */
+	uint32_t b_block;
+	void *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* handed out, or being written */
+	bool b_held;			/* not to be written yet (buf_hold) */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list; oldest at the head */
+	struct buf *b_lrunext;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;		/* signalled when a buffer isn't busy */
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *buf_lruhead;
+static struct buf *buf_lrutail;
+static unsigned buf_count;
+static unsigned buf_ndirty;		/* buffers with b_dirty set */
+
+/* Read-ahead ring, also under buf_lock */
+static struct {
+	struct device *ra_dev;
+	uint32_t ra_block;
+} buf_raqueue[BUF_RAQUEUE];
+static unsigned buf_rahead, buf_racount;
+static struct work buf_rawork;		/* queued when the ring isn't empty */
+
+/* The flusher, and seconds since it last wrote anything */
+static struct work buf_flushwork;
+static unsigned buf_flushsecs;
+
+/*
+ * buf_flush_locked's sorted list; too big for a kernel stack. It's kept
+ * across buf_writeback, which drops buf_lock, so buf_flushbusy says
+ * somebody is using it.
+ */
+static struct buf *buf_flushlist[BUF_MAX];
+static bool buf_flushbusy;
+
+static void buf_rawork_run(void *unused);
+static void buf_flushwork_run(void *unused);
+static unsigned buf_shrink(unsigned npages);
+
+static struct shrinker buf_shrinker = { "buf", buf_shrink, NULL };
+
+void
+buf_bootstrap(void)
+{
+	buf_lock = lock_create("buf_lock");
+	buf_cv = cv_create("buf_cv");
+	if (buf_lock == NULL || buf_cv == NULL) {
+		panic("buf_bootstrap: Out of memory\n");
+	}
+
+	vm_register_shrinker(&buf_shrinker);
+
+	work_init(&buf_rawork, buf_rawork_run, NULL);
+	work_init(&buf_flushwork, buf_flushwork_run, NULL);
+	buf_flushsecs = 0;
+	work_enqueue_delayed(kworkq, &buf_flushwork, HZ);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists. Call with buf_lock held.
+
+static
+unsigned
+buf_hashfn(struct device *dev, uint32_t block)
+{
+	return ((uintptr_t)dev / sizeof(struct device) + block) % BUF_HASHSIZE;
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashinsert(struct buf *b)
+{
+	unsigned h = buf_hashfn(b->b_dev, b->b_block);
+
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **pp;
+
+	for (pp = &buf_hash[buf_hashfn(b->b_dev, b->b_block)]; *pp != b;
+	     pp = &(*pp)->b_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buf_lruaddtail(struct buf *b)
+{
+	b->b_lruprev = buf_lrutail;
+	b->b_lrunext = NULL;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+static
+void
+buf_lruaddhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Disk I/O
+
+/*
+ * Read or write the N consecutive blocks in BS, which the caller has
+ * busy, as one transfer.
+ */
+static
+int
+buf_io(struct buf **bs, unsigned n, enum uio_rw rw)
+{
+	struct device *dev = bs[0]->b_dev;
+	struct iovec iov[BUF_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	uint64_t start;
+	int result;
+	int tries=0;
+
+	KASSERT(n > 0 && n <= BUF_CLUSTER);
+	for (i=0; i<n; i++) {
+		KASSERT(bs[i]->b_busy);
+		KASSERT(bs[i]->b_dev == dev);
+		KASSERT(bs[i]->b_block == bs[0]->b_block + i);
+	}
+
+	DEBUG(DB_SFS, "buf: %s %u+%u\n", rw == UIO_READ ? "read" : "write",
+	      bs[0]->b_block, n);
+
+	start = lat_now();
+ retry:
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = bs[i]->b_data;
+		iov[i].iov_len = BUF_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)bs[0]->b_block * BUF_SIZE;
+	ku.uio_resid = n * BUF_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	result = dev->d_io(dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n",
+				bs[0]->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", bs[0]->b_block, tries);
+		}
+	}
+	lat_record(LAT_BUFIO, start);
+	return result;
+}
+
+/*
+ * Write back the N dirty buffers of consecutive blocks in BS, which
+ * nobody has busy. Drops buf_lock during the write, so the caller must
+ * look again at anything it found before.
+ */
+static
+int
+buf_writeback(struct buf **bs, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	for (i=0; i<n; i++) {
+		KASSERT(!bs[i]->b_busy);
+		KASSERT(bs[i]->b_dirty && bs[i]->b_valid);
+		bs[i]->b_busy = true;
+	}
+	lock_release(buf_lock);
+
+	result = buf_io(bs, n, UIO_WRITE);
+
+	lock_acquire(buf_lock);
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			bs[i]->b_dirty = false;
+			buf_ndirty--;
+		}
+		bs[i]->b_busy = false;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting buffers
+
+/*
+ * Make a new, empty buffer if we're allowed more. Call with buf_lock
+ * held.
+ */
+static
+struct buf *
+buf_create(void)
+{
+	struct buf *b;
+
+	if (buf_count >= BUF_MAX) {
+		return NULL;
+	}
+	b = kmalloc(sizeof(struct buf));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUF_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_held = false;
+	b->b_hashnext = NULL;
+	buf_lruaddhead(b);
+	buf_count++;
+	return b;
+}
+
+/*
+ * Find the buffer for block BLOCK of DEV, or set one up for it, and
+ * hand it back busy. b_valid says whether it has the data yet. Call
+ * with buf_lock held; it may be dropped and retaken while we wait.
+ */
+static
+struct buf *
+buf_getblk_locked(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	while (1) {
+		b = buf_lookup(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			break;
+		}
+
+		/*
+		 * Not cached. Make a buffer, or recycle the oldest idle
+		 * clean one, or failing that the oldest idle dirty one.
+		 */
+		b = buf_create();
+		if (b == NULL) {
+			struct buf *dirty = NULL;
+
+			for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+				if (b->b_busy || b->b_held) {
+					continue;
+				}
+				if (!b->b_dirty) {
+					break;
+				}
+				if (dirty == NULL) {
+					dirty = b;
+				}
+			}
+			if (b == NULL) {
+				b = dirty;
+			}
+			if (b == NULL) {
+				cv_wait(buf_cv, buf_lock);
+				continue;
+			}
+			if (b->b_dirty) {
+				result = buf_writeback(&b, 1);
+				if (result) {
+					kprintf("buf: block %u lost: %s\n",
+						b->b_block, strerror(result));
+					b->b_dirty = false;
+					buf_ndirty--;
+				}
+				/* We slept; someone may have our block now */
+				continue;
+			}
+			if (b->b_dev != NULL) {
+				buf_hashremove(b);
+			}
+		}
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_valid = false;
+		b->b_dirty = false;
+		buf_hashinsert(b);
+		break;
+	}
+
+	b->b_busy = true;
+	buf_lruremove(b);
+	buf_lruaddtail(b);
+	return b;
+}
+
+static
+struct buf *
+buf_getblk(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	b = buf_getblk_locked(dev, block);
+	lock_release(buf_lock);
+	return b;
+}
+
+int
+buf_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	b = buf_getblk(dev, block);
+	if (!b->b_valid) {
+		result = buf_io(&b, 1, UIO_READ);
+		if (result) {
+			buf_release(b);
+			return result;
+		}
+		b->b_valid = true;
+		curthread->t_usage.tu_inblock++;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Read or write N uncached consecutive blocks from BLOCK straight
+ * between the device and UIO. The device's offset isn't the uio's, so
+ * it's swapped in for the call.
+ */
+static
+int
+buf_iouncached(struct device *dev, uint32_t block, unsigned n,
+	       struct uio *uio)
+{
+	off_t offset;
+	size_t resid, len, done;
+	int result;
+
+	offset = uio->uio_offset;
+	resid = uio->uio_resid;
+	len = n * BUF_SIZE;
+
+	uio->uio_offset = (off_t)block * BUF_SIZE;
+	uio->uio_resid = len;
+	result = dev->d_io(dev, uio);
+	done = len - uio->uio_resid;
+
+	uio->uio_offset = offset + done;
+	uio->uio_resid = resid - done;
+	if (result == 0 && uio->uio_rw == UIO_READ) {
+		curthread->t_usage.tu_inblock += n;
+	}
+	else if (result == 0) {
+		curthread->t_usage.tu_oublock += n;
+	}
+	return result;
+}
+
+int
+buf_readdirect(struct device *dev, uint32_t block, unsigned n,
+	       struct uio *uio)
+{
+	struct buf *b;
+	unsigned i, run;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(uio->uio_resid >= n * BUF_SIZE);
+
+	i = 0;
+	while (i < n) {
+		/* Count the uncached blocks from here */
+		lock_acquire(buf_lock);
+		for (run = 0; i + run < n; run++) {
+			if (buf_lookup(dev, block + i + run) != NULL) {
+				break;
+			}
+		}
+		lock_release(buf_lock);
+
+		if (run > 0) {
+			/*
+			 * Not cached, so the disk has the latest. (Anyone
+			 * writing them now is racing with us anyway.)
+			 */
+			result = buf_iouncached(dev, block + i, run, uio);
+			if (result) {
+				return result;
+			}
+			i += run;
+			continue;
+		}
+
+		/* Cached, and perhaps newer than the disk: copy that */
+		result = buf_read(dev, block + i, &b);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buf_data(b), BUF_SIZE, uio);
+		buf_release(b);
+		if (result) {
+			return result;
+		}
+		i++;
+	}
+	return 0;
+}
+
+int
+buf_writedirect(struct device *dev, uint32_t block, unsigned n,
+		struct uio *uio)
+{
+	struct buf *b;
+	unsigned i, run;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_SIZE);
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(uio->uio_resid >= n * BUF_SIZE);
+
+	i = 0;
+	while (i < n) {
+		/* Count the uncached blocks from here */
+		lock_acquire(buf_lock);
+		for (run = 0; i + run < n; run++) {
+			if (buf_lookup(dev, block + i + run) != NULL) {
+				break;
+			}
+		}
+		lock_release(buf_lock);
+
+		if (run > 0) {
+			result = buf_iouncached(dev, block + i, run, uio);
+			if (result) {
+				return result;
+			}
+			i += run;
+			continue;
+		}
+
+		/* Cached, so change that copy rather than leave it stale */
+		result = buf_get(dev, block + i, &b);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buf_data(b), BUF_SIZE, uio);
+		if (result == 0) {
+			buf_markdirty(b);
+		}
+		buf_release(b);
+		if (result) {
+			return result;
+		}
+		i++;
+	}
+	return 0;
+}
+
+int
+buf_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+
+	b = buf_getblk(dev, block);
+	/* The caller is about to fill it in */
+	b->b_valid = true;
+	*ret = b;
+	return 0;
+}
+
+void *
+buf_data(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buf_markdirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	if (!b->b_dirty) {
+		lock_acquire(buf_lock);
+		b->b_dirty = true;
+		buf_ndirty++;
+		lock_release(buf_lock);
+		/* It'll be written later, but this is who wrote it */
+		curthread->t_usage.tu_oublock++;
+	}
+}
+
+int
+buf_hold(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+
+	lock_acquire(buf_lock);
+	if (b->b_held) {
+		lock_release(buf_lock);
+		return 0;
+	}
+	if (b->b_dirty) {
+		/*
+		 * What's there now has to reach the disk before the new
+		 * changes, and may never get another chance: write it.
+		 * We have it busy, so nobody else will.
+		 */
+		lock_release(buf_lock);
+		result = buf_io(&b, 1, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		lock_acquire(buf_lock);
+		b->b_dirty = false;
+		buf_ndirty--;
+	}
+	b->b_held = true;
+	lock_release(buf_lock);
+	return 0;
+}
+
+void
+buf_unhold(struct buf *b)
+{
+	KASSERT(b->b_busy);
+
+	lock_acquire(buf_lock);
+	KASSERT(b->b_held);
+	b->b_held = false;
+	lock_release(buf_lock);
+}
+
+bool
+buf_isheld(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_held;
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+void
+buf_readahead(struct device *dev, uint32_t block)
+{
+	unsigned slot;
+
+	lock_acquire(buf_lock);
+	if (buf_racount < BUF_RAQUEUE && buf_lookup(dev, block) == NULL) {
+		slot = (buf_rahead + buf_racount) % BUF_RAQUEUE;
+		buf_raqueue[slot].ra_dev = dev;
+		buf_raqueue[slot].ra_block = block;
+		buf_racount++;
+		work_enqueue(kworkq, &buf_rawork);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Read-ahead job: empty the ring. Takes the buffer while still holding
+ * buf_lock after taking a request off the ring, so buf_purge either
+ * drops the request or waits for the read.
+ */
+static
+void
+buf_rawork_run(void *unused)
+{
+	struct device *dev;
+	uint32_t block;
+	struct buf *b;
+	int result;
+
+	(void)unused;
+
+	lock_acquire(buf_lock);
+	while (buf_racount > 0) {
+		dev = buf_raqueue[buf_rahead].ra_dev;
+		block = buf_raqueue[buf_rahead].ra_block;
+		buf_rahead = (buf_rahead + 1) % BUF_RAQUEUE;
+		buf_racount--;
+
+		b = buf_getblk_locked(dev, block);
+		if (!b->b_valid) {
+			lock_release(buf_lock);
+			result = buf_io(&b, 1, UIO_READ);
+			lock_acquire(buf_lock);
+			if (result == 0) {
+				b->b_valid = true;
+			}
+		}
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole-device operations
+
+/*
+ * Write out the dirty buffers of DEV, or of every device if DEV is
+ * NULL, in ascending (device, block) order so the disk sweeps across
+ * once. Held buffers are left alone. If WAIT is set, buffers that are
+ * busy are waited for, and the first error stops the flush; otherwise busy buffers are skipped and
+ * errors are only reported. Call with buf_lock held.
+ */
+static
+int
+buf_flush_locked(struct device *dev, bool wait)
+{
+	struct buf **list = buf_flushlist;
+	struct buf *b;
+	unsigned i, j, n, run;
+	bool busy;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+ again:
+	/* The list is shared; wait out a flush that is writing from it */
+	while (buf_flushbusy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+	buf_flushbusy = true;
+
+	/* Collect them, sorting as we go */
+	n = 0;
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_dirty || b->b_held ||
+		    (dev != NULL && b->b_dev != dev)) {
+			continue;
+		}
+		for (j = n; j > 0; j--) {
+			if ((uintptr_t)list[j-1]->b_dev < (uintptr_t)b->b_dev ||
+			    (list[j-1]->b_dev == b->b_dev &&
+			     list[j-1]->b_block < b->b_block)) {
+				break;
+			}
+			list[j] = list[j-1];
+		}
+		list[j] = b;
+		n++;
+	}
+
+	busy = false;
+	for (i = 0; i < n; i += run) {
+		b = list[i];
+		run = 1;
+		/* We drop the lock for each write, so look again */
+		if (!b->b_dirty || b->b_held ||
+		    (dev != NULL && b->b_dev != dev)) {
+			continue;
+		}
+		if (b->b_busy) {
+			busy = true;
+			continue;
+		}
+
+		/* Take the following blocks along, as long as they qualify */
+		while (run < BUF_CLUSTER && i + run < n &&
+		       list[i+run]->b_dev == b->b_dev &&
+		       list[i+run]->b_block == b->b_block + run &&
+		       list[i+run]->b_dirty && !list[i+run]->b_busy &&
+		       !list[i+run]->b_held) {
+			run++;
+		}
+
+		result = buf_writeback(&list[i], run);
+		if (result) {
+			if (wait) {
+				buf_flushbusy = false;
+				cv_broadcast(buf_cv, buf_lock);
+				return result;
+			}
+			kprintf("buf: block %u: write failed: %s\n",
+				b->b_block, strerror(result));
+		}
+	}
+	buf_flushbusy = false;
+	cv_broadcast(buf_cv, buf_lock);
+
+	if (wait && busy) {
+		/* Let whoever has them finish, then go around again */
+		cv_wait(buf_cv, buf_lock);
+		goto again;
+	}
+	return 0;
+}
+
+int
+buf_flush(struct device *dev)
+{
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_flush_locked(dev, true);
+	lock_release(buf_lock);
+	return result;
+}
+
+/*
+ * Flusher. Runs once a second, rearming itself each time.
+ */
+static
+void
+buf_flushwork_run(void *unused)
+{
+	(void)unused;
+
+	buf_flushsecs++;
+
+	lock_acquire(buf_lock);
+	if (buf_ndirty >= BUF_DIRTY_HIGH ||
+	    (buf_ndirty > 0 && buf_flushsecs >= BUF_FLUSH_SECS)) {
+		buf_flush_locked(NULL, false);
+		buf_flushsecs = 0;
+	}
+	lock_release(buf_lock);
+
+	work_enqueue_delayed(kworkq, &buf_flushwork, HZ);
+}
+
+/*
+ * Shrinker: free up to NPAGES pages' worth of idle clean buffers,
+ * oldest first.
+ */
+static
+unsigned
+buf_shrink(unsigned npages)
+{
+	struct buf *b, *next;
+	unsigned want, n = 0;
+
+	if (lock_do_i_hold(buf_lock)) {
+		return 0;
+	}
+	want = npages * (PAGE_SIZE / BUF_SIZE);
+
+	lock_acquire(buf_lock);
+	for (b = buf_lruhead; b != NULL && n < want; b = next) {
+		next = b->b_lrunext;
+		if (b->b_busy || b->b_dirty || b->b_held) {
+			continue;
+		}
+		if (b->b_dev != NULL) {
+			buf_hashremove(b);
+		}
+		buf_lruremove(b);
+		buf_count--;
+		kfree(b->b_data);
+		kfree(b);
+		n++;
+	}
+	lock_release(buf_lock);
+
+	return n / (PAGE_SIZE / BUF_SIZE);
+}
+
+void
+buf_purge(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i, n, slot;
+
+	lock_acquire(buf_lock);
+
+	/* Drop read-aheads that haven't started */
+	n = buf_racount;
+	buf_racount = 0;
+	for (i = 0; i < n; i++) {
+		slot = (buf_rahead + i) % BUF_RAQUEUE;
+		if (buf_raqueue[slot].ra_dev != dev) {
+			buf_raqueue[(buf_rahead + buf_racount) % BUF_RAQUEUE] =
+				buf_raqueue[slot];
+			buf_racount++;
+		}
+	}
+
+ again:
+	for (b = buf_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			/* Only a read-ahead should still have one */
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		KASSERT(!b->b_dirty && !b->b_held);
+		buf_hashremove(b);
+		b->b_dev = NULL;
+		b->b_valid = false;
+		/* Reuse these first */
+		buf_lruremove(b);
+		buf_lruaddhead(b);
+	}
+	lock_release(buf_lock);
+}
@@ -33,11 +33,15 @@
  * These hand off to the functions in the VFS device structure (see dev.h)
  * but take care of a bunch of common tasks in a uniform fashion.
  */
+#define KMTAG KMT_VFS
+
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/poll.h>
 #include <stat.h>
 #include <lib.h>
+#include <kclock.h>
 #include <uio.h>
 #include <synch.h>
 #include <vnode.h>
@@ -241,15 +245,73 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. None of our devices can be mapped: mapped pages are
+ * moved with VOP_READ and VOP_WRITE at page granularity, which makes
+ * no sense for the console and would bypass the file system on a disk.
+ */
+static
+int
+dev_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+dev_getpage(struct vnode *v, uint32_t index, bool forwrite,
+	    struct fcpage **ret)
+{
+	(void)v;
+	(void)index;
+	(void)forwrite;
+	(void)ret;
+	return ENOSYS;
+}
+
+/*
+ * For posix_fadvise(). Devices have no read-ahead to tune.
+ */
+static
+int
+dev_advise(struct vnode *v, off_t pos, off_t len, int advice)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)advice;
+	return 0;
+}
+
+/*
+ * For sync_file_range(). Device I/O isn't held back anywhere.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_syncrange(struct vnode *v, off_t pos, off_t len, unsigned flags)
 {
 	(void)v;
-	return EUNIMP;
+	(void)pos;
+	(void)len;
+	(void)flags;
+	return 0;
+}
+
+/*
+ * For poll(). Devices that can make a reader wait for input have a
+ * d_poll; the rest are always ready.
+ */
+static
+int
+dev_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	struct device *d = v->vn_data;
+
+	if (d->d_poll == NULL) {
+		*revents = events & (POLLIN | POLLOUT);
+		return 0;
+	}
+	return d->d_poll(d, events, pw, revents);
 }
 
 /*
@@ -271,6 +333,37 @@ dev_truncate(struct vnode *v, off_t len)
 	return EINVAL;
 }
 
+/*
+ * For fallocate(). Devices are the size they are.
+ */
+static
+int
+dev_fallocate(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return ENODEV;
+}
+
+/*
+ * For copy_file_range(). There are no blocks to share, so the caller
+ * copies through a buffer.
+ */
+static
+int
+dev_copyrange(struct vnode *v, off_t pos, struct vnode *src,
+	      off_t spos, off_t len, off_t *copied)
+{
+	(void)v;
+	(void)pos;
+	(void)src;
+	(void)spos;
+	(void)len;
+	(void)copied;
+	return ENOSYS;
+}
+
 /*
  * For namefile (which implements "pwd")
  *
@@ -376,7 +469,7 @@ null_rename(struct vnode *v, const char *n1, struct vnode *v2, const char *n2)
 static
 int
 dev_lookup(struct vnode *dir,
-	   char *pathname, struct vnode **result)
+	   const char *pathname, struct vnode **result)
 {
 	/*
 	 * If the path was "device:", we get "". For that, return self.
@@ -394,7 +487,7 @@ dev_lookup(struct vnode *dir,
 static
 int
 dev_lookparent(struct vnode *dir,
-	       char *pathname, struct vnode **result,
+	       const char *pathname, struct vnode **result,
 	       char *namebuf, size_t buflen)
 {
 	/*
@@ -428,7 +521,13 @@ static const struct vnode_ops dev_vnode_ops = {
 	dev_tryseek,
 	null_fsync,
 	dev_mmap,
+	dev_getpage,
+	dev_advise,
+	dev_syncrange,
+	dev_poll,
 	dev_truncate,
+	dev_fallocate,
+	dev_copyrange,
 	dev_namefile,
 	null_creat,
 	null_symlink,
@@ -463,3 +562,179 @@ dev_create_vnode(struct device *dev)
 
 	return v;
 }
+
+////////////////////////////////////////////////////////////
+// I/O statistics
+
+static struct spinlock iostat_listlock = SPINLOCK_INITIALIZER;
+static struct iostat *iostat_list;
+static struct iostat **iostat_tail = &iostat_list;
+
+/*
+ * Set up IS and add it to the list, at the end so the disks come out
+ * in the order they attached.
+ */
+void
+iostat_register(struct iostat *is, const char *name)
+{
+	spinlock_init(&is->is_lock);
+	snprintf(is->is_name, sizeof(is->is_name), "%s", name);
+	bzero(&is->is_counts, sizeof(is->is_counts));
+	is->is_busysince = 0;
+	is->is_since = kclock_ns();
+	is->is_next = NULL;
+
+	spinlock_acquire(&iostat_listlock);
+	*iostat_tail = is;
+	iostat_tail = &is->is_next;
+	spinlock_release(&iostat_listlock);
+}
+
+/*
+ * A request is coming in. Returns the start time to give iostat_done.
+ */
+uint64_t
+iostat_start(struct iostat *is)
+{
+	struct iocounts *ic = &is->is_counts;
+	uint64_t now;
+
+	now = kclock_ns();
+	spinlock_acquire(&is->is_lock);
+	if (ic->ic_depth++ == 0) {
+		is->is_busysince = now;
+	}
+	if (ic->ic_depth > ic->ic_maxdepth) {
+		ic->ic_maxdepth = ic->ic_depth;
+	}
+	spinlock_release(&is->is_lock);
+	return now;
+}
+
+/*
+ * A request that came in at START is finished, having moved BYTES
+ * (or failed with RESULT).
+ */
+void
+iostat_done(struct iostat *is, uint64_t start, bool write, size_t bytes,
+	    int result)
+{
+	struct iocounts *ic = &is->is_counts;
+	uint64_t now;
+
+	now = kclock_ns();
+	spinlock_acquire(&is->is_lock);
+	KASSERT(ic->ic_depth > 0);
+	if (write) {
+		ic->ic_writes++;
+		ic->ic_wbytes += bytes;
+	}
+	else {
+		ic->ic_reads++;
+		ic->ic_rbytes += bytes;
+	}
+	if (result) {
+		ic->ic_errors++;
+	}
+	/* Either may be from another cpu, whose clock may be a little ahead */
+	if (start != 0 && now > start) {
+		ic->ic_totalns += now - start;
+	}
+	if (--ic->ic_depth == 0 && is->is_busysince != 0 &&
+	    now > is->is_busysince) {
+		ic->ic_busyns += now - is->is_busysince;
+	}
+	spinlock_release(&is->is_lock);
+}
+
+int
+iostat_get(unsigned num, const char **name, struct iocounts *ret,
+	   uint64_t *elapsed)
+{
+	struct iostat *is;
+	uint64_t now;
+
+	now = kclock_ns();
+	spinlock_acquire(&iostat_listlock);
+	for (is = iostat_list; is != NULL && num > 0; is = is->is_next) {
+		num--;
+	}
+	if (is == NULL) {
+		spinlock_release(&iostat_listlock);
+		return ENOENT;
+	}
+	spinlock_acquire(&is->is_lock);
+	*ret = is->is_counts;
+	if (ret->ic_depth > 0 && is->is_busysince != 0 &&
+	    now > is->is_busysince) {
+		ret->ic_busyns += now - is->is_busysince;
+	}
+	*elapsed = now > is->is_since ? now - is->is_since : 0;
+	spinlock_release(&is->is_lock);
+	*name = is->is_name;
+	spinlock_release(&iostat_listlock);
+	return 0;
+}
+
+/*
+ * Print the per-disk table: requests and kilobytes each way, the
+ * depth now and at most and on average (in hundredths), how much of
+ * the time the disk was busy, and the average service time and wait
+ * per request, in microseconds.
+ */
+void
+iostat_report(void)
+{
+	struct iocounts ic;
+	const char *name;
+	uint64_t elapsed;
+	unsigned i, n, util, avgdepth;
+
+	kprintf("%-8s %8s %8s %10s %10s %5s %5s %7s %5s %8s %8s\n",
+		"device", "reads", "writes", "read KB", "write KB", "depth",
+		"max", "avgdep", "util%", "svc us", "wait us");
+	for (i=0; iostat_get(i, &name, &ic, &elapsed) == 0; i++) {
+		n = ic.ic_reads + ic.ic_writes;
+		if (elapsed == 0) {
+			elapsed = 1;
+		}
+		util = ic.ic_busyns * 100 / elapsed;
+		avgdepth = ic.ic_totalns * 100 / elapsed;
+		kprintf("%-8s %8u %8u %10llu %10llu %5u %5u %4u.%02u %5u "
+			"%8llu %8llu\n", name, ic.ic_reads, ic.ic_writes,
+			ic.ic_rbytes / 1024, ic.ic_wbytes / 1024,
+			ic.ic_depth, ic.ic_maxdepth,
+			avgdepth / 100, avgdepth % 100, util,
+			n ? ic.ic_busyns / n / 1000 : 0,
+			n ? ic.ic_totalns / n / 1000 : 0);
+		if (ic.ic_errors > 0) {
+			kprintf("%-8s %u errors\n", "", ic.ic_errors);
+		}
+	}
+}
+
+/*
+ * Zero the counts. Requests in progress stay counted in the depth, so
+ * iostat_done still balances.
+ */
+void
+iostat_reset(void)
+{
+	struct iostat *is;
+	unsigned depth;
+	uint64_t now;
+
+	now = kclock_ns();
+	spinlock_acquire(&iostat_listlock);
+	for (is = iostat_list; is != NULL; is = is->is_next) {
+		spinlock_acquire(&is->is_lock);
+		depth = is->is_counts.ic_depth;
+		bzero(&is->is_counts, sizeof(is->is_counts));
+		is->is_counts.ic_depth = depth;
+		is->is_counts.ic_maxdepth = depth;
+		is->is_busysince = depth > 0 ? now : 0;
+		is->is_since = now;
+		spinlock_release(&is->is_lock);
+	}
+	spinlock_release(&iostat_listlock);
+}
@@ -31,6 +31,8 @@
  * Implementation of the null device, "null:", which generates an
  * immediate EOF on read and throws away anything written to it.
  */
+#define KMTAG KMT_VFS
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -112,6 +114,7 @@ devnull_create(void)
 	dev->d_close = nullclose;
 	dev->d_io = nullio;
 	dev->d_ioctl = nullioctl;
+	dev->d_poll = NULL;
 
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
@@ -0,0 +1,532 @@
+/*
+ * Striping (RAID-0) pseudo-device, "stripeN:", spread over several
+ * other block devices (normally lhd disks) so one volume gets the
+ * bandwidth of all of them.
+ *
+ * The device is cut into stripe units of sc_unit blocks, dealt out to
+ * the members in turn: unit U is unit U/n of member U%n. A run of
+ * blocks is then one run on each member, and a request that covers
+ * more than one member is split into one request per member, which
+ * run at the same time. Each member has a worker thread that does the
+ * requests for it; the caller does the last one itself and waits for
+ * the rest. The members' parts go through bounce buffers, since the
+ * workers can't get at the caller's address space; a request inside one
+ * stripe unit (a single buffer cache block, say) goes straight to its
+ * member instead.
+ *
+ * The members are opened raw and kept open. Nothing stops them being
+ * used directly as well, which will of course make a mess.
+ */
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Most blocks one member is asked for at a time, through a bounce buffer */
+#define STRIPE_MAXIO  64
+
+/*
+ * One member's share of a request.
+ */
+struct stripe_part {
+	struct stripe_part *p_next;     /* on the member's queue */
+	uint32_t p_sector;              /* first block on the member */
+	uint32_t p_n;                   /* number of blocks; 0 if none */
+	uint32_t p_fill;                /* blocks copied in or out so far */
+	char *p_buf;
+	enum uio_rw p_rw;
+	int p_result;
+	bool p_queued;                  /* given to the member's worker */
+	bool p_done;                    /* under sc_lock, if p_queued */
+};
+
+struct stripe_member {
+	struct vnode *m_vn;             /* the device, opened raw */
+	bool m_worker;                  /* has a worker thread; sc_lock */
+	struct cv *m_cv;                /* signalled when work is queued */
+	struct stripe_part *m_head;     /* work queue, under sc_lock */
+	struct stripe_part *m_tail;
+};
+
+struct stripe_softc {
+	unsigned sc_n;                  /* number of members */
+	uint32_t sc_unit;               /* blocks per stripe unit */
+	struct lock *sc_lock;           /* the work queues */
+	struct cv *sc_donecv;           /* signalled when a part is done */
+	struct stripe_member sc_members[DEVSTRIPE_MAXMEMBERS];
+	struct device sc_dev;
+};
+
+/* For naming them */
+static unsigned stripe_count;
+
+/*
+ * Find where device block SECTOR is: which member, which block on it,
+ * and how many blocks from there to the end of its stripe unit.
+ */
+static
+void
+stripe_map(struct stripe_softc *sc, uint32_t sector, unsigned *member,
+	   uint32_t *msector, uint32_t *left)
+{
+	uint32_t unit = sector / sc->sc_unit;
+	uint32_t off = sector % sc->sc_unit;
+
+	*member = unit % sc->sc_n;
+	*msector = (unit / sc->sc_n) * sc->sc_unit + off;
+	*left = sc->sc_unit - off;
+}
+
+/*
+ * Do part P on member M.
+ */
+static
+int
+stripe_partio(struct stripe_softc *sc, struct stripe_member *m,
+	      struct stripe_part *p)
+{
+	struct iovec iov;
+	struct uio u;
+	uint32_t bs = sc->sc_dev.d_blocksize;
+	int result;
+
+	uio_kinit(&iov, &u, p->p_buf, p->p_n * bs, (off_t)p->p_sector * bs,
+		  p->p_rw);
+	if (p->p_rw == UIO_READ) {
+		result = VOP_READ(m->m_vn, &u);
+	}
+	else {
+		result = VOP_WRITE(m->m_vn, &u);
+	}
+	if (result == 0 && u.uio_resid > 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+/*
+ * Worker thread for one member.
+ */
+static
+void
+stripe_worker(void *vsc, unsigned long which)
+{
+	struct stripe_softc *sc = vsc;
+	struct stripe_member *m = &sc->sc_members[which];
+	struct stripe_part *p;
+	int result;
+
+	while (1) {
+		lock_acquire(sc->sc_lock);
+		while (m->m_head == NULL) {
+			cv_wait(m->m_cv, sc->sc_lock);
+		}
+		p = m->m_head;
+		m->m_head = p->p_next;
+		if (m->m_head == NULL) {
+			m->m_tail = NULL;
+		}
+		lock_release(sc->sc_lock);
+
+		result = stripe_partio(sc, m, p);
+
+		/* P belongs to the caller again once p_done is set */
+		lock_acquire(sc->sc_lock);
+		p->p_result = result;
+		p->p_done = true;
+		cv_broadcast(sc->sc_donecv, sc->sc_lock);
+		lock_release(sc->sc_lock);
+	}
+}
+
+/*
+ * Copy between the uio and the parts' buffers, for device blocks
+ * SECTOR up to END, in order.
+ */
+static
+int
+stripe_copy(struct stripe_softc *sc, struct stripe_part *parts,
+	    uint32_t sector, uint32_t end, struct uio *uio)
+{
+	uint32_t bs = sc->sc_dev.d_blocksize;
+	uint32_t s, ms, len;
+	struct stripe_part *p;
+	unsigned m;
+	int result;
+
+	for (s = sector; s < end; s += len) {
+		stripe_map(sc, s, &m, &ms, &len);
+		if (len > end - s) {
+			len = end - s;
+		}
+		p = &parts[m];
+		result = uiomove(p->p_buf + p->p_fill * bs, len * bs, uio);
+		if (result) {
+			return result;
+		}
+		p->p_fill += len;
+	}
+	return 0;
+}
+
+/*
+ * Do as much of UIO as fits in one round: at most STRIPE_MAXIO blocks
+ * from each member, all at once.
+ */
+static
+int
+stripe_round(struct stripe_softc *sc, struct uio *uio)
+{
+	struct stripe_part parts[DEVSTRIPE_MAXMEMBERS];
+	struct stripe_part *p;
+	struct stripe_member *m;
+	uint32_t bs = sc->sc_dev.d_blocksize;
+	uint32_t sector, end, s, ms, len;
+	unsigned i, which, last;
+	int result = 0;
+
+	sector = uio->uio_offset / bs;
+	end = sector + uio->uio_resid / bs;
+
+	for (i=0; i<sc->sc_n; i++) {
+		parts[i].p_n = 0;
+		parts[i].p_fill = 0;
+		parts[i].p_buf = NULL;
+		parts[i].p_rw = uio->uio_rw;
+		parts[i].p_result = 0;
+		parts[i].p_queued = false;
+		parts[i].p_done = false;
+	}
+
+	/* Work out each member's part; each is a single run on it */
+	for (s = sector; s < end; s += len) {
+		stripe_map(sc, s, &which, &ms, &len);
+		if (len > end - s) {
+			len = end - s;
+		}
+		p = &parts[which];
+		if (p->p_n + len > STRIPE_MAXIO) {
+			break;
+		}
+		if (p->p_n == 0) {
+			p->p_sector = ms;
+		}
+		KASSERT(p->p_sector + p->p_n == ms);
+		p->p_n += len;
+	}
+	end = s;
+
+	last = sc->sc_n;
+	for (i=0; i<sc->sc_n; i++) {
+		if (parts[i].p_n == 0) {
+			continue;
+		}
+		parts[i].p_buf = kmalloc(parts[i].p_n * bs);
+		if (parts[i].p_buf == NULL) {
+			result = ENOMEM;
+			goto out;
+		}
+		last = i;
+	}
+	KASSERT(last < sc->sc_n);
+
+	if (uio->uio_rw == UIO_WRITE) {
+		result = stripe_copy(sc, parts, sector, end, uio);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* Hand out the parts, and do the last one here */
+	lock_acquire(sc->sc_lock);
+	for (i=0; i<last; i++) {
+		m = &sc->sc_members[i];
+		p = &parts[i];
+		if (p->p_n == 0 || !m->m_worker) {
+			continue;
+		}
+		p->p_next = NULL;
+		if (m->m_tail == NULL) {
+			m->m_head = p;
+		}
+		else {
+			m->m_tail->p_next = p;
+		}
+		m->m_tail = p;
+		p->p_queued = true;
+		cv_signal(m->m_cv, sc->sc_lock);
+	}
+	lock_release(sc->sc_lock);
+
+	for (i=0; i<=last; i++) {
+		p = &parts[i];
+		if (p->p_n > 0 && !p->p_queued) {
+			p->p_result = stripe_partio(sc, &sc->sc_members[i], p);
+		}
+	}
+
+	lock_acquire(sc->sc_lock);
+	for (i=0; i<last; i++) {
+		while (parts[i].p_queued && !parts[i].p_done) {
+			cv_wait(sc->sc_donecv, sc->sc_lock);
+		}
+	}
+	lock_release(sc->sc_lock);
+
+	for (i=0; i<=last; i++) {
+		if (parts[i].p_result != 0) {
+			result = parts[i].p_result;
+			goto out;
+		}
+	}
+
+	if (uio->uio_rw == UIO_READ) {
+		result = stripe_copy(sc, parts, sector, end, uio);
+	}
+
+ out:
+	for (i=0; i<sc->sc_n; i++) {
+		if (parts[i].p_buf != NULL) {
+			kfree(parts[i].p_buf);
+		}
+	}
+	return result;
+}
+
+/* For open() */
+static
+int
+stripe_open(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+/* For close() */
+static
+int
+stripe_close(struct device *dev)
+{
+	(void)dev;
+	return 0;
+}
+
+static
+int
+stripe_doio(struct device *dev, struct uio *uio)
+{
+	struct stripe_softc *sc = dev->d_data;
+	uint32_t bs = dev->d_blocksize;
+	uint32_t sector, nsect, ms, left;
+	unsigned which;
+	off_t offset;
+	size_t resid;
+	int result;
+
+	if (uio->uio_offset % bs != 0 || uio->uio_resid % bs != 0) {
+		return EINVAL;
+	}
+	sector = uio->uio_offset / bs;
+	nsect = uio->uio_resid / bs;
+	if (uio->uio_offset < 0 || sector + nsect > dev->d_blocks) {
+		return EINVAL;
+	}
+	if (nsect == 0) {
+		return 0;
+	}
+
+	/* Inside one stripe unit: just pass it on, in this thread */
+	stripe_map(sc, sector, &which, &ms, &left);
+	if (nsect <= left) {
+		offset = uio->uio_offset;
+		resid = uio->uio_resid;
+		uio->uio_offset = (off_t)ms * bs;
+		if (uio->uio_rw == UIO_READ) {
+			result = VOP_READ(sc->sc_members[which].m_vn, uio);
+		}
+		else {
+			result = VOP_WRITE(sc->sc_members[which].m_vn, uio);
+		}
+		uio->uio_offset = offset + (resid - uio->uio_resid);
+		return result;
+	}
+
+	while (uio->uio_resid > 0) {
+		result = stripe_round(sc, uio);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/* For d_io(). The members count their own parts too. */
+static
+int
+stripe_io(struct device *dev, struct uio *uio)
+{
+	uint64_t start;
+	size_t resid;
+	int result;
+
+	resid = uio->uio_resid;
+	start = iostat_start(&dev->d_iostat);
+	result = stripe_doio(dev, uio);
+	iostat_done(&dev->d_iostat, start, uio->uio_rw == UIO_WRITE,
+		    resid - uio->uio_resid, result);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+stripe_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+/*
+ * Function to create and attach a striping device.
+ */
+int
+devstripe_create(unsigned nmembers, char **members, unsigned unit)
+{
+	struct stripe_softc *sc;
+	struct stripe_member *m;
+	struct stat st;
+	char name[32];
+	uint32_t minblocks = 0;
+	unsigned i, nopen = 0;
+	int result;
+
+	if (nmembers < 1 || nmembers > DEVSTRIPE_MAXMEMBERS ||
+	    unit < 1 || unit > STRIPE_MAXIO) {
+		return EINVAL;
+	}
+
+	sc = kmalloc(sizeof(*sc));
+	if (sc == NULL) {
+		return ENOMEM;
+	}
+	sc->sc_n = nmembers;
+	sc->sc_unit = unit;
+	sc->sc_lock = NULL;
+	sc->sc_donecv = NULL;
+	for (i=0; i<nmembers; i++) {
+		sc->sc_members[i].m_cv = NULL;
+	}
+
+	for (i=0; i<nmembers; i++) {
+		m = &sc->sc_members[i];
+		m->m_worker = false;
+		m->m_head = m->m_tail = NULL;
+
+		snprintf(name, sizeof(name), "%sraw:", members[i]);
+		result = vfs_open(name, O_RDWR, 0, &m->m_vn);
+		if (result) {
+			kprintf("stripe: %s: %s\n", name, strerror(result));
+			goto fail;
+		}
+		nopen++;
+
+		result = VOP_STAT(m->m_vn, &st);
+		if (result) {
+			goto fail;
+		}
+		if (st.st_blksize == 0 ||
+		    (i > 0 && st.st_blksize != sc->sc_dev.d_blocksize)) {
+			kprintf("stripe: %s: not a disk like the others\n",
+				name);
+			result = EINVAL;
+			goto fail;
+		}
+		sc->sc_dev.d_blocksize = st.st_blksize;
+		if (i == 0 || st.st_blocks < minblocks) {
+			minblocks = st.st_blocks;
+		}
+
+		m->m_cv = cv_create("stripe");
+		if (m->m_cv == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+	}
+	sc->sc_lock = lock_create("stripe");
+	sc->sc_donecv = cv_create("stripedone");
+	if (sc->sc_lock == NULL || sc->sc_donecv == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	/* The members' ends past their last whole stripe unit go unused */
+	sc->sc_dev.d_open = stripe_open;
+	sc->sc_dev.d_close = stripe_close;
+	sc->sc_dev.d_io = stripe_io;
+	sc->sc_dev.d_ioctl = stripe_ioctl;
+	sc->sc_dev.d_poll = NULL;
+	sc->sc_dev.d_blocks = (minblocks / unit) * unit * nmembers;
+	sc->sc_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	sc->sc_dev.d_data = sc;
+
+	snprintf(name, sizeof(name), "stripe%u", stripe_count);
+	result = vfs_adddev(name, &sc->sc_dev, 1);
+	if (result) {
+		goto fail;
+	}
+	stripe_count++;
+	iostat_register(&sc->sc_dev.d_iostat, name);
+
+	/*
+	 * Devices are never removed, so from here on nothing is undone;
+	 * a member whose worker can't be started has its parts done by
+	 * the caller instead.
+	 */
+	for (i=0; i<nmembers; i++) {
+		result = thread_fork(name, NULL, stripe_worker, sc, i);
+		if (result) {
+			kprintf("%s: no worker for %s: %s\n", name,
+				members[i], strerror(result));
+			continue;
+		}
+		lock_acquire(sc->sc_lock);
+		sc->sc_members[i].m_worker = true;
+		lock_release(sc->sc_lock);
+	}
+
+	kprintf("%s: %u members, %u blocks per stripe unit, %u blocks\n",
+		name, nmembers, unit, (unsigned)sc->sc_dev.d_blocks);
+	return 0;
+
+ fail:
+	for (i=0; i<nmembers; i++) {
+		if (i < nopen) {
+			vfs_close(sc->sc_members[i].m_vn);
+		}
+		if (sc->sc_members[i].m_cv != NULL) {
+			cv_destroy(sc->sc_members[i].m_cv);
+		}
+	}
+	if (sc->sc_donecv != NULL) {
+		cv_destroy(sc->sc_donecv);
+	}
+	if (sc->sc_lock != NULL) {
+		lock_destroy(sc->sc_lock);
+	}
+	kfree(sc);
+	return result;
+}
@@ -0,0 +1,130 @@
+/*
+ * The wait device, "wait:". It holds no data; its only use is with
+ * poll(), which reports it readable (POLLIN) whenever the process
+ * polling it has a child that has exited and not been waited for. A
+ * shell can then reap background jobs with waitpid(..., WNOHANG) as
+ * soon as they finish, while it waits for input, instead of only
+ * checking between commands.
+ *
+ * Which process it describes is whoever polls it, so it can be opened
+ * once and shared across fork like any other file.
+ */
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <lib.h>
+#include <array.h>
+#include <uio.h>
+#include <synch.h>
+#include <current.h>
+#include <proc.h>
+#include <vfs.h>
+#include <device.h>
+
+/* For open() */
+static
+int
+waitopen(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+/* For close() */
+static
+int
+waitclose(struct device *dev)
+{
+	(void)dev;
+	return 0;
+}
+
+/* For d_io(). There's nothing to read or write. */
+static
+int
+waitio(struct device *dev, struct uio *uio)
+{
+	(void)dev;
+	(void)uio;
+
+	return EINVAL;
+}
+
+/* For ioctl() */
+static
+int
+waitioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+/*
+ * For poll(). Child exits are announced on the parent's p_waitpq,
+ * under proc_family_lk, so getting on it under the same lock before
+ * looking means none are missed.
+ */
+static
+int
+waitpoll(struct device *dev, int events, struct pollwaiter *pw, int *revents)
+{
+	struct proc *p = curproc;
+	struct proc *child;
+	unsigned i;
+
+	(void)dev;
+
+	*revents = 0;
+	lock_acquire(proc_family_lk);
+	pollqueue_add(&p->p_waitpq, pw);
+	for (i = 0; i < array_num(&p->p_children); i++) {
+		child = array_get(&p->p_children, i);
+		if (child->p_did_exit) {
+			*revents = events & POLLIN;
+			break;
+		}
+	}
+	lock_release(proc_family_lk);
+
+	return 0;
+}
+
+/*
+ * Function to create and attach wait:
+ */
+void
+devwait_create(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev==NULL) {
+		panic("Could not add wait device: out of memory\n");
+	}
+
+	dev->d_open = waitopen;
+	dev->d_close = waitclose;
+	dev->d_io = waitio;
+	dev->d_ioctl = waitioctl;
+	dev->d_poll = waitpoll;
+
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = NULL;
+
+	result = vfs_adddev("wait", dev, 0);
+	if (result) {
+		panic("Could not add wait device: %s\n", strerror(result));
+	}
+}
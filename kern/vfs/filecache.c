@@ -0,0 +1,525 @@
+/*
+ * File page cache. See filecache.h for the interface.
+ *
+ * fc_lock covers every cache's tree and counts and every field of
+ * every page except the data, which is the file system's to look
+ * after. Pages nobody has pinned are on one list in least-recently-used
+ * order, for the shrinker and for taking a frame back when the VM
+ * system has none to give.
+ *
+ * Frames are got and given back without fc_lock, since getting one
+ * may mean evicting a user page to swap.
+ */
+
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <radix.h>
+#include <vm.h>
+#include <filecache.h>
+
+struct fcpage {
+	struct fcobj *fp_obj;
+	uint32_t fp_index;
+	paddr_t fp_paddr;
+	unsigned fp_pins;
+	bool fp_valid;			/* fp_paddr holds the data */
+	bool fp_busy;			/* being filled */
+	bool fp_dirty;			/* newer than the disk */
+	bool fp_mapwrite;		/* mapped writable; stays dirty */
+	struct fcpage *fp_lruprev;	/* LRU list, if unpinned */
+	struct fcpage *fp_lrunext;
+};
+
+DECLRADIX(fcpageradix, struct fcpage);
+DEFRADIX(fcpageradix, struct fcpage, /*no inline*/);
+
+struct fcobj {
+	struct fcpageradix fo_pages;	/* by page number */
+	unsigned fo_npages;
+	unsigned fo_ndirty;
+};
+
+static struct lock *fc_lock;
+static struct cv *fc_cv;		/* a page stopped being busy */
+
+/* Unpinned pages; oldest at the head */
+static struct fcpage *fc_lruhead, *fc_lrutail;
+
+static unsigned filecache_shrink(unsigned npages);
+
+static struct shrinker filecache_shrinker = {
+	"filecache", filecache_shrink, NULL
+};
+
+void
+filecache_bootstrap(void)
+{
+	fc_lock = lock_create("filecache");
+	fc_cv = cv_create("filecache");
+	if (fc_lock == NULL || fc_cv == NULL) {
+		panic("filecache_bootstrap: Out of memory\n");
+	}
+	vm_register_shrinker(&filecache_shrinker);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists. Call with fc_lock held.
+
+static
+void
+fc_lruremove(struct fcpage *pp)
+{
+	if (pp->fp_lruprev != NULL) {
+		pp->fp_lruprev->fp_lrunext = pp->fp_lrunext;
+	}
+	else {
+		fc_lruhead = pp->fp_lrunext;
+	}
+	if (pp->fp_lrunext != NULL) {
+		pp->fp_lrunext->fp_lruprev = pp->fp_lruprev;
+	}
+	else {
+		fc_lrutail = pp->fp_lruprev;
+	}
+	pp->fp_lruprev = pp->fp_lrunext = NULL;
+}
+
+static
+void
+fc_lruaddtail(struct fcpage *pp)
+{
+	pp->fp_lruprev = fc_lrutail;
+	pp->fp_lrunext = NULL;
+	if (fc_lrutail != NULL) {
+		fc_lrutail->fp_lrunext = pp;
+	}
+	else {
+		fc_lruhead = pp;
+	}
+	fc_lrutail = pp;
+}
+
+static
+void
+fc_lruaddhead(struct fcpage *pp)
+{
+	pp->fp_lruprev = NULL;
+	pp->fp_lrunext = fc_lruhead;
+	if (fc_lruhead != NULL) {
+		fc_lruhead->fp_lruprev = pp;
+	}
+	else {
+		fc_lrutail = pp;
+	}
+	fc_lruhead = pp;
+}
+
+/*
+ * Take an unpinned page out of its cache. The caller frees it, and
+ * its frame, once it has let go of fc_lock.
+ */
+static
+void
+fc_unlink(struct fcpage *pp)
+{
+	struct fcobj *fo = pp->fp_obj;
+
+	KASSERT(pp->fp_pins == 0);
+	KASSERT(!pp->fp_busy);
+
+	fc_lruremove(pp);
+	fcpageradix_remove(&fo->fo_pages, pp->fp_index);
+	fo->fo_npages--;
+	if (pp->fp_dirty) {
+		fo->fo_ndirty--;
+	}
+}
+
+/*
+ * The oldest clean unpinned page, taken out of its cache, or NULL.
+ */
+static
+struct fcpage *
+fc_victim(void)
+{
+	struct fcpage *pp;
+
+	for (pp = fc_lruhead; pp != NULL; pp = pp->fp_lrunext) {
+		if (!pp->fp_dirty) {
+			fc_unlink(pp);
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+fc_setdirty(struct fcpage *pp, bool dirty)
+{
+	if (pp->fp_dirty != dirty) {
+		pp->fp_dirty = dirty;
+		if (dirty) {
+			pp->fp_obj->fo_ndirty++;
+		}
+		else {
+			pp->fp_obj->fo_ndirty--;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Caches
+
+struct fcobj *
+filecache_create(void)
+{
+	struct fcobj *fo;
+
+	fo = kmalloc(sizeof(*fo));
+	if (fo == NULL) {
+		return NULL;
+	}
+	fcpageradix_init(&fo->fo_pages);
+	fo->fo_npages = 0;
+	fo->fo_ndirty = 0;
+	return fo;
+}
+
+void
+filecache_destroy(struct fcobj *fo)
+{
+	struct fcpage *pp;
+	uint32_t index;
+
+	lock_acquire(fc_lock);
+	while ((pp = fcpageradix_next(&fo->fo_pages, 0, &index)) != NULL) {
+		fc_unlink(pp);
+		lock_release(fc_lock);
+		vm_putpage(pp->fp_paddr);
+		kfree(pp);
+		lock_acquire(fc_lock);
+	}
+	lock_release(fc_lock);
+
+	KASSERT(fo->fo_npages == 0 && fo->fo_ndirty == 0);
+	fcpageradix_cleanup(&fo->fo_pages);
+	kfree(fo);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pages
+
+int
+filecache_get(struct fcobj *fo, uint32_t index, bool *fill,
+	      struct fcpage **ret)
+{
+	struct fcpage *pp, *newpp = NULL, *old;
+	paddr_t paddr;
+	int result;
+
+	lock_acquire(fc_lock);
+	while (1) {
+		pp = fcpageradix_lookup(&fo->fo_pages, index);
+		if (pp != NULL && pp->fp_busy) {
+			cv_wait(fc_cv, fc_lock);
+			continue;
+		}
+		if (pp != NULL) {
+			if (pp->fp_pins++ == 0) {
+				fc_lruremove(pp);
+			}
+			/* Left invalid by a fill that failed: ours now */
+			*fill = !pp->fp_valid;
+			pp->fp_busy = *fill;
+			break;
+		}
+		if (newpp != NULL) {
+			result = fcpageradix_insert(&fo->fo_pages, index,
+						    newpp);
+			if (result) {
+				lock_release(fc_lock);
+				vm_putpage(newpp->fp_paddr);
+				kfree(newpp);
+				return result;
+			}
+			fo->fo_npages++;
+			pp = newpp;
+			newpp = NULL;
+			*fill = true;
+			break;
+		}
+
+		/* Not there; get a page without the lock and look again */
+		lock_release(fc_lock);
+		newpp = kmalloc(sizeof(*newpp));
+		if (newpp == NULL) {
+			return ENOMEM;
+		}
+		paddr = vm_getpage();
+		if (paddr == 0) {
+			/* Take the frame of our own oldest clean page */
+			lock_acquire(fc_lock);
+			old = fc_victim();
+			lock_release(fc_lock);
+			if (old == NULL) {
+				kfree(newpp);
+				return ENOMEM;
+			}
+			paddr = old->fp_paddr;
+			kfree(old);
+		}
+		newpp->fp_obj = fo;
+		newpp->fp_index = index;
+		newpp->fp_paddr = paddr;
+		newpp->fp_pins = 1;
+		newpp->fp_valid = false;
+		newpp->fp_busy = true;
+		newpp->fp_dirty = false;
+		newpp->fp_mapwrite = false;
+		newpp->fp_lruprev = newpp->fp_lrunext = NULL;
+		lock_acquire(fc_lock);
+	}
+	lock_release(fc_lock);
+
+	if (newpp != NULL) {
+		/* Someone else added it meanwhile */
+		vm_putpage(newpp->fp_paddr);
+		kfree(newpp);
+	}
+	*ret = pp;
+	return 0;
+}
+
+void
+filecache_filldone(struct fcpage *pp, bool ok)
+{
+	lock_acquire(fc_lock);
+	KASSERT(pp->fp_busy);
+	KASSERT(pp->fp_pins > 0);
+	pp->fp_busy = false;
+	pp->fp_valid = ok;
+	cv_broadcast(fc_cv, fc_lock);
+	lock_release(fc_lock);
+}
+
+void *
+filecache_data(struct fcpage *pp)
+{
+	KASSERT(pp->fp_pins > 0);
+	return (void *)PADDR_TO_KVADDR(pp->fp_paddr);
+}
+
+paddr_t
+filecache_paddr(struct fcpage *pp)
+{
+	KASSERT(pp->fp_pins > 0);
+	return pp->fp_paddr;
+}
+
+uint32_t
+filecache_index(struct fcpage *pp)
+{
+	return pp->fp_index;
+}
+
+void
+filecache_markdirty(struct fcpage *pp)
+{
+	KASSERT(pp->fp_pins > 0);
+	if (!pp->fp_dirty) {
+		lock_acquire(fc_lock);
+		fc_setdirty(pp, true);
+		lock_release(fc_lock);
+	}
+}
+
+void
+filecache_mapwrite(struct fcpage *pp)
+{
+	KASSERT(pp->fp_pins > 0);
+	lock_acquire(fc_lock);
+	fc_setdirty(pp, true);
+	pp->fp_mapwrite = true;
+	lock_release(fc_lock);
+}
+
+void
+filecache_release(struct fcpage *pp)
+{
+	bool drop = false;
+
+	lock_acquire(fc_lock);
+	KASSERT(pp->fp_pins > 0);
+	if (--pp->fp_pins == 0) {
+		/* (a page being filled is pinned by whoever fills it) */
+		KASSERT(!pp->fp_busy);
+		/* Nobody can write it behind our back any more */
+		pp->fp_mapwrite = false;
+		if (pp->fp_valid) {
+			fc_lruaddtail(pp);
+		}
+		else {
+			fcpageradix_remove(&pp->fp_obj->fo_pages,
+					   pp->fp_index);
+			pp->fp_obj->fo_npages--;
+			drop = true;
+		}
+	}
+	lock_release(fc_lock);
+
+	if (drop) {
+		vm_putpage(pp->fp_paddr);
+		kfree(pp);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Writing back
+
+struct fcpage *
+filecache_nextdirty(struct fcobj *fo, uint32_t start)
+{
+	struct fcpage *pp;
+	uint32_t index;
+
+	lock_acquire(fc_lock);
+	pp = NULL;
+	while (fo->fo_ndirty > 0) {
+		pp = fcpageradix_next(&fo->fo_pages, start, &index);
+		if (pp == NULL || (pp->fp_dirty && !pp->fp_busy)) {
+			break;
+		}
+		start = index + 1;
+		pp = NULL;
+		if (start == 0) {
+			/* wrapped */
+			break;
+		}
+	}
+	if (pp != NULL && pp->fp_pins++ == 0) {
+		fc_lruremove(pp);
+	}
+	lock_release(fc_lock);
+	return pp;
+}
+
+void
+filecache_cleaned(struct fcpage *pp)
+{
+	lock_acquire(fc_lock);
+	KASSERT(pp->fp_pins > 0);
+	if (!pp->fp_mapwrite) {
+		fc_setdirty(pp, false);
+	}
+	lock_release(fc_lock);
+}
+
+unsigned
+filecache_ndirty(struct fcobj *fo)
+{
+	/* Just a hint, so no lock */
+	return fo->fo_ndirty;
+}
+
+void
+filecache_dontneed(struct fcobj *fo, uint32_t first, uint32_t last)
+{
+	struct fcpage *pp;
+	uint32_t index;
+
+	lock_acquire(fc_lock);
+	while (first < last &&
+	       (pp = fcpageradix_next(&fo->fo_pages, first, &index)) != NULL &&
+	       index < last) {
+		first = index + 1;
+		if (pp->fp_pins == 0) {
+			fc_lruremove(pp);
+			fc_lruaddhead(pp);
+		}
+		if (first == 0) {
+			break;
+		}
+	}
+	lock_release(fc_lock);
+}
+
+void
+filecache_truncate(struct fcobj *fo, off_t len)
+{
+	struct fcpage *pp;
+	uint32_t first, index;
+	size_t off;
+
+	first = DIVROUNDUP(len, PAGE_SIZE);
+	lock_acquire(fc_lock);
+
+	off = len % PAGE_SIZE;
+	if (off != 0) {
+		pp = fcpageradix_lookup(&fo->fo_pages, len / PAGE_SIZE);
+		if (pp != NULL && pp->fp_valid) {
+			KASSERT(!pp->fp_busy);
+			bzero((char *)PADDR_TO_KVADDR(pp->fp_paddr) + off,
+			      PAGE_SIZE - off);
+			/* So the zeros reach disk if the file grows again */
+			fc_setdirty(pp, true);
+		}
+	}
+
+	while ((pp = fcpageradix_next(&fo->fo_pages, first, &index)) != NULL) {
+		first = index + 1;
+		KASSERT(!pp->fp_busy);
+		if (pp->fp_pins > 0) {
+			/* Still mapped; it reads as zeros from now on */
+			bzero((void *)PADDR_TO_KVADDR(pp->fp_paddr),
+			      PAGE_SIZE);
+			fc_setdirty(pp, false);
+			pp->fp_mapwrite = false;
+		}
+		else {
+			fc_unlink(pp);
+			lock_release(fc_lock);
+			vm_putpage(pp->fp_paddr);
+			kfree(pp);
+			lock_acquire(fc_lock);
+		}
+		if (first == 0) {
+			break;
+		}
+	}
+	lock_release(fc_lock);
+}
+
+/*
+ * Shrinker: give back clean unpinned pages, oldest first.
+ */
+static
+unsigned
+filecache_shrink(unsigned npages)
+{
+	struct fcpage *pp;
+	unsigned n = 0;
+
+	if (fc_lock == NULL || lock_do_i_hold(fc_lock)) {
+		return 0;
+	}
+
+	lock_acquire(fc_lock);
+	while (n < npages && (pp = fc_victim()) != NULL) {
+		lock_release(fc_lock);
+		vm_putpage(pp->fp_paddr);
+		kfree(pp);
+		n++;
+		lock_acquire(fc_lock);
+	}
+	lock_release(fc_lock);
+	return n;
+}
@@ -0,0 +1,676 @@
+/*
+ * Pipes.
+ *
+ * A pipe is a PIPE_SIZE byte ring buffer with two vnodes, one for each
+ * end, whose vn_data both point at it. The ends are separate vnodes so
+ * that VOP_CLOSE tells us which side has gone away: the last close of
+ * the write end gives readers end of file, and the last close of the
+ * read end makes writes fail with EPIPE. The pipe is freed when both
+ * vnodes have been reclaimed.
+ *
+ * Big writes skip the buffer: whole pages of the writer's memory are
+ * lent to the pipe (they become copy-on-write in the writer), and a
+ * reader reading a whole page into its own memory gets the frame mapped
+ * there instead of a copy. Pages are only lent while the buffer is
+ * empty, so the lent pages always come before what's in the buffer.
+ *
+ * Everything in the pipe is protected by pp_lock. Readers wait on
+ * pp_readcv for data, writers on pp_writecv for room, and threads in
+ * poll() on pp_pollq for either.
+ */
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <stat.h>
+#include <lib.h>
+#include <limits.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <poll.h>
+#include <pipe.h>
+
+#define PIPE_SIZE      4096
+#define PIPE_MAXLOANS  16	/* pages lent to the pipe at once */
+
+struct pipeloan {
+	paddr_t pl_paddr;
+	unsigned pl_offset;		/* bytes of the page already read */
+};
+
+struct pipe {
+	struct vnode pp_readvn;
+	struct vnode pp_writevn;
+
+	struct lock *pp_lock;
+	struct cv *pp_readcv;
+	struct cv *pp_writecv;
+	struct pollqueue pp_pollq;
+
+	char *pp_buf;
+	unsigned pp_head;		/* where the next byte is read from */
+	unsigned pp_count;		/* bytes in the buffer */
+
+	struct pipeloan pp_loans[PIPE_MAXLOANS];
+	unsigned pp_loanhead;		/* the next page lent to be read */
+	unsigned pp_nloans;		/* pages lent */
+
+	bool pp_readopen;		/* read end not closed yet */
+	bool pp_writeopen;		/* write end not closed yet */
+	unsigned pp_nvnodes;		/* vnodes not reclaimed yet */
+};
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	while (pp->pp_nloans > 0) {
+		vm_unloanpage(pp->pp_loans[pp->pp_loanhead].pl_paddr);
+		pp->pp_loanhead = (pp->pp_loanhead + 1) % PIPE_MAXLOANS;
+		pp->pp_nloans--;
+	}
+	pollqueue_cleanup(&pp->pp_pollq);
+	cv_destroy(pp->pp_writecv);
+	cv_destroy(pp->pp_readcv);
+	lock_destroy(pp->pp_lock);
+	kfree(pp->pp_buf);
+	kfree(pp);
+}
+
+/*
+ * Neither end is ever opened by name, so this is only reached if
+ * someone manages to get one through the VFS anyway.
+ */
+static
+int
+pipe_open(struct vnode *v, int openflags)
+{
+	(void)v;
+	(void)openflags;
+	return EINVAL;
+}
+
+/*
+ * Last close of one end.
+ */
+static
+int
+pipe_close(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_readvn) {
+		pp->pp_readopen = false;
+		cv_broadcast(pp->pp_writecv, pp->pp_lock);
+	}
+	else {
+		pp->pp_writeopen = false;
+		cv_broadcast(pp->pp_readcv, pp->pp_lock);
+	}
+	pollqueue_wakeup(&pp->pp_pollq);
+	lock_release(pp->pp_lock);
+	return 0;
+}
+
+/*
+ * Last reference to one end. Free the pipe after the second.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+	bool last;
+
+	lock_acquire(pp->pp_lock);
+	KASSERT(pp->pp_nvnodes > 0);
+	last = --pp->pp_nvnodes == 0;
+	lock_release(pp->pp_lock);
+
+	VOP_CLEANUP(v);
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+/*
+ * The iovec the next byte of a uio goes to or comes from, skipping
+ * empty ones, or NULL if there's nothing left.
+ */
+static
+struct iovec *
+pipe_curiov(struct uio *uio)
+{
+	while (uio->uio_iovcnt > 1 && uio->uio_iov->iov_len == 0) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+	}
+	return uio->uio_iov->iov_len > 0 ? uio->uio_iov : NULL;
+}
+
+/*
+ * Account for N bytes of the current iovec having been moved some
+ * other way than uiomove.
+ */
+static
+void
+pipe_skip(struct uio *uio, size_t n)
+{
+	KASSERT(uio->uio_iov->iov_len >= n);
+	uio->uio_iov->iov_ubase += n;
+	uio->uio_iov->iov_len -= n;
+	uio->uio_resid -= n;
+	uio->uio_offset += n;
+}
+
+/*
+ * How many whole pages of a user write could be lent to the pipe now,
+ * leaving aside whether there's room for them.
+ */
+static
+unsigned
+pipe_lendable(struct pipe *pp, struct uio *uio)
+{
+	struct iovec *iov;
+
+	if (uio->uio_segflg != UIO_USERSPACE || pp->pp_count > 0) {
+		return 0;
+	}
+	iov = pipe_curiov(uio);
+	if (iov == NULL || (vaddr_t)iov->iov_ubase % PAGE_SIZE != 0) {
+		return 0;
+	}
+	return iov->iov_len / PAGE_SIZE;
+}
+
+/*
+ * Lend up to NPAGES pages of a user write. Returns how many were; none
+ * if they aren't in memory, in which case they get copied instead.
+ */
+static
+unsigned
+pipe_lend(struct pipe *pp, struct uio *uio, unsigned npages)
+{
+	paddr_t paddrs[PIPE_MAXLOANS];
+	struct pipeloan *pl;
+	unsigned i;
+
+	if (npages > PIPE_MAXLOANS - pp->pp_nloans) {
+		npages = PIPE_MAXLOANS - pp->pp_nloans;
+	}
+	npages = vm_loanpages(uio->uio_space, (vaddr_t)uio->uio_iov->iov_ubase,
+			      npages, paddrs);
+	for (i = 0; i < npages; i++) {
+		pl = &pp->pp_loans[(pp->pp_loanhead + pp->pp_nloans) %
+				   PIPE_MAXLOANS];
+		pl->pl_paddr = paddrs[i];
+		pl->pl_offset = 0;
+		pp->pp_nloans++;
+	}
+	pipe_skip(uio, npages * PAGE_SIZE);
+	return npages;
+}
+
+/*
+ * Give back the first lent page, once it's all been read.
+ */
+static
+void
+pipe_unlend(struct pipe *pp)
+{
+	unsigned n;
+
+	n = pp->pp_loanhead;
+	KASSERT(pp->pp_nloans > 0);
+	KASSERT(pp->pp_loans[n].pl_offset == PAGE_SIZE);
+	vm_unloanpage(pp->pp_loans[n].pl_paddr);
+	pp->pp_loanhead = (n + 1) % PIPE_MAXLOANS;
+	pp->pp_nloans--;
+}
+
+/*
+ * Read from the lent pages. Whole pages going to page aligned user
+ * memory are mapped there copy-on-write; anything else is copied
+ * straight out of the page, which still beats going through the buffer.
+ */
+static
+int
+pipe_readloans(struct pipe *pp, struct uio *uio)
+{
+	paddr_t paddrs[PIPE_MAXLOANS];
+	struct pipeloan *pl;
+	struct iovec *iov;
+	unsigned npages, i;
+	size_t n;
+	int result;
+
+	pl = &pp->pp_loans[pp->pp_loanhead];
+	iov = uio->uio_segflg == UIO_USERSPACE ? pipe_curiov(uio) : NULL;
+	if (pl->pl_offset == 0 && iov != NULL &&
+	    (vaddr_t)iov->iov_ubase % PAGE_SIZE == 0) {
+		npages = iov->iov_len / PAGE_SIZE;
+		if (npages > pp->pp_nloans) {
+			npages = pp->pp_nloans;
+		}
+		for (i = 0; i < npages; i++) {
+			paddrs[i] = pp->pp_loans[(pp->pp_loanhead + i) %
+						 PIPE_MAXLOANS].pl_paddr;
+		}
+		npages = vm_mappages(uio->uio_space,
+				     (vaddr_t)iov->iov_ubase, npages, paddrs);
+		if (npages > 0) {
+			pipe_skip(uio, npages * PAGE_SIZE);
+			for (i = 0; i < npages; i++) {
+				pp->pp_loans[pp->pp_loanhead].pl_offset =
+					PAGE_SIZE;
+				pipe_unlend(pp);
+			}
+			return 0;
+		}
+	}
+
+	n = PAGE_SIZE - pl->pl_offset;
+	if (n > uio->uio_resid) {
+		n = uio->uio_resid;
+	}
+	result = uiomove((char *)PADDR_TO_KVADDR(pl->pl_paddr) + pl->pl_offset,
+			 n, uio);
+	if (result) {
+		return result;
+	}
+	pl->pl_offset += n;
+	if (pl->pl_offset == PAGE_SIZE) {
+		pipe_unlend(pp);
+	}
+	return 0;
+}
+
+/*
+ * Read whatever is in the pipe, up to the size of the request, waiting
+ * if it's empty. An empty pipe with no writer reads as end of file.
+ */
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	unsigned n;
+	int result = 0;
+
+	if (v != &pp->pp_readvn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_lock);
+	while (pp->pp_count == 0 && pp->pp_nloans == 0 && pp->pp_writeopen) {
+		cv_wait(pp->pp_readcv, pp->pp_lock);
+	}
+
+	/* Lent pages first; they were all written before the buffer */
+	while (result == 0 && pp->pp_nloans > 0 && uio->uio_resid > 0) {
+		result = pipe_readloans(pp, uio);
+	}
+
+	/* At most two pieces, if the data wraps around the end */
+	while (result == 0 && pp->pp_count > 0 && uio->uio_resid > 0) {
+		n = pp->pp_count;
+		if (n > PIPE_SIZE - pp->pp_head) {
+			n = PIPE_SIZE - pp->pp_head;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(pp->pp_buf + pp->pp_head, n, uio);
+		if (result == 0) {
+			pp->pp_head = (pp->pp_head + n) % PIPE_SIZE;
+			pp->pp_count -= n;
+		}
+	}
+
+	cv_broadcast(pp->pp_writecv, pp->pp_lock);
+	pollqueue_wakeup(&pp->pp_pollq);
+	lock_release(pp->pp_lock);
+	return result;
+}
+
+/*
+ * Write the whole request, waiting for room as needed. A request of
+ * PIPE_BUF bytes or less waits until it fits all at once, so it can't be
+ * split up by another writer. Once there is no reader left, fails with
+ * EPIPE, unless some of the data already went in.
+ */
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	size_t want = uio->uio_resid <= PIPE_BUF ? uio->uio_resid : 1;
+	size_t start = uio->uio_resid;
+	unsigned tail, n, npages;
+	int result = 0;
+
+	if (v != &pp->pp_writevn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_lock);
+	while (result == 0 && uio->uio_resid > 0) {
+		if (!pp->pp_readopen) {
+			result = EPIPE;
+			break;
+		}
+
+		npages = pipe_lendable(pp, uio);
+		if (npages > 0) {
+			if (pp->pp_nloans == PIPE_MAXLOANS) {
+				cv_wait(pp->pp_writecv, pp->pp_lock);
+				continue;
+			}
+			if (pipe_lend(pp, uio, npages) > 0) {
+				cv_broadcast(pp->pp_readcv, pp->pp_lock);
+				pollqueue_wakeup(&pp->pp_pollq);
+				continue;
+			}
+		}
+
+		if (PIPE_SIZE - pp->pp_count < want) {
+			cv_wait(pp->pp_writecv, pp->pp_lock);
+			continue;
+		}
+
+		tail = (pp->pp_head + pp->pp_count) % PIPE_SIZE;
+		n = PIPE_SIZE - pp->pp_count;
+		if (n > PIPE_SIZE - tail) {
+			n = PIPE_SIZE - tail;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(pp->pp_buf + tail, n, uio);
+		if (result == 0) {
+			pp->pp_count += n;
+			cv_broadcast(pp->pp_readcv, pp->pp_lock);
+			pollqueue_wakeup(&pp->pp_pollq);
+		}
+	}
+	lock_release(pp->pp_lock);
+
+	if (result == EPIPE && uio->uio_resid < start) {
+		/* Report the short write; the next one gets the EPIPE */
+		result = 0;
+	}
+	return result;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *pp = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_mode |= 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_BUF;
+
+	/* What's waiting to be read */
+	lock_acquire(pp->pp_lock);
+	statbuf->st_size = pp->pp_count;
+	if (pp->pp_nloans > 0) {
+		statbuf->st_size += pp->pp_nloans * PAGE_SIZE -
+			pp->pp_loans[pp->pp_loanhead].pl_offset;
+	}
+	lock_release(pp->pp_lock);
+
+	return 0;
+}
+
+/*
+ * The read end is ready when there's data or no writer (so read won't
+ * wait), the write end when there's room for PIPE_BUF bytes or no
+ * reader (so write fails straight away).
+ */
+static
+int
+pipe_poll(struct vnode *v, int events, struct pollwaiter *pw, int *revents)
+{
+	struct pipe *pp = v->vn_data;
+	int ready = 0;
+
+	lock_acquire(pp->pp_lock);
+	pollqueue_add(&pp->pp_pollq, pw);
+	if (v == &pp->pp_readvn) {
+		if (pp->pp_count > 0 || pp->pp_nloans > 0) {
+			ready |= POLLIN;
+		}
+		if (!pp->pp_writeopen) {
+			ready |= POLLHUP;
+		}
+	}
+	else {
+		if (!pp->pp_readopen) {
+			ready |= POLLERR;
+		}
+		else if (PIPE_SIZE - pp->pp_count >= PIPE_BUF) {
+			ready |= POLLOUT;
+		}
+	}
+	lock_release(pp->pp_lock);
+
+	*revents = ready & (events | POLLERR | POLLHUP);
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+pipe_fallocate(struct vnode *v, off_t pos, off_t len)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	return ESPIPE;
+}
+
+static
+int
+pipe_copyrange(struct vnode *v, off_t pos, struct vnode *src,
+	       off_t spos, off_t len, off_t *copied)
+{
+	(void)v;
+	(void)pos;
+	(void)src;
+	(void)spos;
+	(void)len;
+	(void)copied;
+	return ESPIPE;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+pipe_getpage(struct vnode *v, uint32_t index, bool forwrite,
+	     struct fcpage **ret)
+{
+	(void)v;
+	(void)index;
+	(void)forwrite;
+	(void)ret;
+	return ENOSYS;
+}
+
+static
+int
+pipe_advise(struct vnode *v, off_t pos, off_t len, int advice)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)advice;
+	return ESPIPE;
+}
+
+static
+int
+pipe_syncrange(struct vnode *v, off_t pos, off_t len, unsigned flags)
+{
+	(void)v;
+	(void)pos;
+	(void)len;
+	(void)flags;
+	return ESPIPE;
+}
+
+//////////////////////////////////////////////////
+
+static
+int
+pipe_notdir(void)
+{
+	return ENOTDIR;
+}
+
+static
+int
+pipe_inval(void)
+{
+	return EINVAL;
+}
+
+/*
+ * Casting through void * prevents warnings, as in sfs_vnode.c.
+ */
+#define NOTDIR ((void *)pipe_notdir)
+#define INVAL ((void *)pipe_inval)
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,	/* mark this a valid vnode ops table */
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+
+	pipe_read,
+	INVAL,   /* readlink */
+	NOTDIR,  /* getdirentry */
+	pipe_write,
+	INVAL,   /* ioctl */
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_getpage,
+	pipe_advise,
+	pipe_syncrange,
+	pipe_poll,
+	INVAL,   /* truncate */
+	pipe_fallocate,
+	pipe_copyrange,
+	NOTDIR,  /* namefile */
+
+	NOTDIR,  /* creat */
+	NOTDIR,  /* symlink */
+	NOTDIR,  /* mkdir */
+	NOTDIR,  /* link */
+	NOTDIR,  /* remove */
+	NOTDIR,  /* rmdir */
+	NOTDIR,  /* rename */
+
+	NOTDIR,  /* lookup */
+	NOTDIR,  /* lookparent */
+};
+
+int
+pipe_create(struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(struct pipe));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_buf = kmalloc(PIPE_SIZE);
+	pp->pp_lock = lock_create("pipe");
+	pp->pp_readcv = cv_create("pipe read");
+	pp->pp_writecv = cv_create("pipe write");
+	if (pp->pp_buf == NULL || pp->pp_lock == NULL ||
+	    pp->pp_readcv == NULL || pp->pp_writecv == NULL) {
+		if (pp->pp_writecv != NULL) {
+			cv_destroy(pp->pp_writecv);
+		}
+		if (pp->pp_readcv != NULL) {
+			cv_destroy(pp->pp_readcv);
+		}
+		if (pp->pp_lock != NULL) {
+			lock_destroy(pp->pp_lock);
+		}
+		kfree(pp->pp_buf);
+		kfree(pp);
+		return ENOMEM;
+	}
+	pp->pp_head = 0;
+	pp->pp_count = 0;
+	pp->pp_loanhead = 0;
+	pp->pp_nloans = 0;
+	pp->pp_readopen = true;
+	pp->pp_writeopen = true;
+	pp->pp_nvnodes = 2;
+	pollqueue_init(&pp->pp_pollq);
+
+	/* vnode_init can't fail */
+	VOP_INIT(&pp->pp_readvn, &pipe_vnode_ops, NULL, pp);
+	VOP_INIT(&pp->pp_writevn, &pipe_vnode_ops, NULL, pp);
+
+	/* As if vfs_open had opened each of them */
+	VOP_INCOPEN(&pp->pp_readvn);
+	VOP_INCOPEN(&pp->pp_writevn);
+
+	*readend = &pp->pp_readvn;
+	*writeend = &pp->pp_writevn;
+	return 0;
+}
@@ -34,15 +34,25 @@
 
 #define VFSINLINE
 
+#define KMTAG KMT_VFS
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <hashtable.h>
 #include <synch.h>
+#include <current.h>
+#include <thread.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <filecache.h>
+#include <vm.h>
+#include <rcu.h>
+#include <membar.h>
 
 /*
  * Structure for a single named device.
@@ -87,17 +97,196 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Copy of knowndevs, with every name hashed, so lookups don't scan
+ * the list. Knowndev structures are never freed, only added, so
+ * whenever anything that changes the names (vfs_doadd, and mounting
+ * and unmounting, which change the volume names) is done a new copy is
+ * published and the old one freed once no reader can be using it.
+ * Readers use rcu_read_lock, or the big lock, under which all of the
+ * publishing happens.
+ *
+ * The hash table is open-addressed and at most half full. The names
+ * are copied into the same block of memory, so a reader never looks at
+ * the volume name of a filesystem that has since gone away; a KD_VOLNAME
+ * entry for a device with no filesystem now is stale and is ignored.
+ * Entries with the same name are found in knowndevs order.
+ */
+#define KD_NAME		0
+#define KD_RAWNAME	1
+#define KD_VOLNAME	2
+
+struct knowndevname {
+	const char *kn_name;		/* NULL if the slot is empty */
+	struct knowndev *kn_kd;
+	unsigned kn_kind;		/* KD_* */
+};
+
+struct knowndevsnap {
+	struct rcu_head ks_rcu;		/* must be first */
+	unsigned ks_hashsize;		/* a power of two */
+	struct knowndevname *ks_hash;
+	unsigned ks_num;
+	struct knowndev *ks_devs[];
+};
+
+static struct knowndevsnap *volatile knowndevs_rcu;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
 
+static
+void
+knowndevsnap_add(struct knowndevsnap *snap, char **strings,
+		 const char *name, struct knowndev *kd, unsigned kind)
+{
+	unsigned i;
+
+	i = hash_string(name) & (snap->ks_hashsize - 1);
+	while (snap->ks_hash[i].kn_name != NULL) {
+		i = (i + 1) & (snap->ks_hashsize - 1);
+	}
+	strcpy(*strings, name);
+	snap->ks_hash[i].kn_name = *strings;
+	snap->ks_hash[i].kn_kd = kd;
+	snap->ks_hash[i].kn_kind = kind;
+	*strings += strlen(name) + 1;
+}
+
+/*
+ * Build a new copy of knowndevs as it stands. Returns NULL if out of
+ * memory. Must hold the big lock.
+ */
+static
+struct knowndevsnap *
+knowndevsnap_build(void)
+{
+	struct knowndevsnap *snap;
+	struct knowndev *kd;
+	const char *volname;
+	unsigned i, num, hashsize;
+	size_t size, namelen;
+	char *strings;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	num = knowndevarray_num(knowndevs);
+	hashsize = 8;
+	while (hashsize < 2 * 3 * num) {
+		hashsize *= 2;
+	}
+	namelen = 0;
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		namelen += strlen(kd->kd_name) + 1;
+		if (kd->kd_rawname != NULL) {
+			namelen += strlen(kd->kd_rawname) + 1;
+		}
+		if (kd->kd_fs != NULL) {
+			volname = FSOP_GETVOLNAME(kd->kd_fs);
+			if (volname != NULL) {
+				namelen += strlen(volname) + 1;
+			}
+		}
+	}
+
+	size = sizeof(struct knowndevsnap) + num * sizeof(struct knowndev *) +
+		hashsize * sizeof(struct knowndevname) + namelen;
+	snap = kmalloc(size);
+	if (snap == NULL) {
+		return NULL;
+	}
+	snap->ks_num = num;
+	snap->ks_hashsize = hashsize;
+	snap->ks_hash = (struct knowndevname *)&snap->ks_devs[num];
+	for (i=0; i<hashsize; i++) {
+		snap->ks_hash[i].kn_name = NULL;
+	}
+	strings = (char *)&snap->ks_hash[hashsize];
+
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		snap->ks_devs[i] = kd;
+		knowndevsnap_add(snap, &strings, kd->kd_name, kd, KD_NAME);
+		if (kd->kd_rawname != NULL) {
+			knowndevsnap_add(snap, &strings, kd->kd_rawname, kd,
+					 KD_RAWNAME);
+		}
+		if (kd->kd_fs != NULL) {
+			volname = FSOP_GETVOLNAME(kd->kd_fs);
+			if (volname != NULL) {
+				knowndevsnap_add(snap, &strings, volname, kd,
+						 KD_VOLNAME);
+			}
+		}
+	}
+	KASSERT(strings == (char *)snap + size);
+	return snap;
+}
+
+static
+void
+knowndevsnap_free(struct rcu_head *head)
+{
+	kfree(head);
+}
+
+/*
+ * Make SNAP the copy readers see. Must hold the big lock.
+ */
+static
+void
+knowndevsnap_publish(struct knowndevsnap *snap)
+{
+	struct knowndevsnap *oldsnap;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* The copy is filled in completely before readers can see it */
+	oldsnap = knowndevs_rcu;
+	membar_store_store();
+	knowndevs_rcu = snap;
+	if (oldsnap != NULL) {
+		call_rcu(&oldsnap->ks_rcu, knowndevsnap_free);
+	}
+}
+
+/*
+ * Find the next entry for NAME in SNAP after PREV, or the first if PREV
+ * is NULL. Returns NULL when there are no more.
+ */
+static
+const struct knowndevname *
+knowndevsnap_find(const struct knowndevsnap *snap, const char *name,
+		  const struct knowndevname *prev)
+{
+	unsigned i;
+
+	if (prev == NULL) {
+		i = hash_string(name) & (snap->ks_hashsize - 1);
+	}
+	else {
+		i = (prev - snap->ks_hash + 1) & (snap->ks_hashsize - 1);
+	}
+	while (snap->ks_hash[i].kn_name != NULL) {
+		if (!strcmp(snap->ks_hash[i].kn_name, name)) {
+			return &snap->ks_hash[i];
+		}
+		i = (i + 1) & (snap->ks_hashsize - 1);
+	}
+	return NULL;
+}
+
 /*
  * Setup function
  */
 void
 vfs_bootstrap(void)
 {
+	struct knowndevsnap *snap;
+
 	knowndevs = knowndevarray_create();
 	if (knowndevs==NULL) {
 		panic("vfs: Could not create knowndevs array\n");
@@ -109,7 +298,20 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_biglock_acquire();
+	snap = knowndevsnap_build();
+	if (snap==NULL) {
+		panic("vfs: Could not create knowndevs array\n");
+	}
+	knowndevsnap_publish(snap);
+	vfs_biglock_release();
+
+	filecache_bootstrap();
+	buf_bootstrap();
+	vfs_nc_bootstrap();
+
 	devnull_create();
+	devwait_create();
 }
 
 /*
@@ -145,23 +347,77 @@ vfs_biglock_do_i_hold(void)
 	return lock_do_i_hold(vfs_biglock);
 }
 
+/*
+ * Thread syncing one filesystem for vfs_sync. The fs can't be
+ * unmounted meanwhile, since vfs_sync holds the big lock until every
+ * worker is done.
+ */
+static
+void
+vfs_sync_thread(void *fs, unsigned long sem)
+{
+	/*result =*/ FSOP_SYNC((struct fs *)fs);
+	V((struct semaphore *)sem);
+}
+
 /*
  * Global sync function - call FSOP_SYNC on all devices.
+ *
+ * Each mounted filesystem after the first is synced by a thread of
+ * its own while this thread does the first, so the disks flush at
+ * the same time and the whole thing takes about as long as the
+ * slowest one. If a thread can't be had, or we can't wait for one
+ * (as when syncing during panic, with interrupts off), that
+ * filesystem is just synced here instead.
  */
 int
 vfs_sync(void)
 {
 	struct knowndev *dev;
-	unsigned i, num;
+	struct semaphore *done;
+	struct fs *first;
+	unsigned i, num, nthreads;
+	int result;
 
 	vfs_biglock_acquire();
 
+	done = NULL;
+	if (curthread->t_curspl == 0 && !curthread->t_in_interrupt) {
+		done = sem_create("vfs_sync", 0);
+	}
+
+	first = NULL;
+	nthreads = 0;
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_fs != NULL) {
+		if (dev->kd_fs == NULL) {
+			continue;
+		}
+		if (first == NULL) {
+			first = dev->kd_fs;
+			continue;
+		}
+		result = ENOMEM;
+		if (done != NULL) {
+			result = thread_fork("vfs_sync", NULL, vfs_sync_thread,
+					     dev->kd_fs, (unsigned long)done);
+		}
+		if (result) {
 			/*result =*/ FSOP_SYNC(dev->kd_fs);
+			continue;
 		}
+		nthreads++;
+	}
+
+	if (first != NULL) {
+		/*result =*/ FSOP_SYNC(first);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(done);
+	}
+	if (done != NULL) {
+		sem_destroy(done);
 	}
 
 	vfs_biglock_release();
@@ -176,71 +432,51 @@ vfs_sync(void)
 int
 vfs_getroot(const char *devname, struct vnode **result)
 {
+	const struct knowndevname *kn = NULL;
 	struct knowndev *kd;
-	unsigned i, num;
 
 	KASSERT(vfs_biglock_do_i_hold());
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
-
-		/*
-		 * If this device has a mounted filesystem, and
-		 * DEVNAME names either the filesystem or the device,
-		 * return the root of the filesystem.
-		 *
-		 * If it has no mounted filesystem, it's mountable,
-		 * and DEVNAME names the device, return ENXIO.
-		 */
-
-		if (kd->kd_fs!=NULL) {
-			const char *volname;
-			volname = FSOP_GETVOLNAME(kd->kd_fs);
+	/* knowndevs_rcu only changes under the big lock */
+	while ((kn = knowndevsnap_find(knowndevs_rcu, devname, kn)) != NULL) {
+		kd = kn->kn_kd;
 
-			if (!strcmp(kd->kd_name, devname) ||
-			    (volname!=NULL && !strcmp(volname, devname))) {
+		switch (kn->kn_kind) {
+		    case KD_NAME:
+			/*
+			 * If this device has a mounted filesystem,
+			 * return the root of that. If it has none and is
+			 * mountable, return ENXIO. Otherwise return the
+			 * device itself.
+			 */
+			if (kd->kd_fs != NULL) {
 				*result = FSOP_GETROOT(kd->kd_fs);
 				return 0;
 			}
-		}
-		else {
-			if (kd->kd_rawname!=NULL &&
-			    !strcmp(kd->kd_name, devname)) {
+			if (kd->kd_rawname != NULL) {
 				return ENXIO;
 			}
-		}
-
-		/*
-		 * If DEVNAME names the device, and we get here, it
-		 * must have no fs and not be mountable. In this case,
-		 * we return the device itself.
-		 */
-		if (!strcmp(kd->kd_name, devname)) {
-			KASSERT(kd->kd_fs==NULL);
-			KASSERT(kd->kd_rawname==NULL);
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*result = kd->kd_vnode;
 			return 0;
-		}
 
-		/*
-		 * If the device has a rawname and DEVNAME names that,
-		 * return the device itself.
-		 */
-		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
+		    case KD_RAWNAME:
+			/* The raw name always gets the device itself */
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*result = kd->kd_vnode;
 			return 0;
-		}
 
-		/*
-		 * If none of the above tests matched, we didn't name
-		 * any of the names of this device, so go on to the
-		 * next one.
-		 */
+		    case KD_VOLNAME:
+			/* A volume name gets the root of the filesystem */
+			if (kd->kd_fs != NULL) {
+				*result = FSOP_GETROOT(kd->kd_fs);
+				return 0;
+			}
+			/* stale; the volume was unmounted */
+			break;
+		}
 	}
 
 	/*
@@ -252,20 +488,37 @@ vfs_getroot(const char *devname, struct vnode **result)
 
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
+ * This doesn't need the big lock.
  */
 const char *
 vfs_getdevname(struct fs *fs)
 {
+	struct knowndevsnap *snap;
+	const struct knowndevname *kn = NULL;
 	struct knowndev *kd;
-	unsigned i, num;
+	const char *volname, *name = NULL;
+	unsigned i;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rcu_read_lock();
+	snap = knowndevs_rcu;
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
+	/* Go by the volume name, if there is one */
+	volname = FSOP_GETVOLNAME(fs);
+	if (volname != NULL) {
+		while ((kn = knowndevsnap_find(snap, volname, kn)) != NULL) {
+			if (kn->kn_kind == KD_VOLNAME && kn->kn_kd->kd_fs == fs) {
+				name = kn->kn_kd->kd_name;
+				break;
+			}
+		}
+		rcu_read_unlock();
+		return name;
+	}
+
+	for (i=0; i<snap->ks_num; i++) {
+		kd = snap->ks_devs[i];
 
 		if (kd->kd_fs == fs) {
 			/*
@@ -274,11 +527,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	rcu_read_unlock();
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -299,65 +554,33 @@ mkrawname(const char *name)
 
 
 /*
- * Check if the two strings passed in are the same, if they're both
- * not NULL (the latter part being significant).
+ * Check if any of the names passed in (which may be NULL) already
+ * exists as a device, raw device or volume name.
  */
 static
-inline
-int
-samestring(const char *a, const char *b)
-{
-	if (a==NULL || b==NULL) {
-		return 0;
-	}
-	return !strcmp(a, b);
-}
-
-/*
- * Check if the first string passed is the same as any of the three others,
- * if they're not NULL.
- */
-static
-inline
-int
-samestring3(const char *a, const char *b, const char *c, const char *d)
-{
-	return samestring(a,b) || samestring(a,c) || samestring(a,d);
-}
-
-/*
- * Check if any of the three names passed in already exists as a device
- * name.
- */
-
-static
-int
+bool
 badnames(const char *n1, const char *n2, const char *n3)
 {
-	const char *volname;
-	unsigned i, num;
-	struct knowndev *kd;
+	const char *names[3] = { n1, n2, n3 };
+	const struct knowndevname *kn;
+	unsigned i;
 
 	KASSERT(vfs_biglock_do_i_hold());
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; i<num; i++) {
-		kd = knowndevarray_get(knowndevs, i);
-
-		if (kd->kd_fs) {
-			volname = FSOP_GETVOLNAME(kd->kd_fs);
-			if (samestring3(volname, n1, n2, n3)) {
-				return 1;
-			}
+	for (i=0; i<3; i++) {
+		if (names[i] == NULL) {
+			continue;
 		}
-
-		if (samestring3(kd->kd_rawname, n1, n2, n3) ||
-		    samestring3(kd->kd_name, n1, n2, n3)) {
-			return 1;
+		kn = NULL;
+		while ((kn = knowndevsnap_find(knowndevs_rcu, names[i], kn))
+		       != NULL) {
+			if (kn->kn_kind != KD_VOLNAME ||
+			    kn->kn_kd->kd_fs != NULL) {
+				return true;
+			}
 		}
 	}
-
-	return 0;
+	return false;
 }
 
 /*
@@ -373,6 +596,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 {
 	char *name=NULL, *rawname=NULL;
 	struct knowndev *kd=NULL;
+	struct knowndevsnap *snap;
 	struct vnode *vnode=NULL;
 	const char *volname=NULL;
 	unsigned index;
@@ -412,21 +636,34 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	if (badnames(name, rawname, volname)) {
-		vfs_biglock_release();
-		return EEXIST;
+		result = EEXIST;
+		goto fail;
 	}
 
 	result = knowndevarray_add(knowndevs, kd, &index);
+	if (result) {
+		goto fail;
+	}
 
-	if (result == 0 && dev != NULL) {
+	snap = knowndevsnap_build();
+	if (snap==NULL) {
+		knowndevarray_setsize(knowndevs, index);
+		goto nomem;
+	}
+
+	if (dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
 		dev->d_devnumber = index+1;
 	}
 
+	knowndevsnap_publish(snap);
+
 	vfs_biglock_release();
-	return result;
+	return 0;
 
  nomem:
+	result = ENOMEM;
+ fail:
 
 	if (name) {
 		kfree(name);
@@ -442,7 +679,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	vfs_biglock_release();
-	return ENOMEM;
+	return result;
 }
 
 /*
@@ -470,33 +707,26 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold the big lock.
  */
 static
 int
 findmount(const char *devname, struct knowndev **result)
 {
-	struct knowndev *dev;
-	unsigned i, num;
-	bool found = false;
+	const struct knowndevname *kn = NULL;
 
 	KASSERT(vfs_biglock_do_i_hold());
 
-	num = knowndevarray_num(knowndevs);
-	for (i=0; !found && i<num; i++) {
-		dev = knowndevarray_get(knowndevs, i);
-		if (dev->kd_rawname==NULL) {
-			/* not mountable/unmountable */
+	while ((kn = knowndevsnap_find(knowndevs_rcu, devname, kn)) != NULL) {
+		if (kn->kn_kind != KD_NAME || kn->kn_kd->kd_rawname == NULL) {
+			/* not a device name, or not mountable/unmountable */
 			continue;
 		}
-
-		if (!strcmp(devname, dev->kd_name)) {
-			*result = dev;
-			found = true;
-		}
+		*result = kn->kn_kd;
+		return 0;
 	}
 
-	return found ? 0 : ENODEV;
+	return ENODEV;
 }
 
 /*
@@ -511,9 +741,13 @@ vfs_mount(const char *devname, void *data,
 {
 	const char *volname;
 	struct knowndev *kd;
+	struct knowndevsnap *snap;
 	struct fs *fs;
 	int result;
 
+	/* Cached executable pages hold vnode references */
+	vm_textcache_purge(NULL);
+
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -539,6 +773,17 @@ vfs_mount(const char *devname, void *data,
 
 	kd->kd_fs = fs;
 
+	/* The volume name has to be findable; if not, back out */
+	snap = knowndevsnap_build();
+	if (snap == NULL) {
+		kd->kd_fs = NULL;
+		FSOP_SYNC(fs);
+		FSOP_UNMOUNT(fs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	knowndevsnap_publish(snap);
+
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
@@ -547,6 +792,23 @@ vfs_mount(const char *devname, void *data,
 	return 0;
 }
 
+/*
+ * Publish a new copy of knowndevs after an unmount. If there's no
+ * memory for it the old one will do, since its entry for the volume
+ * name is ignored now that the device has no filesystem.
+ */
+static
+void
+vfs_republish(void)
+{
+	struct knowndevsnap *snap;
+
+	snap = knowndevsnap_build();
+	if (snap != NULL) {
+		knowndevsnap_publish(snap);
+	}
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -557,6 +819,10 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	/* Cached executable pages and names hold vnode references */
+	vm_textcache_purge(NULL);
+	vfs_nc_purge();
+
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -585,6 +851,7 @@ vfs_unmount(const char *devname)
 
 	/* now drop the filesystem */
 	kd->kd_fs = NULL;
+	vfs_republish();
 
 	KASSERT(result==0);
 
@@ -603,6 +870,9 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	vm_textcache_purge(NULL);
+	vfs_nc_purge();
+
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -648,6 +918,7 @@ vfs_unmountall(void)
 
 		/* now drop the filesystem */
 		dev->kd_fs = NULL;
+		vfs_republish();
 	}
 
 	vfs_biglock_release();
@@ -127,8 +127,9 @@ vfs_clearbootfs(void)
 
 static
 int
-getdevice(char *path, char **subpath, struct vnode **startvn)
+getdevice(const char *path, const char **subpath, struct vnode **startvn)
 {
+	char devname[NAME_MAX+1];
 	int slash=-1, colon=-1, i;
 	struct vnode *vn;
 	int result;
@@ -164,14 +165,19 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 
 	if (colon>0) {
 		/* device:path - get root of device's filesystem */
-		path[colon]=0;
+		if (colon > NAME_MAX) {
+			return ENAMETOOLONG;
+		}
+		memcpy(devname, path, colon);
+		devname[colon] = 0;
+
 		while (path[colon+1]=='/') {
 			/* device:/path - skip slash, treat as device:path */
 			colon++;
 		}
 		*subpath = &path[colon+1];
 
-		result = vfs_getroot(path, startvn);
+		result = vfs_getroot(devname, startvn);
 		if (result) {
 			return result;
 		}
@@ -223,16 +229,115 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Path components.
+ */
+bool
+vfs_path_next(const char **path, const char **name, size_t *len)
+{
+	const char *s = *path;
+	size_t n;
+
+	while (*s == '/') {
+		s++;
+	}
+	for (n = 0; s[n] != 0 && s[n] != '/'; n++) {
+		/* nothing */
+	}
+	*path = s + n;
+	if (n == 0) {
+		return false;
+	}
+	*name = s;
+	*len = n;
+	return true;
+}
+
+/*
+ * Can the result of looking up the component NAME (LEN bytes) in DIR
+ * go in the name cache? Only names in a filesystem directory: "." and
+ * "..", and anything in a device, go straight to the filesystem.
+ */
+static
+bool
+lookup_cacheable(struct vnode *dir, const char *name, size_t len)
+{
+	if (dir->vn_fs == NULL || len > NAME_MAX) {
+		return false;
+	}
+	if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Walk *PATH from DIR a component at a time, looking each one up in
+ * the name cache and going to VOP_LOOKUP for just that name on a miss.
+ * Stops at the end of the path, at a component the cache can't take,
+ * or, with PARENT set, at the last component. Hands back a reference
+ * to the vnode it got to, and sets *PATH to what is left: empty, or
+ * starting at the component it stopped on, for the caller to pass to
+ * the filesystem in one go.
+ */
+static
+int
+lookup_walk(struct vnode *dir, const char **path, bool parent,
+	    struct vnode **ret)
+{
+	char name[NAME_MAX+1];
+	const char *rest, *comp, *next, *nextcomp;
+	struct vnode *vn;
+	unsigned gen;
+	size_t len, nextlen;
+	int result;
+
+	VOP_INCREF(dir);
+	rest = *path;
+	while (vfs_path_next(&rest, &comp, &len)) {
+		next = rest;
+		if ((parent && !vfs_path_next(&next, &nextcomp, &nextlen)) ||
+		    !lookup_cacheable(dir, comp, len)) {
+			rest = comp;
+			break;
+		}
+		memcpy(name, comp, len);
+		name[len] = 0;
+
+		if (vfs_nc_lookup(dir, name, &vn, &gen)) {
+			result = (vn == NULL) ? ENOENT : 0;
+		}
+		else {
+			result = VOP_LOOKUP(dir, name, &vn);
+			if (result == 0) {
+				vfs_nc_enter(dir, name, vn, gen);
+			}
+			else if (result == ENOENT) {
+				vfs_nc_enter(dir, name, NULL, gen);
+			}
+		}
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = vn;
+	}
+
+	*path = rest;
+	*ret = dir;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
  */
 
 int
-vfs_lookparent(char *path, struct vnode **retval,
+vfs_lookparent(const char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
 	int result;
 
 	vfs_biglock_acquire();
@@ -252,7 +357,18 @@ vfs_lookparent(char *path, struct vnode **retval,
 		result = EINVAL;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		result = lookup_walk(startvn, &path, true, &dir);
+		if (result == 0) {
+			if (*path == 0) {
+				/* nothing but slashes after the device */
+				result = EINVAL;
+			}
+			else {
+				result = VOP_LOOKPARENT(dir, path, retval,
+							buf, buflen);
+			}
+			VOP_DECREF(dir);
+		}
 	}
 
 	VOP_DECREF(startvn);
@@ -262,9 +378,9 @@ vfs_lookparent(char *path, struct vnode **retval,
 }
 
 int
-vfs_lookup(char *path, struct vnode **retval)
+vfs_lookup(const char *path, struct vnode **retval)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *vn;
 	int result;
 
 	vfs_biglock_acquire();
@@ -281,7 +397,16 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_walk(startvn, &path, false, &vn);
+	if (result == 0) {
+		if (*path == 0) {
+			*retval = vn;
+		}
+		else {
+			result = VOP_LOOKUP(vn, path, retval);
+			VOP_DECREF(vn);
+		}
+	}
 
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
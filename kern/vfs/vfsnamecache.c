@@ -0,0 +1,343 @@
+/*
+ * Name cache: remembers what VOP_LOOKUP said for a single name in a
+ * directory, as (directory, name) -> vnode, or -> none for names that
+ * don't exist. vfs_lookup checks it before calling down into the
+ * filesystem, which for SFS means a scan of the whole directory.
+ *
+ * Entries hold a reference to both vnodes, so a vnode pointer in the
+ * cache can't be freed and reused behind our back. That also keeps
+ * cached files loaded; vfs_unmount empties the cache first so they
+ * don't make the filesystem look busy.
+ *
+ * The operations that change directories (vfs_open with O_CREAT,
+ * vfs_remove, vfs_rename, vfs_link, ...) call vfs_nc_invalidate for
+ * the names they touch once the filesystem is done. A lookup that
+ * missed might get its answer from the filesystem before such a change
+ * and try to enter it after; to catch that, every invalidation bumps
+ * nc_gen, and vfs_nc_enter drops the entry if nc_gen moved since the
+ * miss.
+ *
+ * Under memory pressure the VM system calls nc_shrink, which drops the
+ * least recently used entries so the vnodes only they were keeping
+ * loaded can be reclaimed.
+ */
+
+#define KMTAG KMT_VFS
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define NC_SIZE      128	/* entries */
+#define NC_HASHSIZE  64
+#define NC_NAMELEN   31		/* longer names aren't cached */
+#define NC_PERPAGE   4		/* entries dropped per page asked for */
+
+struct ncentry {
+	struct vnode *nc_dir;		/* NULL if the entry is free */
+	struct vnode *nc_vn;		/* NULL for "doesn't exist" */
+	char nc_name[NC_NAMELEN+1];
+	struct ncentry *nc_hashnext;
+	struct ncentry *nc_lruprev;	/* LRU list; oldest at the head */
+	struct ncentry *nc_lrunext;
+};
+
+static struct lock *nc_lock;		/* covers everything here */
+static struct ncentry *nc_entries;
+static struct ncentry *nc_hash[NC_HASHSIZE];
+static struct ncentry *nc_lruhead;
+static struct ncentry *nc_lrutail;
+static unsigned nc_gen;
+
+static unsigned nc_shrink(unsigned npages);
+static struct shrinker nc_shrinker = { "vfs_nc", nc_shrink, NULL };
+
+void
+vfs_nc_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lock = lock_create("vfs_nc");
+	nc_entries = kmalloc(NC_SIZE * sizeof(struct ncentry));
+	if (nc_lock == NULL || nc_entries == NULL) {
+		panic("vfs: Could not create name cache\n");
+	}
+
+	vm_register_shrinker(&nc_shrinker);
+
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_entries[i].nc_lruprev = nc_lrutail;
+		nc_entries[i].nc_lrunext = NULL;
+		if (nc_lrutail != NULL) {
+			nc_lrutail->nc_lrunext = &nc_entries[i];
+		}
+		else {
+			nc_lruhead = &nc_entries[i];
+		}
+		nc_lrutail = &nc_entries[i];
+	}
+	nc_gen = 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lists. Call with nc_lock held.
+
+static
+unsigned
+nc_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir / sizeof(struct vnode);
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % NC_HASHSIZE;
+}
+
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	for (nc = nc_hash[nc_hashfn(dir, name)]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+nc_lrumove(struct ncentry *nc, bool totail)
+{
+	/* unlink */
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+
+	/* and put back at one end */
+	if (totail) {
+		nc->nc_lruprev = nc_lrutail;
+		nc->nc_lrunext = NULL;
+		if (nc_lrutail != NULL) {
+			nc_lrutail->nc_lrunext = nc;
+		}
+		else {
+			nc_lruhead = nc;
+		}
+		nc_lrutail = nc;
+	}
+	else {
+		nc->nc_lruprev = NULL;
+		nc->nc_lrunext = nc_lruhead;
+		if (nc_lruhead != NULL) {
+			nc_lruhead->nc_lruprev = nc;
+		}
+		else {
+			nc_lrutail = nc;
+		}
+		nc_lruhead = nc;
+	}
+}
+
+/*
+ * Take NC out of the cache and make it free. The vnode references it
+ * held are handed back in DIR and VN for the caller to drop after
+ * letting go of nc_lock (VOP_DECREF may reclaim, which can sleep on
+ * filesystem locks).
+ */
+static
+void
+nc_free(struct ncentry *nc, struct vnode **dir, struct vnode **vn)
+{
+	struct ncentry **pp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	for (pp = &nc_hash[nc_hashfn(nc->nc_dir, nc->nc_name)]; *pp != nc;
+	     pp = &(*pp)->nc_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dir = nc->nc_dir;
+	*vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+
+	/* Free entries get reused first */
+	nc_lrumove(nc, false);
+}
+
+static
+void
+nc_drop(struct vnode *dir, struct vnode *vn)
+{
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+/*
+ * Shrinker: drop the oldest entries, NC_PERPAGE of them for each page
+ * asked for. Free entries sit at the head of the LRU list, so each pass
+ * looks past them for the oldest one in use. What that gives back is
+ * really the vnodes, which we can't see, so this is a guess.
+ */
+static
+unsigned
+nc_shrink(unsigned npages)
+{
+	struct ncentry *nc;
+	struct vnode *dir, *vn;
+	unsigned n;
+
+	if (lock_do_i_hold(nc_lock)) {
+		return 0;
+	}
+
+	lock_acquire(nc_lock);
+	for (n = 0; n < npages * NC_PERPAGE; n++) {
+		for (nc = nc_lruhead; nc != NULL && nc->nc_dir == NULL;
+		     nc = nc->nc_lrunext) {
+			/* skip free entries */
+		}
+		if (nc == NULL) {
+			break;
+		}
+		nc_free(nc, &dir, &vn);
+		lock_release(nc_lock);
+		nc_drop(dir, vn);
+		lock_acquire(nc_lock);
+	}
+	lock_release(nc_lock);
+
+	return n / NC_PERPAGE;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+bool
+vfs_nc_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+	      unsigned *gen)
+{
+	struct ncentry *nc;
+
+	lock_acquire(nc_lock);
+	nc = nc_find(dir, name);
+	if (nc == NULL) {
+		*gen = nc_gen;
+		lock_release(nc_lock);
+		return false;
+	}
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+	}
+	*ret = nc->nc_vn;
+	nc_lrumove(nc, true);
+	lock_release(nc_lock);
+	return true;
+}
+
+void
+vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) > NC_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(nc_lock);
+	if (gen != nc_gen || nc_find(dir, name) != NULL) {
+		/* Something changed since the miss, or someone beat us */
+		lock_release(nc_lock);
+		return;
+	}
+
+	/* Recycle the oldest entry */
+	nc = nc_lruhead;
+	if (nc->nc_dir != NULL) {
+		nc_free(nc, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	strcpy(nc->nc_name, name);
+	nc->nc_hashnext = nc_hash[nc_hashfn(dir, name)];
+	nc_hash[nc_hashfn(dir, name)] = nc;
+	nc_lrumove(nc, true);
+	lock_release(nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+void
+vfs_nc_invalidate(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	lock_acquire(nc_lock);
+	nc_gen++;
+	nc = nc_find(dir, name);
+	if (nc != NULL) {
+		nc_free(nc, &olddir, &oldvn);
+	}
+	lock_release(nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+void
+vfs_nc_purge(void)
+{
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	lock_acquire(nc_lock);
+	nc_gen++;
+	for (i=0; i<NC_SIZE; i++) {
+		if (nc_entries[i].nc_dir == NULL) {
+			continue;
+		}
+		nc_free(&nc_entries[i], &dir, &vn);
+		lock_release(nc_lock);
+		nc_drop(dir, vn);
+		lock_acquire(nc_lock);
+	}
+	lock_release(nc_lock);
+}
@@ -38,11 +38,12 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 
 
 /* Does most of the work for open(). */
 int
-vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
+vfs_open(const char *path, int openflags, mode_t mode, struct vnode **ret)
 {
 	int how;
 	int result;
@@ -74,6 +75,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		vfs_nc_invalidate(dir, name);
 
 		VOP_DECREF(dir);
 	}
@@ -87,6 +89,11 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 
 	KASSERT(vn != NULL);
 
+	if (canwrite) {
+		/* Don't let running programs see stale executable pages */
+		vm_textcache_purge(vn);
+	}
+
 	result = VOP_OPEN(vn, openflags);
 	if (result) {
 		VOP_DECREF(vn);
@@ -138,7 +145,7 @@ vfs_close(struct vnode *vn)
 
 /* Does most of the work for remove(). */
 int
-vfs_remove(char *path)
+vfs_remove(const char *path)
 {
 	struct vnode *dir;
 	char name[NAME_MAX+1];
@@ -150,6 +157,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_nc_invalidate(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -157,7 +165,7 @@ vfs_remove(char *path)
 
 /* Does most of the work for rename(). */
 int
-vfs_rename(char *oldpath, char *newpath)
+vfs_rename(const char *oldpath, const char *newpath)
 {
 	struct vnode *olddir;
 	char oldname[NAME_MAX+1];
@@ -183,6 +191,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_nc_invalidate(olddir, oldname);
+	vfs_nc_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -192,7 +202,7 @@ vfs_rename(char *oldpath, char *newpath)
 
 /* Does most of the work for link(). */
 int
-vfs_link(char *oldpath, char *newpath)
+vfs_link(const char *oldpath, const char *newpath)
 {
 	struct vnode *oldfile;
 	struct vnode *newdir;
@@ -217,6 +227,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_nc_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -232,7 +243,7 @@ vfs_link(char *oldpath, char *newpath)
  * support for symlinks.
  */
 int
-vfs_symlink(const char *contents, char *path)
+vfs_symlink(const char *contents, const char *path)
 {
 	struct vnode *newdir;
 	char newname[NAME_MAX+1];
@@ -244,6 +255,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_nc_invalidate(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -257,7 +269,7 @@ vfs_symlink(const char *contents, char *path)
  * support for symlinks.
  */
 int
-vfs_readlink(char *path, struct uio *uio)
+vfs_readlink(const char *path, struct uio *uio)
 {
 	struct vnode *vn;
 	int result;
@@ -278,7 +290,7 @@ vfs_readlink(char *path, struct uio *uio)
  * Does most of the work for mkdir.
  */
 int
-vfs_mkdir(char *path, mode_t mode)
+vfs_mkdir(const char *path, mode_t mode)
 {
 	struct vnode *parent;
 	char name[NAME_MAX+1];
@@ -290,6 +302,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_nc_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -300,7 +313,7 @@ vfs_mkdir(char *path, mode_t mode)
  * Does most of the work for rmdir.
  */
 int
-vfs_rmdir(char *path)
+vfs_rmdir(const char *path)
 {
 	struct vnode *parent;
 	char name[NAME_MAX+1];
@@ -312,6 +325,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_nc_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <membar.h>
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
@@ -51,8 +52,10 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	rangelock_init(&vn->vn_rangelock, "vnode");
 	return 0;
 }
 
@@ -66,6 +69,8 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+	spinlock_cleanup(&vn->vn_countlock);
+	rangelock_cleanup(&vn->vn_rangelock);
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -77,17 +82,39 @@ vnode_cleanup(struct vnode *vn)
 /*
  * Increment refcount.
  * Called by VOP_INCREF.
+ *
+ * The caller either has a reference already or is the filesystem
+ * handing one out under its vnode table lock, so the count can't be
+ * going to zero underneath us and a plain atomic add will do.
  */
 void
 vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
-	vn->vn_refcount++;
+	spinlock_data_fetchadd(&vn->vn_refcount, 1);
+}
 
-	vfs_biglock_release();
+/*
+ * Drop a reference unless it's the last one. Returns false, with the
+ * count left at 1, if it is.
+ */
+bool
+vnode_decref_notlast(struct vnode *vn)
+{
+	spinlock_data_t old;
+
+	/* Whatever we did with the vnode happens before others see the drop */
+	membar_any_store();
+	do {
+		old = vn->vn_refcount;
+		KASSERT(old > 0);
+		if (old == 1) {
+			membar_load_any();
+			return false;
+		}
+	} while (!spinlock_data_cas(&vn->vn_refcount, old, old - 1));
+	return true;
 }
 
 /*
@@ -102,13 +129,8 @@ vnode_decref(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
-	KASSERT(vn->vn_refcount>0);
-	if (vn->vn_refcount>1) {
-		vn->vn_refcount--;
-	}
-	else {
+	/* The reclaim routine consumes the last reference */
+	if (!vnode_decref_notlast(vn)) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +138,6 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -129,9 +149,9 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_opencount++;
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
@@ -141,17 +161,18 @@ vnode_incopen(struct vnode *vn)
 void
 vnode_decopen(struct vnode *vn)
 {
+	bool doclose;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_opencount>0);
 	vn->vn_opencount--;
+	doclose = (vn->vn_opencount == 0);
+	spinlock_release(&vn->vn_countlock);
 
-	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
+	if (!doclose) {
 		return;
 	}
 
@@ -162,8 +183,6 @@ vnode_decopen(struct vnode *vn)
 		// doesn't get reached...
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -173,7 +192,7 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
+	int refcount, opencount;
 
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
@@ -202,26 +221,30 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
-	if (v->vn_refcount < 0) {
+	spinlock_acquire(&v->vn_countlock);
+	/* an underflow shows up as negative */
+	refcount = (int)v->vn_refcount;
+	opencount = v->vn_opencount;
+	spinlock_release(&v->vn_countlock);
+
+	if (refcount < 0) {
 		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
-		      v->vn_refcount);
+		      refcount);
 	}
-	else if (v->vn_refcount == 0 && strcmp(opstr, "reclaim")) {
+	else if (refcount == 0 && strcmp(opstr, "reclaim")) {
 		panic("vnode_check: vop_%s: zero refcount\n", opstr);
 	}
-	else if (v->vn_refcount > 0x100000) {
+	else if (refcount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large refcount %d\n",
-			opstr, v->vn_refcount);
+			opstr, refcount);
 	}
 
-	if (v->vn_opencount < 0) {
+	if (opencount < 0) {
 		panic("vnode_check: vop_%s: negative opencount %d\n", opstr,
-		      v->vn_opencount);
+		      opencount);
 	}
-	else if (v->vn_opencount > 0x100000) {
+	else if (opencount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large opencount %d\n",
-			opstr, v->vn_opencount);
+			opstr, opencount);
 	}
-
-	vfs_biglock_release();
 }
@@ -35,6 +35,7 @@
 #include <current.h>
 #include <vm.h>
 #include <copyinout.h>
+#include <kern/strword.h>
 
 /*
  * User/kernel memory copying functions.
@@ -229,15 +230,35 @@ copyout(const void *src, userptr_t userdest, size_t len)
  * hit STOPLEN it's because the string has run into the end of
  * userspace. Thus in the latter case we return EFAULT, not
  * ENAMETOOLONG.
+ *
+ * Like strcpy, it moves whole words while it can (see <kern/strword.h>),
+ * but never reads a word that isn't entirely inside both limits.
  */
 static
 int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
+	size_t i = 0, limit;
+	unsigned long w;
+
+	limit = maxlen < stoplen ? maxlen : stoplen;
+	if ((uintptr_t)dest % sizeof(long) == (uintptr_t)src % sizeof(long)) {
+		while (i < limit && !STRWORD_ALIGNED(src + i) && src[i] != 0) {
+			dest[i] = src[i];
+			i++;
+		}
+		while (STRWORD_ALIGNED(src + i) && i + sizeof(long) <= limit) {
+			w = *(const unsigned long *)(src + i);
+			if (STRWORD_HASZERO(w)) {
+				break;
+			}
+			*(unsigned long *)(dest + i) = w;
+			i += sizeof(long);
+		}
+	}
 
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	for (; i<maxlen && i<stoplen; i++) {
 		dest[i] = src[i];
 		if (src[i] == 0) {
 			if (gotlen != NULL) {
@@ -319,3 +340,169 @@ copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return result;
 }
+
+/*
+ * Check that every range in VEC is wholly in userspace.
+ */
+static
+int
+copycheckv(const struct copyvec *vec, unsigned n)
+{
+	unsigned i;
+	size_t stoplen;
+	int result;
+
+	for (i=0; i<n; i++) {
+		if (vec[i].cv_len == 0) {
+			continue;
+		}
+		result = copycheck(vec[i].cv_uaddr, vec[i].cv_len, &stoplen);
+		if (result) {
+			return result;
+		}
+		if (stoplen != vec[i].cv_len) {
+			return EFAULT;
+		}
+	}
+	return 0;
+}
+
+/*
+ * copyinv
+ *
+ * Copy each range of VEC from user memory into the kernel, with one
+ * tm_badfaultfunc/copyfail setup for the lot.
+ */
+int
+copyinv(const struct copyvec *vec, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	result = copycheckv(vec, n);
+	if (result) {
+		return result;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	for (i=0; i<n; i++) {
+		memcpy(vec[i].cv_kaddr, (const void *)vec[i].cv_uaddr,
+		       vec[i].cv_len);
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return 0;
+}
+
+/*
+ * copyoutv
+ *
+ * Copy each range of VEC from the kernel out to user memory, with one
+ * tm_badfaultfunc/copyfail setup for the lot.
+ */
+int
+copyoutv(const struct copyvec *vec, unsigned n)
+{
+	unsigned i;
+	int result;
+
+	result = copycheckv(vec, n);
+	if (result) {
+		return result;
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	for (i=0; i<n; i++) {
+		memcpy((void *)vec[i].cv_uaddr, vec[i].cv_kaddr,
+		       vec[i].cv_len);
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return 0;
+}
+
+/*
+ * copyinstrs
+ *
+ * Copy in a whole null-terminated array of user string pointers and
+ * the strings they point to, packing the strings into DEST. Both the
+ * pointers and the strings are read under a single
+ * tm_badfaultfunc/copyfail setup; copycheck is still applied to each
+ * one before it's touched.
+ */
+int
+copyinstrs(const_userptr_t uargv, char *dest, size_t len, size_t *got,
+	   unsigned long *count)
+{
+	const_userptr_t uarg;
+	size_t stoplen, used, n;
+	unsigned long num;
+	int result;
+
+	used = 0;
+	num = 0;
+
+	curthread->t_machdep.tm_badfaultfunc = copyfail;
+
+	result = setjmp(curthread->t_machdep.tm_copyjmp);
+	if (result) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+
+	for (;;) {
+		result = copycheck(uargv, sizeof(uarg), &stoplen);
+		if (result == 0 && stoplen != sizeof(uarg)) {
+			result = EFAULT;
+		}
+		if (result) {
+			break;
+		}
+		uarg = *(const const_userptr_t *)uargv;
+		if (uarg == NULL) {
+			break;
+		}
+
+		if (used == len) {
+			result = ENAMETOOLONG;
+			break;
+		}
+		result = copycheck(uarg, len - used, &stoplen);
+		if (result == 0) {
+			result = copystr(dest + used, (const char *)uarg,
+					 len - used, stoplen, &n);
+		}
+		if (result) {
+			break;
+		}
+		used += n;
+		num++;
+		uargv += sizeof(uarg);
+	}
+
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+
+	if (result == ENAMETOOLONG) {
+		return E2BIG;
+	}
+	if (result) {
+		return result;
+	}
+	*got = used;
+	*count = num;
+	return 0;
+}
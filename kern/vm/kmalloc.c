@@ -29,8 +29,15 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmem.h>
+#include "opt-kmsites.h"
+#include "opt-kmtags.h"
 
 /*
  * Kernel malloc.
@@ -71,9 +78,18 @@ fill_deadbeef(void *vptr, size_t len)
 //    sizes, and large numbers of items of the new size are allocated.
 //
 //    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    pageref structures. Each page is found from its address through a
+//    map indexed by page number, and the pages of each size that still have free
+//    blocks are kept on a per-size list, so neither allocation nor free
+//    has to look at pages that are full. Maintaining these tables is a
+//    nuisance, because they cannot recursively use the subpage
+//    allocator; pagerefs come a whole page at a time from alloc_kpages.
+//
+//    On top of that each cpu keeps a few free blocks of each size,
+//    taken from and given back to the pages a batch at a time, so most
+//    allocations and frees don't touch the pages or their lock at all.
+//    Blocks in a cpu's cache count as allocated as far as the pages
+//    are concerned.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -102,8 +118,8 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_samesize;	/* also links free pagerefs */
+	struct pageref *prev_samesize;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,87 +134,118 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy.
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs are handed out from a free list. The first page's worth
+ * lives in the kernel BSS so the allocator works before there is
+ * anything to call alloc_kpages on; after that, whenever the list runs
+ * dry, another page is carved up. Pages of pagerefs are never given
+ * back.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define NBOOTPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
+static struct pageref bootpagerefs[NBOOTPAGEREFS];
+static bool bootpagerefs_used;
+
+static struct pageref *freepagerefs;
+static unsigned npagerefs;	/* total, free or not */
+
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	for (i=0; i<n; i++) {
+		prs[i].next_samesize = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+	npagerefs += n;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (freepagerefs == NULL && !bootpagerefs_used) {
+		addpagerefs(bootpagerefs, NBOOTPAGEREFS);
+		bootpagerefs_used = true;
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	if (pr == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->pageaddr_and_blocktype = 0;
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
 }
 
 ////////////////////////////////////////
 
+/*
+ * Pages with at least one free block, per size; doubly linked so a
+ * page can come off its list in constant time.
+ */
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+
+/*
+ * The pageref of every page in use by the subpage allocator, by page
+ * number. It's in two levels so only the parts covering memory that's
+ * been used take up space: each leaf is a page of pointers, made when
+ * first needed and never freed, and the top level covers all of
+ * KSEG0.
+ */
+#define PM_LEAFSIZE  (PAGE_SIZE / sizeof(struct pageref *))
+#define PM_TOPSIZE   ((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE / PM_LEAFSIZE)
+#define PM_PAGENUM(va)  (KVADDR_TO_PADDR(va) / PAGE_SIZE)
+#define PM_TOP(va)   (PM_PAGENUM(va) / PM_LEAFSIZE)
+#define PM_LEAF(va)  (PM_PAGENUM(va) % PM_LEAFSIZE)
+static struct pageref **pagemap[PM_TOPSIZE];
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock covers the pages and the tables. kfree reads the page
+ * map without it, though; see subpage_lookup.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu caches of free blocks. A cpu moves BATCHES[i] blocks of
+ * size i at a time between its cache and the pages, and holds at most
+ * twice that; bigger blocks come in smaller batches so a cache never
+ * holds much memory. Only touched by the owning cpu, with interrupts
+ * off.
+ */
+
+/* Cpus with caches; any beyond this always use the pages */
+#define KMALLOC_MAXCPUS 32
+#define KMALLOC_MAXBATCH 32
+
+static const unsigned batches[NSIZES] = { 32, 32, 16, 8, 4, 2, 1, 1 };
+
+struct kmcache {
+	struct freelist *kmc_head;
+	unsigned kmc_count;
+};
+
+static struct kmcache kmcaches[KMALLOC_MAXCPUS][NSIZES];
+
+////////////////////////////////////////
+
 /* SLOWER implies SLOW */
 #ifdef SLOWER
 #ifndef SLOW
@@ -246,13 +293,116 @@ checksubpage(struct pageref *pr)
 #define checksubpage(pr) ((void)(pr))
 #endif
 
+////////////////////////////////////////
+
+static
+void
+pagemap_insert(struct pageref *pr)
+{
+	vaddr_t prpage = PR_PAGEADDR(pr);
+
+	KASSERT(pagemap[PM_TOP(prpage)] != NULL);
+	KASSERT(pagemap[PM_TOP(prpage)][PM_LEAF(prpage)] == NULL);
+	pagemap[PM_TOP(prpage)][PM_LEAF(prpage)] = pr;
+}
+
+static
+void
+pagemap_remove(struct pageref *pr)
+{
+	vaddr_t prpage = PR_PAGEADDR(pr);
+
+	KASSERT(pagemap[PM_TOP(prpage)][PM_LEAF(prpage)] == pr);
+	pagemap[PM_TOP(prpage)][PM_LEAF(prpage)] = NULL;
+}
+
+/*
+ * The pageref of page PRPAGE, or NULL. Only KSEG0 pages are ever in
+ * the map; multi-page allocations alloc_kpages had to map in KSEG2
+ * come here from kfree too, and aren't ours.
+ */
+static
+struct pageref *
+pagemap_find(vaddr_t prpage)
+{
+	struct pageref **leaf;
+
+	if (prpage < MIPS_KSEG0 || prpage >= MIPS_KSEG1) {
+		return NULL;
+	}
+	leaf = pagemap[PM_TOP(prpage)];
+	return leaf != NULL ? leaf[PM_LEAF(prpage)] : NULL;
+}
+
+/*
+ * The first page in use at or after page number *POS, which is moved
+ * past it; NULL if there are no more. Call with kmalloc_spinlock held.
+ */
+static
+struct pageref *
+pagemap_next(unsigned *pos)
+{
+	struct pageref **leaf;
+	struct pageref *pr;
+
+	while (*pos < PM_TOPSIZE * PM_LEAFSIZE) {
+		leaf = pagemap[*pos / PM_LEAFSIZE];
+		if (leaf == NULL) {
+			*pos = ROUNDUP(*pos + 1, PM_LEAFSIZE);
+			continue;
+		}
+		pr = leaf[*pos % PM_LEAFSIZE];
+		(*pos)++;
+		if (pr != NULL) {
+			checksubpage(pr);
+			return pr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Make sure the page map has a leaf for PRPAGE. Call without
+ * kmalloc_spinlock. Returns false if out of memory.
+ */
+static
+bool
+pagemap_addleaf(vaddr_t prpage)
+{
+	vaddr_t leaf;
+
+	if (pagemap[PM_TOP(prpage)] != NULL) {
+		return true;
+	}
+	leaf = alloc_kpages(1);
+	if (leaf == 0) {
+		return false;
+	}
+	bzero((void *)leaf, PAGE_SIZE);
+	/* Cleared before anyone can see it */
+	membar_store_store();
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagemap[PM_TOP(prpage)] == NULL) {
+		pagemap[PM_TOP(prpage)] = (struct pageref **)leaf;
+		leaf = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (leaf != 0) {
+		/* Someone else got there first */
+		free_kpages(leaf);
+	}
+	return true;
+}
+
 #ifdef SLOWER
 static
 void
 checksubpages(void)
 {
 	struct pageref *pr;
-	int i;
+	unsigned i;
 	unsigned sc=0, ac=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
@@ -260,18 +410,22 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(PR_BLOCKTYPE(pr) == (unsigned)i);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	i = 0;
+	while ((pr = pagemap_next(&i)) != NULL) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(PM_PAGENUM(PR_PAGEADDR(pr)) == i - 1);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc<=ac);
 }
 #else
 #define checksubpages()
@@ -334,44 +488,130 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	i = 0;
+	while ((pr = pagemap_next(&i)) != NULL) {
 		dumpsubpage(pr);
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("Object caches:\n");
+	kmem_printstats();
 }
 
-////////////////////////////////////////
+/* A page under a quarter used is nearly empty */
+#define FRAG_NEARLYEMPTY(pr, blktype) \
+	((pr)->nfree * 4 >= (PAGE_SIZE / sizes[blktype]) * 3)
+
+/* How many nearly empty pages kheap_printfrag names */
+#define FRAG_MAXLIST 16
 
-static
 void
-remove_lists(struct pageref *pr, int blktype)
+kheap_printfrag(void)
 {
-	struct pageref **guy;
+	struct pageref *pr;
+	unsigned pages[NSIZES], freeblocks[NSIZES], nearlyempty[NSIZES];
+	vaddr_t list[FRAG_MAXLIST];
+	unsigned listnfree[FRAG_MAXLIST], listtype[FRAG_MAXLIST];
+	unsigned cached[NSIZES];
+	unsigned i, blktype, nlist = 0, totpages = 0, totfree = 0;
 
-	KASSERT(blktype>=0 && blktype<NSIZES);
+	for (i=0; i<NSIZES; i++) {
+		pages[i] = freeblocks[i] = nearlyempty[i] = cached[i] = 0;
+	}
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
+	/* Other cpus' caches change under us; near enough */
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		for (blktype=0; blktype<NSIZES; blktype++) {
+			cached[blktype] += kmcaches[i][blktype].kmc_count;
 		}
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+	/* Count with the lock held, print afterwards */
+	spinlock_acquire(&kmalloc_spinlock);
+	i = 0;
+	while ((pr = pagemap_next(&i)) != NULL) {
+		blktype = PR_BLOCKTYPE(pr);
+		pages[blktype]++;
+		freeblocks[blktype] += pr->nfree;
+		if (!FRAG_NEARLYEMPTY(pr, blktype)) {
+			continue;
+		}
+		nearlyempty[blktype]++;
+		if (nlist < FRAG_MAXLIST) {
+			list[nlist] = PR_PAGEADDR(pr);
+			listnfree[nlist] = pr->nfree;
+			listtype[nlist] = blktype;
+			nlist++;
 		}
 	}
+	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("Subpage heap fragmentation:\n");
+	kprintf("  size  pages  free blocks  free bytes  used  nearly empty"
+		"  cached\n");
+	for (i=0; i<NSIZES; i++) {
+		if (pages[i] == 0) {
+			continue;
+		}
+		kprintf("  %4lu  %5u  %11u  %10lu  %3u%%  %12u  %6u\n",
+			(unsigned long)sizes[i], pages[i], freeblocks[i],
+			(unsigned long)(freeblocks[i] * sizes[i]),
+			100 - (unsigned)(freeblocks[i] * sizes[i] * 100 /
+					 (pages[i] * PAGE_SIZE)),
+			nearlyempty[i], cached[i]);
+		totpages += pages[i];
+		totfree += freeblocks[i] * sizes[i];
+	}
+	kprintf("  %u pages, %u bytes free in them\n", totpages, totfree);
+	for (i=0; i<nlist; i++) {
+		kprintf("  nearly empty: 0x%08lx size %-4lu %u/%u free\n",
+			(unsigned long)list[i],
+			(unsigned long)sizes[listtype[i]], listnfree[i],
+			(unsigned)(PAGE_SIZE / sizes[listtype[i]]));
+	}
+}
+
+////////////////////////////////////////
+
+static
+void
+sizelist_insert(struct pageref *pr, int blktype)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	pr->prev_samesize = NULL;
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
+	}
+	sizebases[blktype] = pr;
+}
+
+static
+void
+sizelist_remove(struct pageref *pr, int blktype)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
 }
 
 static
@@ -392,71 +632,109 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * The block type of the subpage allocator's page PRPAGE, or -1 if it
+ * isn't one of ours, without kmalloc_spinlock. The caller must have a
+ * block on the page, if it is ours, so it can't change meanwhile; and
+ * if it isn't, it was taken out of the map before it was freed, let
+ * alone handed out again as a whole page.
+ */
+static
+int
+subpage_lookup(vaddr_t prpage)
+{
+	struct pageref *pr;
+
+	pr = pagemap_find(prpage);
+	return pr != NULL ? (int)PR_BLOCKTYPE(pr) : -1;
+}
+
+/*
+ * This cpu's cache for blocks of type BLKTYPE, or NULL if there isn't
+ * one (early in boot, or too many cpus). Call with interrupts off.
+ */
+static
+struct kmcache *
+kmcache_mine(unsigned blktype)
+{
+	unsigned n;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	n = curcpu->c_number;
+	return n < KMALLOC_MAXCPUS ? &kmcaches[n][blktype] : NULL;
+}
+
+/*
+ * Take a block of type BLKTYPE from the first page that has one, or
+ * return NULL if none do. Call with kmalloc_spinlock held.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_takeblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
-
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		if (pr->nfree > 0) {
+	pr = sizebases[blktype];
+	if (pr == NULL) {
+		return NULL;
+	}
 
-		doalloc: /* comes here after getting a whole fresh page */
+	/* check for corruption */
+	KASSERT(PR_BLOCKTYPE(pr) == blktype);
+	KASSERT(pr->nfree > 0);
+	checksubpage(pr);
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		/* full; nothing more to find here */
+		sizelist_remove(pr, blktype);
+	}
+	return retptr;
+}
 
-			checksubpages();
+/*
+ * Add a fresh page of blocks of type BLKTYPE. Call with
+ * kmalloc_spinlock held; it is let go of while getting the page, so
+ * things can change behind our back. Returns false if out of memory.
+ */
+static
+bool
+subpage_addpage(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
-	}
+	volatile int i;
 
 	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
@@ -464,17 +742,36 @@ subpage_kmalloc(size_t sz)
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
+	}
+	if (!pagemap_addleaf(prpage)) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't map a page\n");
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/* Get another page of accounting space, again unlocked. */
+		vaddr_t refpage;
+
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
+			spinlock_acquire(&kmalloc_spinlock);
+			return false;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+
+		addpagerefs((struct pageref *)refpage,
+			    PAGE_SIZE / sizeof(struct pageref));
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -498,53 +795,137 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	sizelist_insert(pr, blktype);
+	pagemap_insert(pr);
+	return true;
+}
 
-	pr->next_all = allbase;
-	allbase = pr;
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct kmcache *kmc;	// this cpu's cache of that size
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+	int spl;
+
+	blktype = blocktype(sz);
+
+	/* Usually this cpu's cache has one */
+	spl = splhigh();
+	kmc = kmcache_mine(blktype);
+	if (kmc != NULL && kmc->kmc_count > 0) {
+		fl = kmc->kmc_head;
+		kmc->kmc_head = fl->next;
+		kmc->kmc_count--;
+		splx(spl);
+		return fl;
+	}
+	splx(spl);
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	while ((retptr = subpage_takeblock(blktype)) == NULL) {
+		/* No page of the right size available. Make a new one. */
+		if (!subpage_addpage(blktype)) {
+			spinlock_release(&kmalloc_spinlock);
+			return NULL;
+		}
+	}
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	/*
+	 * Fill up the cache while we have the lock, from the pages there
+	 * are. We may be on another cpu by now, so look again.
+	 */
+	kmc = kmcache_mine(blktype);
+	if (kmc != NULL) {
+		while (kmc->kmc_count < batches[blktype] &&
+		       (fl = subpage_takeblock(blktype)) != NULL) {
+			fl->next = kmc->kmc_head;
+			kmc->kmc_head = fl;
+			kmc->kmc_count++;
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
+/*
+ * Put block FL back on its page. Call with kmalloc_spinlock held.
+ * Returns the page if that left it entirely free, in which case it's
+ * been taken out of the tables and the caller should free_kpages it
+ * once the lock is let go of; otherwise 0.
+ */
 static
-int
-subpage_kfree(void *ptr)
+vaddr_t
+subpage_putblock(struct freelist *fl)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
-	ptraddr = (vaddr_t)ptr;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	spinlock_acquire(&kmalloc_spinlock);
+	prpage = (vaddr_t)fl & PAGE_FRAME;
+	pr = pagemap_find(prpage);
+	KASSERT(pr != NULL);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)fl - prpage;
 
-	checksubpages();
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+		/* was full; has room again */
+		sizelist_insert(pr, blktype);
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		sizelist_remove(pr, blktype);
+		pagemap_remove(pr);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t prpage;		// page ptr is on
+	vaddr_t offset;		// offset into page
+	struct kmcache *kmc;	// this cpu's cache of that size
+	struct freelist *fl;	// free list entry
+	vaddr_t freed[KMALLOC_MAXBATCH + 1];	// pages left empty
+	unsigned i, nfreed;
+	int spl;
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
+	ptraddr = (vaddr_t)ptr;
+	prpage = ptraddr & PAGE_FRAME;
 
-	if (pr==NULL) {
+	blktype = subpage_lookup(prpage);
+	if (blktype < 0) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -563,34 +944,46 @@ subpage_kfree(void *ptr)
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	fl = ptr;
+	spl = splhigh();
+	kmc = kmcache_mine(blktype);
+	if (kmc != NULL && kmc->kmc_count < 2 * batches[blktype]) {
+		fl->next = kmc->kmc_head;
+		kmc->kmc_head = fl;
+		kmc->kmc_count++;
+		splx(spl);
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	/* The cache is full (or there isn't one); give back a batch too */
+	nfreed = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	freed[nfreed] = subpage_putblock(fl);
+	if (freed[nfreed] != 0) {
+		nfreed++;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	for (i=0; kmc != NULL && i<batches[blktype]; i++) {
+		fl = kmc->kmc_head;
+		kmc->kmc_head = fl->next;
+		kmc->kmc_count--;
+		freed[nfreed] = subpage_putblock(fl);
+		if (freed[nfreed] != 0) {
+			nfreed++;
+		}
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
 	checksubpages();
+
 	spinlock_release(&kmalloc_spinlock);
-#endif
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreed; i++) {
+		free_kpages(freed[i]);
+	}
 
 	return 0;
 }
@@ -598,24 +991,458 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+page_kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
+	unsigned long npages;
+	vaddr_t address;
+
+	/* Round up to a whole number of pages. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	address = alloc_kpages(npages);
+	if (address==0) {
+		return NULL;
+	}
+
+	return (void *)address;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Call site and subsystem tracking (options kmsites, kmtags).
+//
+//    Each subpage block carries a trailer in its last word saying
+//    which caller and subsystem it came from and how much was asked
+//    for. The request is grown by the size of the trailer before a
+//    block size is picked, so some allocations move up a size class
+//    while this is on. Whole-page allocations are remembered in a
+//    small table instead; any that don't fit in it aren't counted.
+//
+//    The caller is kmalloc's return address, so allocations made
+//    through kstrdup and such are charged to those.
+//
+//    Subsystem totals are kept per cpu, without a lock; a cpu's total
+//    goes negative if it frees more than it allocates. High-water
+//    marks are only as good as the sampling: the totals are added up
+//    every KMTAG_SAMPLE allocations a cpu makes, and for each report.
+//
+
+#define KMTRACK (OPT_KMSITES || OPT_KMTAGS)
+
+#if KMTRACK
+
+#define KMSITE_MAX   128	/* callers told apart; slot 0 is the rest */
+#define KMSITE_NBIG  256	/* whole-page allocations remembered */
+#define KMSITE_TOP   20		/* lines in a report */
+
+struct kmtrailer {
+	uint16_t kt_size;
+	uint8_t kt_site;		/* fits: KMSITE_MAX <= 256 */
+	uint8_t kt_tag;
+};
+#define KMSITE_TRAILER sizeof(struct kmtrailer)
+
+struct kmsite {
+	vaddr_t ks_caller;		/* 0 if the slot is unused */
+	unsigned ks_allocs;		/* total ever */
+	unsigned ks_live;		/* not freed yet */
+	size_t ks_livebytes;
+	size_t ks_peakbytes;
+};
+
+struct kmbig {
+	vaddr_t kb_addr;		/* 0 if the slot is unused */
+	size_t kb_size;
+	unsigned kb_site;
+	unsigned kb_tag;
+};
+
+/* Protects all of the below; never held while taking another lock */
+static struct spinlock kmsite_lock = SPINLOCK_INITIALIZER;
+static struct kmbig kmbigs[KMSITE_NBIG];
+static unsigned kmbig_lost;		/* didn't fit in kmbigs */
+#if OPT_KMSITES
+static struct kmsite kmsites[KMSITE_MAX];
+#endif
+#if OPT_KMTAGS
+static int32_t kmtag_nocpu[KMT_NTAGS];	/* for cpus without a slot below */
+#endif
+
+#if OPT_KMSITES
+
+/*
+ * Find (or claim) the slot for CALLER in the open hash over slots
+ * 1..KMSITE_MAX-1. Returns 0 once they're all taken.
+ */
+static
+unsigned
+kmsite_find(vaddr_t caller)
+{
+	unsigned i, site;
+
+	KASSERT(spinlock_do_i_hold(&kmsite_lock));
+
+	site = (caller / 4) % (KMSITE_MAX - 1) + 1;
+	for (i=0; i<KMSITE_MAX - 1; i++) {
+		if (kmsites[site].ks_caller == caller) {
+			return site;
+		}
+		if (kmsites[site].ks_caller == 0) {
+			kmsites[site].ks_caller = caller;
+			return site;
+		}
+		site = site % (KMSITE_MAX - 1) + 1;
+	}
+	return 0;
+}
+
+static
+void
+kmsite_count(unsigned site, size_t sz)
+{
+	struct kmsite *ks = &kmsites[site];
+
+	ks->ks_allocs++;
+	ks->ks_live++;
+	ks->ks_livebytes += sz;
+	if (ks->ks_livebytes > ks->ks_peakbytes) {
+		ks->ks_peakbytes = ks->ks_livebytes;
+	}
+}
+
+static
+void
+kmsite_uncount(unsigned site, size_t sz)
+{
+	struct kmsite *ks = &kmsites[site];
+
+	KASSERT(site < KMSITE_MAX);
+	KASSERT(ks->ks_live > 0 && ks->ks_livebytes >= sz);
+	ks->ks_live--;
+	ks->ks_livebytes -= sz;
+}
+
+#endif /* OPT_KMSITES */
+
+#if OPT_KMTAGS
+
+/* Allocations a cpu makes between samples of the high-water marks */
+#define KMTAG_SAMPLE 64
+
+static const char *const kmtag_names[KMT_NTAGS] = {
+	"other", "vm", "vfs", "sfs", "proc", "thread", "synch", "net", "dev",
+};
+
+/* Only touched by the owning cpu, with interrupts off */
+static int32_t kmtag_live[KMALLOC_MAXCPUS][KMT_NTAGS];
+static unsigned kmtag_untilsample[KMALLOC_MAXCPUS];
+
+static struct spinlock kmtag_peaklock = SPINLOCK_INITIALIZER;
+static int32_t kmtag_peak[KMT_NTAGS];
+
+/*
+ * Live bytes charged to TAG, as near as we can tell without stopping
+ * the other cpus.
+ */
+static
+int32_t
+kmtag_sum(unsigned tag)
+{
+	int32_t total;
+	unsigned i;
+
+	total = kmtag_nocpu[tag];
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		total += kmtag_live[i][tag];
+	}
+	return total;
+}
+
+static
+void
+kmtag_samplepeaks(void)
+{
+	int32_t live;
+	unsigned i;
+
+	spinlock_acquire(&kmtag_peaklock);
+	for (i=0; i<KMT_NTAGS; i++) {
+		live = kmtag_sum(i);
+		if (live > kmtag_peak[i]) {
+			kmtag_peak[i] = live;
+		}
+	}
+	spinlock_release(&kmtag_peaklock);
+}
 
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
+/*
+ * Charge N bytes (negative for a free) to TAG.
+ */
+static
+void
+kmtag_charge(unsigned tag, int32_t n)
+{
+	unsigned c;
+	bool sample = false;
+	int spl;
+
+	KASSERT(tag < KMT_NTAGS);
+
+	spl = splhigh();
+	if (CURCPU_EXISTS() && curcpu->c_number < KMALLOC_MAXCPUS) {
+		c = curcpu->c_number;
+		kmtag_live[c][tag] += n;
+		if (n > 0 && ++kmtag_untilsample[c] == KMTAG_SAMPLE) {
+			kmtag_untilsample[c] = 0;
+			sample = true;
+		}
+	}
+	else {
+		spinlock_acquire(&kmsite_lock);
+		kmtag_nocpu[tag] += n;
+		spinlock_release(&kmsite_lock);
+	}
+	splx(spl);
+
+	if (sample) {
+		kmtag_samplepeaks();
+	}
+}
+
+void
+kheap_printtags(void)
+{
+	int32_t live[KMT_NTAGS], peak[KMT_NTAGS];
+	unsigned i;
+
+	kmtag_samplepeaks();
+	spinlock_acquire(&kmtag_peaklock);
+	for (i=0; i<KMT_NTAGS; i++) {
+		live[i] = kmtag_sum(i);
+		peak[i] = kmtag_peak[i];
+	}
+	spinlock_release(&kmtag_peaklock);
+
+	kprintf("kmalloc memory by subsystem:\n");
+	kprintf("  subsystem   live bytes  peak bytes\n");
+	for (i=0; i<KMT_NTAGS; i++) {
+		kprintf("  %-9s  %11ld  %10ld\n", kmtag_names[i],
+			(long)live[i], (long)peak[i]);
+	}
+}
+
+#else
+#define kmtag_charge(tag, n) ((void)(tag), (void)(n))
+#endif /* OPT_KMTAGS */
+
+/*
+ * The block size of the subpage block PTR, or 0 if it isn't one.
+ */
+static
+size_t
+subpage_blocksize(void *ptr)
+{
+	int blktype;
+
+	blktype = subpage_lookup((vaddr_t)ptr & PAGE_FRAME);
+	return blktype >= 0 ? sizes[blktype] : 0;
+}
+
+static
+void *
+kmsite_kmalloc(size_t sz, vaddr_t caller, unsigned tag)
+{
+	struct kmtrailer *kt;
+	void *ptr;
+	unsigned i;
+	bool counted = true;
+
+	(void)caller;
+
+	if (sz + KMSITE_TRAILER >= LARGEST_SUBPAGE_SIZE) {
+		ptr = page_kmalloc(sz);
+		if (ptr == NULL) {
 			return NULL;
 		}
+		spinlock_acquire(&kmsite_lock);
+		for (i=0; i<KMSITE_NBIG && kmbigs[i].kb_addr != 0; i++) {
+			/* nothing */
+		}
+		if (i < KMSITE_NBIG) {
+			kmbigs[i].kb_addr = (vaddr_t)ptr;
+			kmbigs[i].kb_size = sz;
+			kmbigs[i].kb_tag = tag;
+#if OPT_KMSITES
+			kmbigs[i].kb_site = kmsite_find(caller);
+			kmsite_count(kmbigs[i].kb_site, sz);
+#endif
+		}
+		else {
+			kmbig_lost++;
+			counted = false;
+		}
+		spinlock_release(&kmsite_lock);
+		if (counted) {
+			kmtag_charge(tag, sz);
+		}
+		return ptr;
+	}
+
+	ptr = subpage_kmalloc(sz + KMSITE_TRAILER);
+	if (ptr == NULL) {
+		return NULL;
+	}
+	kt = (struct kmtrailer *)((char *)ptr +
+				  sizes[blocktype(sz + KMSITE_TRAILER)] -
+				  KMSITE_TRAILER);
+	kt->kt_size = sz;
+	kt->kt_tag = tag;
+	kt->kt_site = 0;
+#if OPT_KMSITES
+	spinlock_acquire(&kmsite_lock);
+	kt->kt_site = kmsite_find(caller);
+	kmsite_count(kt->kt_site, sz);
+	spinlock_release(&kmsite_lock);
+#endif
+	kmtag_charge(tag, sz);
+	return ptr;
+}
+
+/*
+ * Uncount PTR before kfree frees it (and fills it with deadbeef).
+ */
+static
+void
+kmsite_kfree(void *ptr)
+{
+	struct kmtrailer *kt;
+	size_t blocksize, size = 0;
+	unsigned i, tag = 0;
+
+	blocksize = subpage_blocksize(ptr);
+	if (blocksize > 0) {
+		kt = (struct kmtrailer *)((char *)ptr + blocksize -
+					  KMSITE_TRAILER);
+#if OPT_KMSITES
+		spinlock_acquire(&kmsite_lock);
+		kmsite_uncount(kt->kt_site, kt->kt_size);
+		spinlock_release(&kmsite_lock);
+#endif
+		kmtag_charge(kt->kt_tag, -(int32_t)kt->kt_size);
+		return;
+	}
+
+	spinlock_acquire(&kmsite_lock);
+	for (i=0; i<KMSITE_NBIG; i++) {
+		if (kmbigs[i].kb_addr == (vaddr_t)ptr) {
+#if OPT_KMSITES
+			kmsite_uncount(kmbigs[i].kb_site, kmbigs[i].kb_size);
+#endif
+			size = kmbigs[i].kb_size;
+			tag = kmbigs[i].kb_tag;
+			kmbigs[i].kb_addr = 0;
+			break;
+		}
+	}
+	spinlock_release(&kmsite_lock);
+	if (size > 0) {
+		kmtag_charge(tag, -(int32_t)size);
+	}
+}
+
+#endif /* KMTRACK */
 
-		return (void *)address;
+#if OPT_KMSITES
+
+void
+kheap_printsites(void)
+{
+	struct kmsite top[KMSITE_TOP];
+	uint32_t taken[(KMSITE_MAX + 31) / 32];
+	unsigned i, j, best, ntop, lost;
+
+	for (i=0; i<sizeof(taken)/sizeof(taken[0]); i++) {
+		taken[i] = 0;
+	}
+
+	/* Pick out the biggest with the lock held, print afterwards */
+	spinlock_acquire(&kmsite_lock);
+	for (ntop=0; ntop<KMSITE_TOP; ntop++) {
+		best = KMSITE_MAX;
+		for (j=0; j<KMSITE_MAX; j++) {
+			if ((taken[j/32] & (1U << (j%32))) != 0 ||
+			    kmsites[j].ks_allocs == 0) {
+				continue;
+			}
+			if (best == KMSITE_MAX || kmsites[j].ks_livebytes >
+			    kmsites[best].ks_livebytes) {
+				best = j;
+			}
+		}
+		if (best == KMSITE_MAX) {
+			break;
+		}
+		taken[best/32] |= 1U << (best%32);
+		top[ntop] = kmsites[best];
+	}
+	lost = kmbig_lost;
+	spinlock_release(&kmsite_lock);
+
+	kprintf("kmalloc call sites by live bytes:\n");
+	kprintf("  caller        allocs     live  live bytes  peak bytes\n");
+	for (i=0; i<ntop; i++) {
+		if (top[i].ks_caller == 0) {
+			kprintf("  (others)  ");
+		}
+		else {
+			kprintf("  0x%08lx", (unsigned long)top[i].ks_caller);
+		}
+		kprintf("  %8u %8u  %10lu  %10lu\n",
+			top[i].ks_allocs, top[i].ks_live,
+			(unsigned long)top[i].ks_livebytes,
+			(unsigned long)top[i].ks_peakbytes);
+	}
+	if (lost > 0) {
+		kprintf("  (%u whole-page allocations not tracked)\n", lost);
+	}
+}
+
+#else /* !OPT_KMSITES */
+
+void
+kheap_printsites(void)
+{
+	kprintf("kmalloc call sites aren't tracked (options kmsites)\n");
+}
+
+#endif /* OPT_KMSITES */
+
+#if !OPT_KMTAGS
+void
+kheap_printtags(void)
+{
+	kprintf("kmalloc memory isn't charged to subsystems "
+		"(options kmtags)\n");
+}
+#endif
+
+//
+////////////////////////////////////////////////////////////
+
+void *
+kmalloc_tagged(size_t sz, unsigned tag)
+{
+	KASSERT(tag < KMT_NTAGS);
+#if KMTRACK
+	return kmsite_kmalloc(sz, (vaddr_t)__builtin_return_address(0), tag);
+#else
+	if (sz>=LARGEST_SUBPAGE_SIZE) {
+		return page_kmalloc(sz);
 	}
 
 	return subpage_kmalloc(sz);
+#endif
 }
 
 void
@@ -626,7 +1453,11 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if KMTRACK
+	kmsite_kfree(ptr);
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
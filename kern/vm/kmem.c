@@ -0,0 +1,447 @@
+/*
+ * Object caches (see kmem.h).
+ *
+ * Each slab is one page. It starts with a struct kmem_slab, then an
+ * array of free list links (one per object, as indices), then the
+ * objects themselves. The links are kept outside the objects so that a
+ * free object stays in its constructed state.
+ *
+ * Slabs move between three lists in their cache: partial (some objects
+ * free), full and empty. At most one empty slab is kept around; any
+ * others go back to the page allocator. Under memory pressure the spare
+ * goes back too (see kmem_shrink).
+ */
+
+#define KMTAG KMT_VM
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <kmem.h>
+
+/* Objects each cpu can hold on to without going to the slabs */
+#define KMEM_MAGSIZE	8
+
+/* Cpus with a magazine; any beyond this always use the slabs */
+#define KMEM_MAXCPUS	32
+
+#define KMEM_ALIGN	8
+
+#define KMEM_NOLINK	0xffff
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;
+	struct kmem_slab *ks_prev;
+	vaddr_t ks_objs;		/* address of object 0 */
+	uint16_t ks_freehead;		/* index of first free object */
+	uint16_t ks_nfree;
+	uint16_t ks_links[];		/* next free object, per object */
+};
+
+struct kmem_magazine {
+	unsigned km_count;
+	void *km_objs[KMEM_MAGSIZE];
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;
+	unsigned kc_perslab;
+	size_t kc_objoffset;		/* of object 0 from the slab start */
+	void (*kc_ctor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects the slab lists */
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nslabs;
+	unsigned kc_nfree;		/* free objects in slabs */
+
+	/* Only touched by the owning cpu, with interrupts off */
+	struct kmem_magazine kc_mags[KMEM_MAXCPUS];
+
+	struct kmem_cache *kc_next;	/* all caches, for printstats */
+};
+
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+static unsigned kmem_shrink(unsigned npages);
+static struct shrinker kmem_shrinker = { "kmem", kmem_shrink, NULL };
+
+////////////////////////////////////////////////////////////
+
+static
+void
+slab_link(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+slab_unlink(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Which list a slab with NFREE free objects belongs on.
+ */
+static
+struct kmem_slab **
+slab_list(struct kmem_cache *kc, unsigned nfree)
+{
+	if (nfree == 0) {
+		return &kc->kc_full;
+	}
+	if (nfree == kc->kc_perslab) {
+		return &kc->kc_empty;
+	}
+	return &kc->kc_partial;
+}
+
+/*
+ * Set up a fresh page as a slab, running the constructor on every
+ * object. Doesn't need the cache lock; nobody else can see it yet.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_objs = page + kc->kc_objoffset;
+	ks->ks_freehead = 0;
+	ks->ks_nfree = kc->kc_perslab;
+	for (i=0; i<kc->kc_perslab; i++) {
+		ks->ks_links[i] = (i+1 < kc->kc_perslab) ? i+1 : KMEM_NOLINK;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor((void *)(ks->ks_objs + i * kc->kc_size));
+		}
+	}
+	return ks;
+}
+
+/*
+ * Take an object out of the slabs. Must hold the cache lock; returns
+ * NULL if every slab is full.
+ */
+static
+void *
+slab_take(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	ks = kc->kc_partial != NULL ? kc->kc_partial : kc->kc_empty;
+	if (ks == NULL) {
+		return NULL;
+	}
+
+	slab_unlink(slab_list(kc, ks->ks_nfree), ks);
+	i = ks->ks_freehead;
+	KASSERT(i < kc->kc_perslab);
+	ks->ks_freehead = ks->ks_links[i];
+	ks->ks_nfree--;
+	kc->kc_nfree--;
+	slab_link(slab_list(kc, ks->ks_nfree), ks);
+
+	return (void *)(ks->ks_objs + i * kc->kc_size);
+}
+
+/*
+ * Put an object back in its slab. Must hold the cache lock. Returns a
+ * slab that has become surplus, which the caller must free_kpages once
+ * it has dropped the lock, or NULL.
+ */
+static
+struct kmem_slab *
+slab_put(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+	vaddr_t offset;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	if (ks->ks_cache != kc) {
+		panic("kmem_cache_free: %p does not belong to cache %s\n",
+		      obj, kc->kc_name);
+	}
+	offset = (vaddr_t)obj - ks->ks_objs;
+	i = offset / kc->kc_size;
+	if (offset % kc->kc_size != 0 || i >= kc->kc_perslab) {
+		panic("kmem_cache_free: invalid object %p in cache %s\n",
+		      obj, kc->kc_name);
+	}
+
+	slab_unlink(slab_list(kc, ks->ks_nfree), ks);
+	ks->ks_links[i] = ks->ks_freehead;
+	ks->ks_freehead = i;
+	ks->ks_nfree++;
+	kc->kc_nfree++;
+
+	if (ks->ks_nfree == kc->kc_perslab && kc->kc_empty != NULL) {
+		/* Already have a spare; this one goes back */
+		kc->kc_nslabs--;
+		kc->kc_nfree -= kc->kc_perslab;
+		return ks;
+	}
+	slab_link(slab_list(kc, ks->ks_nfree), ks);
+	return NULL;
+}
+
+/*
+ * This cpu's magazine, or NULL if there isn't one (early in boot, or
+ * too many cpus). Call with interrupts off.
+ */
+static
+struct kmem_magazine *
+kmem_mymag(struct kmem_cache *kc)
+{
+	unsigned n;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	n = curcpu->c_number;
+	return n < KMEM_MAXCPUS ? &kc->kc_mags[n] : NULL;
+}
+
+////////////////////////////////////////////////////////////
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned perslab;
+	size_t hdr;
+	bool first;
+
+	size = ROUNDUP(size, KMEM_ALIGN);
+
+	/* As many objects as fit after the header and their links */
+	perslab = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(size + sizeof(uint16_t));
+	hdr = ROUNDUP(sizeof(struct kmem_slab) + perslab * sizeof(uint16_t),
+		      KMEM_ALIGN);
+	while (perslab > 0 && hdr + perslab * size > PAGE_SIZE) {
+		perslab--;
+		hdr = ROUNDUP(sizeof(struct kmem_slab) +
+			      perslab * sizeof(uint16_t), KMEM_ALIGN);
+	}
+	if (perslab == 0) {
+		panic("kmem_cache_create: %s: objects of %lu bytes "
+		      "don't fit in a page\n", name, (unsigned long)size);
+	}
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_perslab = perslab;
+	kc->kc_objoffset = hdr;
+	kc->kc_ctor = ctor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nfree = 0;
+	bzero(kc->kc_mags, sizeof(kc->kc_mags));
+
+	spinlock_acquire(&kmem_caches_lock);
+	first = kmem_caches == NULL;
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	if (first) {
+		vm_register_shrinker(&kmem_shrinker);
+	}
+	return kc;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag;
+	struct kmem_slab *ks;
+	void *obj;
+	int spl;
+
+	spl = splhigh();
+	mag = kmem_mymag(kc);
+	if (mag != NULL && mag->km_count > 0) {
+		obj = mag->km_objs[--mag->km_count];
+		splx(spl);
+		return obj;
+	}
+	splx(spl);
+
+	spinlock_acquire(&kc->kc_lock);
+	obj = slab_take(kc);
+	spinlock_release(&kc->kc_lock);
+	if (obj != NULL) {
+		return obj;
+	}
+
+	/* Get a new slab without holding the lock */
+	ks = slab_create(kc);
+	if (ks == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	slab_link(&kc->kc_empty, ks);
+	kc->kc_nslabs++;
+	kc->kc_nfree += kc->kc_perslab;
+	obj = slab_take(kc);
+	spinlock_release(&kc->kc_lock);
+
+	KASSERT(obj != NULL);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_magazine *mag;
+	void *spill[KMEM_MAGSIZE / 2 + 1];
+	struct kmem_slab *surplus[KMEM_MAGSIZE / 2 + 1];
+	unsigned nspill = 0, nsurplus = 0;
+	unsigned i;
+	int spl;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	spl = splhigh();
+	mag = kmem_mymag(kc);
+	if (mag != NULL && mag->km_count < KMEM_MAGSIZE) {
+		mag->km_objs[mag->km_count++] = obj;
+		splx(spl);
+		return;
+	}
+	if (mag != NULL) {
+		/* Full: send half of it back along with this one */
+		for (i=0; i<KMEM_MAGSIZE / 2; i++) {
+			spill[nspill++] = mag->km_objs[--mag->km_count];
+		}
+	}
+	splx(spl);
+	spill[nspill++] = obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	for (i=0; i<nspill; i++) {
+		struct kmem_slab *ks = slab_put(kc, spill[i]);
+		if (ks != NULL) {
+			surplus[nsurplus++] = ks;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	for (i=0; i<nsurplus; i++) {
+		free_kpages((vaddr_t)surplus[i]);
+	}
+}
+
+/*
+ * Shrinker: give back the spare empty slab of each cache, up to NPAGES
+ * of them. Caches are never destroyed, so the list can be followed
+ * without kmem_caches_lock while a slab is being freed.
+ */
+static
+unsigned
+kmem_shrink(unsigned npages)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *ks;
+	unsigned n = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	for (; kc != NULL && n < npages; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		ks = kc->kc_empty;
+		if (ks != NULL) {
+			slab_unlink(&kc->kc_empty, ks);
+			kc->kc_nslabs--;
+			kc->kc_nfree -= kc->kc_perslab;
+		}
+		spinlock_release(&kc->kc_lock);
+
+		if (ks != NULL) {
+			free_kpages((vaddr_t)ks);
+			n++;
+		}
+	}
+	return n;
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned i, inmags;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		/* Without the cpus' cooperation this is only approximate */
+		inmags = 0;
+		for (i=0; i<KMEM_MAXCPUS; i++) {
+			inmags += kc->kc_mags[i].km_count;
+		}
+
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("cache %-12s size %-4lu %u slabs, %u/%u in use, "
+			"%u in magazines\n",
+			kc->kc_name, (unsigned long)kc->kc_size, kc->kc_nslabs,
+			kc->kc_nslabs * kc->kc_perslab - kc->kc_nfree - inmags,
+			kc->kc_nslabs * kc->kc_perslab, inmags);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
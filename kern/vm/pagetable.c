@@ -0,0 +1,60 @@
+#define KMTAG KMT_VM
+
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+
+/**
+	Create an empty page table (no second-level tables yet)
+*/
+struct pagetable * pt_create(void) {
+	struct pagetable *pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+
+	for (unsigned i = 0; i < PT_DIR_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+
+	return pt;
+}
+
+void pt_destroy(struct pagetable *pt) {
+	KASSERT(pt != NULL);
+
+	for (unsigned i = 0; i < PT_DIR_ENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+/**
+	Constant time lookup of the PTE mapping `vaddr`
+*/
+pte_t * pt_lookup(struct pagetable *pt, vaddr_t vaddr) {
+	pte_t *table = pt->pt_dir[PT_DIR_INDEX(vaddr)];
+	if (table == NULL) {
+		return NULL;
+	}
+	return &table[PT_TABLE_INDEX(vaddr)];
+}
+
+pte_t * pt_lookup_create(struct pagetable *pt, vaddr_t vaddr) {
+	unsigned dir = PT_DIR_INDEX(vaddr);
+
+	if (pt->pt_dir[dir] == NULL) {
+		pte_t *table = kmalloc(PT_TABLE_ENTRIES * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		for (unsigned i = 0; i < PT_TABLE_ENTRIES; i++) {
+			table[i] = 0;
+		}
+		pt->pt_dir[dir] = table;
+	}
+
+	return &pt->pt_dir[dir][PT_TABLE_INDEX(vaddr)];
+}
@@ -0,0 +1,46 @@
+/*
+ * Memory pressure callbacks. See vm.h.
+ *
+ * Shrinkers are only ever added, so once vm_shrink has read the head
+ * of the list it can walk the rest without the lock. The newest comes
+ * first; the order hardly matters, since each one only gives back what
+ * it hasn't used lately.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+
+static struct spinlock shrink_lock = SPINLOCK_INITIALIZER;
+static struct shrinker *shrinkers;
+
+void
+vm_register_shrinker(struct shrinker *sh)
+{
+	KASSERT(sh->sh_shrink != NULL);
+
+	spinlock_acquire(&shrink_lock);
+	sh->sh_next = shrinkers;
+	shrinkers = sh;
+	spinlock_release(&shrink_lock);
+}
+
+unsigned
+vm_shrink(unsigned npages)
+{
+	struct shrinker *sh;
+	unsigned n, freed = 0;
+
+	spinlock_acquire(&shrink_lock);
+	sh = shrinkers;
+	spinlock_release(&shrink_lock);
+
+	for (; sh != NULL && freed < npages; sh = sh->sh_next) {
+		n = sh->sh_shrink(npages - freed);
+		DEBUG(DB_VM, "vm_shrink: %s gave back %u pages\n",
+		      sh->sh_name, n);
+		freed += n;
+	}
+	return freed;
+}
@@ -0,0 +1,437 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+// The raw disk we swap to, or NULL if there isn't one
+static struct vnode *swap_vnode = NULL;
+
+// One bit per page-sized slot on the device
+static struct bitmap *swap_map = NULL;
+static unsigned swap_nslots = 0;
+static unsigned swap_rotor = 0;		// where to look for the next cluster
+
+// The compressed pool is made of chunks, which are strung together to
+// hold a page: chunk c is at offset c % SWAP_PERPAGE in pool page
+// c / SWAP_PERPAGE, and pool_next[c] is the one after it.
+#define SWAP_CHUNK	128
+#define SWAP_PERPAGE	(PAGE_SIZE / SWAP_CHUNK)
+#define SWAP_NOCHUNK	0xffff
+#define SWAP_MAXLEN	(PAGE_SIZE / 2)		// worth keeping in the pool
+#define SWAP_WORDS	(PAGE_SIZE / sizeof(uint32_t))
+
+static vaddr_t *pool_pages = NULL;
+static uint16_t *pool_next = NULL;
+static unsigned pool_nchunks = 0;
+static uint16_t pool_free = SWAP_NOCHUNK;	// list linked by pool_next
+static unsigned pool_nfree = 0;
+
+// Where each slot's page is. ss_len is the length of the compressed copy
+// starting at chunk ss_first, or one of these:
+#define SS_DISK	0		// on the disk
+#define SS_ZERO	0xffff		// all zeros; nothing stored
+struct swapslot {
+	uint16_t ss_first;
+	uint16_t ss_len;
+};
+static struct swapslot *swap_slots = NULL;
+
+// Protects swap_map, swap_slots and the pool's free list
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+/**
+	Find room for 1/SWAP_POOLFRAC of RAM's worth of compressed pages.
+	Without it everything goes to the disk.
+*/
+static void pool_bootstrap(unsigned rampages) {
+	unsigned npages, i;
+
+	npages = rampages / SWAP_POOLFRAC;
+	if (npages * SWAP_PERPAGE >= SWAP_NOCHUNK) {
+		npages = (SWAP_NOCHUNK - 1) / SWAP_PERPAGE;
+	}
+	if (npages == 0) {
+		return;
+	}
+
+	pool_pages = kmalloc(npages * sizeof(vaddr_t));
+	pool_next = kmalloc(npages * SWAP_PERPAGE * sizeof(uint16_t));
+	if (pool_pages == NULL || pool_next == NULL) {
+		kfree(pool_pages);
+		kfree(pool_next);
+		pool_pages = NULL;
+		pool_next = NULL;
+		return;
+	}
+	for (i = 0; i < npages; i++) {
+		pool_pages[i] = alloc_kpages(1);
+		if (pool_pages[i] == 0) {
+			break;
+		}
+	}
+
+	pool_nchunks = i * SWAP_PERPAGE;
+	for (i = pool_nchunks; i-- > 0; ) {
+		pool_next[i] = pool_free;
+		pool_free = i;
+	}
+	pool_nfree = pool_nchunks;
+}
+
+void swap_bootstrap(unsigned rampages) {
+	struct stat st;
+	unsigned i;
+	int result;
+
+	result = vfs_open(SWAP_DEVICE, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: no %s (%s), running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat of %s failed: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_slots = kmalloc(swap_nslots * sizeof(struct swapslot));
+	if (swap_map == NULL || swap_slots == NULL) {
+		panic("swap: out of memory creating swap map\n");
+	}
+	for (i = 0; i < swap_nslots; i++) {
+		swap_slots[i].ss_first = SWAP_NOCHUNK;
+		swap_slots[i].ss_len = SS_DISK;
+	}
+	pool_bootstrap(rampages);
+
+	kprintf("swap: %uk on %s, %uk compressed pool\n",
+		swap_nslots * PAGE_SIZE / 1024, SWAP_DEVICE,
+		pool_nchunks * SWAP_CHUNK / 1024);
+}
+
+bool swap_enabled(void) {
+	return swap_vnode != NULL;
+}
+
+int swap_alloc(unsigned *slot) {
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	spinlock_release(&swap_lock);
+
+	return result ? ENOSPC : 0;
+}
+
+int swap_alloc_cluster(unsigned *first, unsigned *n) {
+	int result;
+
+	KASSERT(*n >= 1 && *n <= SWAP_CLUSTER);
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc_run(swap_map, *n, swap_rotor, first);
+	if (result) {
+		// Too fragmented for a run; one page still beats none
+		*n = 1;
+		result = bitmap_alloc(swap_map, first);
+	}
+	if (!result) {
+		swap_rotor = (*first + *n) % swap_nslots;
+	}
+	spinlock_release(&swap_lock);
+
+	return result ? ENOSPC : 0;
+}
+
+bool swap_ondisk(unsigned slot) {
+	bool ret;
+
+	KASSERT(slot < swap_nslots);
+	spinlock_acquire(&swap_lock);
+	ret = swap_slots[slot].ss_len == SS_DISK;
+	spinlock_release(&swap_lock);
+	return ret;
+}
+
+void swap_free(unsigned slot) {
+	struct swapslot *ss;
+	uint16_t c, next;
+
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	ss = &swap_slots[slot];
+	for (c = ss->ss_first; c != SWAP_NOCHUNK; c = next) {
+		next = pool_next[c];
+		pool_next[c] = pool_free;
+		pool_free = c;
+		pool_nfree++;
+	}
+	ss->ss_first = SWAP_NOCHUNK;
+	ss->ss_len = SS_DISK;
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+// Reads or writes a string of chunks a word at a time. The chunks
+// belong to one slot, so nobody else changes their links meanwhile.
+struct chunkcursor {
+	uint16_t cc_chunk;
+	unsigned cc_off;
+};
+
+static uint32_t *chunk_word(struct chunkcursor *cc) {
+	uint32_t *ret;
+
+	if (cc->cc_off == SWAP_CHUNK) {
+		cc->cc_chunk = pool_next[cc->cc_chunk];
+		cc->cc_off = 0;
+	}
+	KASSERT(cc->cc_chunk < pool_nchunks);
+	ret = (uint32_t *)(pool_pages[cc->cc_chunk / SWAP_PERPAGE] +
+		(cc->cc_chunk % SWAP_PERPAGE) * SWAP_CHUNK + cc->cc_off);
+	cc->cc_off += sizeof(uint32_t);
+	return ret;
+}
+
+/**
+	Compress PAGE into the chunks at CC, or with CC NULL just work out
+	how many bytes that would take. The page goes in groups of 16
+	words: a word of 2-bit codes (zero, same as the last word that
+	wasn't, or given) and then the words given. Sparse heaps and
+	arrays that are mostly zeros or one value shrink a lot.
+*/
+static unsigned swap_compress(const uint32_t *page, struct chunkcursor *cc) {
+	uint32_t prev = 0, codes, w;
+	unsigned g, i, len = 0;
+
+	for (g = 0; g < SWAP_WORDS; g += 16) {
+		codes = 0;
+		for (i = 0; i < 16; i++) {
+			w = page[g + i];
+			if (w == 0) {
+				continue;
+			}
+			codes |= (w == prev ? 1U : 2U) << (2 * i);
+			prev = w;
+		}
+		len += sizeof(uint32_t);
+		if (cc != NULL) {
+			*chunk_word(cc) = codes;
+		}
+		for (i = 0; i < 16; i++) {
+			if ((codes >> (2 * i) & 3) == 2) {
+				len += sizeof(uint32_t);
+				if (cc != NULL) {
+					*chunk_word(cc) = page[g + i];
+				}
+			}
+		}
+	}
+	return len;
+}
+
+static void swap_decompress(uint32_t *page, struct chunkcursor *cc) {
+	uint32_t prev = 0, codes;
+	unsigned g, i;
+
+	for (g = 0; g < SWAP_WORDS; g += 16) {
+		codes = *chunk_word(cc);
+		for (i = 0; i < 16; i++) {
+			switch (codes >> (2 * i) & 3) {
+			    case 0:
+				page[g + i] = 0;
+				break;
+			    case 1:
+				page[g + i] = prev;
+				break;
+			    default:
+				prev = page[g + i] = *chunk_word(cc);
+				break;
+			}
+		}
+	}
+}
+
+/**
+	Try to put the page at `paddr` in the pool instead of on the disk.
+	Returns false if it doesn't compress well enough or won't fit.
+*/
+static bool pool_write(unsigned slot, paddr_t paddr) {
+	const uint32_t *page = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+	struct swapslot *ss = &swap_slots[slot];
+	struct chunkcursor cc;
+	unsigned len, n, i;
+	uint16_t first, last;
+
+	len = swap_compress(page, NULL);
+	if (len == SWAP_WORDS / 16 * sizeof(uint32_t)) {
+		// Nothing but code words, so all zeros; at least they were
+		// when we looked, and the page isn't mapped any more
+		for (i = 0; i < SWAP_WORDS && page[i] == 0; i++) {
+			// nothing
+		}
+		if (i == SWAP_WORDS) {
+			spinlock_acquire(&swap_lock);
+			ss->ss_len = SS_ZERO;
+			spinlock_release(&swap_lock);
+			return true;
+		}
+	}
+	if (len > SWAP_MAXLEN) {
+		return false;
+	}
+
+	n = DIVROUNDUP(len, SWAP_CHUNK);
+	spinlock_acquire(&swap_lock);
+	if (pool_nfree < n) {
+		spinlock_release(&swap_lock);
+		return false;
+	}
+	first = last = pool_free;
+	for (i = 1; i < n; i++) {
+		last = pool_next[last];
+	}
+	pool_free = pool_next[last];
+	pool_next[last] = SWAP_NOCHUNK;
+	pool_nfree -= n;
+	ss->ss_first = first;
+	ss->ss_len = len;
+	spinlock_release(&swap_lock);
+
+	cc.cc_chunk = first;
+	cc.cc_off = 0;
+	swap_compress(page, &cc);
+	return true;
+}
+
+/**
+	Move `n` pages between the frames at `paddrs` and consecutive slots
+	starting at `first`, in one request to the disk
+*/
+static int swap_io(unsigned first, const paddr_t *paddrs, unsigned n, enum uio_rw rw) {
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	unsigned i;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(n >= 1 && n <= SWAP_CLUSTER);
+	KASSERT(first + n <= swap_nslots);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = (off_t)first * PAGE_SIZE;
+	u.uio_resid = n * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	vmstats_inc(VMSTAT_SWAP_DISK_IO);
+	result = rw == UIO_READ ? VOP_READ(swap_vnode, &u) : VOP_WRITE(swap_vnode, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int swap_write_cluster(unsigned first, const paddr_t *paddrs, unsigned n) {
+	unsigned i, run;
+	int result;
+
+	KASSERT(first + n <= swap_nslots);
+
+	// Whatever the pool won't take goes out in runs of consecutive slots
+	run = 0;
+	for (i = 0; i <= n; i++) {
+		if (i < n) {
+			KASSERT(swap_slots[first + i].ss_len == SS_DISK);
+			if (pool_nchunks == 0 || !pool_write(first + i, paddrs[i])) {
+				vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+				run++;
+				continue;
+			}
+			vmstats_inc(VMSTAT_SWAP_POOL_WRITE);
+		}
+		if (run > 0) {
+			result = swap_io(first + i - run, paddrs + i - run, run, UIO_WRITE);
+			if (result) {
+				return result;
+			}
+			run = 0;
+		}
+	}
+	return 0;
+}
+
+int swap_write(unsigned slot, paddr_t paddr) {
+	return swap_write_cluster(slot, &paddr, 1);
+}
+
+int swap_read(unsigned slot, paddr_t paddr) {
+	struct chunkcursor cc;
+	uint16_t len;
+
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	len = swap_slots[slot].ss_len;
+	cc.cc_chunk = swap_slots[slot].ss_first;
+	cc.cc_off = 0;
+	spinlock_release(&swap_lock);
+
+	if (len == SS_DISK) {
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		return swap_io(slot, &paddr, 1, UIO_READ);
+	}
+
+	vmstats_inc(VMSTAT_SWAP_POOL_READ);
+	if (len == SS_ZERO) {
+		memzero_page((void *)PADDR_TO_KVADDR(paddr));
+	} else {
+		swap_decompress((uint32_t *)PADDR_TO_KVADDR(paddr), &cc);
+	}
+	return 0;
+}
+
+int swap_read_cluster(unsigned first, paddr_t *paddrs, unsigned n) {
+	unsigned i;
+
+	KASSERT(first + n <= swap_nslots);
+	for (i = 0; i < n; i++) {
+		KASSERT(swap_ondisk(first + i));
+	}
+
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	for (i = 1; i < n; i++) {
+		vmstats_inc(VMSTAT_SWAP_READAROUND);
+	}
+	return swap_io(first, paddrs, n, UIO_READ);
+}
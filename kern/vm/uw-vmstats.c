@@ -2,25 +2,22 @@
 
 /* belongs in kern/vm/uw-vmstats.c */
 
-/* NOTE !!!!!! WARNING !!!!!
- * All of the functions whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally.
+/* The counters are kept per cpu (c_vmstats in struct cpu), so counting
+ * only needs interrupts off on this cpu, never a lock. Each cpu bumps
+ * its sequence count around an update, so a reader can take a copy of
+ * a cpu's counters that isn't torn without stopping it. They are only
+ * added up when printed. The '_' versions of the functions are now the
+ * same as the others; they are kept for the existing callers.
  */
 
 #include <types.h>
 #include <lib.h>
-#include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <seqlock.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
-
-struct spinlock stats_lock = SPINLOCK_INITIALIZER;
-
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
  /*  0 */ "TLB Faults",
@@ -33,6 +30,12 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Page Faults from Swap Pool",
+ /* 11 */ "Swap Pool Writes",
+ /* 12 */ "Swapfile Read-around Pages",
+ /* 13 */ "Swapfile Disk Requests",
+ /* 14 */ "Compactions",
+ /* 15 */ "Compaction Page Moves",
 };
 
 
@@ -41,31 +44,28 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  _vmstats_inc(index);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
-   */
-  spinlock_init(&stats_lock);
-
-  spinlock_acquire(&stats_lock);
-    _vmstats_init();
-  spinlock_release(&stats_lock);
+  _vmstats_init();
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_inc(unsigned int index)
 {
+  int spl;
+
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  spl = splhigh();
+  seqcount_writebegin(&curcpu->c_vmstatseq);
+  curcpu->c_vmstats[index]++;
+  seqcount_writeend(&curcpu->c_vmstatseq);
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -73,6 +73,8 @@ void
 _vmstats_init(void)
 {
   int i = 0;
+  unsigned n;
+  struct cpu *c;
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,22 +82,66 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
+  /* Other cpus may be counting meanwhile, and only a cpu itself may
+   * write under its sequence count; so a reset is only approximate. */
+  for (n=0; n<cpu_count(); n++) {
+    c = cpu_get(n);
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      c->c_vmstats[i] = 0;
+    }
+  }
+
+}
+
+/* ---------------------------------------------------------------------- */
+/* Each cpu's counters are copied out as they stood at one moment,
+ * retrying if that cpu counted something meanwhile.
+ */
+void
+vmstats_get(unsigned int *counts)
+{
+  unsigned int snap[VMSTAT_COUNT];
+  struct cpu *c;
+  uint32_t seq;
+  unsigned n;
+  int i;
+
   for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+    counts[i] = 0;
   }
+  for (n=0; n<cpu_count(); n++) {
+    c = cpu_get(n);
+    do {
+      seq = seqcount_readbegin(&c->c_vmstatseq);
+      for (i=0; i<VMSTAT_COUNT; i++) {
+        snap[i] = c->c_vmstats[i];
+      }
+    } while (seqcount_readretry(&c->c_vmstatseq, seq));
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      counts[i] += snap[i];
+    }
+  }
+}
 
+/* ---------------------------------------------------------------------- */
+const char *
+vmstats_name(unsigned int index)
+{
+  KASSERT(index < VMSTAT_COUNT);
+  return stats_names[index];
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* The counts are added up without stopping the other cpus: each cpu's
+ * are consistent, but the cpus aren't in step with each other, so use
+ * this when there is only one thread remaining if they must be exact.
  */
 
 void
 vmstats_print(void)
 {
+  unsigned int stats_counts[VMSTAT_COUNT];
   int i = 0;
   int free_plus_replace = 0;
   int disk_plus_zeroed_plus_reload = 0;
@@ -103,6 +149,8 @@ vmstats_print(void)
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
 
+  vmstats_get(stats_counts);
+
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
     kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
@@ -112,7 +160,8 @@ vmstats_print(void)
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ] +
+    stats_counts[VMSTAT_SWAP_POOL_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
@@ -128,9 +177,9 @@ vmstats_print(void)
       tlb_faults, disk_plus_zeroed_plus_reload);
   }
 
-  kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT ELF File reads + Swapfile reads + Swap Pool reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
-    kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
+    kprintf("WARNING: ELF File reads + Swapfile reads + Swap Pool reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
 }
@@ -0,0 +1,47 @@
+/*
+ * chrt - run a program in a real-time scheduling class.
+ * Usage: chrt [-f | -r | -o] priority program [args...]
+ *        chrt
+ *
+ * Puts us in SCHED_FIFO (-f, the default), SCHED_RR (-r) or back in
+ * SCHED_OTHER (-o, priority 0) and execs PROGRAM, which keeps it. With
+ * no program, prints the current class and priority.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static const char *const names[] = { "SCHED_OTHER", "SCHED_FIFO", "SCHED_RR" };
+
+int
+main(int argc, char *argv[])
+{
+	int policy = SCHED_FIFO, prio, i = 1;
+
+	if (argc == 1) {
+		policy = sched_getscheduler(&prio);
+		if (policy < 0) {
+			err(1, "sched_getscheduler");
+		}
+		printf("%s %d\n", names[policy], prio);
+		return 0;
+	}
+	if (!strcmp(argv[1], "-f") || !strcmp(argv[1], "-r") ||
+	    !strcmp(argv[1], "-o")) {
+		policy = argv[1][1] == 'f' ? SCHED_FIFO :
+			argv[1][1] == 'r' ? SCHED_RR : SCHED_OTHER;
+		i = 2;
+	}
+	if (argc < i + 2) {
+		errx(1, "Usage: chrt [-f | -r | -o] priority program [args...]");
+	}
+	prio = atoi(argv[i]);
+	if (sched_setscheduler(policy, prio) < 0) {
+		err(1, "sched_setscheduler");
+	}
+	execv(argv[i+1], &argv[i+1]);
+	err(1, "%s", argv[i+1]);
+}
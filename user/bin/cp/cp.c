@@ -35,6 +35,9 @@
  * Usage: cp oldfile newfile
  */
 
+/* How much to ask copy_file_range for at once */
+#define COPYSIZE (1024*1024)
+
 
 /* Copy one file to another. */
 static
@@ -58,6 +61,18 @@ copy(const char *from, const char *to)
 		err(1, "%s", to);
 	}
 
+	/*
+	 * Have the kernel copy it, without the data coming through
+	 * here, for as long as it will. If it stops with an error (the
+	 * files might be ones it can't copy between), carry on from
+	 * where it got to the ordinary way; real I/O errors will turn
+	 * up again there.
+	 */
+	while ((len = copy_file_range(fromfd, NULL, tofd, NULL,
+				      COPYSIZE, 0)) > 0) {
+		/* nothing */
+	}
+
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
 	 * Zero means EOF. Less than zero means an error occurred.
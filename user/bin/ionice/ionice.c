@@ -0,0 +1,61 @@
+/*
+ * ionice - run a program in an I/O priority class.
+ * Usage: ionice [-c class] program [args...]
+ *        ionice
+ *
+ * Puts us in I/O class CLASS (rt, be or idle; the default is idle) and
+ * execs PROGRAM, which keeps it, as do the processes it starts. With
+ * no program, prints the current class.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static const char *const names[IOPRIO_NCLASSES] = { "rt", "be", "idle" };
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: ionice [-c rt|be|idle] program [args...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ioclass = IOPRIO_IDLE, i = 1;
+
+	if (argc == 1) {
+		ioclass = ioprio_get();
+		if (ioclass < 0) {
+			err(1, "ioprio_get");
+		}
+		printf("%s\n", names[ioclass]);
+		return 0;
+	}
+	if (!strcmp(argv[1], "-c")) {
+		if (argc < 3) {
+			usage();
+		}
+		for (ioclass = 0; ioclass < IOPRIO_NCLASSES; ioclass++) {
+			if (!strcmp(argv[2], names[ioclass])) {
+				break;
+			}
+		}
+		if (ioclass == IOPRIO_NCLASSES) {
+			usage();
+		}
+		i = 3;
+	}
+	if (argc < i + 1) {
+		usage();
+	}
+	if (ioprio_set(ioclass) < 0) {
+		err(1, "ioprio_set");
+	}
+	execv(argv[i], &argv[i]);
+	err(1, "%s", argv[i]);
+}
@@ -0,0 +1,41 @@
+/*
+ * nice - run a program with a different share of the CPU.
+ * Usage: nice [-n adjustment] program [args...]
+ *        nice
+ *
+ * Adds ADJUSTMENT (default 10) to our nice value and execs PROGRAM,
+ * which keeps it. Higher values get less of the CPU when other
+ * processes want it too. With no program, prints the current value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+int
+main(int argc, char *argv[])
+{
+	int adj = 10, nice, i = 1;
+
+	if (getnice(0, &nice) < 0) {
+		err(1, "getnice");
+	}
+	if (argc == 1) {
+		printf("%d\n", nice);
+		return 0;
+	}
+	if (!strcmp(argv[1], "-n")) {
+		if (argc < 4) {
+			errx(1, "Usage: nice [-n adjustment] program [args...]");
+		}
+		adj = atoi(argv[2]);
+		i = 3;
+	}
+	if (setnice(0, nice + adj) < 0) {
+		err(1, "setnice");
+	}
+	execv(argv[i], &argv[i]);
+	err(1, "%s", argv[i]);
+}
@@ -39,6 +39,7 @@
 #include <sys/wait.h>
 #include <assert.h>
 #include <unistd.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -177,20 +178,67 @@ dowaitpoll(pid_t pid)
 
 /*
  * waitpoll
- * poll all background jobs for having exited.
+ * poll all background jobs for having exited. returns how many had.
  */
 static
-void
+int
 waitpoll(void)
 {
-	int i;
+	int i, n = 0;
 	for (i=0; i < MAXBG; i++) {
 		if (bgpids[i] != 0) {
 			if (dowaitpoll(bgpids[i])) {
 				bgpids[i] = 0;
+				n++;
 			}
 		}
 	}
+	return n;
+}
+
+/*
+ * the wait: device, which poll says is readable whenever one of our
+ * children has exited and not been waited for; -1 if we don't have it.
+ */
+static int waitfd = -1;
+
+/*
+ * waitinput
+ * wait for the next key, reaping background jobs as soon as they
+ * finish. their status goes on a line of its own, and then the prompt
+ * and the POS characters typed so far in BUF are put back.
+ */
+static
+void
+waitinput(const char *buf, size_t pos)
+{
+	struct pollfd fds[2];
+	size_t i;
+
+	if (waitfd < 0) {
+		return;
+	}
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[1].fd = waitfd;
+	fds[1].events = POLLIN;
+
+	while (1) {
+		fflush(stdout);
+		if (poll(fds, 2, -1) < 0 || (fds[0].revents & POLLIN) ||
+		    !(fds[1].revents & POLLIN)) {
+			return;
+		}
+		putchar('\n');
+		if (waitpoll() == 0) {
+			/* not one of ours; don't spin on it */
+			return;
+		}
+		printf("OS/161$ ");
+		for (i = 0; i < pos; i++) {
+			putchar(buf[i]);
+		}
+	}
 }
 #endif /* WNOHANG */
 
@@ -354,14 +402,23 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
+	/*
+	 * The child only execs, so borrow our address space with vfork
+	 * rather than copying it.
+	 */
+	pid = vfork();
 	switch (pid) {
 		case -1:
 			/* error */
-			warn("fork");
+			warn("vfork");
 			return _MKWAIT_EXIT(255);
 		case 0:
 			/* child */
+#ifdef WNOHANG
+			if (waitfd >= 0) {
+				close(waitfd);
+			}
+#endif
 			execv(args[0], args);
 			warn("%s", args[0]);
 			/*
@@ -426,6 +483,9 @@ getcmd(char *buf, size_t len)
 	 */
 
 	while (!done) {
+#ifdef WNOHANG
+		waitinput(buf, pos);
+#endif
 		ch = getchar();
 		if ((ch == '\b' || ch == 127) && pos > 0) {
 			putchar('\b');
@@ -463,6 +523,10 @@ interactive(void)
 	char buf[CMDLINE_MAX];
 	int status;
 
+#ifdef WNOHANG
+	waitfd = open("wait:", O_RDONLY);
+#endif
+
 	while (1) {
 		printf("OS/161$ ");
 		getcmd(buf, sizeof(buf));
@@ -41,6 +41,38 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/* Size of a stdio buffer */
+#define BUFSIZ 1024
+
+/*
+ * Output stream. stdout is line-buffered if it's a terminal (a
+ * character device) and fully buffered otherwise; stderr is always
+ * unbuffered. The contents are private to libc.
+ */
+typedef struct __file {
+	int __f_fd;		/* file handle */
+	unsigned __f_flags;	/* __SF_* */
+	size_t __f_len;		/* bytes in __f_buf */
+	char __f_buf[BUFSIZ];
+} FILE;
+
+#define __SF_SETUP	1	/* buffering mode chosen */
+#define __SF_LINEBUF	2	/* flush at each newline */
+#define __SF_NOBUF	4	/* don't buffer at all */
+#define __SF_ERR	8	/* a write has failed */
+
+extern FILE *stdout;
+extern FILE *stderr;
+
+/*
+ * Write LEN bytes to a stream. Returns 0, or EOF on error.
+ * (for libc internal use only)
+ */
+int __stdio_write(FILE *f, const char *data, size_t len);
+
+/* Write out buffered output; with NULL, for all streams. */
+int fflush(FILE *f);
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -53,6 +85,8 @@ int __vprintf(void (*sendfunc)(void *clientdata, const char *, size_t len),
 /* Printf calls for user programs */
 int printf(const char *fmt, ...);
 int vprintf(const char *fmt, __va_list ap);
+int fprintf(FILE *f, const char *fmt, ...);
+int vfprintf(FILE *f, const char *fmt, __va_list ap);
 int snprintf(char *buf, size_t len, const char *fmt, ...);
 int vsnprintf(char *buf, size_t len, const char *fmt, __va_list ap);
 
@@ -63,8 +97,13 @@ int puts(const char *);
 /* Nonstandard C, hence the __. */
 int __puts(const char *);
 
+/* Writes a string to a stream, without a newline. Returns 0 or EOF. */
+int fputs(const char *, FILE *);
+
 /* Writes one character. Returns it. */
 int putchar(int);
+int fputc(int, FILE *);
+#define putc(c, f) fputc(c, f)
 
 /* Reads one character (0-255) or returns EOF on error. */
 int getchar(void);
@@ -0,0 +1,2 @@
+/* This file is for UNIX compat. In OS/161, everything's in <unistd.h> */
+#include <unistd.h>
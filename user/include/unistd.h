@@ -37,12 +37,23 @@
  * kernel includes. This way user-level code doesn't need to know
  * about the kern/ headers.
  */
+#include <kern/cputime.h>
+#include <kern/dirent.h>
 #include <kern/fcntl.h>
+#include <kern/iovec.h>
 #include <kern/ioctl.h>
+#include <kern/ioring.h>
+#include <kern/mman.h>
+#include <kern/ioprio.h>
+#include <kern/poll.h>
 #include <kern/reboot.h>
+#include <kern/sched.h>
 #include <kern/seek.h>
+#include <kern/socket.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* after kern/time.h, for struct timeval */
 #include <kern/unistd.h>
+#include <kern/vmstats.h>
 #include <kern/wait.h>
 
 
@@ -64,6 +75,7 @@
  *     open:     fcntl.h or sys/fcntl.h
  *     reboot:   sys/reboot.h
  *     ioctl:    sys/ioctl.h
+ *     socket:   sys/socket.h (also bind, sendto, recvfrom)
  *     remove:   stdio.h
  *     rename:   stdio.h
  *     time:     time.h
@@ -147,12 +159,53 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(int change);
+pid_t vfork(void);
 int getdirentry(int filehandle, char *buf, size_t buflen);
+int getdirentries(int filehandle, char *buf, size_t buflen);
+int fallocate(int filehandle, off_t pos, off_t len);
+int posix_fadvise(int filehandle, off_t pos, off_t len, int advice);
+int sync_file_range(int filehandle, off_t pos, off_t len, unsigned flags);
+int copy_file_range(int infd, off_t *inpos, int outfd, off_t *outpos,
+		    size_t len, unsigned flags);
 int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
+int pread(int filehandle, void *buf, size_t size, off_t pos);
+int pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+int readv(int filehandle, const struct iovec *iov, int iovcnt);
+int writev(int filehandle, const struct iovec *iov, int iovcnt);
+int threadfork(void (*func)(void));
+__DEAD void threadexit(int code);
+int threadjoin(int tid, int *code);
+int futex_wait(volatile int *addr, int val);
+int futex_wake(volatile int *addr, int n);
+int setaffinity(unsigned mask);
+int getaffinity(unsigned *mask);
+int setnice(pid_t pid, int nice);
+int getnice(pid_t pid, int *nice);
+int sched_setscheduler(int policy, int prio);
+int sched_getscheduler(int *prio);
+int ioprio_set(int ioclass);
+int ioprio_get(void);
+int cputimes(int cpu, struct cputimes *times);
+int vmstats(unsigned *counts);
+int utrace(unsigned code, unsigned arg);
+int ioring_setup(struct ioring *ring);
+int ioring_enter(unsigned tosubmit, unsigned mincomplete);
+int getrusage(int who, struct rusage *usage);
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t pos);
+int munmap(void *addr, size_t len);
+int madvise(void *addr, size_t len, int advice);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int socket(int domain, int type, int protocol);
+int bind(int sock, const struct sockaddr *addr, socklen_t addrlen);
+ssize_t sendto(int sock, const void *buf, size_t len, int flags,
+	       const struct sockaddr *to, socklen_t tolen);
+ssize_t recvfrom(int sock, void *buf, size_t len, int flags,
+		 struct sockaddr *from, socklen_t *fromlen);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
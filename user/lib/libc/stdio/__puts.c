@@ -28,6 +28,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 /*
  * Nonstandard (hence the __) version of puts that doesn't append
@@ -39,11 +40,8 @@
 int
 __puts(const char *str)
 {
-	int count=0;
-	while (*str) {
-		putchar(*str);
-		str++;
-		count++;
-	}
-	return count;
+	size_t len = strlen(str);
+
+	__stdio_write(stdout, str, len);
+	return len;
 }
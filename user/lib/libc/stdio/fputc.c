@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+/*
+ * C standard function - print a single character to a stream.
+ */
+
+int
+fputc(int ch, FILE *f)
+{
+	char c = ch;
+
+	/* Fast path: room in the buffer and no flush needed */
+	if ((f->__f_flags & (__SF_SETUP|__SF_NOBUF|__SF_LINEBUF))
+	    == __SF_SETUP && f->__f_len < BUFSIZ - 1) {
+		f->__f_buf[f->__f_len++] = c;
+		return (unsigned char)c;
+	}
+
+	if (__stdio_write(f, &c, 1)) {
+		return EOF;
+	}
+	return (unsigned char)c;
+}
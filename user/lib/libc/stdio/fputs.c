@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * C standard I/O function - print a string to a stream, without
+ * adding a newline.
+ */
+
+int
+fputs(const char *s, FILE *f)
+{
+	return __stdio_write(f, s, strlen(s));
+}
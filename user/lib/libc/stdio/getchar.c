@@ -41,6 +41,9 @@ getchar(void)
 	char ch;
 	int len;
 
+	/* Make sure any prompt is visible before we wait for input */
+	fflush(stdout);
+
 	len = read(STDIN_FILENO, &ch, 1);
 	if (len<=0) {
 		/* end of file or error */
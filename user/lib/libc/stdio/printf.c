@@ -31,7 +31,7 @@
 #include <stdarg.h>
 
 /*
- * printf - C standard I/O function.
+ * printf and fprintf - C standard I/O functions.
  */
 
 
@@ -42,12 +42,7 @@ static
 void
 __printf_send(void *mydata, const char *data, size_t len)
 {
-	unsigned i;
-	(void)mydata;  /* not needed */
-
-	for (i=0; i<len; i++) {
-		putchar(data[i]);
-	}
+	__stdio_write(mydata, data, len);
 }
 
 /* printf: hand off to vprintf */
@@ -66,5 +61,24 @@ printf(const char *fmt, ...)
 int
 vprintf(const char *fmt, va_list ap)
 {
-	return __vprintf(__printf_send, NULL, fmt, ap);
+	return __vprintf(__printf_send, stdout, fmt, ap);
+}
+
+/* fprintf: hand off to vfprintf */
+int
+fprintf(FILE *f, const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+	va_start(ap, fmt);
+	chars = vfprintf(f, fmt, ap);
+	va_end(ap);
+	return chars;
+}
+
+/* vfprintf: call __vprintf to do the work. */
+int
+vfprintf(FILE *f, const char *fmt, va_list ap)
+{
+	return __vprintf(__printf_send, f, fmt, ap);
 }
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Output buffering for stdio.
+ *
+ * Everything that prints to a stream comes through __stdio_write, so
+ * a program printing a line at a time makes one write call per line
+ * (on the console) or per BUFSIZ bytes (to a file or pipe) instead of
+ * one per character. exit() and the fork/execv/_exit wrappers call
+ * fflush(NULL) so buffered output is neither lost nor duplicated.
+ */
+
+static FILE __stdout = { STDOUT_FILENO, 0, 0, {0} };
+static FILE __stderr = { STDERR_FILENO, __SF_SETUP|__SF_NOBUF, 0, {0} };
+
+FILE *stdout = &__stdout;
+FILE *stderr = &__stderr;
+
+/*
+ * Pick the buffering mode for a stream the first time it's used.
+ */
+static
+void
+__stdio_setup(FILE *f)
+{
+	struct stat st;
+
+	if (fstat(f->__f_fd, &st) == 0 && S_ISCHR(st.st_mode)) {
+		f->__f_flags |= __SF_LINEBUF;
+	}
+	f->__f_flags |= __SF_SETUP;
+}
+
+/*
+ * Write out a buffer completely, or fail.
+ */
+static
+int
+__stdio_writeall(FILE *f, const char *data, size_t len)
+{
+	size_t done;
+	int r;
+
+	for (done = 0; done < len; done += r) {
+		r = write(f->__f_fd, data + done, len - done);
+		if (r <= 0) {
+			f->__f_flags |= __SF_ERR;
+			return EOF;
+		}
+	}
+	return 0;
+}
+
+int
+fflush(FILE *f)
+{
+	int result;
+
+	if (f == NULL) {
+		result = fflush(stdout);
+		if (fflush(stderr)) {
+			result = EOF;
+		}
+		return result;
+	}
+
+	if (f->__f_len == 0) {
+		return 0;
+	}
+	/* On error the buffered data is dropped; there's nothing better */
+	result = __stdio_writeall(f, f->__f_buf, f->__f_len);
+	f->__f_len = 0;
+	return result;
+}
+
+int
+__stdio_write(FILE *f, const char *data, size_t len)
+{
+	size_t n;
+	int flush = 0;
+
+	if ((f->__f_flags & __SF_SETUP) == 0) {
+		__stdio_setup(f);
+	}
+
+	if (f->__f_flags & __SF_NOBUF) {
+		return __stdio_writeall(f, data, len);
+	}
+
+	if (f->__f_flags & __SF_LINEBUF) {
+		for (n = len; n > 0; n--) {
+			if (data[n-1] == '\n') {
+				flush = 1;
+				break;
+			}
+		}
+	}
+
+	/* Big writes don't need to go through the buffer */
+	if (len >= BUFSIZ) {
+		if (fflush(f)) {
+			return EOF;
+		}
+		return __stdio_writeall(f, data, len);
+	}
+
+	while (len > 0) {
+		n = BUFSIZ - f->__f_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(f->__f_buf + f->__f_len, data, n);
+		f->__f_len += n;
+		data += n;
+		len -= n;
+		if (f->__f_len == BUFSIZ && fflush(f)) {
+			return EOF;
+		}
+	}
+
+	if (flush) {
+		return fflush(f);
+	}
+	return 0;
+}
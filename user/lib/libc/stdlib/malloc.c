@@ -30,10 +30,37 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * Blocks are laid out end to end in the heap, each with a header that
+ * records the offsets to its neighbors, so free can coalesce adjacent
+ * free blocks in constant time. Free blocks are also kept on
+ * segregated free lists by size, so malloc doesn't have to walk the
+ * heap: small sizes each have an exact-size list, and larger sizes
+ * are grouped by powers of two. When nothing fits, the heap is grown
+ * with sbrk by at least MCHUNK bytes at a time, and the unused part
+ * is left as a free block at the top for later requests to carve up.
+ *
+ * Once a program has more than one thread (see threadfork), there are
+ * MARENAS such heaps, called arenas, each with its own lock, its own
+ * free lists and its own region of memory: arena 0 is the sbrk heap,
+ * and the others are MARENASIZE of anonymous mmap each, mapped the
+ * first time they are wanted. A thread uses the arena its stack
+ * address picks, so threads with different stacks mostly get
+ * different arenas and don't wait for each other; if they do share
+ * one, the lock keeps it straight. Until the first threadfork nothing
+ * is locked, so single-threaded programs use arena 0 exactly as they
+ * always did.
+ *
+ * A block freed by a thread that doesn't use its arena is not handed
+ * back right away: it goes on the freeing thread's own arena's outbox,
+ * and when MBATCH have collected there they are returned to their
+ * arenas together, one lock each. A producer feeding a consumer thus
+ * takes the consumer's lock once per MBATCH frees rather than every
+ * time. Up to MBATCH-1 blocks may sit in an outbox until its arena is
+ * next used to free something.
+ *
+ * With MALLOCDEBUG defined, the whole heap is checked (and printed) on
+ * every call, and freed memory is filled with 0xdeadbeef. The magic
+ * numbers in each header are always checked when a block is freed.
  */
 
 #include <stdlib.h>
@@ -51,6 +78,21 @@
 #error "please fix me"
 #endif
 
+/*
+ * Minimum amount to grow the heap by.
+ */
+#define MCHUNK 4096
+
+/*
+ * Arenas: how many, how much memory each of the mmap ones gets, how a
+ * thread's stack address picks one (threadfork's stacks are 64K), and
+ * how many cross-thread frees collect before they are sent back.
+ */
+#define MARENAS 8
+#define MARENASIZE (4*1024*1024)
+#define MSTACKSHIFT 16
+#define MBATCH 16
+
 /*
  * malloc block header.
  *
@@ -133,12 +175,68 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Free list links. These live in the data area of a free block, which
+ * is always at least MBLOCKSIZE bytes and so has room for them. A
+ * block waiting in an outbox uses mf_next the same way.
+ */
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
+
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+#define M_HEADER(mf)	(((struct mheader *)(mf))-1)
+
+/*
+ * Size classes, by block count (data size / MBLOCKSIZE). Counts up to
+ * MSMALL get a list each; above that, class MSMALL+k holds counts in
+ * [MSMALL<<k, MSMALL<<(k+1)). Everything on an exact list fits any
+ * request for that size or smaller, and everything on a power-of-two
+ * list fits any request for a smaller class, so only the request's own
+ * power-of-two list ever needs searching.
+ */
+#define MSMALL 32
+#define MSMALLSHIFT 5
+#define MNCLASSES (MSMALL + 8*sizeof(size_t) - MSMALLSHIFT)
+
+/*
+ * An arena: one heap and its lock.
+ *
+ * ma_lock is 0 when free, 1 when held, and 2 when held and someone
+ * may be waiting for it in futex_wait.
+ *
+ * ma_base and ma_top are the bottom and top of the heap, ma_last the
+ * topmost block (NULL if the heap is empty), and ma_freelists the free
+ * lists. ma_limit is where the heap has to stop, the end of the
+ * mapping, or 0 for arena 0, which grows with sbrk. ma_nomap is set
+ * if the mapping couldn't be made. ma_base doesn't change once set
+ * and ma_top only goes up, so free can tell which arena a block is in
+ * without any locks.
+ *
+ * ma_outbox holds the ma_nout blocks of other arenas freed through
+ * this one.
+ */
+struct marena {
+	volatile unsigned ma_lock;
+	uintptr_t ma_base, ma_top, ma_limit;
+	int ma_nomap;
+	struct mheader *ma_last;
+	struct mfree *ma_freelists[MNCLASSES];
+	struct mfree *ma_outbox;
+	unsigned ma_nout;
+};
+
+/* Called by threadfork before the first thread starts. */
+void __malloc_threads(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the arenas, and whether there are threads yet.
  */
-static uintptr_t __heapbase, __heaptop;
+static struct marena __arenas[MARENAS];
+static int __malloc_threaded;
 
 /*
  * Setup function.
@@ -147,6 +245,7 @@ static
 void
 __malloc_init(void)
 {
+	struct marena *ma = &__arenas[0];
 	void *x;
 
 	/*
@@ -163,7 +262,7 @@ __malloc_init(void)
 	}
 
 	/* init should only be called once. */
-	if (__heapbase!=0 || __heaptop!=0) {
+	if (ma->ma_base!=0 || ma->ma_top!=0) {
 		errx(1, "malloc: Internal error - bad init call");
 	}
 
@@ -175,7 +274,7 @@ __malloc_init(void)
 	if (x==(void *) 0) {
 		errx(1, "malloc: Internal error - heap began at 0");
 	}
-	__heapbase = __heaptop = (uintptr_t)x;
+	ma->ma_base = ma->ma_top = (uintptr_t)x;
 
 	/*
 	 * Make sure the heap base is aligned the way we want it.
@@ -184,34 +283,58 @@ __malloc_init(void)
 	 * begins at _end.)
 	 */
 
-	if (__heapbase % MBLOCKSIZE != 0) {
-		size_t adjust = MBLOCKSIZE - (__heapbase % MBLOCKSIZE);
+	if (ma->ma_base % MBLOCKSIZE != 0) {
+		size_t adjust = MBLOCKSIZE - (ma->ma_base % MBLOCKSIZE);
 		x = sbrk(adjust);
 		if (x==(void *)-1) {
 			err(1, "malloc: sbrk failed aligning heap base");
 		}
-		if ((uintptr_t)x != __heapbase) {
+		if ((uintptr_t)x != ma->ma_base) {
 			err(1, "malloc: heap base moved during init");
 		}
 #ifdef MALLOCDEBUG
 		warnx("malloc: adjusted heap base upwards by %lu bytes",
 		      (unsigned long) adjust);
 #endif
-		__heapbase += adjust;
-		__heaptop = __heapbase;
+		ma->ma_base += adjust;
+		ma->ma_top = ma->ma_base;
 	}
 }
 
-////////////////////////////////////////////////////////////
+/*
+ * Map the memory for one of the other arenas. Returns 0 if that
+ * can't be done, and then the arena's threads use arena 0 instead.
+ * Called with the arena locked.
+ */
+static
+int
+__malloc_arenainit(struct marena *ma)
+{
+	void *x;
+
+	if (ma->ma_nomap) {
+		return 0;
+	}
+	x = mmap(NULL, MARENASIZE, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (x == MAP_FAILED) {
+		ma->ma_nomap = 1;
+		return 0;
+	}
+	ma->ma_limit = (uintptr_t)x + MARENASIZE;
+	ma->ma_top = (uintptr_t)x;
+	ma->ma_base = (uintptr_t)x;
+	return 1;
+}
 
 #ifdef MALLOCDEBUG
 
 /*
- * Debugging print function to iterate and dump the entire heap.
+ * Debugging print function to iterate and dump an entire heap.
  */
 static
 void
-__malloc_dump(void)
+__malloc_dump(struct marena *ma)
 {
 	struct mheader *mh;
 	uintptr_t i;
@@ -220,7 +343,7 @@ __malloc_dump(void)
 	warnx("heap: ************************************************");
 
 	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
+	for (i=ma->ma_base; i<ma->ma_top; i += M_NEXTOFF(mh)) {
 		mh = (struct mheader *) i;
 		if (!M_OK(mh)) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
@@ -243,7 +366,7 @@ __malloc_dump(void)
 		      (unsigned long) (i+M_NEXTOFF(mh)),
 		      mh->mh_inuse ? "INUSE" : "FREE");
 	}
-	if (i!=__heaptop) {
+	if (i!=ma->ma_top) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
 
@@ -255,27 +378,289 @@ __malloc_dump(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Get more memory (at the top of the heap) using sbrk, and
- * return a pointer to it.
+ * Atomic operations for the arena locks, using LL/SC the way the
+ * kernel's spinlocks do. Each retries until its SC goes through.
+ * __malloc_swap returns the value it replaced; __malloc_cas stores
+ * NEW only if the value was OLD, and returns whether it did.
+ */
+
+#if defined(__mips__)
+
+static
+unsigned
+__malloc_swap(volatile unsigned *p, unsigned val)
+{
+	unsigned x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set reorder;"		/* let the assembler fill delay slots */
+		"1: ll %0, 0(%3);"	/*   x = *p */
+		"move %1, %2;"		/*   y = val */
+		"sc %1, 0(%3);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   again if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (val), "r" (p) : "memory");
+	return x;
+}
+
+static
+int
+__malloc_cas(volatile unsigned *p, unsigned old, unsigned new)
+{
+	unsigned x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set reorder;"		/* let the assembler fill delay slots */
+		"1: ll %0, 0(%4);"	/*   x = *p */
+		"move %1, $0;"		/*   y = 0 (no store) */
+		"bne %0, %2, 2f;"	/*   done if x != old */
+		"move %1, %3;"		/*   y = new */
+		"sc %1, 0(%4);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   again if it failed */
+		"2:;"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (old), "r" (new), "r" (p)
+		: "memory");
+	return y != 0;
+}
+
+#else
+
+static
+unsigned
+__malloc_swap(volatile unsigned *p, unsigned val)
+{
+	return __sync_lock_test_and_set(p, val);
+}
+
+static
+int
+__malloc_cas(volatile unsigned *p, unsigned old, unsigned new)
+{
+	return __sync_bool_compare_and_swap(p, old, new);
+}
+
+#endif
+
+/*
+ * Lock an arena. The uncontended case is a single CAS; otherwise we
+ * mark the lock contended and sleep on it until it's let go. Nothing
+ * needs locking before there are threads.
+ */
+static
+void
+__malloc_lock(struct marena *ma)
+{
+	if (!__malloc_threaded) {
+		return;
+	}
+	if (__malloc_cas(&ma->ma_lock, 0, 1)) {
+		return;
+	}
+	while (__malloc_swap(&ma->ma_lock, 2) != 0) {
+		futex_wait((volatile int *)&ma->ma_lock, 2);
+	}
+}
+
+static
+void
+__malloc_unlock(struct marena *ma)
+{
+	if (!__malloc_threaded) {
+		return;
+	}
+	if (__malloc_swap(&ma->ma_lock, 0) == 2) {
+		futex_wake((volatile int *)&ma->ma_lock, 1);
+	}
+}
+
+/*
+ * The arena the current thread should use. Our stack address decides;
+ * the main thread's stack is just below 0x80000000, which comes out as
+ * arena 0, where everything it allocated before there were threads is.
+ */
+static
+struct marena *
+__malloc_thisarena(void)
+{
+	uintptr_t sp;
+
+	if (!__malloc_threaded) {
+		return &__arenas[0];
+	}
+	sp = (uintptr_t)&sp;
+	return &__arenas[((sp >> MSTACKSHIFT) + 1) % MARENAS];
+}
+
+/*
+ * The arena the block with data at X is in, or NULL if none.
+ */
+static
+struct marena *
+__malloc_findarena(void *x)
+{
+	struct marena *ma;
+	unsigned i;
+
+	for (i=0; i<MARENAS; i++) {
+		ma = &__arenas[i];
+		if (ma->ma_base != 0 && (uintptr_t)x >= ma->ma_base &&
+		    (uintptr_t)x < ma->ma_top) {
+			return ma;
+		}
+	}
+	return NULL;
+}
+
+void
+__malloc_threads(void)
+{
+	__malloc_threaded = 1;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Size class for a block of NBLOCKS data blocks.
+ */
+static
+unsigned
+__malloc_class(size_t nblocks)
+{
+	unsigned c;
+
+	if (nblocks <= MSMALL) {
+		return nblocks - 1;
+	}
+	c = MSMALL;
+	nblocks >>= MSMALLSHIFT + 1;
+	while (nblocks > 0) {
+		c++;
+		nblocks >>= 1;
+	}
+	return c;
+}
+
+/*
+ * Put a free block on its list.
+ */
+static
+void
+__malloc_listadd(struct marena *ma, struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned c = __malloc_class(M_SIZE(mh) >> MBLOCKSHIFT);
+
+	mf->mf_prev = NULL;
+	mf->mf_next = ma->ma_freelists[c];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	ma->ma_freelists[c] = mf;
+}
+
+/*
+ * Take a free block off its list.
+ */
+static
+void
+__malloc_listremove(struct marena *ma, struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned c = __malloc_class(M_SIZE(mh) >> MBLOCKSHIFT);
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		if (ma->ma_freelists[c] != mf) {
+			errx(1, "malloc: Heap corrupt; free block %p "
+			     "not on its list", mh);
+		}
+		ma->ma_freelists[c] = mf->mf_next;
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+}
+
+/*
+ * Find a free block with at least SIZE bytes of data and take it off
+ * its list, or return NULL.
+ */
+static
+struct mheader *
+__malloc_findfree(struct marena *ma, size_t size)
+{
+	struct mfree *mf;
+	struct mheader *mh;
+	unsigned c;
+
+	c = __malloc_class(size >> MBLOCKSHIFT);
+
+	/* Only a power-of-two class can hold blocks too small for us */
+	if (c >= MSMALL) {
+		for (mf = ma->ma_freelists[c]; mf != NULL; mf = mf->mf_next) {
+			mh = M_HEADER(mf);
+			if (M_SIZE(mh) >= size) {
+				__malloc_listremove(ma, mh);
+				return mh;
+			}
+		}
+		c++;
+	}
+
+	/* Otherwise the first block of any class from here up will do */
+	for (; c < MNCLASSES; c++) {
+		if (ma->ma_freelists[c] != NULL) {
+			mh = M_HEADER(ma->ma_freelists[c]);
+			__malloc_listremove(ma, mh);
+			return mh;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Get more memory (at the top of the heap) and return a pointer to
+ * it: using sbrk for arena 0, and from what's left of the mapping for
+ * the others.
  */
 static
 void *
-__malloc_sbrk(size_t size)
+__malloc_sbrk(struct marena *ma, size_t size)
 {
 	void *x;
 
+	if (ma->ma_limit != 0) {
+		if (size > ma->ma_limit - ma->ma_top) {
+			return NULL;
+		}
+		x = (void *)ma->ma_top;
+		ma->ma_top += size;
+		return x;
+	}
+
 	x = sbrk(size);
 	if (x == (void *)-1) {
 		return NULL;
 	}
 
-	if ((uintptr_t)x != __heaptop) {
+	if ((uintptr_t)x != ma->ma_top) {
 		errx(1, "malloc: Internal error - "
 		     "heap top moved itself from 0x%lx to 0x%lx",
-		     (unsigned long) __heaptop,
+		     (unsigned long) ma->ma_top,
 		     (unsigned long) (uintptr_t) x);
 	}
-	__heaptop += size;
+	ma->ma_top += size;
 	return x;
 }
 
@@ -285,11 +670,12 @@ __malloc_sbrk(size_t size)
  * MBLOCKSIZE.
  *
  * Only split if the excess space is at least twice the blocksize -
- * one blocksize to hold a header and one for data.
+ * one blocksize to hold a header and one for data. The new block goes
+ * on the free lists.
  */
 static
 void
-__malloc_split(struct mheader *mh, size_t size)
+__malloc_split(struct marena *ma, struct mheader *mh, size_t size)
 {
 	struct mheader *mhnext, *mhnew;
 	size_t oldsize;
@@ -321,114 +707,153 @@ __malloc_split(struct mheader *mh, size_t size)
 	mhnew->mh_inuse = 0;
 	mhnew->mh_magic2 = MMAGIC;
 
-	if (mhnext != (struct mheader *) __heaptop) {
+	if (mhnext != (struct mheader *) ma->ma_top) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		ma->ma_last = mhnew;
+	}
+
+	/* The block after mh wasn't free (or it would have been merged) */
+	__malloc_listadd(ma, mhnew);
 }
 
 /*
- * malloc itself.
+ * Grow the heap so there's a free block with at least SIZE bytes of
+ * data at the top, and return it (off the free lists). Reuses a free
+ * block already at the top, and asks for at least MCHUNK.
  */
-void *
-malloc(size_t size)
+static
+struct mheader *
+__malloc_grow(struct marena *ma, size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	size_t have, need;
 
-	if (__heapbase==0) {
-		__malloc_init();
+	mh = ma->ma_last;
+	if (mh != NULL && !mh->mh_inuse) {
+		have = M_SIZE(mh);
+		need = size - have;
 	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
+	else {
+		mh = NULL;
+		have = 0;
+		need = size + MBLOCKSIZE;
+	}
+	if (need < MCHUNK) {
+		need = MCHUNK;
 	}
 
+	if (mh != NULL) {
+		if (__malloc_sbrk(ma, need) == NULL) {
+			return NULL;
+		}
+		__malloc_listremove(ma, mh);
+		mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + have + need);
+		return mh;
+	}
+
+	mh = __malloc_sbrk(ma, need);
+	if (mh == NULL) {
+		return NULL;
+	}
+	mh->mh_prevblock = ma->ma_last == NULL ? 0 : ma->ma_last->mh_nextblock;
+	mh->mh_magic1 = MMAGIC;
+	mh->mh_magic2 = MMAGIC;
+	mh->mh_pad = 0;
+	mh->mh_inuse = 0;
+	mh->mh_nextblock = M_MKFIELD(need);
+	ma->ma_last = mh;
+	return mh;
+}
+
+/*
+ * Allocate SIZE bytes (already rounded) from an arena, which must be
+ * locked. Returns NULL if the arena can't grow enough.
+ */
+static
+void *
+__malloc_alloc(struct marena *ma, size_t size)
+{
+	struct mheader *mh;
+
 #ifdef MALLOCDEBUG
 	warnx("malloc: about to allocate %lu (0x%lx) bytes",
 	      (unsigned long) size, (unsigned long) size);
-	__malloc_dump();
+	__malloc_dump(ma);
 #endif
 
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i,
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
+	mh = __malloc_findfree(ma, size);
+	if (mh == NULL) {
+		mh = __malloc_grow(ma, size);
+		if (mh == NULL) {
+			return NULL;
 		}
+	}
+	if (!M_OK(mh) || mh->mh_inuse) {
+		errx(1, "malloc: Heap corrupt; bad free block at %p", mh);
+	}
 
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
+	/* Give back what we don't need, then allocate. */
+	__malloc_split(ma, mh, size);
+	mh->mh_inuse = 1;
 
 #ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
+	warnx("malloc: allocating at %p", M_DATA(mh));
+	__malloc_dump(ma);
 #endif
-		return M_DATA(mh);
+	return M_DATA(mh);
+}
+
+/*
+ * malloc itself.
+ */
+void *
+malloc(size_t size)
+{
+	struct marena *ma, *ma0 = &__arenas[0];
+	void *x;
+
+	if (ma0->ma_base==0) {
+		__malloc_init();
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+	if (ma0->ma_base==0 || ma0->ma_top==0 || ma0->ma_base > ma0->ma_top) {
+		warnx("malloc: Internal error - local data corrupt");
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) ma0->ma_base, (unsigned long) ma0->ma_top);
 	}
 
 	/*
-	 * Didn't find anything. Expand the heap.
+	 * Round size up to an integral number of blocks, and at least
+	 * one (a free block has to hold its list links).
 	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
-	if (mh == NULL) {
-		return NULL;
+	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
 	}
 
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
-	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	ma = __malloc_thisarena();
+	__malloc_lock(ma);
+	if (ma->ma_base == 0 && !__malloc_arenainit(ma)) {
+		x = NULL;
+	}
+	else {
+		x = __malloc_alloc(ma, size);
+	}
+	__malloc_unlock(ma);
 
-#ifdef MALLOCDEBUG
-	warnx("malloc: allocating at %p", M_DATA(mh));
-	__malloc_dump();
-#endif
-	return M_DATA(mh);
+	/* Our own arena is full (or missing): fall back on the sbrk heap */
+	if (x == NULL && ma != ma0) {
+		__malloc_lock(ma0);
+		x = __malloc_alloc(ma0, size);
+		__malloc_unlock(ma0);
+	}
+	return x;
 }
 
 ////////////////////////////////////////////////////////////
 
+#ifdef MALLOCDEBUG
 /*
  * Clear a range of memory with 0xdeadbeef.
  * ptr must be suitably aligned.
@@ -443,13 +868,15 @@ __malloc_deadbeef(void *ptr, size_t size)
 		x[i] = 0xdeadbeef;
 	}
 }
+#endif
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Merge two adjacent blocks (mh below mhnext). Both must be free and
+ * off the free lists.
  */
 static
 void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct marena *ma, struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
@@ -457,53 +884,33 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
 
 	mhnextnext = M_NEXT(mhnext);
 
 	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
 				     MBLOCKSIZE + M_SIZE(mhnext));
 
-	if (mhnextnext != (struct mheader *)__heaptop) {
+	if (mhnextnext != (struct mheader *)ma->ma_top) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		ma->ma_last = mh;
+	}
 
+#ifdef MALLOCDEBUG
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+#endif
 }
 
 /*
- * The actual free() implementation.
+ * Check that X is a block that can be freed, and return its header.
  */
-void
-free(void *x)
+static
+struct mheader *
+__malloc_checkfree(void *x)
 {
-	struct mheader *mh, *mhnext, *mhprev;
-
-	if (x==NULL) {
-		/* safest practice */
-		return;
-	}
-
-	/* Consistency check. */
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
-		warnx("free: Internal error - local data corrupt");
-		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx",
-		     (unsigned long) __heapbase, (unsigned long) __heaptop);
-	}
-
-	/* Don't allow freeing pointers that aren't on the heap. */
-	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
-		errx(1, "free: Invalid pointer %p freed (out of range)", x);
-	}
-
-#ifdef MALLOCDEBUG
-	warnx("free: about to free %p", x);
-	__malloc_dump();
-#endif
+	struct mheader *mh;
 
 	mh = ((struct mheader *)x)-1;
 	if (!M_OK(mh)) {
@@ -513,27 +920,145 @@ free(void *x)
 	if (!mh->mh_inuse) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
+	return mh;
+}
+
+/*
+ * Free the block MH into its arena, which must be locked.
+ */
+static
+void
+__malloc_release(struct marena *ma, struct mheader *mh)
+{
+	struct mheader *mhnext, *mhprev;
+
+#ifdef MALLOCDEBUG
+	warnx("free: about to free %p", M_DATA(mh));
+	__malloc_dump(ma);
+#endif
 
 	/* mark it free */
 	mh->mh_inuse = 0;
 
+#ifdef MALLOCDEBUG
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
-	/* Try merging with the block above (but not if we're at the top) */
+	/* Merge with the block above (but not if we're at the top) */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mhnext != (struct mheader *)ma->ma_top && !mhnext->mh_inuse) {
+		__malloc_listremove(ma, mhnext);
+		__malloc_merge(ma, mh, mhnext);
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
+	/* Merge with the block below (but not if we're at the bottom) */
+	if (mh != (struct mheader *)ma->ma_base) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_listremove(ma, mhprev);
+			__malloc_merge(ma, mhprev, mh);
+			mh = mhprev;
+		}
 	}
 
+	__malloc_listadd(ma, mh);
+
 #ifdef MALLOCDEBUG
-	warnx("free: freed %p", x);
-	__malloc_dump();
+	warnx("free: freed %p", M_DATA(mh));
+	__malloc_dump(ma);
 #endif
 }
+
+/*
+ * Send a list of blocks taken from an outbox back to their arenas,
+ * locking each arena once for all of its blocks.
+ */
+static
+void
+__malloc_flush(struct mfree *list)
+{
+	struct marena *ma;
+	struct mfree *mf, **mfp;
+
+	while (list != NULL) {
+		ma = __malloc_findarena(list);
+		__malloc_lock(ma);
+		mfp = &list;
+		while ((mf = *mfp) != NULL) {
+			if (__malloc_findarena(mf) == ma) {
+				*mfp = mf->mf_next;
+				__malloc_release(ma, M_HEADER(mf));
+			}
+			else {
+				mfp = &mf->mf_next;
+			}
+		}
+		__malloc_unlock(ma);
+	}
+}
+
+/*
+ * The actual free() implementation.
+ */
+void
+free(void *x)
+{
+	struct marena *ma, *mine;
+	struct mheader *mh;
+	struct mfree *mf, *out;
+
+	if (x==NULL) {
+		/* safest practice */
+		return;
+	}
+
+	/* Consistency check. */
+	ma = &__arenas[0];
+	if (ma->ma_base==0 || ma->ma_top==0 || ma->ma_base > ma->ma_top) {
+		warnx("free: Internal error - local data corrupt");
+		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx",
+		     (unsigned long) ma->ma_base, (unsigned long) ma->ma_top);
+	}
+
+	/* Don't allow freeing pointers that aren't on a heap. */
+	ma = __malloc_findarena(x);
+	if (ma == NULL) {
+		errx(1, "free: Invalid pointer %p freed (out of range)", x);
+	}
+
+	mh = __malloc_checkfree(x);
+
+	mine = __malloc_thisarena();
+	if (ma == mine) {
+		__malloc_lock(ma);
+		__malloc_release(ma, mh);
+		__malloc_unlock(ma);
+		return;
+	}
+
+	/*
+	 * Someone else's block: queue it, and once there's a batch,
+	 * send them all back. The flush is done with our own arena
+	 * unlocked, so we never hold two arena locks at once.
+	 */
+	__malloc_lock(mine);
+	for (mf = mine->ma_outbox; mf != NULL; mf = mf->mf_next) {
+		if (mf == M_FREE(mh)) {
+			errx(1, "free: Invalid pointer %p freed "
+			     "(already free)", x);
+		}
+	}
+	mf = M_FREE(mh);
+	mf->mf_next = mine->ma_outbox;
+	mine->ma_outbox = mf;
+	out = NULL;
+	if (++mine->ma_nout >= MBATCH) {
+		out = mine->ma_outbox;
+		mine->ma_outbox = NULL;
+		mine->ma_nout = 0;
+	}
+	__malloc_unlock(mine);
+
+	__malloc_flush(out);
+}
@@ -19,8 +19,16 @@ awk '
 	# print the name of the call and the number.
 	print $2, $3;
     }
-' | awk '{
+' | awk '
+    # These are wrapped by C code in libc (see unix/fork.c and
+    # unix/threadfork.c).
+    $1 == "fork" || $1 == "execv" || $1 == "_exit" || $1 ~ /^thread/ {
+	printf "SYSCALL_WRAPPED(%s, %s)\n", $1, $2;
+	next;
+    }
+    {
 	# output something simple that will work in syscalls.S.
 	printf "SYSCALL(%s, %s)\n", $1, $2;
-}'
+    }
+'
 
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * fork, execv and _exit: flush stdio first, so output buffered before
+ * the call is written once instead of twice (fork) or not at all
+ * (execv, and _exit, which children such as the testbin crash and
+ * f_test ones end with). The system calls themselves are __fork,
+ * __execv and ___exit in syscalls.S.
+ *
+ * vfork isn't wrapped; the child shares our memory, buffers included,
+ * so the flush in its execv covers both processes. (A C wrapper around
+ * vfork wouldn't be safe anyway, as the child would return through a
+ * stack frame the parent still needs.)
+ */
+
+pid_t __fork(void);
+int __execv(const char *prog, char *const *args);
+__DEAD void ___exit(int code);
+
+pid_t
+fork(void)
+{
+	fflush(NULL);
+	return __fork();
+}
+
+int
+execv(const char *prog, char *const *args)
+{
+	fflush(NULL);
+	return __execv(prog, args);
+}
+
+void
+_exit(int code)
+{
+	fflush(NULL);
+	___exit(code);
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * User threads. The kernel runs the new thread in our address space;
+ * we supply its stack, taken from the heap, and free the stack when the
+ * thread is joined.
+ *
+ * malloc and free may be called from any thread (the first threadfork
+ * tells malloc to start locking), but nothing else in libc is
+ * thread-safe, this included: threads that share stdio need to arrange
+ * their own locking, and threadfork and threadjoin should be called
+ * from one thread only.
+ */
+
+#define THREAD_STACK (64*1024)
+
+/* Stacks of threads that haven't been joined yet */
+struct __threadstack {
+	int ts_tid;
+	void *ts_stack;
+	struct __threadstack *ts_next;
+};
+
+static struct __threadstack *__threadstacks;
+
+int __threadfork(void (*start)(void (*)(void)), void (*func)(void),
+		 void *stack);
+__DEAD void __threadexit(int code);
+int __threadjoin(int tid, int *code);
+void __malloc_threads(void);
+
+/*
+ * Where new threads start: run the function, then exit with 0.
+ */
+static
+void
+__threadstart(void (*func)(void))
+{
+	func();
+	threadexit(0);
+}
+
+int
+threadfork(void (*func)(void))
+{
+	struct __threadstack *ts;
+	int tid;
+
+	/* From here on there may be someone else in malloc */
+	__malloc_threads();
+
+	ts = malloc(sizeof(*ts));
+	if (ts == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ts->ts_stack = malloc(THREAD_STACK);
+	if (ts->ts_stack == NULL) {
+		free(ts);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Leave the 16 bytes of argument space the MIPS ABI promises */
+	tid = __threadfork(__threadstart, func,
+			   (char *)ts->ts_stack + THREAD_STACK - 16);
+	if (tid < 0) {
+		free(ts->ts_stack);
+		free(ts);
+		return -1;
+	}
+
+	ts->ts_tid = tid;
+	ts->ts_next = __threadstacks;
+	__threadstacks = ts;
+	return tid;
+}
+
+void
+threadexit(int code)
+{
+	/* We might be the last thread, so this might be exit */
+	fflush(NULL);
+	__threadexit(code);
+}
+
+int
+threadjoin(int tid, int *code)
+{
+	struct __threadstack **tsp, *ts;
+
+	if (__threadjoin(tid, code) < 0) {
+		return -1;
+	}
+
+	for (tsp = &__threadstacks; *tsp != NULL; tsp = &(*tsp)->ts_next) {
+		if ((*tsp)->ts_tid == tid) {
+			ts = *tsp;
+			*tsp = ts->ts_next;
+			free(ts->ts_stack);
+			free(ts);
+			break;
+		}
+	}
+	return 0;
+}
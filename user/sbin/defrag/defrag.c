@@ -0,0 +1,120 @@
+/*
+ * defrag.c
+ *
+ * 	Defragment files on a mounted SFS volume.
+ *
+ *	usage: defrag [-v] file-or-directory ...
+ *
+ * Each file named is asked, with the SFS_IOC_DEFRAG ioctl, to move its
+ * blocks into one run on disk; directories are gone through
+ * recursively and each file in them done the same way. The volume
+ * stays in use while this runs; a file being defragmented is only
+ * locked while its own blocks move. With -v each file that was moved
+ * is printed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static int vopt;
+static unsigned long long totalmoved;
+static unsigned nfiles, nerrors;
+
+static void dopath(const char *path);
+
+static
+void
+dodir(int fd, const char *path)
+{
+	int buf[256];		/* word-aligned for the struct dirents */
+	struct dirent *d;
+	char newpath[1024];
+	int len, pos;
+
+	while ((len = getdirentries(fd, (char *)buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos += d->d_reclen) {
+			d = (struct dirent *)((char *)buf + pos);
+			if (!strcmp(d->d_name, ".") ||
+			    !strcmp(d->d_name, "..")) {
+				continue;
+			}
+			snprintf(newpath, sizeof(newpath), "%s/%s", path,
+				 d->d_name);
+			dopath(newpath);
+		}
+	}
+	if (len<0) {
+		warn("%s: getdirentries", path);
+		nerrors++;
+	}
+}
+
+static
+void
+dofile(int fd, const char *path)
+{
+	uint32_t moved;
+
+	if (ioctl(fd, SFS_IOC_DEFRAG, &moved) < 0) {
+		warn("%s", path);
+		nerrors++;
+		return;
+	}
+	nfiles++;
+	totalmoved += moved;
+	if (vopt && moved > 0) {
+		printf("%s: %u blocks\n", path, moved);
+	}
+}
+
+static
+void
+dopath(const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd<0) {
+		warn("%s", path);
+		nerrors++;
+		return;
+	}
+	if (fstat(fd, &st)<0) {
+		warn("%s: fstat", path);
+		nerrors++;
+	}
+	else if (S_ISDIR(st.st_mode)) {
+		dodir(fd, path);
+	}
+	else if (S_ISREG(st.st_mode)) {
+		dofile(fd, path);
+	}
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i = 1;
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) {
+		vopt = 1;
+		i++;
+	}
+	if (i >= argc) {
+		errx(1, "Usage: defrag [-v] file-or-directory ...");
+	}
+	for (; i<argc; i++) {
+		dopath(argv[i]);
+	}
+
+	printf("defrag: %u files, %llu blocks moved\n", nfiles, totalmoved);
+	return nerrors > 0 ? 1 : 0;
+}
@@ -68,6 +68,10 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname,
 	       SWAPL(sp.sp_nblocks));
+	if (SWAPL(sp.sp_journal) != 0) {
+		printf("Journal: blocks %u-%u\n", SWAPL(sp.sp_journal),
+		       SWAPL(sp.sp_journal) + SWAPL(sp.sp_journalsize) - 1);
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -104,12 +104,17 @@ diskblocks(void)
 	return nblocks;
 }
 
+/*
+ * Move N blocks starting at BLOCK between DATA and the disk in one
+ * request.
+ */
+static
 void
-diskwrite(const void *data, uint32_t block)
+diskio(int dowrite, void *data, uint32_t block, uint32_t n)
 {
-	const char *cdata = data;
-	uint32_t tot=0;
-	int len;
+	char *cdata = data;
+	size_t tot=0, size = (size_t)n * BLOCKSIZE;
+	ssize_t len;
 
 	assert(fd>=0);
 
@@ -118,64 +123,135 @@ diskwrite(const void *data, uint32_t block)
 	block++;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, (off_t)block*BLOCKSIZE, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < size) {
+		if (dowrite) {
+			len = write(fd, cdata + tot, size - tot);
+		}
+		else {
+			len = read(fd, cdata + tot, size - tot);
+		}
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
 			}
-			err(1, "write");
+			err(1, dowrite ? "write" : "read");
 		}
 		if (len==0) {
-			err(1, "write returned 0?");
+			if (dowrite) {
+				err(1, "write returned 0?");
+			}
+			err(1, "unexpected EOF in mid-sector");
 		}
 		tot += len;
 	}
 }
 
+/*
+ * Reads go through a small cache of chunks of CHUNKBLOCKS blocks, each
+ * filled by one request, so walking blocks that are near each other on
+ * disk (the freemap, a file's blocks, inodes made around the same
+ * time) doesn't cost a request, and likely a seek, per block. Writes
+ * go straight to the disk and update any cached copy.
+ */
+#define CHUNKBLOCKS 32
+#define NCHUNKS     32
+
+static struct chunk {
+	uint32_t c_first;		/* first block */
+	uint32_t c_n;			/* blocks in it; 0 if unused */
+	unsigned c_lastuse;		/* for replacing the oldest */
+	char c_data[CHUNKBLOCKS * BLOCKSIZE];
+} chunks[NCHUNKS];
+static unsigned chunkclock;
+
+static
+struct chunk *
+findchunk(uint32_t block)
+{
+	unsigned i;
+
+	for (i=0; i<NCHUNKS; i++) {
+		if (chunks[i].c_n > 0 && block >= chunks[i].c_first &&
+		    block < chunks[i].c_first + chunks[i].c_n) {
+			return &chunks[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write N consecutive blocks from DATA in one request.
+ */
 void
-diskread(void *data, uint32_t block)
+diskwriten(const void *data, uint32_t block, uint32_t n)
 {
-	char *cdata = data;
-	uint32_t tot=0;
-	int len;
+	const char *cdata = data;
+	struct chunk *c;
+	uint32_t i;
 
-	assert(fd>=0);
+	diskio(1, (void *)data, block, n);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
+	for (i=0; i<n; i++) {
+		c = findchunk(block + i);
+		if (c != NULL) {
+			memcpy(c->c_data + (block + i - c->c_first) * BLOCKSIZE,
+			       cdata + i * BLOCKSIZE, BLOCKSIZE);
+		}
+	}
+}
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
+void
+diskwrite(const void *data, uint32_t block)
+{
+	diskwriten(data, block, 1);
+}
+
+void
+diskread(void *data, uint32_t block)
+{
+	struct chunk *c;
+	unsigned i;
+
+	if (block >= nblocks) {
+		/* Not ours to cache; let the read fail as it will */
+		diskio(0, data, block, 1);
+		return;
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
-			if (errno==EINTR || errno==EAGAIN) {
-				continue;
+	c = findchunk(block);
+	if (c == NULL) {
+		c = &chunks[0];
+		for (i=1; i<NCHUNKS; i++) {
+			if (chunks[i].c_lastuse < c->c_lastuse) {
+				c = &chunks[i];
 			}
-			err(1, "read");
 		}
-		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+		c->c_first = block - block % CHUNKBLOCKS;
+		c->c_n = CHUNKBLOCKS;
+		if (c->c_first + c->c_n > nblocks) {
+			c->c_n = nblocks - c->c_first;
 		}
-		tot += len;
+		diskio(0, c->c_data, c->c_first, c->c_n);
 	}
+	c->c_lastuse = ++chunkclock;
+	memcpy(data, c->c_data + (block - c->c_first) * BLOCKSIZE, BLOCKSIZE);
 }
 
 void
 closedisk(void)
 {
+	unsigned i;
+
 	assert(fd>=0);
 	if (close(fd)) {
 		err(1, "close");
 	}
 	fd = -1;
+	for (i=0; i<NCHUNKS; i++) {
+		chunks[i].c_n = 0;
+	}
 }
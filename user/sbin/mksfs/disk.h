@@ -33,6 +33,7 @@ uint32_t diskblocksize(void);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
+void diskwriten(const void *data, uint32_t block, uint32_t n);
 void diskread(void *data, uint32_t block);
 
 void closedisk(void);
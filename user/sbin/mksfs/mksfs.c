@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -55,7 +56,27 @@
 
 #include "disk.h"
 
-#define MAXBITBLOCKS 32
+/* Disks smaller than this get no journal, so it's at most a quarter */
+#define JOURNAL_MINDISK (4 * SFS_JOURNAL_SIZE)
+
+/* Most blocks to send to the disk in one request */
+#define WRITEBLOCKS 128
+
+/*
+ * All the metadata (the superblock, the root directory, the freemap,
+ * and the journal header) sits at the front of the volume, so it's
+ * built here in memory and written in a few large requests.
+ */
+static char *image;
+static uint32_t imageblocks;
+
+static
+void *
+imageblock(uint32_t block)
+{
+	assert(block < imageblocks);
+	return image + block*SFS_BLOCKSIZE;
+}
 
 static
 void
@@ -68,44 +89,55 @@ check(void)
 
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+makesuper(const char *volname, uint32_t nblocks, uint32_t journal)
 {
-	struct sfs_super sp;
-
-	bzero((void *)&sp, sizeof(sp));
+	struct sfs_super *sp = imageblock(SFS_SB_LOCATION);
 
 	if (strlen(volname) >= SFS_VOLNAME_SIZE) {
 		errx(1, "Volume name %s too long", volname);
 	}
 
-	sp.sp_magic = SWAPL(SFS_MAGIC);
-	sp.sp_nblocks = SWAPL(nblocks);
-	strcpy(sp.sp_volname, volname);
-
-	diskwrite(&sp, SFS_SB_LOCATION);
+	sp->sp_magic = SWAPL(SFS_MAGIC);
+	sp->sp_nblocks = SWAPL(nblocks);
+	strcpy(sp->sp_volname, volname);
+	if (journal != 0) {
+		sp->sp_journal = SWAPL(journal);
+		sp->sp_journalsize = SWAPL(SFS_JOURNAL_SIZE);
+	}
 }
 
 static
 void
-writerootdir(void)
+makerootdir(void)
 {
-	struct sfs_inode sfi;
+	struct sfs_inode *sfi = imageblock(SFS_ROOT_LOCATION);
 
-	bzero((void *)&sfi, sizeof(sfi));
+	sfi->sfi_size = SWAPL(0);
+	sfi->sfi_type = SWAPS(SFS_TYPE_DIR);
+	sfi->sfi_linkcount = SWAPS(1);
+}
 
-	sfi.sfi_size = SWAPL(0);
-	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
-	sfi.sfi_linkcount = SWAPS(1);
+/*
+ * The journal needs only an empty header; the rest is written before
+ * it's read.
+ */
+static
+void
+makejournal(uint32_t journal)
+{
+	struct sfs_jheader *jh = imageblock(journal);
 
-	diskwrite(&sfi, SFS_ROOT_LOCATION);
+	jh->jh_magic = SWAPL(SFS_JOURNAL_MAGIC);
+	jh->jh_seq = SWAPL(0);
+	jh->jh_nblocks = SWAPL(0);
+	jh->jh_sum = SWAPL(0);		/* seq 0, then 0 blocks: 0*31 + 0 */
 }
 
-static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
-
 static
 void
 doallocbit(uint32_t bit)
 {
+	unsigned char *bitbuf = imageblock(SFS_MAP_LOCATION);
 	uint32_t byte = bit/CHAR_BIT;
 	unsigned char mask = (1<<(bit % CHAR_BIT));
 
@@ -115,46 +147,71 @@ doallocbit(uint32_t bit)
 
 static
 void
-writebitmap(uint32_t fsblocks)
+makebitmap(uint32_t fsblocks, uint32_t journal)
 {
-
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
 	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
-	char *ptr;
 	uint32_t i;
 
-	if (nblocks > MAXBITBLOCKS) {
-		errx(1, "Filesystem too large "
-		     "- increase MAXBITBLOCKS and recompile");
-	}
-
 	doallocbit(SFS_SB_LOCATION);
 	doallocbit(SFS_ROOT_LOCATION);
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	if (journal != 0) {
+		for (i=0; i<SFS_JOURNAL_SIZE; i++) {
+			doallocbit(journal+i);
+		}
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
+}
 
-	for (i=0; i<nblocks; i++) {
-		ptr = bitbuf + i*SFS_BLOCKSIZE;
-		diskwrite(ptr, SFS_MAP_LOCATION+i);
+/*
+ * Write blocks FIRST through LAST-1 from DATA, or zeros if DATA is
+ * NULL, WRITEBLOCKS at a time.
+ */
+static
+void
+writeblocks(const char *data, uint32_t first, uint32_t last)
+{
+	static char zeros[WRITEBLOCKS*SFS_BLOCKSIZE];
+	uint32_t block, n;
+
+	for (block = first; block < last; block += n) {
+		n = last - block;
+		if (n > WRITEBLOCKS) {
+			n = WRITEBLOCKS;
+		}
+		if (data != NULL) {
+			diskwriten(data + (block - first)*SFS_BLOCKSIZE,
+				   block, n);
+		}
+		else {
+			diskwriten(zeros, block, n);
+		}
 	}
 }
 
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, journal;
 	char *volname, *s;
+	int zero = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	if (argc==4 && !strcmp(argv[1], "-z")) {
+		zero = 1;
+		argc--;
+		argv++;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-z] device/diskfile volume-name");
 	}
 
 	check();
@@ -185,10 +242,46 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	writesuper(volname, size);
-	writerootdir();
-	writebitmap(size);
+	/* The journal goes right after the bitmap, if there's room */
+	journal = 0;
+	if (size >= JOURNAL_MINDISK) {
+		journal = SFS_MAP_LOCATION + SFS_BITBLOCKS(size);
+	}
+
+	/* Everything up to and including the journal header */
+	imageblocks = SFS_MAP_LOCATION + SFS_BITBLOCKS(size);
+	if (journal != 0) {
+		imageblocks = journal + 1;
+	}
+	if (imageblocks > size) {
+		errx(1, "Device too small (%u blocks)", size);
+	}
+	image = malloc(imageblocks*SFS_BLOCKSIZE);
+	if (image == NULL) {
+		errx(1, "Out of memory");
+	}
+	bzero(image, imageblocks*SFS_BLOCKSIZE);
+
+	makesuper(volname, size, journal);
+	makerootdir();
+	makebitmap(size, journal);
+	if (journal != 0) {
+		makejournal(journal);
+	}
+
+	writeblocks(image, 0, imageblocks);
+
+	/*
+	 * Nothing needs the rest zeroed (the journal's blocks are written
+	 * before they're read, and the filesystem clears blocks as it
+	 * allocates them), but -z does it anyway, for a volume with no
+	 * leftovers from whatever was on the disk before.
+	 */
+	if (zero) {
+		writeblocks(NULL, imageblocks, size);
+	}
 
+	free(image);
 	closedisk();
 
 	return 0;
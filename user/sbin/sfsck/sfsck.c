@@ -83,6 +83,8 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_journal = SWAPL(sp->sp_journal);
+	sp->sp_journalsize = SWAPL(sp->sp_journalsize);
 }
 
 static
@@ -94,6 +96,7 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_size = SWAPL(sfi->sfi_size);
 	sfi->sfi_type = SWAPS(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAPS(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 
 	for (i=0; i<SFS_NDIRECT; i++) {
 		sfi->sfi_direct[i] = SWAPL(sfi->sfi_direct[i]);
@@ -172,6 +175,7 @@ domalloc(size_t len)
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -210,6 +214,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK:
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu",
@@ -545,15 +550,116 @@ check_sb(void)
 		schanged = 1;
 	}
 
+	if (sp.sp_journal != 0 &&
+	    (sp.sp_journalsize < 2 ||
+	     sp.sp_journal < SFS_MAP_LOCATION + bitblocks ||
+	     sp.sp_journal + sp.sp_journalsize > nblocks)) {
+		warnx("Journal at %lu+%lu is out of range (removed)",
+		      (unsigned long) sp.sp_journal,
+		      (unsigned long) sp.sp_journalsize);
+		setbadness(EXIT_RECOV);
+		sp.sp_journal = sp.sp_journalsize = 0;
+		schanged = 1;
+	}
+
 	if (schanged) {
 		swapsb(&sp);
 		diskwrite(&sp, SFS_SB_LOCATION);
+		swapsb(&sp);
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+	if (sp.sp_journal != 0) {
+		for (i=0; i<sp.sp_journalsize; i++) {
+			bitmap_mark(sp.sp_journal+i, B_JOURNAL, i);
+		}
+	}
+}
+
+/*
+ * Add N on-disk words to the journal checksum SUM (see kern/sfs.h).
+ */
+static
+uint32_t
+journal_sum(uint32_t sum, const uint32_t *words, uint32_t n)
+{
+	uint32_t i;
+
+	for (i=0; i<n; i++) {
+		sum = sum * 31 + SWAPL(words[i]);
+	}
+	return sum;
+}
+
+/*
+ * Replay a complete transaction left in the journal, as mount would,
+ * so the checks see the metadata as it was committed; then clear it.
+ * An incomplete one is left alone, like mount leaves it.
+ */
+static
+void
+replay_journal(void)
+{
+	struct sfs_super sp;
+	struct sfs_jheader jh;
+	uint32_t block[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t i, n, sum, cap, seq;
+	int bad = 0;
+
+	diskread(&sp, SFS_SB_LOCATION);
+	swapsb(&sp);
+	if (sp.sp_magic != SFS_MAGIC || sp.sp_journal == 0 ||
+	    sp.sp_journalsize < 2 ||
+	    sp.sp_journal + sp.sp_journalsize > sp.sp_nblocks) {
+		/* check_sb has the complaints */
+		return;
+	}
+	cap = sp.sp_journalsize - 1;
+	if (cap > SFS_JOURNAL_MAX) {
+		cap = SFS_JOURNAL_MAX;
+	}
+
+	diskread(&jh, sp.sp_journal);
+	n = SWAPL(jh.jh_nblocks);
+	if (SWAPL(jh.jh_magic) != SFS_JOURNAL_MAGIC || n == 0 || n > cap) {
+		return;
+	}
+	seq = SWAPL(jh.jh_seq);
+
+	sum = seq;
+	sum = journal_sum(sum, &jh.jh_nblocks, 1);
+	sum = journal_sum(sum, jh.jh_blocks, n);
+	for (i=0; i<n; i++) {
+		if (SWAPL(jh.jh_blocks[i]) >= sp.sp_nblocks) {
+			bad = 1;
+		}
+		diskread(block, sp.sp_journal + 1 + i);
+		sum = journal_sum(sum, block, SFS_BLOCKSIZE/sizeof(uint32_t));
+	}
+	if (sum != SWAPL(jh.jh_sum)) {
+		return;
+	}
+
+	if (bad) {
+		warnx("Journal has blocks past the end (cleared)");
+	}
+	else {
+		for (i=0; i<n; i++) {
+			diskread(block, sp.sp_journal + 1 + i);
+			diskwrite(block, SWAPL(jh.jh_blocks[i]));
+		}
+		warnx("Replayed %lu blocks from the journal",
+		      (unsigned long) n);
+	}
+	setbadness(EXIT_RECOV);
+
+	/* Clear it: no blocks, and the sum of just seq and 0 */
+	jh.jh_nblocks = SWAPL(0);
+	jh.jh_sum = SWAPL(seq * 31);
+	diskwrite(&jh, sp.sp_journal);
 }
 
 ////////////////////////////////////////////////////////////
@@ -565,19 +671,22 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     int isdir, int indirection)
 {
 	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
+	uint32_t i, ct, span;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/* Nothing under it; just skip the blocks it would map */
+		span = 1;
+		for (i=0; i<(uint32_t)indirection; i++) {
+			span *= SFS_DBPERIDB;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i],
@@ -637,12 +746,34 @@ int
 check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
 	uint32_t size, block, nblocks, badcount;
+	int changed = 0;
 
 	badcount = 0;
 
+	if ((sfi->sfi_flags & SFS_IF_INLINE) && isdir) {
+		warnx("Inode %lu: Inline directory (flag cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IF_INLINE;
+		changed = 1;
+	}
+	if ((sfi->sfi_flags & SFS_IF_INLINE) &&
+	    sfi->sfi_size > SFS_INLINE_MAX) {
+		warnx("Inode %lu: Inline size %lu too large (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = SFS_INLINE_MAX;
+		changed = 1;
+	}
+
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
 	nblocks = size/SFS_BLOCKSIZE;
 
+	/* Inline files have no blocks; any they point to are freed */
+	if (sfi->sfi_flags & SFS_IF_INLINE) {
+		nblocks = 0;
+	}
+
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
 			if (sfi->sfi_direct[block] != 0) {
@@ -700,7 +831,7 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 		return 1;
 	}
 
-	return 0;
+	return changed;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1257,6 +1388,7 @@ main(int argc, char **argv)
 
 	opendisk(argv[1]);
 
+	replay_journal();
 	check_sb();
 	check_root_dir();
 	check_bitmap();
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * nanosleep
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "test.h"
+
+static
+void
+nanosleep_badreq(void *ptr, const char *desc)
+{
+	int rv;
+
+	rv = nanosleep(ptr, NULL);
+	report_test(rv, errno, EFAULT, desc);
+}
+
+static
+void
+nanosleep_badrem(void *ptr, const char *desc)
+{
+	struct timespec ts;
+	int rv;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1;
+	rv = nanosleep(&ts, ptr);
+	report_test(rv, errno, EFAULT, desc);
+}
+
+static
+void
+nanosleep_badtime(time_t secs, long nsecs, const char *desc)
+{
+	struct timespec ts;
+	int rv;
+
+	ts.tv_sec = secs;
+	ts.tv_nsec = nsecs;
+	rv = nanosleep(&ts, NULL);
+	report_test(rv, errno, EINVAL, desc);
+}
+
+void
+test_nanosleep(void)
+{
+	nanosleep_badreq(INVAL_PTR, "nanosleep with invalid request pointer");
+	nanosleep_badreq(KERN_PTR, "nanosleep with kernel request pointer");
+
+	nanosleep_badrem(INVAL_PTR, "nanosleep with invalid remainder pointer");
+	nanosleep_badrem(KERN_PTR, "nanosleep with kernel remainder pointer");
+
+	nanosleep_badtime(-1, 0, "nanosleep with negative seconds");
+	nanosleep_badtime(0, -1, "nanosleep with negative nanoseconds");
+	nanosleep_badtime(0, 1000000000, "nanosleep with nanoseconds too big");
+}
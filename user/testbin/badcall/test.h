@@ -98,6 +98,7 @@ void test_readlink(void);
 void test_dup2(void);
 void test_pipe(void);
 void test_time(void);
+void test_nanosleep(void);
 void test_getcwd(void);
 void test_stat(void);
 void test_lstat(void);		/* in bad_stat.c */
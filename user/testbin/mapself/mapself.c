@@ -0,0 +1,149 @@
+/*
+ * mapself.c
+ *
+ *	Read and write a file through a shared mapping of itself.
+ *
+ *	usage: mapself [file]
+ *
+ * The buffer of each read and write is a MAP_SHARED mapping of the
+ * file being read or written, not touched beforehand, so the kernel
+ * has to get the file's pages while it is in the middle of I/O on that
+ * same file. Writes the file onto itself, copies one page over the
+ * next, reads it back into its own mapping, and does the same for a
+ * file small enough to be kept inline in its inode. Should finish
+ * without deadlocking or panicking and with the data intact.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE_SIZE  4096
+#define NPAGES     4
+#define SMALL      100
+
+static char buf[NPAGES * PAGE_SIZE];
+
+/*
+ * What byte POS of the file should hold, for a file of LEN bytes.
+ */
+static
+char
+expect(size_t pos, size_t len)
+{
+	if (len > PAGE_SIZE && pos >= PAGE_SIZE && pos < 2 * PAGE_SIZE) {
+		/* page 1 is a copy of page 0 */
+		pos -= PAGE_SIZE;
+	}
+	return 'a' + (pos / PAGE_SIZE) + (pos % 7);
+}
+
+static
+void
+check(const char *what, const char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != expect(i, len)) {
+			errx(1, "%s: byte %u is %d, not %d", what,
+			     (unsigned)i, p[i], expect(i, len));
+		}
+	}
+}
+
+static
+char *
+mapfile(int fd, size_t len)
+{
+	char *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+rw(int fd, char *p, size_t len, off_t pos, int wr)
+{
+	ssize_t r;
+
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	r = wr ? write(fd, p, len) : read(fd, p, len);
+	if (r < 0) {
+		err(1, wr ? "write" : "read");
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: %d of %u bytes", wr ? "write" : "read",
+		     (int)r, (unsigned)len);
+	}
+}
+
+static
+void
+test(const char *file, size_t len)
+{
+	char *p;
+	size_t i;
+	int fd;
+
+	fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	for (i = 0; i < len; i++) {
+		buf[i] = 'a' + (i / PAGE_SIZE) + (i % 7);
+	}
+	rw(fd, buf, len, 0, 1);
+
+	/* The file onto itself, from a mapping nothing has touched */
+	p = mapfile(fd, len);
+	rw(fd, p, len, 0, 1);
+	if (len > PAGE_SIZE) {
+		/* And one page of it over the next */
+		rw(fd, p, PAGE_SIZE, PAGE_SIZE, 1);
+	}
+	check("mapping after write", p, len);
+	if (munmap(p, len) < 0) {
+		err(1, "munmap");
+	}
+
+	/* Then into a fresh mapping of itself */
+	p = mapfile(fd, len);
+	rw(fd, p, len, 0, 0);
+	check("mapping after read", p, len);
+	if (munmap(p, len) < 0) {
+		err(1, "munmap");
+	}
+
+	memset(buf, 0, sizeof(buf));
+	rw(fd, buf, len, 0, 0);
+	check("file", buf, len);
+
+	close(fd);
+	remove(file);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "mapself.dat";
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+
+	test(file, NPAGES * PAGE_SIZE);
+	test(file, SMALL);
+
+	printf("mapself: passed\n");
+	return 0;
+}
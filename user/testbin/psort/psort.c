@@ -429,13 +429,20 @@ dowait(int guy, pid_t pid)
 	return 0;
 }
 
+/*
+ * Each child marks the start and end of its share of a phase in the
+ * kernel trace: code 2*phase to begin and 2*phase+1 to end, with its
+ * number as the argument.
+ */
 static
 void
 doforkall(const char *phasename, void (*func)(void))
 {
+	static unsigned phase;
 	int i, bad = 0;
 	pid_t pids[numprocs];
 
+	phase++;
 	for (i=0; i<numprocs; i++) {
 		pids[i] = dofork();
 		if (pids[i] < 0) {
@@ -444,7 +451,9 @@ doforkall(const char *phasename, void (*func)(void))
 		else if (pids[i] == 0) {
 			/* child */
 			me = i;
+			utrace(2 * phase, me);
 			func();
+			utrace(2 * phase + 1, me);
 			exit(0);
 		}
 	}
@@ -710,6 +719,8 @@ mergebins(void)
 	for (i=0; i<numprocs; i++) {
 		name = binname(i, me);
 		infds[i] = doopen(name, O_RDONLY, 0);
+		/* Each bin is read once, start to end; it's only a hint */
+		(void)posix_fadvise(infds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
 		values[i] = 0;
 		ready[i] = 0;
 	}
@@ -727,6 +738,9 @@ mergebins(void)
 				result = doread("bin", infds[i],
 						&val, sizeof(int));
 				if (result == 0) {
+					/* and never again */
+					(void)posix_fadvise(infds[i], 0, 0,
+							    POSIX_FADV_DONTNEED);
 					doclose("bin", infds[i]);
 					infds[i] = -1;
 					continue;
@@ -780,8 +794,8 @@ static
 void
 assemble(void)
 {
-	off_t mypos;
-	int i, fd;
+	off_t mypos, pos;
+	int i, fd, infd, len;
 	const char *args[3];
 
 	mypos = 0;
@@ -790,6 +804,18 @@ assemble(void)
 	}
 
 	fd = doopen(PATH_SORTED, O_WRONLY, 0);
+
+	/* Copy it in the kernel if possible, else start over with cat */
+	infd = doopen(mergedname(me), O_RDONLY, 0);
+	pos = mypos;
+	while ((len = copy_file_range(infd, NULL, fd, &pos, WORKNUM, 0)) > 0) {
+		/* nothing */
+	}
+	doclose(mergedname(me), infd);
+	if (len == 0) {
+		doclose(PATH_SORTED, fd);
+		exit(0);
+	}
 	dolseek(PATH_SORTED, fd, mypos, SEEK_SET);
 
 	if (dup2(fd, STDOUT_FILENO) < 0) {
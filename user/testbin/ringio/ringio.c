@@ -0,0 +1,175 @@
+/*
+ * ringio.c
+ *
+ *	Exercise the submission/completion rings (ioring_setup and
+ *	ioring_enter).
+ *
+ *	usage: ringio [file]
+ *
+ * Opens FILE (default ringio.dat) through the ring, writes NBLOCKS
+ * blocks to it in one batch at explicit offsets, fsyncs it, reads the
+ * blocks back in another batch and checks them, then closes it through
+ * the ring and removes it. Also checks that a bad descriptor and a bad
+ * op come back as errors in their completions.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#define ENTRIES  16
+#define NBLOCKS  12
+#define BLOCK    1024
+
+static struct ioring ring;
+static struct ioring_sqe sq[ENTRIES];
+static struct ioring_cqe cq[ENTRIES];
+static char bufs[NBLOCKS][BLOCK];
+
+/*
+ * Queue one entry.
+ */
+static
+struct ioring_sqe *
+queue(unsigned op, int fd, void *buf, unsigned len, off_t offset,
+      unsigned data)
+{
+	struct ioring_sqe *sqe;
+
+	if (ring.ir_sqtail - ring.ir_sqhead == ENTRIES) {
+		errx(1, "submission ring full");
+	}
+	sqe = &sq[ring.ir_sqtail & (ENTRIES - 1)];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->sqe_op = op;
+	sqe->sqe_fd = fd;
+	sqe->sqe_buf = buf;
+	sqe->sqe_len = len;
+	sqe->sqe_offset = offset;
+	sqe->sqe_data = data;
+	ring.ir_sqtail++;
+	return sqe;
+}
+
+/*
+ * Submit everything queued and wait for N completions; put their
+ * results in RES by cqe_data.
+ */
+static
+void
+run(unsigned n, int *res)
+{
+	struct ioring_cqe *cqe;
+	unsigned got = 0;
+	int r;
+
+	r = ioring_enter(ring.ir_sqtail - ring.ir_sqhead, n);
+	if (r < 0) {
+		err(1, "ioring_enter");
+	}
+	while (got < n) {
+		if (ring.ir_cqhead == ring.ir_cqtail) {
+			if (ioring_enter(0, 1) < 0) {
+				err(1, "ioring_enter");
+			}
+			if (ring.ir_cqhead == ring.ir_cqtail) {
+				errx(1, "only %u of %u completions came", got, n);
+			}
+			continue;
+		}
+		cqe = &cq[ring.ir_cqhead & (ENTRIES - 1)];
+		res[cqe->cqe_data] = cqe->cqe_res;
+		ring.ir_cqhead++;
+		got++;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "ringio.dat";
+	struct ioring_sqe *sqe;
+	int res[NBLOCKS + 1];
+	int fd, i, j;
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+
+	ring.ir_entries = ENTRIES;
+	ring.ir_sq = sq;
+	ring.ir_cq = cq;
+	if (ioring_setup(&ring) < 0) {
+		err(1, "ioring_setup");
+	}
+
+	sqe = queue(IORING_OP_OPEN, -1, (void *)file, 0, 0, 0);
+	sqe->sqe_flags = O_RDWR | O_CREAT | O_TRUNC;
+	sqe->sqe_mode = 0664;
+	run(1, res);
+	if (res[0] < 0) {
+		errno = -res[0];
+		err(1, "%s: open", file);
+	}
+	fd = res[0];
+
+	/* One batch of writes, out of order on purpose */
+	for (i = NBLOCKS - 1; i >= 0; i--) {
+		memset(bufs[i], 'a' + i, BLOCK);
+		queue(IORING_OP_WRITE, fd, bufs[i], BLOCK, (off_t)i * BLOCK, i);
+	}
+	run(NBLOCKS, res);
+	for (i = 0; i < NBLOCKS; i++) {
+		if (res[i] != BLOCK) {
+			errx(1, "write %d: got %d", i, res[i]);
+		}
+	}
+
+	queue(IORING_OP_FSYNC, fd, NULL, 0, 0, 0);
+	run(1, res);
+	if (res[0] != 0) {
+		errx(1, "fsync: got %d", res[0]);
+	}
+
+	/* Read them back */
+	memset(bufs, 0, sizeof(bufs));
+	for (i = 0; i < NBLOCKS; i++) {
+		queue(IORING_OP_READ, fd, bufs[i], BLOCK, (off_t)i * BLOCK, i);
+	}
+	run(NBLOCKS, res);
+	for (i = 0; i < NBLOCKS; i++) {
+		if (res[i] != BLOCK) {
+			errx(1, "read %d: got %d", i, res[i]);
+		}
+		for (j = 0; j < BLOCK; j++) {
+			if (bufs[i][j] != 'a' + i) {
+				errx(1, "block %d byte %d is wrong", i, j);
+			}
+		}
+	}
+
+	/* Errors come back in the completions */
+	queue(IORING_OP_READ, 999, bufs[0], BLOCK, IORING_OFF_CUR, 0);
+	queue(IORING_OP_NOP + 100, fd, NULL, 0, 0, 1);
+	queue(IORING_OP_NOP, -1, NULL, 0, 0, 2);
+	run(3, res);
+	if (res[0] != -EBADF || res[1] != -EINVAL || res[2] != 0) {
+		errx(1, "bad entries: got %d %d %d", res[0], res[1], res[2]);
+	}
+
+	queue(IORING_OP_CLOSE, fd, NULL, 0, 0, 0);
+	run(1, res);
+	if (res[0] != 0) {
+		errx(1, "close: got %d", res[0]);
+	}
+	if (close(fd) == 0 || errno != EBADF) {
+		errx(1, "fd %d still open after close through the ring", fd);
+	}
+	remove(file);
+
+	printf("ringio: passed\n");
+	return 0;
+}
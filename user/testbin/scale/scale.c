@@ -0,0 +1,172 @@
+/*
+ * scale.c
+ *
+ * 	Run 1, 2, ... N copies of a program at once and report how the
+ *	throughput grows.
+ *
+ *	usage: scale [-n maxcopies] prog [args ...]
+ *
+ * prog is run from /testbin unless it has a / in it. At each level all
+ * the copies are started together and the level ends when the last one
+ * exits. The default for maxcopies is the number of cpus.
+ *
+ * Each level is one line of numbers, for plotting: the number of
+ * copies, the elapsed time in ms, the throughput in copies per minute,
+ * the speedup over one copy, the parallel efficiency (speedup divided
+ * by copies) in percent, and how busy the cpus were, in percent. When
+ * efficiency falls off while the cpus stay busy, the time is going to
+ * something the copies share: a lock, most likely, which the kernel's
+ * lockstat command can then name.
+ *
+ * This generalizes farm, triplehuge, triplemat and triplesort, which
+ * always run three. For kernel tests, the menu's "scale" command does
+ * the same with threads.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define MAXCOPIES 64
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Total and idle nanoseconds over all cpus. Returns the cpu count.
+ */
+static
+int
+cpusnap(unsigned long long *total, unsigned long long *idle)
+{
+	struct cputimes ct;
+	int i, j, ncpus;
+
+	*total = *idle = 0;
+	ncpus = cputimes(0, &ct);
+	if (ncpus < 0) {
+		err(1, "cputimes");
+	}
+	for (i=0; i<ncpus; i++) {
+		if (cputimes(i, &ct) < 0) {
+			err(1, "cputimes %d", i);
+		}
+		for (j=0; j<CPUTIME_NSTATES; j++) {
+			*total += ct.ct_nsecs[j];
+		}
+		*idle += ct.ct_nsecs[CPUTIME_IDLE];
+	}
+	return ncpus;
+}
+
+/*
+ * Run NCOPIES of PATH at once, and return the elapsed time in ns.
+ */
+static
+unsigned long long
+runlevel(const char *path, char **args, int ncopies)
+{
+	pid_t pids[MAXCOPIES];
+	unsigned long long start;
+	int i, status;
+
+	start = now_ns();
+	for (i=0; i<ncopies; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			execv(path, args);
+			warn("%s", path);
+			_exit(1);
+		}
+	}
+	for (i=0; i<ncopies; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("copy %d of %s failed (status %d)", i, path,
+			      status);
+		}
+	}
+	return now_ns() - start;
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "usage: scale [-n maxcopies] prog [args ...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[64];
+	unsigned long long t1, t, tot0, idle0, tot1, idle1;
+	unsigned long long speedup, busy;
+	int maxcopies, ncopies, ncpus, i;
+
+	ncpus = cpusnap(&tot0, &idle0);
+	maxcopies = ncpus;
+
+	i = 1;
+	if (i < argc && !strcmp(argv[i], "-n")) {
+		if (i + 1 >= argc) {
+			usage();
+		}
+		maxcopies = atoi(argv[i + 1]);
+		i += 2;
+	}
+	if (i >= argc || maxcopies < 1 || maxcopies > MAXCOPIES) {
+		usage();
+	}
+
+	if (strchr(argv[i], '/') != NULL) {
+		snprintf(path, sizeof(path), "%s", argv[i]);
+	}
+	else {
+		snprintf(path, sizeof(path), "/testbin/%s", argv[i]);
+	}
+	argv[i] = path;
+
+	printf("# %s on %d cpus\n", path, ncpus);
+	printf("# copies ms copies/min speedup(x100) efficiency(%%) "
+	       "busy(%%)\n");
+	t1 = 0;
+	for (ncopies = 1; ncopies <= maxcopies; ncopies++) {
+		cpusnap(&tot0, &idle0);
+		t = runlevel(path, argv + i, ncopies);
+		cpusnap(&tot1, &idle1);
+		if (t == 0) {
+			t = 1;
+		}
+		if (ncopies == 1) {
+			t1 = t;
+		}
+
+		/* Speedup is throughput over that of one copy */
+		speedup = t1 * ncopies * 100 / t;
+		busy = tot1 > tot0 ?
+			100 - (idle1 - idle0) * 100 / (tot1 - tot0) : 0;
+		printf("%d %llu %llu %llu %llu %llu\n", ncopies,
+		       t / 1000000,
+		       (unsigned long long)ncopies * 60 * 1000000000 / t,
+		       speedup, speedup / ncopies, busy);
+	}
+	return 0;
+}
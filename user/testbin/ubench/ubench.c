@@ -0,0 +1,410 @@
+/*
+ * ubench.c
+ *
+ * 	Time kernel primitives, one number each.
+ *
+ *	usage: ubench [test ...]
+ *
+ * The tests are:
+ *     null       - a system call that does nothing much (getpid)
+ *     fork       - fork, and the child exits at once
+ *     exec       - fork, and the child execs /bin/true
+ *     ctxsw      - a byte bounced between two processes on pipes
+ *     fault      - first touch of a page of anonymous memory
+ *     create     - create and then remove empty files
+ *     filebw     - write and read back a file, at various I/O sizes
+ *     pipebw     - send data through a pipe, at various I/O sizes
+ * The default is to run all of them.
+ *
+ * Each result is one line, "name value unit", so the output can be
+ * picked apart by a script and compared from one kernel to the next.
+ * Times are averages from __time over a fixed number of repetitions;
+ * the system should otherwise be idle.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define NULL_ITERS    10000
+#define FORK_ITERS    100
+#define EXEC_ITERS    50
+#define CTXSW_ITERS   1000
+#define FAULT_PAGES   256
+#define CREATE_FILES  100
+#define BW_TOTAL      (256*1024)
+#define BW_MAXIO      65536
+
+#define PAGE_SIZE     4096
+#define TESTFILE      "ubench.tmp"
+
+static const size_t bw_sizes[] = { 512, 4096, 16384, BW_MAXIO };
+#define NSIZES (sizeof(bw_sizes) / sizeof(bw_sizes[0]))
+
+static char bwbuf[BW_MAXIO];
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000 + nsecs;
+}
+
+static
+void
+report(const char *name, unsigned long long value, const char *unit)
+{
+	printf("%s %llu %s\n", name, value, unit);
+}
+
+/* Nanoseconds per operation, from a start time and a count */
+static
+void
+report_per(const char *name, unsigned long long start, unsigned n)
+{
+	report(name, (now_ns() - start) / n, "ns");
+}
+
+/* Kilobytes per second, from a start time and a byte count */
+static
+void
+report_bw(const char *name, size_t iosize, unsigned long long start,
+	  unsigned long long bytes)
+{
+	char buf[64];
+	unsigned long long elapsed;
+
+	elapsed = now_ns() - start;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	snprintf(buf, sizeof(buf), "%s.%u", name, (unsigned)iosize);
+	report(buf, bytes * 1000000000 / 1024 / elapsed, "KB/s");
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed (status %d)", status);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+test_null(void)
+{
+	unsigned long long start;
+	unsigned i;
+
+	start = now_ns();
+	for (i=0; i<NULL_ITERS; i++) {
+		(void)getpid();
+	}
+	report_per("null", start, NULL_ITERS);
+}
+
+static
+void
+test_fork(void)
+{
+	unsigned long long start;
+	unsigned i;
+	pid_t pid;
+
+	start = now_ns();
+	for (i=0; i<FORK_ITERS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		waitchild(pid);
+	}
+	report_per("fork", start, FORK_ITERS);
+}
+
+static
+void
+test_exec(void)
+{
+	char *args[2];
+	unsigned long long start;
+	unsigned i;
+	pid_t pid;
+
+	args[0] = (char *)"/bin/true";
+	args[1] = NULL;
+
+	start = now_ns();
+	for (i=0; i<EXEC_ITERS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			execv(args[0], args);
+			warn("%s", args[0]);
+			_exit(1);
+		}
+		waitchild(pid);
+	}
+	report_per("exec", start, EXEC_ITERS);
+}
+
+/*
+ * Each round trip is two switches, so that's what the time is divided
+ * by. It includes two pipe writes and reads too.
+ */
+static
+void
+test_ctxsw(void)
+{
+	int there[2], back[2];
+	unsigned long long start;
+	unsigned i;
+	pid_t pid;
+	char ch = 0;
+
+	if (pipe(there) < 0 || pipe(back) < 0) {
+		err(1, "pipe");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(there[1]);
+		close(back[0]);
+		while (read(there[0], &ch, 1) == 1) {
+			if (write(back[1], &ch, 1) != 1) {
+				_exit(1);
+			}
+		}
+		_exit(0);
+	}
+	close(there[0]);
+	close(back[1]);
+
+	start = now_ns();
+	for (i=0; i<CTXSW_ITERS; i++) {
+		if (write(there[1], &ch, 1) != 1 || read(back[0], &ch, 1) != 1) {
+			err(1, "ctxsw: pipe");
+		}
+	}
+	report_per("ctxsw", start, 2 * CTXSW_ITERS);
+
+	close(there[1]);
+	close(back[0]);
+	waitchild(pid);
+}
+
+static
+void
+test_fault(void)
+{
+	unsigned long long start;
+	volatile char *p;
+	unsigned i;
+
+	p = mmap(NULL, FAULT_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	start = now_ns();
+	for (i=0; i<FAULT_PAGES; i++) {
+		p[i * PAGE_SIZE] = 1;
+	}
+	report_per("fault", start, FAULT_PAGES);
+	if (munmap((void *)p, FAULT_PAGES * PAGE_SIZE) < 0) {
+		err(1, "munmap");
+	}
+}
+
+static
+void
+test_create(void)
+{
+	char name[32];
+	unsigned long long start;
+	unsigned i;
+	int fd;
+
+	start = now_ns();
+	for (i=0; i<CREATE_FILES; i++) {
+		snprintf(name, sizeof(name), "ubench.%u", i);
+		fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0664);
+		if (fd < 0) {
+			err(1, "%s", name);
+		}
+		close(fd);
+	}
+	report_per("create", start, CREATE_FILES);
+
+	start = now_ns();
+	for (i=0; i<CREATE_FILES; i++) {
+		snprintf(name, sizeof(name), "ubench.%u", i);
+		if (remove(name) < 0) {
+			err(1, "remove %s", name);
+		}
+	}
+	report_per("remove", start, CREATE_FILES);
+}
+
+/*
+ * The write includes the fsync, so it measures getting the data to
+ * disk. The read comes right after, so it's probably from the cache.
+ */
+static
+void
+test_filebw(void)
+{
+	unsigned long long start;
+	size_t done, iosize;
+	unsigned i;
+	int fd;
+
+	for (i=0; i<NSIZES; i++) {
+		iosize = bw_sizes[i];
+
+		fd = open(TESTFILE, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+		if (fd < 0) {
+			err(1, "%s", TESTFILE);
+		}
+		start = now_ns();
+		for (done = 0; done < BW_TOTAL; done += iosize) {
+			if (write(fd, bwbuf, iosize) != (ssize_t)iosize) {
+				err(1, "%s: write", TESTFILE);
+			}
+		}
+		if (fsync(fd) < 0) {
+			err(1, "%s: fsync", TESTFILE);
+		}
+		report_bw("filewrite", iosize, start, BW_TOTAL);
+		close(fd);
+
+		fd = open(TESTFILE, O_RDONLY);
+		if (fd < 0) {
+			err(1, "%s", TESTFILE);
+		}
+		start = now_ns();
+		for (done = 0; done < BW_TOTAL; done += iosize) {
+			if (read(fd, bwbuf, iosize) != (ssize_t)iosize) {
+				err(1, "%s: read", TESTFILE);
+			}
+		}
+		report_bw("fileread", iosize, start, BW_TOTAL);
+		close(fd);
+	}
+	remove(TESTFILE);
+}
+
+static
+void
+test_pipebw(void)
+{
+	unsigned long long start;
+	size_t done, iosize;
+	ssize_t r;
+	unsigned i;
+	int fds[2];
+	pid_t pid;
+
+	for (i=0; i<NSIZES; i++) {
+		iosize = bw_sizes[i];
+
+		if (pipe(fds) < 0) {
+			err(1, "pipe");
+		}
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			for (done = 0; done < BW_TOTAL; done += iosize) {
+				if (write(fds[1], bwbuf, iosize) !=
+				    (ssize_t)iosize) {
+					_exit(1);
+				}
+			}
+			_exit(0);
+		}
+		close(fds[1]);
+
+		start = now_ns();
+		done = 0;
+		while ((r = read(fds[0], bwbuf, iosize)) > 0) {
+			done += r;
+		}
+		if (r < 0) {
+			err(1, "pipebw: read");
+		}
+		report_bw("pipe", iosize, start, done);
+		close(fds[0]);
+		waitchild(pid);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} tests[] = {
+	{ "null", test_null },
+	{ "fork", test_fork },
+	{ "exec", test_exec },
+	{ "ctxsw", test_ctxsw },
+	{ "fault", test_fault },
+	{ "create", test_create },
+	{ "filebw", test_filebw },
+	{ "pipebw", test_pipebw },
+};
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+int
+main(int argc, char *argv[])
+{
+	unsigned i;
+	int j;
+
+	if (argc == 1) {
+		for (i=0; i<NTESTS; i++) {
+			tests[i].func();
+		}
+		return 0;
+	}
+	for (j=1; j<argc; j++) {
+		for (i=0; i<NTESTS; i++) {
+			if (!strcmp(argv[j], tests[i].name)) {
+				break;
+			}
+		}
+		if (i == NTESTS) {
+			errx(1, "%s: no such test", argv[j]);
+		}
+		tests[i].func();
+	}
+	return 0;
+}
@@ -44,6 +44,9 @@
  * assumptions are not met by your user-level threads, you will need
  * to patch this test accordingly.
  *
+ * With OS/161's threadfork, returning from main exits the whole
+ * process, so the parent leaves with threadexit() instead.
+ *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
  */
@@ -80,7 +83,7 @@ main(int argc, char *argv[])
     }
 
     printf("Parent has left.\n");
-    return 0;
+    threadexit(0);
 }
 
 /* multiple threads will simply print out the global variable.
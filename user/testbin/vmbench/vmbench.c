@@ -0,0 +1,160 @@
+/*
+ * vmbench.c
+ *
+ * 	Run VM tests one at a time and report how long each took and
+ *	what the VM system did for it.
+ *
+ *	usage: vmbench [prog ...]
+ *
+ * Each prog is run from /testbin (unless it has a / in it) with no
+ * arguments; the default is matmult, huge, sort, parallelvm, triplemat
+ * and triplesort. For each the elapsed time comes from __time and the
+ * cpu time from getrusage, and the VM counters from vmstats() are
+ * snapshotted before and after. These are system-wide, so run this on
+ * an otherwise idle system.
+ *
+ * This is for comparing VM policy changes (TLB replacement, COW,
+ * swapping) with numbers rather than by feel.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static const char *const default_progs[] = {
+	"matmult", "huge", "sort", "parallelvm", "triplemat", "triplesort",
+	NULL
+};
+
+static
+unsigned long long
+now_us(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+unsigned long long
+tv_us(const struct timeval *tv)
+{
+	return (unsigned long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static
+int
+runprog(const char *prog)
+{
+	char path[64];
+	char *args[2];
+	int pid, status;
+
+	if (strchr(prog, '/') != NULL) {
+		snprintf(path, sizeof(path), "%s", prog);
+	}
+	else {
+		snprintf(path, sizeof(path), "/testbin/%s", prog);
+	}
+	args[0] = path;
+	args[1] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		warn("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		execv(path, args);
+		err(1, "%s", path);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		warn("waitpid");
+		return -1;
+	}
+	if (WIFSIGNALED(status)) {
+		warnx("%s: signal %d", prog, WTERMSIG(status));
+		return -1;
+	}
+	if (WEXITSTATUS(status) != 0) {
+		warnx("%s: exit %d", prog, WEXITSTATUS(status));
+		return -1;
+	}
+	return 0;
+}
+
+static
+void
+bench(const char *prog)
+{
+	unsigned before[VMSTAT_COUNT], after[VMSTAT_COUNT], d[VMSTAT_COUNT];
+	struct rusage ru0, ru1;
+	unsigned long long start, elapsed, utime, stime;
+	int i, ok;
+
+	if (vmstats(before) < 0) {
+		err(1, "vmstats");
+	}
+	if (getrusage(RUSAGE_CHILDREN, &ru0) < 0) {
+		err(1, "getrusage");
+	}
+	start = now_us();
+
+	ok = runprog(prog) == 0;
+
+	elapsed = now_us() - start;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+	vmstats(after);
+	getrusage(RUSAGE_CHILDREN, &ru1);
+	for (i=0; i<VMSTAT_COUNT; i++) {
+		d[i] = after[i] - before[i];
+	}
+	utime = tv_us(&ru1.ru_utime) - tv_us(&ru0.ru_utime);
+	stime = tv_us(&ru1.ru_stime) - tv_us(&ru0.ru_stime);
+
+	printf("%s%s: %llu.%03llu s elapsed, %llu.%03llu user, "
+	       "%llu.%03llu sys\n", prog, ok ? "" : " (FAILED)",
+	       elapsed / 1000000, elapsed / 1000 % 1000,
+	       utime / 1000000, utime / 1000 % 1000,
+	       stime / 1000000, stime / 1000 % 1000);
+	printf("    TLB faults %u (%llu/s): %u into free slots, "
+	       "%u replacing\n", d[VMSTAT_TLB_FAULT],
+	       (unsigned long long)d[VMSTAT_TLB_FAULT] * 1000000 / elapsed,
+	       d[VMSTAT_TLB_FAULT_FREE], d[VMSTAT_TLB_FAULT_REPLACE]);
+	printf("    resolved: %u reloaded, %u zero-filled, %u from disk "
+	       "(%u ELF, %u swap, %u swap pool)\n", d[VMSTAT_TLB_RELOAD],
+	       d[VMSTAT_PAGE_FAULT_ZERO], d[VMSTAT_PAGE_FAULT_DISK],
+	       d[VMSTAT_ELF_FILE_READ], d[VMSTAT_SWAP_FILE_READ],
+	       d[VMSTAT_SWAP_POOL_READ]);
+	printf("    %u TLB invalidations, %u swap writes, "
+	       "%u to the swap pool\n", d[VMSTAT_TLB_INVALIDATE],
+	       d[VMSTAT_SWAP_FILE_WRITE], d[VMSTAT_SWAP_POOL_WRITE]);
+	printf("    %u swap disk requests, %u pages read around faults\n",
+	       d[VMSTAT_SWAP_DISK_IO], d[VMSTAT_SWAP_READAROUND]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i;
+
+	if (argc > 1) {
+		for (i=1; i<argc; i++) {
+			bench(argv[i]);
+		}
+	}
+	else {
+		for (i=0; default_progs[i] != NULL; i++) {
+			bench(default_progs[i]);
+		}
+	}
+	return 0;
+}